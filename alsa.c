@@ -24,6 +24,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 #include <math.h>
 #define exp10(x) (exp((x) * log(10)))
 
@@ -72,6 +73,28 @@ static int alsa_buf_fill = 0;
 static int bytes_per_frame;
 static int bytes_per_sample;
 
+/* Sound is copied straight into the ring buffer of the device (mmap access)
+ * instead of being collected in alsa_buf and written in periods.  Then
+ * alsa_buf holds at most a part of a frame. */
+static bool use_mmap = false;
+
+/* Can the device be paused with snd_pcm_pause(), and is it paused? */
+static bool can_pause = false;
+static bool paused = false;
+
+/* Two periods of silence played before pausing, made when the device is
+ * opened. */
+static char *pause_silence = NULL;
+
+/* Descriptors to wait on for room in the device buffer. */
+static struct pollfd *poll_fds = NULL;
+static int poll_count = 0;
+
+/* Underruns (xruns) the device has recovered from, and how many of them
+ * get_delay() has already reported. */
+static unsigned int xruns = 0;
+static unsigned int xruns_reported = 0;
+
 static snd_mixer_t *mixer_handle = NULL;
 static snd_mixer_elem_t *mixer_elem1 = NULL;
 static snd_mixer_elem_t *mixer_elem2 = NULL;
@@ -152,6 +175,7 @@ static const struct {
 	{SND_PCM_FORMAT_U24, SFMT_U24},
 	{SND_PCM_FORMAT_S32, SFMT_S32},
 	{SND_PCM_FORMAT_U32, SFMT_U32},
+	{SND_PCM_FORMAT_FLOAT, SFMT_FLOAT},
 #ifdef WORDS_BIGENDIAN
 	{SND_PCM_FORMAT_S24_3BE, SFMT_S24_3},
 	{SND_PCM_FORMAT_U24_3BE, SFMT_U24_3}
@@ -606,11 +630,24 @@ static int alsa_open (struct sound_params *sound_params)
 	if (!hw_params)
 		return 0;
 
-	rc = snd_pcm_hw_params_set_access (handle, hw_params,
-	                                   SND_PCM_ACCESS_RW_INTERLEAVED);
-	if (rc < 0) {
-		error_errno ("Can't set ALSA access type", rc);
-		goto err;
+	use_mmap = false;
+	if (options_get_bool ("ALSAMmap")) {
+		rc = snd_pcm_hw_params_set_access (handle, hw_params,
+		                                   SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		if (rc < 0)
+			log_errno ("Can't use mmap access, falling back to writes",
+			           rc);
+		else
+			use_mmap = true;
+	}
+
+	if (!use_mmap) {
+		rc = snd_pcm_hw_params_set_access (handle, hw_params,
+		                                   SND_PCM_ACCESS_RW_INTERLEAVED);
+		if (rc < 0) {
+			error_errno ("Can't set ALSA access type", rc);
+			goto err;
+		}
 	}
 
 	rc = snd_pcm_hw_params_set_format (handle, hw_params, params.format);
@@ -672,6 +709,9 @@ static int alsa_open (struct sound_params *sound_params)
 	snd_pcm_hw_params_get_period_size (hw_params, &chunk_frames, 0);
 	debug ("Chunk size: %lu frames", chunk_frames);
 
+	can_pause = snd_pcm_hw_params_can_pause (hw_params);
+	paused = false;
+
 	snd_pcm_hw_params_get_buffer_size (hw_params, &buffer_frames);
 	debug ("Buffer size: %lu frames", buffer_frames);
 	debug ("Buffer time: %"PRIu64"us",
@@ -682,6 +722,11 @@ static int alsa_open (struct sound_params *sound_params)
 
 	chunk_bytes = chunk_frames * bytes_per_frame;
 
+	free (pause_silence);
+	pause_silence = xmalloc (2 * chunk_bytes);
+	snd_pcm_format_set_silence (params.format, pause_silence,
+	                            2 * chunk_bytes / bytes_per_sample);
+
 	if (chunk_frames == buffer_frames) {
 		error ("Can't use period equal to buffer size (%lu == %lu)",
 				chunk_frames, buffer_frames);
@@ -694,10 +739,24 @@ static int alsa_open (struct sound_params *sound_params)
 		goto err;
 	}
 
+	poll_count = snd_pcm_poll_descriptors_count (handle);
+	if (poll_count <= 0) {
+		error ("Can't get poll descriptors of the device");
+		goto err;
+	}
+	poll_fds = (struct pollfd *)xmalloc (poll_count * sizeof(struct pollfd));
+	rc = snd_pcm_poll_descriptors (handle, poll_fds, poll_count);
+	if (rc < 0) {
+		error_errno ("Can't get poll descriptors of the device", rc);
+		free (poll_fds);
+		poll_fds = NULL;
+		goto err;
+	}
+
 	ALSA_CHECK (samples_to_bytes, bytes_per_sample);
 	ALSA_CHECK (frames_to_bytes, bytes_per_frame);
 
-	logit ("ALSA device opened");
+	logit ("ALSA device opened%s", use_mmap ? " (mmap access)" : "");
 
 	params.channels = sound_params->channels;
 	alsa_buf_fill = 0;
@@ -709,28 +768,62 @@ err:
 	return result;
 }
 
+/* Recover from the error of a write, counting underruns. */
+static int recover (int err)
+{
+	if (err == -EPIPE) {
+		xruns += 1;
+		logit ("ALSA buffer underrun");
+	}
+
+	return snd_pcm_recover (handle, err, 0);
+}
+
+/* Wait until the device wakes us up at the end of a period or there is an
+ * error.  Return 0 or the (negative) error code. */
+static int wait_for_room ()
+{
+	while (1) {
+		int rc;
+		unsigned short revents;
+
+		rc = poll (poll_fds, poll_count, 500);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (rc == 0) {
+			logit ("Timeout waiting for the device");
+			return 0;
+		}
+
+		rc = snd_pcm_poll_descriptors_revents (handle, poll_fds,
+		                                       poll_count, &revents);
+		if (rc < 0)
+			return rc;
+		if (revents & POLLERR)
+			return snd_pcm_state (handle) == SND_PCM_STATE_XRUN
+			       ? -EPIPE : -EIO;
+		if (revents & POLLOUT)
+			return 0;
+	}
+}
+
 /* Play from alsa_buf as many chunks as possible. Move the remaining data
  * to the beginning of the buffer. Return the number of bytes written
  * or -1 on error. */
 static int play_buf_chunks ()
 {
 	int written = 0;
-	bool zero_logged = false;
 
 	while (alsa_buf_fill >= chunk_bytes) {
 		int rc;
 
 		rc = snd_pcm_writei (handle, alsa_buf + written, chunk_frames);
 
-		if (rc == 0) {
-			if (!zero_logged) {
-				debug ("Played 0 bytes");
-				zero_logged = true;
-			}
-			continue;
-		}
-
-		zero_logged = false;
+		if (rc == 0)
+			rc = -EAGAIN;
 
 		if (rc > 0) {
 			int written_bytes = rc * bytes_per_frame;
@@ -742,14 +835,18 @@ static int play_buf_chunks ()
 			continue;
 		}
 
-		rc = snd_pcm_recover (handle, rc, 0);
+		if (rc != -EAGAIN)
+			rc = recover (rc);
 
 		switch (rc) {
 		case 0:
 			break;
 		case -EAGAIN:
-			if (snd_pcm_wait (handle, 500) < 0)
-				logit ("snd_pcm_wait() failed");
+			rc = wait_for_room ();
+			if (rc < 0 && recover (rc) < 0) {
+				error_errno ("Can't play", rc);
+				return -1;
+			}
 			break;
 		default:
 			error_errno ("Can't play", rc);
@@ -763,14 +860,141 @@ static int play_buf_chunks ()
 	return written;
 }
 
+/* Copy the frames straight into the ring buffer of the device, waiting for
+ * room as needed.  Return 0 or -1 on error. */
+static int mmap_write (const char *buff, const snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t written = 0;
+
+	while (written < frames) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset, count;
+		snd_pcm_sframes_t avail, committed;
+		int rc;
+
+		avail = snd_pcm_avail_update (handle);
+		if (avail < 0) {
+			rc = recover (avail);
+			if (rc < 0) {
+				error_errno ("Can't play", rc);
+				return -1;
+			}
+			continue;
+		}
+
+		if ((snd_pcm_uframes_t) avail < MIN(chunk_frames, frames - written)) {
+
+			/* The ring is full, but nothing starts playing it. */
+			if (snd_pcm_state (handle) == SND_PCM_STATE_PREPARED) {
+				rc = snd_pcm_start (handle);
+				if (rc < 0) {
+					error_errno ("Can't start playing", rc);
+					return -1;
+				}
+			}
+
+			rc = wait_for_room ();
+			if (rc < 0 && recover (rc) < 0) {
+				error_errno ("Can't play", rc);
+				return -1;
+			}
+			continue;
+		}
+
+		count = frames - written;
+		rc = snd_pcm_mmap_begin (handle, &areas, &offset, &count);
+		if (rc < 0) {
+			rc = recover (rc);
+			if (rc < 0) {
+				error_errno ("Can't play", rc);
+				return -1;
+			}
+			continue;
+		}
+
+		/* Interleaved, so all channels are in the first area. */
+		memcpy ((char *)areas[0].addr + (areas[0].first
+		                + offset * areas[0].step) / 8,
+		        buff + written * bytes_per_frame,
+		        count * bytes_per_frame);
+
+		committed = snd_pcm_mmap_commit (handle, offset, count);
+		if (committed < 0) {
+			rc = recover (committed);
+			if (rc < 0) {
+				error_errno ("Can't play", rc);
+				return -1;
+			}
+			continue;
+		}
+
+		written += committed;
+		debug ("Played %ld bytes", committed * bytes_per_frame);
+
+		if (snd_pcm_state (handle) == SND_PCM_STATE_PREPARED
+		        && (snd_pcm_uframes_t) snd_pcm_avail_update (handle)
+		           <= buffer_frames - chunk_frames) {
+			rc = snd_pcm_start (handle);
+			if (rc < 0) {
+				error_errno ("Can't start playing", rc);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Play the sound with mmap access, keeping a part of a frame which doesn't
+ * fit in alsa_buf.  Return the size or -1 on error. */
+static int mmap_play (const char *buff, const size_t size)
+{
+	size_t pos = 0;
+	snd_pcm_uframes_t frames;
+
+	if (alsa_buf_fill) {
+		int to_copy = MIN(size, (size_t)(bytes_per_frame - alsa_buf_fill));
+
+		memcpy (alsa_buf + alsa_buf_fill, buff, to_copy);
+		alsa_buf_fill += to_copy;
+		pos = to_copy;
+
+		if (alsa_buf_fill < bytes_per_frame)
+			return size;
+		if (mmap_write (alsa_buf, 1) < 0)
+			return -1;
+		alsa_buf_fill = 0;
+	}
+
+	frames = (size - pos) / bytes_per_frame;
+	if (frames && mmap_write (buff + pos, frames) < 0)
+		return -1;
+	pos += frames * bytes_per_frame;
+
+	alsa_buf_fill = size - pos;
+	memcpy (alsa_buf, buff + pos, alsa_buf_fill);
+
+	return size;
+}
+
 static void alsa_close ()
 {
 	snd_pcm_sframes_t delay;
 
 	assert (handle != NULL);
 
+	/* Only silence is left after pausing. */
+	if (paused) {
+		snd_pcm_drop (handle);
+		paused = false;
+	}
+
 	/* play what remained in the buffer */
-	if (alsa_buf_fill > 0) {
+	if (use_mmap) {
+		if (snd_pcm_state (handle) == SND_PCM_STATE_PREPARED)
+			snd_pcm_start (handle);
+	}
+	else if (alsa_buf_fill > 0) {
 		unsigned int samples_required;
 
 		assert (alsa_buf_fill < chunk_bytes);
@@ -793,6 +1017,12 @@ static void alsa_close ()
 	snd_pcm_close (handle);
 	logit ("ALSA device closed");
 
+	free (poll_fds);
+	poll_fds = NULL;
+	poll_count = 0;
+	free (pause_silence);
+	pause_silence = NULL;
+
 	params.format = 0;
 	params.rate = 0;
 	params.channels = 0;
@@ -811,6 +1041,9 @@ static int alsa_play (const char *buff, const size_t size)
 
 	debug ("Got %zu bytes to play", size);
 
+	if (use_mmap)
+		return mmap_play (buff, size);
+
 	while (to_write) {
 		int to_copy;
 
@@ -934,6 +1167,38 @@ static int alsa_get_buff_fill ()
 	return result;
 }
 
+/* Report the frames not heard yet (in the device and in alsa_buf) and
+ * the room in the device buffer, using the device's own counters. */
+static int alsa_get_delay (int *delay, int *avail)
+{
+	int rc, result;
+	snd_pcm_sframes_t dev_avail, dev_delay;
+
+	if (!handle)
+		return -1;
+
+	rc = snd_pcm_avail_delay (handle, &dev_avail, &dev_delay);
+	if (rc == -EPIPE) {
+
+		/* The device has run dry, it will be counted when
+		 * recovering. */
+		dev_avail = buffer_frames;
+		dev_delay = 0;
+	}
+	else if (rc < 0) {
+		log_errno ("snd_pcm_avail_delay() failed", rc);
+		return -1;
+	}
+
+	*delay = MAX(dev_delay, 0) + alsa_buf_fill / bytes_per_frame;
+	*avail = MAX(dev_avail, 0);
+
+	result = xruns - xruns_reported;
+	xruns_reported = xruns;
+
+	return result;
+}
+
 static int alsa_reset ()
 {
 	int result = 0;
@@ -959,17 +1224,73 @@ static int alsa_reset ()
 		}
 
 		alsa_buf_fill = 0;
+		xruns_reported = xruns;
+		paused = false;
 		result = 1;
 	} while (0);
 
 	return result;
 }
 
+/* Pause after what was played so far has been heard: play it out followed
+ * by a period of silence, and pause the device (or drop what is left if
+ * it can't pause) when only the silence remains.  On resuming the silence
+ * gives the time to write more before the device runs dry. */
+static int alsa_pause (int pause)
+{
+	int rc;
+	size_t pad;
+	snd_pcm_sframes_t delay;
+
+	if (!handle)
+		return 0;
+
+	if (!pause) {
+		if (!paused)
+			return 1;
+
+		paused = false;
+		rc = snd_pcm_pause (handle, 0);
+		if (rc < 0) {
+			log_errno ("Can't resume the device", rc);
+			return alsa_reset ();
+		}
+
+		return 1;
+	}
+
+	/* What is in alsa_buf goes out with the silence. */
+	pad = use_mmap ? chunk_bytes : 2 * chunk_bytes - alsa_buf_fill;
+	rc = alsa_play (pause_silence, pad);
+	if (rc < 0)
+		return 0;
+
+	if (snd_pcm_delay (handle, &delay) == 0
+			&& delay > (snd_pcm_sframes_t)chunk_frames)
+		xsleep (delay - chunk_frames, params.rate);
+
+	if (can_pause && snd_pcm_state (handle) == SND_PCM_STATE_RUNNING) {
+		rc = snd_pcm_pause (handle, 1);
+		if (rc == 0) {
+			paused = true;
+			return 1;
+		}
+		log_errno ("snd_pcm_pause() failed", rc);
+	}
+
+	return alsa_reset ();
+}
+
 static int alsa_get_rate ()
 {
 	return params.rate;
 }
 
+static int alsa_get_period ()
+{
+	return handle ? (int) chunk_frames : 0;
+}
+
 static void alsa_toggle_mixer_channel ()
 {
 	if (mixer_elem_curr == mixer_elem1 && mixer_elem2)
@@ -1007,4 +1328,7 @@ void alsa_funcs (struct hw_funcs *funcs)
 	funcs->get_rate = alsa_get_rate;
 	funcs->toggle_mixer_channel = alsa_toggle_mixer_channel;
 	funcs->get_mixer_channel_name = alsa_get_mixer_channel_name;
+	funcs->get_period = alsa_get_period;
+	funcs->get_delay = alsa_get_delay;
+	funcs->pause = alsa_pause;
 }
@@ -53,6 +53,7 @@
 
 #include "softmixer.h"
 #include "equalizer.h"
+#include "dsp.h"
 
 #include "out_buf.h"
 #include "protocol.h"
@@ -62,6 +63,9 @@
 #include "files.h"
 #include "io.h"
 #include "audio_conversion.h"
+#include "stats.h"
+#include "thread_sched.h"
+#include "tee_out.h"
 
 static pthread_t playing_thread = 0;  /* tid of play thread */
 static int play_thread_running = 0;
@@ -94,11 +98,51 @@ static pthread_mutex_t request_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 /* Playlists. */
 static struct plist playlist;
-static struct plist shuffled_plist;
 static struct plist queue;
 struct plist *curr_plist; /* currently used playlist */
 pthread_mutex_t plist_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+/* Copy of the queue sent to the clients.  It's made when a client asks
+ * for the queue after it has changed, and the same copy is shared by
+ * everyone who asks until the queue changes again; it's freed when the
+ * last one releases it.  Protected by plist_mtx. */
+struct queue_copy
+{
+	struct plist plist;	/* must be the first */
+	int refs;
+};
+static struct queue_copy *queue_copy = NULL;
+
+/* Files added to the playlist by clients but not put on it yet.  Adding
+ * only appends here, and the whole batch is moved to the playlist when
+ * the server has handled the commands it got or when the playlist is
+ * needed, so a long list of additions takes plist_mtx once instead of
+ * for each file. */
+static lists_t_strs *pending_adds = NULL;
+static pthread_mutex_t pending_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Known times of files on the playlist, with the mtime of the file they
+ * were read from, kept in a list of their own with its own lock so the
+ * tags readers and the precache don't wait for changes of the playlist. */
+static struct plist file_times;
+static pthread_mutex_t times_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Order of playing the playlist in shuffle mode: a permutation of the
+ * playlist's indexes made when it's needed and updated when items are
+ * added.  Deleted items stay in it until the playlist is compacted.
+ * Protected by plist_mtx. */
+static struct
+{
+	int *order;	/* playlist indexes in the shuffled order */
+	int *pos;	/* position in order of each playlist index or -1 */
+	int len;	/* number of indexes in order */
+	int size;	/* allocated size of order and pos */
+	bool valid;	/* false if it must be made again */
+} shuffled = { NULL, NULL, 0, 0, false };
+
+/* Is the playlist played in the shuffled order? */
+static bool curr_shuffled = false;
+
 /* Is the audio device opened? */
 static int audio_opened = 0;
 
@@ -111,12 +155,27 @@ static struct sound_params req_sound_params = { 0, 0, 0 };
 static struct audio_conversion sound_conv;
 static int need_audio_conversion = 0;
 
+/* The parameters the device was first opened with while LockOutputFormat
+ * is set, or zero.  The device is kept open with them, and the sound of
+ * the following files is converted to them, until playing stops. */
+static struct sound_params locked_params = { 0, 0, 0 };
+static pthread_mutex_t locked_params_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 /* URL of the last played stream. Used to fake pause/unpause of internet
  * streams. Protected by curr_playing_mtx. */
 static char *last_stream_url = NULL;
 
 static int current_mixer = 0;
 
+/* Options read when going to another file and for each decoded buffer. */
+static options_t_handle opt_shuffle = OPTIONS_HANDLE("Shuffle");
+static options_t_handle opt_repeat = OPTIONS_HANDLE("Repeat");
+static options_t_handle opt_autonext = OPTIONS_HANDLE("AutoNext");
+static options_t_handle opt_queue_next_return
+	= OPTIONS_HANDLE("QueueNextSongReturn");
+static options_t_handle opt_prefer_float = OPTIONS_HANDLE("PreferFloatOutput");
+static options_t_handle opt_lock_output = OPTIONS_HANDLE("LockOutputFormat");
+
 /* Make a human readable description of the sound sample format(s).
  * Put the description in msg which is of size buf_size.
  * Return msg. */
@@ -365,6 +424,62 @@ static long sfmt_best_matching (const long formats_with_endian,
 	return best;
 }
 
+/* Should the device get float sound although the file isn't float?  If the
+ * DSP chain or the resampler is going to work on the sound, it is in float
+ * anyway, and converting it to fixed point only costs time and
+ * precision. */
+static int prefer_float (const struct sound_params *req,
+		const struct sound_params *driver)
+{
+	struct sound_params params = *req;
+
+	if (!(hw_caps.formats & SFMT_FLOAT)
+			|| (driver->fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT
+			|| !options_handle_bool (&opt_prefer_float))
+		return 0;
+
+	params.channels = driver->channels;
+	params.rate = driver->rate;
+
+	return req->rate != driver->rate || dsp_is_needed (&params);
+}
+
+static void reset_sound_params (struct sound_params *params)
+{
+	params->rate = 0;
+	params->channels = 0;
+	params->fmt = 0;
+}
+
+/* If the output is locked to the parameters of the device, put them in
+ * *params and return true. */
+static bool get_locked_params (struct sound_params *params)
+{
+	bool locked = false;
+
+	if (!options_handle_bool (&opt_lock_output))
+		return false;
+
+	LOCK (locked_params_mtx);
+	if (locked_params.fmt) {
+		*params = locked_params;
+		locked = true;
+	}
+	UNLOCK (locked_params_mtx);
+
+	return locked;
+}
+
+static void set_locked_params (const struct sound_params *params)
+{
+	LOCK (locked_params_mtx);
+	if (params)
+		locked_params = *params;
+	else
+		reset_sound_params (&locked_params);
+	UNLOCK (locked_params_mtx);
+}
+
 /* Return the number of bytes per sample for the given format. */
 int sfmt_Bps (const long format)
 {
@@ -399,17 +514,308 @@ int sfmt_Bps (const long format)
 	return Bps;
 }
 
+/* Return a random number from 0 to n - 1, each with the same
+ * probability. */
+static int random_below (const int n)
+{
+	int limit = RAND_MAX - RAND_MAX % n;
+	int r;
+
+	assert (n > 0);
+
+	do {
+		r = rand ();
+	} while (r >= limit);
+
+	return r % n;
+}
+
+static void shuffle_reserve (const int size)
+{
+	if (size > shuffled.size) {
+		int i, old_size = shuffled.size;
+
+		shuffled.size = MAX(size, MAX(shuffled.size * 2, 64));
+		shuffled.order = (int *)xrealloc (shuffled.order,
+				sizeof(int) * shuffled.size);
+		shuffled.pos = (int *)xrealloc (shuffled.pos,
+				sizeof(int) * shuffled.size);
+
+		for (i = old_size; i < shuffled.size; i++)
+			shuffled.pos[i] = -1;
+	}
+}
+
+static void shuffle_swap (const int a, const int b)
+{
+	int t = shuffled.order[a];
+
+	shuffled.order[a] = shuffled.order[b];
+	shuffled.order[b] = t;
+	shuffled.pos[shuffled.order[a]] = a;
+	shuffled.pos[shuffled.order[b]] = b;
+}
+
+/* Make a new shuffled order of the playlist (Fisher-Yates) starting with
+ * the item first if it's not -1. */
+static void shuffle_make (const int first)
+{
+	int i;
+
+	shuffle_reserve (playlist.num);
+
+	shuffled.len = 0;
+	for (i = 0; i < playlist.num; i++) {
+		shuffled.pos[i] = -1;
+		if (!plist_deleted (&playlist, i))
+			shuffled.order[shuffled.len++] = i;
+	}
+
+	for (i = shuffled.len - 1; i > 0; i--) {
+		int j = random_below (i + 1);
+		int t = shuffled.order[i];
+
+		shuffled.order[i] = shuffled.order[j];
+		shuffled.order[j] = t;
+	}
+
+	for (i = 0; i < shuffled.len; i++)
+		shuffled.pos[shuffled.order[i]] = i;
+
+	if (first != -1 && shuffled.pos[first] != -1)
+		shuffle_swap (0, shuffled.pos[first]);
+
+	shuffled.valid = true;
+}
+
+/* Put the item just added to the playlist at a random position in the
+ * part of the shuffled order which is not played yet. */
+static void shuffle_add (const int num)
+{
+	int from = 0;
+
+	if (!shuffled.valid)
+		return;
+
+	shuffle_reserve (num + 1);
+
+	if (curr_plist == &playlist && curr_shuffled && curr_playing != -1
+			&& curr_playing < shuffled.size
+			&& shuffled.pos[curr_playing] != -1)
+		from = shuffled.pos[curr_playing] + 1;
+
+	shuffled.order[shuffled.len] = num;
+	shuffled.pos[num] = shuffled.len;
+	shuffled.len++;
+
+	shuffle_swap (from + random_below (shuffled.len - from),
+	              shuffled.len - 1);
+}
+
+static void shuffle_clear ()
+{
+	int i;
+
+	for (i = 0; i < shuffled.len; i++)
+		shuffled.pos[shuffled.order[i]] = -1;
+	shuffled.len = 0;
+	shuffled.valid = false;
+}
+
+/* Position in the shuffled order of the playlist item or -1. */
+static int shuffle_pos_of (const int num)
+{
+	return num >= 0 && num < shuffled.size ? shuffled.pos[num] : -1;
+}
+
+static int shuffle_next (const int num)
+{
+	/* Start from the beginning if the item is not in the order. */
+	int p = num == -1 ? 0 : shuffle_pos_of (num) + 1;
+
+	while (p < shuffled.len && plist_deleted (&playlist, shuffled.order[p]))
+		p++;
+
+	return p < shuffled.len ? shuffled.order[p] : -1;
+}
+
+static int shuffle_prev (const int num)
+{
+	int p = shuffle_pos_of (num) - 1;
+
+	if (num == -1)
+		return -1;
+
+	while (p >= 0 && plist_deleted (&playlist, shuffled.order[p]))
+		p--;
+
+	return p >= 0 ? shuffled.order[p] : -1;
+}
+
+static int shuffle_last ()
+{
+	int p = shuffled.len - 1;
+
+	while (p >= 0 && plist_deleted (&playlist, shuffled.order[p]))
+		p--;
+
+	return p >= 0 ? shuffled.order[p] : -1;
+}
+
+/* Change the playlist indexes in the shuffled order as plist_compact()
+ * will change them. */
+static void shuffle_compact (const int keep)
+{
+	int *new_index;
+	int i, n = 0;
+
+	if (!shuffled.valid)
+		return;
+
+	new_index = (int *)xmalloc (sizeof(int) * MAX(playlist.num, 1));
+	for (i = 0; i < playlist.num; i++) {
+		if (!plist_deleted (&playlist, i) || i == keep)
+			new_index[i] = n++;
+		else
+			new_index[i] = -1;
+		shuffled.pos[i] = -1;
+	}
+
+	n = 0;
+	for (i = 0; i < shuffled.len; i++) {
+		int num = new_index[shuffled.order[i]];
+
+		if (num != -1)
+			shuffled.order[n++] = num;
+	}
+	shuffled.len = n;
+
+	for (i = 0; i < shuffled.len; i++)
+		shuffled.pos[shuffled.order[i]] = i;
+
+	free (new_index);
+}
+
+/* Items of the list in the order they are played. */
+static int next_item (struct plist *plist, const int num)
+{
+	if (plist == &playlist && curr_shuffled)
+		return shuffle_next (num);
+
+	return plist_next (plist, num);
+}
+
+static int prev_item (struct plist *plist, const int num)
+{
+	if (plist == &playlist && curr_shuffled)
+		return shuffle_prev (num);
+
+	return plist_prev (plist, num);
+}
+
+static int last_item (struct plist *plist)
+{
+	if (plist == &playlist && curr_shuffled)
+		return shuffle_last ();
+
+	return plist_last (plist);
+}
+
+/* Compact the list if it has many deleted items, keeping the item being
+ * played.  Must be called with curr_playing_mtx and plist_mtx locked. */
+static void compact_plist (struct plist *plist)
+{
+	int keep;
+
+	if (!plist_needs_compact (plist))
+		return;
+
+	keep = curr_plist == plist ? curr_playing : -1;
+
+	if (plist == &playlist)
+		shuffle_compact (keep);
+
+	keep = plist_compact (plist, keep);
+
+	if (curr_plist == plist)
+		curr_playing = keep;
+}
+
+static void queue_copy_unref (struct queue_copy *copy)
+{
+	if (--copy->refs == 0) {
+		plist_free (&copy->plist);
+		free (copy);
+	}
+}
+
+/* Drop our reference to the copy of the queue after the queue was
+ * changed.  Must be called with plist_mtx locked. */
+static void queue_changed ()
+{
+	if (queue_copy) {
+		queue_copy_unref (queue_copy);
+		queue_copy = NULL;
+	}
+}
+
+/* Put the files added by clients since the last time on the playlist.
+ * Must be called with curr_playing_mtx and plist_mtx locked. */
+static void apply_pending_adds ()
+{
+	lists_t_strs *files;
+	int ix;
+
+	LOCK (pending_mtx);
+	files = pending_adds;
+	pending_adds = NULL;
+	UNLOCK (pending_mtx);
+
+	if (!files)
+		return;
+
+	for (ix = 0; ix < lists_strs_size (files); ix++) {
+		const char *file = lists_strs_at (files, ix);
+
+		if (plist_find_fname (&playlist, file) == -1)
+			shuffle_add (plist_add (&playlist, file));
+		else
+			logit ("Wanted to add a file already present: %s", file);
+	}
+
+	lists_strs_free (files);
+}
+
+/* Forget the time of the file, or of all files if file is NULL. */
+static void forget_time (const char *file)
+{
+	LOCK (times_mtx);
+	if (file) {
+		int num = plist_find_fname (&file_times, file);
+
+		if (num != -1) {
+			plist_delete (&file_times, num);
+			if (plist_needs_compact (&file_times))
+				plist_compact (&file_times, -1);
+		}
+	}
+	else
+		plist_clear (&file_times);
+	UNLOCK (times_mtx);
+}
+
 /* Move to the next file depending on the options set, the user
  * request and whether or not there are files in the queue. */
 static void go_to_another_file ()
 {
-	bool shuffle = options_get_bool ("Shuffle");
-	bool go_next = (play_next || options_get_bool("AutoNext"));
+	bool shuffle = options_handle_bool (&opt_shuffle);
+	bool go_next = (play_next || options_handle_bool (&opt_autonext));
 	int curr_playing_curr_pos;
 	/* XXX: Shouldn't play_next be protected by mutex? */
 
 	LOCK (curr_playing_mtx);
 	LOCK (plist_mtx);
+	apply_pending_adds ();
 
 	/* If we move forward in the playlist and there are some songs in
 	 * the queue, then play them. */
@@ -424,32 +830,28 @@ static void go_to_another_file ()
 
 		server_queue_pop (queue.items[curr_playing].file);
 		plist_delete (&queue, curr_playing);
+		compact_plist (&queue);
+		queue_changed ();
 	}
 	else {
 		/* If we just finished playing files from the queue and the
 		 * appropriate option is set, continue with the file played
 		 * before playing the queue. */
-		if (before_queue_fname && options_get_bool ("QueueNextSongReturn")) {
+		if (before_queue_fname
+				&& options_handle_bool (&opt_queue_next_return)) {
 			free (curr_playing_fname);
 			curr_playing_fname = before_queue_fname;
 			before_queue_fname = NULL;
 		}
 
-		if (shuffle) {
-			curr_plist = &shuffled_plist;
-
-			if (plist_count(&playlist)
-					&& !plist_count(&shuffled_plist)) {
-				plist_cat (&shuffled_plist, &playlist);
-				plist_shuffle (&shuffled_plist);
+		curr_plist = &playlist;
+		curr_shuffled = shuffle;
 
-				if (curr_playing_fname)
-					plist_swap_first_fname (&shuffled_plist,
-							curr_playing_fname);
-			}
-		}
-		else
-			curr_plist = &playlist;
+		if (shuffle && !shuffled.valid && plist_count(&playlist))
+			shuffle_make (curr_playing_fname
+					? plist_find_fname (&playlist,
+					                    curr_playing_fname)
+					: -1);
 
 		curr_playing_curr_pos = plist_find_fname (curr_plist,
 				curr_playing_fname);
@@ -467,16 +869,16 @@ static void go_to_another_file ()
 
 			if (curr_playing_curr_pos == -1
 					|| started_playing_in_queue) {
-				curr_playing = plist_prev (curr_plist, -1);
+				curr_playing = prev_item (curr_plist, -1);
 				started_playing_in_queue = 0;
 			}
 			else
-				curr_playing = plist_prev (curr_plist,
+				curr_playing = prev_item (curr_plist,
 						curr_playing_curr_pos);
 
 			if (curr_playing == -1) {
-				if (options_get_bool("Repeat"))
-					curr_playing = plist_last (curr_plist);
+				if (options_handle_bool (&opt_repeat))
+					curr_playing = last_item (curr_plist);
 				logit ("Beginning of the list.");
 			}
 			else
@@ -487,20 +889,17 @@ static void go_to_another_file ()
 
 			if (curr_playing_curr_pos == -1
 					|| started_playing_in_queue) {
-				curr_playing = plist_next (curr_plist, -1);
+				curr_playing = next_item (curr_plist, -1);
 				started_playing_in_queue = 0;
 			}
 			else
-				curr_playing = plist_next (curr_plist,
+				curr_playing = next_item (curr_plist,
 						curr_playing_curr_pos);
 
-			if (curr_playing == -1 && options_get_bool("Repeat")) {
-				if (shuffle) {
-					plist_clear (&shuffled_plist);
-					plist_cat (&shuffled_plist, &playlist);
-					plist_shuffle (&shuffled_plist);
-				}
-				curr_playing = plist_next (curr_plist, -1);
+			if (curr_playing == -1 && options_handle_bool (&opt_repeat)) {
+				if (shuffle)
+					shuffle_make (-1);
+				curr_playing = next_item (curr_plist, -1);
 				logit ("Going back to the first item.");
 			}
 			else if (curr_playing == -1)
@@ -509,7 +908,7 @@ static void go_to_another_file ()
 				logit ("Next item");
 
 		}
-		else if (!options_get_bool("Repeat")) {
+		else if (!options_handle_bool (&opt_repeat)) {
 			curr_playing = -1;
 		}
 		else
@@ -524,9 +923,33 @@ static void go_to_another_file ()
 	UNLOCK (curr_playing_mtx);
 }
 
+/* Return the files which will be played after the current one as far as
+ * we can tell: the queue first, then the rest of the current playlist,
+ * at most count of them.  Must be called with plist_mtx locked. */
+static lists_t_strs *upcoming_files (const int count)
+{
+	int ix;
+	lists_t_strs *files = lists_strs_new (count);
+
+	if (curr_plist != &queue) {
+		for (ix = plist_next (&queue, -1);
+		     ix != -1 && lists_strs_size (files) < count;
+		     ix = plist_next (&queue, ix))
+			lists_strs_push (files, plist_get_file (&queue, ix));
+	}
+
+	for (ix = next_item (curr_plist, curr_playing);
+	     ix != -1 && lists_strs_size (files) < count;
+	     ix = next_item (curr_plist, ix))
+		lists_strs_push (files, plist_get_file (curr_plist, ix));
+
+	return files;
+}
+
 static void *play_thread (void *unused ATTR_UNUSED)
 {
 	logit ("Entering playing thread");
+	thread_sched_apply (THREAD_DECODER);
 
 	while (curr_playing != -1) {
 		char *file;
@@ -539,11 +962,11 @@ static void *play_thread (void *unused ATTR_UNUSED)
 		play_prev = 0;
 
 		if (file) {
-			int next;
-			char *next_file;
+			lists_t_strs *next_files;
 
 			LOCK (curr_playing_mtx);
 			LOCK (plist_mtx);
+			apply_pending_adds ();
 			logit ("Playing item %d: %s", curr_playing, file);
 
 			if (curr_playing_fname)
@@ -552,14 +975,13 @@ static void *play_thread (void *unused ATTR_UNUSED)
 
 			out_buf_time_set (out_buf, 0.0);
 
-			next = plist_next (curr_plist, curr_playing);
-			next_file = next != -1 ? plist_get_file (curr_plist, next) : NULL;
+			next_files = upcoming_files (
+					options_get_int ("PrecacheDepth"));
 			UNLOCK (plist_mtx);
 			UNLOCK (curr_playing_mtx);
 
-			player (file, next_file, out_buf);
-			if (next_file)
-				free (next_file);
+			player (file, next_files, out_buf);
+			lists_strs_free (next_files);
 
 			set_info_rate (0);
 			set_info_bitrate (0);
@@ -595,6 +1017,7 @@ static void *play_thread (void *unused ATTR_UNUSED)
 	}
 
 	audio_close ();
+	set_locked_params (NULL);
 	logit ("Exiting");
 
 	return NULL;
@@ -650,6 +1073,7 @@ void audio_play (const char *fname)
 
 	LOCK (curr_playing_mtx);
 	LOCK (plist_mtx);
+	apply_pending_adds ();
 
 	/* If we have songs in the queue and fname is empty string, start
 	 * playing file from the queue. */
@@ -660,27 +1084,29 @@ void audio_play (const char *fname)
 		/* remove the file from queue */
 		server_queue_pop (queue.items[curr_playing].file);
 		plist_delete (curr_plist, curr_playing);
+		compact_plist (&queue);
+		queue_changed ();
 
 		started_playing_in_queue = 1;
 	}
-	else if (options_get_bool("Shuffle")) {
-		plist_clear (&shuffled_plist);
-		plist_cat (&shuffled_plist, &playlist);
-		plist_shuffle (&shuffled_plist);
-		plist_swap_first_fname (&shuffled_plist, fname);
-
-		curr_plist = &shuffled_plist;
+	else if (options_handle_bool (&opt_shuffle)) {
+		curr_plist = &playlist;
+		curr_shuffled = true;
 
-		if (*fname)
+		if (*fname) {
 			curr_playing = plist_find_fname (curr_plist, fname);
+			shuffle_make (curr_playing);
+		}
 		else if (plist_count(curr_plist)) {
-			curr_playing = plist_next (curr_plist, -1);
+			shuffle_make (-1);
+			curr_playing = next_item (curr_plist, -1);
 		}
 		else
 			curr_playing = -1;
 	}
 	else {
 		curr_plist = &playlist;
+		curr_shuffled = false;
 
 		if (*fname)
 			curr_playing = plist_find_fname (curr_plist, fname);
@@ -772,11 +1198,135 @@ void audio_unpause ()
 		UNLOCK (curr_playing_mtx);
 }
 
-static void reset_sound_params (struct sound_params *params)
+/* Set *driver to the parameters supported by the driver that are nearly
+ * the requested ones, which the device is opened with for sound of *req.
+ * Decoders can use them to produce the sound the device takes. */
+static void choose_output_params (const struct sound_params *req,
+		struct sound_params *driver)
 {
-	params->rate = 0;
-	params->channels = 0;
-	params->fmt = 0;
+	int max_rate = options_get_int("MaxSamplerate");
+
+	if (get_locked_params (driver))
+		return;
+
+	switch (options_get_int("EnableResample")) {
+		case 2:
+			assert (max_rate > 0);
+
+			driver->rate = max_rate;
+			logit ("Setting forced output sample.");
+			break;
+		case 1:
+			max_rate = (max_rate == 0) || (hw_caps.max_rate < max_rate) ? hw_caps.max_rate : max_rate;
+			driver->rate = CLAMP(hw_caps.min_rate,req->rate,max_rate);
+
+			/* check if it is possible to chose a sample rate which would be a multiple of req sample rate */
+			if (driver->rate > req->rate && driver->rate % req->rate !=0 ) {
+				if (req->rate*2 >= hw_caps.min_rate && req->rate*2 <= max_rate)
+					driver->rate = req->rate*2;
+				else if (req->rate*3 >= hw_caps.min_rate && req->rate*3 <= max_rate)
+					driver->rate = req->rate*3;
+				else if (req->rate*4 >= hw_caps.min_rate && req->rate*4 <= max_rate)
+					driver->rate = req->rate*4;
+			}
+
+			break;
+		default:
+			driver->rate = req->rate;
+	}
+
+	driver->fmt = sfmt_best_matching (hw_caps.formats, req->fmt);
+
+	/* number of channels */
+	driver->channels = CLAMP(hw_caps.min_channels,
+	                         req->channels,
+	                         hw_caps.max_channels);
+
+	if (prefer_float (req, driver))
+		driver->fmt = SFMT_FLOAT;
+}
+
+void audio_get_output_params (const struct sound_params *req,
+		struct sound_params *driver)
+{
+	choose_output_params (req, driver);
+
+	logit ("Requested sample rate: %dHz, output sample rate: %dHz", req->rate, driver->rate);
+	if ((driver->fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT
+			&& (req->fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT
+			&& (hw_caps.formats & ~SFMT_FLOAT & SFMT_MASK_FORMAT))
+		logit ("Using float output for the DSP chain or resampling.");
+}
+
+/* Should a decoder which can give float samples give them for sound of
+ * these rate and channels?  It should if the device would get float even
+ * if the decoder gave fixed point samples (see prefer_float()): then
+ * the conversion to fixed point and back can be skipped. */
+int audio_float_wanted (const struct sound_params *params)
+{
+	struct sound_params req, driver;
+
+	if (!(hw_caps.formats & SFMT_FLOAT))
+		return 0;
+
+	req.channels = params->channels;
+	req.rate = params->rate;
+	req.fmt = SFMT_S16 | SFMT_NE;
+
+	choose_output_params (&req, &driver);
+
+	return (driver.fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT;
+}
+
+/* Should decoders which have decode_float() be asked for float samples?
+ * Unlike audio_float_wanted() this doesn't depend on the sound, so it
+ * is the same for the whole file. */
+int audio_float_output ()
+{
+	return (hw_caps.formats & SFMT_FLOAT)
+		&& options_handle_bool (&opt_prefer_float);
+}
+
+/* Will audio_open() keep the device open for sound of these parameters,
+ * only converting it to the format the device is locked to?  The sound
+ * already in the output buffer is converted, so it doesn't need to be
+ * played out first. */
+int audio_keeps_device (const struct sound_params *params)
+{
+	struct sound_params locked;
+
+	return audio_opened && get_locked_params (&locked)
+		&& audio_conv_possible (params, &locked);
+}
+
+/* Convert sound of new parameters to those of the opened device instead
+ * of reopening it.  Return 0 on error. */
+static int change_conversion (const struct sound_params *params)
+{
+	char fmt_name[SFMT_STR_MAX] LOGIT_ONLY;
+
+	if (need_audio_conversion) {
+		audio_conv_destroy (&sound_conv);
+		need_audio_conversion = 0;
+	}
+
+	req_sound_params = *params;
+
+	if (!sound_params_eq(req_sound_params, driver_sound_params)) {
+		if (!audio_conv_new (&sound_conv, &req_sound_params,
+				&driver_sound_params)) {
+			audio_close ();
+			return 0;
+		}
+		need_audio_conversion = 1;
+	}
+
+	logit ("Keeping the device open for %s, %d channels, %dHz",
+			sfmt_str(req_sound_params.fmt, fmt_name, sizeof(fmt_name)),
+			req_sound_params.channels,
+			req_sound_params.rate);
+
+	return 1;
 }
 
 /* Return 0 on error. If sound params == NULL, open the device using
@@ -805,50 +1355,20 @@ int audio_open (struct sound_params *sound_params)
 			 * and the user will hear old data, so close it. */
 			logit ("Reopening device due to low bps.");
 		}
+		else if (audio_keeps_device (sound_params))
+			return change_conversion (sound_params);
+		else if (options_handle_bool (&opt_lock_output)) {
+			logit ("Can't convert to the locked output format, "
+			       "reopening the device.");
+			set_locked_params (NULL);
+		}
 
 		audio_close ();
 	}
 
 	req_sound_params = *sound_params;
 
-	/* Set driver_sound_params to parameters supported by the driver that
-	 * are nearly the requested parameters. */
-
-	int max_rate = options_get_int("MaxSamplerate");
-
-	switch (options_get_int("EnableResample")) {
-		case 2:
-			assert (max_rate > 0);
-
-			driver_sound_params.rate = max_rate;
-			logit ("Setting forced output sample.");
-			break;
-		case 1:
-			max_rate = (max_rate == 0) || (hw_caps.max_rate < max_rate) ? hw_caps.max_rate : max_rate;
-			driver_sound_params.rate = CLAMP(hw_caps.min_rate,req_sound_params.rate,max_rate);
-
-			/* check if it is possible to chose a sample rate which would be a multiple of req sample rate */
-			if (driver_sound_params.rate > req_sound_params.rate && driver_sound_params.rate % req_sound_params.rate !=0 ) {
-				if (req_sound_params.rate*2 >= hw_caps.min_rate && req_sound_params.rate*2 <= max_rate)
-					driver_sound_params.rate = req_sound_params.rate*2;
-				else if (req_sound_params.rate*3 >= hw_caps.min_rate && req_sound_params.rate*3 <= max_rate)
-					driver_sound_params.rate = req_sound_params.rate*3;
-				else if (req_sound_params.rate*4 >= hw_caps.min_rate && req_sound_params.rate*4 <= max_rate)
-					driver_sound_params.rate = req_sound_params.rate*4;
-			}
-
-			break;
-		default:
-			driver_sound_params.rate = req_sound_params.rate;
-	}
-	logit ("Requested sample rate: %dHz, output sample rate: %dHz", req_sound_params.rate, driver_sound_params.rate);
-
-	driver_sound_params.fmt = sfmt_best_matching (hw_caps.formats, req_sound_params.fmt);
-
-	/* number of channels */
-	driver_sound_params.channels = CLAMP(hw_caps.min_channels,
-	                                     req_sound_params.channels,
-	                                     hw_caps.max_channels);
+	audio_get_output_params (&req_sound_params, &driver_sound_params);
 
 	res = hw.open (&driver_sound_params);
 
@@ -872,6 +1392,8 @@ int audio_open (struct sound_params *sound_params)
 			need_audio_conversion = 1;
 		}
 		audio_opened = 1;
+		if (options_handle_bool (&opt_lock_output))
+			set_locked_params (&driver_sound_params);
 
 		logit ("Requested sound parameters: %s, %d channels, %dHz",
 				sfmt_str(req_sound_params.fmt, fmt_name, sizeof(fmt_name)),
@@ -889,23 +1411,19 @@ int audio_open (struct sound_params *sound_params)
 int audio_send_buf (const char *buf, const size_t size)
 {
 	size_t out_data_len = size;
-	int res;
-	char *converted = NULL;
-
-	if (need_audio_conversion)
-		converted = audio_conv (&sound_conv, buf, size, &out_data_len);
+	const char *converted;
+	struct timespec start;
 
-	if (need_audio_conversion && converted)
-		res = out_buf_put (out_buf, converted, out_data_len);
-	else if (!need_audio_conversion)
-		res = out_buf_put (out_buf, buf, size);
-	else
-		res = 0;
+	if (!need_audio_conversion)
+		return out_buf_put (out_buf, buf, size);
 
-	if (converted)
-		free (converted);
+	get_realtime (&start);
+	converted = audio_conv (&sound_conv, buf, size, &out_data_len);
+	stats_add (STAT_CONV_USEC, stats_usec_since (&start));
+	if (!converted)
+		return 0;
 
-	return res;
+	return out_buf_put (out_buf, converted, out_data_len);
 }
 
 /* Get the current audio format bytes per frame value.
@@ -929,52 +1447,105 @@ int audio_get_buf_fill ()
 	return hw.get_buff_fill ();
 }
 
-int audio_send_pcm (const char *buf, const size_t size)
+/* Get the driver's period in frames, 0 if it doesn't tell. */
+int audio_get_period ()
 {
-	char *softmixed = NULL;
-	char *equalized = NULL;
+	return hw.get_period ? hw.get_period () : 0;
+}
 
-	if (equalizer_is_active ())
-	{
-		equalized = xmalloc (size);
-		memcpy (equalized, buf, size);
+/* Get the frames not played yet and the free space of the device (-1 if
+ * unknown).  Return the number of underruns since the last call, -1 if
+ * the driver doesn't count them. */
+int audio_get_delay (int *delay, int *avail)
+{
+	int xruns = -1;
 
-		equalizer_process_buffer (equalized, size, &driver_sound_params);
+	if (hw.get_delay)
+		xruns = hw.get_delay (delay, avail);
 
-		buf = equalized;
+	if (xruns < 0) {
+		*delay = hw.get_buff_fill () / MAX(audio_get_bpf (), 1);
+		*avail = -1;
 	}
 
-	if (softmixer_is_active () || softmixer_is_mono ())
-	{
-		if (equalized)
-		{
-			softmixed = equalized;
-		}
-		else
-		{
-			softmixed = xmalloc (size);
-			memcpy (softmixed, buf, size);
-		}
+	return xruns;
+}
+
+int audio_send_pcm (const char *buf, const size_t size)
+{
+	int played;
 
-		softmixer_process_buffer (softmixed, size, &driver_sound_params);
+	if (dsp_is_needed (&driver_sound_params)) {
+		struct timespec start;
 
-		buf = softmixed;
+		get_realtime (&start);
+		buf = dsp_process (buf, size, &driver_sound_params);
+		stats_add (STAT_DSP_USEC, stats_usec_since (&start));
 	}
 
-	int played;
+	tee_out_play (buf, size, &driver_sound_params);
 
 	played = hw.play (buf, size);
 
 	if (played < 0)
 		fatal ("Audio output error!");
 
-	if (softmixed && !equalized)
-		free (softmixed);
+	return played;
+}
+
+/* Fade the sound in the device's format linearly in or out over the
+ * whole buffer, so that pausing and resuming don't click.  Only the output
+ * buffer thread uses it. */
+void audio_fade (char *buf, const size_t size, const int fade_in)
+{
+	static float fade_buf[AUDIO_MAX_PLAY_BYTES];
+	const long fmt = driver_sound_params.fmt;
+	const int channels = driver_sound_params.channels;
+	float *samples;
+	int frames, ix, ch;
 
-	if (equalized)
-		free (equalized);
+	assert (size <= AUDIO_MAX_PLAY_BYTES);
 
-	return played;
+	/* The sound can be converted to float only in native endianness. */
+	if (!fmt || (!(fmt & (SFMT_S8 | SFMT_U8 | SFMT_FLOAT))
+	             && (fmt & SFMT_MASK_ENDIANNESS) != SFMT_NE))
+		return;
+
+	frames = size / sfmt_Bps (fmt) / channels;
+	if (frames < 2)
+		return;
+
+	if ((fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT)
+		samples = (float *)buf;
+	else {
+		audio_conv_to_float (buf, size, fmt, fade_buf);
+		samples = fade_buf;
+	}
+
+	for (ix = 0; ix < frames; ix += 1) {
+		float gain = ix / (float)(frames - 1);
+
+		if (!fade_in)
+			gain = 1.0f - gain;
+		for (ch = 0; ch < channels; ch += 1)
+			samples[ix * channels + ch] *= gain;
+	}
+
+	if (samples == fade_buf)
+		audio_conv_from_float (fade_buf, frames * channels, fmt, buf);
+}
+
+/* Pause the device without closing it, if the driver can.  Return 0 if it
+ * can't. */
+int audio_pause_device ()
+{
+	return hw.pause ? hw.pause (1) : 0;
+}
+
+void audio_resume_device ()
+{
+	if (hw.pause && !hw.pause (0))
+		logit ("Can't resume the device");
 }
 
 /* Get current time of the song in seconds. */
@@ -997,74 +1568,145 @@ void audio_close ()
 	}
 }
 
-/* Try to initialize drivers from the list and fill funcs with
- * those of the first working driver. */
-static void find_working_driver (lists_t_strs *drivers, struct hw_funcs *funcs)
-{
-	int ix;
+/* Name of the file in which the driver which worked last is kept. */
+#define LAST_DRIVER_FILE	"last_driver"
 
+/* Try to initialize the driver of the name, return 1 if it works. */
+static int try_driver (const char *name, struct hw_funcs *funcs)
+{
 	memset (funcs, 0, sizeof(*funcs));
 
-	for (ix = 0; ix < lists_strs_size (drivers); ix += 1) {
-		const char *name;
-
-		name = lists_strs_at (drivers, ix);
-
 #ifdef HAVE_SNDIO
-		if (!strcasecmp(name, "sndio")) {
-			sndio_funcs (funcs);
-			printf ("Trying SNDIO...\n");
-			if (funcs->init(&hw_caps))
-				return;
-		}
+	if (!strcasecmp(name, "sndio")) {
+		sndio_funcs (funcs);
+		printf ("Trying SNDIO...\n");
+		if (funcs->init(&hw_caps))
+			return 1;
+	}
 #endif
 
 #ifdef HAVE_PULSE
-		if (!strcasecmp(name, "pulseaudio")) {
-			pulse_funcs (funcs);
-			printf ("Trying PulseAudio...\n");
-			if (funcs->init(&hw_caps))
-				return;
-		}
+	if (!strcasecmp(name, "pulseaudio")) {
+		pulse_funcs (funcs);
+		printf ("Trying PulseAudio...\n");
+		if (funcs->init(&hw_caps))
+			return 1;
+	}
 #endif
 
 #ifdef HAVE_OSS
-		if (!strcasecmp(name, "oss")) {
-			oss_funcs (funcs);
-			printf ("Trying OSS...\n");
-			if (funcs->init(&hw_caps))
-				return;
-		}
+	if (!strcasecmp(name, "oss")) {
+		oss_funcs (funcs);
+		printf ("Trying OSS...\n");
+		if (funcs->init(&hw_caps))
+			return 1;
+	}
 #endif
 
 #ifdef HAVE_ALSA
-		if (!strcasecmp(name, "alsa")) {
-			alsa_funcs (funcs);
-			printf ("Trying ALSA...\n");
-			if (funcs->init(&hw_caps))
-				return;
-		}
+	if (!strcasecmp(name, "alsa")) {
+		alsa_funcs (funcs);
+		printf ("Trying ALSA...\n");
+		if (funcs->init(&hw_caps))
+			return 1;
+	}
 #endif
 
 #ifdef HAVE_JACK
-		if (!strcasecmp(name, "jack")) {
-			moc_jack_funcs (funcs);
-			printf ("Trying JACK...\n");
-			if (funcs->init(&hw_caps))
-				return;
-		}
+	if (!strcasecmp(name, "jack")) {
+		moc_jack_funcs (funcs);
+		printf ("Trying JACK...\n");
+		if (funcs->init(&hw_caps))
+			return 1;
+	}
 #endif
 
 #ifndef NDEBUG
-		if (!strcasecmp(name, "null")) {
-			null_funcs (funcs);
-			printf ("Trying NULL...\n");
-			if (funcs->init(&hw_caps))
+	if (!strcasecmp(name, "null")) {
+		null_funcs (funcs);
+		printf ("Trying NULL...\n");
+		if (funcs->init(&hw_caps))
+			return 1;
+	}
+#endif
+
+	return 0;
+}
+
+/* Return the name of the driver which worked last time or NULL. */
+static char *read_last_driver ()
+{
+	FILE *file;
+	char name[32];
+	char *nl;
+
+	file = fopen (create_file_name (LAST_DRIVER_FILE), "r");
+	if (!file)
+		return NULL;
+
+	if (!fgets (name, sizeof(name), file))
+		name[0] = 0;
+	fclose (file);
+
+	nl = strchr (name, '\n');
+	if (nl)
+		*nl = 0;
+
+	return name[0] ? xstrdup (name) : NULL;
+}
+
+static void save_last_driver (const char *name)
+{
+	FILE *file;
+
+	file = fopen (create_file_name (LAST_DRIVER_FILE), "w");
+	if (!file) {
+		log_errno ("Can't save the name of the sound driver", errno);
+		return;
+	}
+
+	fprintf (file, "%s\n", name);
+	if (fclose (file) != 0)
+		log_errno ("Can't save the name of the sound driver", errno);
+}
+
+/* Find the first driver on the list which works.  The one which worked
+ * last time is tried first if it's still on the list, so the drivers
+ * before it which aren't running don't make each start wait for their
+ * connection timeouts. */
+static void find_working_driver (lists_t_strs *drivers, struct hw_funcs *funcs)
+{
+	char *last = read_last_driver ();
+	int ix;
+
+	if (last) {
+		for (ix = 0; ix < lists_strs_size (drivers); ix += 1) {
+			if (strcasecmp (lists_strs_at (drivers, ix), last))
+				continue;
+			if (try_driver (last, funcs)) {
+				free (last);
 				return;
+			}
+			break;
 		}
-#endif
 	}
 
+	for (ix = 0; ix < lists_strs_size (drivers); ix += 1) {
+		const char *name;
+
+		name = lists_strs_at (drivers, ix);
+
+		if (last && !strcasecmp (name, last))
+			continue;
+
+		if (try_driver (name, funcs)) {
+			save_last_driver (name);
+			free (last);
+			return;
+		}
+	}
+
+	free (last);
 	fatal ("No valid sound driver!");
 }
 
@@ -1129,13 +1771,16 @@ void audio_initialize ()
 
 	out_buf = out_buf_new (options_get_int("OutputBuffer") * 1024);
 
+	audio_conv_init ();
 	softmixer_init();
 	equalizer_init();
+	dsp_init ();
 
 	plist_init (&playlist);
-	plist_init (&shuffled_plist);
 	plist_init (&queue);
+	plist_init (&file_times);
 	player_init ();
+	tee_out_init ();
 }
 
 void audio_exit ()
@@ -1147,9 +1792,15 @@ void audio_exit ()
 		hw.shutdown ();
 	out_buf_free (out_buf);
 	out_buf = NULL;
+	tee_out_shutdown ();
 	plist_free (&playlist);
-	plist_free (&shuffled_plist);
 	plist_free (&queue);
+	queue_changed ();
+	plist_free (&file_times);
+	if (pending_adds)
+		lists_strs_free (pending_adds);
+	free (shuffled.order);
+	free (shuffled.pos);
 	player_cleanup ();
 	rc = pthread_mutex_destroy (&curr_playing_mtx);
 	if (rc != 0)
@@ -1164,6 +1815,7 @@ void audio_exit ()
 	if (last_stream_url)
 		free (last_stream_url);
 
+	dsp_shutdown ();
 	softmixer_shutdown();
 	equalizer_shutdown();
 }
@@ -1206,22 +1858,34 @@ int audio_get_prev_state ()
 	return prev_state;
 }
 
+/* Add the file to the playlist.  It's put there with the others added
+ * since by audio_plist_flush() or when the playlist is used next. */
 void audio_plist_add (const char *file)
 {
+	LOCK (pending_mtx);
+	if (!pending_adds)
+		pending_adds = lists_strs_new (16);
+	lists_strs_append (pending_adds, file);
+	UNLOCK (pending_mtx);
+}
+
+/* Put the files added since the last time on the playlist. */
+void audio_plist_flush ()
+{
+	LOCK (curr_playing_mtx);
 	LOCK (plist_mtx);
-	plist_clear (&shuffled_plist);
-	if (plist_find_fname(&playlist, file) == -1)
-		plist_add (&playlist, file);
-	else
-		logit ("Wanted to add a file already present: %s", file);
+	apply_pending_adds ();
 	UNLOCK (plist_mtx);
+	UNLOCK (curr_playing_mtx);
 }
 
 void audio_queue_add (const char *file)
 {
 	LOCK (plist_mtx);
-	if (plist_find_fname(&queue, file) == -1)
+	if (plist_find_fname(&queue, file) == -1) {
 		plist_add (&queue, file);
+		queue_changed ();
+	}
 	else
 		logit ("Wanted to add a file already present: %s", file);
 	UNLOCK (plist_mtx);
@@ -1229,16 +1893,24 @@ void audio_queue_add (const char *file)
 
 void audio_plist_clear ()
 {
+	LOCK (pending_mtx);
+	if (pending_adds)
+		lists_strs_clear (pending_adds);
+	UNLOCK (pending_mtx);
+
 	LOCK (plist_mtx);
-	plist_clear (&shuffled_plist);
+	shuffle_clear ();
 	plist_clear (&playlist);
 	UNLOCK (plist_mtx);
+
+	forget_time (NULL);
 }
 
 void audio_queue_clear ()
 {
 	LOCK (plist_mtx);
 	plist_clear (&queue);
+	queue_changed ();
 	UNLOCK (plist_mtx);
 }
 
@@ -1279,26 +1951,34 @@ void audio_plist_delete (const char *file)
 {
 	int num;
 
+	LOCK (curr_playing_mtx);
 	LOCK (plist_mtx);
+	apply_pending_adds ();
 	num = plist_find_fname (&playlist, file);
-	if (num != -1)
+	if (num != -1) {
 		plist_delete (&playlist, num);
-
-	num = plist_find_fname (&shuffled_plist, file);
-	if (num != -1)
-		plist_delete (&shuffled_plist, num);
+		compact_plist (&playlist);
+	}
 	UNLOCK (plist_mtx);
+	UNLOCK (curr_playing_mtx);
+
+	forget_time (file);
 }
 
 void audio_queue_delete (const char *file)
 {
 	int num;
 
+	LOCK (curr_playing_mtx);
 	LOCK (plist_mtx);
 	num = plist_find_fname (&queue, file);
-	if (num != -1)
+	if (num != -1) {
 		plist_delete (&queue, num);
+		compact_plist (&queue);
+		queue_changed ();
+	}
 	UNLOCK (plist_mtx);
+	UNLOCK (curr_playing_mtx);
 }
 
 /* Get the time of a file if the file is on the playlist and
@@ -1306,44 +1986,41 @@ void audio_queue_delete (const char *file)
 int audio_get_ftime (const char *file)
 {
 	int i;
-	int time;
+	int time = -1;
 	time_t mtime;
 
 	mtime = get_mtime (file);
 
-	LOCK (plist_mtx);
-	i = plist_find_fname (&playlist, file);
+	LOCK (times_mtx);
+	i = plist_find_fname (&file_times, file);
 	if (i != -1) {
-		time = get_item_time (&playlist, i);
-		if (time != -1) {
-			if (playlist.items[i].mtime == mtime) {
-				debug ("Found time for %s", file);
-				UNLOCK (plist_mtx);
-				return time;
-			}
-			logit ("mtime for %s has changed", file);
+		if (file_times.items[i].mtime == mtime) {
+			debug ("Found time for %s", file);
+			time = get_item_time (&file_times, i);
 		}
+		else
+			logit ("mtime for %s has changed", file);
 	}
-	UNLOCK (plist_mtx);
+	UNLOCK (times_mtx);
 
-	return -1;
+	return time;
 }
 
-/* Set the time for a file on the playlist. */
+/* Remember the time of a file for audio_get_ftime(). */
 void audio_plist_set_time (const char *file, const int time)
 {
 	int i;
+	time_t mtime;
 
-	LOCK (plist_mtx);
-	if ((i = plist_find_fname(&playlist, file)) != -1) {
-		plist_set_item_time (&playlist, i, time);
-		playlist.items[i].mtime = get_mtime (file);
-		debug ("Setting time for %s", file);
-	}
-	else
-		logit ("Request for updating time for a file not present on the"
-				" playlist!");
-	UNLOCK (plist_mtx);
+	mtime = get_mtime (file);
+
+	LOCK (times_mtx);
+	if ((i = plist_find_fname(&file_times, file)) == -1)
+		i = plist_add (&file_times, file);
+	plist_set_item_time (&file_times, i, time);
+	file_times.items[i].mtime = mtime;
+	debug ("Setting time for %s", file);
+	UNLOCK (times_mtx);
 }
 
 /* Notify that the state was changed (used by the player). */
@@ -1375,31 +2052,50 @@ void audio_plist_set_serial (const int serial)
 /* Swap 2 files on the playlist. */
 void audio_plist_move (const char *file1, const char *file2)
 {
+	LOCK (curr_playing_mtx);
 	LOCK (plist_mtx);
+	apply_pending_adds ();
 	plist_swap_files (&playlist, file1, file2);
 	UNLOCK (plist_mtx);
+	UNLOCK (curr_playing_mtx);
 }
 
 void audio_queue_move (const char *file1, const char *file2)
 {
 	LOCK (plist_mtx);
 	plist_swap_files (&queue, file1, file2);
+	queue_changed ();
 	UNLOCK (plist_mtx);
 }
 
-/* Return a copy of the song queue.  We cannot just return constant
- * pointer, because it will be used in a different thread.
- * It obviously needs to be freed after use. */
-struct plist* audio_queue_get_contents ()
+/* Return the contents of the song queue.  We cannot just return a
+ * pointer to the queue, because it will be used in a different thread,
+ * so it's a copy which must not be changed and must be given back with
+ * audio_queue_release() after use. */
+const struct plist *audio_queue_get_contents ()
 {
-	struct plist *ret = (struct plist *)xmalloc (sizeof(struct plist));
-	plist_init (ret);
+	struct queue_copy *copy;
 
 	LOCK (plist_mtx);
-	plist_cat (ret, &queue);
+	if (!queue_copy) {
+		queue_copy = (struct queue_copy *)xmalloc (
+				sizeof(struct queue_copy));
+		plist_init (&queue_copy->plist);
+		plist_cat (&queue_copy->plist, &queue);
+		queue_copy->refs = 1;
+	}
+	copy = queue_copy;
+	copy->refs++;
 	UNLOCK (plist_mtx);
 
-	return ret;
+	return &copy->plist;
+}
+
+void audio_queue_release (const struct plist *contents)
+{
+	LOCK (plist_mtx);
+	queue_copy_unref ((struct queue_copy *)contents);
+	UNLOCK (plist_mtx);
 }
 
 struct file_tags *audio_get_curr_tags ()
@@ -218,6 +218,44 @@ struct hw_funcs
 	 * \return malloc()ed channel's name.
 	 */
 	char * (*get_mixer_channel_name) ();
+
+	/** Get the period size.
+	 *
+	 * Get the number of frames the device consumes at once, so that
+	 * writes can be sized to it.  This function is optional.
+	 *
+	 * \return Period size in frames or 0 if not known.
+	 */
+	int (*get_period) ();
+
+	/** Get the delay and the free space of the device.
+	 *
+	 * Get how many frames given to play() have not been heard yet and
+	 * how many frames could be written without waiting, as the device
+	 * counts them.  This function is optional, get_buff_fill() is used
+	 * instead.
+	 *
+	 * \param delay Frames not played yet.
+	 * \param avail Frames which fit in the device buffer now.
+	 *
+	 * \return The number of underruns since the last call or -1 on
+	 * error.
+	 */
+	int (*get_delay) (int *delay, int *avail);
+
+	/** Pause or resume the device without closing it.
+	 *
+	 * When pausing, return after the sound given to play() so far has
+	 * been heard and leave the device open but not playing, so that
+	 * play() can go on quickly after resuming.  The device may be
+	 * reset() or closed while paused.  This function is optional; the
+	 * device is closed on pause without it.
+	 *
+	 * \param pause 1 to pause, 0 to resume.
+	 *
+	 * \return 1 on success or 0 otherwise.
+	 */
+	int (*pause) (int pause);
 };
 
 /* Are the parameters p1 and p2 equal? */
@@ -242,18 +280,29 @@ void audio_exit ();
 void audio_seek (const int sec);
 void audio_jump_to (const float sec);
 
+void audio_get_output_params (const struct sound_params *req,
+		struct sound_params *driver);
+int audio_float_wanted (const struct sound_params *params);
+int audio_float_output ();
+int audio_keeps_device (const struct sound_params *params);
 int audio_open (struct sound_params *sound_params);
 int audio_send_buf (const char *buf, const size_t size);
 int audio_send_pcm (const char *buf, const size_t size);
+void audio_fade (char *buf, const size_t size, const int fade_in);
+int audio_pause_device ();
+void audio_resume_device ();
 void audio_reset ();
 int audio_get_bpf ();
 int audio_get_bps ();
 int audio_get_buf_fill ();
+int audio_get_period ();
+int audio_get_delay (int *delay, int *avail);
 void audio_close ();
 float audio_get_time ();
 int audio_get_state ();
 int audio_get_prev_state ();
 void audio_plist_add (const char *file);
+void audio_plist_flush ();
 void audio_plist_clear ();
 char *audio_get_sname ();
 void audio_set_mixer (const int val);
@@ -272,7 +321,8 @@ void audio_queue_add (const char *file);
 void audio_queue_delete (const char *file);
 void audio_queue_clear ();
 void audio_queue_move (const char *file1, const char *file2);
-struct plist* audio_queue_get_contents ();
+const struct plist *audio_queue_get_contents ();
+void audio_queue_release (const struct plist *contents);
 
 #ifdef __cplusplus
 }
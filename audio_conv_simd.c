@@ -0,0 +1,590 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* SSE2, AVX2 and NEON versions of the sample conversion loops in
+ * audio_conversion.c.  They must give exactly the same output as the
+ * scalar code (audio_conv_init() checks this before using them), so they
+ * round with the current rounding mode like lrintf() does and keep the
+ * scalar code's quirks: float is scaled by 2^31 for 16-bit output, by
+ * 2^23 minus one for 24-bit output and 32-bit input is divided by
+ * 2^31 + 1 in double precision.
+ *
+ * All loads and stores are unaligned, and every kernel reads a vector
+ * before writing its (never wider) result, so they can work in place. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && !defined(WORDS_BIGENDIAN)
+# define HAVE_NEON_SIMD 1
+#endif
+
+#if defined(HAVE_X86_SIMD)
+# include <immintrin.h>
+#elif defined(HAVE_NEON_SIMD)
+# include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "audio_conv_simd.h"
+
+/* Scale factors used by the scalar code. */
+#define S16_SCALE 2147483648.0f        /* (float)INT32_MAX */
+#define S24_SCALE 8388608.0f           /* 1 << 23, then minus one */
+#define S32_DIVISOR ((float)INT32_MAX + 1.0)
+
+#ifdef HAVE_X86_SIMD
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* Convert scaled floats to int32 the way lrintf() does: cvtps2dq gives
+ * INT32_MIN for too big values, so they are replaced by INT32_MAX. */
+static inline SSE2 __m128i scaled_to_s32_sse2 (const __m128 f)
+{
+	const __m128 big = _mm_cmpge_ps (f, _mm_set1_ps (S16_SCALE));
+	const __m128i mask = _mm_castps_si128 (big);
+	const __m128i val = _mm_cvtps_epi32 (f);
+
+	return _mm_or_si128 (_mm_andnot_si128 (mask, val),
+	                     _mm_and_si128 (mask, _mm_set1_epi32 (INT32_MAX)));
+}
+
+static SSE2 size_t float_to_s16_sse2 (const float *in, char *out,
+		const size_t samples)
+{
+	const __m128 scale = _mm_set1_ps (S16_SCALE);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i lo, hi;
+
+		lo = scaled_to_s32_sse2 (_mm_mul_ps (_mm_loadu_ps (in + i),
+		                                     scale));
+		hi = scaled_to_s32_sse2 (_mm_mul_ps (_mm_loadu_ps (in + i + 4),
+		                                     scale));
+		lo = _mm_srai_epi32 (lo, 16);
+		hi = _mm_srai_epi32 (hi, 16);
+		_mm_storeu_si128 ((__m128i *)(out + i * 2),
+		                  _mm_packs_epi32 (lo, hi));
+	}
+
+	return i;
+}
+
+static SSE2 size_t s16_to_float_sse2 (const char *in, float *out,
+		const size_t samples)
+{
+	const __m128 scale = _mm_set1_ps (1.0f / 32768.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i v, lo, hi;
+
+		v = _mm_loadu_si128 ((const __m128i *)(in + i * 2));
+		lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16);
+		hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16);
+		_mm_storeu_ps (out + i, _mm_mul_ps (_mm_cvtepi32_ps (lo), scale));
+		_mm_storeu_ps (out + i + 4,
+		               _mm_mul_ps (_mm_cvtepi32_ps (hi), scale));
+	}
+
+	return i;
+}
+
+static SSE2 size_t s32_to_float_sse2 (const char *in, float *out,
+		const size_t samples)
+{
+	const __m128d divisor = _mm_set1_pd (S32_DIVISOR);
+	size_t i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		__m128i v;
+		__m128 lo, hi;
+
+		v = _mm_loadu_si128 ((const __m128i *)(in + i * 4));
+		lo = _mm_cvtpd_ps (_mm_div_pd (_mm_cvtepi32_pd (v), divisor));
+		hi = _mm_cvtpd_ps (_mm_div_pd (_mm_cvtepi32_pd (
+		                   _mm_srli_si128 (v, 8)), divisor));
+		_mm_storeu_ps (out + i, _mm_movelh_ps (lo, hi));
+	}
+
+	return i;
+}
+
+/* XOR whole 16-byte blocks of buf with pattern, return bytes done. */
+static inline SSE2 size_t xor_sse2 (char *buf, const size_t bytes,
+		const uint32_t pattern)
+{
+	const __m128i p = _mm_set1_epi32 ((int32_t)pattern);
+	size_t i;
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		__m128i *v = (__m128i *)(buf + i);
+
+		_mm_storeu_si128 (v, _mm_xor_si128 (_mm_loadu_si128 (v), p));
+	}
+
+	return i;
+}
+
+static SSE2 size_t change_sign_8_sse2 (uint8_t *buf, const size_t samples)
+{
+	return xor_sse2 ((char *)buf, samples, 0x80808080);
+}
+
+static SSE2 size_t change_sign_16_sse2 (uint16_t *buf, const size_t samples)
+{
+	return xor_sse2 ((char *)buf, samples * 2, 0x80008000) / 2;
+}
+
+static SSE2 size_t change_sign_24_sse2 (uint32_t *buf, const size_t samples)
+{
+	return xor_sse2 ((char *)buf, samples * 4, 1 << 23) / 4;
+}
+
+static SSE2 size_t change_sign_32_sse2 (uint32_t *buf, const size_t samples)
+{
+	return xor_sse2 ((char *)buf, samples * 4, 1U << 31) / 4;
+}
+
+static inline SSE2 __m128i bswap_16_sse2_vec (const __m128i v)
+{
+	return _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+}
+
+static SSE2 size_t bswap_16_sse2 (int16_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i *v = (__m128i *)(buf + i);
+
+		_mm_storeu_si128 (v, bswap_16_sse2_vec (_mm_loadu_si128 (v)));
+	}
+
+	return i;
+}
+
+static SSE2 size_t bswap_32_sse2 (int32_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		__m128i *p = (__m128i *)(buf + i);
+		__m128i v = _mm_loadu_si128 (p);
+
+		v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE(2, 3, 0, 1));
+		_mm_storeu_si128 (p, bswap_16_sse2_vec (v));
+	}
+
+	return i;
+}
+
+static inline AVX2 __m256i scaled_to_s32_avx2 (const __m256 f)
+{
+	const __m256 big = _mm256_cmp_ps (f, _mm256_set1_ps (S16_SCALE),
+	                                  _CMP_GE_OQ);
+
+	return _mm256_blendv_epi8 (_mm256_cvtps_epi32 (f),
+	                           _mm256_set1_epi32 (INT32_MAX),
+	                           _mm256_castps_si256 (big));
+}
+
+static AVX2 size_t float_to_s16_avx2 (const float *in, char *out,
+		const size_t samples)
+{
+	const __m256 scale = _mm256_set1_ps (S16_SCALE);
+	size_t i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256i lo, hi, packed;
+
+		lo = scaled_to_s32_avx2 (_mm256_mul_ps (
+		                         _mm256_loadu_ps (in + i), scale));
+		hi = scaled_to_s32_avx2 (_mm256_mul_ps (
+		                         _mm256_loadu_ps (in + i + 8), scale));
+		lo = _mm256_srai_epi32 (lo, 16);
+		hi = _mm256_srai_epi32 (hi, 16);
+
+		/* The pack works on 128-bit lanes, put them back in order. */
+		packed = _mm256_packs_epi32 (lo, hi);
+		packed = _mm256_permute4x64_epi64 (packed,
+		                                   _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256 ((__m256i *)(out + i * 2), packed);
+	}
+
+	return i;
+}
+
+/* Store the low 12 bytes of v. */
+static inline AVX2 void store_12_avx2 (char *out, const __m128i v)
+{
+	int32_t last = _mm_cvtsi128_si32 (_mm_srli_si128 (v, 8));
+
+	_mm_storel_epi64 ((__m128i *)out, v);
+	memcpy (out + 8, &last, sizeof (last));
+}
+
+static AVX2 size_t float_to_s24_3_avx2 (const float *in, char *out,
+		const size_t samples)
+{
+	const __m256 scale = _mm256_set1_ps (S24_SCALE);
+	const __m256 one = _mm256_set1_ps (1.0f);
+	const __m256 min = _mm256_set1_ps (-8388608.0f);
+	const __m256 max = _mm256_set1_ps (8388607.0f);
+	const __m256i pack = _mm256_setr_epi8 (
+	                         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+	                         -1, -1, -1, -1,
+	                         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+	                         -1, -1, -1, -1);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m256 f;
+		__m256i v;
+
+		f = _mm256_sub_ps (_mm256_mul_ps (_mm256_loadu_ps (in + i),
+		                                  scale), one);
+		f = _mm256_min_ps (_mm256_max_ps (f, min), max);
+		v = _mm256_shuffle_epi8 (_mm256_cvtps_epi32 (f), pack);
+
+		store_12_avx2 (out + i * 3, _mm256_castsi256_si128 (v));
+		store_12_avx2 (out + i * 3 + 12,
+		               _mm256_extracti128_si256 (v, 1));
+	}
+
+	return i;
+}
+
+static AVX2 size_t s16_to_float_avx2 (const char *in, float *out,
+		const size_t samples)
+{
+	const __m256 scale = _mm256_set1_ps (1.0f / 32768.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m256i v;
+
+		v = _mm256_cvtepi16_epi32 (_mm_loadu_si128 (
+		                           (const __m128i *)(in + i * 2)));
+		_mm256_storeu_ps (out + i,
+		                  _mm256_mul_ps (_mm256_cvtepi32_ps (v), scale));
+	}
+
+	return i;
+}
+
+static AVX2 size_t s32_to_float_avx2 (const char *in, float *out,
+		const size_t samples)
+{
+	const __m256d divisor = _mm256_set1_pd (S32_DIVISOR);
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i lo, hi;
+
+		lo = _mm_loadu_si128 ((const __m128i *)(in + i * 4));
+		hi = _mm_loadu_si128 ((const __m128i *)(in + i * 4 + 16));
+		_mm_storeu_ps (out + i, _mm256_cvtpd_ps (_mm256_div_pd (
+		               _mm256_cvtepi32_pd (lo), divisor)));
+		_mm_storeu_ps (out + i + 4, _mm256_cvtpd_ps (_mm256_div_pd (
+		               _mm256_cvtepi32_pd (hi), divisor)));
+	}
+
+	return i;
+}
+
+static inline AVX2 size_t xor_avx2 (char *buf, const size_t bytes,
+		const uint32_t pattern)
+{
+	const __m256i p = _mm256_set1_epi32 ((int32_t)pattern);
+	size_t i;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		__m256i *v = (__m256i *)(buf + i);
+
+		_mm256_storeu_si256 (v, _mm256_xor_si256 (
+		                     _mm256_loadu_si256 (v), p));
+	}
+
+	return i;
+}
+
+static AVX2 size_t change_sign_8_avx2 (uint8_t *buf, const size_t samples)
+{
+	return xor_avx2 ((char *)buf, samples, 0x80808080);
+}
+
+static AVX2 size_t change_sign_16_avx2 (uint16_t *buf, const size_t samples)
+{
+	return xor_avx2 ((char *)buf, samples * 2, 0x80008000) / 2;
+}
+
+static AVX2 size_t change_sign_24_avx2 (uint32_t *buf, const size_t samples)
+{
+	return xor_avx2 ((char *)buf, samples * 4, 1 << 23) / 4;
+}
+
+static AVX2 size_t change_sign_32_avx2 (uint32_t *buf, const size_t samples)
+{
+	return xor_avx2 ((char *)buf, samples * 4, 1U << 31) / 4;
+}
+
+/* Reorder bytes of whole 32-byte blocks of buf by shuffle mask. */
+static inline AVX2 size_t shuffle_avx2 (char *buf, const size_t bytes,
+		const __m256i mask)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		__m256i *v = (__m256i *)(buf + i);
+
+		_mm256_storeu_si256 (v, _mm256_shuffle_epi8 (
+		                     _mm256_loadu_si256 (v), mask));
+	}
+
+	return i;
+}
+
+static AVX2 size_t bswap_16_avx2 (int16_t *buf, const size_t samples)
+{
+	const __m256i mask = _mm256_setr_epi8 (
+	                         1, 0, 3, 2, 5, 4, 7, 6,
+	                         9, 8, 11, 10, 13, 12, 15, 14,
+	                         1, 0, 3, 2, 5, 4, 7, 6,
+	                         9, 8, 11, 10, 13, 12, 15, 14);
+
+	return shuffle_avx2 ((char *)buf, samples * 2, mask) / 2;
+}
+
+static AVX2 size_t bswap_32_avx2 (int32_t *buf, const size_t samples)
+{
+	const __m256i mask = _mm256_setr_epi8 (
+	                         3, 2, 1, 0, 7, 6, 5, 4,
+	                         11, 10, 9, 8, 15, 14, 13, 12,
+	                         3, 2, 1, 0, 7, 6, 5, 4,
+	                         11, 10, 9, 8, 15, 14, 13, 12);
+
+	return shuffle_avx2 ((char *)buf, samples * 4, mask) / 4;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+#ifdef HAVE_NEON_SIMD
+
+static size_t float_to_s16_neon (const float *in, char *out,
+		const size_t samples)
+{
+	const float32x4_t scale = vdupq_n_f32 (S16_SCALE);
+	size_t i;
+
+	/* vcvtnq saturates, which is what the scalar code does. */
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int32x4_t lo, hi;
+
+		lo = vcvtnq_s32_f32 (vmulq_f32 (vld1q_f32 (in + i), scale));
+		hi = vcvtnq_s32_f32 (vmulq_f32 (vld1q_f32 (in + i + 4), scale));
+		vst1q_s16 ((int16_t *)(out + i * 2),
+		           vcombine_s16 (vshrn_n_s32 (lo, 16),
+		                         vshrn_n_s32 (hi, 16)));
+	}
+
+	return i;
+}
+
+static size_t float_to_s24_3_neon (const float *in, char *out,
+		const size_t samples)
+{
+	static const uint8_t pack_tab[16] = {
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 16, 16, 16, 16
+	};
+	const uint8x16_t pack = vld1q_u8 (pack_tab);
+	const float32x4_t scale = vdupq_n_f32 (S24_SCALE);
+	const float32x4_t one = vdupq_n_f32 (1.0f);
+	const float32x4_t min = vdupq_n_f32 (-8388608.0f);
+	const float32x4_t max = vdupq_n_f32 (8388607.0f);
+	size_t i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		float32x4_t f;
+		uint8x16_t v;
+		uint32_t last;
+
+		f = vsubq_f32 (vmulq_f32 (vld1q_f32 (in + i), scale), one);
+		f = vminq_f32 (vmaxq_f32 (f, min), max);
+		v = vqtbl1q_u8 (vreinterpretq_u8_s32 (vcvtnq_s32_f32 (f)), pack);
+
+		vst1_u8 ((uint8_t *)(out + i * 3), vget_low_u8 (v));
+		last = vgetq_lane_u32 (vreinterpretq_u32_u8 (v), 2);
+		memcpy (out + i * 3 + 8, &last, sizeof (last));
+	}
+
+	return i;
+}
+
+static size_t s16_to_float_neon (const char *in, float *out,
+		const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		int16x8_t v = vld1q_s16 ((const int16_t *)(in + i * 2));
+
+		vst1q_f32 (out + i, vmulq_n_f32 (vcvtq_f32_s32 (
+		           vmovl_s16 (vget_low_s16 (v))), 1.0f / 32768.0f));
+		vst1q_f32 (out + i + 4, vmulq_n_f32 (vcvtq_f32_s32 (
+		           vmovl_high_s16 (v)), 1.0f / 32768.0f));
+	}
+
+	return i;
+}
+
+static size_t s32_to_float_neon (const char *in, float *out,
+		const size_t samples)
+{
+	const float64x2_t divisor = vdupq_n_f64 (S32_DIVISOR);
+	size_t i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		int32x4_t v = vld1q_s32 ((const int32_t *)(in + i * 4));
+		float64x2_t lo, hi;
+
+		lo = vdivq_f64 (vcvtq_f64_s64 (vmovl_s32 (vget_low_s32 (v))),
+		                divisor);
+		hi = vdivq_f64 (vcvtq_f64_s64 (vmovl_high_s32 (v)), divisor);
+		vst1q_f32 (out + i, vcvt_high_f32_f64 (vcvt_f32_f64 (lo), hi));
+	}
+
+	return i;
+}
+
+static inline size_t xor_neon (char *buf, const size_t bytes,
+		const uint32_t pattern)
+{
+	const uint8x16_t p = vreinterpretq_u8_u32 (vdupq_n_u32 (pattern));
+	size_t i;
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		uint8_t *v = (uint8_t *)(buf + i);
+
+		vst1q_u8 (v, veorq_u8 (vld1q_u8 (v), p));
+	}
+
+	return i;
+}
+
+static size_t change_sign_8_neon (uint8_t *buf, const size_t samples)
+{
+	return xor_neon ((char *)buf, samples, 0x80808080);
+}
+
+static size_t change_sign_16_neon (uint16_t *buf, const size_t samples)
+{
+	return xor_neon ((char *)buf, samples * 2, 0x80008000) / 2;
+}
+
+static size_t change_sign_24_neon (uint32_t *buf, const size_t samples)
+{
+	return xor_neon ((char *)buf, samples * 4, 1 << 23) / 4;
+}
+
+static size_t change_sign_32_neon (uint32_t *buf, const size_t samples)
+{
+	return xor_neon ((char *)buf, samples * 4, 1U << 31) / 4;
+}
+
+static size_t bswap_16_neon (int16_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		uint8_t *v = (uint8_t *)(buf + i);
+
+		vst1q_u8 (v, vrev16q_u8 (vld1q_u8 (v)));
+	}
+
+	return i;
+}
+
+static size_t bswap_32_neon (int32_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		uint8_t *v = (uint8_t *)(buf + i);
+
+		vst1q_u8 (v, vrev32q_u8 (vld1q_u8 (v)));
+	}
+
+	return i;
+}
+
+#endif /* HAVE_NEON_SIMD */
+
+/* Fill kernels with the best vector kernels this CPU supports.  Return
+ * the name of the instruction set or NULL if there is none, in which
+ * case kernels is not changed. */
+const char *audio_conv_simd_kernels (struct conv_kernels *kernels)
+{
+	assert (kernels != NULL);
+
+#if defined(HAVE_X86_SIMD)
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("avx2")) {
+		kernels->float_to_s16 = float_to_s16_avx2;
+		kernels->float_to_s24_3 = float_to_s24_3_avx2;
+		kernels->s16_to_float = s16_to_float_avx2;
+		kernels->s32_to_float = s32_to_float_avx2;
+		kernels->change_sign_8 = change_sign_8_avx2;
+		kernels->change_sign_16 = change_sign_16_avx2;
+		kernels->change_sign_24 = change_sign_24_avx2;
+		kernels->change_sign_32 = change_sign_32_avx2;
+		kernels->swap_16 = bswap_16_avx2;
+		kernels->swap_32 = bswap_32_avx2;
+		return "AVX2";
+	}
+
+	if (__builtin_cpu_supports ("sse2")) {
+		kernels->float_to_s16 = float_to_s16_sse2;
+		kernels->s16_to_float = s16_to_float_sse2;
+		kernels->s32_to_float = s32_to_float_sse2;
+		kernels->change_sign_8 = change_sign_8_sse2;
+		kernels->change_sign_16 = change_sign_16_sse2;
+		kernels->change_sign_24 = change_sign_24_sse2;
+		kernels->change_sign_32 = change_sign_32_sse2;
+		kernels->swap_16 = bswap_16_sse2;
+		kernels->swap_32 = bswap_32_sse2;
+		return "SSE2";
+	}
+#elif defined(HAVE_NEON_SIMD)
+	kernels->float_to_s16 = float_to_s16_neon;
+	kernels->float_to_s24_3 = float_to_s24_3_neon;
+	kernels->s16_to_float = s16_to_float_neon;
+	kernels->s32_to_float = s32_to_float_neon;
+	kernels->change_sign_8 = change_sign_8_neon;
+	kernels->change_sign_16 = change_sign_16_neon;
+	kernels->change_sign_24 = change_sign_24_neon;
+	kernels->change_sign_32 = change_sign_32_neon;
+	kernels->swap_16 = bswap_16_neon;
+	kernels->swap_32 = bswap_32_neon;
+	return "NEON";
+#endif
+
+	return NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef AUDIO_CONV_SIMD_H
+#define AUDIO_CONV_SIMD_H
+
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#endif
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Vectorised versions of the hot sample conversion loops.  Each kernel
+ * converts as many whole vectors as fit in samples and returns how many
+ * samples it has done; the caller finishes the rest with the scalar code.
+ * A NULL entry means there is no vector version. */
+struct conv_kernels
+{
+	size_t (*float_to_s16) (const float *in, char *out,
+	                        const size_t samples);
+	size_t (*float_to_s24_3) (const float *in, char *out,
+	                          const size_t samples);
+	size_t (*s16_to_float) (const char *in, float *out,
+	                        const size_t samples);
+	size_t (*s32_to_float) (const char *in, float *out,
+	                        const size_t samples);
+	size_t (*change_sign_8) (uint8_t *buf, const size_t samples);
+	size_t (*change_sign_16) (uint16_t *buf, const size_t samples);
+	size_t (*change_sign_24) (uint32_t *buf, const size_t samples);
+	size_t (*change_sign_32) (uint32_t *buf, const size_t samples);
+	size_t (*swap_16) (int16_t *buf, const size_t samples);
+	size_t (*swap_32) (int32_t *buf, const size_t samples);
+};
+
+const char *audio_conv_simd_kernels (struct conv_kernels *kernels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -21,6 +21,7 @@
 #endif
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
@@ -36,6 +37,15 @@
 #include "audio_conversion.h"
 #include "log.h"
 #include "options.h"
+#include "audio_conv_simd.h"
+
+/* Vector kernels picked by audio_conv_init(). */
+static struct conv_kernels kernels;
+
+/* Run the vector kernel if there is one and return the number of samples
+ * it has converted, the scalar loop does the rest. */
+#define VECTOR_PART(kernel, ...) \
+	(kernels.kernel ? kernels.kernel (__VA_ARGS__) : 0)
 
 static void float_to_u8 (const float *in, unsigned char *out, const size_t samples)
 {
@@ -103,7 +113,7 @@ static void float_to_s16 (const float *in, char *out, const size_t samples)
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++) {
+	for (i = VECTOR_PART(float_to_s16, in, out, samples); i < samples; i++) {
 		int16_t *out_val = (int16_t *)(out + i * sizeof (int16_t));
 		float f = in[i] * INT32_MAX;
 
@@ -191,7 +201,7 @@ static void float_to_s24_3 (const float *in, char *out, const size_t samples)
 	assert (out != NULL);
 
 	int32_t out_i;
-	for (i = 0; i < samples; i++) {
+	for (i = VECTOR_PART(float_to_s24_3, in, out, samples); i < samples; i++) {
 		int8_t *out_val = (int8_t *)(out + 3*i);
 		float f = in[i] * S24_MAX;
 
@@ -295,8 +305,8 @@ static void s16_to_float (const char *in, float *out, const size_t samples)
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++)
-		out[i] = *in_16++ / (float)(INT16_MAX + 1);
+	for (i = VECTOR_PART(s16_to_float, in, out, samples); i < samples; i++)
+		out[i] = in_16[i] / (float)(INT16_MAX + 1);
 }
 
 static void u24_to_float (const unsigned char *in, float *out,
@@ -384,69 +394,48 @@ static void s32_to_float (const char *in, float *out, const size_t samples)
 	assert (in != NULL);
 	assert (out != NULL);
 
-	for (i = 0; i < samples; i++)
-		out[i] = *in_32++ / ((float)INT32_MAX + 1.0);
+	for (i = VECTOR_PART(s32_to_float, in, out, samples); i < samples; i++)
+		out[i] = in_32[i] / ((float)INT32_MAX + 1.0);
 }
 
-/* Convert fixed point samples in format fmt (size in bytes) to float.
- * Size of converted sound is put in new_size. Returned memory is malloc()ed. */
-static float *fixed_to_float (const char *buf, const size_t size,
-		const long fmt, size_t *new_size)
+/* Convert fixed point samples in format fmt (size in bytes) to float
+ * samples in out.  out may be the same buffer as buf for 32-bit formats. */
+static void fixed_to_float (const char *buf, const size_t size,
+		const long fmt, float *out)
 {
-	float *out = NULL;
 	char fmt_name[SFMT_STR_MAX];
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
 
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
-			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			u8_to_float ((unsigned char *)buf, out, size);
 			break;
 		case SFMT_S8:
-			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			s8_to_float (buf, out, size);
 			break;
 		case SFMT_U16:
-			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
 			u16_to_float ((unsigned char *)buf, out, size / 2);
 			break;
 		case SFMT_S16:
-			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
 			s16_to_float (buf, out, size / 2);
 			break;
 		case SFMT_U24:
-			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			u24_to_float ((unsigned char *)buf, out, size / 4);
 			break;
 		case SFMT_S24:
-			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			s24_to_float (buf, out, size / 4);
 			break;
 		case SFMT_S24_3:
-			*new_size = sizeof(float) * size / 3;
-			out = (float *)xmalloc (*new_size);
 			s24_3_to_float (buf, out, size / 3);
 			break;
 		case SFMT_U24_3:
-			*new_size = sizeof(float) * size / 3;
-			out = (float *)xmalloc (*new_size);
 			u24_3_to_float (buf, out, size / 3);
 			break;
 		case SFMT_U32:
-			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			u32_to_float ((unsigned char *)buf, out, size / 4);
 			break;
 		case SFMT_S32:
-			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			s32_to_float (buf, out, size / 4);
 			break;
 		default:
@@ -454,114 +443,103 @@ static float *fixed_to_float (const char *buf, const size_t size,
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return out;
 }
 
-/* Convert float samples to fixed point format fmt. Returned samples of size
- * new_size bytes is malloc()ed. */
-static char *float_to_fixed (const float *buf, const size_t samples,
-		const long fmt, size_t *new_size)
+/* Convert float samples to fixed point format fmt in out.  No format is
+ * wider than float, so out may be the same buffer as buf. */
+static void float_to_fixed (const float *buf, const size_t samples,
+		const long fmt, char *out)
 {
 	char fmt_name[SFMT_STR_MAX];
-	char *new_snd = NULL;
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
 
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
-			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
-			float_to_u8 (buf, (unsigned char *)new_snd, samples);
+			float_to_u8 (buf, (unsigned char *)out, samples);
 			break;
 		case SFMT_S8:
-			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
-			float_to_s8 (buf, new_snd, samples);
+			float_to_s8 (buf, out, samples);
 			break;
 		case SFMT_U16:
-			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_u16 (buf, (unsigned char *)new_snd, samples);
+			float_to_u16 (buf, (unsigned char *)out, samples);
 			break;
 		case SFMT_S16:
-			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s16 (buf, new_snd, samples);
+			float_to_s16 (buf, out, samples);
 			break;
 		case SFMT_U24:
-			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_u24 (buf, (unsigned char *)new_snd, samples);
+			float_to_u24 (buf, (unsigned char *)out, samples);
 			break;
 		case SFMT_S24:
-			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s24 (buf, new_snd, samples);
+			float_to_s24 (buf, out, samples);
 			break;
 		case SFMT_U24_3:
-			*new_size = samples * 3;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_u24_3 (buf, (unsigned char *)new_snd, samples);
+			float_to_u24_3 (buf, (unsigned char *)out, samples);
 			break;
 		case SFMT_S24_3:
-			*new_size = samples * 3;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s24_3 (buf, new_snd, samples);
+			float_to_s24_3 (buf, out, samples);
 			break;
 		case SFMT_U32:
-			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_u32 (buf, (unsigned char *)new_snd, samples);
+			float_to_u32 (buf, (unsigned char *)out, samples);
 			break;
 		case SFMT_S32:
-			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s32 (buf, new_snd, samples);
+			float_to_s32 (buf, out, samples);
 			break;
 		default:
 			error ("Can't convert from float to %s!",
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return new_snd;
 }
 
 static inline void change_sign_8 (uint8_t *buf, const size_t samples)
 {
 	size_t i;
 
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 7;
+	for (i = VECTOR_PART(change_sign_8, buf, samples); i < samples; i++)
+		buf[i] ^= 1 << 7;
 }
 
 static inline void change_sign_16 (uint16_t *buf, const size_t samples)
 {
 	size_t i;
 
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 15;
+	for (i = VECTOR_PART(change_sign_16, buf, samples); i < samples; i++)
+		buf[i] ^= 1 << 15;
 }
 
 static inline void change_sign_24 (uint32_t *buf, const size_t samples)
 {
 	size_t i;
 
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 23;
+	for (i = VECTOR_PART(change_sign_24, buf, samples); i < samples; i++)
+		buf[i] ^= 1 << 23;
 }
 
 static inline void change_sign_32 (uint32_t *buf, const size_t samples)
 {
 	size_t i;
 
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 31;
+	for (i = VECTOR_PART(change_sign_32, buf, samples); i < samples; i++)
+		buf[i] ^= 1 << 31;
 }
 
 /* Change the signs of samples in format *fmt.  Also changes fmt to the new
  * format. */
+/* The samples are in the native endianness, flip the most significant
+ * byte. */
+static void change_sign_24_3 (uint8_t *buf, const size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+#ifdef WORDS_BIGENDIAN
+		buf[i * 3] ^= 0x80;
+#else
+		buf[i * 3 + 2] ^= 0x80;
+#endif
+}
+
 static void change_sign (char *buf, const size_t size, long *fmt)
 {
 	char fmt_name[SFMT_STR_MAX];
@@ -599,6 +577,14 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 			else
 				*fmt = sfmt_set_fmt (*fmt, SFMT_S32);
 			break;
+		case SFMT_S24_3:
+		case SFMT_U24_3:
+			change_sign_24_3 ((uint8_t *)buf, size / 3);
+			if (*fmt & SFMT_S24_3)
+				*fmt = sfmt_set_fmt (*fmt, SFMT_U24_3);
+			else
+				*fmt = sfmt_set_fmt (*fmt, SFMT_S24_3);
+			break;
 		default:
 			error ("Request for changing sign of unknown format: %s",
 			       sfmt_str (*fmt, fmt_name, sizeof (fmt_name)));
@@ -610,7 +596,7 @@ static inline void audio_conv_bswap_16 (int16_t *buf, const size_t num)
 {
 	size_t i;
 
-	for (i = 0; i < num; i++)
+	for (i = VECTOR_PART(swap_16, buf, num); i < num; i++)
 		buf[i] = bswap_16 (buf[i]);
 }
 
@@ -630,7 +616,7 @@ static inline void audio_conv_bswap_32 (int32_t *buf, const size_t num)
 {
 	size_t i;
 
-	for (i = 0; i < num; i++)
+	for (i = VECTOR_PART(swap_32, buf, num); i < num; i++)
 		buf[i] = bswap_32 (buf[i]);
 }
 
@@ -662,8 +648,258 @@ static void swap_endian (char *buf, const size_t size, const long fmt)
 	}
 }
 
+/* Convert size bytes of native endian fixed point samples in format fmt
+ * to float samples in out. */
+void audio_conv_to_float (const char *buf, const size_t size,
+		const long fmt, float *out)
+{
+	fixed_to_float (buf, size, fmt, out);
+}
+
+/* Convert float samples to native endian fixed point samples in format
+ * fmt.  out may be the same buffer as buf. */
+void audio_conv_from_float (const float *buf, const size_t samples,
+		const long fmt, char *out)
+{
+	float_to_fixed (buf, samples, fmt, out);
+}
+
+/* Swap the byte order of fixed point samples in place. */
+void audio_conv_swap_endian (char *buf, const size_t size, const long fmt)
+{
+	swap_endian (buf, size, fmt);
+}
+
+/* Number of samples the vector kernels are checked on, not a multiple of
+ * any vector size so that the scalar tails are checked too. */
+#define CHECK_SAMPLES 1037
+
+typedef void check_fn (const char *in, char *out);
+
+static void check_float_to_s16 (const char *in, char *out)
+{
+	float_to_s16 ((const float *)in, out, CHECK_SAMPLES);
+}
+
+static void check_float_to_s24_3 (const char *in, char *out)
+{
+	float_to_s24_3 ((const float *)in, out, CHECK_SAMPLES);
+}
+
+static void check_s16_to_float (const char *in, char *out)
+{
+	s16_to_float (in, (float *)out, CHECK_SAMPLES);
+}
+
+static void check_s32_to_float (const char *in, char *out)
+{
+	s32_to_float (in, (float *)out, CHECK_SAMPLES);
+}
+
+static void check_change_sign_8 (const char *in, char *out)
+{
+	memcpy (out, in, CHECK_SAMPLES);
+	change_sign_8 ((uint8_t *)out, CHECK_SAMPLES);
+}
+
+static void check_change_sign_16 (const char *in, char *out)
+{
+	memcpy (out, in, CHECK_SAMPLES * 2);
+	change_sign_16 ((uint16_t *)out, CHECK_SAMPLES);
+}
+
+static void check_change_sign_24 (const char *in, char *out)
+{
+	memcpy (out, in, CHECK_SAMPLES * 4);
+	change_sign_24 ((uint32_t *)out, CHECK_SAMPLES);
+}
+
+static void check_change_sign_32 (const char *in, char *out)
+{
+	memcpy (out, in, CHECK_SAMPLES * 4);
+	change_sign_32 ((uint32_t *)out, CHECK_SAMPLES);
+}
+
+static void check_swap_16 (const char *in, char *out)
+{
+	memcpy (out, in, CHECK_SAMPLES * 2);
+	audio_conv_bswap_16 ((int16_t *)out, CHECK_SAMPLES);
+}
+
+static void check_swap_32 (const char *in, char *out)
+{
+	memcpy (out, in, CHECK_SAMPLES * 4);
+	audio_conv_bswap_32 ((int32_t *)out, CHECK_SAMPLES);
+}
+
+/* Fill in with the same test samples every time: floats covering the
+ * full scale, clipping and rounding edges or random bytes. */
+static void fill_check_input (char *in, const bool floats)
+{
+	const float edges[] = {
+		0.0f, -0.0f, 1.0f, -1.0f, 1.5f, -1.5f, 0.99999994f,
+		-0.99999994f, 1.0f / 65536.0f, -1.0f / 65536.0f,
+		1.5f / 65536.0f, -1.5f / 65536.0f, 0.5f / 8388608.0f,
+		1.5f / 8388608.0f, -2.5f / 8388608.0f, 1e-30f
+	};
+	uint32_t seed = 0x2545f491;
+	size_t i;
+
+	for (i = 0; i < CHECK_SAMPLES; i++) {
+		seed = seed * 1103515245 + 12345;
+
+		if (!floats)
+			memcpy (in + i * 4, &seed, sizeof (seed));
+		else if (i < ARRAY_SIZE(edges))
+			((float *)in)[i] = edges[i];
+		else
+			((float *)in)[i] = (int32_t)seed / 2147483648.0f * 1.1f;
+	}
+}
+
+/* Return true if the test gives the same output with the vector kernels
+ * as with the scalar code. */
+static bool kernel_is_exact (const struct conv_kernels *simd,
+		check_fn *test, const bool float_input)
+{
+	char *in = xmalloc (CHECK_SAMPLES * 4);
+	char *scalar_out = xcalloc (CHECK_SAMPLES, 4);
+	char *simd_out = xcalloc (CHECK_SAMPLES, 4);
+	bool exact;
+
+	fill_check_input (in, float_input);
+
+	memset (&kernels, 0, sizeof (kernels));
+	test (in, scalar_out);
+	kernels = *simd;
+	test (in, simd_out);
+	memset (&kernels, 0, sizeof (kernels));
+
+	exact = !memcmp (scalar_out, simd_out, CHECK_SAMPLES * 4);
+
+	free (in);
+	free (scalar_out);
+	free (simd_out);
+
+	return exact;
+}
+
+#define CHECK_KERNEL(kernel, float_input) \
+	do { \
+		if (simd.kernel && !kernel_is_exact (&simd, check_##kernel, \
+		                                     float_input)) { \
+			logit ("%s " #kernel " is not exact, not using it", \
+			       isa); \
+			simd.kernel = NULL; \
+		} \
+	} while (0)
+
+/* Pick the vector kernels for the sample conversion loops.  Each one is
+ * checked against the scalar code on the test samples first and not used
+ * unless its output is bit-exact, so a compiler or CPU quirk costs speed
+ * rather than changing the sound. */
+void audio_conv_init ()
+{
+	struct conv_kernels simd;
+	const char *isa;
+
+	memset (&simd, 0, sizeof (simd));
+	isa = audio_conv_simd_kernels (&simd);
+	if (!isa) {
+		logit ("No vector sample conversion kernels");
+		return;
+	}
+
+	CHECK_KERNEL(float_to_s16, true);
+	CHECK_KERNEL(float_to_s24_3, true);
+	CHECK_KERNEL(s16_to_float, false);
+	CHECK_KERNEL(s32_to_float, false);
+	CHECK_KERNEL(change_sign_8, false);
+	CHECK_KERNEL(change_sign_16, false);
+	CHECK_KERNEL(change_sign_24, false);
+	CHECK_KERNEL(change_sign_32, false);
+	CHECK_KERNEL(swap_16, false);
+	CHECK_KERNEL(swap_32, false);
+
+	kernels = simd;
+
+	logit ("Using %s sample conversion kernels", isa);
+}
+
 /* Initialize the audio_conversion structure for conversion between parameters
  * from and to. Return 0 on error. */
+#ifdef HAVE_SAMPLERATE
+/* Return the libsamplerate converter for the ResampleMethod name or -1
+ * if there is no such method. */
+static int resample_type (const char *method)
+{
+	if (!strcasecmp(method, "SincBestQuality"))
+		return SRC_SINC_BEST_QUALITY;
+	if (!strcasecmp(method, "SincMediumQuality"))
+		return SRC_SINC_MEDIUM_QUALITY;
+	if (!strcasecmp(method, "SincFastest"))
+		return SRC_SINC_FASTEST;
+	if (!strcasecmp(method, "ZeroOrderHold"))
+		return SRC_ZERO_ORDER_HOLD;
+	if (!strcasecmp(method, "Linear"))
+		return SRC_LINEAR;
+
+	return -1;
+}
+
+/* Put the name of the method to resample sound at this rate in method.
+ * The entries of ResampleMethodByRate look like "SincFastest(44100,22050)"
+ * and the first one listing the rate wins, otherwise it's ResampleMethod. */
+static void resample_method (const int rate, char *method,
+		const size_t size)
+{
+	int ix;
+	lists_t_strs *by_rate = options_get_list ("ResampleMethodByRate");
+
+	for (ix = 0; ix < lists_strs_size (by_rate); ix++) {
+		const char *entry = lists_strs_at (by_rate, ix);
+		const char *args = strchr (entry, '(');
+		char *end;
+
+		if (!args)
+			continue;
+
+		for (end = (char *)args; *end == '(' || *end == ','; ) {
+			long r = strtol (end + 1, &end, 10);
+
+			if (r == rate) {
+				snprintf (method, size, "%.*s",
+				          (int)(args - entry), entry);
+				return;
+			}
+		}
+	}
+
+	snprintf (method, size, "%s", options_get_symb ("ResampleMethod"));
+}
+#endif
+
+/* Can sound be converted between the parameters?  Like audio_conv_new(),
+ * but only checks, quietly. */
+int audio_conv_possible (const struct sound_params *from,
+		const struct sound_params *to)
+{
+	if (from->channels != to->channels
+			&& !((from->channels == 1 || from->channels == 6)
+			     && to->channels == 2))
+		return 0;
+
+	if (from->rate != to->rate) {
+#ifdef HAVE_SAMPLERATE
+		return options_get_int("EnableResample") != 0;
+#else
+		return 0;
+#endif
+	}
+
+	return 1;
+}
+
 int audio_conv_new (struct audio_conversion *conv,
 		const struct sound_params *from,
 		const struct sound_params *to)
@@ -687,24 +923,15 @@ int audio_conv_new (struct audio_conversion *conv,
 			return 0;
 		}
 #ifdef HAVE_SAMPLERATE
-		int err;
-		int resample_type = -1;
-		char *method = options_get_symb ("ResampleMethod");
-
-		if (!strcasecmp(method, "SincBestQuality"))
-			resample_type = SRC_SINC_BEST_QUALITY;
-		else if (!strcasecmp(method, "SincMediumQuality"))
-			resample_type = SRC_SINC_MEDIUM_QUALITY;
-		else if (!strcasecmp(method, "SincFastest"))
-			resample_type = SRC_SINC_FASTEST;
-		else if (!strcasecmp(method, "ZeroOrderHold"))
-			resample_type = SRC_ZERO_ORDER_HOLD;
-		else if (!strcasecmp(method, "Linear"))
-			resample_type = SRC_LINEAR;
-		else
+		int err, type;
+		char method[32];
+
+		resample_method (from->rate, method, sizeof (method));
+		type = resample_type (method);
+		if (type == -1)
 			fatal ("Bad ResampleMethod option: %s", method);
 
-		conv->src_state = src_new (resample_type, from->channels, &err);
+		conv->src_state = src_new (type, from->channels, &err);
 		if (!conv->src_state) {
 			error ("Can't resample from %dHz to %dHz: %s",
 					from->rate, to->rate, src_strerror (err));
@@ -727,42 +954,104 @@ int audio_conv_new (struct audio_conversion *conv,
 #ifdef HAVE_SAMPLERATE
 	conv->resample_buf = NULL;
 	conv->resample_buf_nsamples = 0;
+	conv->resample_buf_size = 0;
 #endif
 
+	conv->work_buf[0] = conv->work_buf[1] = NULL;
+	conv->work_buf_size[0] = conv->work_buf_size[1] = 0;
+
 	return 1;
 }
 
+/* Return the work buffer which does not hold curr, grown to at least
+ * size bytes.  The buffers only grow, so after the first few chunks
+ * the conversion works without allocating memory. */
+static char *other_work_buf (struct audio_conversion *conv, const char *curr,
+		const size_t size)
+{
+	int i = (curr == conv->work_buf[0]) ? 1 : 0;
+
+	if (conv->work_buf_size[i] < size) {
+		free (conv->work_buf[i]);
+		conv->work_buf[i] = (char *)xmalloc (size);
+		conv->work_buf_size[i] = size;
+	}
+
+	return conv->work_buf[i];
+}
+
+/* Return the buffer a stage should write its size bytes of output to.
+ * Stages which can work in place reuse curr if it is one of our work
+ * buffers and is big enough; the caller's buffer is never modified. */
+static char *stage_buf (struct audio_conversion *conv, const char *curr,
+		const size_t size, const bool in_place)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (in_place && curr == conv->work_buf[i]
+		             && size <= conv->work_buf_size[i])
+			return conv->work_buf[i];
+	}
+
+	return other_work_buf (conv, curr, size);
+}
+
+/* Return curr as a buffer which can be modified in place, copying it to
+ * a work buffer if it still is the caller's buffer. */
+static char *writable_buf (struct audio_conversion *conv, const char *curr,
+		const size_t size)
+{
+	char *out = stage_buf (conv, curr, size, true);
+
+	if (out != curr)
+		memcpy (out, curr, size);
+
+	return out;
+}
+
 #ifdef HAVE_SAMPLERATE
+/* Resample the float samples from buf into one of the work buffers.
+ * Frames the converter doesn't take this time are kept in resample_buf
+ * and go in front of the next call's samples.  Return the buffer or
+ * NULL on error. */
 static float *resample_sound (struct audio_conversion *conv, const float *buf,
 		const size_t samples, const int nchannels, size_t *resampled_samples)
 {
 	SRC_DATA resample_data;
 	float *output;
-	float *new_input_start;
-	int output_samples = 0;
+	size_t output_samples = 0, left;
 
 	resample_data.end_of_input = 0;
 	resample_data.src_ratio = conv->to.rate / (double)conv->from.rate;
 
-	resample_data.input_frames = samples / nchannels
-		+ conv->resample_buf_nsamples / nchannels;
-	resample_data.output_frames = resample_data.input_frames
-		* resample_data.src_ratio;
+	if (conv->resample_buf_nsamples) {
+		size_t needed = conv->resample_buf_nsamples + samples;
+
+		if (needed > conv->resample_buf_size) {
+			conv->resample_buf = xrealloc (conv->resample_buf,
+			                               needed * sizeof(float));
+			conv->resample_buf_size = needed;
+		}
 
-	assert (conv->resample_buf || conv->resample_buf_nsamples == 0);
-	conv->resample_buf = xrealloc (conv->resample_buf,
-	                               sizeof(float) * nchannels *
-	                               resample_data.input_frames);
-	new_input_start = conv->resample_buf + conv->resample_buf_nsamples;
+		memcpy (conv->resample_buf + conv->resample_buf_nsamples,
+		        buf, samples * sizeof(float));
+		resample_data.data_in = conv->resample_buf;
+		resample_data.input_frames = needed / nchannels;
+	}
+	else {
 
-	output = (float *)xmalloc (sizeof(float) * resample_data.output_frames
-				* nchannels);
+		/* Nothing left over, so feed the converter directly. */
+		resample_data.data_in = (float *)buf;
+		resample_data.input_frames = samples / nchannels;
+	}
 
-	/*debug ("Resampling %lu bytes of data by ratio %f", (unsigned long)size,
-			resample_data.src_ratio);*/
+	resample_data.output_frames = resample_data.input_frames
+		* resample_data.src_ratio;
 
-	memcpy (new_input_start, buf, samples * sizeof(float));
-	resample_data.data_in = conv->resample_buf;
+	output = (float *)other_work_buf (conv, (const char *)buf,
+	                                  sizeof(float) * nchannels *
+	                                  resample_data.output_frames);
 	resample_data.data_out = output;
 
 	do {
@@ -770,7 +1059,6 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 
 		if ((err = src_process(conv->src_state, &resample_data))) {
 			error ("Can't resample: %s", src_strerror (err));
-			free (output);
 			return NULL;
 		}
 
@@ -786,59 +1074,44 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 
 	*resampled_samples = output_samples;
 
-	if (resample_data.input_frames) {
-		conv->resample_buf_nsamples = resample_data.input_frames
-			* nchannels;
-		if (conv->resample_buf != resample_data.data_in) {
-			float *new;
-
-			new = (float *)xmalloc (sizeof(float) *
-					conv->resample_buf_nsamples);
-			memcpy (new, resample_data.data_in, sizeof(float) *
-					conv->resample_buf_nsamples);
-			free (conv->resample_buf);
-			conv->resample_buf = new;
-		}
-	}
-	else {
+	left = resample_data.input_frames * nchannels;
+	if (left > conv->resample_buf_size) {
 		free (conv->resample_buf);
-		conv->resample_buf = NULL;
-		conv->resample_buf_nsamples = 0;
+		conv->resample_buf = (float *)xmalloc (left * sizeof(float));
+		conv->resample_buf_size = left;
 	}
+	if (left)
+		memmove (conv->resample_buf, resample_data.data_in,
+		         left * sizeof(float));
+	conv->resample_buf_nsamples = left;
 
 	return output;
 }
 #endif
 
-/* Double the channels from */
-static char *mono_to_stereo (const char *mono, const size_t size,
-		const long format)
+/* Double the channels from mono into stereo, which must not overlap. */
+static void mono_to_stereo (const char *mono, const size_t size,
+		const long format, char *stereo)
 {
 	int Bps = sfmt_Bps (format);
 	size_t i;
-	char *stereo;
-
-	stereo = (char *)xmalloc (size * 2);
 
 	for (i = 0; i < size; i += Bps) {
 		memcpy (stereo + (i * 2), mono + i, Bps);
 		memcpy (stereo + (i * 2 + Bps), mono + i, Bps);
 	}
-
-	return stereo;
 }
 
-/* DPL downmix: 5.1 -> stereo */
-static char *ch6_to_stereo (const char *ch6, const size_t size,
-		const long format)
+/* DPL downmix: 5.1 -> stereo.  Each frame is read before its output is
+ * written, so stereo may be the same buffer as ch6. */
+static void ch6_to_stereo (const char *ch6, const size_t size,
+		const long format, char *stereo)
 {
 	debug("Downmixing from 5.1 to 2.0");
 	int Bps = sfmt_Bps (format);
 	size_t i;
 	int j,k;
-	char *stereo;
 
-	stereo = (char *)xmalloc (size / 3);
 	float a[2][6]; //downmix matrix
 a[0][0] = 1.0; a[0][2]=0.707; a[0][1]=0; a[0][4]=-0.8165; a[0][5]= -0.5774; a[0][3]=0.707;
 a[1][0] = 0; a[1][2]=0.707; a[1][1]=1.0; a[1][4]= 0.5774; a[1][5]=0.8165; a[1][3]=0.707;
@@ -897,107 +1170,82 @@ a[1][0] = 0; a[1][2]=0.707; a[1][1]=1.0; a[1][4]= 0.5774; a[1][5]=0.8165; a[1][3
 	error("Can't downsample that sample format yet.");
 	abort ();
 	}
-	return stereo;
 }
 
-static int8_t *s32_to_s24_3 (int32_t *in, const size_t samples)
+/* The narrowing conversions below read each sample before writing its
+ * (smaller) result, so they can all work in place. */
+
+static void s32_to_s24_3 (const int32_t *in, int8_t *out, const size_t samples)
 {
 	size_t i;
-	int8_t *new;
-
-	new = (int8_t *)xmalloc (samples * 3);
 
 	for (i = 0; i < samples; i++)
 	{
-		new[3*i] = (in[i]&0x0000FF00)>>8;
-		new[3*i+1] = (in[i]&0x00FF0000)>>16;
-		new[3*i+2] = (in[i]&0xFF000000)>>24;
+		int32_t sample = in[i];
+
+		out[3*i] = (sample&0x0000FF00)>>8;
+		out[3*i+1] = (sample&0x00FF0000)>>16;
+		out[3*i+2] = (sample&0xFF000000)>>24;
 	}
-	return new;
 }
 
 
-static int16_t *s32_to_s16 (int32_t *in, const size_t samples)
+static void s32_to_s16 (const int32_t *in, int16_t *out, const size_t samples)
 {
 	size_t i;
-	int16_t *new;
-
-	new = (int16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 16;
-
-	return new;
+		out[i] = in[i] >> 16;
 }
 
-static uint16_t *u32_to_u16 (uint32_t *in, const size_t samples)
+static void u32_to_u16 (const uint32_t *in, uint16_t *out,
+		const size_t samples)
 {
 	size_t i;
-	uint16_t *new;
-
-	new = (uint16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 16;
-
-	return new;
+		out[i] = in[i] >> 16;
 }
 
-static int32_t *s32_to_s24 (int32_t *in, const size_t samples)
+static void s32_to_s24 (const int32_t *in, int32_t *out, const size_t samples)
 {
 	size_t i;
-	int32_t *new;
-
-	new = (int32_t *)xmalloc (samples * 4);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 8;
-
-	return new;
+		out[i] = in[i] >> 8;
 }
 
-static uint32_t *u32_to_u24 (uint32_t *in, const size_t samples)
+static void u32_to_u24 (const uint32_t *in, uint32_t *out,
+		const size_t samples)
 {
 	size_t i;
-	uint32_t *new;
-
-	new = (uint32_t *)xmalloc (samples * 4);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 8;
-
-	return new;
+		out[i] = in[i] >> 8;
 }
 
-static int16_t *s24_to_s16 (int32_t *in, const size_t samples)
+static void s24_to_s16 (const int32_t *in, int16_t *out, const size_t samples)
 {
 	size_t i;
-	int16_t *new;
-
-	new = (int16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 8;
-
-	return new;
+		out[i] = in[i] >> 8;
 }
 
-static uint16_t *u24_to_u16 (uint32_t *in, const size_t samples)
+static void u24_to_u16 (const uint32_t *in, uint16_t *out,
+		const size_t samples)
 {
 	size_t i;
-	uint16_t *new;
-
-	new = (uint16_t *)xmalloc (samples * 2);
 
 	for (i = 0; i < samples; i++)
-		new[i] = in[i] >> 8;
-
-	return new;
+		out[i] = in[i] >> 8;
 }
 
 /* Do the sound conversion.  buf of length size is the sample buffer to
  * convert and the size of the converted sound is put into *conv_len.
- * Return the converted sound in malloc()ed memory.
+ * Return the converted sound or NULL on error.  The result lives in one
+ * of the conversion's work buffers (buf itself is never modified) and
+ * stays valid until the next call or audio_conv_destroy().
  *
  * Conversion workflow:
  *   1. Change endianness
@@ -1006,41 +1254,40 @@ static uint16_t *u24_to_u16 (uint32_t *in, const size_t samples)
  *   4. Change sample format to destination SFMT
  *   5. Up/downmix channels
 */
-char *audio_conv (struct audio_conversion *conv, const char *buf,
+const char *audio_conv (struct audio_conversion *conv, const char *buf,
 		const size_t size, size_t *conv_len)
 {
-	char *curr_sound;
+	const char *curr_sound = buf;
 	long curr_sfmt = conv->from.fmt;
 
 	*conv_len = size;
 
-	curr_sound = (char *)xmalloc (size);
-	memcpy (curr_sound, buf, size);
-
 	if (!(curr_sfmt & SFMT_NE)) {
-		swap_endian (curr_sound, *conv_len, curr_sfmt);
+		char *new_sound = writable_buf (conv, curr_sound, *conv_len);
+
+		swap_endian (new_sound, *conv_len, curr_sfmt);
 		curr_sfmt = sfmt_set_endian (curr_sfmt, SFMT_NE);
+		curr_sound = new_sound;
 	}
 
 	/* Special case (optimization): 32bit -> 24bit_3 */
 	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
 	    (conv->to.fmt & (SFMT_S24_3 | SFMT_U24_3)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		char *new_sound = stage_buf (conv, curr_sound,
+				*conv_len * 3 / 4, true);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s24_3 ((int32_t *)curr_sound,
-					*conv_len / 4);
+			s32_to_s24_3 ((const int32_t *)curr_sound,
+					(int8_t *)new_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S24_3);
 		}
 		else {
-			new_sound = (char *)s32_to_s24_3 ((int32_t *)curr_sound,
-					*conv_len / 4);
+			s32_to_s24_3 ((const int32_t *)curr_sound,
+					(int8_t *)new_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U24_3);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		*conv_len = *conv_len *3/ 4;
 
@@ -1052,21 +1299,20 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
 	    (conv->to.fmt & (SFMT_S16 | SFMT_U16)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		char *new_sound = stage_buf (conv, curr_sound,
+				*conv_len / 2, true);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s16 ((int32_t *)curr_sound,
-					*conv_len / 4);
+			s32_to_s16 ((const int32_t *)curr_sound,
+					(int16_t *)new_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S16);
 		}
 		else {
-			new_sound = (char *)u32_to_u16 ((uint32_t *)curr_sound,
-					*conv_len / 4);
+			u32_to_u16 ((const uint32_t *)curr_sound,
+					(uint16_t *)new_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U16);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		*conv_len /= 2;
 
@@ -1077,21 +1323,19 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
  	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
  	    (conv->to.fmt & (SFMT_S24 | SFMT_U24)) &&
  	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		char *new_sound = stage_buf (conv, curr_sound, *conv_len, true);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s24 ((int32_t *)curr_sound,
-					*conv_len/4);
+			s32_to_s24 ((const int32_t *)curr_sound,
+					(int32_t *)new_sound, *conv_len/4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S24);
 		}
 		else {
-			new_sound = (char *)u32_to_u24 ((uint32_t *)curr_sound,
-					*conv_len/4);
+			u32_to_u24 ((const uint32_t *)curr_sound,
+					(uint32_t *)new_sound, *conv_len/4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U24);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		//*conv_len /= 2;
 
@@ -1102,21 +1346,20 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	if ((curr_sfmt & (SFMT_S24 | SFMT_U24)) &&
 	    (conv->to.fmt & (SFMT_S16 | SFMT_U16)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
+		char *new_sound = stage_buf (conv, curr_sound,
+				*conv_len / 2, true);
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S24) {
-			new_sound = (char *)s24_to_s16 ((int32_t *)curr_sound,
-					*conv_len / 4);
+			s24_to_s16 ((const int32_t *)curr_sound,
+					(int16_t *)new_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S16);
 		}
 		else {
-			new_sound = (char *)u24_to_u16 ((uint32_t *)curr_sound,
-					*conv_len / 4);
+			u24_to_u16 ((const uint32_t *)curr_sound,
+					(uint16_t *)new_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U16);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 		*conv_len /= 2;
 
@@ -1129,92 +1372,109 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 				|| (conv->to.fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT
 				|| !sfmt_same_bps(conv->to.fmt, curr_sfmt))
 			&& (curr_sfmt & SFMT_MASK_FORMAT) != SFMT_FLOAT) {
-		char *new_sound;
+		int Bps = sfmt_Bps (curr_sfmt);
+		size_t float_len = *conv_len / Bps * sizeof(float);
+		char *new_sound = stage_buf (conv, curr_sound, float_len,
+				Bps == sizeof(float));
 
-		new_sound = (char *)fixed_to_float (curr_sound, *conv_len,
-				curr_sfmt, conv_len);
+		fixed_to_float (curr_sound, *conv_len, curr_sfmt,
+				(float *)new_sound);
 		curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_FLOAT);
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
+		*conv_len = float_len;
 	}
 
 #ifdef HAVE_SAMPLERATE
 	if (conv->from.rate != conv->to.rate) {
-		char *new_sound = (char *)resample_sound (conv,
-				(float *)curr_sound,
+		float *new_sound = resample_sound (conv,
+				(const float *)curr_sound,
 				*conv_len / sizeof(float), conv->from.channels,
 				conv_len);
+
+		if (!new_sound)
+			return NULL;
+
 		*conv_len *= sizeof(float);
-		if (curr_sound != buf)
-			free (curr_sound);
-		curr_sound = new_sound;
+		curr_sound = (const char *)new_sound;
 	}
 #endif
 
 	if ((curr_sfmt & SFMT_MASK_FORMAT)
 			!= (conv->to.fmt & SFMT_MASK_FORMAT)) {
 
-		if (sfmt_same_bps(curr_sfmt, conv->to.fmt))
-			change_sign (curr_sound, size, &curr_sfmt);
+		if (sfmt_same_bps(curr_sfmt, conv->to.fmt)) {
+			char *new_sound = writable_buf (conv, curr_sound,
+					*conv_len);
+
+			change_sign (new_sound, *conv_len, &curr_sfmt);
+			curr_sound = new_sound;
+		}
 		else {
-			char *new_sound;
+			size_t samples = *conv_len / sizeof(float);
+			size_t fixed_len = samples * sfmt_Bps (conv->to.fmt);
+			char *new_sound = stage_buf (conv, curr_sound,
+					fixed_len, true);
 
 			assert (curr_sfmt & SFMT_FLOAT);
 
-			new_sound = float_to_fixed ((float *)curr_sound,
-					*conv_len / sizeof(float),
-					conv->to.fmt, conv_len);
+			float_to_fixed ((const float *)curr_sound, samples,
+					conv->to.fmt, new_sound);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, conv->to.fmt);
 
-			if (curr_sound != buf)
-				free (curr_sound);
 			curr_sound = new_sound;
+			*conv_len = fixed_len;
 		}
 	}
 
 	if (conv->from.channels == 1 && conv->to.channels == 2) {
-		char *new_sound;
+		char *new_sound = other_work_buf (conv, curr_sound,
+				*conv_len * 2);
 
-		new_sound = mono_to_stereo (curr_sound, *conv_len, curr_sfmt);
+		mono_to_stereo (curr_sound, *conv_len, curr_sfmt, new_sound);
 		*conv_len *= 2;
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 	}
 
 	if (conv->from.channels == 6 && conv->to.channels == 2) {
-		char *new_sound;
+		char *new_sound = stage_buf (conv, curr_sound,
+				*conv_len / 3, true);
 
-		new_sound = ch6_to_stereo (curr_sound, *conv_len,
-				conv->from.fmt);
+		ch6_to_stereo (curr_sound, *conv_len, conv->from.fmt,
+				new_sound);
 		*conv_len /= 3;
 
-		if (curr_sound != buf)
-			free (curr_sound);
 		curr_sound = new_sound;
 	}
 
 	if ((curr_sfmt & SFMT_MASK_ENDIANNESS)
 			!= (conv->to.fmt & SFMT_MASK_ENDIANNESS)) {
-		swap_endian (curr_sound, *conv_len, curr_sfmt);
+		char *new_sound = writable_buf (conv, curr_sound, *conv_len);
+
+		swap_endian (new_sound, *conv_len, curr_sfmt);
 		curr_sfmt = sfmt_set_endian (curr_sfmt,
 				conv->to.fmt & SFMT_MASK_ENDIANNESS);
+		curr_sound = new_sound;
 	}
 	
 	return curr_sound;
 }
 
-void audio_conv_destroy (struct audio_conversion *conv ASSERT_ONLY)
+void audio_conv_destroy (struct audio_conversion *conv)
 {
 	assert (conv != NULL);
 
 #ifdef HAVE_SAMPLERATE
-	if (conv->resample_buf)
-		free (conv->resample_buf);
+	free (conv->resample_buf);
+	conv->resample_buf = NULL;
+	conv->resample_buf_nsamples = conv->resample_buf_size = 0;
 	if (conv->src_state)
 		src_delete (conv->src_state);
 #endif
+
+	free (conv->work_buf[0]);
+	free (conv->work_buf[1]);
+	conv->work_buf[0] = conv->work_buf[1] = NULL;
+	conv->work_buf_size[0] = conv->work_buf_size[1] = 0;
 }
@@ -24,18 +24,30 @@ struct audio_conversion
 
 #ifdef HAVE_SAMPLERATE
 	SRC_STATE *src_state;
-	float *resample_buf;
+	float *resample_buf;         /* Frames left over from the last call */
 	size_t resample_buf_nsamples; /* in samples ( sizeof(float) ) */
+	size_t resample_buf_size;     /* allocated, in samples */
 #endif
 
+	/* Ping-pong buffers the conversion stages write to. */
+	char *work_buf[2];
+	size_t work_buf_size[2];
 };
 
+void audio_conv_init ();
+int audio_conv_possible (const struct sound_params *from,
+		const struct sound_params *to);
 int audio_conv_new (struct audio_conversion *conv,
 		const struct sound_params *from,
 		const struct sound_params *to);
-char *audio_conv (struct audio_conversion *conv,
+const char *audio_conv (struct audio_conversion *conv,
 		const char *buf, const size_t size, size_t *conv_len);
 void audio_conv_destroy (struct audio_conversion *conv);
+void audio_conv_to_float (const char *buf, const size_t size,
+		const long fmt, float *out);
+void audio_conv_from_float (const float *buf, const size_t samples,
+		const long fmt, char *out);
+void audio_conv_swap_endian (char *buf, const size_t size, const long fmt);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,950 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Benchmarks and checks run on files without the server.  The decoder
+ * benchmark decodes files as fast as possible, throwing the sound away,
+ * and prints how long it took compared to the length of the sound.  Each
+ * file is decoded in a child process, so its CPU time and peak memory use
+ * can be told apart from the others'.  The kernel benchmark times the
+ * sound conversions and DSP stages on a generated sound.  The MD5
+ * verification decodes files in as many child processes at once as there
+ * are CPUs and prints the MD5 sums of the sound the way the server logs
+ * them when it plays a file, checking them against earlier sums. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "log.h"
+#include "decoder.h"
+#include "audio.h"
+#include "audio_conversion.h"
+#include "equalizer.h"
+#include "softmixer.h"
+#include "dsp.h"
+#include "files.h"
+#include "options.h"
+#include "playlist.h"
+#include "playlist_file.h"
+#include "stats.h"
+#include "md5.h"
+#include "player.h"
+#include "hash_index.h"
+#include "bench.h"
+
+/* As much as the player asks the decoders for at once. */
+#define BENCH_BUF_SIZE		(36 * 1024)
+
+/* What the child process tells about the file. */
+struct bench_decoded
+{
+	bool okay;
+	bool errors;		/* the decoder reported errors */
+	double audio_sec;	/* length of the decoded sound */
+	long len;		/* bytes of the decoded sound */
+	struct sound_params params;	/* of the end of the sound */
+	uint8_t md5[MD5_DIGEST_SIZE];	/* if asked for */
+};
+
+/* Results for one file or summed for a decoder. */
+struct bench_result
+{
+	const char *decoder;
+	int files;
+	double audio_sec;
+	double wall_sec;
+	double cpu_sec;
+	long max_rss;		/* kB */
+};
+
+/* Decode the file to the end, getting float samples if use_float and the
+ * decoder can give them, and sum up the sound with MD5 if md5.  It's run
+ * in the child process. */
+static struct bench_decoded decode_file (const char *file, bool use_float,
+		const bool md5)
+{
+	struct bench_decoded res;
+	struct decoder *f;
+	struct decoder_error err;
+	struct sound_params sound_params;
+	struct md5_ctx md5_ctx;
+	void *data;
+	char *buf;
+
+	memset (&res, 0, sizeof (res));
+
+	f = get_decoder (file);
+	if (!f)
+		return res;
+
+	data = f->open (file);
+	f->get_error (data, &err);
+	if (err.type != ERROR_OK) {
+		fprintf (stderr, "%s: %s\n", file, err.err);
+		decoder_error_clear (&err);
+		f->close (data);
+		return res;
+	}
+
+	use_float = use_float && f->decode_float;
+	buf = (char *)xmalloc (BENCH_BUF_SIZE);
+	memset (&sound_params, 0, sizeof (sound_params));
+	if (md5)
+		md5_init_ctx (&md5_ctx);
+
+	while (true) {
+		int decoded;
+		long bps;
+
+		if (use_float) {
+			decoded = f->decode_float (data, (float *)buf,
+			                           BENCH_BUF_SIZE / sizeof(float),
+			                           &sound_params) * sizeof(float);
+			sound_params.fmt = SFMT_FLOAT;
+		}
+		else
+			decoded = f->decode (data, buf, BENCH_BUF_SIZE, &sound_params);
+
+		f->get_error (data, &err);
+		if (err.type == ERROR_FATAL) {
+			fprintf (stderr, "%s: %s\n", file, err.err);
+			decoder_error_clear (&err);
+			break;
+		}
+		if (err.type != ERROR_OK)
+			res.errors = true;
+		decoder_error_clear (&err);
+
+		if (decoded <= 0) {
+			res.okay = true;
+			break;
+		}
+
+		res.len += decoded;
+		res.params = sound_params;
+		if (md5)
+			md5_process_bytes (buf, decoded, &md5_ctx);
+
+		bps = (long)sfmt_Bps (sound_params.fmt) * sound_params.channels
+		      * sound_params.rate;
+		if (bps > 0)
+			res.audio_sec += (double)decoded / bps;
+	}
+
+	if (md5)
+		md5_finish_ctx (&md5_ctx, res.md5);
+
+	free (buf);
+	f->close (data);
+
+	return res;
+}
+
+static double timeval_sec (const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/* Decode the file in a child process and fill res with the measurements.
+ * Return false on error. */
+static bool bench_file (const char *file, struct bench_result *res)
+{
+	int fds[2];
+	pid_t pid;
+	int status;
+	struct rusage ru;
+	struct timespec start;
+	struct bench_decoded decoded;
+	ssize_t len;
+
+	/* Load the plugin here, so each child doesn't do it again. */
+	if (!get_decoder (file))
+		return false;
+
+	if (pipe (fds) == -1) {
+		log_errno ("Can't create a pipe", errno);
+		return false;
+	}
+
+	get_realtime (&start);
+
+	pid = fork ();
+	if (pid == -1) {
+		log_errno ("Can't fork", errno);
+		close (fds[0]);
+		close (fds[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		close (fds[0]);
+		decoded = decode_file (file,
+		                       options_get_bool ("PreferFloatOutput"),
+		                       false);
+		if (write (fds[1], &decoded, sizeof (decoded)) != sizeof (decoded))
+			_exit (EXIT_FAILURE);
+		_exit (EXIT_SUCCESS);
+	}
+
+	close (fds[1]);
+	do {
+		len = read (fds[0], &decoded, sizeof (decoded));
+	} while (len == -1 && errno == EINTR);
+	close (fds[0]);
+
+	while (wait4 (pid, &status, 0, &ru) == -1) {
+		if (errno != EINTR) {
+			log_errno ("wait4() failed", errno);
+			return false;
+		}
+	}
+
+	res->wall_sec = stats_usec_since (&start) / 1000000.0;
+
+	if (len != sizeof (decoded) || !WIFEXITED(status)
+			|| WEXITSTATUS(status) != EXIT_SUCCESS || !decoded.okay)
+		return false;
+
+	res->files = 1;
+	res->audio_sec = decoded.audio_sec;
+	res->cpu_sec = timeval_sec (&ru.ru_utime) + timeval_sec (&ru.ru_stime);
+	res->max_rss = ru.ru_maxrss;
+
+	return true;
+}
+
+static void print_result (const struct bench_result *res, const char *name)
+{
+	printf ("%-8s %9.2f %8.2f %8.2f %9.1f %8ld  %s\n",
+	        res->decoder, res->audio_sec, res->wall_sec, res->cpu_sec,
+	        res->wall_sec > 0.0 ? res->audio_sec / res->wall_sec : 0.0,
+	        res->max_rss, name);
+}
+
+/* Add the files, directories (recursively) and playlists given on the
+ * command line to plist. */
+static void add_args (struct plist *plist, lists_t_strs *args)
+{
+	int ix;
+
+	for (ix = 0; ix < lists_strs_size (args); ix += 1) {
+		const char *arg = lists_strs_at (args, ix);
+
+		if (is_dir (arg) == 1)
+			read_directory_recurr (arg, plist);
+		else if (is_plist_file (arg)) {
+			char dir[PATH_MAX];
+			char *slash;
+
+			/* Relative paths are relative to the playlist. */
+			strncpy (dir, arg, sizeof (dir));
+			dir[sizeof (dir) - 1] = 0;
+			slash = strrchr (dir, '/');
+			if (slash)
+				*slash = 0;
+			else if (!getcwd (dir, sizeof (dir)))
+				strcpy (dir, "/");
+			plist_load (plist, arg, dir, 0);
+		}
+		else if (is_sound_file (arg))
+			plist_add (plist, arg);
+		else
+			fprintf (stderr, "Not a sound file: %s\n", arg);
+	}
+}
+
+/* Benchmark decoding the files, directories (recursively) and playlists
+ * given on the command line and print the results for each file and
+ * each decoder.  Return false if some files couldn't be decoded. */
+bool bench_files (lists_t_strs *args)
+{
+	struct plist plist;
+	struct bench_result totals[16];
+	int totals_num = 0;
+	int ix, failed = 0;
+
+	plist_init (&plist);
+	add_args (&plist, args);
+
+	printf ("%-8s %9s %8s %8s %9s %8s  %s\n", "DECODER", "AUDIO s",
+	        "WALL s", "CPU s", "x REALTM", "RSS kB", "FILE");
+
+	for (ix = 0; ix < plist_count (&plist); ix += 1) {
+		struct bench_result res;
+		char *file;
+		int t;
+
+		if (plist_deleted (&plist, ix))
+			continue;
+
+		file = plist_get_file (&plist, ix);
+		memset (&res, 0, sizeof (res));
+
+		if (!bench_file (file, &res)) {
+			fprintf (stderr, "Can't decode: %s\n", file);
+			failed += 1;
+			free (file);
+			continue;
+		}
+
+		res.decoder = get_decoder_name (get_decoder (file));
+		print_result (&res, file);
+		free (file);
+
+		for (t = 0; t < totals_num; t += 1) {
+			if (!strcmp (totals[t].decoder, res.decoder))
+				break;
+		}
+		if (t == totals_num) {
+			if (totals_num == ARRAY_SIZE(totals))
+				continue;
+			memset (&totals[t], 0, sizeof (totals[t]));
+			totals[t].decoder = res.decoder;
+			totals_num += 1;
+		}
+		totals[t].files += res.files;
+		totals[t].audio_sec += res.audio_sec;
+		totals[t].wall_sec += res.wall_sec;
+		totals[t].cpu_sec += res.cpu_sec;
+		totals[t].max_rss = MAX(totals[t].max_rss, res.max_rss);
+	}
+
+	if (totals_num > 0)
+		printf ("\n");
+	for (ix = 0; ix < totals_num; ix += 1) {
+		char name[32];
+
+		snprintf (name, sizeof (name), "(%d files)", totals[ix].files);
+		print_result (&totals[ix], name);
+	}
+
+	plist_free (&plist);
+
+	return failed == 0;
+}
+
+/* At most so many files are decoded at once in the MD5 verification. */
+#define VERIFY_MAX_JOBS		64
+
+/* A file being decoded by a child process for the MD5 verification. */
+struct verify_job
+{
+	pid_t pid;
+	int fd;		/* the pipe the result comes through */
+	int file;	/* index in the playlist */
+};
+
+/* An MD5 sum read from the reference file. */
+struct md5_ref
+{
+	char *name;
+	char *sum;	/* "sum length decoder format channels rate" */
+};
+
+/* The reference sums indexed by the file names. */
+struct md5_refs
+{
+	struct hash_index *index;
+	struct md5_ref **list;	/* all of them, to free them */
+	int num;
+	int allocated;
+};
+
+static const char *md5_ref_key (const void *data,
+		const void *unused ATTR_UNUSED)
+{
+	return ((const struct md5_ref *)data)->name;
+}
+
+static void md5_refs_free (struct md5_refs *refs)
+{
+	int ix;
+
+	hash_index_free (refs->index);
+	for (ix = 0; ix < refs->num; ix += 1) {
+		free (refs->list[ix]->name);
+		free (refs->list[ix]->sum);
+		free (refs->list[ix]);
+	}
+	free (refs->list);
+	free (refs);
+}
+
+/* Read the MD5 sums from the lines with "MD5(name) = ..." in the file:
+ * the output of an earlier verification or the server's log.  Later
+ * lines win.  Return NULL on error. */
+static struct md5_refs *read_md5_refs (const char *fname)
+{
+	struct md5_refs *refs;
+	FILE *file;
+	char *line;
+
+	file = fopen (fname, "r");
+	if (!file) {
+		char *err = xstrerror (errno);
+
+		fprintf (stderr, "Can't open %s: %s\n", fname, err);
+		free (err);
+		return NULL;
+	}
+
+	refs = (struct md5_refs *)xcalloc (1, sizeof (struct md5_refs));
+	refs->index = hash_index_new (md5_ref_key, NULL);
+
+	while ((line = read_line (file))) {
+		char *name = strstr (line, "MD5("), *end;
+
+		if (name && (end = strstr (name, ") = "))) {
+			struct md5_ref *ref;
+
+			*end = 0;
+			ref = (struct md5_ref *)xmalloc (sizeof (struct md5_ref));
+			ref->name = xstrdup (name + 4);
+			ref->sum = xstrdup (end + 4);
+
+			if (refs->num == refs->allocated) {
+				refs->allocated = refs->allocated * 2 + 64;
+				refs->list = (struct md5_ref **)xrealloc (refs->list,
+						refs->allocated * sizeof (struct md5_ref *));
+			}
+			refs->list[refs->num++] = ref;
+
+			if (hash_index_find (refs->index, ref->name))
+				hash_index_delete (refs->index, ref->name);
+			hash_index_set (refs->index, ref);
+		}
+
+		free (line);
+	}
+
+	fclose (file);
+	logit ("Read %d MD5 sums from %s", refs->num, fname);
+
+	return refs;
+}
+
+/* Find the reference sum of the file, by the path or by the file name
+ * only (as the server logs it). */
+static const struct md5_ref *find_md5_ref (const struct md5_refs *refs,
+		const char *file)
+{
+	const struct md5_ref *ref = hash_index_find (refs->index, file);
+	const char *fn;
+
+	if (!ref && (fn = strrchr (file, '/')))
+		ref = hash_index_find (refs->index, fn + 1);
+
+	return ref;
+}
+
+/* Do the sums differ in anything but the decoder's name? */
+static bool md5_sums_differ (const char *sum1, const char *sum2)
+{
+	char md5_1[33], md5_2[33], fmt1[16], fmt2[16];
+	long len1, len2;
+	int ch1, ch2, rate1, rate2;
+
+	if (sscanf (sum1, "%32s %ld %*s %15s %d %d", md5_1, &len1, fmt1,
+				&ch1, &rate1) != 5
+			|| sscanf (sum2, "%32s %ld %*s %15s %d %d", md5_2,
+				&len2, fmt2, &ch2, &rate2) != 5)
+		return strcmp (sum1, sum2) != 0;
+
+	return strcmp (md5_1, md5_2) || len1 != len2 || strcmp (fmt1, fmt2)
+		|| ch1 != ch2 || rate1 != rate2;
+}
+
+/* Start decoding the file in a child process.  Return false on error. */
+static bool start_verify_job (struct verify_job *job, const char *file,
+		const int file_ix, const bool use_float)
+{
+	int fds[2];
+
+	/* Load the plugin here, so each child doesn't do it again. */
+	if (!get_decoder (file))
+		return false;
+
+	if (pipe (fds) == -1) {
+		log_errno ("Can't create a pipe", errno);
+		return false;
+	}
+
+	job->pid = fork ();
+	if (job->pid == -1) {
+		log_errno ("Can't fork", errno);
+		close (fds[0]);
+		close (fds[1]);
+		return false;
+	}
+
+	if (job->pid == 0) {
+		struct bench_decoded decoded;
+
+		close (fds[0]);
+		decoded = decode_file (file, use_float, true);
+		if (write (fds[1], &decoded, sizeof (decoded)) != sizeof (decoded))
+			_exit (EXIT_FAILURE);
+		_exit (EXIT_SUCCESS);
+	}
+
+	close (fds[1]);
+	job->fd = fds[0];
+	job->file = file_ix;
+
+	return true;
+}
+
+/* Get the result of the job whose child has exited with status.  Return
+ * false if it failed. */
+static bool finish_verify_job (struct verify_job *job, const int status,
+		struct bench_decoded *decoded)
+{
+	ssize_t len;
+
+	do {
+		len = read (job->fd, decoded, sizeof (*decoded));
+	} while (len == -1 && errno == EINTR);
+	close (job->fd);
+
+	return len == sizeof (*decoded) && WIFEXITED(status)
+		&& WEXITSTATUS(status) == EXIT_SUCCESS && decoded->okay
+		&& !decoded->errors;
+}
+
+/* Decode the files, directories (recursively) and playlists given on the
+ * command line in parallel and print the MD5 sums of the sound in the
+ * order of the files.  If refs_file is not NULL, check the sums against
+ * the ones in it and mark each file as OK, DIFF (with the expected sum
+ * on the next line), NEW (not in the file) or FAIL (can't be decoded).
+ * Return the exit code: 0 if all is well, 1 if some files couldn't be
+ * decoded, 2 if some sums differ, like tools/md5check.sh. */
+int verify_md5 (lists_t_strs *args, const char *refs_file)
+{
+	struct plist plist;
+	struct md5_refs *refs = NULL;
+	struct verify_job jobs[VERIFY_MAX_JOBS];
+	char **lines;
+	long cpus;
+	int max_jobs, jobs_num = 0, next = 0, printed = 0, count;
+	int ok = 0, differ = 0, unknown = 0, failed = 0;
+
+	if (refs_file) {
+		refs = read_md5_refs (refs_file);
+		if (!refs)
+			return EXIT_FAILURE;
+	}
+
+	plist_init (&plist);
+	add_args (&plist, args);
+	count = plist_count (&plist);
+	lines = (char **)xcalloc (count + 1, sizeof (char *));
+
+	cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	max_jobs = CLAMP(1, cpus, VERIFY_MAX_JOBS);
+
+	while (next < count || jobs_num > 0) {
+		struct bench_decoded decoded;
+		int status, ix;
+		pid_t pid;
+		char *file;
+
+		/* Keep all the workers busy. */
+		while (jobs_num < max_jobs && next < count) {
+			const struct md5_ref *ref = NULL;
+			bool use_float;
+
+			if (plist_deleted (&plist, next)) {
+				lines[next++] = xstrdup ("");
+				continue;
+			}
+
+			file = plist_get_file (&plist, next);
+			if (refs)
+				ref = find_md5_ref (refs, file);
+
+			/* Decode to the format of the reference sum. */
+			if (ref) {
+				char fmt[16];
+
+				use_float = sscanf (ref->sum, "%*s %*s %*s %15s",
+				                    fmt) == 1 && fmt[0] == 'f';
+			}
+			else
+				use_float = options_get_bool ("PreferFloatOutput");
+
+			if (start_verify_job (&jobs[jobs_num], file, next,
+						use_float))
+				jobs_num += 1;
+			else {
+				lines[next] = format_msg ("%sCan't decode: %s",
+						refs ? "FAIL " : "", file);
+				failed += 1;
+			}
+
+			free (file);
+			next += 1;
+		}
+
+		if (jobs_num > 0) {
+			pid = wait (&status);
+			if (pid == -1) {
+				if (errno == EINTR)
+					continue;
+				fatal ("wait() failed: %s", xstrerror (errno));
+			}
+
+			for (ix = 0; ix < jobs_num && jobs[ix].pid != pid; ix++)
+				;
+			if (ix == jobs_num)
+				continue;
+
+			file = plist_get_file (&plist, jobs[ix].file);
+
+			if (!finish_verify_job (&jobs[ix], status, &decoded)) {
+				lines[jobs[ix].file] = format_msg ("%sCan't decode: "
+						"%s", refs ? "FAIL " : "", file);
+				failed += 1;
+			}
+			else {
+				const struct md5_ref *ref = NULL;
+				char *sum;
+
+				sum = md5_sum_line (file, &decoded.params,
+						get_decoder_name (get_decoder (file)),
+						decoded.md5, decoded.len);
+				if (!sum)
+					sum = format_msg ("Unknown sound format: %s",
+							file);
+
+				if (refs)
+					ref = find_md5_ref (refs, file);
+
+				if (!refs)
+					lines[jobs[ix].file] = sum;
+				else if (!ref) {
+					lines[jobs[ix].file] = format_msg ("NEW %s", sum);
+					unknown += 1;
+					free (sum);
+				}
+				else if (md5_sums_differ (strstr (sum, ") = ") + 4,
+							ref->sum)) {
+					lines[jobs[ix].file] = format_msg ("DIFF %s\n"
+							"     expected: %s", sum,
+							ref->sum);
+					differ += 1;
+					free (sum);
+				}
+				else {
+					lines[jobs[ix].file] = format_msg ("OK %s", sum);
+					ok += 1;
+					free (sum);
+				}
+			}
+
+			free (file);
+			jobs[ix] = jobs[--jobs_num];
+		}
+
+		/* Print the results in the order of the files. */
+		while (printed < count && lines[printed]) {
+			if (lines[printed][0])
+				printf ("%s\n", lines[printed]);
+			fflush (stdout);
+			free (lines[printed++]);
+		}
+	}
+
+	if (refs) {
+		fprintf (stderr, "%d OK, %d differ, %d not in %s, %d failed\n",
+		         ok, differ, unknown, refs_file, failed);
+		md5_refs_free (refs);
+	}
+
+	free (lines);
+	plist_free (&plist);
+
+	if (differ)
+		return 2;
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Frames processed by one call of a sound processing kernel. */
+#define KERNEL_FRAMES		4096
+
+/* Each kernel is run repeatedly for at least so long. */
+#define KERNEL_MIN_USEC		200000
+
+typedef void kernel_fn (void *arg);
+
+/* Run the kernel until KERNEL_MIN_USEC have passed and print the time
+ * per sample and the input bytes processed per second. */
+static void time_kernel (const char *name, kernel_fn *fn, void *arg,
+		const size_t samples, const size_t bytes)
+{
+	struct timespec start;
+	uint64_t usec;
+	long runs = 0;
+
+	/* The first call allocates the buffers. */
+	fn (arg);
+
+	get_realtime (&start);
+	do {
+		fn (arg);
+		runs += 1;
+		usec = stats_usec_since (&start);
+	} while (usec < KERNEL_MIN_USEC);
+
+	printf ("%-44s %8.2f ns/sample %7.2f GB/s\n", name,
+	        usec * 1000.0 / ((double)runs * samples),
+	        (double)runs * bytes / (usec * 1000.0));
+}
+
+/* Fill the buffer with a sound in the format: a tone with some noise. */
+static void make_sound (char *buf, const size_t samples, const long fmt)
+{
+	float *sound;
+	size_t ix;
+
+	sound = (float *)xmalloc (samples * sizeof (float));
+	for (ix = 0; ix < samples; ix += 1)
+		sound[ix] = 0.7f * ((ix % 100) / 50.0f - 1.0f)
+		            + 0.1f * (rand () / (float)RAND_MAX - 0.5f);
+
+	if ((fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT)
+		memcpy (buf, sound, samples * sizeof (float));
+	else
+		audio_conv_from_float (sound, samples, fmt, buf);
+	free (sound);
+}
+
+struct conv_kernel
+{
+	struct audio_conversion conv;
+	const char *buf;
+	size_t size;
+};
+
+static void conv_kernel (void *arg)
+{
+	struct conv_kernel *k = (struct conv_kernel *)arg;
+	size_t len;
+
+	audio_conv (&k->conv, k->buf, k->size, &len);
+}
+
+static void bench_conversion (const struct sound_params *from,
+		const struct sound_params *to, const char *what)
+{
+	struct conv_kernel k;
+	char from_str[SFMT_STR_MAX], to_str[SFMT_STR_MAX];
+	char name[2 * SFMT_STR_MAX + 64];
+	size_t samples = KERNEL_FRAMES * from->channels;
+	char *buf;
+
+	sfmt_str (from->fmt, from_str, sizeof (from_str));
+	sfmt_str (to->fmt, to_str, sizeof (to_str));
+	snprintf (name, sizeof (name), "conv %s %dch %d -> %s %dch %d%s%s",
+	          from_str, from->channels, from->rate,
+	          to_str, to->channels, to->rate, what ? " " : "",
+	          what ? what : "");
+
+	if (!audio_conv_new (&k.conv, from, to)) {
+		printf ("%-44s not supported\n", name);
+		return;
+	}
+
+	buf = (char *)xmalloc (samples * sfmt_Bps (from->fmt));
+	make_sound (buf, samples, from->fmt);
+	k.buf = buf;
+	k.size = samples * sfmt_Bps (from->fmt);
+
+	time_kernel (name, conv_kernel, &k, samples, k.size);
+
+	audio_conv_destroy (&k.conv);
+	free (buf);
+}
+
+struct float_kernel
+{
+	void (*process) (float *buf, size_t samples,
+	                 const struct sound_params *params);
+	const float *sound;
+	float *buf;
+	size_t samples;
+	struct sound_params params;
+};
+
+/* The stages change the samples in place, so each run starts from a copy
+ * of the same sound. */
+static void float_kernel (void *arg)
+{
+	struct float_kernel *k = (struct float_kernel *)arg;
+
+	memcpy (k->buf, k->sound, k->samples * sizeof (float));
+	k->process (k->buf, k->samples, &k->params);
+}
+
+static void bench_float_stage (const char *name,
+		void (*process) (float *buf, size_t samples,
+		                 const struct sound_params *params))
+{
+	struct float_kernel k;
+	float *sound;
+
+	k.params.channels = 2;
+	k.params.rate = 44100;
+	k.params.fmt = SFMT_FLOAT | SFMT_NE;
+	k.samples = KERNEL_FRAMES * k.params.channels;
+	k.process = process;
+
+	sound = (float *)xmalloc (k.samples * sizeof (float));
+	make_sound ((char *)sound, k.samples, k.params.fmt);
+	k.sound = sound;
+	k.buf = (float *)xmalloc (k.samples * sizeof (float));
+
+	time_kernel (name, float_kernel, &k, k.samples,
+	             k.samples * sizeof (float));
+
+	free (k.buf);
+	free (sound);
+}
+
+struct dsp_kernel
+{
+	const char *buf;
+	size_t size;
+	struct sound_params params;
+};
+
+static void dsp_kernel (void *arg)
+{
+	struct dsp_kernel *k = (struct dsp_kernel *)arg;
+
+	dsp_process (k->buf, k->size, &k->params);
+}
+
+/* Benchmark the sound format conversions and the DSP stages the server
+ * runs on the sound before it goes to the device. */
+void bench_kernels ()
+{
+	static const long fmts[] = {
+		SFMT_S8, SFMT_U8, SFMT_S16 | SFMT_NE, SFMT_U16 | SFMT_NE,
+		SFMT_S24 | SFMT_NE, SFMT_S24_3 | SFMT_NE, SFMT_S32 | SFMT_NE,
+		SFMT_U32 | SFMT_NE, SFMT_FLOAT | SFMT_NE,
+		SFMT_S16 | (SFMT_NE == SFMT_LE ? SFMT_BE : SFMT_LE)
+	};
+#ifdef HAVE_SAMPLERATE
+	static const char *methods[] = {
+		"Linear", "ZeroOrderHold", "SincFastest", "SincMediumQuality",
+		"SincBestQuality"
+	};
+#endif
+	struct sound_params from, to;
+	struct dsp_kernel dk;
+	size_t i, j;
+	int eq_active, mixer_active, mixer_value, mixer_mono;
+	char *buf;
+
+	/* Don't save the state changed for the benchmark. */
+	options_set_bool (SOFTMIXER_SAVE_OPTION, false);
+	options_set_bool ("Equalizer_SaveState", false);
+	options_set_int ("EnableResample", 1);
+	options_set_list ("ResampleMethodByRate", "", false);
+
+	audio_conv_init ();
+	softmixer_init ();
+	equalizer_init ();
+	dsp_init ();
+
+	from.channels = to.channels = 2;
+	from.rate = to.rate = 44100;
+	for (i = 0; i < ARRAY_SIZE(fmts); i += 1) {
+		for (j = 0; j < ARRAY_SIZE(fmts); j += 1) {
+			if (i == j)
+				continue;
+			from.fmt = fmts[i];
+			to.fmt = fmts[j];
+			bench_conversion (&from, &to, NULL);
+		}
+	}
+
+	from.fmt = to.fmt = SFMT_S16 | SFMT_NE;
+	from.channels = 1;
+	bench_conversion (&from, &to, NULL);
+	from.channels = 6;
+	bench_conversion (&from, &to, NULL);
+
+#ifdef HAVE_SAMPLERATE
+	from.channels = 2;
+	to.rate = 48000;
+	for (i = 0; i < ARRAY_SIZE(methods); i += 1) {
+		options_set_symb ("ResampleMethod", methods[i]);
+		bench_conversion (&from, &to, methods[i]);
+	}
+#endif
+
+	eq_active = equalizer_is_active ();
+	mixer_active = softmixer_is_active ();
+	mixer_value = softmixer_get_value ();
+	mixer_mono = softmixer_is_mono ();
+
+	equalizer_set_active (1);
+	from.fmt = SFMT_FLOAT | SFMT_NE;
+	from.channels = 2;
+	from.rate = 44100;
+	if (equalizer_is_needed (&from))
+		bench_float_stage ("equalizer", equalizer_process_float);
+	else
+		printf ("%-44s no equalizer set\n", "equalizer");
+	equalizer_set_active (0);
+
+	softmixer_set_active (1);
+	softmixer_set_value (50);
+	softmixer_set_mono (0);
+	bench_float_stage ("softmixer", softmixer_process_float);
+	softmixer_set_mono (1);
+	bench_float_stage ("softmixer mono", softmixer_process_float);
+
+	/* The whole DSP chain on the usual format. */
+	equalizer_set_active (1);
+	dk.params.channels = 2;
+	dk.params.rate = 44100;
+	dk.params.fmt = SFMT_S16 | SFMT_NE;
+	dk.size = KERNEL_FRAMES * 2 * sfmt_Bps (dk.params.fmt);
+	buf = (char *)xmalloc (dk.size);
+	make_sound (buf, KERNEL_FRAMES * 2, dk.params.fmt);
+	dk.buf = buf;
+	time_kernel ("dsp s16 (equalizer, softmixer mono)", dsp_kernel, &dk,
+	             KERNEL_FRAMES * 2, dk.size);
+	free (buf);
+
+	equalizer_set_active (eq_active);
+	softmixer_set_active (mixer_active);
+	softmixer_set_value (mixer_value);
+	softmixer_set_mono (mixer_mono);
+
+	dsp_shutdown ();
+	equalizer_shutdown ();
+	softmixer_shutdown ();
+}
@@ -0,0 +1,18 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "lists.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool bench_files (lists_t_strs *args);
+void bench_kernels ();
+int verify_md5 (lists_t_strs *args, const char *refs_file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,6 +32,9 @@
 #ifdef HAVE_SYSLOG
 #include <syslog.h>
 #endif
+#ifdef MEM_STATS
+#include <malloc.h>
+#endif
 
 #include "common.h"
 #include "server.h"
@@ -136,6 +139,98 @@ char *xstrdup (const char *s)
 	return s ? n : NULL;
 }
 
+#ifdef MEM_STATS
+/* Live bytes (as malloc_usable_size() counts them) and blocks of each
+ * subsystem. */
+static long mem_bytes[MEM_SUBSYSTEMS];
+static long mem_blocks[MEM_SUBSYSTEMS];
+
+static void *mem_count (void *p, const enum mem_tag tag)
+{
+	assert (LIMIT(tag, MEM_SUBSYSTEMS));
+
+	if (p) {
+		ATOMIC_ADD (&mem_bytes[tag], (long)malloc_usable_size (p));
+		ATOMIC_ADD (&mem_blocks[tag], 1);
+	}
+
+	return p;
+}
+
+static void mem_uncount (void *p, const enum mem_tag tag)
+{
+	assert (LIMIT(tag, MEM_SUBSYSTEMS));
+
+	if (p) {
+		ATOMIC_ADD (&mem_bytes[tag], -(long)malloc_usable_size (p));
+		ATOMIC_ADD (&mem_blocks[tag], -1);
+	}
+}
+
+void *xmalloc_tag (size_t size, const enum mem_tag tag)
+{
+	return mem_count (xmalloc (size), tag);
+}
+
+void *xcalloc_tag (size_t nmemb, size_t size, const enum mem_tag tag)
+{
+	return mem_count (xcalloc (nmemb, size), tag);
+}
+
+void *xrealloc_tag (void *ptr, const size_t size, const enum mem_tag tag)
+{
+	mem_uncount (ptr, tag);
+
+	return mem_count (xrealloc (ptr, size), tag);
+}
+
+char *xstrdup_tag (const char *s, const enum mem_tag tag)
+{
+	return mem_count (xstrdup (s), tag);
+}
+
+void xfree_tag (void *ptr, const enum mem_tag tag)
+{
+	mem_uncount (ptr, tag);
+	free (ptr);
+}
+#endif
+
+/* Return the name of the subsystem for the reports. */
+const char *mem_tag_name (const enum mem_tag tag)
+{
+	static const char *names[] = {
+		"plist", "tags", "protocol", "io", "decoder", "dsp", "audio"
+	};
+
+	assert (ARRAY_SIZE(names) == MEM_SUBSYSTEMS);
+	assert (LIMIT(tag, MEM_SUBSYSTEMS));
+
+	return names[tag];
+}
+
+/* Get the live memory of the subsystem.  Return false if it's not counted
+ * (MOC was configured without --enable-mem-stats). */
+bool mem_stats_get (const enum mem_tag tag ASSERT_ONLY, long *bytes,
+		long *blocks)
+{
+	assert (LIMIT(tag, MEM_SUBSYSTEMS));
+	assert (bytes != NULL);
+	assert (blocks != NULL);
+
+#ifdef MEM_STATS
+	*bytes = ATOMIC_LOAD (&mem_bytes[tag]);
+	*blocks = ATOMIC_LOAD (&mem_blocks[tag]);
+
+	return true;
+#else
+	*bytes = 0;
+	*blocks = 0;
+
+	return false;
+#endif
+}
+
 /* Sleep for the specified number of 'ticks'. */
 void xsleep (size_t ticks, size_t ticks_per_sec)
 {
@@ -375,6 +470,17 @@ int get_realtime (struct timespec *ts)
     return result;
 }
 
+/* Get the time of a clock which is not changed with the system time, for
+ * measuring intervals; the realtime clock if there is none. */
+int get_monotonic (struct timespec *ts)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	return clock_gettime (CLOCK_MONOTONIC, ts);
+#else
+	return get_realtime (ts);
+#endif
+}
+
 /* Convert time in second to min:sec text format.
    'buff' must be at least 32 chars long. */
 void sec_to_min (char *buff, const int seconds)
@@ -80,6 +80,15 @@ struct timespec;
 #define ARRAY_SIZE(x)   (sizeof(x)/sizeof(x[0]))
 #define ssizeof(x)      ((ssize_t) sizeof(x))
 
+/* Lock-free access to integers and pointers shared between threads.
+ * Stores release and loads acquire, so data written before an
+ * ATOMIC_STORE() is visible after the matching ATOMIC_LOAD(). */
+#define ATOMIC_LOAD(p)      __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v)  __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_XCHG(p, v)   __atomic_exchange_n ((p), (v), __ATOMIC_ACQ_REL)
+#define ATOMIC_ADD(p, v)    __atomic_add_fetch ((p), (v), __ATOMIC_RELAXED)
+#define ATOMIC_FENCE()      __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
 /* Maximal string length sent/received. */
 #define MAX_SEND_STRING	4096
 
@@ -132,6 +141,29 @@ struct timespec;
 		free (err##__LINE__); \
 	} while (0)
 
+/* Subsystems whose live memory is counted when MOC is configured with
+ * --enable-mem-stats.  Memory allocated with a tag must be freed with
+ * xfree_tag() and the same tag. */
+enum mem_tag
+{
+	MEM_PLIST,	/* tables of the playlists */
+	MEM_TAGS,	/* file tags, the string pool and the tags cache */
+	MEM_PROTOCOL,	/* receive buffers, packets and event queues */
+	MEM_IO,		/* streams and their input buffers */
+	MEM_DECODER,	/* decoded sound not played yet, precached files */
+	MEM_DSP,	/* work buffers of the DSP effects */
+	MEM_AUDIO,	/* the output buffer */
+	MEM_SUBSYSTEMS
+};
+
+#ifndef MEM_STATS
+# define xmalloc_tag(size, tag)		xmalloc (size)
+# define xcalloc_tag(nmemb, size, tag)	xcalloc ((nmemb), (size))
+# define xrealloc_tag(ptr, size, tag)	xrealloc ((ptr), (size))
+# define xstrdup_tag(s, tag)		xstrdup (s)
+# define xfree_tag(ptr, tag)		free (ptr)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -144,6 +176,16 @@ void xsleep (size_t ticks, size_t ticks_per_sec);
 char *xstrerror (int errnum);
 void xsignal (int signum, void (*func)(int));
 
+#ifdef MEM_STATS
+void *xmalloc_tag (size_t size, const enum mem_tag tag);
+void *xcalloc_tag (size_t nmemb, size_t size, const enum mem_tag tag);
+void *xrealloc_tag (void *ptr, const size_t size, const enum mem_tag tag);
+char *xstrdup_tag (const char *s, const enum mem_tag tag);
+void xfree_tag (void *ptr, const enum mem_tag tag);
+#endif
+const char *mem_tag_name (const enum mem_tag tag);
+bool mem_stats_get (const enum mem_tag tag, long *bytes, long *blocks);
+
 void internal_error (const char *file, int line, const char *function,
                      const char *format, ...) ATTR_PRINTF(4, 5);
 void internal_fatal (const char *file, int line, const char *function,
@@ -156,6 +198,7 @@ char *format_msg_va (const char *format, va_list va);
 bool is_valid_symbol (const char *candidate);
 char *create_file_name (const char *file);
 int get_realtime (struct timespec *ts);
+int get_monotonic (struct timespec *ts);
 void sec_to_min (char *buff, const int seconds);
 const char *get_home ();
 void common_cleanup ();
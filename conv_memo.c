@@ -0,0 +1,117 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Memo of charset conversions: the results of the last strings converted,
+ * so that the strings which come again and again (the artist and album
+ * of every file of an album, the file names shown each time a directory is
+ * read) go through iconv or librcc's detection once.  It's a direct
+ * mapped table, a string replaces the one with the same slot.
+ *
+ * The conversions are done with the memo's lock held, which also keeps the
+ * threads from using the same iconv descriptor at the same time. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "conv_memo.h"
+
+struct memo_slot
+{
+	char *str;		/* NULL for an empty slot */
+	char *converted;
+};
+
+struct conv_memo
+{
+	struct memo_slot *slots;
+	int size;
+	pthread_mutex_t mtx;
+};
+
+struct conv_memo *conv_memo_new (const int size)
+{
+	struct conv_memo *m;
+
+	assert (size > 0);
+
+	m = (struct conv_memo *)xmalloc (sizeof(struct conv_memo));
+	m->slots = (struct memo_slot *)xcalloc (size, sizeof(struct memo_slot));
+	m->size = size;
+	pthread_mutex_init (&m->mtx, NULL);
+
+	return m;
+}
+
+void conv_memo_free (struct conv_memo *m)
+{
+	int ix;
+
+	if (!m)
+		return;
+
+	for (ix = 0; ix < m->size; ix++) {
+		free (m->slots[ix].str);
+		free (m->slots[ix].converted);
+	}
+
+	pthread_mutex_destroy (&m->mtx);
+	free (m->slots);
+	free (m);
+}
+
+static uint32_t str_hash (const char *str)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Return the string converted (malloc()ed), by the convert function if it
+ * is not in the memo.  Without the memo (NULL), just convert it. */
+char *conv_memo_convert (struct conv_memo *m, const char *str,
+		conv_memo_fn *convert, const void *arg)
+{
+	struct memo_slot *slot;
+	char *result;
+
+	if (!str)
+		return NULL;
+	if (!m)
+		return convert (str, arg);
+
+	slot = &m->slots[str_hash (str) % m->size];
+
+	LOCK (m->mtx);
+	if (!slot->str || strcmp (slot->str, str)) {
+		char *converted = convert (str, arg);
+
+		free (slot->str);
+		free (slot->converted);
+		slot->str = xstrdup (str);
+		slot->converted = converted;
+	}
+	result = xstrdup (slot->converted);
+	UNLOCK (m->mtx);
+
+	return result;
+}
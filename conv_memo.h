@@ -0,0 +1,22 @@
+#ifndef CONV_MEMO_H
+#define CONV_MEMO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Convert the string, return the result malloc()ed. */
+typedef char *conv_memo_fn (const char *str, const void *arg);
+
+struct conv_memo;
+
+struct conv_memo *conv_memo_new (const int size);
+void conv_memo_free (struct conv_memo *m);
+char *conv_memo_convert (struct conv_memo *m, const char *str,
+		conv_memo_fn *convert, const void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,728 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* CUE sheets: an album in one audio file described by a .cue file.  The
+ * tracks are virtual files named "album.cue#3" which are played by the
+ * decoder of the audio file through the one here, cutting the sound at
+ * the sample where the track starts and ends.
+ *
+ * When a track is played to its end, the decoder of the audio file is
+ * left open at that position with the sound it has decoded past it, so
+ * the next track of the same file continues with it without opening the
+ * file again or seeking. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "log.h"
+#include "files.h"
+#include "audio.h"
+#include "decoder.h"
+#include "cue.h"
+
+struct cue_data
+{
+	const struct decoder *f;	/* decoder of the audio file */
+	void *data;			/* its data, NULL if not open */
+	char *audio;			/* the audio file */
+	long start, end;		/* the track in CD frames, see
+					   struct cue_track */
+	int duration;
+	struct sound_params params;	/* of the sound decoded so far */
+	long long pos;			/* frames of the file decoded so far,
+					   -1 until the rate is known */
+	int origin;			/* second the decoder was sought to */
+	char *left;			/* sound decoded past the end of the
+					   track before */
+	int left_len;
+	bool ended;
+	struct decoder_error error;
+};
+
+/* The decoder left open at the end of the track played last. */
+static struct cue_data *parked = NULL;
+static pthread_mutex_t parked_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct decoder cue_funcs;
+
+/* Return the next word or quoted string of the line, NULL at its end.
+ * The line is terminated in place. */
+static char *next_token (char **pos)
+{
+	char *s = *pos, *token;
+
+	while (isspace (*s))
+		s++;
+	if (!*s)
+		return NULL;
+
+	if (*s == '"') {
+		token = ++s;
+		while (*s && *s != '"')
+			s++;
+	}
+	else {
+		token = s;
+		while (*s && !isspace (*s))
+			s++;
+	}
+
+	if (*s)
+		*s++ = 0;
+	*pos = s;
+
+	return token;
+}
+
+/* Parse "mm:ss:ff" into CD frames, return -1 on error. */
+static long parse_time (const char *time)
+{
+	int min, sec, frames;
+
+	if (!time || sscanf (time, "%d:%d:%d", &min, &sec, &frames) != 3
+			|| min < 0 || !RANGE(0, sec, 59)
+			|| !RANGE(0, frames, CUE_FRAMES - 1))
+		return -1;
+
+	return (min * 60L + sec) * CUE_FRAMES + frames;
+}
+
+static void free_track (struct cue_track *track)
+{
+	free (track->title);
+	free (track->performer);
+	free (track->file);
+}
+
+/* Read the CUE sheet, return NULL if it can't be read or has no tracks.
+ * Tracks without INDEX 01 are left out. */
+struct cue_sheet *cue_read (const char *path)
+{
+	FILE *file;
+	struct cue_sheet *sheet;
+	struct cue_track *track = NULL;
+	char *dir, *slash, *line;
+	char *curr_file = NULL;
+	int ix, num;
+
+	file = fopen (path, "r");
+	if (!file)
+		return NULL;
+
+	dir = xstrdup (path);
+	slash = strrchr (dir, '/');
+	if (slash)
+		slash[1] = 0;
+	else
+		dir[0] = 0;
+
+	sheet = (struct cue_sheet *)xcalloc (1, sizeof(struct cue_sheet));
+
+	while ((line = read_line (file))) {
+		char *pos = line, *cmd, *arg;
+
+		/* Skip the UTF-8 byte order mark. */
+		if (!strncmp (pos, "\xef\xbb\xbf", 3))
+			pos += 3;
+
+		cmd = next_token (&pos);
+		arg = cmd ? next_token (&pos) : NULL;
+
+		if (!arg)
+			;
+		else if (!strcasecmp (cmd, "FILE")) {
+			free (curr_file);
+			curr_file = arg[0] == '/' ? xstrdup (arg)
+			                          : format_msg ("%s%s", dir, arg);
+		}
+		else if (!strcasecmp (cmd, "TRACK") && curr_file) {
+			sheet->tracks = (struct cue_track *)xrealloc (
+					sheet->tracks, (sheet->num + 1)
+					* sizeof(struct cue_track));
+			track = &sheet->tracks[sheet->num++];
+			memset (track, 0, sizeof(*track));
+			track->number = atoi (arg);
+			track->file = xstrdup (curr_file);
+			track->start = -1;
+			track->end = -1;
+		}
+		else if (!strcasecmp (cmd, "TITLE")) {
+			char **title = track ? &track->title : &sheet->title;
+
+			free (*title);
+			*title = xstrdup (arg);
+		}
+		else if (!strcasecmp (cmd, "PERFORMER")) {
+			char **performer = track ? &track->performer
+			                         : &sheet->performer;
+
+			free (*performer);
+			*performer = xstrdup (arg);
+		}
+		else if (!strcasecmp (cmd, "INDEX") && track && atoi (arg) == 1)
+			track->start = parse_time (next_token (&pos));
+
+		free (line);
+	}
+
+	fclose (file);
+	free (curr_file);
+	free (dir);
+
+	/* A track lasts until the next one if it's in the same file. */
+	num = 0;
+	for (ix = 0; ix < sheet->num; ix++) {
+		if (sheet->tracks[ix].start == -1)
+			free_track (&sheet->tracks[ix]);
+		else
+			sheet->tracks[num++] = sheet->tracks[ix];
+	}
+	sheet->num = num;
+	for (ix = 0; ix + 1 < sheet->num; ix++) {
+		if (!strcmp (sheet->tracks[ix].file, sheet->tracks[ix + 1].file)
+				&& sheet->tracks[ix + 1].start
+				   > sheet->tracks[ix].start)
+			sheet->tracks[ix].end = sheet->tracks[ix + 1].start;
+	}
+
+	if (!sheet->num) {
+		cue_free (sheet);
+		return NULL;
+	}
+
+	return sheet;
+}
+
+void cue_free (struct cue_sheet *sheet)
+{
+	int ix;
+
+	for (ix = 0; ix < sheet->num; ix++)
+		free_track (&sheet->tracks[ix]);
+	free (sheet->tracks);
+	free (sheet->title);
+	free (sheet->performer);
+	free (sheet);
+}
+
+const struct cue_track *cue_find_track (const struct cue_sheet *sheet,
+		const int number)
+{
+	int ix;
+
+	for (ix = 0; ix < sheet->num; ix++) {
+		if (sheet->tracks[ix].number == number)
+			return &sheet->tracks[ix];
+	}
+
+	return NULL;
+}
+
+/* Return the position of the '#' if the name is of a track of a CUE
+ * sheet ("album.cue#3"), NULL otherwise. */
+static const char *track_mark (const char *name)
+{
+	const char *mark = strrchr (name, '#');
+	const char *c;
+
+	if (!mark || mark - name < 4 || strncasecmp (mark - 4, ".cue", 4)
+			|| !mark[1])
+		return NULL;
+
+	for (c = mark + 1; *c; c++) {
+		if (!isdigit (*c))
+			return NULL;
+	}
+
+	return mark;
+}
+
+int cue_is_track (const char *name)
+{
+	return track_mark (name) != NULL;
+}
+
+/* Return the name of the track of the CUE sheet, it must be freed. */
+char *cue_track_name (const char *cue, const int number)
+{
+	return format_msg ("%s#%d", cue, number);
+}
+
+/* Return the CUE sheet of the track's name and put the track number in
+ * number, NULL if it's not the name of a track.  The result must be
+ * freed. */
+char *cue_split_name (const char *name, int *number)
+{
+	const char *mark = track_mark (name);
+	char *cue;
+
+	if (!mark)
+		return NULL;
+
+	cue = (char *)xmalloc (mark - name + 1);
+	memcpy (cue, name, mark - name);
+	cue[mark - name] = 0;
+	*number = atoi (mark + 1);
+
+	return cue;
+}
+
+/* Is next the track of the same CUE sheet that continues the track in
+ * the same audio file, without a gap?  Then next takes the decoder the
+ * track leaves at its end, so it must not be opened before that. */
+bool cue_continues (const char *track, const char *next)
+{
+	char *cue, *next_cue;
+	int number, next_number;
+	bool res = false;
+
+	cue = cue_split_name (track, &number);
+	if (!cue)
+		return false;
+
+	next_cue = cue_split_name (next, &next_number);
+	if (next_cue && !strcmp (cue, next_cue)) {
+		struct cue_sheet *sheet = cue_read (cue);
+
+		if (sheet) {
+			const struct cue_track *t, *n;
+
+			t = cue_find_track (sheet, number);
+			n = cue_find_track (sheet, next_number);
+			res = t && n && t->end != -1 && t->end == n->start
+				&& !strcmp (t->file, n->file);
+			cue_free (sheet);
+		}
+	}
+
+	free (cue);
+	free (next_cue);
+
+	return res;
+}
+
+/* Read the track of the CUE sheet, return false if there is no such
+ * track. */
+static bool read_track (const char *name, struct cue_sheet **sheet,
+		const struct cue_track **track)
+{
+	char *cue;
+	int number;
+
+	cue = cue_split_name (name, &number);
+	if (!cue)
+		return false;
+
+	*sheet = cue_read (cue);
+	free (cue);
+	if (!*sheet)
+		return false;
+
+	*track = cue_find_track (*sheet, number);
+	if (!*track) {
+		cue_free (*sheet);
+		return false;
+	}
+
+	return true;
+}
+
+static long long frames_at (const long time, const int rate)
+{
+	return (long long)time * rate / CUE_FRAMES;
+}
+
+static void free_data (struct cue_data *d)
+{
+	if (d->data)
+		d->f->close (d->data);
+	free (d->audio);
+	free (d->left);
+	decoder_error_clear (&d->error);
+	free (d);
+}
+
+/* Leave the decoder open at the end of the track, with the sound it has
+ * decoded past the end (rest and what's left from before). */
+static void park (struct cue_data *d, const char *rest, const int rest_len,
+		const long long pos)
+{
+	struct cue_data *p;
+
+	p = (struct cue_data *)xcalloc (1, sizeof(struct cue_data));
+	decoder_error_init (&p->error);
+	p->f = d->f;
+	p->data = d->data;
+	p->audio = xstrdup (d->audio);
+	p->params = d->params;
+	p->pos = pos;
+	p->left_len = rest_len + d->left_len;
+	if (p->left_len) {
+		p->left = (char *)xmalloc (p->left_len);
+		memcpy (p->left, rest, rest_len);
+		if (d->left_len)
+			memcpy (p->left + rest_len, d->left, d->left_len);
+	}
+
+	d->data = NULL;
+	free (d->left);
+	d->left = NULL;
+	d->left_len = 0;
+
+	LOCK (parked_mtx);
+	if (parked)
+		free_data (parked);
+	parked = p;
+	UNLOCK (parked_mtx);
+}
+
+/* Take the parked decoder if it's at the start of the track.  Any other
+ * parked decoder is left for its track: the precache may open several
+ * tracks at once, in any order. */
+static bool unpark (struct cue_data *d)
+{
+	struct cue_data *p = NULL;
+
+	LOCK (parked_mtx);
+	if (parked && !strcmp (parked->audio, d->audio)
+			&& parked->pos == frames_at (d->start,
+			                             parked->params.rate)) {
+		p = parked;
+		parked = NULL;
+	}
+	UNLOCK (parked_mtx);
+
+	if (!p)
+		return false;
+
+	d->f = p->f;
+	d->data = p->data;
+	d->params = p->params;
+	d->pos = p->pos;
+	d->left = p->left;
+	d->left_len = p->left_len;
+
+	p->data = NULL;
+	p->left = NULL;
+	free_data (p);
+
+	return true;
+}
+
+/* Open the audio file and seek to the second.  Return false on error,
+ * which is then in d->error. */
+static bool open_audio (struct cue_data *d, const int sec)
+{
+	struct decoder_error err;
+
+	d->data = d->f->open (d->audio);
+	d->f->get_error (d->data, &err);
+	if (err.type != ERROR_OK) {
+		decoder_error_copy (&d->error, &err);
+		decoder_error_clear (&err);
+		d->f->close (d->data);
+		d->data = NULL;
+		return false;
+	}
+
+	d->pos = -1;
+	d->origin = 0;
+	if (sec > 0) {
+		int res = d->f->seek (d->data, sec);
+
+		if (res != -1)
+			d->origin = res;
+	}
+
+	return true;
+}
+
+static void *cue_open (const char *name)
+{
+	struct cue_data *d;
+	struct cue_sheet *sheet;
+	const struct cue_track *track;
+
+	d = (struct cue_data *)xcalloc (1, sizeof(struct cue_data));
+	decoder_error_init (&d->error);
+	d->pos = -1;
+
+	if (!read_track (name, &sheet, &track)) {
+		decoder_error (&d->error, ERROR_FATAL, 0,
+		               "Can't read the track of the CUE sheet");
+		return d;
+	}
+
+	d->audio = xstrdup (track->file);
+	d->start = track->start;
+	d->end = track->end;
+	cue_free (sheet);
+
+	if (unpark (d))
+		logit ("Continuing with the decoder of %s", d->audio);
+	else {
+		d->f = get_decoder (d->audio);
+		if (!d->f || d->f == &cue_funcs) {
+			decoder_error (&d->error, ERROR_FATAL, 0,
+			               "Can't play the file of the CUE sheet");
+			return d;
+		}
+		if (!open_audio (d, d->start / CUE_FRAMES))
+			return d;
+	}
+
+	if (d->end != -1)
+		d->duration = (d->end - d->start) / CUE_FRAMES;
+	else
+		d->duration = MAX(0, d->f->get_duration (d->data)
+		                     - d->start / CUE_FRAMES);
+
+	return d;
+}
+
+static void cue_close (void *prv)
+{
+	free_data ((struct cue_data *)prv);
+}
+
+/* Get the next piece of sound of the audio file into buf. */
+static int decode_audio (struct cue_data *d, char *buf, const int buf_len,
+		struct sound_params *sound_params)
+{
+	int len;
+
+	if (d->left) {
+		len = MIN(buf_len, d->left_len);
+		memcpy (buf, d->left, len);
+		d->left_len -= len;
+		memmove (d->left, d->left + len, d->left_len);
+		if (!d->left_len) {
+			free (d->left);
+			d->left = NULL;
+		}
+		*sound_params = d->params;
+
+		return len;
+	}
+
+	if (!d->data)
+		return 0;
+
+	len = d->f->decode (d->data, buf, buf_len, sound_params);
+	if (len > 0)
+		d->params = *sound_params;
+
+	return len;
+}
+
+static int cue_decode (void *prv, char *buf, int buf_len,
+		struct sound_params *sound_params)
+{
+	struct cue_data *d = (struct cue_data *)prv;
+
+	while (!d->ended) {
+		long long first, last, skip, keep, frames;
+		int len, frame;
+
+		len = decode_audio (d, buf, buf_len, sound_params);
+		if (len <= 0)
+			break;
+
+		frame = sfmt_Bps (sound_params->fmt) * sound_params->channels;
+		frames = len / frame;
+		if (d->pos == -1)
+			d->pos = (long long)d->origin * sound_params->rate;
+
+		first = frames_at (d->start, sound_params->rate);
+		last = d->end != -1 ? frames_at (d->end, sound_params->rate)
+		                    : LLONG_MAX;
+
+		skip = MAX(0, MIN(frames, first - d->pos));
+		keep = MAX(0, MIN(frames - skip, last - d->pos - skip));
+
+		if (last != LLONG_MAX && d->pos + skip + keep >= last) {
+			park (d, buf + (skip + keep) * frame,
+			      len - (skip + keep) * frame,
+			      d->pos + skip + keep);
+			d->ended = true;
+		}
+		d->pos += frames;
+
+		if (keep) {
+			if (skip)
+				memmove (buf, buf + skip * frame,
+				         keep * frame);
+			return keep * frame;
+		}
+	}
+
+	d->ended = true;
+	return 0;
+}
+
+static int cue_seek (void *prv, int sec)
+{
+	struct cue_data *d = (struct cue_data *)prv;
+	int res;
+
+	if (!d->f)
+		return -1;
+
+	free (d->left);
+	d->left = NULL;
+	d->left_len = 0;
+	d->ended = false;
+
+	/* The decoder may have gone on to the next track. */
+	if (!d->data && !open_audio (d, 0))
+		return -1;
+
+	res = d->f->seek (d->data, d->start / CUE_FRAMES + sec);
+	if (res == -1)
+		return -1;
+
+	d->origin = res;
+	d->pos = d->params.rate ? (long long)res * d->params.rate : -1;
+
+	return MAX(0, res - d->start / CUE_FRAMES);
+}
+
+static void cue_info (const char *file, struct file_tags *tags,
+		const int tags_sel)
+{
+	struct cue_sheet *sheet;
+	const struct cue_track *track;
+
+	if (!read_track (file, &sheet, &track))
+		return;
+
+	if (tags_sel & TAGS_COMMENTS) {
+		const char *artist = track->performer ? track->performer
+		                                      : sheet->performer;
+
+		if (track->title)
+			tags->title = xstrdup (track->title);
+		if (artist)
+			tags->artist = xstrdup (artist);
+		if (sheet->title)
+			tags->album = xstrdup (sheet->title);
+		tags->track = track->number;
+	}
+
+	if (tags_sel & TAGS_TIME) {
+		if (track->end != -1)
+			tags->time = (track->end - track->start) / CUE_FRAMES;
+		else {
+			struct decoder *f = get_decoder (track->file);
+
+			if (f && f != &cue_funcs) {
+				struct file_tags *audio_tags = tags_new ();
+
+				f->info (track->file, audio_tags, TAGS_TIME);
+				if (audio_tags->time != -1)
+					tags->time = MAX(0, audio_tags->time
+					        - track->start / CUE_FRAMES);
+				tags_free (audio_tags);
+			}
+		}
+	}
+
+	cue_free (sheet);
+}
+
+static int cue_get_bitrate (void *prv)
+{
+	struct cue_data *d = (struct cue_data *)prv;
+
+	return d->data ? d->f->get_bitrate (d->data) : -1;
+}
+
+static int cue_get_avg_bitrate (void *prv)
+{
+	struct cue_data *d = (struct cue_data *)prv;
+
+	return d->data && d->f->get_avg_bitrate
+		? d->f->get_avg_bitrate (d->data) : 0;
+}
+
+static int cue_get_duration (void *prv)
+{
+	return ((struct cue_data *)prv)->duration;
+}
+
+static void cue_get_error (void *prv, struct decoder_error *error)
+{
+	struct cue_data *d = (struct cue_data *)prv;
+
+	if (d->error.type != ERROR_OK)
+		decoder_error_copy (error, &d->error);
+	else if (d->data)
+		d->f->get_error (d->data, error);
+	else
+		decoder_error_init (error);
+}
+
+static void cue_get_name (const char *unused ATTR_UNUSED, char buf[4])
+{
+	strcpy (buf, "CUE");
+}
+
+static struct decoder cue_funcs = {
+	DECODER_API_VERSION,
+	NULL,
+	NULL,
+	cue_open,
+	NULL,
+	NULL,
+	cue_close,
+	cue_decode,
+	cue_seek,
+	cue_info,
+	cue_get_bitrate,
+	cue_get_duration,
+	cue_get_error,
+	NULL,
+	NULL,
+	cue_get_name,
+	NULL,
+	NULL,
+	cue_get_avg_bitrate,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+/* The decoder of the tracks of CUE sheets. */
+struct decoder *cue_decoder ()
+{
+	return &cue_funcs;
+}
+
+/* Close the decoder left open. */
+void cue_cleanup ()
+{
+	LOCK (parked_mtx);
+	if (parked) {
+		free_data (parked);
+		parked = NULL;
+	}
+	UNLOCK (parked_mtx);
+}
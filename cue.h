@@ -0,0 +1,47 @@
+#ifndef CUE_H
+#define CUE_H
+
+#include "decoder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* CD frames (the unit of CUE sheet times) per second. */
+#define CUE_FRAMES	75
+
+struct cue_track
+{
+	int number;
+	char *title;
+	char *performer;
+	char *file;		/* the audio file (full path) */
+	long start;		/* INDEX 01 in CD frames */
+	long end;		/* start of the next track in the same file or
+				   -1 if it lasts to the end of the file */
+};
+
+struct cue_sheet
+{
+	char *title;
+	char *performer;
+	int num;
+	struct cue_track *tracks;
+};
+
+struct cue_sheet *cue_read (const char *path);
+void cue_free (struct cue_sheet *sheet);
+const struct cue_track *cue_find_track (const struct cue_sheet *sheet,
+		const int number);
+int cue_is_track (const char *name);
+char *cue_track_name (const char *cue, const int number);
+char *cue_split_name (const char *name, int *number);
+bool cue_continues (const char *track, const char *next);
+struct decoder *cue_decoder ();
+void cue_cleanup ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,6 +20,10 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <ltdl.h>
 
 #include "common.h"
@@ -28,17 +32,30 @@
 #include "log.h"
 #include "io.h"
 #include "options.h"
+#include "hash_index.h"
+#include "cue.h"
+
+/* Plugins which give their extensions (get_extns()) are loaded when
+ * they are first needed, until then what they handle is known from the
+ * manifest MOC keeps in this file. */
+#define MANIFEST_FILE			"decoders"
 
 static struct plugin {
 	char *name;
+	char *file; /* what lt_dlopenext() is given */
 	lt_dlhandle handle;
-	struct decoder *decoder;
+	struct decoder *decoder; /* NULL until the plugin is loaded */
+	lists_t_strs *extns; /* from get_extns() or the manifest, or NULL */
+	bool failed; /* loading the plugin failed */
 } plugins[16];
 
 #define PLUGINS_NUM			(ARRAY_SIZE(plugins))
 
 static int plugins_num = 0;
 
+/* Serialises loading plugins on demand. */
+static pthread_mutex_t plugins_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static bool have_tremor = false;
 
 /* This structure holds the user's decoder preferences for audio formats. */
@@ -56,6 +73,27 @@ typedef struct decoder_s_preference decoder_t_preference;
 static decoder_t_preference *preferences = NULL;
 static int default_decoder_list[PLUGINS_NUM];
 
+/* Longest filename extension kept in the extension map. */
+#define EXTN_MAX			15
+
+/* The decoder chosen for a filename extension (in lower case). */
+struct extn_decoder {
+	int decoder;                          /* index or -1 */
+	char extn[EXTN_MAX + 1];
+};
+
+/* The decoders for all the extensions the plugins and the preferences
+ * know, built by decoder_init() and not changed after that, so it can be
+ * read by any thread.  NULL if the choice depends on more than the
+ * extension (the MIME type). */
+static struct hash_index *extn_map = NULL;
+static struct extn_decoder *extn_decoders = NULL; /* the map's entries */
+static int extn_decoders_num = 0;
+
+/* Some plugins don't tell their extensions: an extension not in the map
+ * must be asked for in the usual way. */
+static bool extn_map_complete = false;
+
 static char *clean_mime_subtype (char *subtype)
 {
 	char *ptr;
@@ -120,6 +158,53 @@ static decoder_t_preference *lookup_preference (const char *extn,
 	return result;
 }
 
+static int load_plugin (const int ix, const int debug_info);
+
+/* Return the plugin's decoder, loading the plugin if it hasn't been yet.
+ * Returns NULL if it can't be loaded. */
+static struct decoder *plugin_decoder (const int ix)
+{
+	struct decoder *result;
+
+	result = ATOMIC_LOAD (&plugins[ix].decoder);
+	if (result || plugins[ix].failed)
+		return result;
+
+	LOCK (plugins_mtx);
+	if (!plugins[ix].decoder && !plugins[ix].failed) {
+		logit ("Loading the %s decoder", plugins[ix].name);
+		if (load_plugin (ix, 0) == -1) {
+			error ("Can't load the %s decoder", plugins[ix].name);
+			plugins[ix].failed = true;
+		}
+	}
+	UNLOCK (plugins_mtx);
+
+	return ATOMIC_LOAD (&plugins[ix].decoder);
+}
+
+/* Can the plugin decode files with the given filename extension?  This
+ * doesn't load the plugin. */
+static bool plugin_handles_extn (const int ix, const char *extn)
+{
+	int i;
+	struct decoder *decoder;
+
+	decoder = ATOMIC_LOAD (&plugins[ix].decoder);
+	if (decoder)
+		return decoder->our_format_ext && decoder->our_format_ext (extn);
+
+	if (plugins[ix].failed || !plugins[ix].extns)
+		return false;
+
+	for (i = 0; i < lists_strs_size (plugins[ix].extns); i += 1) {
+		if (!strcasecmp (lists_strs_at (plugins[ix].extns, i), extn))
+			return true;
+	}
+
+	return false;
+}
+
 /* Return the index of the first decoder able to handle files with the
  * given filename extension, or -1 if none can. */
 static int find_extn_decoder (int *decoder_list, int count, const char *extn)
@@ -131,8 +216,7 @@ static int find_extn_decoder (int *decoder_list, int count, const char *extn)
 	assert (extn && extn[0]);
 
 	for (ix = 0; ix < count; ix += 1) {
-		if (plugins[decoder_list[ix]].decoder->our_format_ext &&
-		    plugins[decoder_list[ix]].decoder->our_format_ext (extn))
+		if (plugin_handles_extn (decoder_list[ix], extn))
 			return decoder_list[ix];
 	}
 
@@ -150,8 +234,10 @@ static int find_mime_decoder (int *decoder_list, int count, const char *mime)
 	assert (mime && mime[0]);
 
 	for (ix = 0; ix < count; ix += 1) {
-		if (plugins[decoder_list[ix]].decoder->our_format_mime &&
-		    plugins[decoder_list[ix]].decoder->our_format_mime (mime))
+		struct decoder *decoder = plugin_decoder (decoder_list[ix]);
+
+		if (decoder && decoder->our_format_mime &&
+		    decoder->our_format_mime (mime))
 			return decoder_list[ix];
 	}
 
@@ -184,6 +270,129 @@ static int find_decoder (const char *extn, const char *file, char **mime)
 	return result;
 }
 
+/* Put the extension in lower case into buf (of EXTN_MAX + 1 bytes).
+ * Return false if it's too long. */
+static bool extn_key (char *buf, const char *extn)
+{
+	size_t ix;
+
+	for (ix = 0; extn[ix]; ix += 1) {
+		if (ix == EXTN_MAX)
+			return false;
+		buf[ix] = tolower ((unsigned char)extn[ix]);
+	}
+	buf[ix] = 0x00;
+
+	return true;
+}
+
+static const char *extn_decoder_key (const void *data,
+                                     const void *unused ATTR_UNUSED)
+{
+	return ((const struct extn_decoder *)data)->extn;
+}
+
+/* Look the extension up in the map.  Return true and put the decoder
+ * index (or -1) into result if the map knows the answer. */
+static bool lookup_extn_map (const char *extn, int *result)
+{
+	char key[EXTN_MAX + 1];
+	const struct extn_decoder *ed;
+
+	if (!extn_map || !extn || !extn[0] || !extn_key (key, extn))
+		return false;
+
+	ed = (const struct extn_decoder *)hash_index_find (extn_map, key);
+	if (!ed) {
+		if (!extn_map_complete)
+			return false;
+		*result = -1;
+		return true;
+	}
+
+	/* The decoder has failed to load since, find the next one. */
+	if (ed->decoder != -1 && plugins[ed->decoder].failed)
+		return false;
+
+	*result = ed->decoder;
+	return true;
+}
+
+static void add_extn_map (const char *extn)
+{
+	struct extn_decoder *ed = &extn_decoders[extn_decoders_num];
+
+	if (!extn[0] || !extn_key (ed->extn, extn)
+	             || hash_index_find (extn_map, ed->extn))
+		return;
+
+	ed->decoder = find_decoder (ed->extn, NULL, NULL);
+	hash_index_set (extn_map, ed);
+	extn_decoders_num += 1;
+}
+
+/* Build the extension map unless MIME types are used to choose decoders. */
+static void make_extn_map ()
+{
+	int ix, i, count;
+	decoder_t_preference *pref;
+
+	assert (extn_map == NULL);
+
+	/* The MIME type is looked for only if there are preferences for some
+	 * of them. */
+	if (options_get_bool ("UseMimeMagic")) {
+		for (pref = preferences; pref; pref = pref->next) {
+			if (pref->subtype)
+				return;
+		}
+	}
+
+	count = 0;
+	for (ix = 0; ix < plugins_num; ix += 1) {
+		if (plugins[ix].extns)
+			count += lists_strs_size (plugins[ix].extns);
+	}
+	for (pref = preferences; pref; pref = pref->next)
+		count += 1;
+
+	extn_decoders = (struct extn_decoder *)xcalloc (MAX(count, 1),
+	                                        sizeof (struct extn_decoder));
+	extn_decoders_num = 0;
+	extn_map = hash_index_new (extn_decoder_key, NULL);
+	hash_index_reserve (extn_map, count);
+	extn_map_complete = true;
+
+	for (ix = 0; ix < plugins_num; ix += 1) {
+		if (!plugins[ix].extns) {
+			extn_map_complete = false;
+			continue;
+		}
+		for (i = 0; i < lists_strs_size (plugins[ix].extns); i += 1)
+			add_extn_map (lists_strs_at (plugins[ix].extns, i));
+	}
+
+	for (pref = preferences; pref; pref = pref->next) {
+		if (!pref->subtype)
+			add_extn_map (pref->type);
+	}
+
+	debug ("Extension map of %d entries%s", extn_decoders_num,
+	       extn_map_complete ? "" : " (incomplete)");
+}
+
+static void free_extn_map ()
+{
+	if (extn_map) {
+		hash_index_free (extn_map);
+		extn_map = NULL;
+	}
+
+	free (extn_decoders);
+	extn_decoders = NULL;
+	extn_decoders_num = 0;
+}
+
 /* Find the index in plugins table for the given file.
  * Return -1 if not found. */
 static int find_type (const char *file)
@@ -192,6 +401,9 @@ static int find_type (const char *file)
 	char *extn, *mime;
 
 	extn = ext_pos (file);
+	if (lookup_extn_map (extn, &result))
+		return result;
+
 	mime = NULL;
 
 	result = find_decoder (extn, file, &mime);
@@ -202,6 +414,9 @@ static int find_type (const char *file)
 
 int is_sound_file (const char *name)
 {
+	if (cue_is_track (name))
+		return 1;
+
 	return find_type(name) != -1 ? 1 : 0;
 }
 
@@ -211,19 +426,25 @@ char *file_type_name (const char *file)
 {
 	int i;
 	static char buf[4];
+	struct decoder *decoder;
 
 	if (file_type (file) == F_URL) {
 		strcpy (buf, "NET");
 		return buf;
 	}
+	if (cue_is_track (file)) {
+		strcpy (buf, "CUE");
+		return buf;
+	}
 
 	i = find_type (file);
 	if (i == -1)
 		return NULL;
 
 	memset (buf, 0, sizeof (buf));
-	if (plugins[i].decoder->get_name)
-		plugins[i].decoder->get_name (file, buf);
+	decoder = plugin_decoder (i);
+	if (decoder && decoder->get_name)
+		decoder->get_name (file, buf);
 
 	/* Attempt a default name if we have nothing else. */
 	if (!buf[0]) {
@@ -254,9 +475,12 @@ struct decoder *get_decoder (const char *file)
 {
 	int i;
 
+	if (cue_is_track (file))
+		return cue_decoder ();
+
 	i = find_type (file);
 	if (i != -1)
-		return plugins[i].decoder;
+		return plugin_decoder (i);
 
 	return NULL;
 }
@@ -269,8 +493,11 @@ const char *get_decoder_name (const struct decoder *decoder)
 
 	assert (decoder);
 
+	if (decoder == cue_decoder ())
+		return "cue";
+
 	for (ix = 0; ix < plugins_num; ix += 1) {
-		if (plugins[ix].decoder == decoder) {
+		if (ATOMIC_LOAD (&plugins[ix].decoder) == decoder) {
 			result = plugins[ix].name;
 			break;
 		}
@@ -295,7 +522,7 @@ static struct decoder *get_decoder_by_mime_type (struct io_stream *stream)
 		i = find_decoder (NULL, NULL, &mime);
 		if (i != -1) {
 			logit ("Found decoder for MIME type %s: %s", mime, plugins[i].name);
-			result = plugins[i].decoder;
+			result = plugin_decoder (i);
 		}
 		free (mime);
 	}
@@ -308,7 +535,7 @@ static struct decoder *get_decoder_by_mime_type (struct io_stream *stream)
 /* Return the decoder for this stream. */
 struct decoder *get_decoder_by_content (struct io_stream *stream)
 {
-	char buf[8096];
+	char buf[DECODER_PEEK_SIZE];
 	ssize_t res;
 	int i;
 	struct decoder *decoder_by_mime_type;
@@ -318,7 +545,8 @@ struct decoder *get_decoder_by_content (struct io_stream *stream)
 	/* Peek at the start of the stream to check if sufficient data is
 	 * available.  If not, there is no sense in trying the decoders as
 	 * each of them would issue an error.  The data is also needed to
-	 * get the MIME type. */
+	 * get the MIME type, and it is what the decoders recognise their
+	 * formats by, so the stream is peeked only once. */
 	logit ("Testing the stream...");
 	res = io_peek (stream, buf, sizeof (buf));
 	if (res < 0) {
@@ -336,10 +564,21 @@ struct decoder *get_decoder_by_content (struct io_stream *stream)
 		return decoder_by_mime_type;
 
 	for (i = 0; i < plugins_num; i++) {
-		if (plugins[i].decoder->can_decode
-				&& plugins[i].decoder->can_decode (stream)) {
+		struct decoder *decoder = plugin_decoder (i);
+		int found;
+
+		if (!decoder)
+			found = 0;
+		else if (decoder->can_decode_buf)
+			found = decoder->can_decode_buf (buf, res);
+		else if (decoder->can_decode)
+			found = decoder->can_decode (stream);
+		else
+			found = 0;
+
+		if (found) {
 			logit ("Found decoder for stream: %s", plugins[i].name);
-			return plugins[i].decoder;
+			return decoder;
 		}
 	}
 
@@ -422,101 +661,247 @@ static char *list_decoder_names (int *decoder_list, int count)
 	return result;
 }
 
-/* Check if this handle is already present in the plugins table.
- * Returns 1 if so. */
-static int present_handle (const lt_dlhandle h)
-{
-	int i;
-
-	for (i = 0; i < plugins_num; i++) {
-		if (plugins[i].handle == h)
-			return 1;
-	}
-
-	return 0;
-}
-
-static int lt_load_plugin (const char *file, lt_ptr debug_info_ptr)
+/* Load the plugin: open it and initialise its decoder.  Returns 0 on
+ * success, -1 on error. */
+static int load_plugin (const int ix, const int debug_info)
 {
-	int debug_info;
-	const char *name;
+	struct plugin *plugin = &plugins[ix];
+	lt_dlhandle handle;
+	struct decoder *decoder;
 	union {
 		void *data;
 		plugin_init_func *func;
 	} init;
 
-	debug_info = *(int *)debug_info_ptr;
-	name = strrchr (file, '/');
-	name = name ? (name + 1) : file;
 	if (debug_info)
-		printf ("Loading plugin %s...\n", name);
+		printf ("Loading plugin %s...\n", plugin->name);
 
-	if (plugins_num == PLUGINS_NUM) {
-		fprintf (stderr, "Can't load plugin, because maximum number "
-		                                    "of plugins reached!\n");
-		return 0;
-	}
-
-	plugins[plugins_num].handle = lt_dlopenext (file);
-	if (!plugins[plugins_num].handle) {
-		fprintf (stderr, "Can't load plugin %s: %s\n", name, lt_dlerror ());
-		return 0;
+	handle = lt_dlopenext (plugin->file);
+	if (!handle) {
+		fprintf (stderr, "Can't load plugin %s: %s\n", plugin->name,
+		                 lt_dlerror ());
+		return -1;
 	}
 
-	if (present_handle (plugins[plugins_num].handle)) {
-		if (debug_info)
-			printf ("Already loaded\n");
-		if (lt_dlclose (plugins[plugins_num].handle))
-			fprintf (stderr, "Error unloading plugin: %s\n", lt_dlerror ());
-		return 0;
-	}
-
-	init.data = lt_dlsym (plugins[plugins_num].handle, "plugin_init");
+	init.data = lt_dlsym (handle, "plugin_init");
 	if (!init.data) {
 		fprintf (stderr, "No init function in the plugin!\n");
-		if (lt_dlclose (plugins[plugins_num].handle))
-			fprintf (stderr, "Error unloading plugin: %s\n", lt_dlerror ());
-		return 0;
+		goto err;
 	}
 
 	/* If this call to init.func() fails with memory access or illegal
 	 * instruction errors then read the commit log message for r2831. */
-	plugins[plugins_num].decoder = init.func ();
-	if (!plugins[plugins_num].decoder) {
+	decoder = init.func ();
+	if (!decoder) {
 		fprintf (stderr, "NULL decoder!\n");
-		if (lt_dlclose (plugins[plugins_num].handle))
-			fprintf (stderr, "Error unloading plugin: %s\n", lt_dlerror ());
-		return 0;
+		goto err;
 	}
 
-	if (plugins[plugins_num].decoder->api_version != DECODER_API_VERSION) {
+	if (decoder->api_version != DECODER_API_VERSION) {
 		fprintf (stderr, "Plugin uses different API version\n");
-		if (lt_dlclose (plugins[plugins_num].handle))
-			fprintf (stderr, "Error unloading plugin: %s\n", lt_dlerror ());
-		return 0;
+		goto err;
 	}
 
-	plugins[plugins_num].name = extract_decoder_name (name);
-
 	/* Is the Vorbis decoder using Tremor? */
-	if (!strcmp (plugins[plugins_num].name, "vorbis")) {
-		void *vorbis_has_tremor;
+	if (!strcmp (plugin->name, "vorbis"))
+		have_tremor = lt_dlsym (handle, "vorbis_has_tremor") != NULL;
 
-		vorbis_has_tremor = lt_dlsym (plugins[plugins_num].handle,
-		                              "vorbis_has_tremor");
-		have_tremor = vorbis_has_tremor != NULL;
-	}
+	debug ("Loaded %s decoder", plugin->name);
 
-	debug ("Loaded %s decoder", plugins[plugins_num].name);
+	if (decoder->init)
+		decoder->init ();
 
-	if (plugins[plugins_num].decoder->init)
-		plugins[plugins_num].decoder->init ();
-	plugins_num += 1;
+	/* Plugins loaded on demand keep the extensions from the manifest:
+	 * other threads may be looking at them. */
+	if (decoder->get_extns && !plugin->extns) {
+		plugin->extns = lists_strs_new (8);
+		decoder->get_extns (plugin->extns);
+	}
+
+	plugin->handle = handle;
+	ATOMIC_STORE (&plugin->decoder, decoder);
 
 	if (debug_info)
 		printf ("OK\n");
 
 	return 0;
+
+err:
+	if (lt_dlclose (handle))
+		fprintf (stderr, "Error unloading plugin: %s\n", lt_dlerror ());
+	return -1;
+}
+
+/* Put a plugin found in the plugin directory in the table without
+ * loading it. */
+static int lt_find_plugin (const char *file, lt_ptr unused ATTR_UNUSED)
+{
+	const char *base;
+	char *name;
+
+	base = strrchr (file, '/');
+	base = base ? (base + 1) : file;
+	name = extract_decoder_name (base);
+
+	/* The same plugin can be there under a few file names. */
+	if (lookup_decoder_by_name (name) < plugins_num) {
+		free (name);
+		return 0;
+	}
+
+	if (plugins_num == PLUGINS_NUM) {
+		fprintf (stderr, "Can't load plugin, because maximum number "
+		                                    "of plugins reached!\n");
+		free (name);
+		return 0;
+	}
+
+	plugins[plugins_num].name = name;
+	plugins[plugins_num].file = xstrdup (file);
+	plugins[plugins_num].handle = NULL;
+	plugins[plugins_num].decoder = NULL;
+	plugins[plugins_num].extns = NULL;
+	plugins[plugins_num].failed = false;
+	plugins_num += 1;
+
+	return 0;
+}
+
+static void free_plugin (struct plugin *plugin)
+{
+	if (plugin->decoder && plugin->decoder->destroy)
+		plugin->decoder->destroy ();
+	if (plugin->handle)
+		lt_dlclose (plugin->handle);
+	if (plugin->extns)
+		lists_strs_free (plugin->extns);
+	free (plugin->name);
+	free (plugin->file);
+}
+
+/* Remove the plugins which failed to load from the table. */
+static void drop_failed_plugins ()
+{
+	int ix, count;
+
+	count = 0;
+	for (ix = 0; ix < plugins_num; ix += 1) {
+		if (plugins[ix].failed)
+			free_plugin (&plugins[ix]);
+		else
+			plugins[count++] = plugins[ix];
+	}
+
+	plugins_num = count;
+}
+
+/* The first line of the manifest.  Installing or removing plugins
+ * changes the plugin directory, which makes the manifest stale. */
+static char *manifest_header ()
+{
+	struct stat st;
+	char *result;
+
+	if (stat (PLUGIN_DIR, &st) == -1)
+		return NULL;
+
+	result = (char *)xmalloc (64);
+	snprintf (result, 64, "MOC decoders %d %ld",
+	          DECODER_API_VERSION, (long)st.st_mtime);
+
+	return result;
+}
+
+/* Read the extensions of the plugins from the manifest.  A line of the
+ * manifest is: name, file, whether it's Tremor and the extensions, tab
+ * separated. */
+static void read_manifest (const char *header)
+{
+	FILE *file;
+	char *line;
+
+	file = fopen (create_file_name (MANIFEST_FILE), "r");
+	if (!file)
+		return;
+
+	line = read_line (file);
+	if (!line || strcmp (line, header)) {
+		logit ("The decoder manifest is out of date");
+		free (line);
+		fclose (file);
+		return;
+	}
+	free (line);
+
+	while ((line = read_line (file))) {
+		int ix;
+		lists_t_strs *fields;
+
+		fields = lists_strs_new (4);
+		lists_strs_split (fields, line, "\t");
+		free (line);
+
+		if (lists_strs_size (fields) < 3) {
+			lists_strs_free (fields);
+			continue;
+		}
+
+		ix = lookup_decoder_by_name (lists_strs_at (fields, 0));
+		if (ix < plugins_num && !plugins[ix].extns
+		        && !strcmp (plugins[ix].file, lists_strs_at (fields, 1))) {
+			plugins[ix].extns = lists_strs_new (8);
+			if (lists_strs_size (fields) > 3)
+				lists_strs_split (plugins[ix].extns,
+				                  lists_strs_at (fields, 3), " ");
+			if (!strcmp (plugins[ix].name, "vorbis"))
+				have_tremor = !strcmp (lists_strs_at (fields, 2), "1");
+		}
+
+		lists_strs_free (fields);
+	}
+
+	fclose (file);
+}
+
+/* Write the manifest of the plugins which give their extensions. */
+static void write_manifest (const char *header)
+{
+	int ix;
+	FILE *file;
+	char *path, *tmp;
+
+	path = xstrdup (create_file_name (MANIFEST_FILE));
+	tmp = format_msg ("%s.%d", path, (int)getpid ());
+
+	file = fopen (tmp, "w");
+	if (!file) {
+		log_errno ("Can't write the decoder manifest", errno);
+		goto end;
+	}
+
+	fprintf (file, "%s\n", header);
+	for (ix = 0; ix < plugins_num; ix += 1) {
+		char *extns;
+
+		if (!plugins[ix].extns)
+			continue;
+
+		extns = lists_strs_fmt (plugins[ix].extns, "%s ");
+		fprintf (file, "%s\t%s\t%d\t%s\n", plugins[ix].name,
+		         plugins[ix].file,
+		         !strcmp (plugins[ix].name, "vorbis") && have_tremor,
+		         extns);
+		free (extns);
+	}
+
+	if (fclose (file) || rename (tmp, path) == -1) {
+		log_errno ("Can't write the decoder manifest", errno);
+		unlink (tmp);
+	}
+
+end:
+	free (tmp);
+	free (path);
 }
 
 /* Create a new preferences entry and initialise it. */
@@ -680,24 +1065,45 @@ static void load_preferences ()
 static void load_plugins (int debug_info)
 {
 	int ix;
-	char *names;
+	bool update_manifest = false;
+	char *header, *names;
 
 	if (debug_info)
 		printf ("Loading plugins from %s...\n", PLUGIN_DIR);
 	if (lt_dlinit ())
 		fatal ("lt_dlinit() failed: %s", lt_dlerror ());
 
-	if (lt_dlforeachfile (PLUGIN_DIR, &lt_load_plugin, &debug_info))
+	if (lt_dlforeachfile (PLUGIN_DIR, &lt_find_plugin, NULL))
 		fatal ("Can't load plugins: %s", lt_dlerror ());
 
+	header = manifest_header ();
+	if (header)
+		read_manifest (header);
+
+	/* Load now the plugins the manifest doesn't know. */
+	for (ix = 0; ix < plugins_num; ix += 1) {
+		if (plugins[ix].extns)
+			continue;
+		if (load_plugin (ix, debug_info) == -1)
+			plugins[ix].failed = true;
+		else if (plugins[ix].extns)
+			update_manifest = true;
+	}
+
+	drop_failed_plugins ();
+
 	if (plugins_num == 0)
 		fatal ("No decoder plugins have been loaded!");
 
+	if (header && update_manifest)
+		write_manifest (header);
+	free (header);
+
 	for (ix = 0; ix < plugins_num; ix += 1)
 		default_decoder_list[ix] = ix;
 
 	names = list_decoder_names (default_decoder_list, plugins_num);
-	logit ("Loaded %d decoders:%s", plugins_num, names);
+	logit ("Found %d decoders:%s", plugins_num, names);
 	free (names);
 }
 
@@ -705,19 +1111,15 @@ void decoder_init (int debug_info)
 {
 	load_plugins (debug_info);
 	load_preferences ();
+	make_extn_map ();
 }
 
 static void cleanup_decoders ()
 {
 	int ix;
 
-	for (ix = 0; ix < plugins_num; ix++) {
-		if (plugins[ix].decoder->destroy)
-			plugins[ix].decoder->destroy ();
-		free (plugins[ix].name);
-		if (plugins[ix].handle)
-			lt_dlclose (plugins[ix].handle);
-	}
+	for (ix = 0; ix < plugins_num; ix++)
+		free_plugin (&plugins[ix]);
 
 	if (lt_dlexit ())
 		logit ("lt_exit() failed: %s", lt_dlerror ());
@@ -737,6 +1139,8 @@ static void cleanup_preferences ()
 
 void decoder_cleanup ()
 {
+	cue_cleanup ();
+	free_extn_map ();
 	cleanup_decoders ();
 	cleanup_preferences ();
 }
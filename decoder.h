@@ -4,6 +4,7 @@
 #include "audio.h"
 #include "playlist.h"
 #include "io.h"
+#include "lists.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,7 +14,10 @@ extern "C" {
  *
  * On every change in the decoder API this number will be changed, so
  * MOC will not load plugins compiled with older/newer decoder.h. */
-#define DECODER_API_VERSION	7
+#define DECODER_API_VERSION	11
+
+/** Number of bytes from the start of a stream given to can_decode_buf(). */
+#define DECODER_PEEK_SIZE	(16 * 1024)
 
 /** Type of the decoder error. */
 enum decoder_error_type
@@ -254,6 +258,72 @@ struct decoder
 	 * \return Average bitrate in kbps or -1 if not available.
 	 */
 	int (*get_avg_bitrate)(void *data);
+
+	/** Decode a piece of input to float samples.
+	 *
+	 * Like decode(), but the sound is written as interleaved float
+	 * samples in the range -1.0 to 1.0.  MOC uses it instead of decode()
+	 * for the whole file when the output device takes float samples
+	 * (see audio_float_output()), so the sound doesn't go through
+	 * fixed point on its way to the DSP chain.  Optional.
+	 *
+	 * \param data Decoder's private data.
+	 * \param buf Buffer to put the samples in.
+	 * \param samples Size of the buffer in samples (not frames).
+	 * \param sound_params Parameters of the decoded sound. The format
+	 * is always SFMT_FLOAT.
+	 *
+	 * \return Number of samples written or 0 on EOF.
+	 */
+	int (*decode_float)(void *data, float *buf, int samples,
+			struct sound_params *sound_params);
+
+	/** Check if the decoder is able to decode a stream by its start.
+	 *
+	 * Like can_decode(), but the decoder gets the first bytes of the
+	 * stream, peeked once for all decoders, and mustn't do any IO.
+	 * It is used instead of can_decode() if present.  Optional.
+	 *
+	 * \param buf The start of the stream.
+	 * \param len Number of bytes in buf, at most DECODER_PEEK_SIZE
+	 * (less only if the stream is shorter).
+	 *
+	 * \return 1 if the decoder is able to decode data from this stream.
+	 */
+	int (*can_decode_buf)(const char *buf, size_t len);
+
+	/** List the filename extensions the decoder handles.
+	 *
+	 * Append every extension for which our_format_ext() returns true
+	 * to the list.  MOC keeps the list on disk and doesn't load the
+	 * plugin until a file it handles is used, so plugins which give it
+	 * don't slow down starting up.  It is called after init().
+	 * Optional; plugins without it are always loaded at startup.
+	 *
+	 * \param extns The list to append the extensions to.
+	 */
+	void (*get_extns)(lists_t_strs *extns);
+
+	/** Get the encoder delay and padding of the file.
+	 *
+	 * Lossy encoders add silence before and after the sound; the
+	 * file's header (e.g. the LAME tag) may tell how much.  MOC drops
+	 * it from what decode() gives, so albums play without gaps.  It is
+	 * called once after open(), before anything is decoded.  Decoders
+	 * which drop it themselves shouldn't give it.  Optional.
+	 *
+	 * \param data Decoder's private data.
+	 * \param delay Number of frames to drop at the start.
+	 * \param padding Number of frames to drop at the end.
+	 * \param frames Number of frames decode() gives for the whole
+	 * file, the delay and the padding included, or -1 if not known
+	 * (then the padding is not dropped).
+	 *
+	 * \return 1 if the values were filled, 0 if the file has no such
+	 * information.
+	 */
+	int (*get_gapless)(void *data, long *delay, long *padding,
+			long *frames);
 };
 
 /** Initialize decoder plugin.
@@ -17,9 +17,14 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <strings.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <neaacdec.h>
 #include <id3tag.h>
@@ -31,6 +36,8 @@
 #include "io.h"
 #include "log.h"
 #include "files.h"
+#include "seek_index.h"
+#include "thread_sched.h"
 
 /* FAAD_MIN_STREAMSIZE == 768, 6 == # of channels */
 #define BUFFER_SIZE	(FAAD_MIN_STREAMSIZE * 6 * 4)
@@ -56,6 +63,24 @@ struct aac_data
 	int bitrate;
 	int avg_bitrate;
 	int duration;
+
+	struct seek_index *index; /* NULL for streams */
+	double time; /* time of the next frame, -1.0 if unknown */
+
+	struct adts_scan *scan; /* building the index, NULL if not */
+};
+
+/* The frame headers of a file read by a background thread: their lengths
+ * and sample counts make a complete seek index and the exact duration
+ * without decoding anything. */
+struct adts_scan
+{
+	char *file;
+	pthread_t thread;
+	int stop;	/* atomic */
+	int done;	/* atomic, the fields below are set */
+	struct seek_index *index;	/* NULL if the scan failed */
+	double duration;
 };
 
 static int buffer_length (const struct aac_data *data)
@@ -144,6 +169,29 @@ static int parse_frame (const unsigned char data[6])
 	return len;
 }
 
+/* Return the time of the ADTS frame in seconds or 0.0 if the header
+ * (7 bytes) is not valid. */
+static double frame_time (const unsigned char data[7])
+{
+	static const int rates[] = {
+		96000, 88200, 64000, 48000, 44100, 32000,
+		24000, 22050, 16000, 12000, 11025, 8000, 7350
+	};
+	int rate_ix, blocks;
+
+	if (parse_frame (data) < 7)
+		return 0.0;
+
+	rate_ix = (data[2] >> 2) & 0x0F;
+	if (rate_ix >= (int)ARRAY_SIZE(rates))
+		return 0.0;
+
+	/* raw data blocks of 1024 samples each */
+	blocks = (data[6] & 0x03) + 1;
+
+	return blocks * 1024.0 / rates[rate_ix];
+}
+
 /* scans forward to the next aac frame and makes sure
  * the entire frame is in the buffer.
  */
@@ -195,6 +243,209 @@ end:
 	return rc;
 }
 
+#define SCAN_BUF_SIZE	65536
+
+/* Return the size of the ID3v2 tag the buffer starts with, 0 if none. */
+static off_t id3v2_size (const unsigned char *buf, const size_t len)
+{
+	off_t size;
+
+	if (len < 10 || memcmp (buf, "ID3", 3)
+			|| ((buf[6] | buf[7] | buf[8] | buf[9]) & 0x80))
+		return 0;
+
+	size = (buf[6] << 21) | (buf[7] << 14) | (buf[8] << 7) | buf[9];
+	size += 10;
+	if (buf[5] & 0x10)	/* footer present */
+		size += 10;
+
+	return size;
+}
+
+/* Read the headers of all frames from the fd's position into the index.
+ * Return 0 if the file can't be read or stops being ADTS, or the scan
+ * was stopped. */
+static int scan_frames (struct adts_scan *s, int fd, off_t offset)
+{
+	unsigned char *buf;
+	size_t len = 0, pos = 0;
+	bool synced = false;
+	int resync = 0, count = 0, ok = 0;
+	double time = 0.0;
+
+	buf = (unsigned char *)xmalloc (SCAN_BUF_SIZE);
+
+	while (1) {
+		double ftime;
+		int flen;
+
+		/* Keep the header and the start of the next one in the
+		 * buffer if there is more to read. */
+		if (len - pos < 7 + 6) {
+			ssize_t n;
+
+			memmove (buf, buf + pos, len - pos);
+			offset += pos;
+			len -= pos;
+			pos = 0;
+			n = read (fd, buf + len, SCAN_BUF_SIZE - len);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1) {
+				log_errno ("Can't read the AAC file", errno);
+				break;
+			}
+			len += n;
+			if (len < 7) {
+				ok = time > 0.0;
+				break;
+			}
+		}
+
+		if (!(++count & 1023) && ATOMIC_LOAD(&s->stop))
+			break;
+
+		ftime = frame_time (buf + pos);
+		flen = parse_frame (buf + pos);
+
+		/* Until the sync is found a header counts only if another one
+		 * follows it. */
+		if (ftime > 0.0 && !synced && pos + flen + 7 <= len
+				&& frame_time (buf + pos + flen) == 0.0)
+			ftime = 0.0;
+
+		if (ftime == 0.0) {
+			synced = false;
+			pos += 1;
+			if (++resync > 32768) {
+				logit ("ADTS scan lost the sync at %"PRId64" in %s",
+				       (int64_t)(offset + pos), s->file);
+				break;
+			}
+			continue;
+		}
+		synced = true;
+		resync = 0;
+
+		seek_index_add (s->index, time, offset + pos);
+		time += ftime;
+
+		/* Skip the frame's data, which may go beyond the buffer. */
+		if (pos + flen <= len)
+			pos += flen;
+		else {
+			offset += pos + flen;
+			if (lseek (fd, offset, SEEK_SET) == -1)
+				break;
+			len = pos = 0;
+		}
+	}
+
+	free (buf);
+
+	if (ok)
+		s->duration = time;
+
+	return ok;
+}
+
+static void *adts_scan_thread (void *arg)
+{
+	struct adts_scan *s = (struct adts_scan *)arg;
+	int fd, ok = 0;
+
+	thread_sched_lower ();
+
+	s->index = seek_index_open (s->file);
+	seek_index_reset (s->index, 0.0);
+
+	fd = open (s->file, O_RDONLY);
+	if (fd == -1)
+		log_errno ("Can't open the AAC file to index it", errno);
+	else {
+		unsigned char id3[10];
+		ssize_t len;
+		off_t offset;
+
+		/* The frames start after an ID3v2 tag if there is one. */
+		len = read (fd, id3, sizeof(id3));
+		offset = id3v2_size (id3, MAX(len, 0));
+		if (lseek (fd, offset, SEEK_SET) == -1)
+			log_errno ("Can't seek in the AAC file", errno);
+		else
+			ok = scan_frames (s, fd, offset);
+		close (fd);
+	}
+
+	if (ok) {
+		seek_index_set_duration (s->index, s->duration);
+		logit ("Indexed %s: %.3fs", s->file, s->duration);
+	}
+	else {
+		s->index->modified = 0;
+		seek_index_close (s->index);
+		s->index = NULL;
+	}
+
+	ATOMIC_STORE (&s->done, 1);
+
+	return NULL;
+}
+
+/* Start indexing the file in the background. */
+static struct adts_scan *adts_scan_start (const char *file)
+{
+	struct adts_scan *s;
+	int rc;
+
+	s = (struct adts_scan *)xcalloc (1, sizeof (struct adts_scan));
+	s->file = xstrdup (file);
+
+	rc = pthread_create (&s->thread, NULL, adts_scan_thread, s);
+	if (rc != 0) {
+		log_errno ("Can't create the ADTS scanning thread", rc);
+		free (s->file);
+		free (s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/* Wait for the scan and free it.  The index it made is stored in the
+ * cache unless it has been taken. */
+static void adts_scan_free (struct adts_scan *s)
+{
+	pthread_join (s->thread, NULL);
+	if (s->index)
+		seek_index_close (s->index);
+	free (s->file);
+	free (s);
+}
+
+/* If the background scan has finished, use its index and duration. */
+static void adts_scan_collect (struct aac_data *data)
+{
+	struct adts_scan *s = data->scan;
+
+	if (!s || !ATOMIC_LOAD(&s->done))
+		return;
+
+	if (s->index) {
+		data->index->modified = 0;
+		seek_index_close (data->index);
+		data->index = s->index;
+		s->index = NULL;
+		data->duration = (int)(s->duration + 0.5);
+		if (data->duration > 0)
+			data->avg_bitrate = io_file_size (data->stream)
+			                    / data->duration * 8;
+	}
+
+	adts_scan_free (s);
+	data->scan = NULL;
+}
+
 /* This should be called with a unique decoder instance as the seeking
  * it does triggers an FAAD bug which results in distorted audio due to
  * retained state being corrupted.  (One suspects NeAACDecPostSeekReset()
@@ -339,6 +590,12 @@ static void aac_close (void *prv_data)
 
 	NeAACDecClose (data->decoder);
 	io_close (data->stream);
+	if (data->scan) {
+		ATOMIC_STORE (&data->scan->stop, 1);
+		adts_scan_free (data->scan);
+	}
+	if (data->index)
+		seek_index_close (data->index);
 	decoder_error_clear (&data->error);
 	free (data);
 }
@@ -350,19 +607,34 @@ static void *aac_open (const char *file)
 	data = aac_open_internal (NULL, file);
 
 	if (data->ok) {
+		struct seek_index *index;
 		int duration = -1;
 		int avg_bitrate = -1;
 		off_t file_size;
 
-		duration = aac_count_time (data);
+		/* The index knows the exact duration if the file was indexed
+		 * before, otherwise guess it until it's indexed. */
+		index = seek_index_open (file);
 		file_size = io_file_size (data->stream);
+		if (index->duration > 0.0)
+			duration = (int)(index->duration + 0.5);
+		else {
+			duration = aac_count_time (data);
+			aac_close (data);
+			data = aac_open_internal (NULL, file);
+		}
 		if (duration > 0 && file_size != -1)
 			avg_bitrate = file_size / duration * 8;
-		aac_close (data);
 
-		data = aac_open_internal (NULL, file);
 		data->duration = duration;
 		data->avg_bitrate = avg_bitrate;
+		if (data->ok) {
+			data->index = index;
+			if (index->duration <= 0.0)
+				data->scan = adts_scan_start (file);
+		}
+		else
+			seek_index_close (index);
 	}
 
 	return data;
@@ -438,17 +710,56 @@ static void aac_info (const char *file_name,
 	}
 }
 
-static int aac_seek (void *unused ATTR_UNUSED, int sec ASSERT_ONLY)
+/* Skip whole frames, reading only their headers, while they end before
+ * the time. */
+static void skip_frames (struct aac_data *data, const double time)
+{
+	while (buffer_fill_frame (data) > 0) {
+		unsigned char *frame = buffer_data (data);
+		double ftime;
+
+		if (buffer_length (data) < 7
+				|| (ftime = frame_time (frame)) == 0.0
+				|| data->time + ftime > time)
+			break;
+
+		buffer_consume (data, parse_frame (frame));
+		data->time += ftime;
+	}
+}
+
+static int aac_seek (void *prv_data, int sec)
 {
+	struct aac_data *data = (struct aac_data *)prv_data;
+	const struct seek_point *point;
+
 	assert (sec >= 0);
 
-	/* AAC will probably never be able to seek.  There is no way of
-	 * relating the time in the audio to the position in the file
-	 * short of pre-processing the file at open and building a seek
-	 * table.  Even then, seeking in the file causes audio glitches
-	 * (see aac_count_time()). */
+	/* There is no way of relating the time in the audio to the
+	 * position in the file other than by the frames noted in the seek
+	 * index: all of them once the file was indexed, otherwise those
+	 * decoded before.  From there the frames' headers say how far to
+	 * skip.  There may be a short glitch after it (see
+	 * aac_count_time()). */
+	adts_scan_collect (data);
+	if (!data->index)
+		return -1;
+
+	point = seek_index_find (data->index, sec);
+	if (!point || (data->index->duration <= 0.0
+				&& sec - point->time > 2 * data->index->step))
+		return -1;
+
+	if (io_seek(data->stream, point->offset, SEEK_SET) == -1)
+		return -1;
 
-	return -1;
+	buffer_flush (data);
+	data->overflow_buf_len = 0;
+	data->time = point->time;
+	skip_frames (data, sec);
+	NeAACDecPostSeekReset (data->decoder, -1);
+
+	return (int)(data->time + 0.5);
 }
 
 /* returns -1 on fatal errors
@@ -461,12 +772,14 @@ static int decode_one_frame (struct aac_data *data, void *buffer, int count)
 	unsigned int aac_data_size;
 	NeAACDecFrameInfo frame_info;
 	char *sample_buf;
+	off_t frame_pos;
 	int bytes, rc;
 
 	rc = buffer_fill_frame (data);
 	if (rc <= 0)
 		return rc;
 
+	frame_pos = io_tell (data->stream) - buffer_length (data);
 	aac_data = buffer_data (data);
 	aac_data_size = buffer_length (data);
 
@@ -498,6 +811,13 @@ static int decode_one_frame (struct aac_data *data, void *buffer, int count)
 		return -2;
 	}
 
+	/* Note where the frame starts while we know its time. */
+	if (data->index && data->time >= 0.0) {
+		seek_index_add (data->index, data->time, frame_pos);
+		data->time += (double)frame_info.samples / data->channels
+		              / data->sample_rate;
+	}
+
 	/* 16-bit samples */
 	bytes = frame_info.samples * 2;
 
@@ -524,6 +844,7 @@ static int aac_decode (void *prv_data, char *buf, int buf_len,
 	int rc;
 
 	decoder_error_clear (&data->error);
+	adts_scan_collect (data);
 
 	sound_params->channels = data->channels;
 	sound_params->rate = data->sample_rate;
@@ -579,6 +900,11 @@ static int aac_our_format_ext (const char *ext)
 	return !strcasecmp (ext, "aac");
 }
 
+static void aac_get_extns (lists_t_strs *extns)
+{
+	lists_strs_append (extns, "aac");
+}
+
 static void aac_get_error (void *prv_data, struct decoder_error *error)
 {
 	struct aac_data *data = (struct aac_data *)prv_data;
@@ -613,7 +939,11 @@ static struct decoder aac_decoder = {
 	aac_get_name,
 	NULL,
 	NULL,
-	aac_get_avg_bitrate
+	aac_get_avg_bitrate,
+	NULL,
+	NULL,
+	aac_get_extns,
+	NULL
 };
 
 struct decoder *plugin_init ()
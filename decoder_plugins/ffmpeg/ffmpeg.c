@@ -35,6 +35,9 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/mathematics.h>
+#ifdef HAVE_SWRESAMPLE
+# include <libswresample/swresample.h>
+#endif
 #if HAVE_LIBAVUTIL_CHANNEL_LAYOUT_H
 # include <libavutil/channel_layout.h>
 #else
@@ -73,6 +76,9 @@
  * result erroneous current time values. */
 #define SEEK_IN_DECODER 0
 
+/* The most channels converted with libswresample. */
+#define SWR_CHANNELS_MAX 64
+
 struct ffmpeg_data
 {
 	AVFormatContext *ic;
@@ -82,8 +88,15 @@ struct ffmpeg_data
 	const AVCodec *codec;
 	AVDictionary *opts;
 
-	char *remain_buf;
-	int remain_buf_len;
+	AVPacket *pkt;          /* packet being decoded, reused */
+	uint8_t *pkt_data;      /* its data pointer as it was read */
+	bool pkt_pending;       /* pkt has data left to decode */
+	AVFrame *frame;         /* last decoded frame, reused */
+	int frame_pos;          /* its first sample not yet returned */
+#ifdef HAVE_SWRESAMPLE
+	SwrContext *swr;        /* converts frames to out_params or NULL */
+#endif
+	struct sound_params out_params; /* of the sound we return */
 
 	bool delay;             /* FFmpeg may buffer samples */
 	bool eof;               /* end of file seen */
@@ -559,27 +572,6 @@ static bool is_seek_broken (struct ffmpeg_data *data)
 	return false;
 }
 
-/* Downmix multi-channel audios to stereo. */
-/*
-static void set_downmixing (struct ffmpeg_data *data)
-{
-#if LIBAVUTIL_VERSION_MAJOR < 58
-	if (av_get_channel_layout_nb_channels (data->enc->channel_layout) <= 2)
-
-		return;
-	data->enc->request_channel_layout = AV_CH_LAYOUT_STEREO;
-#else
-	// option types is a string - see AV_OPT_TYPE_CHLAYOUT handling in ffmpeg:libavutil/opt.c
-	char downmix_layout[64];
-
-	if (data->enc->ch_layout.nb_channels <= 2)
-		return;
-	av_channel_layout_describe(&data->enc->ch_layout, downmix_layout, sizeof(downmix_layout));
-	av_dict_set(&data->opts, "downmix", downmix_layout, 0);
-#endif
-}
-*/
-
 static int ffmpeg_io_read_cb (void *s, uint8_t *buf, int count)
 {
 	int len;
@@ -621,6 +613,165 @@ static int64_t ffmpeg_io_seek_cb (void *s, int64_t offset, int whence)
 	return result;
 }
 
+/* Return the number of channels of the stream. */
+static inline int nb_channels (const struct ffmpeg_data *data)
+{
+#if LIBAVUTIL_VERSION_MAJOR < 58
+	return data->enc->channels;
+#else
+	return data->enc->ch_layout.nb_channels;
+#endif
+}
+
+/* Create a new packet ('cause FFmpeg doesn't provide one).  It's used
+ * for all the packets of the stream. */
+static AVPacket *new_packet (void)
+{
+	AVPacket *pkt;
+
+#if HAVE_AV_PACKET_FNS
+	pkt = av_packet_alloc ();
+	if (!pkt)
+		fatal ("av_packet_alloc() failed to allocate memory");
+#else
+	pkt = (AVPacket *)av_malloc (sizeof (AVPacket));
+	if (!pkt)
+		fatal ("av_malloc() failed to allocate memory");
+	av_init_packet (pkt);
+	pkt->data = NULL;
+	pkt->size = 0;
+#endif
+
+	return pkt;
+}
+
+/* Drop the data of the packet, so that it can take the next one. */
+static inline void unref_packet (AVPacket *pkt)
+{
+#if HAVE_AV_PACKET_FNS
+	av_packet_unref (pkt);
+#else
+	av_free_packet (pkt);
+	av_init_packet (pkt);
+	pkt->data = NULL;
+	pkt->size = 0;
+#endif
+}
+
+static inline void free_packet (AVPacket *pkt)
+{
+#if HAVE_AV_PACKET_FNS
+	av_packet_free (&pkt);
+#else
+	av_free_packet (pkt);
+	av_free (pkt);
+#endif
+}
+
+#ifdef HAVE_SWRESAMPLE
+/* Return the interleaved FFmpeg sample format of the MOC one or
+ * AV_SAMPLE_FMT_NONE if libswresample can't produce it. */
+static enum AVSampleFormat sample_fmt_from_fmt (const long fmt)
+{
+	if ((fmt & SFMT_MASK_ENDIANNESS)
+			&& (fmt & SFMT_MASK_ENDIANNESS) != SFMT_NE)
+		return AV_SAMPLE_FMT_NONE;
+
+	switch (fmt & SFMT_MASK_FORMAT) {
+	case SFMT_U8:
+		return AV_SAMPLE_FMT_U8;
+	case SFMT_S16:
+		return AV_SAMPLE_FMT_S16;
+	case SFMT_S32:
+		return AV_SAMPLE_FMT_S32;
+	case SFMT_FLOAT:
+		return AV_SAMPLE_FMT_FLT;
+	}
+
+	return AV_SAMPLE_FMT_NONE;
+}
+
+/* Make a libswresample context converting from the codec's sound to the
+ * format, rate and channels in *out.  Return NULL on error. */
+static SwrContext *make_swr (struct ffmpeg_data *data,
+                             const struct sound_params *out,
+                             enum AVSampleFormat out_fmt)
+{
+	SwrContext *swr = NULL;
+
+#if LIBAVUTIL_VERSION_MAJOR < 58
+	int64_t in_layout = data->enc->channel_layout;
+
+	if (!in_layout)
+		in_layout = av_get_default_channel_layout (data->enc->channels);
+	swr = swr_alloc_set_opts (NULL,
+	                          av_get_default_channel_layout (out->channels),
+	                          out_fmt, out->rate,
+	                          in_layout, data->enc->sample_fmt,
+	                          data->enc->sample_rate, 0, NULL);
+#else
+	AVChannelLayout out_layout;
+
+	av_channel_layout_default (&out_layout, out->channels);
+	if (swr_alloc_set_opts2 (&swr, &out_layout, out_fmt, out->rate,
+	                         &data->enc->ch_layout, data->enc->sample_fmt,
+	                         data->enc->sample_rate, 0, NULL) < 0)
+		swr = NULL;
+	av_channel_layout_uninit (&out_layout);
+#endif
+
+	if (swr && swr_init (swr) < 0)
+		swr_free (&swr);
+
+	return swr;
+}
+#endif
+
+/* Choose the parameters of the sound we return.  With libswresample it's
+ * the sound the device is going to take, so that interleaving, the
+ * format, the rate and downmixing are all done in one pass here and not
+ * again in the player. */
+static void set_converter (struct ffmpeg_data *data)
+{
+	struct sound_params *out = &data->out_params;
+
+	/* FFmpeg claims to always return native endian. */
+	out->channels = nb_channels (data);
+	out->rate = data->enc->sample_rate;
+	out->fmt = data->fmt | SFMT_NE;
+
+#ifdef HAVE_SWRESAMPLE
+	struct sound_params dev;
+	enum AVSampleFormat out_fmt;
+
+	if (out->channels > SWR_CHANNELS_MAX)
+		return;
+
+	audio_get_output_params (out, &dev);
+	out_fmt = sample_fmt_from_fmt (dev.fmt);
+	if (out_fmt == AV_SAMPLE_FMT_NONE) {
+
+		/* Leave the format to the player, but interleave here. */
+		dev.fmt = out->fmt;
+		out_fmt = av_get_packed_sample_fmt (data->enc->sample_fmt);
+	}
+
+	if (sound_params_eq (dev, *out)
+			&& !av_sample_fmt_is_planar (data->enc->sample_fmt))
+		return;
+
+	data->swr = make_swr (data, &dev, out_fmt);
+	if (!data->swr) {
+		logit ("Can't convert with libswresample, leaving it to the player");
+		return;
+	}
+
+	debug ("Converting to %d channels, %dHz, format 0x%lX",
+	       dev.channels, dev.rate, dev.fmt);
+	*out = dev;
+#endif
+}
+
 static struct ffmpeg_data *ffmpeg_make_data (void)
 {
 	struct ffmpeg_data *data;
@@ -633,8 +784,14 @@ static struct ffmpeg_data *ffmpeg_make_data (void)
 	data->enc = NULL;
 	data->codec = NULL;
 	data->opts = NULL;
-	data->remain_buf = NULL;
-	data->remain_buf_len = 0;
+	data->pkt = NULL;
+	data->pkt_data = NULL;
+	data->pkt_pending = false;
+	data->frame = NULL;
+	data->frame_pos = 0;
+#ifdef HAVE_SWRESAMPLE
+	data->swr = NULL;
+#endif
 	data->delay = false;
 	data->eof = false;
 	data->eos = false;
@@ -774,7 +931,6 @@ static void *ffmpeg_open_internal (struct ffmpeg_data *data)
 		goto end;
 	}
 
-//	set_downmixing (data);
 #if LIBAVCODEC_VERSION_MAJOR < 60
 	if (data->codec->capabilities & AV_CODEC_CAP_TRUNCATED)
 		data->enc->flags |= AV_CODEC_FLAG_TRUNCATED;
@@ -808,6 +964,17 @@ static void *ffmpeg_open_internal (struct ffmpeg_data *data)
 		goto end;
 	}
 
+	data->pkt = new_packet ();
+#ifdef HAVE_AV_FRAME_FNS
+	data->frame = av_frame_alloc ();
+#else
+	data->frame = avcodec_alloc_frame ();
+#endif
+	if (!data->frame)
+		fatal ("Can't allocate frame!");
+
+	set_converter (data);
+
 	data->okay = true;
 
 	if (!data->timing_broken && data->ic->duration >= AV_TIME_BASE)
@@ -860,22 +1027,19 @@ static void *ffmpeg_open_stream (struct io_stream *stream)
 	return ffmpeg_open_internal (data);
 }
 
-static int ffmpeg_can_decode (struct io_stream *stream)
+static int ffmpeg_can_decode (const char *buf, size_t len)
 {
-	int res;
 	AVProbeData probe_data;
 	const AVInputFormat *fmt;
-	char buf[8096 + AVPROBE_PADDING_SIZE] = {0};
+	unsigned char probe_buf[DECODER_PEEK_SIZE + AVPROBE_PADDING_SIZE];
 
-	res = io_peek (stream, buf, sizeof (buf));
-	if (res < 0) {
-		error ("Stream error: %s", io_strerror (stream));
-		return 0;
-	}
+	/* FFmpeg wants the buffer padded with zeros. */
+	memcpy (probe_buf, buf, len);
+	memset (probe_buf + len, 0, AVPROBE_PADDING_SIZE);
 
 	probe_data.filename = NULL;
-	probe_data.buf = (unsigned char*)buf;
-	probe_data.buf_size = sizeof (buf) - AVPROBE_PADDING_SIZE;
+	probe_data.buf = probe_buf;
+	probe_data.buf_size = len;
 #ifdef HAVE_STRUCT_AVPROBEDATA_MIME_TYPE
 	probe_data.mime_type = NULL;
 #endif
@@ -885,156 +1049,76 @@ static int ffmpeg_can_decode (struct io_stream *stream)
 	return fmt != NULL;
 }
 
-static void put_in_remain_buf (struct ffmpeg_data *data, const char *buf,
-		const int len)
+/* Be done with the packet being decoded. */
+static void release_packet (struct ffmpeg_data *data)
 {
-	debug ("Remain: %dB", len);
-
-	data->remain_buf_len = len;
-	data->remain_buf = (char *)xmalloc (len);
-	memcpy (data->remain_buf, buf, len);
+	/* FFmpeg will segfault if the data pointer is not restored. */
+	data->pkt->data = data->pkt_data;
+	unref_packet (data->pkt);
+	data->pkt_pending = false;
 }
 
-static void add_to_remain_buf (struct ffmpeg_data *data, const char *buf,
-		const int len)
+/* Return the number of samples of the decoded frame not returned yet. */
+static inline int frame_left (const struct ffmpeg_data *data)
 {
-	debug ("Adding %dB to remain_buf", len);
-
-	data->remain_buf = (char *)xrealloc (data->remain_buf,
-			data->remain_buf_len + len);
-	memcpy (data->remain_buf + data->remain_buf_len, buf, len);
-	data->remain_buf_len += len;
-
-	debug ("remain_buf is %dB long", data->remain_buf_len);
+	return data->frame->nb_samples - data->frame_pos;
 }
 
-/* Free the remainder buffer. */
-static void free_remain_buf (struct ffmpeg_data *data)
+/* Forget what was read or decoded but not returned yet. */
+static void drop_pending (struct ffmpeg_data *data)
 {
-	free (data->remain_buf);
-	data->remain_buf = NULL;
-	data->remain_buf_len = 0;
-}
-
-/* Satisfy the request from previously decoded samples. */
-static int take_from_remain_buf (struct ffmpeg_data *data, char *buf, int buf_len)
-{
-	int to_copy = MIN (buf_len, data->remain_buf_len);
-
-	debug ("Copying %d bytes from the remain buf", to_copy);
-
-	memcpy (buf, data->remain_buf, to_copy);
-
-	if (to_copy < data->remain_buf_len) {
-		memmove (data->remain_buf, data->remain_buf + to_copy,
-				data->remain_buf_len - to_copy);
-		data->remain_buf_len -= to_copy;
-	}
-	else {
-		debug ("Remain buf is now empty");
-		free_remain_buf (data);
-	}
-
-	return to_copy;
-}
-
-/* Copy samples to output or remain buffer. */
-static int copy_or_buffer (struct ffmpeg_data *data, char *in, int in_len,
-                                                     char *out, int out_len)
-{
-	if (in_len == 0)
-		return 0;
-
-	if (in_len <= out_len) {
-		memcpy (out, in, in_len);
-		return in_len;
-	}
-
-	if (out_len == 0) {
-		add_to_remain_buf (data, in, in_len);
-		return 0;
-	}
-
-	memcpy (out, in, out_len);
-	put_in_remain_buf (data, in + out_len, in_len - out_len);
-	return out_len;
-}
-
-/* Create a new packet ('cause FFmpeg doesn't provide one). */
-static inline AVPacket *new_packet (struct ffmpeg_data *data)
-{
-	AVPacket *pkt;
-
-	assert (data->stream);
-
-#if HAVE_AV_PACKET_FNS
-	pkt = av_packet_alloc ();
-#else
-	pkt = (AVPacket *)av_malloc (sizeof (AVPacket));
-	if (!pkt)
-		fatal ("av_malloc() failed to allocate memory");
-	av_init_packet (pkt);
-	pkt->data = NULL;
-	pkt->size = 0;
+	if (data->pkt_pending)
+		release_packet (data);
+	data->frame_pos = data->frame->nb_samples;
+
+#ifdef HAVE_SWRESAMPLE
+	/* Drop the samples libswresample holds. */
+	if (data->swr && swr_init (data->swr) < 0)
+		logit ("Can't reinitialise libswresample");
 #endif
-
-	pkt->stream_index = data->stream->index;
-
-	return pkt;
 }
 
-static inline void free_packet (AVPacket *pkt)
-{
-#if HAVE_AV_PACKET_FNS
-	av_packet_free (&pkt);
-#else
-	av_free_packet (pkt);
-	av_free (pkt);
-#endif
-}
-
-/* Read a packet from the file or empty packet if flushing delayed
- * samples. */
-static AVPacket *get_packet (struct ffmpeg_data *data)
+/* Read a packet from the file into data->pkt, or make it empty if
+ * flushing delayed samples.  Return false at the end of sound or on
+ * error. */
+static bool get_packet (struct ffmpeg_data *data)
 {
 	int rc;
-	AVPacket *pkt;
 
 	assert (data);
 	assert (!data->eos);
+	assert (!data->pkt_pending);
 
-	pkt = new_packet (data);
+	if (!data->eof) {
+		rc = av_read_frame (data->ic, data->pkt);
+		if (rc >= 0) {
+			debug ("Got %dB packet", data->pkt->size);
+			return true;
+		}
 
-	if (data->eof)
-		return pkt;
+		/* FFmpeg has (at least) two ways of indicating EOF.  (Awesome!) */
+		if (rc == AVERROR_EOF)
+			data->eof = true;
+		if (data->ic->pb && data->ic->pb->eof_reached)
+			data->eof = true;
 
-	rc = av_read_frame (data->ic, pkt);
-	if (rc >= 0) {
-		debug ("Got %dB packet", pkt->size);
-		return pkt;
+		if (!data->eof && rc < 0) {
+			char *buf = ffmpeg_strerror (rc);
+			decoder_error (&data->error, ERROR_FATAL, 0,
+			               "Error in the stream: %s", buf);
+			free (buf);
+			return false;
+		}
 	}
 
-	free_packet (pkt);
-
-	/* FFmpeg has (at least) two ways of indicating EOF.  (Awesome!) */
-	if (rc == AVERROR_EOF)
-		data->eof = true;
-	if (data->ic->pb && data->ic->pb->eof_reached)
-		data->eof = true;
-
-	if (!data->eof && rc < 0) {
-		char *buf = ffmpeg_strerror (rc);
-		decoder_error (&data->error, ERROR_FATAL, 0,
-		               "Error in the stream: %s", buf);
-		free (buf);
-		return NULL;
+	if (data->delay) {
+		unref_packet (data->pkt);
+		data->pkt->stream_index = data->stream->index;
+		return true;
 	}
 
-	if (data->delay)
-		return new_packet (data);
-
 	data->eos = true;
-	return NULL;
+	return false;
 }
 
 #ifndef HAVE_AVCODEC_RECEIVE_FRAME
@@ -1104,87 +1188,165 @@ static int decode_audio (AVCodecContext *ctx, AVFrame *frame,
 }
 #endif
 
-/* Decode samples from packet data. */
-static int decode_packet (struct ffmpeg_data *data, AVPacket *pkt,
-                          char *buf, int buf_len)
+/* Decode the next frame into data->frame, reading packets as needed and
+ * adding their size to *bytes_used.  Return false at the end of sound or
+ * on a fatal error. */
+static bool next_frame (struct ffmpeg_data *data, int *bytes_used)
 {
-	int filled = 0;
-	char *packed;
-	AVFrame *frame;
+	while (!data->eos) {
+		int len, got_frame;
 
-#ifdef HAVE_AV_FRAME_FNS
-	frame = av_frame_alloc ();
-#else
-	frame = avcodec_alloc_frame ();
+		if (!data->pkt_pending) {
+			if (!get_packet (data))
+				return false;
+
+			if (data->pkt->stream_index != data->stream->index) {
+				unref_packet (data->pkt);
+				continue;
+			}
+
+#ifdef AV_PKT_FLAG_CORRUPT
+			if (data->pkt->flags & AV_PKT_FLAG_CORRUPT) {
+				ffmpeg_log_repeats (NULL);
+				debug ("Dropped corrupt packet.");
+				unref_packet (data->pkt);
+				continue;
+			}
 #endif
 
-	do {
-		int len, got_frame, is_planar, packed_size, copied;
+			data->pkt_data = data->pkt->data;
+			data->pkt_pending = true;
+			*bytes_used += data->pkt->size;
+		}
 
-		len = decode_audio (data->enc, frame, &got_frame, pkt);
+		len = decode_audio (data->enc, data->frame, &got_frame, data->pkt);
 
 		if (len < 0) {
 			/* skip frame */
 			decoder_error (&data->error, ERROR_STREAM, 0,
 			               "Error in the stream!");
-			break;
+			release_packet (data);
+			data->eos = data->eof;
+			continue;
 		}
 
 		debug ("Decoded %dB", len);
 
-		pkt->data += len;
-		pkt->size -= len;
+		data->pkt->data += len;
+		data->pkt->size -= len;
+		if (data->pkt->size <= 0)
+			release_packet (data);
 
 		if (!got_frame) {
-			data->eos = data->eof && (pkt->size == 0);
+			data->eos = data->eof && !data->pkt_pending;
 			continue;
 		}
 
-		if (frame->nb_samples == 0)
-			continue;
-
-		is_planar = av_sample_fmt_is_planar (data->enc->sample_fmt);
-		packed = (char *)frame->extended_data[0];
-#if LIBAVUTIL_VERSION_MAJOR < 58
-		int nb_channels = data->enc->channels;
-#else
-		int nb_channels = data->enc->ch_layout.nb_channels;
-#endif
-
-		packed_size = frame->nb_samples * data->sample_width * nb_channels;
-
-		if (is_planar && nb_channels > 1) {
-			int sample, ch;
+		if (data->frame->nb_samples > 0) {
+			data->frame_pos = 0;
+			return true;
+		}
+	}
 
-			packed = xmalloc (packed_size);
+	return false;
+}
 
-			for (sample = 0; sample < frame->nb_samples; sample += 1) {
-				for (ch = 0; ch < nb_channels; ch += 1)
-					memcpy (packed + (sample * nb_channels + ch)
-					                         * data->sample_width,
-					        (char *)frame->extended_data[ch] + sample * data->sample_width,
-					        data->sample_width);
-			}
+#ifdef HAVE_SWRESAMPLE
+/* Convert the samples of the decoded frame from the cursor on into buf
+ * with libswresample, or flush it if there is no frame left.  Return the
+ * number of bytes put into buf. */
+static int convert_frame (struct ffmpeg_data *data, char *buf, int buf_len)
+{
+	const uint8_t *in[SWR_CHANNELS_MAX];
+	uint8_t *out = (uint8_t *)buf;
+	int out_bpf = sfmt_Bps (data->out_params.fmt) * data->out_params.channels;
+	int out_count = buf_len / out_bpf;
+	int in_count = 0, converted;
+
+	if (frame_left (data)) {
+		int ch, width = data->sample_width;
+
+		/* As many as fit, the rest would be buffered by libswresample. */
+		in_count = MIN(frame_left (data),
+		               av_rescale_rnd (out_count, data->enc->sample_rate,
+		                               data->out_params.rate,
+		                               AV_ROUND_DOWN));
+
+		if (av_sample_fmt_is_planar (data->enc->sample_fmt)) {
+			for (ch = 0; ch < nb_channels (data); ch += 1)
+				in[ch] = data->frame->extended_data[ch]
+				         + data->frame_pos * width;
 		}
+		else
+			in[0] = data->frame->extended_data[0]
+			        + data->frame_pos * width * nb_channels (data);
+	}
 
-		copied = copy_or_buffer (data, packed, packed_size, buf, buf_len);
-		buf += copied;
-		filled += copied;
-		buf_len -= copied;
+	converted = swr_convert (data->swr, &out, out_count,
+	                         in_count ? in : NULL, in_count);
+	if (converted < 0) {
+		decoder_error (&data->error, ERROR_STREAM, 0,
+		               "Can't convert the sound!");
+		data->frame_pos = data->frame->nb_samples;
+		return 0;
+	}
 
-		debug ("Copying %dB (%dB filled)", packed_size, filled);
+	data->frame_pos += in_count;
 
-		if (packed != (char *)frame->extended_data[0])
-			free (packed);
-	} while (pkt->size > 0);
+	return converted * out_bpf;
+}
+#endif
 
-#ifdef HAVE_AV_FRAME_FNS
-	av_frame_free (&frame);
-#else
-	avcodec_free_frame (&frame);
+/* Copy the samples of the decoded frame from the cursor on into buf,
+ * interleaving planar ones.  Return the number of bytes copied. */
+static int copy_frame (struct ffmpeg_data *data, char *buf, int buf_len)
+{
+	AVFrame *frame = data->frame;
+	int channels = nb_channels (data);
+	int width = data->sample_width;
+	int samples;
+
+#ifdef HAVE_SWRESAMPLE
+	if (data->swr)
+		return convert_frame (data, buf, buf_len);
 #endif
 
-	return filled;
+	samples = MIN (frame_left (data), buf_len / (width * channels));
+
+	if (av_sample_fmt_is_planar (data->enc->sample_fmt) && channels > 1) {
+		int sample, ch;
+
+		for (ch = 0; ch < channels; ch += 1) {
+			const char *in = (const char *)frame->extended_data[ch]
+			                 + data->frame_pos * width;
+			char *out = buf + ch * width;
+
+			switch (width) {
+			case 2:
+				for (sample = 0; sample < samples; sample += 1)
+					((int16_t *)out)[sample * channels]
+						= ((const int16_t *)in)[sample];
+				break;
+			case 4:
+				for (sample = 0; sample < samples; sample += 1)
+					((int32_t *)out)[sample * channels]
+						= ((const int32_t *)in)[sample];
+				break;
+			default:
+				for (sample = 0; sample < samples; sample += 1)
+					memcpy (out + sample * channels * width,
+					        in + sample * width, width);
+			}
+		}
+	}
+	else
+		memcpy (buf, (char *)frame->extended_data[0]
+		             + data->frame_pos * width * channels,
+		        samples * width * channels);
+
+	data->frame_pos += samples;
+
+	return samples * width * channels;
 }
 
 #if SEEK_IN_DECODER
@@ -1253,67 +1415,44 @@ static int ffmpeg_decode (void *prv_data, char *buf, int buf_len,
 
 	decoder_error_clear (&data->error);
 
-	if (data->eos)
-		return 0;
-
-	/* FFmpeg claims to always return native endian. */
-#if LIBAVUTIL_VERSION_MAJOR < 58
-	int nb_channels = data->enc->channels;
-#else
-	int nb_channels = data->enc->ch_layout.nb_channels;
-#endif
-	sound_params->channels = nb_channels;
-	sound_params->rate = data->enc->sample_rate;
-	sound_params->fmt = data->fmt | SFMT_NE;
+	*sound_params = data->out_params;
 
 #if SEEK_IN_DECODER
 	if (data->seek_req) {
 		data->seek_req = false;
 		if (seek_in_stream (data))
-			free_remain_buf (data);
+			drop_pending (data);
 	}
 #endif
 
-	if (data->remain_buf)
-		return take_from_remain_buf (data, buf, buf_len);
-
-	do {
-		uint8_t *saved_pkt_data_ptr;
-		AVPacket *pkt;
-
-		pkt = get_packet (data);
-		if (!pkt)
+	/* Each frame is copied straight into buf, what doesn't fit is
+	 * returned from the frame on the next call. */
+	while (bytes_produced < buf_len) {
+		int copied;
+
+		if (!frame_left (data) && !next_frame (data, &bytes_used)) {
+#ifdef HAVE_SWRESAMPLE
+			/* Take what libswresample still holds. */
+			if (data->swr)
+				bytes_produced += convert_frame (data,
+				                    buf + bytes_produced,
+				                    buf_len - bytes_produced);
+#endif
 			break;
-
-		if (pkt->stream_index != data->stream->index) {
-			free_packet (pkt);
-			continue;
 		}
 
-#ifdef AV_PKT_FLAG_CORRUPT
-		if (pkt->flags & AV_PKT_FLAG_CORRUPT) {
-			ffmpeg_log_repeats (NULL);
-			debug ("Dropped corrupt packet.");
-			free_packet (pkt);
-			continue;
-		}
-#endif
-
-		saved_pkt_data_ptr = pkt->data;
-		bytes_used += pkt->size;
-
-		bytes_produced = decode_packet (data, pkt, buf, buf_len);
-		buf += bytes_produced;
-		buf_len -= bytes_produced;
-
-		/* FFmpeg will segfault if the data pointer is not restored. */
-		pkt->data = saved_pkt_data_ptr;
-		free_packet (pkt);
-	} while (!bytes_produced && !data->eos);
+		copied = copy_frame (data, buf + bytes_produced,
+		                     buf_len - bytes_produced);
+		if (!copied && frame_left (data))
+			break;
+		bytes_produced += copied;
+	}
 
 	if (!data->timing_broken)
 		data->bitrate = compute_bitrate (sound_params, bytes_used,
-		                                 bytes_produced + data->remain_buf_len,
+		                                 bytes_produced + frame_left (data)
+		                                 * data->sample_width
+		                                 * sound_params->channels,
 		                                 data->bitrate);
 
 	return bytes_produced;
@@ -1341,7 +1480,7 @@ static int ffmpeg_seek (void *prv_data, int sec)
 	if (!seek_in_stream (data, sec))
 		return -1;
 
-	free_remain_buf (data);
+	drop_pending (data);
 
 #endif
 
@@ -1368,7 +1507,15 @@ static void ffmpeg_close (void *prv_data)
 		av_freep (&data->enc);
 #endif
 		avformat_close_input (&data->ic);
-		free_remain_buf (data);
+		free_packet (data->pkt);
+#ifdef HAVE_SWRESAMPLE
+		swr_free (&data->swr);
+#endif
+#ifdef HAVE_AV_FRAME_FNS
+		av_frame_free (&data->frame);
+#else
+		avcodec_free_frame (&data->frame);
+#endif
 	}
 
 	ffmpeg_log_repeats (NULL);
@@ -1432,6 +1579,14 @@ static int ffmpeg_our_format_ext (const char *ext)
 	return (lists_strs_exists (supported_extns, ext)) ? 1 : 0;
 }
 
+static void ffmpeg_get_extns (lists_t_strs *extns)
+{
+	int ix;
+
+	for (ix = 0; ix < lists_strs_size (supported_extns); ix += 1)
+		lists_strs_append (extns, lists_strs_at (supported_extns, ix));
+}
+
 static int ffmpeg_our_format_mime (const char *mime_type)
 {
 	const AVOutputFormat *fmt;
@@ -1453,7 +1608,7 @@ static struct decoder ffmpeg_decoder = {
 	ffmpeg_destroy,
 	ffmpeg_open,
 	ffmpeg_open_stream,
-	ffmpeg_can_decode,
+	NULL,
 	ffmpeg_close,
 	ffmpeg_decode,
 	ffmpeg_seek,
@@ -1466,7 +1621,11 @@ static struct decoder ffmpeg_decoder = {
 	NULL,
 	NULL,
 	ffmpeg_get_iostream,
-	ffmpeg_get_avg_bitrate
+	ffmpeg_get_avg_bitrate,
+	NULL,
+	ffmpeg_can_decode,
+	ffmpeg_get_extns,
+	NULL
 };
 
 struct decoder *plugin_init ()
@@ -36,6 +36,13 @@ then
 			AC_DEFINE([HAVE_LIBAV], 1,
 			          [Define to 1 if you know you have LibAV.])
 		fi
+		PKG_CHECK_MODULES(swresample, libswresample,
+			[ffmpeg_CPPFLAGS="$ffmpeg_CPPFLAGS `$PKG_CONFIG --cflags-only-I libswresample`"
+			 ffmpeg_CFLAGS="$ffmpeg_CFLAGS $swresample_CFLAGS"
+			 ffmpeg_LIBS="$ffmpeg_LIBS $swresample_LIBS"
+			 AC_DEFINE([HAVE_SWRESAMPLE], 1,
+				[Define to 1 if you have libswresample.])],
+			[true])
 		save_CPPFLAGS="$CPPFLAGS"
 		CPPFLAGS="$CPPFLAGS $ffmpeg_CPPFLAGS"
 		save_CFLAGS="$CFLAGS"
@@ -32,7 +32,7 @@
 #define MAX_SUPPORTED_CHANNELS		6
 
 #define SAMPLES_PER_WRITE		512
-#define SAMPLE_BUFFER_SIZE ((FLAC__MAX_BLOCK_SIZE + SAMPLES_PER_WRITE) * MAX_SUPPORTED_CHANNELS * (24/8))
+#define SAMPLE_BUFFER_SIZE ((FLAC__MAX_BLOCK_SIZE + SAMPLES_PER_WRITE) * MAX_SUPPORTED_CHANNELS * 4)
 
 struct flac_data
 {
@@ -47,63 +47,120 @@ struct flac_data
 
 	FLAC__byte sample_buffer[SAMPLE_BUFFER_SIZE];
 	unsigned int sample_buffer_fill;
+	unsigned int sample_buffer_pos; /* where the unread samples start */
 
 	/* sound parameters */
 	unsigned int bits_per_sample;
 	unsigned int sample_rate;
 	unsigned int channels;
 
+	int use_float; /* give float samples, not native integers */
+
 	FLAC__uint64 last_decode_position;
 
 	int ok; /* was this stream successfully opened? */
 	struct decoder_error error;
 };
 
-/* Convert FLAC big-endian data into PCM little-endian. */
+/* Size in bytes of one output sample. */
+static unsigned int output_sample_size (const struct flac_data *data)
+{
+	if (data->use_float || data->bits_per_sample > 16)
+		return 4;
+	if (data->bits_per_sample > 8)
+		return 2;
+	return 1;
+}
+
+/* Interleave the decoded channels into native-endian integers of the
+ * smallest width holding bps bits, scaled up to the full width so that
+ * e.g. 12-bit and 20-bit files play at the right level. */
 static size_t pack_pcm_signed (FLAC__byte *data,
 		const FLAC__int32 * const input[], unsigned int wide_samples,
 		unsigned int channels, unsigned int bps)
 {
-	FLAC__byte * const start = data;
-	FLAC__int32 sample;
-	const FLAC__int32 *input_;
-	unsigned int samples, channel;
-	unsigned int bytes_per_sample;
-	unsigned int incr;
-
-	bytes_per_sample = bps / 8;
-	incr = bytes_per_sample * channels;
-
-	for (channel = 0; channel < channels; channel++) {
-		samples = wide_samples;
-		data = start + bytes_per_sample * channel;
-		input_ = input[channel];
-
-		while(samples--) {
-			sample = *input_++;
-
-			switch(bps) {
-				case 8:
-					data[0] = sample;
-					break;
-				case 16:
-					data[0] = (FLAC__byte)(sample >> 8);
-					data[1] = (FLAC__byte)sample;
-					break;
-				case 24:
-					data[0] = (FLAC__byte)(sample >> 16);
-					data[1] = (FLAC__byte)(sample >> 8);
-					data[2] = (FLAC__byte)sample;
-					break;
+	unsigned int i, channel;
+
+	if (bps <= 8) {
+		FLAC__int8 *out = (FLAC__int8 *)data;
+		const unsigned int shift = 8 - bps;
+
+		for (channel = 0; channel < channels; channel++) {
+			const FLAC__int32 *in = input[channel];
+
+			for (i = 0; i < wide_samples; i++)
+				out[i * channels + channel] = in[i] << shift;
+		}
+
+		return wide_samples * channels;
+	}
+
+	if (bps <= 16) {
+		FLAC__int16 *out = (FLAC__int16 *)data;
+		const unsigned int shift = 16 - bps;
+
+		if (channels == 2) {
+			const FLAC__int32 *left = input[0], *right = input[1];
+
+			for (i = 0; i < wide_samples; i++) {
+				out[2 * i] = left[i] << shift;
+				out[2 * i + 1] = right[i] << shift;
 			}
+		}
+		else {
+			for (channel = 0; channel < channels; channel++) {
+				const FLAC__int32 *in = input[channel];
 
-			data += incr;
+				for (i = 0; i < wide_samples; i++)
+					out[i * channels + channel] = in[i] << shift;
+			}
 		}
+
+		return wide_samples * channels * 2;
 	}
 
-	debug ("Converted %u bytes", wide_samples * channels * bytes_per_sample);
+	{
+		FLAC__int32 *out = (FLAC__int32 *)data;
+		const unsigned int shift = 32 - bps;
+
+		for (channel = 0; channel < channels; channel++) {
+			const FLAC__int32 *in = input[channel];
 
-	return wide_samples * channels * bytes_per_sample;
+			for (i = 0; i < wide_samples; i++)
+				out[i * channels + channel] = (FLAC__uint32)in[i] << shift;
+		}
+
+		return wide_samples * channels * 4;
+	}
+}
+
+/* Interleave the decoded channels into floats in the range [-1.0, 1.0). */
+static size_t pack_pcm_float (FLAC__byte *data,
+		const FLAC__int32 * const input[], unsigned int wide_samples,
+		unsigned int channels, unsigned int bps)
+{
+	float *out = (float *)data;
+	const float scale = 1.0f / (float)(1UL << (bps - 1));
+	unsigned int i, channel;
+
+	if (channels == 2) {
+		const FLAC__int32 *left = input[0], *right = input[1];
+
+		for (i = 0; i < wide_samples; i++) {
+			out[2 * i] = left[i] * scale;
+			out[2 * i + 1] = right[i] * scale;
+		}
+	}
+	else {
+		for (channel = 0; channel < channels; channel++) {
+			const FLAC__int32 *in = input[channel];
+
+			for (i = 0; i < wide_samples; i++)
+				out[i * channels + channel] = in[i] * scale;
+		}
+	}
+
+	return wide_samples * channels * sizeof(float);
 }
 
 static FLAC__StreamDecoderWriteStatus write_cb (
@@ -117,9 +174,15 @@ static FLAC__StreamDecoderWriteStatus write_cb (
 	if (data->abort)
 		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
 
-	data->sample_buffer_fill = pack_pcm_signed (
-			data->sample_buffer, buffer, wide_samples,
-			data->channels, data->bits_per_sample);
+	if (data->use_float)
+		data->sample_buffer_fill = pack_pcm_float (
+				data->sample_buffer, buffer, wide_samples,
+				data->channels, data->bits_per_sample);
+	else
+		data->sample_buffer_fill = pack_pcm_signed (
+				data->sample_buffer, buffer, wide_samples,
+				data->channels, data->bits_per_sample);
+	data->sample_buffer_pos = 0;
 
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
@@ -240,6 +303,8 @@ static void *flac_open_internal (const char *file, const int buffered)
 	data->avg_bitrate = -1;
 	data->abort = 0;
 	data->sample_buffer_fill = 0;
+	data->sample_buffer_pos = 0;
+	data->use_float = 0;
 	data->last_decode_position = 0;
 	data->length = -1;
 	data->ok = 0;
@@ -278,6 +343,15 @@ static void *flac_open_internal (const char *file, const int buffered)
 
 	data->ok = 1;
 
+	{
+		struct sound_params params;
+
+		params.channels = data->channels;
+		params.rate = data->sample_rate;
+		params.fmt = SFMT_FLOAT;
+		data->use_float = audio_float_wanted (&params);
+	}
+
 	if (data->length > 0) {
 		off_t data_size = io_file_size (data->stream);
 		if (data_size > 0) {
@@ -444,19 +518,16 @@ static int flac_decode (void *void_data, char *buf, int buf_len,
 	int bytes_per_sample;
 	FLAC__uint64 decode_position;
 
-	bytes_per_sample = data->bits_per_sample / 8;
-
-	switch (bytes_per_sample) {
-		case 1:
-			sound_params->fmt = SFMT_S8;
-			break;
-		case 2:
-			sound_params->fmt = SFMT_S16 | SFMT_BE;
-			break;
-		case 3:
-			sound_params->fmt = SFMT_S24_3 | SFMT_BE;
-			break;
-	}
+	bytes_per_sample = output_sample_size (data);
+
+	if (data->use_float)
+		sound_params->fmt = SFMT_FLOAT;
+	else if (bytes_per_sample == 1)
+		sound_params->fmt = SFMT_S8;
+	else if (bytes_per_sample == 2)
+		sound_params->fmt = SFMT_S16 | SFMT_NE;
+	else
+		sound_params->fmt = SFMT_S32 | SFMT_NE;
 
 	sound_params->rate = data->sample_rate;
 	sound_params->channels = data->channels;
@@ -499,14 +570,24 @@ static int flac_decode (void *void_data, char *buf, int buf_len,
 	debug ("Decoded %d bytes", data->sample_buffer_fill);
 
 	to_copy = MIN((unsigned int)buf_len, data->sample_buffer_fill);
-	memcpy (buf, data->sample_buffer, to_copy);
-	memmove (data->sample_buffer, data->sample_buffer + to_copy,
-			data->sample_buffer_fill - to_copy);
+	memcpy (buf, data->sample_buffer + data->sample_buffer_pos, to_copy);
+	data->sample_buffer_pos += to_copy;
 	data->sample_buffer_fill -= to_copy;
 
 	return to_copy;
 }
 
+static int flac_decode_float (void *void_data, float *buf, int samples,
+		struct sound_params *sound_params)
+{
+	struct flac_data *data = (struct flac_data *)void_data;
+
+	data->use_float = 1;
+
+	return flac_decode (data, (char *)buf, samples * sizeof(float),
+	                    sound_params) / sizeof(float);
+}
+
 static int flac_get_bitrate (void *void_data)
 {
 	struct flac_data *data = (struct flac_data *)void_data;
@@ -542,6 +623,12 @@ static int flac_our_format_ext (const char *ext)
 	return !strcasecmp (ext, "flac") || !strcasecmp (ext, "fla");
 }
 
+static void flac_get_extns (lists_t_strs *extns)
+{
+	lists_strs_append (extns, "flac");
+	lists_strs_append (extns, "fla");
+}
+
 static int flac_our_format_mime (const char *mime)
 {
 	return !strcasecmp (mime, "audio/flac") ||
@@ -576,7 +663,11 @@ static struct decoder flac_decoder = {
 	flac_get_name,
 	NULL,
 	NULL,
-	flac_get_avg_bitrate
+	flac_get_avg_bitrate,
+	flac_decode_float,
+	NULL,
+	flac_get_extns,
+	NULL
 };
 
 struct decoder *plugin_init ()
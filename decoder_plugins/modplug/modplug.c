@@ -22,7 +22,9 @@
 #include "config.h"
 #endif
 
+#include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <limits.h>
 #include <assert.h>
 #include <libmodplug/modplug.h>
@@ -48,7 +50,6 @@ struct modplug_data
 {
   ModPlugFile *modplugfile;
   int length;
-  char *filedata;
   struct decoder_error error;
 };
 
@@ -108,7 +109,6 @@ static struct modplug_data *make_modplug_data(const char *file) {
   data = (struct modplug_data *)xmalloc (sizeof(struct modplug_data));
 
   data->modplugfile = NULL;
-  data->filedata = NULL;
   decoder_error_init (&data->error);
 
   struct io_stream *s = io_open(file, 0);
@@ -133,15 +133,30 @@ static struct modplug_data *make_modplug_data(const char *file) {
 //    return data;
 //  }
 
-  data->filedata = (char *)xmalloc((size_t)size);
+  // ModPlug_Load() copies what it needs out of the module, so it can be
+  // loaded straight from the mapped file, which is dropped afterwards.
+  // Only when the file can't be mapped is it read into a copy.
+  size_t mapped_size;
+  const void *module = io_map(s, &mapped_size);
+  char *filedata = NULL;
+
+  if(!module || mapped_size != (size_t)size) {
+    filedata = (char *)xmalloc((size_t)size);
+    if(io_read(s, filedata, (size_t)size) != (ssize_t)size) {
+      decoder_error(&data->error, ERROR_FATAL, 0, "Can't read module: %s", file);
+      free(filedata);
+      io_close(s);
+      return data;
+    }
+    module = filedata;
+  }
 
-  io_read(s, data->filedata, (size_t)size);
-  io_close(s);
+  data->modplugfile=ModPlug_Load(module, (int)size);
 
-  data->modplugfile=ModPlug_Load(data->filedata, (int)size);
+  free(filedata);
+  io_close(s);
 
   if(data->modplugfile==NULL) {
-    free(data->filedata);
     decoder_error(&data->error, ERROR_FATAL, 0, "Can't load module: %s", file);
     return data;
   }
@@ -149,6 +164,63 @@ static struct modplug_data *make_modplug_data(const char *file) {
   return data;
 }
 
+// Read the song name from the header of the formats which keep it at a
+// fixed place, so that the title alone doesn't need loading the whole
+// module.  Returns NULL if the format is not recognised.
+static char *probe_module_name(const char *file)
+{
+  // The MOD signature at 1080 is the farthest we look.
+  unsigned char header[1084];
+  struct io_stream *s;
+  ssize_t len;
+  size_t offset, size;
+
+  s = io_open(file, 0);
+  if(!io_ok(s)) {
+    io_close(s);
+    return NULL;
+  }
+  len = io_read(s, header, sizeof(header));
+  io_close(s);
+
+  if(len >= 37 && !memcmp(header, "Extended Module: ", 17)) {
+    offset = 17;                        // XM
+    size = 20;
+  }
+  else if(len >= 30 && !memcmp(header, "IMPM", 4)) {
+    offset = 4;                         // IT
+    size = 26;
+  }
+  else if(len >= 48 && !memcmp(header + 44, "SCRM", 4)) {
+    offset = 0;                         // S3M
+    size = 28;
+  }
+  else if(len >= 24 && !memcmp(header, "MTM", 3)) {
+    offset = 4;                         // MTM
+    size = 20;
+  }
+  else if(len == sizeof(header)
+          && (!memcmp(header + 1080, "M.K.", 4)
+              || !memcmp(header + 1080, "M!K!", 4)
+              || !memcmp(header + 1080, "FLT4", 4)
+              || !memcmp(header + 1080, "FLT8", 4)
+              || (!memcmp(header + 1081, "CHN", 3)
+                  && isdigit(header[1080]))
+              || (!memcmp(header + 1082, "CH", 2)
+                  && isdigit(header[1080]) && isdigit(header[1081])))) {
+    offset = 0;                         // 31-sample MOD
+    size = 20;
+  }
+  else
+    return NULL;
+
+  char *name = (char *)xmalloc(size + 1);
+  memcpy(name, header + offset, size);
+  name[size] = 0;
+
+  return name;
+}
+
 static void *modplug_open (const char *file)
 {
 // this is not really needed but without it the calls would still be made
@@ -175,7 +247,6 @@ static void modplug_close (void *void_data)
 
   if (data->modplugfile) {
     ModPlug_Unload(data->modplugfile);
-    free(data->filedata);
   }
 
   decoder_error_clear (&data->error);
@@ -185,10 +256,27 @@ static void modplug_close (void *void_data)
 static void modplug_info (const char *file_name, struct file_tags *info,
 		const int tags_sel)
 {
+  // The title is in the header; only the time needs the whole module.
+  if(!(tags_sel & TAGS_TIME)) {
+    char *name;
+
+    if(!(tags_sel & TAGS_COMMENTS))
+      return;
+
+    name = probe_module_name(file_name);
+    if(name) {
+      info->title = name;
+      info->filled |= TAGS_COMMENTS;
+      return;
+    }
+  }
+
   struct modplug_data *data = make_modplug_data(file_name);
 
-  if(data->modplugfile==NULL)
+  if(data->modplugfile==NULL) {
+    modplug_close(data);
     return;
+  }
 
   if(tags_sel & TAGS_TIME) {
     info->time = ModPlug_GetLength(data->modplugfile) / 1000;
@@ -275,6 +363,19 @@ static int modplug_our_format_ext(const char *ext)
     !strcasecmp (ext, "UMX");
 }
 
+static void modplug_get_extns (lists_t_strs *extns)
+{
+  static const char *const list[] = {
+    "NONE", "MOD", "S3M", "XM", "MED", "MTM", "IT", "669", "ULT",
+    "STM", "FAR", "AMF", "AMS", "DSM", "MDL", "OKT", "DMF", "PTM",
+    "DBM", "MT2", "AMF0", "PSM", "J2B", "UMX"
+  };
+  size_t ix;
+
+  for (ix = 0; ix < ARRAY_SIZE(list); ix++)
+    lists_strs_append (extns, list[ix]);
+}
+
 static void modplug_get_error (void *prv_data, struct decoder_error *error)
 {
   struct modplug_data *data = (struct modplug_data *)prv_data;
@@ -302,6 +403,10 @@ static struct decoder modplug_decoder =
   NULL,
   NULL,
   NULL,
+  NULL,
+  NULL,
+  NULL,
+  modplug_get_extns,
   NULL
 };
 
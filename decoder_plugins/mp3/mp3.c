@@ -46,11 +46,32 @@
 #include "files.h"
 #include "utf8.h"
 #include "rcc.h"
+#include "seek_index.h"
+#include "conv_memo.h"
 
 #define INPUT_BUFFER	(32 * 1024)
 
+/* Samples of the synthesis filter's delay, the same for every layer. */
+#define MAD_DECODER_DELAY	529
+
 static iconv_t iconv_id3_fix;
 
+/* ID3v1 strings converted last: the same ones come with each file of an
+ * album. */
+#define ID3_MEMO_SIZE	256
+static struct conv_memo *id3_memo = NULL;
+
+/* Positions of frames at regular time intervals from the Xing or VBRI
+ * header. */
+struct seek_table
+{
+	double step;		/* Time between entries in seconds */
+	double duration;	/* Total time in seconds */
+	off_t end;		/* Position of the end of the audio data */
+	unsigned int count;	/* Number of entries (0 if there is no table) */
+	off_t *offsets;
+};
+
 struct mp3_data
 {
 	struct io_stream *io_stream;
@@ -62,8 +83,15 @@ struct mp3_data
 	signed long duration;	/* Total time of the file in seconds
 	                           (used for seeking). */
 	off_t size;				/* Size of the file */
+	off_t audio_start;		/* Position of the first audio frame */
+	double frame_time;		/* Duration of a frame in seconds */
+	struct seek_table toc;
+	struct seek_index *index;	/* NULL for streams */
+	double time;			/* Time of the next frame or -1.0 if
+					   unknown (after an estimated seek) */
 
 	unsigned char in_buff[INPUT_BUFFER + MAD_BUFFER_GUARD];
+	off_t buff_pos;			/* Position of in_buff in the file */
 
 	struct mad_stream stream;
 	struct mad_frame frame;
@@ -71,6 +99,13 @@ struct mp3_data
 
 	int skip_frames; /* how many frames to skip (after seeking) */
 
+	/* From the LAME tag, in samples per channel: the silence added by
+	 * the encoder and the decoder, and the total the decoder gives
+	 * (-1 if there is no tag). */
+	long delay;
+	long padding;
+	long samples;
+
 	int ok; /* was this stream successfully opened? */
 	struct decoder_error error;
 };
@@ -94,6 +129,8 @@ static size_t fill_buff (struct mp3_data *data)
 		remaining = 0;
 	}
 
+	data->buff_pos = io_tell (data->io_stream) - remaining;
+
 	read_size = io_read (data->io_stream, read_start, read_size);
 	if (read_size < 0) {
 		decoder_error (&data->error, ERROR_FATAL, 0,
@@ -114,10 +151,15 @@ static size_t fill_buff (struct mp3_data *data)
 	return read_size;
 }
 
+static char *id3_iconv (const char *str, const void *unused ATTR_UNUSED)
+{
+	return iconv_str (iconv_id3_fix, str);
+}
+
 static char *id3v1_fix (const char *str)
 {
 	if (iconv_id3_fix != (iconv_t)-1)
-		return iconv_str (iconv_id3_fix, str);
+		return conv_memo_convert (id3_memo, str, id3_iconv, NULL);
 	return xstrdup (str);
 }
 
@@ -184,30 +226,159 @@ static char *get_tag (struct id3_tag *tag, const char *what)
 	return comm;
 }
 
+/* Position in the file of the frame whose header was just decoded. */
+static off_t frame_offset (const struct mp3_data *data)
+{
+	return data->buff_pos + (data->stream.this_frame - data->in_buff);
+}
+
+static void seek_table_free (struct seek_table *toc)
+{
+	free (toc->offsets);
+	toc->offsets = NULL;
+	toc->count = 0;
+}
+
+/* Make the seek table from the Xing TOC: entry i is the position at i%
+ * of the duration expressed in 1/256ths of the bytes from start. */
+static void seek_table_from_xing (struct seek_table *toc,
+		const struct xing *xing, const off_t start, const off_t bytes,
+		const double duration)
+{
+	int i;
+
+	toc->offsets = (off_t *)xmalloc (100 * sizeof(off_t));
+	for (i = 0; i < 100; i++)
+		toc->offsets[i] = start + (off_t)(xing->toc[i] / 256.0 * bytes);
+
+	toc->count = 100;
+	toc->step = duration / 100;
+	toc->duration = duration;
+	toc->end = start + bytes;
+}
+
+/* Make the seek table from the VBRI TOC which contains sizes of chunks
+ * of entry_frames frames. */
+static void seek_table_from_vbri (struct seek_table *toc,
+		const struct vbri *vbri, const off_t start,
+		const double frame_time, const double duration)
+{
+	unsigned int i;
+
+	toc->offsets = (off_t *)xmalloc (vbri->entries * sizeof(off_t));
+	toc->offsets[0] = start;
+	for (i = 1; i < vbri->entries; i++)
+		toc->offsets[i] = toc->offsets[i - 1] + vbri->toc[i - 1];
+
+	toc->count = vbri->entries;
+	toc->step = vbri->entry_frames * frame_time;
+	toc->duration = duration;
+	toc->end = toc->offsets[i - 1] + vbri->toc[i - 1];
+}
+
+/* Return the position of the frame playing at sec, interpolating between
+ * the entries. */
+static off_t seek_table_position (const struct seek_table *toc,
+		const double sec)
+{
+	double pos = sec / toc->step;
+	unsigned int i;
+	double t0, t1;
+	off_t p0, p1;
+
+	if (pos >= toc->count - 1) {
+		i = toc->count - 1;
+		t1 = toc->duration;
+		p1 = toc->end;
+	}
+	else {
+		i = pos;
+		t1 = (i + 1) * toc->step;
+		p1 = toc->offsets[i + 1];
+	}
+	t0 = i * toc->step;
+	p0 = toc->offsets[i];
+
+	if (t1 <= t0 || p1 <= p0)
+		return p0;
+
+	return p0 + (off_t)((sec - t0) / (t1 - t0) * (p1 - p0));
+}
+
+/* Look for a Xing/Info or VBRI header in the frame whose header was just
+ * decoded.  Return 1 if there is one which gives the number of frames. */
+static int find_vbr_header (struct mp3_data *data,
+		const struct mad_header *header, struct xing *xing,
+		struct vbri *vbri)
+{
+	const unsigned char *frame = data->stream.this_frame;
+	size_t len = data->stream.next_frame - frame;
+	size_t offset;
+
+	if (header->layer != MAD_LAYER_III)
+		return 0;
+
+	/* The Xing header is placed just after the side information. */
+	if (header->flags & MAD_FLAG_LSF_EXT)
+		offset = header->mode == MAD_MODE_SINGLE_CHANNEL ? 9 : 17;
+	else
+		offset = header->mode == MAD_MODE_SINGLE_CHANNEL ? 17 : 32;
+	offset += 4;
+
+	if (len > offset) {
+		struct mad_bitptr ptr;
+
+		mad_bit_init (&ptr, frame + offset);
+		if (xing_parse (xing, ptr, (len - offset) * 8) != -1) {
+			debug ("Has XING header%s",
+			       xing->flags & XING_LAME ? " with LAME tag" : "");
+			if (xing->flags & XING_FRAMES)
+				return 1;
+			debug ("XING header doesn't contain number of frames.");
+		}
+	}
+
+	/* The VBRI header is always 32 bytes after the frame header. */
+	if (len > 36 && vbri_parse (vbri, frame + 36, len - 36) != -1) {
+		debug ("Has VBRI header");
+		return vbri->frames > 0;
+	}
+
+	return 0;
+}
+
 static int count_time_internal (struct mp3_data *data)
 {
 	struct xing xing;
+	struct vbri vbri;
 	unsigned long bitrate = 0;
-	int has_xing = 0;
+	int has_header = 0;
 	int is_vbr = 0;
+	int from_cache = 0;
 	int num_frames = 0;
+	off_t header_start = 0;
+	double frame_time = 0.0;
+	double time;
 	mad_timer_t duration = mad_timer_zero;
 	struct mad_header header;
-	int good_header = 0; /* Have we decoded any header? */
 
 	mad_header_init (&header);
 	xing_init (&xing);
+	vbri_init (&vbri);
 
-	/* There are three ways of calculating the length of an mp3:
-	  1) Constant bitrate: One frame can provide the information
+	/* There are four ways of calculating the length of an mp3:
+	  1) Xing/Info or VBRI header: It provides the number of frames
+		 (and usually a seek table). Each frame has the same
+		 number of samples, so just use that.
+	  2) Constant bitrate: One frame can provide the information
 		 needed: # of frames and duration. Just see how long it
 		 is and do the division.
-	  2) Variable bitrate: Xing tag. It provides the number of
-		 frames. Each frame has the same number of samples, so
-		 just use that.
-	  3) All: Count up the frames and duration of each frame
-		 by decoding each one. We do this if we've no other
-		 choice, i.e. if it's a VBR file with no Xing tag.
+	  3) Variable bitrate we have seen before: the duration and the
+		 seek index are in the tags cache.
+	  4) All: Count up the frames and duration of each frame
+		 by decoding each one, filling the seek index on the
+		 way. We do this if we've no other choice, i.e. if it's
+		 a VBR file with no header, and only once per file.
 	*/
 
 	while (1) {
@@ -231,23 +402,18 @@ static int count_time_internal (struct mp3_data *data)
 			}
 		}
 
-		good_header = 1;
-
-		/* Limit xing testing to the first frame header */
+		/* Limit VBR header testing to the first frame header */
 		if (!num_frames++) {
-			if (xing_parse(&xing, data->stream.anc_ptr,
-						data->stream.anc_bitlen)
-					!= -1) {
-				is_vbr = 1;
-
-				debug ("Has XING header");
-
-				if (xing.flags & XING_FRAMES) {
-					has_xing = 1;
-					num_frames = xing.frames;
-					break;
-				}
-				debug ("XING header doesn't contain number of frames.");
+			header_start = frame_offset (data);
+			data->audio_start = header_start;
+			frame_time = 32 * MAD_NSBSAMPLES(&header)
+				/ (double)header.samplerate;
+
+			if (find_vbr_header(data, &header, &xing, &vbri)) {
+				has_header = 1;
+				data->audio_start += data->stream.next_frame
+					- data->stream.this_frame;
+				break;
 			}
 		}
 
@@ -256,6 +422,16 @@ static int count_time_internal (struct mp3_data *data)
 			if (bitrate && header.bitrate != bitrate) {
 				debug ("Detected VBR after %d frames", num_frames);
 				is_vbr = 1;
+
+				if (data->index && data->index->duration > 0.0) {
+					debug ("Duration and seek index are in the cache");
+					from_cache = 1;
+					break;
+				}
+
+				if (data->index)
+					seek_index_add (data->index, 0.0,
+							data->audio_start);
 			}
 			else
 				bitrate = header.bitrate;
@@ -269,57 +445,100 @@ static int count_time_internal (struct mp3_data *data)
 			break;
 		}
 
+		if (is_vbr && data->index)
+			seek_index_add (data->index,
+					mad_timer_count (duration, MAD_UNITS_MILLISECONDS)
+					/ 1000.0, frame_offset (data));
 		mad_timer_add (&duration, header.duration);
 	}
 
-	if (!good_header)
-		return -1;
+	data->frame_time = frame_time;
 
-	if (data->size == -1) {
+	if (!num_frames || (!has_header && data->size == -1)) {
+		vbri_finish (&vbri);
 		mad_header_finish(&header);
 		return -1;
 	}
 
-	if (!is_vbr) {
-		/* time in seconds */
-		double time = (data->size * 8.0) / (header.bitrate);
+	if (has_header && (xing.flags & XING_FRAMES)) {
+		double samples = (double)xing.frames
+			* 32 * MAD_NSBSAMPLES(&header);
+
+		if ((xing.flags & XING_LAME)
+				&& samples > xing.delay + xing.padding) {
+			samples -= xing.delay + xing.padding;
+
+			/* The Info frame is decoded too, as silence, and
+			 * libmad gives the sound MAD_DECODER_DELAY samples
+			 * late, which the encoder counts in its padding. */
+			data->samples = (long)(xing.frames + 1)
+				* 32 * MAD_NSBSAMPLES(&header);
+			data->delay = 32 * MAD_NSBSAMPLES(&header)
+				+ xing.delay + MAD_DECODER_DELAY;
+			data->padding = MAX(0, (long)xing.padding
+					- MAD_DECODER_DELAY);
+		}
+		time = samples / header.samplerate;
 
-		double timefrac = (double)time - ((long)(time));
+		if ((xing.flags & XING_TOC) && time > 0.0) {
+			off_t bytes = -1;
 
-		/* samples per frame */
-		long nsamples = 32 * MAD_NSBSAMPLES(&header);
+			if (xing.flags & XING_BYTES)
+				bytes = xing.bytes;
+			else if (data->size != -1)
+				bytes = data->size - header_start;
 
-		/* samplerate is a constant */
-		num_frames = (long) (time * header.samplerate / nsamples);
+			if (bytes > 0)
+				seek_table_from_xing (&data->toc, &xing,
+						header_start, bytes, time);
+		}
+	}
 
-		/* the average bitrate is the constant bitrate */
-		data->avg_bitrate = bitrate;
+	else if (has_header) {
+		time = vbri.frames * frame_time;
 
-		mad_timer_set(&duration, (long)time, (long)(timefrac*100),
-				100);
+		if (vbri.entries && time > 0.0)
+			seek_table_from_vbri (&data->toc, &vbri,
+					data->audio_start, frame_time, time);
 	}
 
-	else if (has_xing) {
-		mad_timer_multiply (&header.duration, num_frames);
-		duration = header.duration;
+	else if (!is_vbr) {
+
+		/* time in seconds, the size excludes the ID3v2 tag */
+		time = ((data->size - data->audio_start) * 8.0)
+			/ (header.bitrate);
+
+		/* the average bitrate is the constant bitrate */
+		data->avg_bitrate = bitrate;
 	}
+
+	else if (from_cache)
+		time = data->index->duration;
+
 	else {
-		/* the durations have been added up, and the number of frames
-		   counted. We do nothing here. */
+		/* the durations have been added up, and the seek index
+		   filled. It's kept for the next time. */
 		debug ("Counted duration by counting frames durations in VBR file.");
+
+		time = mad_timer_count (duration, MAD_UNITS_MILLISECONDS)
+			/ 1000.0;
+
+		if (data->index)
+			seek_index_set_duration (data->index, time);
 	}
 
-	if (data->avg_bitrate == -1
-			&& mad_timer_count(duration, MAD_UNITS_SECONDS) > 0) {
-		data->avg_bitrate = data->size
-				/ mad_timer_count(duration, MAD_UNITS_SECONDS) * 8;
+	vbri_finish (&vbri);
+
+	if (data->avg_bitrate == -1 && data->size != -1 && (long)time > 0) {
+		data->avg_bitrate = (data->size - data->audio_start)
+				/ (long)time * 8;
 	}
 
 	mad_header_finish(&header);
 
-	debug ("MP3 time: %ld", mad_timer_count (duration, MAD_UNITS_SECONDS));
+	debug ("MP3 time: %ld", (long)time);
 
-	return mad_timer_count (duration, MAD_UNITS_SECONDS);
+	return time;
 }
 
 static struct mp3_data *mp3_open_internal (const char *file,
@@ -335,8 +554,17 @@ static struct mp3_data *mp3_open_internal (const char *file,
 	data->freq = 0;
 	data->channels = 0;
 	data->skip_frames = 0;
+	data->delay = 0;
+	data->padding = 0;
+	data->samples = -1;
 	data->bitrate = -1;
 	data->avg_bitrate = -1;
+	data->audio_start = 0;
+	data->frame_time = 0.0;
+	data->toc.count = 0;
+	data->toc.offsets = NULL;
+	data->index = NULL;
+	data->time = 0.0;
 
 	/* Open the file */
 	data->io_stream = io_open (file, buffered);
@@ -353,6 +581,7 @@ static struct mp3_data *mp3_open_internal (const char *file,
 				mad_stream_options (&data->stream,
 					MAD_OPTION_IGNORECRC);
 
+		data->index = seek_index_open (file);
 		data->duration = count_time_internal (data);
 		mad_frame_mute (&data->frame);
 		data->stream.next_frame = NULL;
@@ -394,10 +623,19 @@ static void *mp3_open_stream (struct io_stream *stream)
 	data->freq = 0;
 	data->channels = 0;
 	data->skip_frames = 0;
+	data->delay = 0;
+	data->padding = 0;
+	data->samples = -1;
 	data->bitrate = -1;
 	data->io_stream = stream;
 	data->duration = -1;
 	data->size = -1;
+	data->audio_start = 0;
+	data->frame_time = 0.0;
+	data->toc.count = 0;
+	data->toc.offsets = NULL;
+	data->index = NULL;
+	data->time = -1.0;
 
 	mad_stream_init (&data->stream);
 	mad_frame_init (&data->frame);
@@ -420,6 +658,9 @@ static void mp3_close (void *void_data)
 		mad_synth_finish (&data->synth);
 	}
 	io_close (data->io_stream);
+	seek_table_free (&data->toc);
+	if (data->index)
+		seek_index_close (data->index);
 	decoder_error_clear (&data->error);
 	free (data);
 }
@@ -589,6 +830,15 @@ static int mp3_decode (void *void_data, char *buf, int buf_len,
 			}
 		}
 
+		/* Note where the frame starts while we know its time. */
+		if (data->time >= 0.0) {
+			if (data->index)
+				seek_index_add (data->index, data->time,
+						frame_offset (data));
+			data->time += mad_timer_count (data->frame.header.duration,
+					MAD_UNITS_MILLISECONDS) / 1000.0;
+		}
+
 		if (data->skip_frames) {
 			data->skip_frames--;
 			continue;
@@ -626,6 +876,7 @@ static int mp3_decode (void *void_data, char *buf, int buf_len,
 static int mp3_seek (void *void_data, int sec)
 {
 	struct mp3_data *data = (struct mp3_data *)void_data;
+	const struct seek_point *point = NULL;
 	off_t new_position;
 
 	assert (sec >= 0);
@@ -636,8 +887,22 @@ static int mp3_seek (void *void_data, int sec)
 	if (sec >= data->duration)
 		return -1;
 
-	new_position = ((double) sec /
-			(double) data->duration) * data->size;
+	/* A nearby point in the seek index is exact, the frames up to sec
+	 * are skipped.  Otherwise estimate the position. */
+	if (data->index && data->frame_time > 0.0) {
+		point = seek_index_find (data->index, sec);
+		if (point && sec - point->time > 2 * data->index->step)
+			point = NULL;
+	}
+
+	if (point)
+		new_position = point->offset;
+	else if (data->toc.count)
+		new_position = seek_table_position (&data->toc, sec);
+	else
+		new_position = data->audio_start + ((double) sec /
+				(double) data->duration)
+			* (data->size - data->audio_start);
 
 	debug ("Seeking to %d (byte %"PRId64")", sec, new_position);
 
@@ -659,7 +924,15 @@ static int mp3_seek (void *void_data, int sec)
 	data->stream.sync = 0;
 	data->stream.next_frame = NULL;
 
-	data->skip_frames = 2;
+	if (point) {
+		data->time = point->time;
+		data->skip_frames = MAX(2, (int)((sec - point->time)
+					/ data->frame_time));
+	}
+	else {
+		data->time = -1.0;
+		data->skip_frames = 2;
+	}
 
 	return sec;
 }
@@ -678,6 +951,21 @@ static int mp3_get_avg_bitrate (void *void_data)
 	return data->avg_bitrate / 1000;
 }
 
+static int mp3_get_gapless (void *void_data, long *delay, long *padding,
+		long *frames)
+{
+	struct mp3_data *data = (struct mp3_data *)void_data;
+
+	if (data->samples == -1)
+		return 0;
+
+	*delay = data->delay;
+	*padding = data->padding;
+	*frames = data->samples;
+
+	return 1;
+}
+
 static int mp3_get_duration (void *void_data)
 {
 	struct mp3_data *data = (struct mp3_data *)void_data;
@@ -712,6 +1000,14 @@ static int mp3_our_format_ext (const char *ext)
 		|| !strcasecmp (ext, "mp1");
 }
 
+static void mp3_get_extns (lists_t_strs *extns)
+{
+	lists_strs_append (extns, "mp3");
+	lists_strs_append (extns, "mpga");
+	lists_strs_append (extns, "mp2");
+	lists_strs_append (extns, "mp1");
+}
+
 static void mp3_get_error (void *prv_data, struct decoder_error *error)
 {
 	struct mp3_data *data = (struct mp3_data *)prv_data;
@@ -732,14 +1028,12 @@ static int mp3_our_mime (const char *mime)
 		|| !strncasecmp (mime, "audio/mpeg;", 11);
 }
 
-static int mp3_can_decode (struct io_stream *stream)
+static int mp3_can_decode (const char *buf, size_t len)
 {
-	unsigned char buf[16 * 1024];
-
 	/* We must use such a sophisticated test, because there are Shoutcast
 	 * servers that can start broadcasting in the middle of a frame, so we
 	 * can't use any fewer bytes for magic values. */
-	if (io_peek(stream, buf, sizeof(buf)) == sizeof(buf)) {
+	if (len == DECODER_PEEK_SIZE) {
 		struct mad_stream stream;
 		struct mad_header header;
 		int dec_res;
@@ -747,7 +1041,7 @@ static int mp3_can_decode (struct io_stream *stream)
 		mad_stream_init (&stream);
 		mad_header_init (&header);
 
-		mad_stream_buffer (&stream, buf, sizeof(buf));
+		mad_stream_buffer (&stream, (const unsigned char *)buf, len);
 		stream.error = 0;
 
 		while ((dec_res = mad_header_decode(&header, &stream)) == -1
@@ -766,10 +1060,14 @@ static void mp3_init ()
 			options_get_str("ID3v1TagsEncoding"));
 	if (iconv_id3_fix == (iconv_t)(-1))
 		log_errno ("iconv_open() failed", errno);
+	else
+		id3_memo = conv_memo_new (ID3_MEMO_SIZE);
 }
 
 static void mp3_destroy ()
 {
+	conv_memo_free (id3_memo);
+	id3_memo = NULL;
 	if (iconv_close(iconv_id3_fix) == -1)
 		log_errno ("iconv_close() failed", errno);
 }
@@ -780,7 +1078,7 @@ static struct decoder mp3_decoder = {
 	mp3_destroy,
 	mp3_open,
 	mp3_open_stream,
-	mp3_can_decode,
+	NULL,
 	mp3_close,
 	mp3_decode,
 	mp3_seek,
@@ -793,7 +1091,11 @@ static struct decoder mp3_decoder = {
 	mp3_get_name,
 	NULL,
 	mp3_get_stream,
-	mp3_get_avg_bitrate
+	mp3_get_avg_bitrate,
+	NULL,
+	mp3_can_decode,
+	mp3_get_extns,
+	mp3_get_gapless
 };
 
 struct decoder *plugin_init ()
@@ -23,11 +23,23 @@
 # include "config.h"
 #endif
 
+#include <stdlib.h>
 #include <mad.h>
 
 #include "xing.h"
 
 #define XING_MAGIC	(('X' << 24) | ('i' << 16) | ('n' << 8) | 'g')
+#define INFO_MAGIC	(('I' << 24) | ('n' << 16) | ('f' << 8) | 'o')
+#define LAME_MAGIC	(('L' << 24) | ('A' << 16) | ('M' << 8) | 'E')
+#define VBRI_MAGIC	(('V' << 24) | ('B' << 16) | ('R' << 8) | 'I')
+
+/* The LAME tag is 36 bytes long; the encoder delay and padding are
+ * the 12 bit fields at byte 21. */
+#define LAME_DELAY_OFFSET	21
+#define LAME_TAG_LEN		36
+
+/* Length of the VBRI header without the seek table. */
+#define VBRI_HEADER_LEN		26
 
 /*
  * NAME:	xing->init()
@@ -44,7 +56,14 @@ void xing_init(struct xing *xing)
  */
 int xing_parse(struct xing *xing, struct mad_bitptr ptr, unsigned int bitlen)
 {
-  if (bitlen < 64 || mad_bit_read(&ptr, 32) != XING_MAGIC)
+  unsigned long magic;
+
+  if (bitlen < 64)
+    goto fail;
+
+  /* LAME writes "Info" instead of "Xing" for CBR files. */
+  magic = mad_bit_read(&ptr, 32);
+  if (magic != XING_MAGIC && magic != INFO_MAGIC)
     goto fail;
 
   xing->flags = mad_bit_read(&ptr, 32);
@@ -86,9 +105,87 @@ int xing_parse(struct xing *xing, struct mad_bitptr ptr, unsigned int bitlen)
     bitlen -= 32;
   }
 
+  xing->delay = xing->padding = 0;
+
+  if (bitlen >= LAME_TAG_LEN * 8 && mad_bit_read(&ptr, 32) == LAME_MAGIC) {
+    mad_bit_skip(&ptr, (LAME_DELAY_OFFSET - 4) * 8);
+
+    xing->delay = mad_bit_read(&ptr, 12);
+    xing->padding = mad_bit_read(&ptr, 12);
+    xing->flags |= XING_LAME;
+  }
+
   return 0;
 
 fail:
   xing->flags = 0;
   return -1;
 }
+
+/*
+ * NAME:	vbri->init()
+ * DESCRIPTION:	initialize VBRI structure
+ */
+void vbri_init(struct vbri *vbri)
+{
+  vbri->entries = 0;
+  vbri->toc = 0;
+}
+
+/*
+ * NAME:	vbri->finish()
+ * DESCRIPTION:	free the VBRI seek table
+ */
+void vbri_finish(struct vbri *vbri)
+{
+  free(vbri->toc);
+  vbri_init(vbri);
+}
+
+/*
+ * NAME:	vbri->parse()
+ * DESCRIPTION:	parse a Fraunhofer VBRI header (found 32 bytes after the
+ *		frame header)
+ */
+int vbri_parse(struct vbri *vbri, unsigned char const *buf, unsigned int len)
+{
+  struct mad_bitptr ptr;
+  unsigned int scale, entry_size, i;
+
+  if (len < VBRI_HEADER_LEN)
+    goto fail;
+
+  mad_bit_init(&ptr, buf);
+
+  if (mad_bit_read(&ptr, 32) != VBRI_MAGIC)
+    goto fail;
+
+  mad_bit_skip(&ptr, 48);	/* version, delay, quality */
+
+  vbri->bytes = mad_bit_read(&ptr, 32);
+  vbri->frames = mad_bit_read(&ptr, 32);
+  vbri->entries = mad_bit_read(&ptr, 16);
+  scale = mad_bit_read(&ptr, 16);
+  entry_size = mad_bit_read(&ptr, 16);
+  vbri->entry_frames = mad_bit_read(&ptr, 16);
+
+  if (entry_size < 1 || entry_size > 4 || vbri->entry_frames == 0 ||
+      len - VBRI_HEADER_LEN < vbri->entries * entry_size)
+    goto fail;
+
+  vbri->toc = 0;
+  if (vbri->entries) {
+    vbri->toc = malloc(vbri->entries * sizeof(*vbri->toc));
+    if (!vbri->toc)
+      goto fail;
+
+    for (i = 0; i < vbri->entries; ++i)
+      vbri->toc[i] = mad_bit_read(&ptr, entry_size * 8) * scale;
+  }
+
+  return 0;
+
+fail:
+  vbri_init(vbri);
+  return -1;
+}
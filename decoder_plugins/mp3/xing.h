@@ -30,6 +30,8 @@ struct xing
   unsigned long bytes;		/* total number of bytes */
   unsigned char toc[100];	/* 100-point seek table */
   long scale;			/* ?? */
+  unsigned int delay;		/* LAME encoder delay (samples) */
+  unsigned int padding;		/* LAME end padding (samples) */
 };
 
 enum
@@ -37,7 +39,18 @@ enum
   XING_FRAMES = 0x00000001L,
   XING_BYTES  = 0x00000002L,
   XING_TOC    = 0x00000004L,
-  XING_SCALE  = 0x00000008L
+  XING_SCALE  = 0x00000008L,
+
+  XING_LAME   = 0x00010000L	/* LAME tag follows (not a header flag) */
+};
+
+struct vbri
+{
+  unsigned long bytes;		/* total number of bytes */
+  unsigned long frames;		/* total number of frames */
+  unsigned int entries;		/* number of seek table entries */
+  unsigned int entry_frames;	/* number of frames per entry */
+  unsigned long *toc;		/* size in bytes of each entry */
 };
 
 void xing_init (struct xing *);
@@ -46,4 +59,9 @@ void xing_init (struct xing *);
 
 int xing_parse (struct xing *, struct mad_bitptr, unsigned int);
 
+void vbri_init (struct vbri *);
+void vbri_finish (struct vbri *);
+
+int vbri_parse (struct vbri *, unsigned char const *, unsigned int);
+
 #endif
@@ -30,6 +30,7 @@
 #include "decoder.h"
 #include "io.h"
 #include "audio.h"
+#include "seek_index.h"
 
 
 struct mpg123_data
@@ -46,6 +47,7 @@ struct mpg123_data
 	int ok; /* was this stream successfully opened? */
 	int tags_change; /* the tags were changed from the last call decode function */
 	struct file_tags *tags;
+	struct seek_index *index; /* NULL for streams */
 };
 
 // ID3v1 tag values may not be null-terminated. Truncate trailing spaces and zeros.
@@ -197,6 +199,56 @@ static off_t seek_cb (void *datasource, off_t offset, int whence)
 	return res;
 }
 
+/* Give libmpg123 the frame index kept in the seek index, so it doesn't
+ * need to scan the file.  Return 0 if there is no complete index. */
+static int load_index (struct mpg123_data *data)
+{
+	struct seek_index *idx = data->index;
+	off_t *offsets;
+	off_t step;
+	size_t fill;
+	int spf, res;
+
+	spf = mpg123_spf (data->mf);
+	if (spf <= 0 || idx->duration <= 0.0 || !idx->slots)
+		return 0;
+
+	step = (off_t)(idx->step * data->sample_rate / spf + 0.5);
+	if (step <= 0)
+		return 0;
+
+	offsets = (off_t *)xmalloc (idx->slots * sizeof(off_t));
+	for (fill = 0; fill < idx->slots; fill++) {
+		if (idx->points[fill].time < 0.0)
+			break;
+		offsets[fill] = idx->points[fill].offset;
+	}
+
+	res = mpg123_set_index (data->mf, offsets, step, fill);
+	free (offsets);
+
+	return res == MPG123_OK;
+}
+
+/* Keep the frame index libmpg123 made while scanning the file. */
+static void save_index (struct mpg123_data *data, const double duration)
+{
+	off_t *offsets;
+	off_t step;
+	size_t fill, i;
+	int spf;
+
+	spf = mpg123_spf (data->mf);
+	if (spf <= 0 || mpg123_index (data->mf, &offsets, &step, &fill)
+			!= MPG123_OK || !fill || step <= 0)
+		return;
+
+	seek_index_reset (data->index, (double)step * spf / data->sample_rate);
+	for (i = 0; i < fill; i++)
+		seek_index_add (data->index, i * data->index->step, offsets[i]);
+	seek_index_set_duration (data->index, duration);
+}
+
 static void mpg123_open_stream_internal (struct mpg123_data *data)
 {
 	int res;
@@ -272,13 +324,22 @@ static void mpg123_open_stream_internal (struct mpg123_data *data)
 	debug ("Bitrate %i",info.bitrate);
 	data->bitrate = info.bitrate;
 
-	res = mpg123_scan(data->mf);
-	if (res != MPG123_OK) goto err;
-	samples = mpg123_length(data->mf);
-	if (samples == MPG123_ERR)
-		data->duration = -1;
-	else
-		data->duration =samples/rate;
+	if (data->index && load_index (data)) {
+		samples = data->index->duration * rate;
+		data->duration = data->index->duration;
+	}
+	else {
+		res = mpg123_scan(data->mf);
+		if (res != MPG123_OK) goto err;
+		samples = mpg123_length(data->mf);
+		if (samples == MPG123_ERR)
+			data->duration = -1;
+		else {
+			data->duration =samples/rate;
+			if (data->index)
+				save_index (data, (double)samples / rate);
+		}
+	}
 	debug("Duration: %d, samples %lld",data->duration,(long long)samples);
 	file_size = io_file_size (data->stream);
 	if (data->duration > 0 && file_size != -1)
@@ -309,18 +370,22 @@ static void *mpg123_openX (const char *file)
 	decoder_error_init (&data->error);
 	data->tags_change = 0;
 	data->tags = NULL;
+	data->index = NULL;
 
 	data->stream = io_open (file, 1);
 	if (!io_ok(data->stream)) {
 		decoder_error (&data->error, ERROR_FATAL, 0, "Can't open mpg123 file: %s", io_strerror(data->stream));
 		io_close (data->stream);
 	}
-	else
+	else {
+		data->index = seek_index_open (file);
 		mpg123_open_stream_internal (data);
+	}
 	return data;
 }
 
-static int mpg123_can_decode (__attribute__ ((unused)) struct io_stream *stream)
+static int mpg123_can_decode (__attribute__ ((unused)) const char *buf,
+		__attribute__ ((unused)) size_t len)
 {
 	return 1;
 }
@@ -334,6 +399,7 @@ static void *mpg123_open_stream (struct io_stream *stream)
 
 	decoder_error_init (&data->error);
 	data->stream = stream;
+	data->index = NULL;
 	mpg123_open_stream_internal (data);
 	return data;
 }
@@ -350,6 +416,8 @@ static void mpg123_closeX (void *prv_data)
 	decoder_error_clear (&data->error);
 	if (data->tags)
 		tags_free (data->tags);
+	if (data->index)
+		seek_index_close (data->index);
 	free (data);
 }
 
@@ -474,6 +542,11 @@ static int mpg123_our_format_ext (const char *ext)
 	return !strcasecmp (ext, "mp3");
 }
 
+static void mpg123_get_extns (lists_t_strs *extns)
+{
+	lists_strs_append (extns, "mp3");
+}
+
 static void mpg123_get_error (void *prv_data, struct decoder_error *error)
 {
 	struct mpg123_data *data = (struct mpg123_data *)prv_data;
@@ -492,7 +565,7 @@ static struct decoder mpg123_decoderX = {
 	NULL,
 	mpg123_openX,
 	mpg123_open_stream,
-	mpg123_can_decode,
+	NULL,
 	mpg123_closeX,
 	mpg123_decodeX,
 	mpg123_seekX,
@@ -505,7 +578,11 @@ static struct decoder mpg123_decoderX = {
 	mpg123_get_name,
 	mpg123_current_tags,
 	mpg123_get_stream,
-	mpg123_get_avg_bitrate
+	mpg123_get_avg_bitrate,
+	NULL,
+	mpg123_can_decode,
+	mpg123_get_extns,
+	NULL
 };
 
 struct decoder *plugin_init ()
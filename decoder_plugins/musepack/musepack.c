@@ -462,6 +462,11 @@ static int musepack_our_format_ext (const char *ext)
 	return !strcasecmp (ext, "mpc");
 }
 
+static void musepack_get_extns (lists_t_strs *extns)
+{
+	lists_strs_append (extns, "mpc");
+}
+
 static void musepack_get_error (void *prv_data, struct decoder_error *error)
 {
 	struct musepack_data *data = (struct musepack_data *)prv_data;
@@ -488,7 +493,11 @@ static struct decoder musepack_decoder = {
 	musepack_get_name,
 	NULL /* musepack_current_tags */,
 	musepack_get_stream,
-	musepack_get_avg_bitrate
+	musepack_get_avg_bitrate,
+	NULL,
+	NULL,
+	musepack_get_extns,
+	NULL
 };
 
 struct decoder *plugin_init ()
@@ -43,6 +43,7 @@ struct opus_data
 	int ok; /* was this stream successfully opened? */
 	int tags_change; /* the tags were changed from the last call of opus_current_tags */
 	struct file_tags *tags;
+	int use_float; /* decode with op_read_float() */
 };
 
 
@@ -219,6 +220,24 @@ static void opus_open_stream_internal (struct opus_data *data)
 		debug("Duration: %d, samples %lld",data->duration,(long long)samples);
 		data->ok = 1;
 		get_comment_tags (data->of, data->tags);
+
+#if HAVE_OPUSFILE_FLOAT
+#ifdef INTERNAL_FLOAT
+		data->use_float = 1;
+#else
+		{
+			struct sound_params params;
+
+			params.channels = op_channel_count (data->of, -1);
+			params.rate = 48000;
+			params.fmt = SFMT_FLOAT;
+			data->use_float = audio_float_wanted (&params);
+		}
+#endif
+#else
+		data->use_float = 0;
+#endif
+		debug ("Decoding to %s", data->use_float ? "float" : "16-bit");
 	}
 }
 
@@ -242,11 +261,9 @@ static void *opus_open (const char *file)
 	return data;
 }
 
-static int opus_can_decode (struct io_stream *stream)
+static int opus_can_decode (const char *buf, size_t len)
 {
-	char buf[36];
-
-	if (io_peek (stream, buf, 36) == 36 && !memcmp (buf, "OggS", 4)
+	if (len >= 36 && !memcmp (buf, "OggS", 4)
 	    && !memcmp (buf + 28, "OpusHead", 8))
 		return 1;
 	return 0;
@@ -299,13 +316,14 @@ static int opus_decodeX (void *prv_data, char *buf, int buf_len, struct sound_pa
 	decoder_error_clear (&data->error);
 
 	while (1) {
-#if HAVE_OPUSFILE_FLOAT && INTERNAL_FLOAT
-		ret = op_read_float(data->of, (float *)buf, buf_len/sizeof(float), &current_section);
-		debug("opus float!");
-#else
-		ret = op_read(data->of, (opus_int16 *)buf, buf_len/sizeof(opus_int16), &current_section);
-		debug("opus fixed!");
+#if HAVE_OPUSFILE_FLOAT
+		if (data->use_float)
+			ret = op_read_float (data->of, (float *)buf,
+			                     buf_len / sizeof(float), &current_section);
+		else
 #endif
+			ret = op_read (data->of, (opus_int16 *)buf,
+			               buf_len / sizeof(opus_int16), &current_section);
 		if (ret == 0)
 			return 0;
 		if (ret < 0) {
@@ -324,13 +342,14 @@ static int opus_decodeX (void *prv_data, char *buf, int buf_len, struct sound_pa
 
 		sound_params->channels = op_channel_count (data->of, current_section);
 		sound_params->rate = 48000;
-#if HAVE_OPUSFILE_FLOAT && INTERNAL_FLOAT
-		sound_params->fmt = SFMT_FLOAT;
-		ret *= sound_params->channels * sizeof(float);
-#else
-		sound_params->fmt = SFMT_S16 | SFMT_NE;
-		ret *= sound_params->channels * sizeof(opus_int16);
-#endif
+		if (data->use_float) {
+			sound_params->fmt = SFMT_FLOAT;
+			ret *= sound_params->channels * sizeof(float);
+		}
+		else {
+			sound_params->fmt = SFMT_S16 | SFMT_NE;
+			ret *= sound_params->channels * sizeof(opus_int16);
+		}
 		/* Update the bitrate information */
 		bitrate = op_bitrate_instant (data->of);
 		if (bitrate > 0)
@@ -341,6 +360,19 @@ static int opus_decodeX (void *prv_data, char *buf, int buf_len, struct sound_pa
 	return ret;
 }
 
+#if HAVE_OPUSFILE_FLOAT
+static int opus_decode_float (void *prv_data, float *buf, int samples,
+		struct sound_params *sound_params)
+{
+	struct opus_data *data = (struct opus_data *)prv_data;
+
+	data->use_float = 1;
+
+	return opus_decodeX (data, (char *)buf, samples * sizeof(float),
+	                     sound_params) / sizeof(float);
+}
+#endif
+
 static int opus_current_tags (void *prv_data, struct file_tags *tags)
 {
 	struct opus_data *data = (struct opus_data *)prv_data;
@@ -395,6 +427,11 @@ static int opus_our_format_ext (const char *ext)
 	return !strcasecmp (ext, "opus");
 }
 
+static void opus_get_extns (lists_t_strs *extns)
+{
+	lists_strs_append (extns, "opus");
+}
+
 static void opus_get_error (void *prv_data, struct decoder_error *error)
 {
 	struct opus_data *data = (struct opus_data *)prv_data;
@@ -413,7 +450,7 @@ static struct decoder opus_decoder = {
 	NULL,
 	opus_open,
 	opus_open_stream,
-	opus_can_decode,
+	NULL,
 	opus_close,
 	opus_decodeX,
 	opus_seek,
@@ -426,7 +463,15 @@ static struct decoder opus_decoder = {
 	opus_get_name,
 	opus_current_tags,
 	opus_get_stream,
-	opus_get_avg_bitrate
+	opus_get_avg_bitrate,
+#if HAVE_OPUSFILE_FLOAT
+	opus_decode_float,
+#else
+	NULL,
+#endif
+	opus_can_decode,
+	opus_get_extns,
+	NULL
 };
 
 struct decoder *plugin_init ()
@@ -24,6 +24,8 @@
 #include "sidplay2.h"
 #include "log.h"
 #include "options.h"
+#include "files.h"
+#include "hash_index.h"
 
 static SID_EXTERN::sidplay2 *players [POOL_SIZE];
 
@@ -45,6 +47,35 @@ static bool startAtStart;
 
 static bool playSubTunes;
 
+/* What is known about a tune without loading it into a player: parsing
+ * the file and looking up the lengths of all its songs is done once for
+ * each file (and modification time) and shared by sidplay2_info() and
+ * sidplay2_open(), so listing a directory of tunes is cheap. */
+struct tune_header
+{
+  char *file;
+  time_t mtime;
+  char *title;       /* trimmed info strings, NULL if empty */
+  char *author;
+  char *copyright;
+  int songs;
+  int startSong;
+  int *lengths;      /* of each song in seconds */
+  char md5[SIDTUNE_MD5_LENGTH + 1];
+};
+
+/* The cache keeps the last TUNE_CACHE_SIZE tunes, the oldest entry of
+ * tune_ring is replaced by a new one. */
+#define TUNE_CACHE_SIZE 4096
+
+static struct hash_index *tune_cache;
+
+static struct tune_header *tune_ring [TUNE_CACHE_SIZE];
+
+static int tune_ring_next;
+
+static pthread_mutex_t tune_mtx;
+
 static sidplay2_data * make_data()
 {
   pthread_mutex_lock(&player_select_mtx);
@@ -195,41 +226,186 @@ static sidplay2_data * make_data()
   return s2d;
 }
 
+/* Open the song length database the first time it's needed. */
 static void init_database()
 {
-  int cancel = 0;
+  pthread_mutex_lock(&db_mtx);
+
+  if(init_db)
+  {
+    char * dbfile = options_get_str(OPT_DATABASE);
+
+    init_db = 0;
+
+    if(dbfile!=NULL && dbfile[0]!='\0')
+    {
+      database = new SidDatabase();
+
+      if(database->open(dbfile)<0)
+      {
+        logit("Unable to open SidDatabase %s", dbfile);
+        delete database;
+        database = NULL;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&db_mtx);
+}
+
+static const char *tune_header_key (const void *data, const void *)
+{
+  return ((const struct tune_header *)data)->file;
+}
+
+static void tune_header_free (struct tune_header *th)
+{
+  free(th->file);
+  free(th->title);
+  free(th->author);
+  free(th->copyright);
+  delete [] th->lengths;
+  delete th;
+}
+
+static char *info_string (const SidTuneInfo &sti, const unsigned int ix)
+{
+  if(sti.numberOfInfoStrings>ix && sti.infoString[ix]!=NULL
+      && strlen(sti.infoString[ix])>0)
+    return trim(sti.infoString[ix], strlen(sti.infoString[ix]));
+
+  return NULL;
+}
+
+/* Parse the tune and look up the lengths of its songs. */
+static struct tune_header *tune_header_read (const char *file,
+                                             const time_t mtime)
+{
+  SidTuneMod st(file);
+
+  if(!st)
+    return NULL;
+
+  const SidTuneInfo sti = st.getInfo();
+
+  if(sti.songs < 1 || sti.startSong < 1 || sti.startSong > sti.songs)
+    return NULL;
+  struct tune_header *th = new tune_header;
+
+  th->file = xstrdup(file);
+  th->mtime = mtime;
+  th->title = info_string(sti, STITLE);
+  th->author = info_string(sti, SAUTHOR);
+  th->copyright = info_string(sti, SCOPY);
+  th->songs = sti.songs;
+  th->startSong = sti.startSong;
+  th->lengths = new int [th->songs];
+
+  /* The database is keyed by the MD5 of the tune which is the same for
+   * all the songs: compute it once. */
+  st.createMD5(th->md5);
+  th->md5[SIDTUNE_MD5_LENGTH] = '\0';
+
+  init_database();
 
   pthread_mutex_lock(&db_mtx);
+  for(int s=0; s < th->songs; s++)
+  {
+    int dl = defaultLength;
 
-  if(init_db==0)
-    cancel = 1;
+    if(database!=NULL)
+    {
+      dl = database->length(th->md5, s+1);
+
+      if(dl<1)
+        dl = defaultLength;
+    }
 
-  init_db = 0;
+    if(dl<minLength)
+      dl = minLength;
 
+    th->lengths[s] = dl;
+  }
   pthread_mutex_unlock(&db_mtx);
 
-  if(cancel)
-    return;
+  return th;
+}
 
-  char * dbfile = options_get_str(OPT_DATABASE);
+static struct tune_header *tune_header_copy (const struct tune_header *th)
+{
+  struct tune_header *copy = new tune_header;
+
+  *copy = *th;
+  copy->file = xstrdup(th->file);
+  copy->title = xstrdup(th->title);
+  copy->author = xstrdup(th->author);
+  copy->copyright = xstrdup(th->copyright);
+  copy->lengths = new int [th->songs];
+  memcpy(copy->lengths, th->lengths, th->songs * sizeof(int));
+
+  return copy;
+}
+
+/* Return the header of the tune (a copy to be freed with
+ * tune_header_free()) or NULL if the file is not a valid tune. */
+static struct tune_header *tune_header_get (const char *file)
+{
+  time_t mtime = get_mtime(file);
+  struct tune_header *th, *copy = NULL;
+
+  pthread_mutex_lock(&tune_mtx);
+  th = (struct tune_header *)hash_index_find(tune_cache, file);
+  if(th!=NULL && th->mtime==mtime)
+    copy = tune_header_copy(th);
+  pthread_mutex_unlock(&tune_mtx);
+
+  if(copy!=NULL)
+    return copy;
+
+  th = tune_header_read(file, mtime);
+  if(th==NULL)
+    return NULL;
 
-  if(dbfile!=NULL && dbfile[0]!='\0')
+  copy = tune_header_copy(th);
+
+  pthread_mutex_lock(&tune_mtx);
+  struct tune_header *old =
+    (struct tune_header *)hash_index_find(tune_cache, file);
+
+  if(old!=NULL)
   {
-    database = new SidDatabase();
+    /* Outdated or just read by another thread: replace its content. */
+    struct tune_header tmp = *old;
 
-    if(database->open(dbfile)<0)
+    *old = *th;
+    *th = tmp;
+    tune_header_free(th);
+  }
+  else
+  {
+    if(tune_ring[tune_ring_next]!=NULL)
     {
-      logit("Unable to open SidDatabase %s", dbfile);
-      database = NULL;
+      hash_index_delete(tune_cache, tune_ring[tune_ring_next]->file);
+      tune_header_free(tune_ring[tune_ring_next]);
     }
+    tune_ring[tune_ring_next] = th;
+    tune_ring_next = (tune_ring_next + 1) % TUNE_CACHE_SIZE;
+    hash_index_set(tune_cache, th);
   }
+  pthread_mutex_unlock(&tune_mtx);
+
+  return copy;
 }
 
-extern "C" void *sidplay2_open(const char *file)
+/* Return the first and the last song to be played. */
+static void song_range (const struct tune_header *th, int *first, int *last)
 {
-  if(init_db)
-    init_database();
+  *first = startAtStart ? th->startSong : 1;
+  *last = playSubTunes ? th->songs : *first;
+}
 
+extern "C" void *sidplay2_open(const char *file)
+{
   struct sidplay2_data *s2d = make_data();
 
   decoder_error_init(&s2d->error);
@@ -237,62 +413,27 @@ extern "C" void *sidplay2_open(const char *file)
   s2d->sublengths = NULL;
   s2d->length = 0;
 
-  SidTuneMod *st = new SidTuneMod(file);
+  struct tune_header *th = tune_header_get(file);
 
-  if(!(*st))
+  if(th==NULL)
   {
     decoder_error(&s2d->error, ERROR_FATAL, 0, "Unable to open %s...", file);
-    delete st;
     return s2d;
   }
 
-  s2d->songs = st->getInfo().songs;
+  s2d->songs = th->songs;
 
   s2d->sublengths = new int [s2d->songs];
+  memcpy(s2d->sublengths, th->lengths, s2d->songs * sizeof(int));
 
-  s2d->startSong = st->getInfo().startSong;
+  s2d->startSong = th->startSong;
 
-  s2d->timeStart = 1;
+  song_range(th, &s2d->timeStart, &s2d->timeEnd);
 
-  s2d->timeEnd = s2d->songs;
-
-  if(startAtStart)
-    s2d->timeStart = s2d->startSong;
-
-  if(!playSubTunes)
-    s2d->timeEnd = s2d->timeStart;
+  tune_header_free(th);
 
   for(int s=s2d->timeStart; s <= s2d->timeEnd; s++)
-  {
-    st->selectSong(s);
-
-    if(!(*st))
-    {
-      decoder_error(&s2d->error, ERROR_FATAL, 0,
-                                 "Error determining length of %s", file);
-      delete st;
-      return s2d;
-    }
-
-    if(database!=NULL)
-    {
-      int dl = database->length(*st);
-
-      if(dl<1)
-        dl = defaultLength;
-
-      if(dl<minLength)
-        dl = minLength;
-
-      s2d->length += dl;
-      s2d->sublengths[s-1] = dl;
-    }
-    else
-    {
-      s2d->length += defaultLength;
-      s2d->sublengths[s-1] = defaultLength;
-    }
-  }
+    s2d->length += s2d->sublengths[s-1];
 
   // this should not happen normally...
   if(s2d->length==0)
@@ -300,7 +441,10 @@ extern "C" void *sidplay2_open(const char *file)
 
   s2d->currentSong = s2d->timeStart;
 
-  st->selectSong(s2d->currentSong);
+  SidTuneMod *st = new SidTuneMod(file);
+
+  if(*st)
+    st->selectSong(s2d->currentSong);
 
   if(!(*st))
   {
@@ -335,7 +479,7 @@ extern "C" void sidplay2_close(void *void_data)
     delete data->tune;
 
   if(data->sublengths!=NULL)
-    delete data->sublengths;
+    delete [] data->sublengths;
 
   decoder_error_clear (&data->error);
   free(data);
@@ -351,95 +495,32 @@ extern "C" void sidplay2_get_error (void *prv_data, struct decoder_error *error)
 extern "C" void sidplay2_info (const char *file_name, struct file_tags *info,
 		const int)
 {
-  if(init_db)
-    init_database();
+  struct tune_header *th = tune_header_get(file_name);
 
-  SidTuneMod *st = new SidTuneMod(file_name);
-
-  if(!(*st))
-  {
-    delete st;
+  if(th==NULL)
     return;
-  }
-
-  const SidTuneInfo sti = st->getInfo();
-
-  if
-  (
-    sti.numberOfInfoStrings>0
-    && sti.infoString[STITLE]!=NULL
-    && strlen(sti.infoString[STITLE])>0
-  )
-  {
-    info->title = trim(sti.infoString[STITLE],strlen(sti.infoString[STITLE]));
-    if (info->title)
-      info->filled |= TAGS_COMMENTS;
-  }
-
-  if
-  (
-    sti.numberOfInfoStrings>1
-    && sti.infoString[SAUTHOR]!=NULL
-    && strlen(sti.infoString[SAUTHOR])>0
-  )
-  {
-    info->artist = trim(sti.infoString[SAUTHOR],strlen(sti.infoString[SAUTHOR]));
-    if (info->artist)
-      info->filled |= TAGS_COMMENTS;
-  }
 
+  info->title = th->title;
+  info->artist = th->author;
   // Not really album - but close...
-  if
-  (
-    sti.numberOfInfoStrings>2
-    && sti.infoString[SCOPY]!=NULL
-    && strlen(sti.infoString[SCOPY])>0
-  )
-  {
-    info->album = trim(sti.infoString[SCOPY],strlen(sti.infoString[SCOPY]));
-    if (info->album)
-      info->filled |= TAGS_COMMENTS;
-  }
-
-  info->time = 0;
-
-  int songs = st->getInfo().songs;
+  info->album = th->copyright;
+  th->title = th->author = th->copyright = NULL;
 
-  int countStart = 1;
+  if(info->title || info->artist || info->album)
+    info->filled |= TAGS_COMMENTS;
 
-  int countEnd = songs;
+  int countStart, countEnd;
 
-  if(startAtStart)
-    countStart = st->getInfo().startSong;
+  song_range(th, &countStart, &countEnd);
 
-  if(!playSubTunes)
-    countEnd = countStart;
+  info->time = 0;
 
   for(int s=countStart; s <= countEnd; s++)
-  {
-    st->selectSong(s);
-
-    if(database!=NULL)
-    {
-      int dl = database->length(*st);
-
-      if(dl<1)
-        dl = defaultLength;
-
-      if(dl<minLength)
-        dl = minLength;
-
-      info->time += dl;
-    }
-    else
-    {
-     info->time += defaultLength;
-    }
-  }
+    info->time += th->lengths[s-1];
 
   info->filled |= TAGS_TIME;
 
-  delete st;
+  tune_header_free(th);
 }
 
 /* Seeking is not reliable because I don't know how to keep track of the
@@ -503,6 +584,12 @@ extern "C" int sidplay2_our_format_ext(const char *ext)
     !strcasecmp (ext, "MUS");
 }
 
+extern "C" void sidplay2_get_extns (lists_t_strs *extns)
+{
+  lists_strs_append (extns, "SID");
+  lists_strs_append (extns, "MUS");
+}
+
 extern "C" void init()
 {
   defaultLength = options_get_int(OPT_DEFLEN);
@@ -525,6 +612,15 @@ extern "C" void destroy()
 
   pthread_mutex_destroy(&player_select_mtx);
 
+  for(int i=0; i < TUNE_CACHE_SIZE; i++)
+  {
+    if(tune_ring[i]!=NULL)
+      tune_header_free(tune_ring[i]);
+  }
+  hash_index_free(tune_cache);
+
+  pthread_mutex_destroy(&tune_mtx);
+
   if(database!=NULL)
     delete database;
 
@@ -557,6 +653,10 @@ static struct decoder sidplay2_decoder =
   NULL,
   NULL,
   NULL,
+  NULL,
+  NULL,
+  NULL,
+  sidplay2_get_extns,
   NULL
 };
 
@@ -564,5 +664,7 @@ extern "C" struct decoder *plugin_init ()
 {
   pthread_mutex_init(&db_mtx, NULL);
   pthread_mutex_init(&player_select_mtx, NULL);
+  pthread_mutex_init(&tune_mtx, NULL);
+  tune_cache = hash_index_new(tune_header_key, NULL);
   return &sidplay2_decoder;
 }
@@ -89,6 +89,7 @@ int sidplay2_get_bitrate (void *void_data);
 int sidplay2_get_duration (void *void_data);
 void sidplay2_get_name (const char *file, char buf[4]);
 int sidplay2_our_format_ext (const char *ext);
+void sidplay2_get_extns (lists_t_strs *extns);
 void destroy ();
 void init ();
 decoder *plugin_init ();
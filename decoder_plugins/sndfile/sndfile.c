@@ -13,12 +13,7 @@
 # include "config.h"
 #endif
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
 #include <stdint.h>
-#include <errno.h>
 #include <string.h>
 #include <strings.h>
 #include <assert.h>
@@ -32,6 +27,7 @@
 #include "log.h"
 #include "files.h"
 #include "lists.h"
+#include "io.h"
 
 /* TODO:
  * - sndfile is not thread-safe: use a mutex?
@@ -40,8 +36,10 @@
 
 struct sndfile_data
 {
+	struct io_stream *stream;
 	SNDFILE *sndfile;
 	SF_INFO snd_info;
+	long fmt;	/* format the samples are read in */
 	struct decoder_error error;
 	bool timing_broken;
 	int bitrate;
@@ -102,11 +100,83 @@ static void sndfile_destroy ()
 	lists_strs_free (supported_extns);
 }
 
+/* libsndfile reads the file through the stream, so that it gets the
+ * buffering and mmap() of local files and can read internet streams. */
+
+static sf_count_t vio_get_filelen (void *user_data)
+{
+	struct sndfile_data *data = (struct sndfile_data *)user_data;
+
+	return io_file_size (data->stream);
+}
+
+static sf_count_t vio_seek (sf_count_t offset, int whence, void *user_data)
+{
+	struct sndfile_data *data = (struct sndfile_data *)user_data;
+	off_t pos = io_tell (data->stream);
+	char buf[4096];
+
+	if (io_seekable (data->stream))
+		return io_seek (data->stream, offset, whence);
+
+	/* Internet streams can only be skipped forward, which is all
+	 * libsndfile needs for the formats with the header before the
+	 * audio. */
+	if (whence == SEEK_CUR)
+		offset += pos;
+	else if (whence != SEEK_SET)
+		return -1;
+
+	while (pos < offset) {
+		ssize_t res = io_read (data->stream, buf,
+		                       MIN(offset - pos, (off_t)sizeof(buf)));
+
+		if (res <= 0)
+			return -1;
+		pos += res;
+	}
+
+	return pos == offset ? pos : -1;
+}
+
+static sf_count_t vio_read (void *ptr, sf_count_t count, void *user_data)
+{
+	struct sndfile_data *data = (struct sndfile_data *)user_data;
+	ssize_t res;
+
+	res = io_read (data->stream, ptr, (size_t)count);
+	if (res < 0) {
+		logit ("Read error: %s", io_strerror (data->stream));
+		return 0;
+	}
+
+	return res;
+}
+
+static sf_count_t vio_write (const void *ptr ATTR_UNUSED,
+		sf_count_t count ATTR_UNUSED, void *user_data ATTR_UNUSED)
+{
+	return 0;
+}
+
+static sf_count_t vio_tell (void *user_data)
+{
+	struct sndfile_data *data = (struct sndfile_data *)user_data;
+
+	return io_tell (data->stream);
+}
+
+static SF_VIRTUAL_IO stream_vio = {
+	vio_get_filelen,
+	vio_seek,
+	vio_read,
+	vio_write,
+	vio_tell
+};
+
 /* Return true iff libsndfile's frame count is unknown or miscalculated. */
-static bool is_timing_broken (int fd, struct sndfile_data *data)
+static bool is_timing_broken (struct sndfile_data *data)
 {
-	int rc;
-	struct stat buf;
 	SF_INFO *info = &data->snd_info;
 
 	if (info->frames == SF_COUNT_MAX)
@@ -124,44 +194,85 @@ static bool is_timing_broken (int fd, struct sndfile_data *data)
 	case SF_FORMAT_AU:
 	case SF_FORMAT_SVX:
 	case SF_FORMAT_WAV:
-		rc = fstat (fd, &buf);
-		if (rc == -1) {
-			log_errno ("Can't stat file", errno);
-			/* We really need to return "unknown" here. */
-			return false;
-		}
-
-		if (buf.st_size > UINT32_MAX)
+		if (io_file_size (data->stream) > UINT32_MAX)
 			return true;
 	}
 
 	return false;
 }
 
-static void *sndfile_open (const char *file)
+/* Choose the format to read the samples in: the narrowest one which holds
+ * the file's samples, so that 8 and 16-bit files are not widened to 32
+ * bits only for the output to narrow them again. */
+static long native_format (const int format)
+{
+	switch (format & SF_FORMAT_SUBMASK) {
+	case SF_FORMAT_PCM_S8:
+	case SF_FORMAT_PCM_U8:
+	case SF_FORMAT_PCM_16:
+	case SF_FORMAT_ULAW:
+	case SF_FORMAT_ALAW:
+	case SF_FORMAT_IMA_ADPCM:
+	case SF_FORMAT_MS_ADPCM:
+	case SF_FORMAT_GSM610:
+	case SF_FORMAT_VOX_ADPCM:
+	case SF_FORMAT_G721_32:
+	case SF_FORMAT_G723_24:
+	case SF_FORMAT_G723_40:
+	case SF_FORMAT_DWVW_12:
+	case SF_FORMAT_DWVW_16:
+	case SF_FORMAT_DPCM_8:
+	case SF_FORMAT_DPCM_16:
+		return SFMT_S16 | SFMT_NE;
+#ifdef INTERNAL_FLOAT
+	case SF_FORMAT_FLOAT:
+	case SF_FORMAT_DOUBLE:
+	case SF_FORMAT_VORBIS:
+		return SFMT_FLOAT;
+#endif
+	}
+
+	/* sf_readf_int() gives the samples in an int. */
+	if (sizeof(int) == 4)
+		return SFMT_S32 | SFMT_NE;
+
+	logit ("sizeof(int)=%d is not supported. Please report this error. "
+	       "Falling back to float decoding.", (int)sizeof(int));
+	return SFMT_FLOAT;
+}
+
+static void update_bitrate (struct sndfile_data *data ATTR_UNUSED)
+{
+#ifdef HAVE_SNDFILE_BYTERATE
+	data->bitrate = sf_current_byterate (data->sndfile);
+	if (data->bitrate > 0)
+		data->bitrate = data->bitrate * 8 / 1000;
+#endif
+}
+
+/* Open the file for the opened stream, which is closed with the data. */
+static struct sndfile_data *sndfile_open_internal (struct io_stream *stream)
 {
-	int fd;
 	struct sndfile_data *data;
 
 	data = (struct sndfile_data *)xmalloc (sizeof(struct sndfile_data));
 
 	decoder_error_init (&data->error);
 	memset (&data->snd_info, 0, sizeof(data->snd_info));
+	data->stream = stream;
 	data->sndfile = NULL;
+	data->fmt = 0;
 	data->timing_broken = false;
 	data->bitrate = -1;
 
-	fd = open (file, O_RDONLY);
-	if (fd == -1) {
-		char *err = xstrerror (errno);
+	if (!io_ok (stream)) {
 		decoder_error (&data->error, ERROR_FATAL, 0,
-		               "Can't open file: %s", err);
-		free (err);
+		               "Can't open file: %s", io_strerror (stream));
 		return data;
 	}
 
-	/* sf_open_fd() close()s 'fd' on error and in sf_close(). */
-	data->sndfile = sf_open_fd (fd, SFM_READ, &data->snd_info, SF_TRUE);
+	data->sndfile = sf_open_virtual (&stream_vio, SFM_READ,
+	                                 &data->snd_info, data);
 	if (!data->sndfile) {
 		/* FIXME: sf_strerror is not thread safe with NULL argument */
 		decoder_error (&data->error, ERROR_FATAL, 0,
@@ -170,20 +281,17 @@ static void *sndfile_open (const char *file)
 	}
 
 	/* If the timing is broken, sndfile only decodes up to the broken value. */
-	data->timing_broken = is_timing_broken (fd, data);
+	data->timing_broken = is_timing_broken (data);
 	if (data->timing_broken) {
 		decoder_error (&data->error, ERROR_FATAL, 0,
 		               "File too large for audio format!");
 		return data;
 	}
 
-#ifdef HAVE_SNDFILE_BYTERATE
-	data->bitrate = sf_current_byterate (data->sndfile);
-	if (data->bitrate > 0)
-		data->bitrate = data->bitrate * 8 / 1000;
-#endif
+	update_bitrate (data);
+	data->fmt = native_format (data->snd_info.format);
 
-	debug ("Opened file %s", file);
+	debug ("Opened file %s", stream->name);
 	debug ("Channels: %d", data->snd_info.channels);
 	debug ("Format: %08X", data->snd_info.format);
 	debug ("Sample rate: %d", data->snd_info.samplerate);
@@ -197,12 +305,23 @@ static void *sndfile_open (const char *file)
 	return data;
 }
 
+static void *sndfile_open (const char *file)
+{
+	return sndfile_open_internal (io_open (file, 1));
+}
+
+static void *sndfile_open_stream (struct io_stream *stream)
+{
+	return sndfile_open_internal (stream);
+}
+
 static void sndfile_close (void *void_data)
 {
 	struct sndfile_data *data = (struct sndfile_data *)void_data;
 
 	if (data->sndfile)
 		sf_close (data->sndfile);
+	io_close (data->stream);
 
 	decoder_error_clear (&data->error);
 	free (data);
@@ -212,7 +331,8 @@ static void sndfile_info (const char *file_name, struct file_tags *info,
 		const int tags_sel)
 {
 	struct sndfile_data *data;
-	data = sndfile_open (file_name);
+
+	data = sndfile_open_internal (io_open (file_name, 0));
 	if (!data->sndfile) {
 		sndfile_close (data);
 		return;
@@ -252,57 +372,54 @@ static int sndfile_seek (void *void_data, int sec)
 	return res / data->snd_info.samplerate;
 }
 
+/* Read the samples straight into the buffer in the format chosen for the
+ * file. */
 static int sndfile_decode (void *void_data, char *buf, int buf_len,
 		struct sound_params *sound_params)
 {
 	struct sndfile_data *data = (struct sndfile_data *)void_data;
-	int use_float = 0;
-	int res;
+	sf_count_t frames;
+	int frame_size;
 
 	sound_params->channels = data->snd_info.channels;
 	sound_params->rate = data->snd_info.samplerate;
-
-#ifdef INTERNAL_FLOAT
-	switch (data->snd_info.format & SF_FORMAT_SUBMASK) {
-		case SF_FORMAT_FLOAT:
-		case SF_FORMAT_DOUBLE:
-		case SF_FORMAT_VORBIS:
-			sound_params->fmt = SFMT_FLOAT;
-			use_float = 1;
+	sound_params->fmt = data->fmt;
+
+	frame_size = sfmt_Bps (data->fmt) * data->snd_info.channels;
+	frames = buf_len / frame_size;
+
+	switch (data->fmt & SFMT_MASK_FORMAT) {
+	case SFMT_S16:
+		frames = sf_readf_short (data->sndfile, (short *)buf, frames);
+		break;
+	case SFMT_S32:
+		frames = sf_readf_int (data->sndfile, (int *)buf, frames);
+		break;
+	default:
+		frames = sf_readf_float (data->sndfile, (float *)buf, frames);
 	}
-#endif
 
-	if (!use_float) {
-		switch (sizeof(int)) {
-			case 4:
-				sound_params->fmt = SFMT_S32 | SFMT_NE;
-				break;
-			case 2:
-				sound_params->fmt = SFMT_S16 | SFMT_NE;
-				break;
-			default:
-				logit("sizeof(int)=%d is not supported. Please report this error.\
-						Falling back to float decoding.", (int)sizeof(int));
-				sound_params->fmt = SFMT_FLOAT;
-				use_float = 1;
-		}
-	}
+	update_bitrate (data);
 
-	if (use_float)
-		res = sf_readf_float (data->sndfile, (float *)buf, buf_len /
-		      sizeof(float) / data->snd_info.channels) *
-		      sizeof(float) * data->snd_info.channels;
-	else
-        res = sf_readf_int (data->sndfile, (int *)buf, buf_len / sizeof(int) /
-	          data->snd_info.channels) * sizeof(int) * data->snd_info.channels;
+	return frames * frame_size;
+}
 
-#ifdef HAVE_SNDFILE_BYTERATE
-	data->bitrate = sf_current_byterate (data->sndfile);
-	if (data->bitrate > 0)
-		data->bitrate = data->bitrate * 8 / 1000;
-#endif
+static int sndfile_decode_float (void *void_data, float *buf, int samples,
+		struct sound_params *sound_params)
+{
+	struct sndfile_data *data = (struct sndfile_data *)void_data;
+	sf_count_t frames;
 
-	return res;
+	sound_params->channels = data->snd_info.channels;
+	sound_params->rate = data->snd_info.samplerate;
+	sound_params->fmt = SFMT_FLOAT;
+
+	frames = sf_readf_float (data->sndfile, buf,
+	                         samples / data->snd_info.channels);
+
+	update_bitrate (data);
+
+	return frames * data->snd_info.channels;
 }
 
 static int sndfile_get_bitrate (void *void_data)
@@ -348,6 +465,33 @@ static int sndfile_our_format_ext (const char *ext)
 	return lists_strs_exists (supported_extns, ext);
 }
 
+static void sndfile_get_extns (lists_t_strs *extns)
+{
+	int ix;
+
+	for (ix = 0; ix < lists_strs_size (supported_extns); ix += 1)
+		lists_strs_append (extns, lists_strs_at (supported_extns, ix));
+}
+
+static int sndfile_our_format_mime (const char *mime)
+{
+	static const char *types[] = {
+		"audio/wav", "audio/x-wav", "audio/wave", "audio/vnd.wave",
+		"audio/aiff", "audio/x-aiff", "audio/basic", "audio/x-caf"
+	};
+	size_t ix;
+
+	for (ix = 0; ix < ARRAY_SIZE(types); ix += 1) {
+		size_t len = strlen (types[ix]);
+
+		if (!strncasecmp (mime, types[ix], len)
+				&& (mime[len] == 0 || mime[len] == ';'))
+			return 1;
+	}
+
+	return 0;
+}
+
 static void sndfile_get_error (void *prv_data, struct decoder_error *error)
 {
 	struct sndfile_data *data = (struct sndfile_data *)prv_data;
@@ -360,7 +504,7 @@ static struct decoder sndfile_decoder = {
 	sndfile_init,
 	sndfile_destroy,
 	sndfile_open,
-	NULL,
+	sndfile_open_stream,
 	NULL,
 	sndfile_close,
 	sndfile_decode,
@@ -370,10 +514,14 @@ static struct decoder sndfile_decoder = {
 	sndfile_get_duration,
 	sndfile_get_error,
 	sndfile_our_format_ext,
-	NULL,
+	sndfile_our_format_mime,
 	sndfile_get_name,
 	NULL,
 	NULL,
+	NULL,
+	sndfile_decode_float,
+	NULL,
+	sndfile_get_extns,
 	NULL
 };
 
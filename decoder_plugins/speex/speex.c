@@ -33,6 +33,7 @@
 #include "io.h"
 #include "audio.h"
 #include "log.h"
+#include "seek_index.h"
 
 /* Use speex's audio enhancement feature */
 #define ENHANCE_AUDIO 1
@@ -63,6 +64,8 @@ struct spx_data
 	int output_left;
 	char *comment_packet;
 	int comment_packet_len;
+
+	struct seek_index *index; /* NULL for streams */
 };
 
 static void *process_header (struct spx_data *data)
@@ -229,6 +232,7 @@ static struct spx_data *spx_open_internal (struct io_stream *stream)
 	data->output = NULL;
 	data->comment_packet = NULL;
 	data->bitrate = -1;
+	data->index = NULL;
 	ogg_sync_init (&data->oy);
 	speex_bits_init (&data->bits);
 
@@ -249,12 +253,16 @@ static void *spx_open (const char *file)
 	struct spx_data *data;
 
 	stream = io_open (file, 1);
-	if (io_ok (stream))
+	if (io_ok (stream)) {
 		data = spx_open_internal (stream);
+		if (data->ok)
+			data->index = seek_index_open (file);
+	}
 	else {
 		data = (struct spx_data *)xmalloc (sizeof(struct spx_data));
 		data->stream = stream;
 		data->header = NULL;
+		data->index = NULL;
 		decoder_error_init (&data->error);
 		decoder_error (&data->error, ERROR_STREAM, 0,
 				"Can't open file: %s", io_strerror(stream));
@@ -269,11 +277,9 @@ static void *spx_open_stream (struct io_stream *stream)
 	return spx_open_internal (stream);
 }
 
-static int spx_can_decode (struct io_stream *stream)
+static int spx_can_decode (const char *buf, size_t len)
 {
-	char buf[36];
-
-	if (io_peek(stream, buf, 36) == 36 && !memcmp(buf, "OggS", 4)
+	if (len >= 36 && !memcmp(buf, "OggS", 4)
 			&& !memcmp(buf + 28, "Speex   ", 8))
 		return 1;
 
@@ -297,6 +303,8 @@ static void spx_close (void *prv_data)
 	}
 
 	io_close (data->stream);
+	if (data->index)
+		seek_index_close (data->index);
 	decoder_error_clear (&data->error);
 
 	free (data->header);
@@ -470,6 +478,23 @@ static int spx_seek (void *prv_data, int sec)
 
 	debug ("Seek request to %ds", sec);
 
+	/* The page noted in the seek index when the file was played
+	 * before saves the search. */
+	if (data->index) {
+		const struct seek_point *point;
+
+		point = seek_index_find (data->index, sec);
+		if (point && sec - point->time <= 2 * data->index->step
+				&& io_seek(data->stream, point->offset,
+				           SEEK_SET) != -1) {
+			debug ("Found in the seek index at %.1fs",
+			       point->time);
+			ogg_sync_reset (&data->oy);
+			ogg_stream_reset (&data->os);
+			return point->time;
+		}
+	}
+
 	while (1) {
 		off_t middle = (end + begin) / 2;
 		ogg_int64_t granule_pos;
@@ -606,10 +631,19 @@ static int spx_decode (void *prv_data, char *sound_buf, int nbytes,
 				data->nchannels * data->frames_per_packet;
 		}
 		else if (ogg_sync_pageout(&data->oy, &data->og) == 1) {
+			ogg_int64_t granule_pos;
 
 			/* Read in another ogg page */
 			ogg_stream_pagein (&data->os, &data->og);
-			debug ("Granulepos: %"PRId64, ogg_page_granulepos(&data->og));
+			granule_pos = ogg_page_granulepos (&data->og);
+			debug ("Granulepos: %"PRId64, granule_pos);
+
+			/* The next page starts at the page's granulepos. */
+			if (data->index && granule_pos >= 0)
+				seek_index_add (data->index,
+						(double)granule_pos / data->rate,
+						io_tell (data->stream)
+						- (data->oy.fill - data->oy.returned));
 
 		}
 		else if (!io_eof(data->stream)) {
@@ -663,6 +697,11 @@ static int spx_our_format_ext (const char *ext)
 	return !strcasecmp (ext, "spx");
 }
 
+static void spx_get_extns (lists_t_strs *extns)
+{
+	lists_strs_append (extns, "spx");
+}
+
 static void spx_get_error (void *prv_data, struct decoder_error *error)
 {
 	struct spx_data *data = (struct spx_data *)prv_data;
@@ -684,7 +723,7 @@ static struct decoder spx_decoder = {
 	NULL,
 	spx_open,
 	spx_open_stream,
-	spx_can_decode,
+	NULL,
 	spx_close,
 	spx_decode,
 	spx_seek,
@@ -697,6 +736,10 @@ static struct decoder spx_decoder = {
 	spx_get_name,
 	NULL /*spx_current_tags*/,
 	spx_get_stream,
+	NULL,
+	NULL,
+	spx_can_decode,
+	spx_get_extns,
 	NULL
 };
 
@@ -41,24 +41,74 @@ struct timidity_data
   struct decoder_error error;
 };
 
+// The MIDI file as libtimidity reads it: straight from the mapped file
+// when the stream can map it, through io_read() otherwise.
+struct midi_source
+{
+  struct io_stream *stream;
+  const char *mem;
+  size_t size;
+  size_t pos;
+};
+
+static size_t midi_source_read(void *ctx, void *ptr, size_t size,
+                               size_t nmemb)
+{
+  struct midi_source *src = (struct midi_source *)ctx;
+  ssize_t res;
+
+  if(size == 0)
+    return 0;
+
+  if(src->mem) {
+    nmemb = MIN(nmemb, (src->size - src->pos) / size);
+    memcpy(ptr, src->mem + src->pos, nmemb * size);
+    src->pos += nmemb * size;
+    return nmemb;
+  }
+
+  res = io_read(src->stream, ptr, nmemb * size);
+  return res > 0 ? (size_t)res / size : 0;
+}
+
+static int midi_source_close(void *ctx ATTR_UNUSED)
+{
+  return 0;
+}
+
 static struct timidity_data *make_timidity_data(const char *file) {
   struct timidity_data *data;
+  struct midi_source src;
 
   data = (struct timidity_data *)xmalloc (sizeof(struct timidity_data));
 
   data->midisong = NULL;
   decoder_error_init (&data->error);
 
-  MidIStream *midistream = mid_istream_open_file(file);
+  src.stream = io_open(file, 0);
+  if(!io_ok(src.stream)) {
+    decoder_error(&data->error, ERROR_FATAL, 0,
+                  "Can't open midifile: %s", file);
+    io_close(src.stream);
+    return data;
+  }
+  src.mem = (const char *)io_map(src.stream, &src.size);
+  src.pos = 0;
+
+  MidIStream *midistream = mid_istream_open_callbacks(midi_source_read,
+                                                      midi_source_close,
+                                                      &src);
 
   if(midistream==NULL) {
     decoder_error(&data->error, ERROR_FATAL, 0,
                   "Can't open midifile: %s", file);
+    io_close(src.stream);
     return data;
   }
 
   data->midisong = mid_song_load(midistream, &midioptions);
   mid_istream_close(midistream);
+  io_close(src.stream);
 
   if(data->midisong==NULL) {
     decoder_error(&data->error, ERROR_FATAL, 0,
@@ -166,6 +216,11 @@ static int timidity_our_format_ext(const char *ext)
   return !strcasecmp (ext, "MID");
 }
 
+static void timidity_get_extns (lists_t_strs *extns)
+{
+  lists_strs_append (extns, "MID");
+}
+
 static int timidity_our_format_mime (const char *mime)
 {
   return !strcasecmp(mime, "audio/midi")
@@ -204,6 +259,10 @@ static struct decoder timidity_decoder =
   timidity_get_name,
   NULL,
   NULL,
+  NULL,
+  NULL,
+  NULL,
+  timidity_get_extns,
   NULL
 };
 
@@ -67,6 +67,13 @@ struct vorbis_data
 	int tags_change; /* the tags were changed from the last call of
 	                    ogg_current_tags() */
 	struct file_tags *tags;
+
+#ifndef HAVE_TREMOR
+	int use_float; /* decode with ov_read_float() */
+	float **pcm; /* samples from ov_read_float() not yet returned */
+	long pcm_pos;
+	long pcm_left;
+#endif
 };
 
 static void get_comment_tags (OggVorbis_File *vf, struct file_tags *info)
@@ -239,6 +246,26 @@ static void vorbis_open_stream_internal (struct vorbis_data *data)
 			data->duration = duration / time_scaler;
 		data->ok = 1;
 		get_comment_tags (&data->vf, data->tags);
+
+#ifndef HAVE_TREMOR
+		data->pcm = NULL;
+		data->pcm_pos = 0;
+		data->pcm_left = 0;
+#ifdef INTERNAL_FLOAT
+		data->use_float = 1;
+#else
+		{
+			vorbis_info *info = ov_info (&data->vf, -1);
+			struct sound_params params;
+
+			params.channels = info->channels;
+			params.rate = info->rate;
+			params.fmt = SFMT_FLOAT;
+			data->use_float = audio_float_wanted (&params);
+		}
+#endif
+		debug ("Decoding to %s", data->use_float ? "float" : "16-bit");
+#endif
 	}
 }
 
@@ -273,11 +300,9 @@ static void *vorbis_open (const char *file)
 	return data;
 }
 
-static int vorbis_can_decode (struct io_stream *stream)
+static int vorbis_can_decode (const char *buf, size_t len)
 {
-	char buf[35];
-
-	if (io_peek (stream, buf, 35) == 35 && !memcmp (buf, "OggS", 4)
+	if (len >= 35 && !memcmp (buf, "OggS", 4)
 			&& !memcmp (buf + 28, "\01vorbis", 7))
 		return 1;
 
@@ -319,9 +344,68 @@ static int vorbis_seek (void *prv_data, int sec)
 
 	assert (sec >= 0);
 
+#ifndef HAVE_TREMOR
+	data->pcm_left = 0;
+#endif
+
 	return ov_time_seek (&data->vf, sec * time_scaler) ? -1 : sec;
 }
 
+#ifndef HAVE_TREMOR
+/* Interleave as many of the samples left from ov_read_float() as fit
+ * into buf.  Return the number of bytes written. */
+static int put_float (struct vorbis_data *data, char *buf, int buf_len,
+		const int channels)
+{
+	float *out = (float *)buf;
+	long samples, i;
+	int ch;
+
+	samples = MIN(data->pcm_left,
+	              buf_len / (long)(sizeof(float) * channels));
+
+	if (channels == 2) {
+		const float *left = data->pcm[0] + data->pcm_pos;
+		const float *right = data->pcm[1] + data->pcm_pos;
+
+		for (i = 0; i < samples; i++) {
+			out[2 * i] = left[i];
+			out[2 * i + 1] = right[i];
+		}
+	}
+	else {
+		for (ch = 0; ch < channels; ch++) {
+			const float *in = data->pcm[ch] + data->pcm_pos;
+
+			for (i = 0; i < samples; i++)
+				out[i * channels + ch] = in[i];
+		}
+	}
+
+	data->pcm_pos += samples;
+	data->pcm_left -= samples;
+
+	return samples * sizeof(float) * channels;
+}
+#endif
+
+static void fill_sound_params (struct vorbis_data *data,
+		struct sound_params *sound_params)
+{
+	vorbis_info *info;
+
+	info = ov_info (&data->vf, -1);
+	assert (info != NULL);
+	sound_params->channels = info->channels;
+	sound_params->rate = info->rate;
+#ifndef HAVE_TREMOR
+	if (data->use_float)
+		sound_params->fmt = SFMT_FLOAT;
+	else
+#endif
+		sound_params->fmt = SFMT_S16 | SFMT_NE;
+}
+
 static int vorbis_decode (void *prv_data, char *buf, int buf_len,
 		struct sound_params *sound_params)
 {
@@ -329,21 +413,31 @@ static int vorbis_decode (void *prv_data, char *buf, int buf_len,
 	int ret;
 	int current_section;
 	int bitrate;
-	vorbis_info *info;
 
 	decoder_error_clear (&data->error);
 
-	while (1) {
 #ifndef HAVE_TREMOR
-#ifdef INTERNAL_FLOAT
-	float **pcm = NULL;
-	//We need some safe bound on maximal number of channels... Up to 8 are described in Vorbis specification
-	ret = ov_read_float(&data->vf, &pcm, buf_len/sizeof(float)/8, &current_section);
-	debug("vorbis float");
-#else
-	ret = ov_read(&data->vf, buf, buf_len,(SFMT_NE == SFMT_LE ? 0 : 1), 2, 1, &current_section);
-	debug("vorbis fixed");
+	/* A new link can have more channels than the buffer was sized for,
+	 * so samples from the last ov_read_float() may be left over. */
+	if (data->pcm_left > 0) {
+		fill_sound_params (data, sound_params);
+		return put_float (data, buf, buf_len, sound_params->channels);
+	}
 #endif
+
+	while (1) {
+#ifndef HAVE_TREMOR
+		if (data->use_float) {
+			vorbis_info *info = ov_info (&data->vf, -1);
+
+			ret = ov_read_float (&data->vf, &data->pcm,
+			                     buf_len / (int)(sizeof(float) * info->channels),
+			                     &current_section);
+		}
+		else
+			ret = ov_read (&data->vf, buf, buf_len,
+			               (SFMT_NE == SFMT_LE ? 0 : 1), 2, 1,
+			               &current_section);
 #else
 		ret = ov_read(&data->vf, buf, buf_len, &current_section);
 #endif
@@ -365,59 +459,40 @@ static int vorbis_decode (void *prv_data, char *buf, int buf_len,
 			get_comment_tags (&data->vf, data->tags);
 		}
 
-		info = ov_info (&data->vf, -1);
-		assert (info != NULL);
-		sound_params->channels = info->channels;
-		sound_params->rate = info->rate;
-#ifdef INTERNAL_FLOAT
-		sound_params->fmt = SFMT_FLOAT;
-#else
-		sound_params->fmt = SFMT_S16 | SFMT_NE;
-#endif
+		fill_sound_params (data, sound_params);
 
 		/* Update the bitrate information */
 		bitrate = ov_bitrate_instant (&data->vf);
 		if (bitrate > 0)
 			data->bitrate = bitrate / 1000;
 
-#ifndef HAVE_TREMOR
-#ifdef INTERNAL_FLOAT
-		if (sound_params->channels==1) {
-			assert (sizeof(float) * ret <= (unsigned)buf_len);
-
-			if (ret > 0)
-				memcpy (buf, *pcm, sizeof(float) * ret);
-
-		} 
-		else {
-			float *out; out=malloc(buf_len);
-			int i,j;
-
-			assert (sizeof(float) * ret *sound_params->channels<= (unsigned)buf_len);
-
-			if (ret > 0) {
-				for (i=0 ; i < ret; i++) {
-					for(j=0;j<(sound_params->channels);j++)
-						out[sound_params->channels*i+j] = pcm[j][i];
-				};
-				memcpy(buf,out,sizeof(float)*ret*sound_params->channels);
-			}
-			free(out);
-		}
-#endif
-#endif
 		break;
 	}
 
+#ifndef HAVE_TREMOR
+	if (data->use_float) {
+		data->pcm_pos = 0;
+		data->pcm_left = ret;
+		return put_float (data, buf, buf_len, sound_params->channels);
+	}
+#endif
 
-	debug("decoded: %d samples, %u bytes, buffer: %d, channels: %d",ret,(unsigned int)sizeof(float)*ret*sound_params->channels,buf_len,sound_params->channels);
-#ifdef INTERNAL_FLOAT
-	return ret*sizeof(float)*sound_params->channels;
-#else
 	return ret;
-#endif
 }
 
+#ifndef HAVE_TREMOR
+static int vorbis_decode_float (void *prv_data, float *buf, int samples,
+		struct sound_params *sound_params)
+{
+	struct vorbis_data *data = (struct vorbis_data *)prv_data;
+
+	data->use_float = 1;
+
+	return vorbis_decode (data, (char *)buf, samples * sizeof(float),
+	                      sound_params) / sizeof(float);
+}
+#endif
+
 static int vorbis_current_tags (void *prv_data, struct file_tags *tags)
 {
 	struct vorbis_data *data = (struct vorbis_data *)prv_data;
@@ -471,6 +546,12 @@ static int vorbis_our_format_ext (const char *ext)
 		|| !strcasecmp (ext, "oga");
 }
 
+static void vorbis_get_extns (lists_t_strs *extns)
+{
+	lists_strs_append (extns, "ogg");
+	lists_strs_append (extns, "oga");
+}
+
 static void vorbis_get_error (void *prv_data, struct decoder_error *error)
 {
 	struct vorbis_data *data = (struct vorbis_data *)prv_data;
@@ -492,7 +573,7 @@ static struct decoder vorbis_decoder = {
 	NULL,
 	vorbis_open,
 	vorbis_open_stream,
-	vorbis_can_decode,
+	NULL,
 	vorbis_close,
 	vorbis_decode,
 	vorbis_seek,
@@ -505,7 +586,15 @@ static struct decoder vorbis_decoder = {
 	vorbis_get_name,
 	vorbis_current_tags,
 	vorbis_get_stream,
-	vorbis_get_avg_bitrate
+	vorbis_get_avg_bitrate,
+#ifndef HAVE_TREMOR
+	vorbis_decode_float,
+#else
+	NULL,
+#endif
+	vorbis_can_decode,
+	vorbis_get_extns,
+	NULL
 };
 
 struct decoder *plugin_init ()
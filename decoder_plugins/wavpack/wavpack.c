@@ -276,6 +276,11 @@ static int wav_our_format_ext(const char *ext)
     !strcasecmp (ext, "WV");
 }
 
+static void wav_get_extns (lists_t_strs *extns)
+{
+  lists_strs_append (extns, "WV");
+}
+
 static struct decoder wv_decoder = {
         DECODER_API_VERSION,
         NULL,//wav_init
@@ -295,7 +300,11 @@ static struct decoder wv_decoder = {
         wav_get_name,
         NULL,//wav_current_tags,
         NULL,//wav_get_stream
-        wav_get_avg_bitrate
+        wav_get_avg_bitrate,
+        NULL,
+        NULL,
+        wav_get_extns,
+        NULL
 };
 
 struct decoder *plugin_init ()
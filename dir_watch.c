@@ -0,0 +1,359 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Watching the directories of files for changes made by other programs.
+ * A thread reads the inotify events and passes them to a callback.  The
+ * number of directories is limited, the files in those over the limit are
+ * just not covered.  Without inotify nothing is watched: dir_watch_new()
+ * returns NULL and the other functions accept it. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "hash_index.h"
+#include "dir_watch.h"
+
+/* The most directories watched. */
+#define DIR_WATCH_MAX	1024
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define WATCH_MASK	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM \
+			 | IN_DELETE | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct watched_dir
+{
+	int wd;
+	char *dir;
+};
+
+struct dir_watch
+{
+	int fd;				/* inotify */
+	int stop_pipe[2];		/* written to stop the thread */
+	pthread_t thread;
+	dir_watch_cb *cb;
+	void *data;
+
+	pthread_mutex_t mtx;		/* for the fields below */
+	struct watched_dir *dirs[DIR_WATCH_MAX];
+	int count;
+	struct hash_index *index;	/* of dirs by the directory */
+	bool full_logged;
+};
+
+static const char *watched_dir_key (const void *data,
+                                    const void *unused ATTR_UNUSED)
+{
+	return ((const struct watched_dir *)data)->dir;
+}
+
+/* Return the index of the directory with this watch descriptor or -1. */
+static int find_wd (const struct dir_watch *w, const int wd)
+{
+	int i;
+
+	for (i = 0; i < w->count; i++)
+		if (w->dirs[i]->wd == wd)
+			return i;
+
+	return -1;
+}
+
+static void remove_dir (struct dir_watch *w, const int i)
+{
+	hash_index_delete (w->index, w->dirs[i]->dir);
+	free (w->dirs[i]->dir);
+	free (w->dirs[i]);
+	w->dirs[i] = w->dirs[--w->count];
+}
+
+static void handle_event (struct dir_watch *w, const struct inotify_event *ev)
+{
+	char *path = NULL;
+	enum dir_watch_event event;
+	int i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		logit ("Directory watch events were lost");
+		w->cb (w->data, NULL, DIR_WATCH_LOST);
+		return;
+	}
+
+	LOCK (w->mtx);
+
+	if ((i = find_wd (w, ev->wd)) == -1) {
+		UNLOCK (w->mtx);
+		return;
+	}
+
+	if (ev->mask & IN_IGNORED) {
+		debug ("Stopped watching %s", w->dirs[i]->dir);
+		path = xstrdup (w->dirs[i]->dir);
+		remove_dir (w, i);
+		event = DIR_WATCH_LOST;
+	}
+	else if (ev->mask & IN_MOVE_SELF) {
+
+		/* The names of its files are wrong from now on.  IN_IGNORED
+		 * follows. */
+		inotify_rm_watch (w->fd, ev->wd);
+	}
+	else if (ev->len && !(ev->mask & IN_ISDIR)) {
+		path = format_msg ("%s/%s", strcmp (w->dirs[i]->dir, "/")
+		                   ? w->dirs[i]->dir : "", ev->name);
+		event = ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)
+		        ? DIR_WATCH_CHANGED : DIR_WATCH_GONE;
+	}
+
+	UNLOCK (w->mtx);
+
+	if (path) {
+		w->cb (w->data, path, event);
+		free (path);
+	}
+}
+
+static void *watch_thread (void *watch_ptr)
+{
+	struct dir_watch *w = (struct dir_watch *)watch_ptr;
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2];
+
+	fds[0].fd = w->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = w->stop_pipe[0];
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		ssize_t len;
+		char *p;
+
+		if (poll (fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_errno ("poll() on the directory watch failed", errno);
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		len = read (w->fd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			log_errno ("Can't read the directory watch events", errno);
+			break;
+		}
+
+		for (p = buf; p < buf + len; ) {
+			const struct inotify_event *ev
+				= (const struct inotify_event *)p;
+
+			handle_event (w, ev);
+			p += sizeof (struct inotify_event) + ev->len;
+		}
+	}
+
+	return NULL;
+}
+
+/* Start watching, cb is called on the changes in the directories added.
+ * Return NULL if it's not possible. */
+struct dir_watch *dir_watch_new (dir_watch_cb *cb, void *data)
+{
+	struct dir_watch *w;
+	int rc;
+
+	w = (struct dir_watch *)xmalloc (sizeof (struct dir_watch));
+
+	w->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd == -1) {
+		log_errno ("Can't initialize inotify", errno);
+		free (w);
+		return NULL;
+	}
+
+	if (pipe (w->stop_pipe) == -1) {
+		log_errno ("Can't create a pipe", errno);
+		close (w->fd);
+		free (w);
+		return NULL;
+	}
+
+	w->cb = cb;
+	w->data = data;
+	pthread_mutex_init (&w->mtx, NULL);
+	w->count = 0;
+	w->index = hash_index_new (watched_dir_key, NULL);
+	w->full_logged = false;
+
+	rc = pthread_create (&w->thread, NULL, watch_thread, w);
+	if (rc != 0) {
+		log_errno ("Can't create the directory watch thread", rc);
+		w->thread = pthread_self ();
+		dir_watch_free (w);
+		return NULL;
+	}
+
+	return w;
+}
+
+void dir_watch_free (struct dir_watch *w)
+{
+	if (!w)
+		return;
+
+	if (!pthread_equal (w->thread, pthread_self ())) {
+		if (write (w->stop_pipe[1], "x", 1) != 1)
+			log_errno ("Can't stop the directory watch thread", errno);
+		pthread_join (w->thread, NULL);
+	}
+
+	close (w->stop_pipe[0]);
+	close (w->stop_pipe[1]);
+	close (w->fd);
+
+	while (w->count)
+		remove_dir (w, w->count - 1);
+	hash_index_free (w->index);
+	pthread_mutex_destroy (&w->mtx);
+	free (w);
+}
+
+/* Copy the directory of the file (absolute path) to buf, return false if
+ * it's too long. */
+static bool file_dir (const char *file, char *buf)
+{
+	const char *slash = strrchr (file, '/');
+	size_t len;
+
+	if (!slash)
+		return false;
+
+	len = slash == file ? 1 : (size_t)(slash - file);
+	if (len >= PATH_MAX)
+		return false;
+
+	memcpy (buf, file, len);
+	buf[len] = 0;
+
+	return true;
+}
+
+/* Watch the directory of the file (absolute path) if it isn't already and
+ * the limit allows it. */
+void dir_watch_add (struct dir_watch *w, const char *file)
+{
+	char dir[PATH_MAX];
+	int wd;
+
+	if (!w || !file_dir (file, dir))
+		return;
+
+	LOCK (w->mtx);
+
+	if (hash_index_find (w->index, dir)) {
+		UNLOCK (w->mtx);
+		return;
+	}
+
+	if (w->count == DIR_WATCH_MAX) {
+		if (!w->full_logged) {
+			logit ("Watching %d directories, not watching more",
+			       DIR_WATCH_MAX);
+			w->full_logged = true;
+		}
+		UNLOCK (w->mtx);
+		return;
+	}
+
+	wd = inotify_add_watch (w->fd, dir, WATCH_MASK);
+	if (wd == -1) {
+		char *err = xstrerror (errno);
+		debug ("Can't watch %s: %s", dir, err);
+		free (err);
+	}
+
+	/* The same directory under another name (through a symlink) gives
+	 * the same descriptor, the events come under the first name. */
+	else if (find_wd (w, wd) == -1) {
+		struct watched_dir *d;
+
+		d = (struct watched_dir *)xmalloc (sizeof (struct watched_dir));
+		d->wd = wd;
+		d->dir = xstrdup (dir);
+		w->dirs[w->count++] = d;
+		hash_index_set (w->index, d);
+		debug ("Watching %s", dir);
+	}
+
+	UNLOCK (w->mtx);
+}
+
+/* Return true if the directory of the file is watched. */
+bool dir_watch_covers (struct dir_watch *w, const char *file)
+{
+	char dir[PATH_MAX];
+	bool found;
+
+	if (!w || !file_dir (file, dir))
+		return false;
+
+	LOCK (w->mtx);
+	found = hash_index_find (w->index, dir) != NULL;
+	UNLOCK (w->mtx);
+
+	return found;
+}
+
+#else
+
+struct dir_watch *dir_watch_new (dir_watch_cb *cb ATTR_UNUSED,
+                                 void *data ATTR_UNUSED)
+{
+	return NULL;
+}
+
+void dir_watch_free (struct dir_watch *w ATTR_UNUSED)
+{
+}
+
+void dir_watch_add (struct dir_watch *w ATTR_UNUSED,
+                    const char *file ATTR_UNUSED)
+{
+}
+
+bool dir_watch_covers (struct dir_watch *w ATTR_UNUSED,
+                       const char *file ATTR_UNUSED)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef DIR_WATCH_H
+#define DIR_WATCH_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum dir_watch_event
+{
+	DIR_WATCH_CHANGED,	/* the file was written or moved in */
+	DIR_WATCH_GONE,		/* the file was deleted or moved away */
+	DIR_WATCH_LOST		/* the directory (or all of them if NULL) is
+				   not watched anymore, events may have been
+				   missed */
+};
+
+/* Called from the watching thread with the path of the file or of the
+ * directory for DIR_WATCH_LOST. */
+typedef void dir_watch_cb (void *data, const char *path,
+                           enum dir_watch_event event);
+
+struct dir_watch;
+
+struct dir_watch *dir_watch_new (dir_watch_cb *cb, void *data);
+void dir_watch_free (struct dir_watch *w);
+void dir_watch_add (struct dir_watch *w, const char *file);
+bool dir_watch_covers (struct dir_watch *w, const char *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
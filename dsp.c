@@ -0,0 +1,331 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* The sound processing done just before the samples go to the driver.
+ * The samples are converted to float once, every active stage works on
+ * them in turn and the result is converted back to the device format
+ * once, so adding a stage doesn't add a pass over the samples in each
+ * format.  Stages don't clip, the final conversion does.  When the
+ * softmixer is the only stage needed, a kernel made for the sample type
+ * does it all in one pass instead. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+
+#include "common.h"
+#include "audio.h"
+#include "audio_conversion.h"
+#include "out_buf.h"
+#include "equalizer.h"
+#include "softmixer.h"
+#include "log.h"
+#include "dsp.h"
+
+struct dsp_stage
+{
+	const char *name;
+
+	/* Does the stage change sound in this format? */
+	int (*is_needed) (const struct sound_params *params);
+
+	/* Process the float samples in place. */
+	void (*process) (float *buf, size_t samples,
+	                 const struct sound_params *params);
+};
+
+/* The stages in the order they are applied. */
+static const struct dsp_stage stages[] = {
+	{ "equalizer", equalizer_is_needed, equalizer_process_float },
+	{ "softmixer", softmixer_is_needed, softmixer_process_float }
+};
+
+/* The float samples, which are also the result returned. */
+static float *dsp_buf = NULL;
+static size_t dsp_buf_samples = 0;
+
+/* Copy of the input for byte order swapping. */
+static char *swap_buf = NULL;
+static size_t swap_buf_size = 0;
+
+static void grow_dsp_buf (const size_t samples)
+{
+	if (samples > dsp_buf_samples) {
+		dsp_buf = xrealloc_tag (dsp_buf, samples * sizeof (float),
+				MEM_DSP);
+		dsp_buf_samples = samples;
+	}
+}
+
+void dsp_init ()
+{
+	/* Enough for AUDIO_MAX_PLAY_BYTES of 8-bit samples. */
+	grow_dsp_buf (AUDIO_MAX_PLAY_BYTES);
+}
+
+void dsp_shutdown ()
+{
+	xfree_tag (dsp_buf, MEM_DSP);
+	dsp_buf = NULL;
+	dsp_buf_samples = 0;
+
+	xfree_tag (swap_buf, MEM_DSP);
+	swap_buf = NULL;
+	swap_buf_size = 0;
+}
+
+/* Tell if any stage would change sound in this format. */
+int dsp_is_needed (const struct sound_params *params)
+{
+	size_t ix;
+
+	for (ix = 0; ix < ARRAY_SIZE(stages); ix++) {
+		if (stages[ix].is_needed (params))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* True if samples in this format are not in the native byte order. */
+static int needs_swap (const long fmt)
+{
+	if (fmt & (SFMT_S8 | SFMT_U8 | SFMT_FLOAT))
+		return 0;
+
+	return (fmt & SFMT_MASK_ENDIANNESS) != SFMT_NE;
+}
+
+/* Conversions of each sample type to float and back (clamped) for the
+ * fused kernels.  The clamping is done on floats, so it's min/max without
+ * branches. */
+static inline float s8_in (const int8_t v)
+{
+	return v / 128.0f;
+}
+
+static inline int8_t s8_out (const float f)
+{
+	return lrintf (CLAMP(-128.0f, f * 128.0f, 127.0f));
+}
+
+static inline float u8_in (const uint8_t v)
+{
+	return ((int)v - 128) / 128.0f;
+}
+
+static inline uint8_t u8_out (const float f)
+{
+	return lrintf (CLAMP(-128.0f, f * 128.0f, 127.0f)) + 128;
+}
+
+static inline float s16_in (const int16_t v)
+{
+	return v / 32768.0f;
+}
+
+static inline int16_t s16_out (const float f)
+{
+	return lrintf (CLAMP(-32768.0f, f * 32768.0f, 32767.0f));
+}
+
+static inline float u16_in (const uint16_t v)
+{
+	return ((int)v - 32768) / 32768.0f;
+}
+
+static inline uint16_t u16_out (const float f)
+{
+	return lrintf (CLAMP(-32768.0f, f * 32768.0f, 32767.0f)) + 32768;
+}
+
+static inline float s32_in (const int32_t v)
+{
+	return v / 2147483648.0f;
+}
+
+/* The upper bound is the largest float below 2^31. */
+static inline int32_t s32_out (const float f)
+{
+	return lrintf (CLAMP(-2147483648.0f, f * 2147483648.0f,
+	                     2147483520.0f));
+}
+
+static inline float u32_in (const uint32_t v)
+{
+	return s32_in ((int32_t)(v ^ 0x80000000u));
+}
+
+static inline uint32_t u32_out (const float f)
+{
+	return (uint32_t)s32_out (f) ^ 0x80000000u;
+}
+
+static inline float float_in (const float v)
+{
+	return v;
+}
+
+static inline float float_out (const float f)
+{
+	return CLAMP(-1.0f, f, 1.0f);
+}
+
+/* Fused kernel for the usual case of the softmixer being the only stage
+ * needed: each sample is read in the device format, mixed to mono, scaled,
+ * clamped and written in one pass, without the float buffer.  The mono
+ * mix is chosen once for the buffer, with stereo specialized. */
+typedef void gain_kernel (const char *in, char *out, const size_t samples,
+                          const int channels, const int mono,
+                          const float gain);
+
+#define DSP_GAIN_KERNEL(name, type) \
+static void name##_gain (const char *in, char *out, const size_t samples, \
+                         const int channels, const int mono, \
+                         const float gain) \
+{ \
+	const type *src = (const type *)in; \
+	type *dst = (type *)out; \
+	size_t i; \
+	int c; \
+\
+	if (!mono || channels == 1) { \
+		for (i = 0; i < samples; i++) \
+			dst[i] = name##_out (name##_in (src[i]) * gain); \
+	} \
+	else if (channels == 2) { \
+		const float g = gain / 2; \
+\
+		for (i = 0; i < samples; i += 2) { \
+			type v = name##_out ((name##_in (src[i]) \
+			                      + name##_in (src[i + 1])) * g); \
+\
+			dst[i] = v; \
+			dst[i + 1] = v; \
+		} \
+	} \
+	else { \
+		const float g = gain / channels; \
+\
+		for (i = 0; i < samples; i += channels) { \
+			float f = 0.0f; \
+			type v; \
+\
+			for (c = 0; c < channels; c++) \
+				f += name##_in (src[i + c]); \
+			v = name##_out (f * g); \
+			for (c = 0; c < channels; c++) \
+				dst[i + c] = v; \
+		} \
+	} \
+}
+
+DSP_GAIN_KERNEL(s8, int8_t)
+DSP_GAIN_KERNEL(u8, uint8_t)
+DSP_GAIN_KERNEL(s16, int16_t)
+DSP_GAIN_KERNEL(u16, uint16_t)
+DSP_GAIN_KERNEL(s32, int32_t)
+DSP_GAIN_KERNEL(u32, uint32_t)
+DSP_GAIN_KERNEL(float, float)
+
+/* Return the fused kernel for the sample format, NULL if there is none
+ * (24-bit formats take the float path). */
+static gain_kernel *find_gain_kernel (const long sfmt)
+{
+	switch (sfmt) {
+		case SFMT_S8:
+			return s8_gain;
+		case SFMT_U8:
+			return u8_gain;
+		case SFMT_S16:
+			return s16_gain;
+		case SFMT_U16:
+			return u16_gain;
+		case SFMT_S32:
+			return s32_gain;
+		case SFMT_U32:
+			return u32_gain;
+		case SFMT_FLOAT:
+			return float_gain;
+		default:
+			return NULL;
+	}
+}
+
+/* Run the active stages over size bytes of samples in the device format
+ * params.  Returns the processed samples in the same format; the buffer
+ * is valid until the next call. */
+const char *dsp_process (const char *buf, const size_t size,
+		const struct sound_params *params)
+{
+	const long sfmt = params->fmt & SFMT_MASK_FORMAT;
+	const int swap = needs_swap (params->fmt);
+	gain_kernel *kernel;
+	size_t ix, samples;
+
+	assert (size % (sfmt_Bps(params->fmt) * params->channels) == 0);
+
+	samples = size / sfmt_Bps(params->fmt);
+	grow_dsp_buf (samples);
+
+	if (swap) {
+		if (size > swap_buf_size) {
+			swap_buf = xrealloc_tag (swap_buf, size, MEM_DSP);
+			swap_buf_size = size;
+		}
+		memcpy (swap_buf, buf, size);
+		audio_conv_swap_endian (swap_buf, size, params->fmt);
+		buf = swap_buf;
+	}
+
+	/* Only the softmixer is left after the equalizer, so without it the
+	 * whole work can be done by a fused kernel. */
+	if (!equalizer_is_needed (params)
+			&& (kernel = find_gain_kernel (sfmt))) {
+		debug ("Running the fused softmixer kernel");
+		kernel (buf, (char *)dsp_buf, samples, params->channels,
+		        softmixer_is_mono (), softmixer_get_gain ());
+		if (swap)
+			audio_conv_swap_endian ((char *)dsp_buf, size,
+			                        params->fmt);
+
+		return (const char *)dsp_buf;
+	}
+
+	if (sfmt == SFMT_FLOAT)
+		memcpy (dsp_buf, buf, size);
+	else
+		audio_conv_to_float (buf, size, params->fmt, dsp_buf);
+
+	for (ix = 0; ix < ARRAY_SIZE(stages); ix++) {
+		if (stages[ix].is_needed (params)) {
+			debug ("Running %s", stages[ix].name);
+			stages[ix].process (dsp_buf, samples, params);
+		}
+	}
+
+	if (sfmt == SFMT_FLOAT) {
+		for (ix = 0; ix < samples; ix++)
+			dsp_buf[ix] = CLAMP(-1.0f, dsp_buf[ix], 1.0f);
+	}
+	else
+		audio_conv_from_float (dsp_buf, samples, params->fmt,
+		                       (char *)dsp_buf);
+
+	if (swap)
+		audio_conv_swap_endian ((char *)dsp_buf, size, params->fmt);
+
+	return (const char *)dsp_buf;
+}
@@ -0,0 +1,20 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include "audio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void dsp_init ();
+void dsp_shutdown ();
+int dsp_is_needed (const struct sound_params *params);
+const char *dsp_process (const char *buf, const size_t size,
+		const struct sound_params *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,12 +9,6 @@
  * coefficients' by Robert Bristow-Johnson.
  * http://www.musicdsp.org/files/Audio-EQ-Cookbook.txt
  *
- * TODO:
- * - Merge somehow with softmixer code to avoid multiple endianness
- *   conversions.
- * - Implement equalizer routines for integer samples... conversion
- *   to float (and back) is lazy...
- *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or
@@ -40,9 +34,14 @@
 #include <dirent.h>
 #include <locale.h>
 
+#if defined(__SSE__)
+# include <xmmintrin.h>
+#endif
+
 #include "common.h"
 #include "audio.h"
 #include "audio_conversion.h"
+#include "out_buf.h"
 #include "options.h"
 #include "log.h"
 #include "files.h"
@@ -63,12 +62,26 @@
 #define EQUALIZER_SAVE_FILE "equalizer"
 #define EQUALIZER_SAVE_OPTION "Equalizer_SaveState"
 
+/* More than two channels are filtered in groups of EQ_LANES so that the
+ * compiler can keep a group in one SIMD register; EQ_MAX_CHANNELS must be
+ * a multiple of it. */
+#define EQ_LANES 4
+#define EQ_MAX_CHANNELS 8
+
+/* Filter state below this is flushed to zero after each buffer so that
+ * decaying silence never reaches denormal numbers. */
+#define EQ_DENORMAL_LIMIT 1e-15f
+
 typedef struct t_biquad t_biquad;
 
+/* One band of the equalizer.  The coefficients are shared by all channels
+ * and the state is kept as arrays indexed by channel (structure of arrays),
+ * so one band is applied to all channels of a frame at once. */
 struct t_biquad
 {
   float a0, a1, a2, a3, a4;
-  float x1, x2, y1, y2;
+  float x1[EQ_MAX_CHANNELS], x2[EQ_MAX_CHANNELS];
+  float y1[EQ_MAX_CHANNELS], y2[EQ_MAX_CHANNELS];
   float cf, bw, gain, srate;
   int israte;
 };
@@ -132,25 +145,19 @@ static void equalizer_read_config();
 static void equalizer_write_config();
 
 /* biquad application */
-static inline void apply_biquads(float *src, float *dst, int channels, int len, t_biquad *b, int blen);
+static inline void apply_biquads(float *buf, int channels, size_t len, t_biquad *b, int blen);
+static void equ_filter(float *buf, size_t samples);
 
 /* biquad filter creation */
 static t_biquad *mk_biquad(float dbgain, float cf, float srate, float bw, t_biquad *b);
 
 /* equalizer list processing */
+static void equalizer_retune();
 static t_eq_set_list *append_eq_set(t_eq_set *eqs, t_eq_set_list *l);
 static void clear_eq_set(t_eq_set_list *l);
 
 /* sound processing */
-static void equ_process_buffer_u8(uint8_t *buf, size_t samples);
-static void equ_process_buffer_s8(int8_t *buf, size_t samples);
-static void equ_process_buffer_u16(uint16_t *buf, size_t samples);
-static void equ_process_buffer_s16(int16_t *buf, size_t samples);
-static void equ_process_buffer_u24(uint32_t *buf, size_t samples);
-static void equ_process_buffer_s24(int32_t *buf, size_t samples);
-static void equ_process_buffer_u32(uint32_t *buf, size_t samples);
-static void equ_process_buffer_s32(int32_t *buf, size_t samples);
-static void equ_process_buffer_float(float *buf, size_t samples);
+static float *equ_work_buffer(size_t samples);
 
 /* static global variables */
 static t_eq_set_list equ_list, *current_equ;
@@ -164,6 +171,11 @@ static char *eqsetdir;
 
 static char *config_preset_name;
 
+/* Copy of the unfiltered samples for the mixin, kept between calls so
+ * that playback does not allocate memory for each chunk. */
+static float *equ_work;
+static size_t equ_work_samples;
+
 /* public functions */
 int equalizer_is_active()
 {
@@ -258,10 +270,10 @@ static t_biquad *mk_biquad(float dbgain, float cf, float srate, float bw, t_biqu
   b->a3 = a1 / a0;
   b->a4 = a2 / a0;
 
-  b->x1 = 0.0f;
-  b->x2 = 0.0f;
-  b->y1 = 0.0f;
-  b->y2 = 0.0f;
+  memset(b->x1, 0, sizeof(b->x1));
+  memset(b->x2, 0, sizeof(b->x2));
+  memset(b->y1, 0, sizeof(b->y1));
+  memset(b->y2, 0, sizeof(b->y2));
 
   b->cf = cf;
   b->bw = bw;
@@ -290,43 +302,118 @@ static inline void biquad(float *src, float *dst, int len, t_biquad *b)
 */
 
 /* Applies a set of biquadratic filters to a buffer of floating point
- * samples.
- * It is safe to have the same input and output buffer.
+ * samples in place, with the channels of a frame padded to groups of
+ * width lanes.  Each band is applied to a whole group in a fixed length
+ * loop, which the compiler turns into SIMD operations.
  *
- * blen is the sample-count ignoring channels (samples per channel * channels)
+ * len is the sample-count ignoring channels (samples per channel * channels)
  */
-static inline void apply_biquads(float *src, float *dst, int channels, int len, t_biquad *b, int blen)
+static inline void apply_biquads_width(float *buf, int channels, size_t len, t_biquad *b, int blen, const int width)
 {
-  int bi, ci, boffs, idx;
-  while(len>0)
+  int bi, ci, li;
+  int lanes = (channels + width - 1) / width * width;
+  float s[EQ_MAX_CHANNELS];
+
+  memset(s, 0, sizeof(s));
+
+  while(len>=(size_t)channels)
   {
-    boffs = 0;
-    for(ci=0; ci<channels; ci++)
+    memcpy(s, buf, channels * sizeof(float));
+
+    for(bi=0; bi<blen; bi++)
     {
-      float s = *src++;
-      float f = s;
-      for(bi=0; bi<blen; bi++)
+      t_biquad *q = &b[bi];
+
+      for(ci=0; ci<lanes; ci+=width)
       {
-        idx = boffs + bi;
-        f =
-          s * b[idx].a0 \
-          + b[idx].a1 * b[idx].x1 \
-          + b[idx].a2 * b[idx].x2 \
-          - b[idx].a3 * b[idx].y1 \
-          - b[idx].a4 * b[idx].y2;
-        b[idx].x2 = b[idx].x1;
-        b[idx].x1 = s;
-        b[idx].y2 = b[idx].y1;
-        b[idx].y1 = f;
-        s = f;
+        for(li=ci; li<ci+width; li++)
+        {
+          /* The feedback part does not depend on this band's input, so
+           * only one multiply-add is on the path through the bands. */
+          float fb = q->a1 * q->x1[li] + q->a2 * q->x2[li]
+                   - q->a3 * q->y1[li] - q->a4 * q->y2[li];
+          float f = s[li] * q->a0 + fb;
+
+          q->x2[li] = q->x1[li];
+          q->x1[li] = s[li];
+          q->y2[li] = q->y1[li];
+          q->y1[li] = f;
+          s[li] = f;
+        }
       }
-      *dst++=f;
-      boffs += blen;
-      len--;
+    }
+
+    memcpy(buf, s, channels * sizeof(float));
+    buf += channels;
+    len -= channels;
+  }
+}
+
+/* Mono and stereo get their own lane widths, padding them to EQ_LANES
+ * would only add work. */
+static inline void apply_biquads(float *buf, int channels, size_t len, t_biquad *b, int blen)
+{
+  assert(channels <= EQ_MAX_CHANNELS);
+
+  if(channels == 1)
+    apply_biquads_width(buf, channels, len, b, blen, 1);
+  else if(channels == 2)
+    apply_biquads_width(buf, channels, len, b, blen, 2);
+  else
+    apply_biquads_width(buf, channels, len, b, blen, EQ_LANES);
+}
+
+/* Zero filter state that has decayed to almost nothing. */
+static void flush_denormals(t_biquad *b, int blen)
+{
+  int bi, ci;
+
+  for(bi=0; bi<blen; bi++)
+  {
+    for(ci=0; ci<EQ_MAX_CHANNELS; ci++)
+    {
+      if(fabsf(b[bi].x1[ci]) < EQ_DENORMAL_LIMIT)
+        b[bi].x1[ci] = 0.0f;
+      if(fabsf(b[bi].x2[ci]) < EQ_DENORMAL_LIMIT)
+        b[bi].x2[ci] = 0.0f;
+      if(fabsf(b[bi].y1[ci]) < EQ_DENORMAL_LIMIT)
+        b[bi].y1[ci] = 0.0f;
+      if(fabsf(b[bi].y2[ci]) < EQ_DENORMAL_LIMIT)
+        b[bi].y2[ci] = 0.0f;
     }
   }
 }
 
+/* Run the current equalizer over the float samples.  Denormals are much
+ * slower than normal numbers on most CPUs, so where the hardware can
+ * flush them to zero it is told to do so while filtering. */
+static void equ_filter(float *buf, size_t samples)
+{
+  t_eq_set *set = current_equ->set;
+
+#if defined(__SSE__)
+  unsigned int csr = _mm_getcsr();
+
+  /* flush-to-zero and denormals-are-zero */
+  _mm_setcsr(csr | 0x8040);
+#elif defined(__aarch64__)
+  uint64_t fpcr;
+
+  __asm__ __volatile__ ("mrs %0, fpcr" : "=r" (fpcr));
+  __asm__ __volatile__ ("msr fpcr, %0" : : "r" (fpcr | (1 << 24)));
+#endif
+
+  apply_biquads(buf, equ_channels, samples, set->b, set->bcount);
+
+#if defined(__SSE__)
+  _mm_setcsr(csr);
+#elif defined(__aarch64__)
+  __asm__ __volatile__ ("msr fpcr, %0" : : "r" (fpcr));
+#endif
+
+  flush_denormals(set->b, set->bcount);
+}
+
 /*
  preamping
  XMMS / Beep Media Player / Audacious use all the same code but
@@ -508,6 +595,9 @@ void equalizer_init()
 
   equalizer_refresh();
 
+  /* 8-bit samples need the most floats per byte. */
+  equ_work_buffer(AUDIO_MAX_PLAY_BYTES);
+
   logit ("Equalizer initialized");
 }
 
@@ -518,6 +608,10 @@ void equalizer_shutdown()
 
   clear_eq_set(&equ_list);
 
+  xfree_tag(equ_work, MEM_DSP);
+  equ_work = NULL;
+  equ_work_samples = 0;
+
   logit ("Equalizer stopped");
 }
 
@@ -591,9 +685,9 @@ void equalizer_refresh()
 
         if(r==0)
         {
-          int i, channel;
+          int i;
           t_eq_set *eqset = (t_eq_set *)xmalloc(sizeof(t_eq_set));
-          eqset->b = (t_biquad *)xmalloc(sizeof(t_biquad)*eqs->bcount*equ_channels);
+          eqset->b = (t_biquad *)xmalloc(sizeof(t_biquad)*eqs->bcount);
 
           eqset->name = xstrdup(eqs->name);
           eqset->preamp = eqs->preamp;
@@ -603,11 +697,6 @@ void equalizer_refresh()
           for(i=0; i<eqs->bcount; i++)
           {
             mk_biquad(eqs->dg[i], eqs->cf[i], sample_rate, eqs->bw[i], &eqset->b[i]);
-
-            for(channel=1; channel<equ_channels; channel++)
-            {
-              eqset->b[channel*eqset->bcount + i] = eqset->b[i];
-            }
           }
 
           last_elem = append_eq_set(eqset, last_elem);
@@ -692,275 +781,90 @@ void equalizer_refresh()
 }
 
 /* sound processing code */
-void equalizer_process_buffer(char *buf, size_t size, const struct sound_params *sound_params)
-{
-  debug ("EQ Processing %zu bytes...", size);
-
-  if(!equ_active || !current_equ || !current_equ->set)
-    return;
 
-  if(sound_params->rate != current_equ->set->b->israte || sound_params->channels != equ_channels)
-  {
-    logit ("Recreating filters due to sound parameter changes...");
-    sample_rate = sound_params->rate;
-    equ_channels = sound_params->channels;
-
-    equalizer_refresh();
-  }
-
-  long sound_format = sound_params->fmt & SFMT_MASK_FORMAT;
-  int samplewidth = sfmt_Bps(sound_format);
-
-
-  assert (size % (samplewidth * sound_params->channels) == 0);
-
-  switch(sound_format)
-  {
-    case SFMT_U8:
-      equ_process_buffer_u8((uint8_t *)buf, size);
-      break;
-    case SFMT_S8:
-      equ_process_buffer_s8((int8_t *)buf, size);
-      break;
-    case SFMT_U16:
-      equ_process_buffer_u16((uint16_t *)buf, size / sizeof(uint16_t));
-      break;
-    case SFMT_S16:
-      equ_process_buffer_s16((int16_t *)buf, size / sizeof(int16_t));
-      break;
-    case SFMT_U24:
-      equ_process_buffer_u24((uint32_t *)buf, size / sizeof(uint32_t));
-      break;
-    case SFMT_S24:
-      equ_process_buffer_s24((int32_t *)buf, size / sizeof(int32_t));
-      break;
-    case SFMT_U32:
-      equ_process_buffer_u32((uint32_t *)buf, size / sizeof(uint32_t));
-      break;
-    case SFMT_S32:
-      equ_process_buffer_s32((int32_t *)buf, size / sizeof(int32_t));
-      break;
-    case SFMT_FLOAT:
-      equ_process_buffer_float((float *)buf, size / sizeof(float));
-      break;
-  }
-}
-
-static void equ_process_buffer_u8(uint8_t *buf, size_t samples)
+/* Return the work buffer, growing it to hold at least that many samples. */
+static float *equ_work_buffer(size_t samples)
 {
-  size_t i;
-  float *tmp;
-
-  debug ("equalizing");
-
-  tmp = (float *)xmalloc (samples * sizeof (float));
-
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
-
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
-
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT8_MAX);
-    buf[i] = (uint8_t)tmp[i];
-  }
-
-  free(tmp);
-}
-
-static void equ_process_buffer_s8(int8_t *buf, size_t samples)
-{
-  size_t i;
-  float *tmp;
-
-  debug ("equalizing");
-
-  tmp = (float *)xmalloc (samples * sizeof (float));
-
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
-
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
-
-  for(i=0; i<samples; i++)
+  if(samples > equ_work_samples)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT8_MIN, tmp[i], INT8_MAX);
-    buf[i] = (int8_t)tmp[i];
+    equ_work = (float *)xrealloc_tag(equ_work, samples * sizeof(float),
+                                     MEM_DSP);
+    equ_work_samples = samples;
   }
 
-  free(tmp);
+  return equ_work;
 }
 
-static void equ_process_buffer_u16(uint16_t *buf, size_t samples)
+/* Tell if the equalizer has anything to do with sound in this format. */
+int equalizer_is_needed(const struct sound_params *sound_params)
 {
-  size_t i;
-  float *tmp;
-
-  debug ("equalizing");
-
-  tmp = (float *)xmalloc (samples * sizeof (float));
-
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
-
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
-
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT16_MAX);
-    buf[i] = (uint16_t)tmp[i];
-  }
-
-  free(tmp);
+  return equ_active && current_equ && current_equ->set
+    && sound_params->channels <= EQ_MAX_CHANNELS;
 }
 
-static void equ_process_buffer_s16(int16_t *buf, size_t samples)
+/* Equalize float samples in place.  The result is not clipped, that is
+ * left to the final conversion to the device format. */
+void equalizer_process_float(float *buf, size_t samples, const struct sound_params *sound_params)
 {
   size_t i;
-  float *tmp;
-
-  debug ("equalizing");
+  float *dry = NULL;
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  debug ("EQ Processing %zu samples...", samples);
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+  if(!equalizer_is_needed(sound_params))
+    return;
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  assert (samples % sound_params->channels == 0);
 
-  for(i=0; i<samples; i++)
+  if(sound_params->rate != sample_rate || sound_params->channels != equ_channels)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT16_MIN, tmp[i], INT16_MAX);
-    buf[i] = (int16_t)tmp[i];
-  }
-
-  free(tmp);
-}
-
-static void equ_process_buffer_u24(uint32_t *buf, size_t samples)
-{
-  size_t i;
-  float *tmp;
-
-  debug ("equalizing");
-
-  tmp = (float *)xmalloc (samples * sizeof (float));
-
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
-
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    logit ("Recomputing filters due to sound parameter changes...");
+    sample_rate = sound_params->rate;
+    equ_channels = sound_params->channels;
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], U24_MAX);
-    buf[i] = (uint32_t)tmp[i];
+    equalizer_retune();
   }
 
-  free(tmp);
-}
-
-static void equ_process_buffer_s24(int32_t *buf, size_t samples)
-{
-  size_t i;
-  float *tmp;
-
-  debug ("equalizing");
-
-  tmp = (float *)xmalloc (samples * sizeof (float));
-
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
-
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
-
-  for(i=0; i<samples; i++)
+  if(mixin_rate != 0.0f)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(S24_MIN, tmp[i], S24_MAX);
-    buf[i] = (int32_t)tmp[i];
+    dry = equ_work_buffer(samples);
+    memcpy(dry, buf, samples * sizeof(float));
   }
 
-  free(tmp);
-}
-
-
-static void equ_process_buffer_u32(uint32_t *buf, size_t samples)
-{
-  size_t i;
-  float *tmp;
-
-  debug ("equalizing");
-
-  tmp = (float *)xmalloc (samples * sizeof (float));
-
   for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
+    buf[i] *= preampf;
 
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+  equ_filter(buf, samples);
 
-  for(i=0; i<samples; i++)
+  if(dry)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(0, tmp[i], UINT32_MAX);
-    buf[i] = (uint32_t)tmp[i];
+    for(i=0; i<samples; i++)
+      buf[i] = r_mixin_rate * buf[i] + mixin_rate * dry[i];
   }
-
-  free(tmp);
 }
 
-static void equ_process_buffer_s32(int32_t *buf, size_t samples)
+/* Recompute the coefficients of all equalizers for the current sample
+ * rate and clear their state.  The band settings are kept in the filters,
+ * so the EQSET files don't have to be read again. */
+static void equalizer_retune()
 {
-  size_t i;
-  float *tmp;
-
-  debug ("equalizing");
-
-  tmp = (float *)xmalloc (samples * sizeof (float));
+  t_eq_set_list *l;
+  int i;
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
-
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
-
-  for(i=0; i<samples; i++)
+  for(l = &equ_list; l; l = l->next)
   {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(INT32_MIN, tmp[i], INT32_MAX);
-    buf[i] = (int32_t)tmp[i];
-  }
-
-  free(tmp);
-}
-
-static void equ_process_buffer_float(float *buf, size_t samples)
-{
-  size_t i;
-  float *tmp;
-
-  debug ("equalizing");
+    if(!l->set)
+      continue;
 
-  tmp = (float *)xmalloc (samples * sizeof (float));
+    l->set->channels = equ_channels;
 
-  for(i=0; i<samples; i++)
-    tmp[i] = preampf * (float)buf[i];
-
-  apply_biquads(tmp, tmp, equ_channels, samples, current_equ->set->b, current_equ->set->bcount);
+    for(i=0; i<l->set->bcount; i++)
+    {
+      t_biquad *b = &l->set->b[i];
 
-  for(i=0; i<samples; i++)
-  {
-    tmp[i] = r_mixin_rate * tmp[i] + mixin_rate * buf[i];
-    tmp[i] = CLAMP(-1.0f, tmp[i], 1.0f);
-    buf[i] = tmp[i];
+      mk_biquad(b->gain, b->cf, sample_rate, b->bw, b);
+    }
   }
-
-  free(tmp);
 }
 
 /* equalizer list maintenance */
@@ -9,6 +9,12 @@
  *
  */
 
+/* The buffer is a single-producer/single-consumer ring: one thread may
+ * put data while another gets it without any locking.  The indices run
+ * from 0 to 2 * size - 1 so that a full buffer can be told from an empty
+ * one; only the producer moves write_pos and only the consumer moves
+ * read_pos.  More than one producer or consumer still needs a lock. */
+
 #ifdef HAVE_CONFIG_H
 # include "config.h"
 #endif
@@ -23,24 +29,55 @@
 
 struct fifo_buf
 {
-	int size;                           /* Size of the buffer */
-	int pos;                            /* Current position */
-	int fill;                           /* Current fill */
+	size_t size;                        /* Size of the buffer */
+	enum mem_tag tag;                   /* Subsystem using it */
+	size_t read_pos;                    /* Consumer's position */
+	size_t write_pos;                   /* Producer's position */
 	char buf[];                         /* The buffer content */
 };
 
-/* Initialize and return a new fifo_buf structure of the size requested. */
-struct fifo_buf *fifo_buf_new (const size_t size)
+/* Return the number of bytes between the two positions. */
+static inline size_t fill_between (const struct fifo_buf *b,
+                                   const size_t read_pos,
+                                   const size_t write_pos)
+{
+	if (write_pos >= read_pos)
+		return write_pos - read_pos;
+
+	return 2 * b->size - read_pos + write_pos;
+}
+
+/* Return the position advanced by count bytes. */
+static inline size_t advance (const struct fifo_buf *b, size_t pos,
+                              const size_t count)
+{
+	pos += count;
+	if (pos >= 2 * b->size)
+		pos -= 2 * b->size;
+
+	return pos;
+}
+
+/* Return the offset into the buffer content for the position. */
+static inline size_t offset (const struct fifo_buf *b, const size_t pos)
+{
+	return pos >= b->size ? pos - b->size : pos;
+}
+
+/* Initialize and return a new fifo_buf structure of the size requested,
+ * its memory counted for the subsystem tag. */
+struct fifo_buf *fifo_buf_new (const size_t size, const enum mem_tag tag)
 {
 	struct fifo_buf *b;
 
 	assert (size > 0);
 
-	b = xmalloc (offsetof (struct fifo_buf, buf) + size);
+	b = xmalloc_tag (offsetof (struct fifo_buf, buf) + size, tag);
 
 	b->size = size;
-	b->pos = 0;
-	b->fill = 0;
+	b->tag = tag;
+	b->read_pos = 0;
+	b->write_pos = 0;
 
 	return b;
 }
@@ -50,97 +87,109 @@ void fifo_buf_free (struct fifo_buf *b)
 {
 	assert (b != NULL);
 
-	free (b);
+	xfree_tag (b, b->tag);
 }
 
 /* Put data into the buffer. Returns number of bytes actually put. */
 size_t fifo_buf_put (struct fifo_buf *b, const char *data, size_t size)
 {
-	size_t written = 0;
+	size_t read_pos, write_pos, to_write, from, first;
 
 	assert (b != NULL);
 	assert (b->buf != NULL);
 
-	while (b->fill < b->size && written < size) {
-		size_t write_from;
-		size_t to_write;
+	read_pos = ATOMIC_LOAD (&b->read_pos);
+	write_pos = b->write_pos;
 
-		if (b->pos + b->fill < b->size) {
-			write_from = b->pos + b->fill;
-			to_write = b->size - (b->pos + b->fill);
-		}
-		else {
-			write_from = b->fill - b->size + b->pos;
-			to_write = b->size - b->fill;
-		}
+	to_write = MIN(size, b->size - fill_between (b, read_pos, write_pos));
+	if (to_write == 0)
+		return 0;
 
-		if (to_write > size - written)
-			to_write = size - written;
+	from = offset (b, write_pos);
+	first = MIN(to_write, b->size - from);
 
-		memcpy (b->buf + write_from, data + written, to_write);
-		b->fill += to_write;
-		written += to_write;
-	}
+	memcpy (b->buf + from, data, first);
+	if (first < to_write)
+		memcpy (b->buf, data + first, to_write - first);
 
-	return written;
+	ATOMIC_STORE (&b->write_pos, advance (b, write_pos, to_write));
+
+	return to_write;
 }
 
-/* Copy data from the beginning of the buffer to the user buffer. Returns the
- * number of bytes copied. */
-size_t fifo_buf_peek (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
+/* Return where up to *len bytes can be written straight into the buffer,
+ * *len is 0 if it is full.  The data is added by fifo_buf_commit().  This
+ * is a producer side operation. */
+char *fifo_buf_write_region (struct fifo_buf *b, size_t *len)
 {
-	size_t user_buf_pos = 0, written = 0;
-	ssize_t left, pos;
+	size_t read_pos, write_pos, from;
 
 	assert (b != NULL);
-	assert (b->buf != NULL);
-
-	left = b->fill;
-	pos = b->pos;
+	assert (len != NULL);
 
-	while (left && written < user_buf_size) {
-		size_t to_copy = pos + left <= b->size
-			? left : b->size - pos;
+	read_pos = ATOMIC_LOAD (&b->read_pos);
+	write_pos = b->write_pos;
+	from = offset (b, write_pos);
 
-		if (to_copy > user_buf_size - written)
-			to_copy = user_buf_size - written;
+	*len = MIN(b->size - fill_between (b, read_pos, write_pos),
+	           b->size - from);
 
-		memcpy (user_buf + user_buf_pos, b->buf + pos, to_copy);
-		user_buf_pos += to_copy;
-		written += to_copy;
+	return b->buf + from;
+}
 
-		left -= to_copy;
-		pos += to_copy;
-		if (pos == b->size)
-			pos = 0;
-	}
+/* Add len bytes written at fifo_buf_write_region() to the buffer. */
+void fifo_buf_commit (struct fifo_buf *b, const size_t len)
+{
+	assert (b != NULL);
 
-	return written;
+	ATOMIC_STORE (&b->write_pos, advance (b, b->write_pos, len));
 }
 
-size_t fifo_buf_get (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
+/* Copy up to user_buf_size bytes from the beginning of the buffer without
+ * consuming them.  Returns the number of bytes copied. */
+static size_t copy_out (const struct fifo_buf *b, const size_t read_pos,
+                        char *user_buf, size_t user_buf_size)
 {
-	size_t user_buf_pos = 0, written = 0;
+	size_t write_pos, to_copy, from, first;
+
+	write_pos = ATOMIC_LOAD (&b->write_pos);
+
+	to_copy = MIN(user_buf_size, fill_between (b, read_pos, write_pos));
+	if (to_copy == 0)
+		return 0;
+
+	from = offset (b, read_pos);
+	first = MIN(to_copy, b->size - from);
+
+	memcpy (user_buf, b->buf + from, first);
+	if (first < to_copy)
+		memcpy (user_buf + first, b->buf, to_copy - first);
 
+	return to_copy;
+}
+
+/* Copy data from the beginning of the buffer to the user buffer. Returns the
+ * number of bytes copied. */
+size_t fifo_buf_peek (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
+{
 	assert (b != NULL);
 	assert (b->buf != NULL);
 
-	while (b->fill && written < user_buf_size) {
-		size_t to_copy = b->pos + b->fill <= b->size
-			? b->fill : b->size - b->pos;
+	return copy_out (b, b->read_pos, user_buf, user_buf_size);
+}
 
-		if (to_copy > user_buf_size - written)
-			to_copy = user_buf_size - written;
+size_t fifo_buf_get (struct fifo_buf *b, char *user_buf, size_t user_buf_size)
+{
+	size_t read_pos, written;
 
-		memcpy (user_buf + user_buf_pos, b->buf + b->pos, to_copy);
-		user_buf_pos += to_copy;
-		written += to_copy;
+	assert (b != NULL);
+	assert (b->buf != NULL);
 
-		b->fill -= to_copy;
-		b->pos += to_copy;
-		if (b->pos == b->size)
-			b->pos = 0;
-	}
+	read_pos = b->read_pos;
+	written = copy_out (b, read_pos, user_buf, user_buf_size);
+
+	if (written)
+		ATOMIC_STORE (&b->read_pos, advance (b, read_pos, written));
 
 	return written;
 }
@@ -151,14 +200,21 @@ size_t fifo_buf_get_space (const struct fifo_buf *b)
 	assert (b != NULL);
 	assert (b->buf != NULL);
 
-	return b->size - b->fill;
-
+	return b->size - fifo_buf_get_fill (b);
 }
 
 size_t fifo_buf_get_fill (const struct fifo_buf *b)
 {
+	size_t fill;
+
 	assert (b != NULL);
-	return b->fill;
+
+	/* The other side may move between the two loads, so the result
+	 * is only a snapshot and must be kept in range. */
+	fill = fill_between (b, ATOMIC_LOAD (&b->read_pos),
+	                        ATOMIC_LOAD (&b->write_pos));
+
+	return MIN(fill, b->size);
 }
 
 size_t fifo_buf_get_size (const struct fifo_buf *b)
@@ -167,8 +223,9 @@ size_t fifo_buf_get_size (const struct fifo_buf *b)
 	return b->size;
 }
 
+/* Drop the buffer content.  This is a consumer side operation. */
 void fifo_buf_clear (struct fifo_buf *b)
 {
 	assert (b != NULL);
-	b->fill = 0;
+	ATOMIC_STORE (&b->read_pos, ATOMIC_LOAD (&b->write_pos));
 }
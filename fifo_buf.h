@@ -1,15 +1,19 @@
 #ifndef FIFO_BUF_H
 #define FIFO_BUF_H
 
+#include "common.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct fifo_buf;
 
-struct fifo_buf *fifo_buf_new (const size_t size);
+struct fifo_buf *fifo_buf_new (const size_t size, const enum mem_tag tag);
 void fifo_buf_free (struct fifo_buf *b);
 size_t fifo_buf_put (struct fifo_buf *b, const char *data, size_t size);
+char *fifo_buf_write_region (struct fifo_buf *b, size_t *len);
+void fifo_buf_commit (struct fifo_buf *b, const size_t len);
 size_t fifo_buf_get (struct fifo_buf *b, char *user_buf, size_t user_buf_size);
 size_t fifo_buf_peek (struct fifo_buf *b, char *user_buf, size_t user_buf_size);
 size_t fifo_buf_get_space (const struct fifo_buf *b);
@@ -23,10 +23,11 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <stdarg.h>
+#include <pthread.h>
 
 #ifdef HAVE_LIBMAGIC
 #include <magic.h>
-#include <pthread.h>
 #endif
 
 #define DEBUG
@@ -42,6 +43,7 @@
 #include "log.h"
 #include "utf8.h"
 #include "ratings.h"
+#include "cue.h"
 
 #define READ_LINE_INIT_SIZE	256
 
@@ -121,6 +123,8 @@ enum file_type file_type (const char *file)
 
 	if (is_url(file))
 		return F_URL;
+	if (cue_is_track(file))
+		return F_SOUND;
 	if (stat(file, &file_stat) == -1)
 		return F_OTHER; /* Ignore the file if stat() failed */
 	if (S_ISDIR(file_stat.st_mode))
@@ -374,16 +378,151 @@ struct file_tags *read_file_tags (const char *file,
 	return tags;
 }
 
+/* How often the client looks at the progress of reading a directory. */
+#define DIR_READ_POLL_MS	100
+
+/* A directory being read by a reader thread.  It's shared by the thread
+ * and the caller, the last of them to leave frees it. */
+struct dir_read
+{
+	DIR *dir;
+	char *directory;
+	bool dir_is_root;
+	bool show_hidden;
+
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	lists_t_strs *dirs;
+	lists_t_strs *playlists;
+	lists_t_strs *files;
+	int count;		/* entries found so far */
+	bool path_too_long;
+	bool done;
+	bool cancel;		/* the caller is not waiting any more */
+	int refs;
+};
+
+/* Type of the directory entry.  The type in the entry saves a stat() on
+ * each file for the file systems which fill it. */
+static enum file_type entry_type (const struct dirent *entry,
+		const char *file)
+{
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	switch (entry->d_type) {
+	case DT_DIR:
+		return F_DIR;
+	case DT_REG:
+		if (is_sound_file (file))
+			return F_SOUND;
+		if (is_plist_file (file))
+			return F_PLAYLIST;
+		return F_OTHER;
+	}
+#endif
+
+	return file_type (file);
+}
+
+static void dir_read_unref (struct dir_read *dr)
+{
+	int refs;
+
+	LOCK (dr->mtx);
+	refs = --dr->refs;
+	UNLOCK (dr->mtx);
+
+	if (refs > 0)
+		return;
+
+	closedir (dr->dir);
+	lists_strs_free (dr->dirs);
+	lists_strs_free (dr->playlists);
+	lists_strs_free (dr->files);
+	pthread_mutex_destroy (&dr->mtx);
+	pthread_cond_destroy (&dr->cond);
+	free (dr->directory);
+	free (dr);
+}
+
+static void *dir_read_thread (void *arg)
+{
+	struct dir_read *dr = (struct dir_read *)arg;
+	struct dirent *entry;
+
+	while ((entry = readdir(dr->dir))) {
+		int rc;
+		char file[PATH_MAX];
+		enum file_type type;
+
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		if (!dr->show_hidden && entry->d_name[0] == '.')
+			continue;
+
+		rc = snprintf(file, sizeof(file), "%s/%s",
+		              dr->dir_is_root ? "" : dr->directory,
+		              entry->d_name);
+		if (rc >= ssizeof(file)) {
+			LOCK (dr->mtx);
+			dr->path_too_long = true;
+			UNLOCK (dr->mtx);
+			break;
+		}
+
+		type = entry_type (entry, file);
+
+		LOCK (dr->mtx);
+		if (dr->cancel) {
+			UNLOCK (dr->mtx);
+			break;
+		}
+		if (type == F_SOUND)
+			lists_strs_append (dr->files, file);
+		else if (type == F_DIR)
+			lists_strs_append (dr->dirs, file);
+		else if (type == F_PLAYLIST)
+			lists_strs_append (dr->playlists, file);
+		dr->count += 1;
+		UNLOCK (dr->mtx);
+	}
+
+	LOCK (dr->mtx);
+	dr->done = true;
+	pthread_cond_signal (&dr->cond);
+	UNLOCK (dr->mtx);
+
+	dir_read_unref (dr);
+
+	return NULL;
+}
+
+/* Move the strings from src to the end of dst. */
+static void move_strs (lists_t_strs *dst, lists_t_strs *src)
+{
+	int ix;
+
+	for (ix = 0; ix < lists_strs_size (src); ix += 1)
+		lists_strs_append (dst, lists_strs_at (src, ix));
+	lists_strs_clear (src);
+}
+
 /* Read the content of the directory, make an array of absolute paths for
  * all recognized files. Put directories, playlists and sound files
- * in proper structures. Return 0 on error.*/
+ * in proper structures.  The directory is read by a separate thread, so
+ * a slow file system doesn't block the interrupt key: if the user
+ * interrupts, the files found so far are used and the thread is left to
+ * finish on its own.  If progress is not NULL, it's called with the number
+ * of entries read so far while waiting.  Return 0 on error. */
 int read_directory (const char *directory, lists_t_strs *dirs,
-		lists_t_strs *playlists, struct plist *plist)
+		lists_t_strs *playlists, struct plist *plist,
+		void (*progress)(int count))
 {
 	DIR *dir;
-	struct dirent *entry;
-	bool show_hidden = options_get_bool ("ShowHiddenFiles");
-	int dir_is_root;
+	struct dir_read *dr;
+	pthread_t thread;
+	pthread_attr_t attr;
+	bool path_too_long, cancelled;
+	int ix, rc;
 
 	assert (directory != NULL);
 	assert (*directory == '/');
@@ -396,92 +535,218 @@ int read_directory (const char *directory, lists_t_strs *dirs,
 		return 0;
 	}
 
-	if (!strcmp(directory, "/"))
-		dir_is_root = 1;
-	else
-		dir_is_root = 0;
+	dr = (struct dir_read *)xmalloc (sizeof (struct dir_read));
+	dr->dir = dir;
+	dr->directory = xstrdup (directory);
+	dr->dir_is_root = !strcmp (directory, "/");
+	dr->show_hidden = options_get_bool ("ShowHiddenFiles");
+	pthread_mutex_init (&dr->mtx, NULL);
+	pthread_cond_init (&dr->cond, NULL);
+	dr->dirs = lists_strs_new_arena (FILES_LIST_INIT_SIZE);
+	dr->playlists = lists_strs_new_arena (FILES_LIST_INIT_SIZE);
+	dr->files = lists_strs_new_arena (FILES_LIST_INIT_SIZE);
+	dr->count = 0;
+	dr->path_too_long = false;
+	dr->done = false;
+	dr->cancel = false;
+	dr->refs = 2;
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create (&thread, &attr, dir_read_thread, dr);
+	pthread_attr_destroy (&attr);
+	if (rc != 0) {
+		log_errno ("Can't create the directory reading thread", rc);
+		dir_read_thread (dr);
+	}
 
-	while ((entry = readdir(dir))) {
-		int rc;
-		char file[PATH_MAX];
-		enum file_type type;
+	LOCK (dr->mtx);
+	while (!dr->done) {
+		struct timespec wake_up;
+		int count;
 
-		if (user_wants_interrupt()) {
-			error ("Interrupted! Not all files read!");
-			break;
+		get_realtime (&wake_up);
+		wake_up.tv_nsec += DIR_READ_POLL_MS * 1000000L;
+		if (wake_up.tv_nsec >= 1000000000L) {
+			wake_up.tv_sec += 1;
+			wake_up.tv_nsec -= 1000000000L;
 		}
+		pthread_cond_timedwait (&dr->cond, &dr->mtx, &wake_up);
+		if (dr->done)
+			break;
+		count = dr->count;
+		UNLOCK (dr->mtx);
 
-		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
-			continue;
-		if (!show_hidden && entry->d_name[0] == '.')
-			continue;
-
-		rc = snprintf(file, sizeof(file), "%s/%s",
-		              dir_is_root ? "" : directory, entry->d_name);
-		if (rc >= ssizeof(file)) {
-			error ("Path too long!");
-			closedir (dir);
-			return 0;
+		if (user_wants_interrupt ()) {
+			LOCK (dr->mtx);
+			dr->cancel = true;
+			break;
 		}
+		if (progress)
+			progress (count);
 
-		type = file_type (file);
-		if (type == F_SOUND)
-			plist_add (plist, file);
-		else if (type == F_DIR)
-			lists_strs_append (dirs, file);
-		else if (type == F_PLAYLIST)
-			lists_strs_append (playlists, file);
+		LOCK (dr->mtx);
 	}
 
-	closedir (dir);
+	path_too_long = dr->path_too_long;
+	cancelled = dr->cancel;
+	move_strs (dirs, dr->dirs);
+	move_strs (playlists, dr->playlists);
+	for (ix = 0; ix < lists_strs_size (dr->files); ix += 1)
+		plist_add (plist, lists_strs_at (dr->files, ix));
+	lists_strs_clear (dr->files);
+	UNLOCK (dr->mtx);
+
+	dir_read_unref (dr);
+
+	if (cancelled)
+		error ("Interrupted! Not all files read!");
+
+	if (path_too_long) {
+		error ("Path too long!");
+		return 0;
+	}
 
 	return 1;
 }
 
-static int dir_symlink_loop (const ino_t inode_no, const ino_t *dir_stack,
-		const int depth)
+/* Number of threads walking the directory tree when adding it to a
+ * playlist.  They mostly wait for the disk, more of them let it reorder
+ * the requests. */
+#define SCAN_THREADS	4
+
+/* Identity of a directory, for detecting symlink loops. */
+struct dir_id
+{
+	dev_t dev;
+	ino_t ino;
+};
+
+/* A directory waiting to be read by the tree walk. */
+struct scan_dir
+{
+	char *path;
+	struct dir_id *parents;	/* the directories above it */
+	int depth;		/* number of parents */
+	struct scan_dir *next;
+};
+
+/* State of the tree walk shared by the scanning threads. */
+struct scan
+{
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	struct scan_dir *queue;	/* directories to read (a stack) */
+	int busy;		/* threads reading a directory */
+	bool interrupted;
+	char *err;		/* the first error */
+};
+
+/* Files found by one scanning thread. */
+struct scan_worker
+{
+	pthread_t thread;
+	struct scan *scan;
+	lists_t_strs *files;
+};
+
+static bool dir_symlink_loop (const struct dir_id *id,
+		const struct dir_id *parents, const int depth)
 {
 	int i;
 
 	for (i = 0; i < depth; i++)
-		if (dir_stack[i] == inode_no)
-			return 1;
+		if (parents[i].ino == id->ino && parents[i].dev == id->dev)
+			return true;
 
-	return 0;
+	return false;
 }
 
-/* Recursively add files from the directory to the playlist.
- * Return 1 if OK (and even some errors), 0 if the user interrupted. */
-static int read_directory_recurr_internal (const char *directory, struct plist *plist,
-		ino_t **dir_stack, int *depth)
+/* Remember the error to be shown when the walk is done; only the first one
+ * is shown, the others are logged. */
+static void scan_error (struct scan *scan, const char *format, ...)
+{
+	char msg[256];
+	va_list va;
+
+	va_start (va, format);
+	vsnprintf (msg, sizeof (msg), format, va);
+	va_end (va);
+
+	logit ("%s", msg);
+
+	LOCK (scan->mtx);
+	if (!scan->err)
+		scan->err = xstrdup (msg);
+	UNLOCK (scan->mtx);
+}
+
+static void scan_push (struct scan *scan, char *path,
+		const struct dir_id *parents, const int depth)
+{
+	struct scan_dir *sd;
+
+	sd = (struct scan_dir *)xmalloc (sizeof (struct scan_dir));
+	sd->path = path;
+	sd->depth = depth;
+	sd->parents = NULL;
+	if (depth > 0) {
+		sd->parents = (struct dir_id *)xmalloc (sizeof (struct dir_id)
+				* depth);
+		memcpy (sd->parents, parents, sizeof (struct dir_id) * depth);
+	}
+
+	LOCK (scan->mtx);
+	sd->next = scan->queue;
+	scan->queue = sd;
+	pthread_cond_signal (&scan->cond);
+	UNLOCK (scan->mtx);
+}
+
+static void scan_dir_free (struct scan_dir *sd)
+{
+	free (sd->path);
+	free (sd->parents);
+	free (sd);
+}
+
+/* Read one directory: queue its subdirectories and put the sound files
+ * into files. */
+static void scan_read_dir (struct scan *scan, struct scan_dir *sd,
+		lists_t_strs *files)
 {
 	DIR *dir;
 	struct dirent *entry;
 	struct stat st;
+	struct dir_id *ids;
 
-	if (stat (directory, &st)) {
+	if (!(dir = opendir(sd->path))) {
 		char *err = xstrerror (errno);
-		error ("Can't stat %s: %s", directory, err);
+		scan_error (scan, "Can't read directory %s: %s", sd->path, err);
 		free (err);
-		return 0;
+		return;
 	}
 
-	assert (plist != NULL);
-	assert (directory != NULL);
-
-	if (*dir_stack && dir_symlink_loop(st.st_ino, *dir_stack, *depth)) {
-		logit ("Detected symlink loop on %s", directory);
-		return 1;
+	if (fstat (dirfd (dir), &st)) {
+		char *err = xstrerror (errno);
+		scan_error (scan, "Can't stat %s: %s", sd->path, err);
+		free (err);
+		closedir (dir);
+		return;
 	}
 
-	if (!(dir = opendir(directory))) {
-		error_errno ("Can't read directory", errno);
-		return 1;
-	}
+	ids = (struct dir_id *)xmalloc (sizeof (struct dir_id) * (sd->depth + 1));
+	if (sd->depth > 0)
+		memcpy (ids, sd->parents, sizeof (struct dir_id) * sd->depth);
+	ids[sd->depth].dev = st.st_dev;
+	ids[sd->depth].ino = st.st_ino;
 
-	(*depth)++;
-	*dir_stack = (ino_t *)xrealloc (*dir_stack, sizeof(ino_t) * (*depth));
-	(*dir_stack)[*depth - 1] = st.st_ino;
+	if (dir_symlink_loop (&ids[sd->depth], sd->parents, sd->depth)) {
+		logit ("Detected symlink loop on %s", sd->path);
+		free (ids);
+		closedir (dir);
+		return;
+	}
 
 	while ((entry = readdir(dir))) {
 		int rc;
@@ -489,44 +754,152 @@ static int read_directory_recurr_internal (const char *directory, struct plist *
 		enum file_type type;
 
 		if (user_wants_interrupt()) {
-			error ("Interrupted! Not all files read!");
+			LOCK (scan->mtx);
+			scan->interrupted = true;
+			UNLOCK (scan->mtx);
 			break;
 		}
 
 		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
 			continue;
-		rc = snprintf(file, sizeof(file), "%s/%s", directory, entry->d_name);
+		rc = snprintf(file, sizeof(file), "%s/%s", sd->path, entry->d_name);
 		if (rc >= ssizeof(file)) {
-			error ("Path too long!");
+			scan_error (scan, "Path too long!");
 			continue;
 		}
-		type = file_type (file);
+		type = entry_type (entry, file);
 		if (type == F_DIR)
-			read_directory_recurr_internal(file, plist, dir_stack, depth);
-		else if (type == F_SOUND && plist_find_fname(plist, file) == -1)
-			plist_add (plist, file);
+			scan_push (scan, xstrdup (file), ids, sd->depth + 1);
+		else if (type == F_SOUND)
+			lists_strs_append (files, file);
 	}
 
-	(*depth)--;
-	*dir_stack = (ino_t *)xrealloc (*dir_stack, sizeof(ino_t) * (*depth));
-
+	free (ids);
 	closedir (dir);
-	return 1;
 }
 
+static void *scan_thread (void *arg)
+{
+	struct scan_worker *worker = (struct scan_worker *)arg;
+	struct scan *scan = worker->scan;
+
+	LOCK (scan->mtx);
+	while (true) {
+		struct scan_dir *sd;
+
+		while (!scan->queue && scan->busy > 0 && !scan->interrupted)
+			pthread_cond_wait (&scan->cond, &scan->mtx);
+		if (!scan->queue || scan->interrupted)
+			break;
+
+		sd = scan->queue;
+		scan->queue = sd->next;
+		scan->busy += 1;
+		UNLOCK (scan->mtx);
+
+		scan_read_dir (scan, sd, worker->files);
+		scan_dir_free (sd);
+
+		LOCK (scan->mtx);
+		scan->busy -= 1;
+	}
+
+	/* Wake up the others: there is nothing left or we were interrupted. */
+	pthread_cond_broadcast (&scan->cond);
+	UNLOCK (scan->mtx);
+
+	return NULL;
+}
+
+/* Recursively add files from the directory to the playlist.  The tree is
+ * read by a few threads; the files are added in the collation order of
+ * their paths, so the result doesn't depend on which thread read what.
+ * Return 1 if OK (and even some errors), 0 if the user interrupted. */
 int read_directory_recurr (const char *directory, struct plist *plist)
 {
-	int ret;
-	int depth = 0;
-	ino_t *dir_stack = NULL;
+	struct scan scan;
+	struct scan_worker workers[SCAN_THREADS];
+	lists_t_strs *files;
+	int i, started;
+
+	assert (plist != NULL);
+	assert (directory != NULL);
+
+	pthread_mutex_init (&scan.mtx, NULL);
+	pthread_cond_init (&scan.cond, NULL);
+	scan.queue = NULL;
+	scan.busy = 0;
+	scan.interrupted = false;
+	scan.err = NULL;
+
+	scan_push (&scan, xstrdup (directory), NULL, 0);
+
+	started = 0;
+	for (i = 0; i < SCAN_THREADS; i++) {
+		int rc;
 
-	ret = read_directory_recurr_internal (directory, plist, &dir_stack,
-			&depth);
+		workers[i].scan = &scan;
+		workers[i].files = lists_strs_new_arena (FILES_LIST_INIT_SIZE);
+		rc = pthread_create (&workers[i].thread, NULL, scan_thread,
+				&workers[i]);
+		if (rc != 0) {
+			log_errno ("Can't create a directory scanning thread", rc);
+			lists_strs_free (workers[i].files);
+			break;
+		}
+		started += 1;
+	}
+
+	/* Do it here if no thread could be started. */
+	if (started == 0) {
+		workers[0].scan = &scan;
+		workers[0].files = lists_strs_new_arena (FILES_LIST_INIT_SIZE);
+		scan_thread (&workers[0]);
+		started = 1;
+	}
+	else {
+		for (i = 0; i < started; i++)
+			pthread_join (workers[i].thread, NULL);
+	}
+
+	/* After an interrupt there may be directories not read. */
+	while (scan.queue) {
+		struct scan_dir *sd = scan.queue;
+
+		scan.queue = sd->next;
+		scan_dir_free (sd);
+	}
 
-	if (dir_stack)
-		free (dir_stack);
+	files = workers[0].files;
+	for (i = 1; i < started; i++) {
+		int ix;
 
-	return ret;
+		for (ix = 0; ix < lists_strs_size (workers[i].files); ix += 1)
+			lists_strs_append (files, lists_strs_at (workers[i].files, ix));
+		lists_strs_free (workers[i].files);
+	}
+
+	lists_strs_collate (files,
+			!strcasecmp (options_get_symb ("Sort"), "Natural"));
+	for (i = 0; i < lists_strs_size (files); i++) {
+		const char *file = lists_strs_at (files, i);
+
+		if (plist_find_fname (plist, file) == -1)
+			plist_add (plist, file);
+	}
+	lists_strs_free (files);
+
+	if (scan.err) {
+		error ("%s", scan.err);
+		free (scan.err);
+	}
+	if (scan.interrupted)
+		error ("Interrupted! Not all files read!");
+
+	pthread_mutex_destroy (&scan.mtx);
+	pthread_cond_destroy (&scan.cond);
+
+	return scan.interrupted ? 0 : 1;
 }
 
 /* Return the file extension position or NULL if the file has no extension. */
@@ -693,8 +1066,16 @@ int file_exists (const char *file)
 time_t get_mtime (const char *file)
 {
 	struct stat stat_buf;
+	char *cue;
+	int number;
+	int res;
+
+	/* A track of a CUE sheet changes with the sheet. */
+	cue = cue_split_name (file, &number);
+	res = stat (cue ? cue : file, &stat_buf);
+	free (cue);
 
-	if (stat(file, &stat_buf) != -1)
+	if (res != -1)
 		return stat_buf.st_mtime;
 
 	return (time_t)-1;
@@ -14,7 +14,8 @@ extern "C" {
 void files_init ();
 void files_cleanup ();
 int read_directory (const char *directory, lists_t_strs *dirs,
-		lists_t_strs *playlists, struct plist *plist);
+		lists_t_strs *playlists, struct plist *plist,
+		void (*progress)(int count));
 int read_directory_recurr (const char *directory, struct plist *plist);
 void resolve_path (char *buf, size_t size, const char *file);
 char *ext_pos (const char *file);
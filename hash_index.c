@@ -0,0 +1,232 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Hash index: file name -> data (non-NULL pointer) lookup for playlists
+ * and menus.  It's an open addressing table with linear probing which
+ * doesn't copy the keys: they are taken from the data by the key
+ * function.  Removal shifts the following entries back, so there are no
+ * tombstones. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "common.h"
+#include "hash_index.h"
+
+/* Minimal number of slots in the table. */
+#define MIN_SLOTS	64
+
+struct hash_slot
+{
+	uint32_t hash;
+	const void *data;	/* NULL for an empty slot */
+};
+
+struct hash_index
+{
+	struct hash_slot *slots;
+	int size;		/* number of slots, a power of 2 */
+	int count;		/* number of used slots */
+	hash_index_key *key_fn;
+	const void *adata;	/* passed to key_fn */
+};
+
+/* FNV-1a */
+static uint32_t hash_key (const char *key)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static const char *slot_key (const struct hash_index *h, const int i)
+{
+	return h->key_fn (h->slots[i].data, h->adata);
+}
+
+/* Return the slot holding the key or the empty slot where it would be
+ * stored. */
+static int find_slot (const struct hash_index *h, const char *key,
+		const uint32_t hash)
+{
+	int mask = h->size - 1;
+	int i = hash & mask;
+
+	while (h->slots[i].data) {
+		if (h->slots[i].hash == hash && !strcmp (slot_key (h, i), key))
+			break;
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+/* Move the entries to a table of the given size. */
+static void resize (struct hash_index *h, const int size)
+{
+	struct hash_slot *old = h->slots;
+	int old_size = h->size;
+	int i;
+
+	h->slots = (struct hash_slot *)xcalloc (size,
+			sizeof(struct hash_slot));
+	h->size = size;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].data) {
+			int j = old[i].hash & (size - 1);
+
+			while (h->slots[j].data)
+				j = (j + 1) & (size - 1);
+			h->slots[j] = old[i];
+		}
+	}
+
+	free (old);
+}
+
+struct hash_index *hash_index_new (hash_index_key *key_fn,
+                                   const void *adata)
+{
+	struct hash_index *h;
+
+	assert (key_fn != NULL);
+
+	h = (struct hash_index *)xmalloc (sizeof(struct hash_index));
+	h->slots = (struct hash_slot *)xcalloc (MIN_SLOTS,
+			sizeof(struct hash_slot));
+	h->size = MIN_SLOTS;
+	h->count = 0;
+	h->key_fn = key_fn;
+	h->adata = adata;
+
+	return h;
+}
+
+/* Make room for count entries, so adding them doesn't rehash the table
+ * again and again. */
+void hash_index_reserve (struct hash_index *h, const int count)
+{
+	int size = h->size;
+
+	assert (h != NULL);
+	assert (count >= 0);
+
+	/* Keep the table at most half full. */
+	while (size / 2 < count)
+		size *= 2;
+
+	if (size != h->size)
+		resize (h, size);
+}
+
+void hash_index_clear (struct hash_index *h)
+{
+	assert (h != NULL);
+
+	if (h->size != MIN_SLOTS) {
+		free (h->slots);
+		h->slots = (struct hash_slot *)xcalloc (MIN_SLOTS,
+				sizeof(struct hash_slot));
+		h->size = MIN_SLOTS;
+	}
+	else
+		memset (h->slots, 0, sizeof(struct hash_slot) * h->size);
+
+	h->count = 0;
+}
+
+void hash_index_free (struct hash_index *h)
+{
+	assert (h != NULL);
+
+	free (h->slots);
+	free (h);
+}
+
+/* Return the data for the key or NULL if there is no such key. */
+const void *hash_index_find (const struct hash_index *h, const char *key)
+{
+	assert (h != NULL);
+	assert (key != NULL);
+
+	return h->slots[find_slot (h, key, hash_key (key))].data;
+}
+
+/* Add the data to the index replacing the data with the same key. */
+void hash_index_set (struct hash_index *h, const void *data)
+{
+	const char *key;
+	uint32_t hash;
+	int i;
+
+	assert (h != NULL);
+	assert (data != NULL);
+
+	key = h->key_fn (data, h->adata);
+	hash = hash_key (key);
+	i = find_slot (h, key, hash);
+
+	if (!h->slots[i].data) {
+		if ((h->count + 1) * 2 > h->size) {
+			resize (h, h->size * 2);
+			i = find_slot (h, key, hash);
+		}
+		h->count++;
+	}
+
+	h->slots[i].hash = hash;
+	h->slots[i].data = data;
+}
+
+/* Remove the key from the index if it's there. */
+void hash_index_delete (struct hash_index *h, const char *key)
+{
+	int mask, i, j;
+
+	assert (h != NULL);
+	assert (key != NULL);
+
+	mask = h->size - 1;
+	i = find_slot (h, key, hash_key (key));
+	if (!h->slots[i].data)
+		return;
+
+	h->count--;
+
+	/* Shift back the entries which would not be found past the hole. */
+	for (;;) {
+		int k;
+
+		h->slots[i].data = NULL;
+		j = i;
+
+		do {
+			j = (j + 1) & mask;
+			if (!h->slots[j].data)
+				return;
+			k = h->slots[j].hash & mask;
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+
+		h->slots[i] = h->slots[j];
+		i = j;
+	}
+}
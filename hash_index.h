@@ -0,0 +1,27 @@
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return the key (file name) of the data stored in the index. */
+typedef const char *hash_index_key (const void *data, const void *adata);
+
+struct hash_index;
+
+struct hash_index *hash_index_new (hash_index_key *key_fn,
+                                   const void *adata);
+void hash_index_reserve (struct hash_index *h, const int count);
+void hash_index_clear (struct hash_index *h);
+void hash_index_free (struct hash_index *h);
+
+const void *hash_index_find (const struct hash_index *h, const char *key);
+void hash_index_set (struct hash_index *h, const void *data);
+void hash_index_delete (struct hash_index *h, const char *key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
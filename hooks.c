@@ -0,0 +1,210 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Running the commands configured for the server's events (OnSongChange,
+ * OnStop...).  They are started with posix_spawn() where available, so the
+ * server's memory is not copied for each of them.  If HookHelper is set,
+ * the commands are not run at all: a line describing each one is written
+ * to the standard input of a helper process started once.  The commands
+ * are run if the helper can't be started. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
+
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "hooks.h"
+
+extern char **environ;
+
+/* Write end of the pipe to the helper's standard input, -1 if the helper
+ * is not running. */
+static int helper_fd = -1;
+
+/* Hooks are run from the server thread and the player thread. */
+static pthread_mutex_t hooks_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Start args[0] with the arguments, with in_fd as its standard input if
+ * it's not -1.  Return false on error. */
+static bool spawn_cmd (char **args, int in_fd)
+{
+	pid_t pid;
+#ifdef HAVE_POSIX_SPAWN
+	posix_spawn_file_actions_t actions, *actions_ptr = NULL;
+	int rc;
+
+	if (in_fd != -1) {
+		posix_spawn_file_actions_init (&actions);
+		posix_spawn_file_actions_adddup2 (&actions, in_fd, STDIN_FILENO);
+		posix_spawn_file_actions_addclose (&actions, in_fd);
+		actions_ptr = &actions;
+	}
+
+	rc = posix_spawn (&pid, args[0], actions_ptr, NULL, args, environ);
+
+	if (actions_ptr)
+		posix_spawn_file_actions_destroy (actions_ptr);
+
+	if (rc != 0) {
+		char *err = xstrerror (rc);
+
+		logit ("Error when running the command '%s': %s", args[0], err);
+		free (err);
+		return false;
+	}
+#else
+	pid = fork ();
+	if (pid == 0) {
+		if (in_fd != -1) {
+			dup2 (in_fd, STDIN_FILENO);
+			close (in_fd);
+		}
+		execve (args[0], args, environ);
+		fatal ("Error when running the command '%s': %s",
+		        args[0], xstrerror (errno));
+	}
+	if (pid == -1) {
+		log_errno ("Failed to fork()", errno);
+		return false;
+	}
+#endif
+
+	debug ("Started '%s' (pid %d)", args[0], (int)pid);
+
+	return true;
+}
+
+/* Start the helper if it's configured and not running. */
+static void helper_start ()
+{
+	char *path = options_get_str ("HookHelper");
+	char *args[2];
+	int fds[2];
+
+	if (!path || helper_fd != -1)
+		return;
+
+	if (pipe (fds) == -1) {
+		log_errno ("Can't create the pipe to the hook helper", errno);
+		return;
+	}
+
+	/* The commands started later must not keep the pipe open, the
+	 * helper wouldn't see the end of it. */
+	if (fcntl (fds[1], F_SETFD, FD_CLOEXEC) == -1
+			|| fcntl (fds[1], F_SETFL, O_NONBLOCK) == -1)
+		log_errno ("Can't set the pipe to the hook helper", errno);
+
+	args[0] = path;
+	args[1] = NULL;
+
+	if (spawn_cmd (args, fds[0])) {
+		logit ("Started the hook helper '%s'", path);
+		helper_fd = fds[1];
+	}
+	else
+		close (fds[1]);
+
+	close (fds[0]);
+}
+
+static void helper_stop ()
+{
+	if (helper_fd != -1) {
+		close (helper_fd);
+		helper_fd = -1;
+	}
+}
+
+/* Write the event line to the helper: the event name, the command and its
+ * arguments separated by tabs.  Tabs and newlines in the arguments are
+ * written as spaces.  The line is dropped if the helper doesn't keep up. */
+static void helper_send (const char *event, char **args)
+{
+	char line[PIPE_BUF];
+	const char *s = event;
+	size_t len = 0;
+	ssize_t res;
+	int i = 0;
+
+	/* Leave room for the newline. */
+	while (len < sizeof(line) - 1) {
+		if (*s) {
+			line[len++] = (*s == '\t' || *s == '\n') ? ' ' : *s;
+			s++;
+		}
+		else if (args[i]) {
+			line[len++] = '\t';
+			s = args[i++];
+		}
+		else
+			break;
+	}
+
+	if (*s || args[i]) {
+		logit ("The %s line for the hook helper is too long", event);
+		return;
+	}
+	line[len++] = '\n';
+
+	/* Up to PIPE_BUF bytes are written at once or not at all. */
+	res = write (helper_fd, line, len);
+	if (res == -1 && errno == EAGAIN)
+		logit ("The hook helper is busy, %s dropped", event);
+	else if (res == -1) {
+		log_errno ("Can't write to the hook helper", errno);
+		helper_stop ();
+	}
+}
+
+void hooks_init ()
+{
+	LOCK (hooks_mtx);
+	helper_start ();
+	UNLOCK (hooks_mtx);
+}
+
+/* Close the pipe, the helper exits when it reads the end of it. */
+void hooks_cleanup ()
+{
+	LOCK (hooks_mtx);
+	helper_stop ();
+	UNLOCK (hooks_mtx);
+}
+
+/* Run the command of the event (args[0] with the arguments) or pass it to
+ * the helper. */
+void hooks_run (const char *event, char **args)
+{
+	LOCK (hooks_mtx);
+
+	/* Restart the helper if it has exited. */
+	helper_start ();
+
+	if (helper_fd != -1)
+		helper_send (event, args);
+	else
+		spawn_cmd (args, -1);
+
+	UNLOCK (hooks_mtx);
+}
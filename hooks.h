@@ -0,0 +1,16 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void hooks_init ();
+void hooks_cleanup ();
+void hooks_run (const char *event, char **args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -50,12 +50,20 @@
 #include "files.h"
 #include "decoder.h"
 #include "themes.h"
+#include "startup.h"
 #include "softmixer.h"
 #include "utf8.h"
 #include "ratings.h"
+#include "status_page.h"
+#include "lyrics.h"
 
 #define INTERFACE_LOG	"mocp_client_log"
 #define PLAYLIST_FILE	"playlist.m3u"
+#define PLAYLIST_SNAPSHOT	"playlist.snap"
+
+/* How many items of the playlist loaded from the snapshot are checked
+ * against their files at a time. */
+#define SNAPSHOT_CHECK_BATCH	256
 
 #define QUEUE_CLEAR_THRESH 128
 
@@ -69,6 +77,21 @@ static struct plist *dir_plist = NULL; /* contents of the current directory */
 /* Queue for events coming from the server. */
 static struct event_queue events;
 
+/* EV_FILE_TAGS events unpacked from EV_FILES_TAGS, not yet handled.  It's
+ * used also without the interface, so it's initialized statically. */
+static struct event_queue batched_tags;
+
+/* Files shown on the screen (or near it) for which we last asked the server
+ * to read the tags first. */
+static lists_t_strs *boosted_files = NULL;
+
+/* How many items above and below the visible part of a menu get their tags
+ * read before the rest, so they are there when the user scrolls. */
+#define TAGS_PREFETCH_ROWS	64
+
+/* How often to look for the lyrics being loaded in the background. */
+#define LYRICS_POLL_MS		50
+
 /* Current working directory (the directory we show). */
 static char cwd[PATH_MAX] = "";
 
@@ -87,6 +110,14 @@ static volatile int want_resize = 0;
 /* Are we waiting for the playlist we have loaded and sent to the clients? */
 static int waiting_for_plist_load = 0;
 
+/* Index of the next playlist item loaded from the snapshot to check
+ * against its file or -1 if there is nothing to check. */
+static int snapshot_check = -1;
+
+/* Version of the server's playlist our playlist is in sync with, counted
+ * up with every playlist event. */
+static struct plist_sync plist_sync = { -1, -1 };
+
 /* Information about the currently played file. */
 static struct file_info curr_file;
 
@@ -98,10 +129,22 @@ static time_t silent_seek_key_last = (time_t)0; /* when the silent seek key was
 /* When the menu was last moved (arrow keys, page up, etc.) */
 static time_t last_menu_move_time = (time_t)0;
 
+/* Options read for each item added to the menus or each server event. */
+static options_t_handle opt_read_tags = OPTIONS_HANDLE("ReadTags");
+static options_t_handle opt_rating_show = OPTIONS_HANDLE("RatingShow");
+static options_t_handle opt_show_time = OPTIONS_HANDLE("ShowTime");
+static options_t_handle opt_hide_file_ext = OPTIONS_HANDLE("HideFileExtension");
+static options_t_handle opt_sync_playlist = OPTIONS_HANDLE("SyncPlaylist");
+
 /* File descriptors for inotify (inotify, watch) */
 #ifdef HAVE_SYS_INOTIFY_H
 static int inotify_fd = -1;
 static int inotify_wd = -1;
+
+/* The events of the current directory's watch which change its listing.
+ * Changes to the files' content are not watched: the server watches them
+ * and sends their new tags. */
+#define DIR_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
 #endif
 
 static void sig_quit (int sig LOGIT_ONLY)
@@ -233,6 +276,20 @@ static struct tag_ev_response *recv_tags_data_from_srv ()
 	return r;
 }
 
+/* Receive data of EV_FILES_TAGS and put it as EV_FILE_TAGS events into
+ * the queue. */
+static void recv_files_tags_from_srv (struct event_queue *q)
+{
+	int count;
+
+	count = get_int_from_srv ();
+	if (count < 1 || count > FILES_TAGS_BATCH)
+		fatal ("Bad number of files in tags event: %d", count);
+
+	while (count-- > 0)
+		event_push (q, EV_FILE_TAGS, recv_tags_data_from_srv ());
+}
+
 static struct move_ev_data *recv_move_ev_data_from_srv ()
 {
 	struct move_ev_data *d;
@@ -275,11 +332,38 @@ static void wait_for_data ()
 		event = get_int_from_srv ();
 		if (event == EV_EXIT)
 			interface_fatal ("The server exited!");
-		if (event != EV_DATA)
+		if (event == EV_FILES_TAGS)
+			recv_files_tags_from_srv (&events);
+		else if (event != EV_DATA)
 			event_push (&events, event, get_event_data(event));
 	 } while (event != EV_DATA);
 }
 
+/* Get the next event from the server and its data.  EV_FILES_TAGS is
+ * returned as separate EV_FILE_TAGS events. */
+static int get_event_from_srv (void **data)
+{
+	struct event *e;
+	int type;
+
+	if (!(e = event_get_first (&batched_tags))) {
+		type = get_int_from_srv ();
+		if (type != EV_FILES_TAGS) {
+			*data = get_event_data (type);
+			return type;
+		}
+
+		recv_files_tags_from_srv (&batched_tags);
+		e = event_get_first (&batched_tags);
+	}
+
+	type = e->type;
+	*data = e->data;
+	event_pop (&batched_tags);
+
+	return type;
+}
+
 /* Get an integer value from the server that will arrive after EV_DATA. */
 static int get_data_int ()
 {
@@ -557,65 +641,163 @@ static int is_subdir (const char *dir1, const char *dir2)
 	return !strncmp(dir1, dir2, strlen(dir1)) ? 1 : 0;
 }
 
-static int sort_strcmp_func (const void *a, const void *b)
-{
-	return strcoll (*(char **)a, *(char **)b);
-}
-
-static int sort_dirs_func (const void *a, const void *b)
+/* Should the file names be sorted in the natural order? */
+static bool sort_natural ()
 {
-	char *sa = *(char **)a;
-	char *sb = *(char **)b;
-
-	/* '../' is always first */
-	if (!strcmp(sa, "../"))
-		return -1;
-	if (!strcmp(sb, "../"))
-		return 1;
-
-	return strcmp (sa, sb);
+	return !strcasecmp (options_get_symb ("Sort"), "Natural");
 }
 
 static int get_tags_setting ()
 {
 	int needed_tags = 0;
 
-	if (options_get_bool("ReadTags"))
+	if (options_handle_bool (&opt_read_tags))
 		needed_tags |= TAGS_COMMENTS;
-	if (options_get_bool("RatingShow"))
+	if (options_handle_bool (&opt_rating_show))
 		needed_tags |= TAGS_RATING;
-	if (!strcasecmp(options_get_symb("ShowTime"), "yes"))
+	if (!strcasecmp(options_handle_symb (&opt_show_time), "yes"))
 		needed_tags |= TAGS_TIME;
 
 	return needed_tags;
 }
 
-/* For each file in the playlist, send a request for all the given tags if
- * the file is missing any of those tags.  Return the number of requests. */
+/* Send one CMD_GET_FILES_TAGS request for the files. */
+static void send_files_tags_request (lists_t_strs *files, const int tags_sel)
+{
+	int i;
+
+	send_int_to_srv (CMD_GET_FILES_TAGS);
+	send_int_to_srv (tags_sel);
+	send_int_to_srv (lists_strs_size (files));
+	for (i = 0; i < lists_strs_size (files); i++)
+		send_str_to_srv (lists_strs_at (files, i));
+
+	debug ("Asking for tags for %d files", lists_strs_size (files));
+}
+
+/* For each file in the playlist, request all the given tags if the file
+ * is missing any of those tags.  The requests are sent in batches of
+ * FILES_TAGS_REQUEST_MAX files.  Return the number of files requested. */
 static int ask_for_tags (const struct plist *plist, const int tags_sel)
 {
 	int i;
 	int req = 0;
+	lists_t_strs *files;
 
 	assert (plist != NULL);
 
-	if (tags_sel != 0) {
-		for (i = 0; i < plist->num; i++) {
-			if (!plist_deleted(plist, i) &&
-			    (!plist->items[i].tags ||
-			     ~plist->items[i].tags->filled & tags_sel)) {
-				char *file;
+	if (tags_sel == 0)
+		return 0;
 
-				file = plist_get_file (plist, i);
-				req += send_tags_request (file, tags_sel);
+	files = lists_strs_new (MIN(plist->num, FILES_TAGS_REQUEST_MAX));
+
+	for (i = 0; i < plist->num; i++) {
+		if (!plist_deleted(plist, i) &&
+		    (!plist->items[i].tags ||
+		     ~plist->items[i].tags->filled & tags_sel)) {
+			char *file;
+
+			file = plist_get_file (plist, i);
+
+			/* The server answers each file once. */
+			if (file_type(file) == F_SOUND
+					&& plist_find_del_fname(plist, file) == i) {
+				lists_strs_push (files, file);
+				req += 1;
+			}
+			else
 				free (file);
+
+			if (lists_strs_size (files) == FILES_TAGS_REQUEST_MAX) {
+				send_files_tags_request (files, tags_sel);
+				lists_strs_clear (files);
 			}
 		}
 	}
 
+	if (!lists_strs_empty (files))
+		send_files_tags_request (files, tags_sel);
+
+	lists_strs_free (files);
+
+	/* The new requests are queued behind the boosted ones, boost the
+	 * visible files again so they are read first. */
+	if (req > 0 && boosted_files) {
+		lists_strs_free (boosted_files);
+		boosted_files = NULL;
+	}
+
 	return req;
 }
 
+/* Return true if the file is on the playlist and misses some of the tags. */
+static bool tags_missing (struct plist *plist, const char *file,
+		const int tags_sel)
+{
+	int i = plist_find_fname (plist, file);
+
+	return i != -1 && (!plist->items[i].tags
+			|| ~plist->items[i].tags->filled & tags_sel);
+}
+
+static bool same_files (const lists_t_strs *a, const lists_t_strs *b)
+{
+	int i;
+
+	if (lists_strs_size (a) != lists_strs_size (b))
+		return false;
+
+	for (i = 0; i < lists_strs_size (a); i++)
+		if (strcmp (lists_strs_at (a, i), lists_strs_at (b, i)))
+			return false;
+
+	return true;
+}
+
+/* Ask the server to read the tags of the files shown on the screen first,
+ * then the ones near them and the rest after that, if the set of those
+ * files has changed since the last time (the user has scrolled). */
+static void boost_visible_tags_requests ()
+{
+	lists_t_strs *visible, *wanted;
+	int tags_sel = get_tags_setting ();
+	int i;
+
+	if (tags_sel == 0)
+		return;
+
+	visible = lists_strs_new (64);
+	iface_get_visible_files (visible, TAGS_PREFETCH_ROWS);
+
+	wanted = lists_strs_new (MAX(lists_strs_size (visible), 1));
+	for (i = 0; i < lists_strs_size (visible)
+			&& lists_strs_size (wanted) < FILES_TAGS_REQUEST_MAX; i++) {
+		const char *file = lists_strs_at (visible, i);
+
+		if (!lists_strs_exists (wanted, file)
+				&& (tags_missing (dir_plist, file, tags_sel)
+					|| tags_missing (playlist, file, tags_sel)))
+			lists_strs_append (wanted, file);
+	}
+	lists_strs_free (visible);
+
+	if (lists_strs_empty (wanted) || (boosted_files
+				&& same_files (wanted, boosted_files))) {
+		lists_strs_free (wanted);
+		return;
+	}
+
+	send_int_to_srv (CMD_BOOST_TAGS_REQUESTS);
+	send_int_to_srv (lists_strs_size (wanted));
+	for (i = 0; i < lists_strs_size (wanted); i++)
+		send_str_to_srv (lists_strs_at (wanted, i));
+	debug ("Boosted tags requests for %d files", lists_strs_size (wanted));
+
+	if (boosted_files)
+		lists_strs_free (boosted_files);
+	boosted_files = wanted;
+}
+
 static void interface_message (const char *format, ...)
 {
 	va_list va;
@@ -650,10 +832,10 @@ static void update_item_tags (struct plist *plist, const int num,
 
 	make_tags_title (plist, num);
 
-	if (options_get_bool ("ReadTags") && !plist->items[num].title_tags) {
+	if (options_handle_bool (&opt_read_tags) && !plist->items[num].title_tags) {
 		if (!plist->items[num].title_file)
 			make_file_title (plist, num,
-					options_get_bool ("HideFileExtension"));
+					options_handle_bool (&opt_hide_file_ext));
 	}
 
 	if (old_tags)
@@ -889,24 +1071,24 @@ static void event_plist_add (const struct plist_item *item)
 		int needed_tags = 0;
 		int i;
 
-		if (options_get_bool("ReadTags")
+		if (options_handle_bool (&opt_read_tags)
 				&& (!item->tags || !item->tags->title))
 			needed_tags |= TAGS_COMMENTS;
-		if (options_get_bool("RatingShow")
+		if (options_handle_bool (&opt_rating_show)
 				&& (!item->tags || !(item->tags->filled & TAGS_RATING)))
 			needed_tags |= TAGS_RATING;
-		if (!strcasecmp(options_get_symb("ShowTime"), "yes")
+		if (!strcasecmp(options_handle_symb (&opt_show_time), "yes")
 				&& (!item->tags || item->tags->time == -1))
 			needed_tags |= TAGS_TIME;
 
 		if (needed_tags)
 			send_tags_request (item->file, needed_tags);
 
-		if (options_get_bool ("ReadTags"))
+		if (options_handle_bool (&opt_read_tags))
 			make_tags_title (playlist, item_num);
 		else
 			make_file_title (playlist, item_num,
-					options_get_bool ("HideFileExtension"));
+					options_handle_bool (&opt_hide_file_ext));
 
 		/* Just calling iface_update_queue_positions (queue, playlist,
 		 * NULL, NULL) is too slow in cases when we receive a large
@@ -951,25 +1133,17 @@ static void update_error (char *err)
 /* Send the playlist to the server to be forwarded to another client. */
 static void forward_playlist ()
 {
-	int i;
-
 	debug ("Forwarding the playlist...");
 
 	send_int_to_srv (CMD_SEND_PLIST);
 	send_int_to_srv (plist_get_serial(playlist));
 
-	for (i = 0; i < playlist->num; i++)
-		if (!plist_deleted(playlist, i))
-			send_item_to_srv (&playlist->items[i]);
-
-	send_item_to_srv (NULL);
+	if (!send_plist_items(srv_sock, playlist))
+		fatal ("Can't send() the playlist to the server!");
 }
 
 static int recv_server_plist (struct plist *plist)
 {
-	int end_of_list = 0;
-	struct plist_item *item;
-
 	logit ("Asking server for the playlist from other client.");
 	send_int_to_srv (CMD_GET_PLIST);
 	logit ("Waiting for response");
@@ -986,39 +1160,28 @@ static int recv_server_plist (struct plist *plist)
 	logit ("Transfer...");
 
 	plist_set_serial (plist, get_int_from_srv());
+	plist_sync.serial = plist_get_serial (plist);
+	plist_sync.version = get_int_from_srv ();
 
-	do {
-		item = recv_item_from_srv ();
-		if (item->file[0])
-			plist_add_from_item (plist, item);
-		else
-			end_of_list = 1;
-		plist_free_item_fields (item);
-		free (item);
-	} while (!end_of_list);
+	if (!recv_plist_items(srv_sock, plist))
+		fatal ("Can't receive the playlist from the server!");
+
+	/* Playlist events that came before are already in the playlist. */
+	if (plist_sync.version != -1)
+		event_queue_drop (&events, is_plist_event);
 
 	return 1;
 }
 
 static void recv_server_queue (struct plist *queue)
 {
-	int end_of_list = 0;
-	struct plist_item *item;
-
 	logit ("Asking server for the queue.");
 	send_int_to_srv (CMD_GET_QUEUE);
 	logit ("Waiting for response");
 	wait_for_data (); /* There must always be (possibly empty) queue. */
 
-	do {
-		item = recv_item_from_srv ();
-		if (item->file[0])
-			plist_add_from_item (queue, item);
-		else
-			end_of_list = 1;
-		plist_free_item_fields (item);
-		free (item);
-	} while (!end_of_list);
+	if (!recv_plist_items(srv_sock, queue))
+		fatal ("Can't receive the queue from the server!");
 }
 
 /* Clear the playlist locally. */
@@ -1131,6 +1294,9 @@ static void server_event (const int event, void *data)
 {
 	logit ("EVENT: 0x%02x", event);
 
+	if (is_plist_event (event) && plist_sync.version != -1)
+		plist_sync.version++;
+
 	switch (event) {
 		case EV_BUSY:
 			interface_fatal ("The server is busy; "
@@ -1164,19 +1330,19 @@ static void server_event (const int event, void *data)
 			forward_playlist ();
 			break;
 		case EV_PLIST_ADD:
-			if (options_get_bool("SyncPlaylist"))
+			if (options_handle_bool (&opt_sync_playlist))
 				event_plist_add ((struct plist_item *)data);
 			break;
 		case EV_PLIST_CLEAR:
-			if (options_get_bool("SyncPlaylist"))
+			if (options_handle_bool (&opt_sync_playlist))
 				clear_playlist ();
 			break;
 		case EV_PLIST_DEL:
-			if (options_get_bool("SyncPlaylist"))
+			if (options_handle_bool (&opt_sync_playlist))
 				event_plist_del ((char *)data);
 			break;
 		case EV_PLIST_MOVE:
-			if (options_get_bool("SyncPlaylist"))
+			if (options_handle_bool (&opt_sync_playlist))
 				event_plist_move ((struct move_ev_data *)data);
 			break;
 		case EV_TAGS:
@@ -1230,6 +1396,8 @@ static void fill_tags (struct plist *plist, const int tags_sel,
 
 	iface_set_status ("Reading tags...");
 	files = ask_for_tags (plist, tags_sel);
+	if (!no_iface)
+		boost_visible_tags_requests ();
 
 	/* Process events until we have all tags. */
 	while (files && !user_wants_interrupt()) {
@@ -1246,10 +1414,8 @@ static void fill_tags (struct plist *plist, const int tags_sel,
 			event_pop (&events);
 
 		}
-		else {
-			type = get_int_from_srv ();
-			data = get_event_data (type);
-		}
+		else
+			type = get_event_from_srv (&data);
 
 		if (type == EV_FILE_TAGS) {
 			struct tag_ev_response *ev
@@ -1274,6 +1440,15 @@ static void fill_tags (struct plist *plist, const int tags_sel,
 	iface_set_status ("");
 }
 
+/* Show how many files have been read so far in a slow directory. */
+static void dir_read_progress (int count)
+{
+	char msg[50];
+
+	snprintf (msg, sizeof (msg), "Reading directory... %d files", count);
+	iface_set_status (msg);
+}
+
 /* Load the directory content into dir_plist and switch the menu to it.
  * If dir is NULL, go to the cwd.  If reload is not zero, we are reloading
  * the current directory, so use iface_update_dir_content().
@@ -1300,7 +1475,8 @@ static int go_to_dir (const char *dir, const int reload)
 	dirs = lists_strs_new (FILES_LIST_INIT_SIZE);
 	playlists = lists_strs_new (FILES_LIST_INIT_SIZE);
 
-	if (!read_directory(new_dir, dirs, playlists, dir_plist)) {
+	if (!read_directory(new_dir, dirs, playlists, dir_plist,
+				dir_read_progress)) {
 		iface_set_status ("");
 		plist_free (dir_plist);
 		lists_strs_free (dirs);
@@ -1329,8 +1505,8 @@ static int go_to_dir (const char *dir, const int reload)
 	switch_titles_file (dir_plist);
 
 	plist_sort_fname (dir_plist);
-	lists_strs_sort (dirs, sort_dirs_func);
-	lists_strs_sort (playlists, sort_strcmp_func);
+	lists_strs_collate (dirs, sort_natural ());
+	lists_strs_collate (playlists, sort_natural ());
 
 	ask_for_tags (dir_plist, get_tags_setting());
 
@@ -1340,7 +1516,7 @@ static int go_to_dir (const char *dir, const int reload)
 		iface_set_dir_content (IFACE_MENU_DIR, dir_plist, dirs, playlists);
 #ifdef HAVE_SYS_INOTIFY_H
 		if (inotify_fd >=0) {
-			inotify_wd = inotify_add_watch(inotify_fd, new_dir, IN_MODIFY | IN_CREATE | IN_DELETE);
+			inotify_wd = inotify_add_watch(inotify_fd, new_dir, DIR_EVENTS);
 			debug("TG: adding watch for dir %s: %s", new_dir, (inotify_wd == -1) ? xstrerror (errno) : "OK");
 		}
 #endif
@@ -1359,6 +1535,16 @@ static int go_to_dir (const char *dir, const int reload)
 	return 1;
 }
 
+/* Tell the server the serial number of our playlist, which is the clients'
+ * playlist other clients get from it. */
+static void send_plist_serial ()
+{
+	if (options_handle_bool (&opt_sync_playlist)) {
+		send_int_to_srv (CMD_CLI_PLIST_SERIAL);
+		send_int_to_srv (plist_get_serial (playlist));
+	}
+}
+
 /* Make sure that the server's playlist has different serial from ours. */
 static void change_srv_plist_serial ()
 {
@@ -1392,6 +1578,69 @@ static void toggle_menu ()
 		error ("The playlist is empty.");
 }
 
+/* Load the playlist saved in .moc directory, from its snapshot if the
+ * snapshot is up to date.  Return the number of items. */
+static int load_moc_playlist ()
+{
+	char *plist_file = xstrdup (create_file_name (PLAYLIST_FILE));
+	int num;
+
+	num = plist_load_snapshot (playlist, create_file_name (PLAYLIST_SNAPSHOT),
+			plist_file, NULL);
+	if (num >= 0) {
+		logit ("Playlist loaded from the snapshot");
+		snapshot_check = 0;
+	}
+	else
+		num = plist_load (playlist, plist_file, cwd, 1);
+
+	free (plist_file);
+	return num;
+}
+
+/* Check the next batch of the playlist items loaded from the snapshot
+ * against their files and ask for the tags of the changed ones again.
+ * Return true if there are items left to check. */
+static bool check_snapshot_items ()
+{
+	lists_t_strs *changed;
+	int tags_sel = get_tags_setting ();
+	int end;
+
+	if (snapshot_check == -1)
+		return false;
+
+	end = MIN(snapshot_check + SNAPSHOT_CHECK_BATCH, playlist->num);
+	changed = lists_strs_new (SNAPSHOT_CHECK_BATCH);
+
+	for (; snapshot_check < end; snapshot_check++) {
+		struct plist_item *item = &playlist->items[snapshot_check];
+		time_t mtime;
+
+		if (item->deleted || item->type != F_SOUND
+				|| item->mtime == (time_t)-1)
+			continue;
+
+		mtime = get_mtime (item->file);
+		if (mtime != item->mtime) {
+			item->mtime = mtime;
+			if (mtime != (time_t)-1)
+				lists_strs_append (changed, item->file);
+		}
+	}
+
+	if (tags_sel && !lists_strs_empty (changed))
+		send_files_tags_request (changed, tags_sel);
+	lists_strs_free (changed);
+
+	if (snapshot_check >= playlist->num) {
+		snapshot_check = -1;
+		return false;
+	}
+
+	return true;
+}
+
 /* Load the playlist file and switch the menu to it. Return 1 on success. */
 static int go_to_playlist (const char *file, const int load_serial,
                            bool default_playlist)
@@ -1405,9 +1654,10 @@ static int go_to_playlist (const char *file, const int load_serial,
 	plist_clear (playlist);
 
 	iface_set_status ("Loading playlist...");
-	if (plist_load(playlist, file, cwd, load_serial)) {
+	if (default_playlist ? load_moc_playlist ()
+	                     : plist_load (playlist, file, cwd, load_serial)) {
 
-		if (options_get_bool("SyncPlaylist")) {
+		if (options_handle_bool (&opt_sync_playlist)) {
 			send_int_to_srv (CMD_LOCK);
 			if (!load_serial)
 				change_srv_plist_serial ();
@@ -1485,7 +1735,7 @@ static int get_server_playlist (struct plist *plist)
 	debug ("Getting the playlist...");
 	if (recv_server_plist(plist)) {
 		ask_for_tags (plist, get_tags_setting());
-		if (options_get_bool ("ReadTags"))
+		if (options_handle_bool (&opt_read_tags))
 			switch_titles_tags (plist);
 		else
 			switch_titles_file (plist);
@@ -1498,11 +1748,47 @@ static int get_server_playlist (struct plist *plist)
 	return 0;
 }
 
-/* Get the playlist from another client and use it as our playlist.
- * Return 0 if there is no client with a playlist. */
+/* Load the playlist from the snapshot if it was in sync with the server's
+ * playlist and get only the changes made to it since then.  Return 0 if
+ * there is no such snapshot or the server doesn't have the changes. */
+static int get_playlist_changes ()
+{
+	char *plist_file = xstrdup (create_file_name (PLAYLIST_FILE));
+	struct plist_sync sync;
+	int num;
+
+	num = plist_load_snapshot (playlist, create_file_name (PLAYLIST_SNAPSHOT),
+			plist_file, &sync);
+	free (plist_file);
+
+	if (num < 0)
+		return 0;
+
+	if (sync.version != -1) {
+		send_int_to_srv (CMD_GET_PLIST_CHANGES);
+		send_int_to_srv (sync.serial);
+		send_int_to_srv (sync.version);
+
+		if (get_data_int ()) {
+			logit ("Playlist loaded from the snapshot, "
+			       "getting the changes");
+			event_queue_drop (&events, is_plist_event);
+			plist_sync = sync;
+			snapshot_check = 0;
+			return 1;
+		}
+	}
+
+	plist_clear (playlist);
+
+	return 0;
+}
+
+/* Get the playlist from the server or another client and use it as our
+ * playlist.  Return 0 if there is no client with a playlist. */
 static int use_server_playlist ()
 {
-	if (get_server_playlist(playlist)) {
+	if (get_playlist_changes () || get_server_playlist(playlist)) {
 		iface_set_dir_content (IFACE_MENU_PLIST, playlist, NULL, NULL);
 		iface_update_queue_positions (queue, playlist, NULL, NULL);
 		return 1;
@@ -1627,7 +1913,7 @@ static void process_args (lists_t_strs *args)
 	else
 		process_multiple_args (args);
 
-	if (plist_count (playlist) && !options_get_bool ("SyncPlaylist")) {
+	if (plist_count (playlist) && !options_handle_bool (&opt_sync_playlist)) {
 		switch_titles_file (playlist);
 		ask_for_tags (playlist, get_tags_setting ());
 		iface_set_dir_content (IFACE_MENU_PLIST, playlist, NULL, NULL);
@@ -1746,7 +2032,7 @@ static void play_it (const char *file)
 	send_int_to_srv (CMD_LOCK);
 
 	if (plist_get_serial(curr_plist) == -1 || get_server_plist_serial()
-			!= plist_get_serial(curr_plist) || !options_get_bool("SyncPlaylist")) {
+			!= plist_get_serial(curr_plist) || !options_handle_bool (&opt_sync_playlist)) {
 		int serial;
 
 		logit ("The server has different playlist");
@@ -1755,6 +2041,8 @@ static void play_it (const char *file)
 		plist_set_serial (curr_plist, serial);
 		send_int_to_srv (CMD_PLIST_SET_SERIAL);
 		send_int_to_srv (serial);
+		if (curr_plist == playlist)
+			send_plist_serial ();
 
 		send_playlist (curr_plist, 1);
 	}
@@ -1864,7 +2152,7 @@ static void add_dir_plist ()
 	if (get_server_plist_serial() == plist_get_serial(playlist))
 		send_playlist (&plist, 0);
 
-	if (options_get_bool("SyncPlaylist")) {
+	if (options_handle_bool (&opt_sync_playlist)) {
 		iface_set_status ("Notifying clients...");
 		send_items_to_clients (&plist);
 		iface_set_status ("");
@@ -1897,7 +2185,7 @@ static void remove_file_from_playlist (const char *file)
 	assert (file != NULL);
 	assert (plist_count(playlist) > 0);
 
-	if (options_get_bool("SyncPlaylist")) {
+	if (options_handle_bool (&opt_sync_playlist)) {
 		send_int_to_srv (CMD_CLI_PLIST_DEL);
 		send_str_to_srv (file);
 	}
@@ -1921,9 +2209,11 @@ static void remove_file_from_playlist (const char *file)
 	}
 }
 
-/* Remove all dead entries (point to non-existent or unreadable). */
+/* Remove all dead entries (point to non-existent or unreadable).  The
+ * menu is updated once at the end, not for every entry. */
 static void remove_dead_entries_plist ()
 {
+	lists_t_strs *dead;
 	const char *file = NULL;
 	int i;
 
@@ -1932,13 +2222,86 @@ static void remove_dead_entries_plist ()
 		return;
 	}
 
-	send_int_to_srv (CMD_LOCK);
+	dead = lists_strs_new (64);
 	for (i = 0, file = plist_get_next_dead_entry(playlist, &i);
 	     file != NULL;
-	     file = plist_get_next_dead_entry(playlist, &i)) {
-		remove_file_from_playlist (file);
+	     file = plist_get_next_dead_entry(playlist, &i))
+		lists_strs_append (dead, file);
+
+	if (lists_strs_empty (dead)) {
+		lists_strs_free (dead);
+		return;
+	}
+
+	send_int_to_srv (CMD_LOCK);
+	for (i = 0; i < lists_strs_size (dead); i++) {
+		file = lists_strs_at (dead, i);
+
+		if (options_handle_bool (&opt_sync_playlist)) {
+			send_int_to_srv (CMD_CLI_PLIST_DEL);
+			send_str_to_srv (file);
+		}
+		else
+			plist_delete (playlist, plist_find_fname (playlist, file));
+
+		if (get_server_plist_serial() == plist_get_serial(playlist)) {
+			send_int_to_srv (CMD_DELETE);
+			send_str_to_srv (file);
+		}
 	}
 	send_int_to_srv (CMD_UNLOCK);
+
+	if (!options_handle_bool (&opt_sync_playlist)) {
+		if (plist_count(playlist) == 0)
+			clear_playlist ();
+		else {
+			iface_update_dir_content (IFACE_MENU_PLIST, playlist,
+					NULL, NULL);
+			iface_update_queue_positions (queue, playlist, NULL, NULL);
+		}
+	}
+
+	lists_strs_free (dead);
+}
+
+/* Sort the playlist by artist, album, track and title. */
+static void sort_plist_tags ()
+{
+	if (!iface_in_plist_menu()) {
+		error ("Can't sort when not in the playlist.");
+		return;
+	}
+
+	if (plist_count (playlist) == 0)
+		return;
+
+	fill_tags (playlist, TAGS_COMMENTS, 0);
+	if (user_wants_interrupt ()) {
+		iface_set_status ("Sorting aborted");
+		return;
+	}
+
+	iface_set_status ("Sorting the playlist...");
+	plist_sort (playlist, PLIST_SORT_TAGS);
+
+	if (options_handle_bool (&opt_sync_playlist)) {
+		send_int_to_srv (CMD_LOCK);
+		change_srv_plist_serial ();
+		send_int_to_srv (CMD_CLI_PLIST_CLEAR);
+		iface_set_status ("Notifying clients...");
+		send_items_to_clients (playlist);
+		waiting_for_plist_load = 1;
+		send_int_to_srv (CMD_UNLOCK);
+
+		/* The sorted playlist comes back from the server. */
+		plist_clear (playlist);
+	}
+	else {
+		iface_set_dir_content (IFACE_MENU_PLIST, playlist, NULL, NULL);
+		iface_update_queue_positions (queue, playlist, NULL, NULL);
+	}
+
+	iface_set_status ("");
 }
 
 /* Add the currently selected file to the playlist. */
@@ -1973,7 +2336,7 @@ static void add_file_plist ()
 
 		send_int_to_srv (CMD_LOCK);
 
-		if (options_get_bool("SyncPlaylist")) {
+		if (options_handle_bool (&opt_sync_playlist)) {
 			send_int_to_srv (CMD_CLI_PLIST_ADD);
 			send_item_to_srv (item);
 		}
@@ -2049,11 +2412,11 @@ static void toggle_option (const char *name)
 
 static void toggle_show_time ()
 {
-	if (!strcasecmp (options_get_symb ("ShowTime"), "yes")) {
+	if (!strcasecmp (options_handle_symb (&opt_show_time), "yes")) {
 		options_set_symb ("ShowTime", "IfAvailable");
 		iface_set_status ("ShowTime: IfAvailable");
 	}
-	else if (!strcasecmp (options_get_symb ("ShowTime"), "no")) {
+	else if (!strcasecmp (options_handle_symb (&opt_show_time), "no")) {
 		options_set_symb ("ShowTime", "yes");
 		iface_update_show_time ();
 		ask_for_tags (dir_plist, TAGS_TIME);
@@ -2088,11 +2451,40 @@ static void reread_dir ()
 		go_dir_up();
 }
 
+#ifdef HAVE_SYS_INOTIFY_H
+/* Read all pending events of the current directory's watch.  Return true
+ * if entries were added or removed, so the directory must be read again
+ * (once for all of them). */
+static bool read_dir_events ()
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t len;
+
+	while ((len = read (inotify_fd, buf, sizeof(buf))) > 0) {
+		char *p;
+
+		for (p = buf; p < buf + len; ) {
+			const struct inotify_event *ev
+				= (const struct inotify_event *)p;
+
+			/* There can be events of the previous directory. */
+			if (ev->wd == inotify_wd && (ev->mask & DIR_EVENTS))
+				changed = true;
+			p += sizeof (struct inotify_event) + ev->len;
+		}
+	}
+
+	return changed;
+}
+#endif
+
 static void set_rating (int r)
 {
 	assert (r >= 0 && r <= 5);
 
-	if (!options_get_bool("RatingShow")) return;
+	if (!options_handle_bool (&opt_rating_show)) return;
 
 	if (iface_curritem_get_type () != F_SOUND) return;
 	char *file = iface_get_curr_file ();
@@ -2108,7 +2500,7 @@ static void set_rating (int r)
 /* Clear the playlist on user request. */
 static void cmd_clear_playlist ()
 {
-	if (options_get_bool("SyncPlaylist")) {
+	if (options_handle_bool (&opt_sync_playlist)) {
 		send_int_to_srv (CMD_LOCK);
 		send_int_to_srv (CMD_CLI_PLIST_CLEAR);
 		change_srv_plist_serial ();
@@ -2321,7 +2713,7 @@ static void add_url_to_plist (const char *url)
 	if (plist_find_fname(playlist, url) == -1) {
 		send_int_to_srv (CMD_LOCK);
 
-		if (options_get_bool("SyncPlaylist")) {
+		if (options_handle_bool (&opt_sync_playlist)) {
 			struct plist_item *item = plist_new_item ();
 
 			item->file = xstrdup (url);
@@ -2410,8 +2802,11 @@ static void entry_key_search (const struct iface_key *k)
 		iface_entry_handle_key (k);
 }
 
-static void save_playlist (const char *file, const int save_serial)
+/* Save the playlist to the file.  Return 0 on error. */
+static int save_playlist (const char *file, const int save_serial)
 {
+	int res;
+
 	iface_set_status ("Saving the playlist...");
 	if (options_get_bool ("SavePlaylistTags")) {
 		fill_tags (playlist, TAGS_COMMENTS | TAGS_TIME, 0);
@@ -2419,9 +2814,12 @@ static void save_playlist (const char *file, const int save_serial)
 			iface_set_status ("Reading tags aborted");
 	}
 
-	if (plist_save (playlist, file, save_serial, (options_get_bool ("SavePlaylistTags") && !user_wants_interrupt())))
+	res = plist_save (playlist, file, save_serial, (options_get_bool ("SavePlaylistTags") && !user_wants_interrupt()));
+	if (res)
 		interface_message ("Playlist saved");
 	iface_set_status ("");
+
+	return res;
 }
 
 static void entry_key_plist_save (const struct iface_key *k)
@@ -2546,7 +2944,7 @@ static void update_iface_menu (const enum iface_menu menu,
 /* Switch ReadTags options and update the menu. */
 static void switch_read_tags ()
 {
-	if (options_get_bool ("ReadTags")) {
+	if (options_handle_bool (&opt_read_tags)) {
 		options_set_bool ("ReadTags", false);
 		switch_titles_file (dir_plist);
 		switch_titles_file (playlist);
@@ -2703,7 +3101,7 @@ static void move_item (const int direction)
 
 	send_int_to_srv (CMD_LOCK);
 
-	if (options_get_bool("SyncPlaylist")) {
+	if (options_handle_bool (&opt_sync_playlist)) {
 		send_int_to_srv (CMD_CLI_PLIST_MOVE);
 		send_str_to_srv (file);
 		send_str_to_srv (second_file);
@@ -2754,6 +3152,7 @@ static void cmd_next ()
 			plist_set_serial (playlist, serial);
 			send_int_to_srv (CMD_PLIST_SET_SERIAL);
 			send_int_to_srv (plist_get_serial(playlist));
+			send_plist_serial ();
 
 			send_int_to_srv (CMD_UNLOCK);
 		}
@@ -2926,8 +3325,8 @@ static void make_sure_tags_exist (const char *file)
 		send_tags_request (file, TAGS_COMMENTS | TAGS_TIME);
 
 		while (!got_it) {
-			int type = get_int_from_srv ();
-			void *data = get_event_data (type);
+			void *data;
+			int type = get_event_from_srv (&data);
 
 			if (type == EV_FILE_TAGS) {
 				struct tag_ev_response *ev
@@ -3293,6 +3692,9 @@ static void menu_key (const struct iface_key *k)
 			case KEY_CMD_PLIST_REMOVE_DEAD_ENTRIES:
 				remove_dead_entries_plist ();
 				break;
+			case KEY_CMD_PLIST_SORT_TAGS:
+				sort_plist_tags ();
+				break;
 			case KEY_CMD_MIXER_DEC_1:
 				adjust_mixer (-1);
 				break;
@@ -3562,17 +3964,36 @@ static void menu_key (const struct iface_key *k)
 	}
 }
 
-/* Get event from the server and handle it. */
+/* Handle EV_FILE_TAGS events unpacked from EV_FILES_TAGS. */
+static void dequeue_batched_tags ()
+{
+	struct event *e;
+
+	while ((e = event_get_first(&batched_tags))) {
+		server_event (e->type, e->data);
+		event_pop (&batched_tags);
+	}
+}
+
+/* Get events from the server and handle them.  All events already
+ * received are handled, they don't make the socket readable. */
 static void get_and_handle_event ()
 {
 	int type;
 
-	if (!get_int_from_srv_noblock(&type)) {
-		debug ("Getting event would block.");
-		return;
-	}
+	do {
+		if (!get_int_from_srv_noblock(&type)) {
+			debug ("Getting event would block.");
+			return;
+		}
 
-	server_event (type, get_event_data(type));
+		if (type == EV_FILES_TAGS)
+			recv_files_tags_from_srv (&batched_tags);
+		else
+			server_event (type, get_event_data(type));
+
+		dequeue_batched_tags ();
+	} while (want_quit == NO_QUIT && recv_buf_pending(srv_sock));
 }
 
 /* Handle events from the queue. */
@@ -3582,6 +4003,8 @@ static void dequeue_events ()
 
 	debug ("Dequeuing events...");
 
+	dequeue_batched_tags ();
+
 	while ((e = event_get_first(&events))) {
 		server_event (e->type, e->data);
 		event_pop (&events);
@@ -3601,6 +4024,7 @@ void init_interface (const int sock, const int logging, lists_t_strs *args)
 {
 	FILE *logfp;
 
+	startup_begin ("init_interface");
 	logit ("Starting MOC Interface");
 
 	logfp = NULL;
@@ -3621,13 +4045,20 @@ void init_interface (const int sock, const int logging, lists_t_strs *args)
 	file_info_block_init (&curr_file);
 	init_playlists ();
 	event_queue_init (&events);
+	event_queue_init (&batched_tags);
+	startup_begin ("keys_init");
 	keys_init ();
+	startup_end ();
+	startup_begin ("windows_init");
 	windows_init ();
+	startup_end ();
+	startup_begin ("get_server_options");
 	get_server_options ();
+	startup_end ();
 	update_mixer_name ();
 
 #ifdef HAVE_SYS_INOTIFY_H
-	inotify_fd = inotify_init();
+	inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
 	debug("TG: initialization of inotify: %s", (inotify_fd == -1) ? xstrerror (errno) : "OK");
 //	debug("TG: values of fds: serv %d, inotify %d",srv_sock,inotify_fd);
 #endif
@@ -3645,11 +4076,11 @@ void init_interface (const int sock, const int logging, lists_t_strs *args)
 		process_args (args);
 
 		if (plist_count(playlist) == 0) {
-			if (!options_get_bool("SyncPlaylist") || !use_server_playlist())
+			if (!options_handle_bool (&opt_sync_playlist) || !use_server_playlist())
 				load_playlist ();
 			send_int_to_srv (CMD_SEND_PLIST_EVENTS);
 		}
-		else if (options_get_bool("SyncPlaylist")) {
+		else if (options_handle_bool (&opt_sync_playlist)) {
 			struct plist tmp_plist;
 
 			/* We have made the playlist from command line. */
@@ -3685,7 +4116,7 @@ void init_interface (const int sock, const int logging, lists_t_strs *args)
 	}
 	else {
 		send_int_to_srv (CMD_SEND_PLIST_EVENTS);
-		if (!options_get_bool("SyncPlaylist") || !use_server_playlist())
+		if (!options_handle_bool (&opt_sync_playlist) || !use_server_playlist())
 			load_playlist ();
 		enter_first_dir ();
 	}
@@ -3693,8 +4124,10 @@ void init_interface (const int sock, const int logging, lists_t_strs *args)
 	/* Ask the server for queue. */
 	use_server_queue ();
 
-	if (options_get_bool("SyncPlaylist"))
+	if (options_handle_bool (&opt_sync_playlist)) {
 		send_int_to_srv (CMD_CAN_SEND_PLIST);
+		send_plist_serial ();
+	}
 
 	update_state ();
 
@@ -3702,6 +4135,9 @@ void init_interface (const int sock, const int logging, lists_t_strs *args)
 			&& curr_file.file
 			&& plist_find_fname(playlist, curr_file.file) != -1)
 		iface_switch_to_plist ();
+
+	startup_end ();
+	startup_profile ("startup_client");
 }
 
 void interface_loop ()
@@ -3710,7 +4146,7 @@ void interface_loop ()
 
 	while (want_quit == NO_QUIT) {
 		fd_set fds;
-		int ret;
+		int ret, screen_delay;
 		struct timespec timeout = { 1, 0 };
 
 		FD_ZERO (&fds);
@@ -3722,7 +4158,28 @@ void interface_loop ()
 
 #endif
 
+		if (recv_buf_pending(srv_sock))
+			get_and_handle_event ();
 		dequeue_events ();
+		boost_visible_tags_requests ();
+
+		/* Don't wait while there are snapshot items to check. */
+		if (check_snapshot_items ())
+			timeout.tv_sec = 0;
+
+		/* Show the lyrics soon after they're loaded. */
+		if (lyrics_loading () && timeout.tv_sec > 0) {
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = LYRICS_POLL_MS * 1000000L;
+		}
+
+		/* Wake up to show the changes held back by the frame rate
+		 * limit. */
+		screen_delay = iface_flush ();
+		if (screen_delay > 0 && timeout.tv_sec > 0) {
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = screen_delay * 1000000L;
+		}
 #ifdef HAVE_SYS_INOTIFY_H
 		ret = pselect (MAX(srv_sock,inotify_fd) + 1, &fds, NULL, NULL, &timeout, NULL);
 #else
@@ -3756,11 +4213,9 @@ void interface_loop ()
 					get_and_handle_event ();
 				do_silent_seek ();
 #ifdef HAVE_SYS_INOTIFY_H
-				if (FD_ISSET(inotify_fd, &fds)) {
-//					char buffer[1024];
+				if (inotify_fd >= 0 && FD_ISSET(inotify_fd, &fds)
+						&& read_dir_events ()) {
 					debug("TG: inotify event, refreshing");
-					ret = read(inotify_fd, NULL, 100 * sizeof (struct inotify_event)); // only needed to empty the event queue
-//					lseek(inotify_fd,0,SEEK_END);
 					reread_dir();
 				}
 #endif
@@ -3792,16 +4247,33 @@ static void save_curr_dir ()
 	fclose (dir_file);
 }
 
-/* Save the playlist in .moc directory or remove the old playist if the
- * playlist is empty. */
+/* Start saving the playlist and its snapshot in .moc directory or remove
+ * the old playist if the playlist is empty.  They are written while the
+ * client goes on exiting. */
 static void save_playlist_in_moc ()
 {
-	char *plist_file = create_file_name (PLAYLIST_FILE);
+	char *plist_file = xstrdup (create_file_name (PLAYLIST_FILE));
 
-	if (plist_count(playlist) && options_get_bool("SavePlaylist"))
-		save_playlist (plist_file, 1);
-	else
+	if (plist_count(playlist) && options_get_bool("SavePlaylist")) {
+		bool save_tags = options_get_bool ("SavePlaylistTags");
+
+		if (save_tags) {
+			iface_set_status ("Saving the playlist...");
+			fill_tags (playlist, TAGS_COMMENTS | TAGS_TIME, 0);
+			if (user_wants_interrupt ())
+				save_tags = false;
+		}
+
+		plist_save_start (playlist, plist_file, 1, save_tags,
+		                  create_file_name (PLAYLIST_SNAPSHOT),
+		                  &plist_sync);
+	}
+	else {
 		unlink (plist_file);
+		unlink (create_file_name (PLAYLIST_SNAPSHOT));
+	}
+
+	free (plist_file);
 }
 
 void interface_end ()
@@ -3830,8 +4302,13 @@ void interface_end ()
 	free (dir_plist);
 	free (playlist);
 	free (queue);
+	if (boosted_files)
+		lists_strs_free (boosted_files);
 
 	event_queue_free (&events);
+	event_queue_free (&batched_tags);
+
+	plist_save_wait ();
 
 	logit ("Interface exited");
 
@@ -3865,7 +4342,7 @@ void interface_cmdline_clear_plist (int server_sock)
 
 	plist_init (&plist);
 
-	if (options_get_bool("SyncPlaylist"))
+	if (options_handle_bool (&opt_sync_playlist))
 		send_int_to_srv (CMD_CLI_PLIST_CLEAR);
 
 	if (recv_server_plist(&plist) && plist_get_serial(&plist)
@@ -3880,6 +4357,7 @@ void interface_cmdline_clear_plist (int server_sock)
 	}
 
 	unlink (create_file_name (PLAYLIST_FILE));
+	unlink (create_file_name (PLAYLIST_SNAPSHOT));
 
 	plist_free (&plist);
 }
@@ -3929,7 +4407,7 @@ void interface_cmdline_append (int server_sock, lists_t_strs *args)
 	srv_sock = server_sock; /* the interface is not initialized, so set it
 				   here */
 
-	if (options_get_bool("SyncPlaylist")) {
+	if (options_handle_bool (&opt_sync_playlist)) {
 		struct plist clients_plist;
 		struct plist new;
 
@@ -3977,6 +4455,7 @@ void interface_cmdline_append (int server_sock, lists_t_strs *args)
 			send_int_to_srv (CMD_UNLOCK);
 
 			plist_cat (&saved_plist, &new);
+			unlink (create_file_name (PLAYLIST_SNAPSHOT));
 			if (options_get_bool("SavePlaylist")) {
 				if (options_get_bool("SavePlaylistTags"))
 					fill_tags (&saved_plist, TAGS_COMMENTS | TAGS_TIME, 1);
@@ -4043,8 +4522,8 @@ static struct file_tags *get_tags_no_iface (const char *file,
 	send_tags_request (file, tags_sel);
 
 	while (!tags) {
-		int type = get_int_from_srv ();
-		void *data = get_event_data (type);
+		void *data;
+		int type = get_event_from_srv (&data);
 
 		if (type == EV_FILE_TAGS) {
 			struct tag_ev_response *ev
@@ -4066,7 +4545,44 @@ static struct file_tags *get_tags_no_iface (const char *file,
 	return tags;
 }
 
-void interface_cmdline_file_info (const int server_sock)
+/* Take the state and the sound parameters from the status page. */
+static void file_info_from_status (struct file_info *f,
+		const struct status_info *status)
+{
+	f->state = status->state;
+	f->curr_time = status->curr_time;
+	f->bitrate = status->bitrate;
+	f->avg_bitrate = status->avg_bitrate;
+	f->rate = status->rate;
+	f->channels = status->channels;
+}
+
+/* Make tags of the current file from the status page. */
+static struct file_tags *tags_from_status (const struct status_info *status)
+{
+	struct file_tags *tags = tags_new ();
+
+	if (status->title[0])
+		tags->title = xstrdup (status->title);
+	if (status->artist[0])
+		tags->artist = xstrdup (status->artist);
+	if (status->album[0])
+		tags->album = xstrdup (status->album);
+	tags->track = status->track;
+	tags->filled = TAGS_COMMENTS;
+
+	if (status->total_time != -1) {
+		tags->time = status->total_time;
+		tags->filled |= TAGS_TIME;
+	}
+
+	return tags;
+}
+
+/* Print information about the current file.  If status is not NULL, it's
+ * taken from there without asking the server. */
+void interface_cmdline_file_info (const int server_sock,
+		const struct status_info *status)
 {
 	srv_sock = server_sock;	/* the interface is not initialized, so set it
 				   here */
@@ -4074,7 +4590,10 @@ void interface_cmdline_file_info (const int server_sock)
 	file_info_reset (&curr_file);
 	file_info_block_init (&curr_file);
 
-	curr_file.state = get_state ();
+	if (status)
+		file_info_from_status (&curr_file, status);
+	else
+		curr_file.state = get_state ();
 
 	if (curr_file.state == STATE_STOP)
 		puts ("State: STOP");
@@ -4090,12 +4609,15 @@ void interface_cmdline_file_info (const int server_sock)
 		else if (curr_file.state == STATE_PAUSE)
 			puts ("State: PAUSE");
 
-		curr_file.file = get_curr_file ();
+		curr_file.file = status ? xstrdup (status->file)
+			: get_curr_file ();
 
 		if (curr_file.file[0]) {
 
 			/* get tags */
-			if (file_type(curr_file.file) == F_URL) {
+			if (status)
+				curr_file.tags = tags_from_status (status);
+			else if (file_type(curr_file.file) == F_URL) {
 				send_int_to_srv (CMD_GET_TAGS);
 				curr_file.tags = get_data_tags ();
 			}
@@ -4113,11 +4635,13 @@ void interface_cmdline_file_info (const int server_sock)
 		else
 			title = xstrdup ("");
 
-		curr_file.channels = get_channels ();
-		curr_file.rate = get_rate ();
-		curr_file.bitrate = get_bitrate ();
-		curr_file.curr_time = get_curr_time ();
-		curr_file.avg_bitrate = get_avg_bitrate ();
+		if (!status) {
+			curr_file.channels = get_channels ();
+			curr_file.rate = get_rate ();
+			curr_file.bitrate = get_bitrate ();
+			curr_file.curr_time = get_curr_time ();
+			curr_file.avg_bitrate = get_avg_bitrate ();
+		}
 
 		if (curr_file.tags->time != -1)
 			sec_to_min (time_str, curr_file.tags->time);
@@ -4176,6 +4700,101 @@ void interface_cmdline_file_info (const int server_sock)
 	plist_free (queue);
 }
 
+/* Print the state published by the server in the status page. */
+void interface_cmdline_status (const struct status_info *status)
+{
+	const char *state;
+
+	switch (status->state) {
+		case STATE_PLAY:
+			state = "PLAY";
+			break;
+		case STATE_PAUSE:
+			state = "PAUSE";
+			break;
+		default:
+			state = "STOP";
+	}
+
+	printf ("State: %s\n", state);
+	printf ("File: %s\n", status->file);
+	printf ("Artist: %s\n", status->artist);
+	printf ("SongTitle: %s\n", status->title);
+	printf ("Album: %s\n", status->album);
+	printf ("Track: %d\n", status->track);
+	printf ("TotalSec: %d\n", status->total_time);
+	printf ("CurrentSec: %d\n", status->curr_time);
+	printf ("Bitrate: %dkbps\n", MAX(status->bitrate, 0));
+	printf ("AvgBitrate: %dkbps\n", MAX(status->avg_bitrate, 0));
+	printf ("Rate: %dkHz\n", MAX(status->rate, 0));
+	printf ("Channels: %d\n", status->channels);
+	printf ("Volume: %d\n", status->volume);
+}
+
+/* Print the I/O counters of the streams open in the server. */
+void interface_cmdline_io_stats (const int server_sock)
+{
+	char *report;
+
+	srv_sock = server_sock;	/* the interface is not initialized, so set it
+				   here */
+	send_int_to_srv (CMD_GET_IO_STATS);
+	report = get_data_str ();
+	fputs (report, stdout);
+	free (report);
+}
+
+/* Print the counters of the server's sound pipeline. */
+void interface_cmdline_stats (const int server_sock)
+{
+	char *report;
+
+	srv_sock = server_sock;	/* the interface is not initialized, so set it
+				   here */
+	send_int_to_srv (CMD_GET_STATS);
+	report = get_data_str ();
+	fputs (report, stdout);
+	free (report);
+}
+
+void interface_cmdline_output_trace (const int server_sock)
+{
+	char *fname;
+
+	srv_sock = server_sock;	/* the interface is not initialized, so set it
+				   here */
+	send_int_to_srv (CMD_DUMP_OUTPUT_TRACE);
+	fname = get_data_str ();
+	if (fname[0])
+		printf ("Output trace written to %s\n", fname);
+	else
+		fprintf (stderr, "No output trace was written (is OutputStats "
+		                 "set?  See the server's log.)\n");
+	free (fname);
+}
+
+void interface_cmdline_scan (const int server_sock, const char *dir)
+{
+	char *path, *err;
+
+	srv_sock = server_sock;	/* the interface is not initialized, so set it
+				   here */
+
+	if (!getcwd (cwd, sizeof (cwd)))
+		fatal ("Can't get CWD: %s", xstrerror (errno));
+
+	path = absolute_path (dir, cwd);
+	send_int_to_srv (CMD_SCAN);
+	send_str_to_srv (path);
+	err = get_data_str ();
+	if (err[0])
+		fprintf (stderr, "%s: %s\n", path, err);
+	else
+		printf ("Scanning %s in the background\n", path);
+	free (err);
+	free (path);
+}
+
 void interface_cmdline_enqueue (int server_sock, lists_t_strs *args)
 {
 	int ix;
@@ -4362,7 +4981,7 @@ Bitrate     %b
 Rate        %r
 */
 void interface_cmdline_formatted_info (const int server_sock,
-		const char *format_str)
+		const char *format_str, const struct status_info *status)
 {
 	typedef struct {
 		char *state;
@@ -4397,7 +5016,10 @@ void interface_cmdline_formatted_info (const int server_sock,
 	file_info_reset (&curr_file);
 	file_info_block_init (&curr_file);
 
-	curr_file.state = get_state ();
+	if (status)
+		file_info_from_status (&curr_file, status);
+	else
+		curr_file.state = get_state ();
 
 	/* extra paranoid about struct data */
 	memset(&str_info, 0, sizeof(str_info));
@@ -4423,12 +5045,15 @@ void interface_cmdline_formatted_info (const int server_sock,
 		else if (curr_file.state == STATE_PAUSE)
 			str_info.state = "PAUSE";
 
-		curr_file.file = get_curr_file ();
+		curr_file.file = status ? xstrdup (status->file)
+			: get_curr_file ();
 
 		if (curr_file.file[0]) {
 
 			/* get tags */
-			if (file_type(curr_file.file) == F_URL) {
+			if (status)
+				curr_file.tags = tags_from_status (status);
+			else if (file_type(curr_file.file) == F_URL) {
 				send_int_to_srv (CMD_GET_TAGS);
 				curr_file.tags = get_data_tags ();
 			}
@@ -4446,10 +5071,12 @@ void interface_cmdline_formatted_info (const int server_sock,
 		else
 			str_info.title = xstrdup ("");
 
-		curr_file.channels = get_channels ();
-		curr_file.rate = get_rate ();
-		curr_file.bitrate = get_bitrate ();
-		curr_file.curr_time = get_curr_time ();
+		if (!status) {
+			curr_file.channels = get_channels ();
+			curr_file.rate = get_rate ();
+			curr_file.bitrate = get_bitrate ();
+			curr_file.curr_time = get_curr_time ();
+		}
 
 		if (curr_file.tags->time != -1)
 			sec_to_min (time_str, curr_file.tags->time);
@@ -33,6 +33,8 @@ struct file_info {
 	int block_end;
 };
 
+struct status_info;
+
 void init_interface (const int sock, const int logging, lists_t_strs *args);
 void interface_loop ();
 void interface_end ();
@@ -42,7 +44,13 @@ void interface_fatal (const char *format, ...) ATTR_PRINTF(1, 2);
 void interface_cmdline_clear_plist (int server_sock);
 void interface_cmdline_append (int server_sock, lists_t_strs *args);
 void interface_cmdline_play_first (int server_sock);
-void interface_cmdline_file_info (const int server_sock);
+void interface_cmdline_file_info (const int server_sock,
+		const struct status_info *status);
+void interface_cmdline_status (const struct status_info *status);
+void interface_cmdline_io_stats (const int server_sock);
+void interface_cmdline_stats (const int server_sock);
+void interface_cmdline_output_trace (const int server_sock);
+void interface_cmdline_scan (const int server_sock, const char *dir);
 void interface_cmdline_playit (int server_sock, lists_t_strs *args);
 void interface_cmdline_seek_by (int server_sock, const int seek_by);
 void interface_cmdline_set_rating (int server_sock, int rating);
@@ -50,7 +58,8 @@ void interface_cmdline_jump_to_percent (int server_sock, const int percent);
 void interface_cmdline_jump_to (int server_sock, const int pos);
 void interface_cmdline_adj_volume (int server_sock, const char *arg);
 void interface_cmdline_set (int server_sock, char *arg, const int val);
-void interface_cmdline_formatted_info (const int server_sock, const char *format_str);
+void interface_cmdline_formatted_info (const int server_sock,
+		const char *format_str, const struct status_info *status);
 void interface_cmdline_enqueue (int server_sock, lists_t_strs *args);
 
 #ifdef __cplusplus
@@ -44,6 +44,7 @@
 #include "utf8.h"
 #include "rcc.h"
 #include "lyrics.h"
+#include "startup.h"
 
 #ifndef PACKAGE_REVISION
 #define STARTUP_MESSAGE "Welcome to " PACKAGE_NAME \
@@ -263,6 +264,30 @@ static int iface_initialized = 0;
 /* Was initscr() called? */
 static int screen_initialized = 0;
 
+/* The terminal is updated at most once in this many milliseconds. */
+#define SCREEN_UPDATE_MS	40
+
+/* Have the windows changed since the terminal was last updated? */
+static bool screen_dirty = false;
+static struct timespec last_screen_update = { 0, 0 };
+
+/* Options read when drawing or adding each menu item. */
+static options_t_handle opt_read_tags = OPTIONS_HANDLE("ReadTags");
+static options_t_handle opt_rating_show = OPTIONS_HANDLE("RatingShow");
+static options_t_handle opt_show_time = OPTIONS_HANDLE("ShowTime");
+static options_t_handle opt_show_format = OPTIONS_HANDLE("ShowFormat");
+static options_t_handle opt_plist_numbering
+	= OPTIONS_HANDLE("PlaylistNumbering");
+static options_t_handle opt_plist_full_paths
+	= OPTIONS_HANDLE("PlaylistFullPaths");
+static options_t_handle opt_cursor_selection
+	= OPTIONS_HANDLE("UseCursorSelection");
+#ifdef HAVE_RCC
+static options_t_handle opt_rcc_for_fs = OPTIONS_HANDLE("UseRCCForFilesystem");
+#endif
+static options_t_handle opt_file_names_iconv
+	= OPTIONS_HANDLE("FileNamesIconv");
+
 /* Chars used to make lines (for borders etc.). */
 static struct
 {
@@ -781,13 +806,13 @@ static void side_menu_init (struct side_menu *m, const enum side_menu_type type,
 
 		menu_set_items_numbering (m->menu.list.main,
 				type == MENU_PLAYLIST
-				&& options_get_bool("PlaylistNumbering"));
+				&& options_handle_bool (&opt_plist_numbering));
 		menu_set_show_format (m->menu.list.main,
-				options_get_bool("ShowFormat"));
+				options_handle_bool (&opt_show_format));
 		menu_set_show_time (m->menu.list.main,
-				strcasecmp(options_get_symb("ShowTime"), "no"));
+				strcasecmp(options_handle_symb (&opt_show_time), "no"));
 		menu_set_show_rating (m->menu.list.main,
-				options_get_bool("RatingShow"));
+				options_handle_bool (&opt_rating_show));
 		menu_set_info_attr_normal (m->menu.list.main,
 				get_color(CLR_MENU_ITEM_INFO));
 		menu_set_info_attr_sel (m->menu.list.main,
@@ -1039,7 +1064,7 @@ static int add_to_menu (struct menu *menu, const struct plist *plist,
 	char *title;
 	const char *type_name;
 
-	made_from_tags = (options_get_bool ("ReadTags") && item->title_tags);
+	made_from_tags = (options_handle_bool (&opt_read_tags) && item->title_tags);
 
 	if (made_from_tags)
 		title = make_menu_title (item->title_tags, 1, 0);
@@ -1083,12 +1108,12 @@ static void side_menu_clear (struct side_menu *m)
 	menu_free (m->menu.list.main);
 	side_menu_init_menu (m);
 	menu_set_items_numbering (m->menu.list.main, m->type == MENU_PLAYLIST
-			&& options_get_bool("PlaylistNumbering"));
+			&& options_handle_bool (&opt_plist_numbering));
 
-	menu_set_show_format (m->menu.list.main, options_get_bool("ShowFormat"));
+	menu_set_show_format (m->menu.list.main, options_handle_bool (&opt_show_format));
 	menu_set_show_time (m->menu.list.main,
-			strcasecmp(options_get_symb("ShowTime"), "no"));
-	menu_set_show_rating (m->menu.list.main, options_get_bool("RatingShow"));
+			strcasecmp(options_handle_symb (&opt_show_time), "no"));
+	menu_set_show_rating (m->menu.list.main, options_handle_bool (&opt_rating_show));
 	menu_set_info_attr_normal (m->menu.list.main, get_color(CLR_MENU_ITEM_INFO));
 	menu_set_info_attr_sel (m->menu.list.main, get_color(CLR_MENU_ITEM_INFO_SELECTED));
 	menu_set_info_attr_marked (m->menu.list.main, get_color(CLR_MENU_ITEM_INFO_MARKED));
@@ -1123,7 +1148,7 @@ static void side_menu_make_list_content (struct side_menu *m,
 
 #ifdef HAVE_RCC
 			char *t_str = NULL;
-			if (options_get_bool("UseRCCForFilesystem")) {
+			if (options_handle_bool (&opt_rcc_for_fs)) {
 				strcpy (title, strrchr (lists_strs_at (dirs, i), '/') + 1);
 				strcat (title, "/");
 				t_str = xstrdup (title);
@@ -1133,7 +1158,7 @@ static void side_menu_make_list_content (struct side_menu *m,
 			}
 			else
 #endif
-			if (options_get_bool ("FileNamesIconv"))
+			if (options_handle_bool (&opt_file_names_iconv))
 			{
 				char *conv_title = files_iconv_str (
 						strrchr (lists_strs_at (dirs, i), '/') + 1);
@@ -1174,7 +1199,7 @@ static void side_menu_make_list_content (struct side_menu *m,
 		if (!plist_deleted(files, i))
 			add_to_menu (m->menu.list.main, files, i,
 					m->type == MENU_PLAYLIST
-					&& options_get_bool("PlaylistFullPaths"));
+					&& options_handle_bool (&opt_plist_full_paths));
 	}
 
 	m->total_time = plist_total_time (files, &m->total_time_for_all);
@@ -1285,7 +1310,7 @@ static void side_menu_draw (const struct side_menu *m, const int active)
 	if (m->type == MENU_DIR || m->type == MENU_PLAYLIST
 			|| m->type == MENU_THEMES) {
 		menu_draw (m->menu.list.main, active);
-		if (options_get_bool("UseCursorSelection"))
+		if (options_handle_bool (&opt_cursor_selection))
 			menu_set_cursor (m->menu.list.main);
 	}
 	else
@@ -1416,7 +1441,7 @@ static void update_menu_item (struct menu_item *mi,
 	if (r > 5) r = 5;
 	menu_item_set_rating (mi, options_rating_strings[r]);
 
-	made_from_tags = (options_get_bool ("ReadTags") && item->title_tags);
+	made_from_tags = (options_handle_bool (&opt_read_tags) && item->title_tags);
 
 	if (made_from_tags)
 		title = make_menu_title (item->title_tags, 1, 0);
@@ -1456,13 +1481,13 @@ static int side_menu_update_item (struct side_menu *m,
 
 	if ((mi = menu_find(m->menu.list.main, file))) {
 		update_menu_item (mi, plist, n, m->type == MENU_PLAYLIST
-				&& options_get_bool("PlaylistFullpaths"));
+				&& options_handle_bool (&opt_plist_full_paths));
 		visible = menu_is_visible (m->menu.list.main, mi);
 	}
 	if (m->menu.list.copy
 			&& (mi = menu_find(m->menu.list.copy, file))) {
 		update_menu_item (mi, plist, n, m->type == MENU_PLAYLIST
-				&& options_get_bool("PlaylistFullpaths"));
+				&& options_handle_bool (&opt_plist_full_paths));
 		visible = visible || menu_is_visible (m->menu.list.main, mi);
 	}
 
@@ -1523,7 +1548,7 @@ static int side_menu_add_plist_item (struct side_menu *m,
 			: m->menu.list.main,
 			plist, num,
 			m->type == MENU_PLAYLIST
-			&& options_get_bool("PlaylistFullPaths"));
+			&& options_handle_bool (&opt_plist_full_paths));
 	m->total_time = plist_total_time (plist, &m->total_time_for_all);
 
 	return visible;
@@ -1552,7 +1577,7 @@ static void side_menu_update_show_time (struct side_menu *m)
 	assert (m->type == MENU_DIR || m->type == MENU_PLAYLIST);
 
 	menu_set_show_time (m->menu.list.main,
-				strcasecmp(options_get_symb("ShowTime"), "no"));
+				strcasecmp(options_handle_symb (&opt_show_time), "no"));
 }
 
 static void side_menu_update_show_format (struct side_menu *m)
@@ -1561,7 +1586,7 @@ static void side_menu_update_show_format (struct side_menu *m)
 	assert (m->visible);
 	assert (m->type == MENU_DIR || m->type == MENU_PLAYLIST);
 
-	menu_set_show_format (m->menu.list.main, options_get_bool("ShowFormat"));
+	menu_set_show_format (m->menu.list.main, options_handle_bool (&opt_show_format));
 }
 
 static void side_menu_get_state (const struct side_menu *m,
@@ -1618,8 +1643,14 @@ static int side_menu_filter (struct side_menu *m, const char *pattern)
 	assert (pattern != NULL);
 	assert (m->menu.list.main != NULL);
 
-	filtered_menu = menu_filter_pattern (m->menu.list.copy
-			? m->menu.list.copy : m->menu.list.main, pattern);
+	/* While typing, the pattern grows and the menu filtered with the
+	 * shorter one can be refined. */
+	if (m->menu.list.copy)
+		filtered_menu = menu_filter_pattern (m->menu.list.copy, pattern,
+				m->menu.list.main);
+	else
+		filtered_menu = menu_filter_pattern (m->menu.list.main, pattern,
+				NULL);
 
 	if (menu_nitems(filtered_menu) == 0) {
 		menu_free (filtered_menu);
@@ -1792,7 +1823,6 @@ static void main_win_draw_lyrics_screen (const struct main_win *w)
 				COLS/2 - (sizeof("...MORE...")-1)/2,
 				"...MORE...");
 	}
-	lists_strs_free (lyrics_array);
 }
 
 static void main_win_draw (struct main_win *w)
@@ -1954,6 +1984,33 @@ static char *main_win_get_curr_file (const struct main_win *w)
 	return side_menu_get_curr_file (&w->menus[w->selected_menu]);
 }
 
+static void main_win_get_visible_files (const struct main_win *w,
+		lists_t_strs *files, const int rows)
+{
+	size_t ix;
+
+	assert (w != NULL);
+
+	if (w->in_help || w->in_lyrics || w->too_small)
+		return;
+
+	for (ix = 0; ix < ARRAY_SIZE(w->menus); ix += 1) {
+		const struct side_menu *m = &w->menus[ix];
+
+		if (m->visible && (m->type == MENU_DIR
+					|| m->type == MENU_PLAYLIST))
+			menu_get_visible_files (m->menu.list.main, files);
+	}
+
+	for (ix = 0; ix < ARRAY_SIZE(w->menus); ix += 1) {
+		const struct side_menu *m = &w->menus[ix];
+
+		if (m->visible && (m->type == MENU_DIR
+					|| m->type == MENU_PLAYLIST))
+			menu_get_nearby_files (m->menu.list.main, files, rows);
+	}
+}
+
 static int main_win_in_dir_menu (const struct main_win *w)
 {
 	assert (w != NULL);
@@ -2186,7 +2243,6 @@ static void main_win_handle_lyrics_key (struct main_win *w,
 		lyrics_array = lyrics_format (height, width);
 		if (w->lyrics_screen_top + LINES - 5 <= lists_strs_size (lyrics_array))
 			w->lyrics_screen_top++;
-		lists_strs_free (lyrics_array);
 	}
 	else {
 		if (k->type == IFACE_KEY_FUNCTION && (k->key.func == KEY_UP
@@ -3148,7 +3204,8 @@ static void info_win_make_entry (struct info_win *w, const enum entry_type type)
 }
 
 /* Display the next queued message. */
-static void info_win_display_msg (struct info_win *w)
+/* Return true if the displayed message has changed. */
+static bool info_win_display_msg (struct info_win *w)
 {
 	int msg_changed;
 
@@ -3203,6 +3260,8 @@ static void info_win_display_msg (struct info_win *w)
 
 	if (msg_changed)
 		info_win_draw_title (w);
+
+	return msg_changed;
 }
 
 /* Force the next queued message to be displayed. */
@@ -3380,9 +3439,9 @@ static void info_win_set_files_time (struct info_win *w, const int time,
 }
 
 /* Update the message timeout, redraw the window if needed. */
-static void info_win_tick (struct info_win *w)
+static bool info_win_tick (struct info_win *w)
 {
-	info_win_display_msg (w);
+	return info_win_display_msg (w);
 }
 
 /* Draw static elements of info_win: frames, legend etc. */
@@ -3462,7 +3521,7 @@ static void info_win_entry_disable (struct info_win *w)
 	entry_destroy (&w->entry);
 	w->in_entry = 0;
 
-	if (!options_get_bool("UseCursorSelection"))
+	if (!options_handle_bool (&opt_cursor_selection))
 		curs_set (0);
 	info_win_draw (w);
 }
@@ -3636,14 +3695,16 @@ void windows_init ()
 	validate_layouts ();
 	cbreak ();
 	noecho ();
-	if (!options_get_bool ("UseCursorSelection"))
+	if (!options_handle_bool (&opt_cursor_selection))
 		curs_set (0);
 	use_default_colors ();
 
 	detect_term ();
 	detect_screen ();
 	start_color ();
+	startup_begin ("theme_init");
 	theme_init (has_xterm);
+	startup_end ();
 	init_lines ();
 
 	main_win_init (&main_win, options_get_list ("Layout1"));
@@ -3696,7 +3757,8 @@ void windows_end ()
 	lyrics_cleanup ();
 }
 
-static void iface_refresh_screen ()
+/* Send the changes of the windows to the terminal now. */
+static void iface_update_screen ()
 {
 	/* We must do it in proper order to get the right cursor position. */
 	if (iface_in_entry ()) {
@@ -3708,6 +3770,41 @@ static void iface_refresh_screen ()
 		wnoutrefresh (main_win.win);
 	}
 	doupdate ();
+
+	screen_dirty = false;
+	get_realtime (&last_screen_update);
+}
+
+/* Note that the windows have changed.  The terminal is updated by
+ * iface_flush() from the main loop, so the changes made while handling
+ * a batch of events or keys go out in one doupdate(). */
+static void iface_refresh_screen ()
+{
+	screen_dirty = true;
+}
+
+/* Update the terminal if the windows have changed and the last update was
+ * at least SCREEN_UPDATE_MS ago.  Return the number of milliseconds to
+ * wait before calling it again to flush the pending changes, 0 if there
+ * are none. */
+int iface_flush ()
+{
+	struct timespec now;
+	long elapsed;
+
+	if (!screen_dirty || !iface_initialized)
+		return 0;
+
+	get_realtime (&now);
+	elapsed = (now.tv_sec - last_screen_update.tv_sec) * 1000L
+		+ (now.tv_nsec - last_screen_update.tv_nsec) / 1000000L;
+
+	if (elapsed >= 0 && elapsed < SCREEN_UPDATE_MS)
+		return SCREEN_UPDATE_MS - elapsed;
+
+	iface_update_screen ();
+
+	return 0;
 }
 
 /* Set state of the options displayed in the information window. */
@@ -3735,7 +3832,10 @@ void iface_set_status (const char *msg)
 
 	if (iface_initialized) {
 		info_win_set_status (&info_win, msg);
-		iface_refresh_screen ();
+
+		/* Status messages report long operations which block the
+		 * main loop, so show them at once. */
+		iface_update_screen ();
 	}
 }
 
@@ -3799,9 +3899,9 @@ void iface_update_attrs ()
 			menu_set_info_attr_marked (menu, get_color (CLR_MENU_ITEM_INFO_MARKED));
 			menu_set_info_attr_sel_marked (menu, get_color (CLR_MENU_ITEM_INFO_MARKED_SELECTED));
 
-			for (mi = menu->items, item_num = 0;
-			     mi && item_num < menu->nitems;
-			     mi = mi->next, item_num += 1) {
+			for (item_num = 0; item_num < menu->nitems;
+			     item_num += 1) {
+				mi = menu->items[item_num];
 				if (mi->type == F_DIR) {
 					menu_item_set_attr_normal (mi, get_color (CLR_MENU_ITEM_DIR));
 					menu_item_set_attr_sel (mi, get_color (CLR_MENU_ITEM_DIR_SELECTED));
@@ -3820,9 +3920,9 @@ void iface_update_attrs ()
 			menu_set_info_attr_normal (menu, get_color (CLR_MENU_ITEM_FILE));
 			menu_set_info_attr_sel (menu, get_color (CLR_MENU_ITEM_FILE_SELECTED));
 
-			for (mi = menu->items, item_num = 0;
-			     mi && item_num < menu->nitems;
-			     mi = mi->next, item_num += 1) {
+			for (item_num = 0; item_num < menu->nitems;
+			     item_num += 1) {
+				mi = menu->items[item_num];
 				menu_item_set_attr_normal (mi, get_color (CLR_MENU_ITEM_FILE));
 				menu_item_set_attr_sel (mi, get_color (CLR_MENU_ITEM_FILE_SELECTED));
 			}
@@ -3833,7 +3933,7 @@ void iface_update_attrs ()
 void iface_update_theme_selection (const char *file)
 {
     /* menus[2] is theme menu. */
-    assert (main_win.menus[2].menu.list.main->selected);
+    assert (main_win.menus[2].menu.list.main->selected != -1);
 
     menu_setcurritem_file (main_win.menus[2].menu.list.main, file);
 }
@@ -3886,7 +3986,7 @@ void iface_set_title (const enum iface_menu menu, const char *title)
 
 	assert (title != NULL);
 
-    if (options_get_bool ("FileNamesIconv"))
+    if (options_handle_bool (&opt_file_names_iconv))
     {
         char *conv_title = NULL;
         conv_title = files_iconv_str (title);
@@ -3983,6 +4083,13 @@ int iface_in_dir_menu ()
 	return main_win_in_dir_menu (&main_win);
 }
 
+/* Append the sound files shown on the screen to the list, then the ones up
+ * to rows items away from the visible part of the menus. */
+void iface_get_visible_files (lists_t_strs *files, const int rows)
+{
+	main_win_get_visible_files (&main_win, files, rows);
+}
+
 /* Return a non zero value if the playlist menu is currently selected. */
 int iface_in_plist_menu ()
 {
@@ -4092,8 +4199,14 @@ void iface_set_played_file_title (const char *title)
  * least once a second. */
 void iface_tick ()
 {
-	info_win_tick (&info_win);
-	iface_refresh_screen ();
+	if (info_win_tick (&info_win))
+		iface_refresh_screen ();
+
+	/* The lyrics loaded in the background are ready. */
+	if (lyrics_poll () && main_win.in_lyrics) {
+		main_win_draw (&main_win);
+		iface_refresh_screen ();
+	}
 }
 
 void iface_set_mixer_value (const int value)
@@ -4172,7 +4285,7 @@ void iface_refresh ()
 	main_win_draw (&main_win);
 	info_win_draw (&info_win);
 
-	iface_refresh_screen ();
+	iface_update_screen ();
 }
 
 void iface_update_show_time ()
@@ -4425,7 +4538,7 @@ void iface_temporary_exit ()
 void iface_restore ()
 {
 	iface_refresh ();
-	if (!options_get_bool("UseCursorSelection"))
+	if (!options_handle_bool (&opt_cursor_selection))
 		curs_set (0);
 }
 
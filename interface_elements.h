@@ -80,6 +80,7 @@ void iface_menu_key (const enum key_cmd cmd);
 enum file_type iface_curritem_get_type ();
 int iface_in_dir_menu ();
 int iface_in_plist_menu ();
+void iface_get_visible_files (lists_t_strs *files, const int rows);
 int iface_in_theme_menu ();
 char *iface_get_curr_file ();
 void iface_update_item (const enum iface_menu menu, const struct plist *plist,
@@ -96,6 +97,7 @@ void iface_set_played_file_title (const char *title);
 void iface_set_mixer_value (const int value);
 void iface_set_files_in_queue (const int num);
 void iface_tick ();
+int iface_flush ();
 void iface_switch_to_plist ();
 void iface_switch_to_dir ();
 void iface_add_to_plist (const struct plist *plist, const int num);
@@ -40,6 +40,7 @@
 #include "io.h"
 #include "options.h"
 #include "files.h"
+#include "thread_sched.h"
 #ifdef HAVE_CURL
 # include "io_curl.h"
 #endif
@@ -50,31 +51,125 @@
 # define CURL_ONLY ATTR_UNUSED
 #endif
 
+/* How much of the file not read yet, and how much of the part already
+ * read, is kept in the page cache when FileReadAhead is used. */
+#define IO_DROP_BEHIND	(1024 * 1024)
+
+/* The most the read thread reads at once into the buffer. */
+#define IO_READ_MAX	(64 * 1024)
+
+/* The least adaptive prebuffering fills the buffer to. */
+#define IO_PREBUFFER_MIN	(16 * 1024)
+
+/* Change a counter of the stream; only the thread it belongs to does. */
+#define STATS_SET(s, field, value) \
+	ATOMIC_STORE (&(s)->stats.field, (value))
+#define STATS_ADD(s, field, n) \
+	STATS_SET (s, field, (s)->stats.field + (n))
+
+/* All the open streams, for io_stats_report(). */
+static struct io_stream *streams = NULL;
+static pthread_mutex_t streams_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Tell the kernel which part of the file is going to be read soon and
+ * which one won't be needed again, so that switching tracks doesn't stall
+ * on a cold cache and long sessions don't flood it. */
+static void io_advise (struct io_stream *s)
+{
+#ifdef HAVE_POSIX_FADVISE
+	off_t window = options_get_int ("FileReadAhead") * (off_t)1024;
+
+	if (!window)
+		return;
+
+	if (s->fd_pos + window / 2 >= s->advised) {
+		off_t len = MIN(window, s->size - s->fd_pos);
+
+		if (len > 0)
+			posix_fadvise (s->fd, s->fd_pos, len,
+			               POSIX_FADV_WILLNEED);
+		s->advised = s->fd_pos + window;
+	}
+
+	if (options_get_bool ("FileDropBehind")
+	            && s->fd_pos - s->dropped >= 2 * IO_DROP_BEHIND) {
+		posix_fadvise (s->fd, s->dropped,
+		               s->fd_pos - IO_DROP_BEHIND - s->dropped,
+		               POSIX_FADV_DONTNEED);
+		s->dropped = s->fd_pos - IO_DROP_BEHIND;
+	}
+#else
+	(void) s;
+#endif
+}
+
 #ifdef HAVE_MMAP
-static void *io_mmap_file (const struct io_stream *s)
+/* Map the part of the file starting at (or just before) pos.  Files larger
+ * than MMapWindow megabytes are mapped a window at a time, so that they
+ * don't exhaust the address space on 32-bit systems. */
+static void *io_mmap_file (struct io_stream *s, const off_t pos)
 {
 	void *result = NULL;
 
 	do {
-		if (s->size < 1 || (uint64_t)s->size > SIZE_MAX) {
+		off_t window = options_get_int ("MMapWindow") * (off_t)1024 * 1024;
+		off_t start = 0, len = s->size;
+
+		if (s->size < 1) {
 			logit ("File size unsuitable for mmap()");
 			break;
 		}
 
-		const size_t sz = (size_t)s->size;
+		if (window && s->size > window) {
+			off_t page = sysconf (_SC_PAGESIZE);
+
+			start = MIN(pos, s->size - 1) / page * page;
+			len = MIN(window, s->size - start);
+		}
+
+		if ((uint64_t)len > SIZE_MAX) {
+			logit ("File size unsuitable for mmap()");
+			break;
+		}
 
-		result = mmap (0, sz, PROT_READ, MAP_SHARED, s->fd, 0);
+		result = mmap (0, (size_t)len, PROT_READ, MAP_SHARED, s->fd,
+		               start);
 		if (result == MAP_FAILED) {
 			log_errno ("mmap() failed", errno);
 			result = NULL;
 			break;
 		}
 
-		logit ("mmap()ed %zu bytes", sz);
+#ifdef HAVE_POSIX_MADVISE
+		if (posix_madvise (result, (size_t)len, POSIX_MADV_SEQUENTIAL))
+			logit ("posix_madvise() failed");
+#endif
+
+		s->mem_start = start;
+		s->mem_len = (size_t)len;
+
+		debug ("mmap()ed %zu bytes at %"PRId64, s->mem_len,
+		       (int64_t)start);
 	} while (0);
 
 	return result;
 }
+
+/* Unmap the current window, return 0 on error. */
+static int io_munmap_file (struct io_stream *s)
+{
+	int result = 1;
+
+	if (s->mem && munmap (s->mem, s->mem_len)) {
+		log_errno ("munmap() failed", errno);
+		result = 0;
+	}
+
+	s->mem = NULL;
+	s->mem_len = 0;
+
+	return result;
+}
 #endif
 
 #ifdef HAVE_MMAP
@@ -82,9 +177,7 @@ static ssize_t io_read_mmap (struct io_stream *s, const int dont_move,
 		void *buf, size_t count)
 {
 	struct stat file_stat;
-	size_t to_read;
-
-	assert (s->mem != NULL);
+	size_t to_read, offset;
 
 	if (fstat (s->fd, &file_stat) == -1) {
 		log_errno ("fstat() failed", errno);
@@ -94,15 +187,10 @@ static ssize_t io_read_mmap (struct io_stream *s, const int dont_move,
 	if (s->size != file_stat.st_size) {
 		logit ("File size has changed");
 
-		if (munmap (s->mem, (size_t)s->size)) {
-			log_errno ("munmap() failed", errno);
+		if (!io_munmap_file (s))
 			return -1;
-		}
 
 		s->size = file_stat.st_size;
-		s->mem = io_mmap_file (s);
-		if (!s->mem)
-			return -1;
 
 		if (s->mem_pos > s->size)
 			logit ("File shrunk");
@@ -111,8 +199,19 @@ static ssize_t io_read_mmap (struct io_stream *s, const int dont_move,
 	if (s->mem_pos >= s->size)
 		return 0;
 
-	to_read = MIN(count, (size_t) (s->size - s->mem_pos));
-	memcpy (buf, (char *)s->mem + s->mem_pos, to_read);
+	/* Move the window when we have read past it (or seeked). */
+	if (!s->mem || s->mem_pos < s->mem_start
+	            || s->mem_pos >= s->mem_start + (off_t)s->mem_len) {
+		if (!io_munmap_file (s))
+			return -1;
+		s->mem = io_mmap_file (s, s->mem_pos);
+		if (!s->mem)
+			return -1;
+	}
+
+	offset = (size_t)(s->mem_pos - s->mem_start);
+	to_read = MIN(count, s->mem_len - offset);
+	memcpy (buf, (char *)s->mem + offset, to_read);
 
 	if (!dont_move)
 		s->mem_pos += to_read;
@@ -134,6 +233,11 @@ static ssize_t io_read_fd (struct io_stream *s, const int dont_move, void *buf,
 	if (dont_move && lseek(s->fd, -res, SEEK_CUR) < 0)
 		return -1;
 
+	if (!dont_move) {
+		s->fd_pos += res;
+		io_advise (s);
+	}
+
 	return res;
 }
 
@@ -179,15 +283,22 @@ static off_t io_seek_mmap (struct io_stream *s, const off_t where)
 
 static off_t io_seek_fd (struct io_stream *s, const off_t where)
 {
-	return lseek (s->fd, where, SEEK_SET);
+	off_t res = lseek (s->fd, where, SEEK_SET);
+
+	if (res >= 0) {
+		s->fd_pos = res;
+		s->advised = res;
+		s->dropped = MIN(s->dropped, res);
+		io_advise (s);
+	}
+
+	return res;
 }
 
 static off_t io_seek_buffered (struct io_stream *s, const off_t where)
 {
 	off_t res = -1;
 
-	assert (s->source != IO_SOURCE_CURL);
-
 	logit ("Seeking...");
 
 	switch (s->source) {
@@ -198,6 +309,11 @@ static off_t io_seek_buffered (struct io_stream *s, const off_t where)
 	case IO_SOURCE_MMAP:
 		res = io_seek_mmap (s, where);
 		break;
+#endif
+#ifdef HAVE_CURL
+	case IO_SOURCE_CURL:
+		res = io_curl_seek (s, where);
+		break;
 #endif
 	default:
 		fatal ("Unknown io_stream->source: %d", s->source);
@@ -217,8 +333,6 @@ static off_t io_seek_unbuffered (struct io_stream *s, const off_t where)
 {
 	off_t res = -1;
 
-	assert (s->source != IO_SOURCE_CURL);
-
 	switch (s->source) {
 #ifdef HAVE_MMAP
 	case IO_SOURCE_MMAP:
@@ -228,6 +342,11 @@ static off_t io_seek_unbuffered (struct io_stream *s, const off_t where)
 	case IO_SOURCE_FD:
 		res = io_seek_fd (s, where);
 		break;
+#ifdef HAVE_CURL
+	case IO_SOURCE_CURL:
+		res = io_curl_seek (s, where);
+		break;
+#endif
 	default:
 		fatal ("Unknown io_stream->source: %d", s->source);
 	}
@@ -242,9 +361,15 @@ off_t io_seek (struct io_stream *s, off_t offset, int whence)
 	assert (s != NULL);
 	assert (s->opened);
 
-	if (s->source == IO_SOURCE_CURL || !io_ok(s))
+	if (!io_seekable(s) || !io_ok(s))
 		return -1;
 
+#ifdef HAVE_CURL
+	/* Don't wait for a network read to fill up. */
+	if (s->source == IO_SOURCE_CURL && s->buffered)
+		io_curl_interrupt (s);
+#endif
+
 	LOCK (s->io_mtx);
 	switch (whence) {
 	case SEEK_SET:
@@ -305,6 +430,33 @@ void io_abort (struct io_stream *s)
 	}
 }
 
+/* Return a line describing the counters of the stream. */
+static char *io_stats_line (struct io_stream *s)
+{
+	static const char *sources[] = { "file", "mmap", "http" };
+	char fill[48];
+	long fill_low, fill_high;
+
+	fill_low = ATOMIC_LOAD (&s->stats.fill_low);
+	fill_high = ATOMIC_LOAD (&s->stats.fill_high);
+	if (s->buffered)
+		snprintf (fill, sizeof(fill), "%ld-%ld KB",
+		          MAX(fill_low, 0L) / 1024, fill_high / 1024);
+	else
+		strcpy (fill, "none");
+
+	return format_msg ("%s (%s): %"PRIu64" bytes in %ld reads, "
+	                   "blocked %"PRIu64" ms, buffer %s, "
+	                   "%ld prebuffer waits, %ld reconnects",
+	                   s->name, sources[s->source],
+	                   ATOMIC_LOAD (&s->stats.bytes),
+	                   ATOMIC_LOAD (&s->stats.reads),
+	                   ATOMIC_LOAD (&s->stats.blocked_usec) / 1000,
+	                   fill,
+	                   ATOMIC_LOAD (&s->stats.prebuffer_waits),
+	                   ATOMIC_LOAD (&s->stats.reconnects));
+}
+
 /* Close the stream and free all resources associated with it. */
 void io_close (struct io_stream *s)
 {
@@ -315,6 +467,19 @@ void io_close (struct io_stream *s)
 	logit ("Closing stream...");
 
 	if (s->opened) {
+		struct io_stream **p;
+		char *stats;
+
+		LOCK (streams_mtx);
+		for (p = &streams; *p != s; p = &(*p)->next)
+			assert (*p != NULL);
+		*p = s->next;
+		UNLOCK (streams_mtx);
+
+		stats = io_stats_line (s);
+		logit ("I/O stats for %s", stats);
+		free (stats);
+
 		if (s->buffered) {
 			io_abort (s);
 
@@ -329,8 +494,7 @@ void io_close (struct io_stream *s)
 			break;
 #ifdef HAVE_MMAP
 		case IO_SOURCE_MMAP:
-			if (s->mem && munmap (s->mem, (size_t)s->size))
-				log_errno ("munmap() failed", errno);
+			io_munmap_file (s);
 			close (s->fd);
 			break;
 #endif
@@ -374,7 +538,8 @@ void io_close (struct io_stream *s)
 
 	if (s->strerror)
 		free (s->strerror);
-	free (s);
+	free (s->name);
+	xfree_tag (s, MEM_IO);
 
 	logit ("done");
 }
@@ -384,23 +549,39 @@ static void *io_read_thread (void *data)
 	struct io_stream *s = (struct io_stream *)data;
 
 	logit ("IO read thread created");
+	thread_sched_apply (THREAD_IO);
 
 	while (!s->stop_read_thread) {
-		char read_buf[8096];
-		int read_buf_fill = 0;
-		int read_buf_pos = 0;
+		char *region;
+		size_t region_len;
+		ssize_t read_buf_fill;
 
+		LOCK (s->buf_mtx);
+		while (!fifo_buf_get_space (s->buf) && !s->stop_read_thread) {
+			debug ("The buffer is full, waiting.");
+			pthread_cond_wait (&s->buf_free_cond, &s->buf_mtx);
+			debug ("Some space in the buffer was freed");
+		}
+		UNLOCK (s->buf_mtx);
+
+		if (s->stop_read_thread)
+			break;
+
+		/* Only this thread fills the buffer, so the space can only
+		 * grow until the data is committed. */
 		LOCK (s->io_mtx);
 		debug ("Reading...");
 
 		LOCK (s->buf_mtx);
 		s->after_seek = 0;
+		region = fifo_buf_write_region (s->buf, &region_len);
 		UNLOCK (s->buf_mtx);
 
-		read_buf_fill = io_internal_read (s, 0, read_buf, sizeof(read_buf));
+		read_buf_fill = io_internal_read (s, 0, region,
+				MIN(region_len, IO_READ_MAX));
 		UNLOCK (s->io_mtx);
 		if (read_buf_fill > 0)
-			debug ("Read %d bytes", read_buf_fill);
+			debug ("Read %zd bytes", read_buf_fill);
 
 		LOCK (s->buf_mtx);
 
@@ -430,36 +611,22 @@ static void *io_read_thread (void *data)
 
 		s->eof = 0;
 
-		while (read_buf_pos < read_buf_fill && !s->after_seek) {
-			size_t put;
-
-			debug ("Buffer fill: %zu", fifo_buf_get_fill (s->buf));
-
-			put = fifo_buf_put (s->buf,
-					read_buf + read_buf_pos,
-					read_buf_fill - read_buf_pos);
-
-			if (s->stop_read_thread)
-				break;
-
-			if (put > 0) {
-				debug ("Put %zu bytes into the buffer", put);
-				if (s->buf_fill_callback) {
-					UNLOCK (s->buf_mtx);
-					s->buf_fill_callback (s,
-						fifo_buf_get_fill (s->buf),
-						fifo_buf_get_size (s->buf),
-						s->buf_fill_callback_data);
-					LOCK (s->buf_mtx);
-				}
-				pthread_cond_broadcast (&s->buf_fill_cond);
-				read_buf_pos += put;
-				continue;
+		/* What was read before a seek is not wanted. */
+		if (!s->after_seek) {
+			fifo_buf_commit (s->buf, read_buf_fill);
+			debug ("Put %zd bytes into the buffer", read_buf_fill);
+			if ((long)fifo_buf_get_fill (s->buf) > s->stats.fill_high)
+				STATS_SET (s, fill_high,
+				           (long)fifo_buf_get_fill (s->buf));
+			if (s->buf_fill_callback) {
+				UNLOCK (s->buf_mtx);
+				s->buf_fill_callback (s,
+					fifo_buf_get_fill (s->buf),
+					fifo_buf_get_size (s->buf),
+					s->buf_fill_callback_data);
+				LOCK (s->buf_mtx);
 			}
-
-			debug ("The buffer is full, waiting.");
-			pthread_cond_wait (&s->buf_free_cond, &s->buf_mtx);
-			debug ("Some space in the buffer was freed");
+			pthread_cond_broadcast (&s->buf_fill_cond);
 		}
 
 		UNLOCK (s->buf_mtx);
@@ -495,6 +662,15 @@ static void io_open_file (struct io_stream *s, const char *file)
 		s->size = file_stat.st_size;
 		s->opened = 1;
 
+		s->fd_pos = 0;
+		s->advised = 0;
+		s->dropped = 0;
+#ifdef HAVE_POSIX_FADVISE
+		if (options_get_int ("FileReadAhead"))
+			posix_fadvise (s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		io_advise (s);
+
 #ifdef HAVE_MMAP
 		if (!options_get_bool ("UseMMap")) {
 			logit ("Not using mmap()");
@@ -502,7 +678,7 @@ static void io_open_file (struct io_stream *s, const char *file)
 			break;
 		}
 
-		s->mem = io_mmap_file (s);
+		s->mem = io_mmap_file (s, 0);
 		if (!s->mem)
 			break;
 
@@ -520,7 +696,7 @@ struct io_stream *io_open (const char *file, const int buffered)
 
 	assert (file != NULL);
 
-	s = xmalloc (sizeof(struct io_stream));
+	s = xmalloc_tag (sizeof(struct io_stream), MEM_IO);
 	s->errno_val = 0;
 	s->read_error = 0;
 	s->strerror = NULL;
@@ -528,6 +704,9 @@ struct io_stream *io_open (const char *file, const int buffered)
 	s->size = -1;
 	s->buf_fill_callback = NULL;
 	memset (&s->metadata, 0, sizeof(s->metadata));
+	memset (&s->stats, 0, sizeof(s->stats));
+	s->stats.fill_low = -1;
+	s->name = xstrdup (file);
 
 #ifdef HAVE_CURL
 	s->curl.mime_type = NULL;
@@ -551,7 +730,8 @@ struct io_stream *io_open (const char *file, const int buffered)
 	s->pos = 0;
 
 	if (buffered) {
-		s->buf = fifo_buf_new (options_get_int("InputBuffer") * 1024);
+		s->buf = fifo_buf_new (options_get_int("InputBuffer") * 1024,
+				MEM_IO);
 		s->prebuffer = options_get_int("Prebuffering") * 1024;
 
 		pthread_cond_init (&s->buf_free_cond, NULL);
@@ -562,6 +742,11 @@ struct io_stream *io_open (const char *file, const int buffered)
 			fatal ("Can't create read thread: %s", xstrerror (errno));
 	}
 
+	LOCK (streams_mtx);
+	s->next = streams;
+	streams = s;
+	UNLOCK (streams_mtx);
+
 	return s;
 }
 
@@ -599,6 +784,7 @@ static ssize_t io_peek_internal (struct io_stream *s, void *buf, size_t count)
 			&& fifo_buf_get_space (s->buf)
 			&& !s->eof) {
 		debug ("waiting...");
+		pthread_cond_signal (&s->buf_free_cond);
 		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
 	}
 
@@ -610,29 +796,105 @@ static ssize_t io_peek_internal (struct io_stream *s, void *buf, size_t count)
 	return io_ok(s) ? received : -1;
 }
 
-/* Wait until there are s->prebuffer bytes in the buffer or some event
- * occurs which prevents prebuffering. */
-void io_prebuffer (struct io_stream *s, const size_t to_fill)
+/* Return how many bytes to prebuffer: to_fill, or for network streams
+ * with AdaptivePrebuffering what their measured throughput and bitrate
+ * (in kbps, -1 if unknown) call for, as long as they are known. */
+static size_t prebuffer_target (struct io_stream *s, const size_t to_fill,
+                                const int bitrate CURL_ONLY)
 {
-	logit ("prebuffering to %zu bytes...", to_fill);
+	size_t target = 0;
+
+#ifdef HAVE_CURL
+	if (s->source == IO_SOURCE_CURL
+			&& options_get_bool ("AdaptivePrebuffering"))
+		target = io_curl_prebuffer_target (s, bitrate);
+#endif
+
+	if (!target)
+		return to_fill;
+
+	target = MAX(target, IO_PREBUFFER_MIN);
+	return MIN(target, fifo_buf_get_size (s->buf) / 4 * 3);
+}
+
+/* Wait until the buffer is filled to the prebuffering target or some
+ * event occurs which prevents prebuffering.  The target starts as to_fill
+ * and, for network streams, follows the throughput measured meanwhile,
+ * so that playing starts as soon as enough is buffered for it. */
+void io_prebuffer (struct io_stream *s, const size_t to_fill,
+                   const int bitrate)
+{
+	size_t target;
 
 	LOCK (s->buf_mtx);
+	s->prebuffer = prebuffer_target (s, to_fill, bitrate);
+	logit ("prebuffering to %zu bytes...", s->prebuffer);
+	if (io_ok_nolock(s) && !s->stop_read_thread && !s->eof
+	                    && s->prebuffer > fifo_buf_get_fill(s->buf))
+		STATS_ADD (s, prebuffer_waits, 1);
 	while (io_ok_nolock(s) && !s->stop_read_thread && !s->eof
-	                       && to_fill > fifo_buf_get_fill(s->buf)) {
+	                       && s->prebuffer > fifo_buf_get_fill(s->buf)) {
 		debug ("waiting (buffer %zu bytes full)", fifo_buf_get_fill (s->buf));
+		pthread_cond_signal (&s->buf_free_cond);
 		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
+
+		target = prebuffer_target (s, to_fill, bitrate);
+		if (target != s->prebuffer) {
+			debug ("prebuffering target changed to %zu bytes", target);
+			s->prebuffer = target;
+		}
 	}
 	UNLOCK (s->buf_mtx);
 
 	logit ("done");
 }
 
+/* Return the number of bytes the last prebuffering has been waiting for. */
+size_t io_prebuffer_target (struct io_stream *s)
+{
+	size_t target;
+
+	LOCK (s->buf_mtx);
+	target = s->prebuffer;
+	UNLOCK (s->buf_mtx);
+
+	return target;
+}
+
+/* Let the read thread refill the buffer once there is room for a large
+ * read, so that it doesn't wake up and read for every small get. */
+static void wake_read_thread (struct io_stream *s)
+{
+	if (fifo_buf_get_space (s->buf) >= MIN(IO_READ_MAX,
+	                                      fifo_buf_get_size (s->buf) / 4))
+		pthread_cond_signal (&s->buf_free_cond);
+}
+
+/* Return the number of microseconds elapsed since start. */
+static uint64_t usec_since (const struct timespec *start)
+{
+	struct timespec now;
+	int64_t usec;
+
+	get_realtime (&now);
+	usec = (now.tv_sec - start->tv_sec) * INT64_C(1000000)
+	       + (now.tv_nsec - start->tv_nsec) / 1000;
+
+	return usec > 0 ? usec : 0;
+}
+
 static ssize_t io_read_buffered (struct io_stream *s, void *buf, size_t count)
 {
 	ssize_t received = 0;
+	struct timespec wait_start;
 
 	LOCK (s->buf_mtx);
 
+	if (s->stats.reads > 0 && ((long)fifo_buf_get_fill (s->buf)
+	                           < s->stats.fill_low
+	                           || s->stats.fill_low == -1))
+		STATS_SET (s, fill_low, (long)fifo_buf_get_fill (s->buf));
+
 	while (received < (ssize_t)count && !s->stop_read_thread
 			&& ((!s->eof && !s->read_error)
 				|| fifo_buf_get_fill(s->buf))) {
@@ -640,12 +902,15 @@ static ssize_t io_read_buffered (struct io_stream *s, void *buf, size_t count)
 			received += fifo_buf_get (s->buf, (char *)buf + received,
 					count - received);
 			debug ("Read %zd bytes so far", received);
-			pthread_cond_signal (&s->buf_free_cond);
+			wake_read_thread (s);
 			continue;
 		}
 
 		debug ("Buffer empty, waiting...");
+		get_realtime (&wait_start);
+		pthread_cond_signal (&s->buf_free_cond);
 		pthread_cond_wait (&s->buf_fill_cond, &s->buf_mtx);
+		STATS_ADD (s, blocked_usec, usec_since (&wait_start));
 	}
 
 	debug ("done");
@@ -695,6 +960,10 @@ ssize_t io_read (struct io_stream *s, void *buf, size_t count)
 	else
 		received = io_read_unbuffered (s, 0, buf, count);
 
+	STATS_ADD (s, reads, 1);
+	if (received > 0)
+		STATS_ADD (s, bytes, received);
+
 	return received;
 }
 
@@ -745,6 +1014,38 @@ off_t io_file_size (const struct io_stream *s)
 	return s->size;
 }
 
+/* Return the whole file mapped into memory read-only, and its size in
+ * len, or NULL if the stream isn't an unbuffered one read with mmap() or
+ * the file doesn't fit in MMapWindow.  It lets decoders which load the
+ * whole file at once parse it in place instead of reading it into a copy;
+ * the memory is valid until the stream is read, seeked or closed. */
+const void *io_map (struct io_stream *s, size_t *len)
+{
+	const void *result = NULL;
+
+	assert (s != NULL);
+	assert (len != NULL);
+
+#ifdef HAVE_MMAP
+	if (s->source != IO_SOURCE_MMAP || s->buffered)
+		return NULL;
+
+	LOCK (s->io_mtx);
+	if (!s->mem || s->mem_start != 0 || (off_t)s->mem_len != s->size) {
+		if (io_munmap_file (s))
+			s->mem = io_mmap_file (s, 0);
+	}
+
+	if (s->mem && s->mem_start == 0 && (off_t)s->mem_len == s->size) {
+		result = s->mem;
+		*len = s->mem_len;
+	}
+	UNLOCK (s->io_mtx);
+#endif
+
+	return result;
+}
+
 /* Return the stream position. */
 off_t io_tell (struct io_stream *s)
 {
@@ -794,6 +1095,15 @@ void io_cleanup ()
 #endif
 }
 
+/* Get the connection to the server of the URL ready in the background,
+ * for a stream which is going to be opened soon. */
+void io_preconnect (const char *url CURL_ONLY)
+{
+#ifdef HAVE_CURL
+	io_curl_preconnect (url);
+#endif
+}
+
 /* Return the mime type if available or NULL.
  * The mime type is read by curl only after the first read (or peek), until
  * then it's NULL. */
@@ -868,5 +1178,31 @@ void io_set_buf_fill_callback (struct io_stream *s,
 /* Return a non-zero value if the stream is seekable. */
 int io_seekable (const struct io_stream *s)
 {
+#ifdef HAVE_CURL
+	if (s->source == IO_SOURCE_CURL)
+		return io_curl_seekable (s);
+#endif
+
 	return s->source == IO_SOURCE_FD || s->source == IO_SOURCE_MMAP;
 }
+
+/* Return the counters of all the open streams, one line each, or an empty
+ * string if there are none.  The result must be freed. */
+char *io_stats_report ()
+{
+	struct io_stream *s;
+	char *report = xstrdup ("");
+
+	LOCK (streams_mtx);
+	for (s = streams; s; s = s->next) {
+		char *line = io_stats_line (s);
+
+		report = xrealloc (report, strlen (report) + strlen (line) + 2);
+		strcat (report, line);
+		strcat (report, "\n");
+		free (line);
+	}
+	UNLOCK (streams_mtx);
+
+	return report;
+}
@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdint.h>
 #ifdef HAVE_CURL
 # include <sys/socket.h>     /* curl sometimes needs this */
 # include <curl/curl.h>
@@ -22,6 +23,12 @@ enum io_source
 };
 
 #ifdef HAVE_CURL
+struct io_curl_range
+{
+	off_t start;
+	off_t end;		/* one past the last byte */
+};
+
 struct io_stream_curl
 {
 	CURLM *multi_handle;	/* we use the multi interface to get the
@@ -45,9 +52,45 @@ struct io_stream_curl
 				   0 - disabled, in bytes */
 	size_t icy_meta_count;	/* how many bytes was read from the last
 				   metadata packet */
+	int requests;		/* number of requests made for the stream */
+	int http_code;		/* status code of the last response */
+	int accept_ranges;	/* does the server take range requests? */
+	char *etag;		/* entity tag of the resource or NULL */
+	off_t pos;		/* position of the next byte to be read */
+	off_t net_pos;		/* position of the next byte from the server */
+	off_t skip;		/* bytes to drop from a response that ignored
+				   our range */
+	int finished;		/* the transfer has completed */
+	int interrupt;		/* return from io_curl_read() early */
+	int cache_fd;		/* disk cache file or -1 */
+	char *cache_name;	/* path of the cache file without suffix */
+	struct io_curl_range *ranges;	/* cached byte ranges, sorted */
+	int ranges_num;
+	int cache_complete;	/* the whole resource is cached */
+	int icy_br;		/* bitrate from the icy-br header in kbps or 0 */
+	long rate_bytes;	/* bytes received in the throughput window */
+	long rate_usec;		/* time spent waiting for them */
+	long rate;		/* average throughput in bytes per second or 0
+				   if not measured yet */
+	long rate_dev;		/* average deviation of the throughput */
 };
 #endif
 
+/* Counters of what has happened to a stream, to tell whether a stutter
+ * came from the source or from reading it too late.  Each one is changed
+ * by a single thread and can be read by any other. */
+struct io_stats
+{
+	uint64_t bytes;		/* bytes read by io_read() */
+	long reads;		/* io_read() calls */
+	uint64_t blocked_usec;	/* time io_read() waited for the buffer */
+	long fill_low;		/* lowest buffer fill met by io_read() after
+				   the first one, -1 if not yet known */
+	long fill_high;		/* highest buffer fill */
+	long prebuffer_waits;	/* io_prebuffer() calls which waited */
+	long reconnects;	/* requests made again for the stream */
+};
+
 struct io_stream;
 
 typedef void (*buf_fill_callback_t) (struct io_stream *s, size_t fill,
@@ -56,6 +99,7 @@ typedef void (*buf_fill_callback_t) (struct io_stream *s, size_t fill,
 struct io_stream
 {
 	enum io_source source;	/* source of the file */
+	char *name;	/* the file name or URL */
 	int fd;
 	off_t size;	/* size of the file */
 	int errno_val;	/* errno value of the last operation  - 0 if ok */
@@ -66,11 +110,17 @@ struct io_stream
 	int after_seek;	/* are we after seek and need to do fresh read()? */
 	int buffered;	/* are we using the buffer? */
 	off_t pos;	/* current position in the file from the user point of view */
-	size_t prebuffer;	/* number of bytes left to prebuffer */
+	size_t prebuffer;	/* number of bytes to prebuffer */
 	pthread_mutex_t io_mtx;	/* mutex for IO operations */
 
+	off_t fd_pos;	/* position of fd */
+	off_t advised;	/* fd: end of the part to be read soon we have told */
+	off_t dropped;	/* fd: start of the read part still in the cache */
+
 #ifdef HAVE_MMAP
-	void *mem;
+	void *mem;	/* the mapped part of the file */
+	off_t mem_start;	/* where the mapped part starts in the file */
+	size_t mem_len;	/* and its length */
 	off_t mem_pos;
 #endif
 
@@ -93,6 +143,9 @@ struct io_stream
 		char *url;
 	} metadata;
 
+	struct io_stats stats;
+	struct io_stream *next;	/* the next open stream */
+
 	/* callbacks */
 	buf_fill_callback_t buf_fill_callback;
 	void *buf_fill_callback_data;
@@ -106,10 +159,12 @@ void io_close (struct io_stream *s);
 int io_ok (struct io_stream *s);
 char *io_strerror (struct io_stream *s);
 off_t io_file_size (const struct io_stream *s);
+const void *io_map (struct io_stream *s, size_t *len);
 off_t io_tell (struct io_stream *s);
 int io_eof (struct io_stream *s);
 void io_init ();
 void io_cleanup ();
+void io_preconnect (const char *url);
 void io_abort (struct io_stream *s);
 char *io_get_mime_type (struct io_stream *s);
 char *io_get_title (struct io_stream *s);
@@ -117,10 +172,13 @@ char *io_get_metadata_title (struct io_stream *s);
 char *io_get_metadata_url (struct io_stream *s);
 void io_set_metadata_title (struct io_stream *s, const char *title);
 void io_set_metadata_url (struct io_stream *s, const char *url);
-void io_prebuffer (struct io_stream *s, const size_t to_fill);
+void io_prebuffer (struct io_stream *s, const size_t to_fill,
+		const int bitrate);
+size_t io_prebuffer_target (struct io_stream *s);
 void io_set_buf_fill_callback (struct io_stream *s,
 		buf_fill_callback_t callback, void *data_ptr);
 int io_seekable (const struct io_stream *s);
+char *io_stats_report ();
 
 #ifdef __cplusplus
 }
@@ -14,15 +14,22 @@
 #endif
 
 #include <curl/curl.h>
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <sys/select.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #define DEBUG
 
@@ -32,9 +39,156 @@
 #include "io_curl.h"
 #include "options.h"
 #include "lists.h"
+#include "files.h"
 
 static char user_agent[] = PACKAGE_NAME"/"PACKAGE_VERSION;
 
+/* Directory holding the disk cache of remote files and its size limit
+ * in bytes.  cache_dir is NULL if the cache is disabled. */
+static char *cache_dir = NULL;
+static off_t cache_limit = 0;
+
+/* Time spent waiting for the network over which one throughput sample
+ * is taken (in microseconds). */
+#define RATE_WINDOW	250000L
+
+/* DNS cache, TLS sessions and kept-alive connections shared by all
+ * streams, so consecutive tracks from one server skip the connection
+ * setup. */
+static CURLSH *share = NULL;
+static pthread_mutex_t share_mtx[CURL_LOCK_DATA_LAST];
+
+static void share_lock (CURL *unused1 ATTR_UNUSED, curl_lock_data data,
+                        curl_lock_access unused2 ATTR_UNUSED,
+                        void *unused3 ATTR_UNUSED)
+{
+	LOCK (share_mtx[data]);
+}
+
+static void share_unlock (CURL *unused1 ATTR_UNUSED, curl_lock_data data,
+                          void *unused2 ATTR_UNUSED)
+{
+	UNLOCK (share_mtx[data]);
+}
+
+/* The thread requesting the headers of a stream which is going to be
+ * played soon, so that DNS, TLS and the connection are ready for it.
+ * io_curl_preconnect() is used from one thread only. */
+static pthread_t preconnect_tid;
+static int preconnect_running = 0;
+static int preconnect_done = 0;
+static char *preconnect_url = NULL;
+
+static void share_init ()
+{
+	size_t ix;
+
+	if (!(share = curl_share_init ())) {
+		logit ("curl_share_init() returned NULL");
+		return;
+	}
+
+	for (ix = 0; ix < ARRAY_SIZE(share_mtx); ix += 1)
+		pthread_mutex_init (&share_mtx[ix], NULL);
+
+	curl_share_setopt (share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt (share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+static void share_cleanup ()
+{
+	size_t ix;
+
+	if (!share)
+		return;
+
+	curl_share_cleanup (share);
+	share = NULL;
+
+	for (ix = 0; ix < ARRAY_SIZE(share_mtx); ix += 1)
+		pthread_mutex_destroy (&share_mtx[ix]);
+}
+
+static void *preconnect_thread (void *data)
+{
+	CURL *handle;
+	CURLcode res;
+
+	if ((handle = curl_easy_init ())) {
+		curl_easy_setopt (handle, CURLOPT_URL, (const char *)data);
+		curl_easy_setopt (handle, CURLOPT_NOBODY, 1);
+		curl_easy_setopt (handle, CURLOPT_NOSIGNAL, 1);
+		curl_easy_setopt (handle, CURLOPT_TIMEOUT, 10);
+		curl_easy_setopt (handle, CURLOPT_SHARE, share);
+		curl_easy_setopt (handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+		curl_easy_setopt (handle, CURLOPT_USERAGENT, user_agent);
+		curl_easy_setopt (handle, CURLOPT_FOLLOWLOCATION, 1);
+		curl_easy_setopt (handle, CURLOPT_MAXREDIRS, 15);
+		if (options_get_str("HTTPProxy"))
+			curl_easy_setopt (handle, CURLOPT_PROXY,
+					options_get_str("HTTPProxy"));
+
+		res = curl_easy_perform (handle);
+		if (res != CURLE_OK)
+			logit ("Preconnecting failed: %s", curl_easy_strerror (res));
+		curl_easy_cleanup (handle);
+	}
+
+	ATOMIC_STORE (&preconnect_done, 1);
+
+	return NULL;
+}
+
+/* Join the preconnect thread if it has finished or wait is true.  Return
+ * 0 if it is still running. */
+static int preconnect_join (const bool wait)
+{
+	int rc;
+
+	if (!preconnect_running)
+		return 1;
+	if (!wait && !ATOMIC_LOAD (&preconnect_done))
+		return 0;
+
+	rc = pthread_join (preconnect_tid, NULL);
+	if (rc != 0)
+		log_errno ("pthread_join() on the preconnect thread failed", rc);
+	preconnect_running = 0;
+
+	return 1;
+}
+
+/* Make a connection to the server of the URL in the background, so that
+ * opening the URL soon after is quick. */
+void io_curl_preconnect (const char *url)
+{
+	int rc;
+
+	assert (url != NULL);
+
+	if (!share || !preconnect_join (false))
+		return;
+	if (preconnect_url && !strcmp (preconnect_url, url))
+		return;
+
+	free (preconnect_url);
+	preconnect_url = xstrdup (url);
+	preconnect_done = 0;
+
+	logit ("Preconnecting to %s", url);
+	rc = pthread_create (&preconnect_tid, NULL, preconnect_thread,
+	                     preconnect_url);
+	if (rc != 0)
+		log_errno ("Can't create the preconnect thread", rc);
+	else
+		preconnect_running = 1;
+}
+
 void io_curl_init ()
 {
 	char *ptr;
@@ -45,11 +199,366 @@ void io_curl_init ()
 	}
 
 	curl_global_init (CURL_GLOBAL_NOTHING);
+	share_init ();
+
+	if (options_get_int ("HTTPCacheSize") > 0) {
+		cache_dir = xstrdup (create_file_name ("http_cache"));
+		cache_limit = (off_t)options_get_int ("HTTPCacheSize")
+		              * 1024 * 1024;
+	}
 }
 
 void io_curl_cleanup ()
 {
+	preconnect_join (true);
+	free (preconnect_url);
+	preconnect_url = NULL;
+
+	share_cleanup ();
 	curl_global_cleanup ();
+
+	free (cache_dir);
+	cache_dir = NULL;
+}
+
+/* Return the number of bytes cached from pos on. */
+static off_t cached_at (const struct io_stream *s, const off_t pos)
+{
+	int ix;
+
+	for (ix = 0; ix < s->curl.ranges_num; ix += 1) {
+		const struct io_curl_range *r = &s->curl.ranges[ix];
+
+		if (pos < r->start)
+			break;
+		if (pos < r->end)
+			return r->end - pos;
+	}
+
+	return 0;
+}
+
+/* Record that the bytes from start up to end are in the cache. */
+static void range_add (struct io_stream *s, off_t start, off_t end)
+{
+	struct io_curl_range *ranges;
+	int first, last, num = s->curl.ranges_num;
+
+	/* Find the ranges which overlap or touch the new one. */
+	for (first = 0; first < num && s->curl.ranges[first].end < start;
+			first += 1)
+		;
+	for (last = first; last < num && s->curl.ranges[last].start <= end;
+			last += 1)
+		;
+
+	if (first == last)
+		s->curl.ranges = xrealloc (s->curl.ranges,
+				(num + 1) * sizeof (struct io_curl_range));
+	else {
+		start = MIN(start, s->curl.ranges[first].start);
+		end = MAX(end, s->curl.ranges[last - 1].end);
+	}
+
+	ranges = s->curl.ranges;
+	memmove (ranges + first + 1, ranges + last,
+			(num - last) * sizeof (struct io_curl_range));
+	ranges[first].start = start;
+	ranges[first].end = end;
+	s->curl.ranges_num = num - (last - first) + 1;
+
+	if (s->curl.ranges_num == 1 && ranges[0].start == 0
+			&& ranges[0].end >= s->size)
+		ATOMIC_STORE (&s->curl.cache_complete, 1);
+}
+
+/* Forget the cache entry of the stream without saving it. */
+static void cache_drop (struct io_stream *s)
+{
+	if (s->curl.cache_fd != -1)
+		close (s->curl.cache_fd);
+	s->curl.cache_fd = -1;
+	free (s->curl.cache_name);
+	s->curl.cache_name = NULL;
+	free (s->curl.ranges);
+	s->curl.ranges = NULL;
+	s->curl.ranges_num = 0;
+	ATOMIC_STORE (&s->curl.cache_complete, 0);
+}
+
+/* Load the list of cached ranges, data_size is the size of the cache
+ * file.  The entry is used only if it is for the same version of the
+ * same resource. */
+static void cache_load_index (struct io_stream *s, const off_t data_size)
+{
+	FILE *file;
+	char *path, *url, *etag, *size;
+
+	path = format_msg ("%s.idx", s->curl.cache_name);
+	file = fopen (path, "r");
+	free (path);
+	if (!file)
+		return;
+
+	url = read_line (file);
+	etag = read_line (file);
+	size = read_line (file);
+
+	if (url && etag && size && !strcmp (url, s->curl.url)
+			&& !strcmp (etag, s->curl.etag)
+			&& strtoll (size, NULL, 10) == s->size) {
+		char *line;
+
+		while ((line = read_line (file))) {
+			int64_t start, end;
+
+			if (sscanf (line, "%"SCNd64" %"SCNd64, &start, &end) == 2
+					&& 0 <= start && start < end
+					&& end <= data_size && end <= s->size)
+				range_add (s, start, end);
+			free (line);
+		}
+	}
+
+	free (url);
+	free (etag);
+	free (size);
+	fclose (file);
+}
+
+/* Write the list of cached ranges. */
+static void cache_save_index (struct io_stream *s)
+{
+	int ix;
+	FILE *file;
+	char *path;
+
+	path = format_msg ("%s.idx", s->curl.cache_name);
+	file = fopen (path, "w");
+	if (!file) {
+		log_errno ("Can't write the HTTP cache index", errno);
+		free (path);
+		return;
+	}
+
+	fprintf (file, "%s\n%s\n%"PRId64"\n", s->curl.url, s->curl.etag,
+	               (int64_t)s->size);
+	for (ix = 0; ix < s->curl.ranges_num; ix += 1)
+		fprintf (file, "%"PRId64" %"PRId64"\n",
+		               (int64_t)s->curl.ranges[ix].start,
+		               (int64_t)s->curl.ranges[ix].end);
+
+	if (fclose (file) == EOF) {
+		log_errno ("Can't write the HTTP cache index", errno);
+		unlink (path);
+	}
+
+	free (path);
+}
+
+/* Open the cache entry for the resource if it should be cached.  This is
+ * done once the headers of the first response are in, the entry is keyed
+ * by the URL and the entity tag. */
+static void cache_open (struct io_stream *s)
+{
+	const char *c;
+	char *path;
+	struct stat st;
+	uint64_t hash = UINT64_C(14695981039346656037);
+
+	if (!cache_dir || !s->curl.etag || s->curl.icy_meta_int
+			|| s->size <= 0 || s->size > cache_limit)
+		return;
+
+	/* FNV-1a, collisions are caught by the index. */
+	for (c = s->curl.url; *c; c++)
+		hash = (hash ^ (uint8_t)*c) * UINT64_C(1099511628211);
+	hash = (hash ^ '\n') * UINT64_C(1099511628211);
+	for (c = s->curl.etag; *c; c++)
+		hash = (hash ^ (uint8_t)*c) * UINT64_C(1099511628211);
+
+	if (mkdir (cache_dir, 0700) == -1 && errno != EEXIST) {
+		log_errno ("Can't create the HTTP cache directory", errno);
+		return;
+	}
+
+	s->curl.cache_name = format_msg ("%s/%016"PRIx64, cache_dir, hash);
+	path = format_msg ("%s.data", s->curl.cache_name);
+	s->curl.cache_fd = open (path, O_RDWR | O_CREAT, 0600);
+	free (path);
+
+	if (s->curl.cache_fd == -1 || fstat (s->curl.cache_fd, &st) == -1) {
+		log_errno ("Can't open the HTTP cache file", errno);
+		cache_drop (s);
+		return;
+	}
+
+	cache_load_index (s, st.st_size);
+	debug ("Caching in %s, %d ranges cached", s->curl.cache_name,
+	       s->curl.ranges_num);
+}
+
+/* Put the data received from the server at pos into the cache.  Return 0
+ * if the cache has failed and the data were not stored. */
+static int cache_store (struct io_stream *s, off_t pos, const char *data,
+                        size_t len)
+{
+	const off_t start = pos;
+
+	while (len) {
+		ssize_t res = pwrite (s->curl.cache_fd, data, len, pos);
+
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0) {
+			log_errno ("Can't write to the HTTP cache", errno);
+			cache_drop (s);
+			return 0;
+		}
+
+		data += res;
+		len -= res;
+		pos += res;
+	}
+
+	range_add (s, start, pos);
+
+	return 1;
+}
+
+/* Read cached data from the stream position into buf.  Return the number
+ * of bytes read, 0 if the data at the position are not in the cache. */
+static size_t cache_read (struct io_stream *s, char *buf, size_t count)
+{
+	off_t avail;
+	ssize_t res;
+
+	if (s->curl.cache_fd == -1)
+		return 0;
+
+	avail = cached_at (s, s->curl.pos);
+	if (avail == 0)
+		return 0;
+
+	/* Nothing more is needed from the server. */
+	if (s->curl.handle && s->curl.cache_complete) {
+		debug ("The whole stream is cached, closing the connection");
+		curl_multi_remove_handle (s->curl.multi_handle, s->curl.handle);
+		curl_easy_cleanup (s->curl.handle);
+		s->curl.handle = NULL;
+	}
+
+	do {
+		res = pread (s->curl.cache_fd, buf, MIN((off_t)count, avail),
+		             s->curl.pos);
+	} while (res < 0 && errno == EINTR);
+
+	if (res <= 0) {
+		if (res < 0)
+			log_errno ("Can't read from the HTTP cache", errno);
+		else
+			logit ("The HTTP cache file is truncated");
+		cache_drop (s);
+		return 0;
+	}
+
+	s->curl.pos += res;
+
+	return res;
+}
+
+struct cache_entry
+{
+	char *name;		/* path without the suffix */
+	time_t mtime;		/* when the index was last written */
+	off_t size;		/* disk space used */
+};
+
+static int cache_entry_cmp (const void *a, const void *b)
+{
+	const struct cache_entry *ea = (const struct cache_entry *)a;
+	const struct cache_entry *eb = (const struct cache_entry *)b;
+
+	return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/* Remove the least recently used entries until the cache fits in its
+ * limit. */
+static void cache_trim ()
+{
+	DIR *dir;
+	struct dirent *d;
+	struct cache_entry *entries = NULL;
+	int ix, num = 0, alloc = 0;
+	off_t total = 0;
+
+	if (!(dir = opendir (cache_dir)))
+		return;
+
+	while ((d = readdir (dir))) {
+		char *dot = strrchr (d->d_name, '.');
+		struct stat data_st, idx_st;
+		char *path;
+
+		if (!dot || strcmp (dot, ".data"))
+			continue;
+
+		path = format_msg ("%s/%s", cache_dir, d->d_name);
+		if (stat (path, &data_st) == -1) {
+			free (path);
+			continue;
+		}
+
+		strcpy (strrchr (path, '.'), ".idx");
+		if (stat (path, &idx_st) == -1)
+			idx_st.st_mtime = 0;
+		*strrchr (path, '.') = 0;
+
+		if (num == alloc) {
+			alloc = alloc ? alloc * 2 : 16;
+			entries = xrealloc (entries,
+					alloc * sizeof (struct cache_entry));
+		}
+		entries[num].name = path;
+		entries[num].mtime = idx_st.st_mtime;
+		entries[num].size = (off_t)data_st.st_blocks * 512;
+		total += entries[num].size;
+		num += 1;
+	}
+
+	closedir (dir);
+
+	qsort (entries, num, sizeof (struct cache_entry), cache_entry_cmp);
+
+	for (ix = 0; ix < num; ix += 1) {
+		if (total > cache_limit) {
+			char *path;
+
+			debug ("Removing %s from the HTTP cache", entries[ix].name);
+			path = format_msg ("%s.data", entries[ix].name);
+			unlink (path);
+			free (path);
+			path = format_msg ("%s.idx", entries[ix].name);
+			unlink (path);
+			free (path);
+			total -= entries[ix].size;
+		}
+		free (entries[ix].name);
+	}
+
+	free (entries);
+}
+
+/* Save and close the cache entry of the stream. */
+static void cache_close (struct io_stream *s)
+{
+	if (s->curl.cache_fd == -1)
+		return;
+
+	if (s->curl.ranges_num)
+		cache_save_index (s);
+	cache_drop (s);
+	cache_trim ();
 }
 
 static size_t write_cb (void *data, size_t size, size_t nmemb,
@@ -59,12 +568,58 @@ static size_t write_cb (void *data, size_t size, size_t nmemb,
 	size_t buf_start = s->curl.buf_fill;
 	size_t data_size = size * nmemb;
 
-	s->curl.buf_fill += data_size;
 	debug ("Got %zu bytes", data_size);
-	s->curl.buf = (char *)xrealloc (s->curl.buf, s->curl.buf_fill);
-	memcpy (s->curl.buf + buf_start, data, data_size);
 
-	return data_size;
+	/* The server has sent the whole resource instead of the range. */
+	if (s->curl.skip) {
+		size_t skipped = MIN((off_t)data_size, s->curl.skip);
+
+		s->curl.skip -= skipped;
+		if (skipped == data_size)
+			return size * nmemb;
+		data = (char *)data + skipped;
+		data_size -= skipped;
+	}
+
+	/* Cached data are read from the cache. */
+	if (s->curl.cache_fd == -1 || !cache_store (s, s->curl.net_pos,
+	                                            data, data_size)) {
+		s->curl.buf_fill += data_size;
+		s->curl.buf = (char *)xrealloc (s->curl.buf, s->curl.buf_fill);
+		memcpy (s->curl.buf + buf_start, data, data_size);
+	}
+
+	s->curl.net_pos += data_size;
+
+	return size * nmemb;
+}
+
+/* Handle the status line of a response. */
+static void response_start (struct io_stream *s, const char *status)
+{
+	const char *code = strchr (status, ' ');
+
+	s->curl.http_code = code ? atoi (code + 1) : 0;
+
+	/* Only the last response (after redirections) counts. */
+	if (s->curl.requests == 1) {
+		s->size = -1;
+		s->curl.accept_ranges = 0;
+		free (s->curl.etag);
+		s->curl.etag = NULL;
+	}
+	else if (s->curl.http_code == 200)
+		s->curl.skip = s->curl.net_pos;
+	else
+		s->curl.skip = 0;
+}
+
+/* Handle the end of the response headers. */
+static void response_headers_done (struct io_stream *s)
+{
+	if (s->curl.requests == 1 && s->curl.http_code / 100 == 2
+			&& s->curl.cache_fd == -1)
+		cache_open (s);
 }
 
 static size_t header_cb (void *data, size_t size, size_t nmemb,
@@ -76,8 +631,10 @@ static size_t header_cb (void *data, size_t size, size_t nmemb,
 
 	assert (s != NULL);
 
-	if (size * nmemb <= 2)
+	if (size * nmemb <= 2) {
+		response_headers_done (s);
 		return size * nmemb;
+	}
 
 	/* we dont need '\r\n', so cut it. */
 	header_size = sizeof(char) * (size * nmemb + 1 - 2);
@@ -87,9 +644,49 @@ static size_t header_cb (void *data, size_t size, size_t nmemb,
 	memcpy (header, data, size * nmemb - 2);
 	header[header_size-1] = 0;
 
-	if (!strncasecmp(header, "Location:", sizeof("Location:")-1)) {
+	if (!strncmp(header, "HTTP/", sizeof("HTTP/")-1)
+			|| !strncmp(header, "ICY ", sizeof("ICY ")-1)) {
+		response_start (s, header);
+	}
+	else if (!strncasecmp(header, "Location:", sizeof("Location:")-1)) {
 		s->curl.got_locn = 1;
 	}
+	else if (!strncasecmp(header, "ETag:", sizeof("ETag:")-1)) {
+		char *value = header + sizeof("ETag:") - 1;
+
+		while (isblank(value[0]))
+			value++;
+
+		if (s->curl.requests == 1)
+			s->curl.etag = xstrdup (value);
+		else if (s->curl.etag && strcmp (s->curl.etag, value)) {
+			logit ("The resource has changed on the server");
+			free (header);
+			return 0;
+		}
+	}
+	else if (s->curl.requests > 1) {
+		/* Other headers of the following range requests
+		 * tell nothing new. */
+	}
+	else if (!strncasecmp(header, "Accept-Ranges:",
+				sizeof("Accept-Ranges:")-1)) {
+		char *value = header + sizeof("Accept-Ranges:") - 1;
+
+		while (isblank(value[0]))
+			value++;
+
+		s->curl.accept_ranges = !strcasecmp (value, "bytes");
+	}
+	else if (!strncasecmp(header, "Content-Length:",
+				sizeof("Content-Length:")-1)) {
+		char *end;
+		char *value = header + sizeof("Content-Length:") - 1;
+		long long length = strtoll (value, &end, 10);
+
+		if (s->curl.http_code == 200 && !*end && length > 0)
+			s->size = length;
+	}
 	else if (!strncasecmp(header, "Content-Type:", sizeof("Content-Type:")-1)) {
 		/* If we got redirected then use the last MIME type. */
 		if (s->curl.got_locn && s->curl.mime_type) {
@@ -142,6 +739,16 @@ static size_t header_cb (void *data, size_t size, size_t nmemb,
 		else
 			debug ("Icy metadata interval: %zu", s->curl.icy_meta_int);
 	}
+	else if (!strncasecmp(header, "icy-br:", sizeof("icy-br:")-1)) {
+		char *value = strchr (header, ':') + 1;
+
+		/* Some servers list the bitrates of all the streams,
+		 * the first one is taken. */
+		s->curl.icy_br = atoi (value);
+		if (s->curl.icy_br < 0)
+			s->curl.icy_br = 0;
+		debug ("Icy bitrate: %d kbps", s->curl.icy_br);
+	}
 
 	free (header);
 
@@ -204,6 +811,7 @@ static int check_curl_stream (struct io_stream *s)
 			curl_multi_remove_handle (s->curl.multi_handle, s->curl.handle);
 			curl_easy_cleanup (s->curl.handle);
 			s->curl.handle = NULL;
+			s->curl.finished = 1;
 			debug ("EOF");
 			break;
 		}
@@ -212,43 +820,39 @@ static int check_curl_stream (struct io_stream *s)
 	return res;
 }
 
-void io_curl_open (struct io_stream *s, const char *url)
+/* Stop the transfer and drop the data which were not read yet. */
+static void curl_stop (struct io_stream *s)
 {
-	s->source = IO_SOURCE_CURL;
-	s->curl.url = NULL;
-	s->curl.http_headers = NULL;
-	s->curl.buf = NULL;
-	s->curl.buf_fill = 0;
-	s->curl.need_perform_loop = 1;
-	s->curl.got_locn = 0;
-
-	s->curl.wake_up_pipe[0] = -1;
-	s->curl.wake_up_pipe[1] = -1;
+	if (s->curl.handle) {
+		curl_multi_remove_handle (s->curl.multi_handle, s->curl.handle);
+		curl_easy_cleanup (s->curl.handle);
+		s->curl.handle = NULL;
+	}
 
-	if (!(s->curl.multi_handle = curl_multi_init())) {
-		logit ("curl_multi_init() returned NULL");
-		s->errno_val = EINVAL;
-		return;
+	if (s->curl.buf) {
+		free (s->curl.buf);
+		s->curl.buf = NULL;
 	}
+	s->curl.buf_fill = 0;
+}
+
+/* (Re)start the transfer of the resource at the byte from.  Return 0 on
+ * error. */
+static int curl_start (struct io_stream *s, const off_t from)
+{
+	curl_stop (s);
 
 	if (!(s->curl.handle = curl_easy_init())) {
 		logit ("curl_easy_init() returned NULL");
 		s->errno_val = EINVAL;
-		return;
+		return 0;
 	}
 
-	s->curl.multi_status = CURLM_OK;
-	s->curl.status = CURLE_OK;
-
-	s->curl.url = xstrdup (url);
-	s->curl.icy_meta_int = 0;
-	s->curl.icy_meta_count = 0;
-
-	s->curl.http200_aliases = curl_slist_append (NULL, "ICY");
-	s->curl.http_headers = curl_slist_append (NULL, "Icy-MetaData: 1");
-
 	curl_easy_setopt (s->curl.handle, CURLOPT_NOPROGRESS, 1);
-	curl_easy_setopt (s->curl.handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_0);
+	/* HTTP/1.1 so the connection is kept alive for the next request. */
+	curl_easy_setopt (s->curl.handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+	if (share)
+		curl_easy_setopt (s->curl.handle, CURLOPT_SHARE, share);
 	curl_easy_setopt (s->curl.handle, CURLOPT_WRITEFUNCTION, write_cb);
 	curl_easy_setopt (s->curl.handle, CURLOPT_WRITEDATA, s);
 	curl_easy_setopt (s->curl.handle, CURLOPT_HEADERFUNCTION, header_cb);
@@ -270,13 +874,85 @@ void io_curl_open (struct io_stream *s, const char *url)
 	curl_easy_setopt (s->curl.handle, CURLOPT_DEBUGFUNCTION, debug_cb);
 #endif
 
+	if (from > 0) {
+		char range[32];
+
+		snprintf (range, sizeof(range), "%"PRId64"-", (int64_t)from);
+		curl_easy_setopt (s->curl.handle, CURLOPT_RANGE, range);
+		logit ("Requesting the stream from byte %"PRId64, (int64_t)from);
+	}
+
+	s->curl.requests += 1;
+	if (s->curl.requests > 1)
+		ATOMIC_STORE (&s->stats.reconnects, s->stats.reconnects + 1);
+	s->curl.net_pos = from;
+	s->curl.skip = 0;
+	s->curl.finished = 0;
+	s->curl.need_perform_loop = 1;
+
 	if ((s->curl.multi_status = curl_multi_add_handle(s->curl.multi_handle,
 					s->curl.handle)) != CURLM_OK) {
 		logit ("curl_multi_add_handle() failed");
 		s->errno_val = EINVAL;
+		return 0;
+	}
+
+	return 1;
+}
+
+void io_curl_open (struct io_stream *s, const char *url)
+{
+	s->source = IO_SOURCE_CURL;
+	s->curl.url = NULL;
+	s->curl.http_headers = NULL;
+	s->curl.http200_aliases = NULL;
+	s->curl.handle = NULL;
+	s->curl.buf = NULL;
+	s->curl.buf_fill = 0;
+	s->curl.need_perform_loop = 1;
+	s->curl.got_locn = 0;
+	s->curl.requests = 0;
+	s->curl.http_code = 0;
+	s->curl.accept_ranges = 0;
+	s->curl.etag = NULL;
+	s->curl.pos = 0;
+	s->curl.net_pos = 0;
+	s->curl.skip = 0;
+	s->curl.finished = 0;
+	s->curl.interrupt = 0;
+	s->curl.cache_fd = -1;
+	s->curl.cache_name = NULL;
+	s->curl.ranges = NULL;
+	s->curl.ranges_num = 0;
+	s->curl.cache_complete = 0;
+	s->curl.icy_br = 0;
+	s->curl.rate_bytes = 0;
+	s->curl.rate_usec = 0;
+	s->curl.rate = 0;
+	s->curl.rate_dev = 0;
+
+	s->curl.wake_up_pipe[0] = -1;
+	s->curl.wake_up_pipe[1] = -1;
+
+	if (!(s->curl.multi_handle = curl_multi_init())) {
+		logit ("curl_multi_init() returned NULL");
+		s->errno_val = EINVAL;
 		return;
 	}
 
+	s->curl.multi_status = CURLM_OK;
+	s->curl.status = CURLE_OK;
+
+	s->curl.url = xstrdup (url);
+	s->curl.icy_meta_int = 0;
+	s->curl.icy_meta_count = 0;
+
+	s->curl.http200_aliases = curl_slist_append (NULL, "ICY");
+	s->curl.http_headers = curl_slist_append (NULL, "Icy-MetaData: 1");
+
+	if (!curl_start (s, 0))
+		return;
+
 	if (pipe(s->curl.wake_up_pipe) < 0) {
 		log_errno ("pipe() failed", errno);
 		s->errno_val = EINVAL;
@@ -291,6 +967,8 @@ void io_curl_close (struct io_stream *s)
 	assert (s != NULL);
 	assert (s->source == IO_SOURCE_CURL);
 
+	cache_close (s);
+
 	if (s->curl.url)
 		free (s->curl.url);
 	if (s->curl.http_headers)
@@ -299,6 +977,7 @@ void io_curl_close (struct io_stream *s)
 		free (s->curl.buf);
 	if (s->curl.mime_type)
 		free (s->curl.mime_type);
+	free (s->curl.etag);
 
 	if (s->curl.multi_handle && s->curl.handle)
 		curl_multi_remove_handle (s->curl.multi_handle, s->curl.handle);
@@ -319,10 +998,10 @@ void io_curl_close (struct io_stream *s)
 /* Get data using curl and put them into the internal buffer.
  * Even if the internal buffer is not empty, more data will be read.
  * Return 0 on error. */
-static int curl_read_internal (struct io_stream *s)
+static int curl_read_net (struct io_stream *s)
 {
 	int running = 1;
-	long buf_fill_before = s->curl.buf_fill;
+	off_t net_pos_before = s->curl.net_pos;
 
 	if (s->curl.need_perform_loop) {
 		debug ("Starting curl...");
@@ -338,7 +1017,7 @@ static int curl_read_internal (struct io_stream *s)
 		s->curl.need_perform_loop = 0;
 	}
 
-	while (s->opened && running && buf_fill_before == s->curl.buf_fill
+	while (s->opened && running && net_pos_before == s->curl.net_pos
 			&& s->curl.handle
 			&& (s->curl.multi_status == CURLM_CALL_MULTI_PERFORM
 				|| s->curl.multi_status == CURLM_OK)) {
@@ -389,7 +1068,11 @@ static int curl_read_internal (struct io_stream *s)
 				return 1;
 
 			if (FD_ISSET(s->curl.wake_up_pipe[0], &read_fds)) {
+				int w;
+
 				logit ("Got wake up - exiting");
+				if (read (s->curl.wake_up_pipe[0], &w, sizeof(w)) < 0)
+					log_errno ("read() failed", errno);
 				return 1;
 			}
 
@@ -405,6 +1088,78 @@ static int curl_read_internal (struct io_stream *s)
 	return 1;
 }
 
+/* Take a throughput sample of the data which arrived while we were
+ * waiting for them.  The average and its deviation are kept the way TCP
+ * estimates the round trip time, the deviation tells how bursty the
+ * connection is. */
+static void rate_update (struct io_stream *s, const long bytes,
+                         const long usec)
+{
+	long sample, rate, dev;
+
+	s->curl.rate_bytes += bytes;
+	s->curl.rate_usec += usec;
+	if (s->curl.rate_usec < RATE_WINDOW)
+		return;
+
+	sample = (long)((double)s->curl.rate_bytes * 1000000.0
+	                / s->curl.rate_usec);
+	s->curl.rate_bytes = 0;
+	s->curl.rate_usec = 0;
+
+	rate = s->curl.rate;
+	dev = s->curl.rate_dev;
+	if (rate == 0) {
+		rate = sample;
+		dev = sample / 2;
+	}
+	else {
+		dev += (labs (sample - rate) - dev) / 4;
+		rate += (sample - rate) / 8;
+	}
+
+	ATOMIC_STORE (&s->curl.rate, MAX(rate, 1));
+	ATOMIC_STORE (&s->curl.rate_dev, dev);
+	debug ("Throughput %ld B/s (sample %ld, deviation %ld)",
+	       rate, sample, dev);
+}
+
+/* Read from the network, measuring only the time spent waiting for it so
+ * that a slow reader doesn't lower the throughput.  Return 0 on error. */
+static int curl_read_internal (struct io_stream *s)
+{
+	struct timespec start, end;
+	off_t net_pos_before = s->curl.net_pos;
+	int res;
+
+	get_realtime (&start);
+	res = curl_read_net (s);
+	get_realtime (&end);
+
+	if (res && s->curl.net_pos > net_pos_before && end.tv_sec >= start.tv_sec)
+		rate_update (s, s->curl.net_pos - net_pos_before,
+		             (end.tv_sec - start.tv_sec) * 1000000L
+		             + (end.tv_nsec - start.tv_nsec) / 1000L);
+
+	return res;
+}
+
+/* Remove count bytes from the beginning of the internal buffer. */
+static void consume_buffer (struct io_stream *s, const long count)
+{
+	s->curl.buf_fill -= count;
+	s->curl.pos += count;
+
+	if (s->curl.buf_fill) {
+		memmove (s->curl.buf, s->curl.buf + count, s->curl.buf_fill);
+		s->curl.buf = (char *)xrealloc (s->curl.buf, s->curl.buf_fill);
+	}
+	else {
+		free (s->curl.buf);
+		s->curl.buf = NULL;
+	}
+}
+
 /* Read data from the internal buffer to buf. Return the number of bytes read.
  */
 static size_t read_from_buffer (struct io_stream *s, char *buf, size_t count)
@@ -415,18 +1170,7 @@ static size_t read_from_buffer (struct io_stream *s, char *buf, size_t count)
 		/*debug ("Copying %ld bytes", to_copy);*/
 
 		memcpy (buf, s->curl.buf, to_copy);
-		s->curl.buf_fill -= to_copy;
-
-		if (s->curl.buf_fill) {
-			memmove (s->curl.buf, s->curl.buf + to_copy,
-					s->curl.buf_fill);
-			s->curl.buf = (char *)xrealloc (s->curl.buf,
-					s->curl.buf_fill);
-		}
-		else {
-			free (s->curl.buf);
-			s->curl.buf = NULL;
-		}
+		consume_buffer (s, to_copy);
 
 		return to_copy;
 	}
@@ -434,6 +1178,23 @@ static size_t read_from_buffer (struct io_stream *s, char *buf, size_t count)
 	return 0;
 }
 
+/* Make the internal buffer start at the stream position, restarting the
+ * transfer there if it is not on its way.  Return 0 on error. */
+static int curl_sync (struct io_stream *s)
+{
+	off_t buf_start = s->curl.net_pos - s->curl.buf_fill;
+
+	if (s->curl.pos >= buf_start && s->curl.pos <= s->curl.net_pos
+			&& (s->curl.handle || s->curl.finished
+				|| s->curl.pos < s->curl.net_pos)) {
+		if (s->curl.pos > buf_start)
+			consume_buffer (s, s->curl.pos - buf_start);
+		return 1;
+	}
+
+	return curl_start (s, s->curl.pos);
+}
+
 /* Parse icy string in form: StreamTitle='my music';StreamUrl='www.x.com' */
 static void parse_icy_string (struct io_stream *s, const char *str)
 {
@@ -574,6 +1335,9 @@ ssize_t io_curl_read (struct io_stream *s, char *buf, size_t count)
 		size_t to_read;
 		size_t res;
 
+		if (s->size > 0 && s->curl.pos >= s->size)
+			break;
+
 		if (s->curl.icy_meta_int && s->curl.icy_meta_count
 				== s->curl.icy_meta_int) {
 			s->curl.icy_meta_count = 0;
@@ -587,6 +1351,15 @@ ssize_t io_curl_read (struct io_stream *s, char *buf, size_t count)
 		else
 			to_read = count - nread;
 
+		res = cache_read (s, buf + nread, to_read);
+		if (res) {
+			nread += res;
+			continue;
+		}
+
+		if (!curl_sync(s))
+			return -1;
+
 		res = read_from_buffer (s, buf + nread, to_read);
 		if (s->curl.icy_meta_int)
 			s->curl.icy_meta_count += res;
@@ -596,11 +1369,83 @@ ssize_t io_curl_read (struct io_stream *s, char *buf, size_t count)
 		if (nread < count && !curl_read_internal(s))
 			return -1;
 	} while (nread < count && !s->stop_read_thread
-			&& s->curl.handle); /* s->curl.handle == NULL on EOF */
+			&& !ATOMIC_LOAD(&s->curl.interrupt)
+			&& (s->curl.handle || s->curl.buf_fill
+				|| cached_at(s, s->curl.pos)));
+			/* no handle and no data on EOF */
 
 	return nread;
 }
 
+/* Move the stream position, the data are fetched from there on the next
+ * read. */
+off_t io_curl_seek (struct io_stream *s, const off_t where)
+{
+	assert (s != NULL);
+	assert (s->source == IO_SOURCE_CURL);
+
+	ATOMIC_STORE (&s->curl.interrupt, 0);
+
+	return (s->curl.pos = where);
+}
+
+/* Return a non-zero value if io_curl_seek() can be used on the stream.
+ * That's known once the response headers have arrived. */
+int io_curl_seekable (const struct io_stream *s)
+{
+	assert (s != NULL);
+	assert (s->source == IO_SOURCE_CURL);
+
+	return s->size > 0 && !s->curl.icy_meta_int
+		&& (s->curl.accept_ranges
+		    || ATOMIC_LOAD(&s->curl.cache_complete));
+}
+
+/* Return how much of the stream should be buffered before playing so
+ * that, with the throughput and burstiness measured so far, the buffer
+ * is not expected to run dry.  The bitrate of the stream is in kbps, if
+ * it's not positive the icy-br header is used.  Return 0 if there is not
+ * enough information. */
+size_t io_curl_prebuffer_target (const struct io_stream *s, int bitrate)
+{
+	long rate, dev, worst;
+	double need, margin;
+
+	assert (s != NULL);
+	assert (s->source == IO_SOURCE_CURL);
+
+	rate = ATOMIC_LOAD (&s->curl.rate);
+	dev = ATOMIC_LOAD (&s->curl.rate_dev);
+	if (bitrate <= 0)
+		bitrate = s->curl.icy_br;
+	if (rate == 0 || bitrate <= 0)
+		return 0;
+
+	/* Bytes played per second. */
+	need = bitrate * 1000.0 / 8.0;
+
+	/* A second of sound and more for bursty connections. */
+	margin = 1.0 + 4.0 * dev / rate;
+
+	/* If the throughput may drop below the bitrate, buffer what is
+	 * missing during such a drop. */
+	worst = rate - 2 * dev;
+	if (worst < need)
+		margin *= need / MAX(worst, need / 4.0);
+
+	return (size_t)(need * margin);
+}
+
+/* Make a pending io_curl_read() return what it has got so far. */
+void io_curl_interrupt (struct io_stream *s)
+{
+	assert (s != NULL);
+	assert (s->source == IO_SOURCE_CURL);
+
+	ATOMIC_STORE (&s->curl.interrupt, 1);
+	io_curl_wake_up (s);
+}
+
 /* Set the error string for the stream. */
 void io_curl_strerror (struct io_stream *s)
 {
@@ -14,6 +14,11 @@ void io_curl_close (struct io_stream *s);
 ssize_t io_curl_read (struct io_stream *s, char *buf, size_t count);
 void io_curl_strerror (struct io_stream *s);
 void io_curl_wake_up (struct io_stream *s);
+off_t io_curl_seek (struct io_stream *s, const off_t where);
+int io_curl_seekable (const struct io_stream *s);
+void io_curl_interrupt (struct io_stream *s);
+void io_curl_preconnect (const char *url);
+size_t io_curl_prebuffer_target (const struct io_stream *s, int bitrate);
 
 #ifdef __cplusplus
 }
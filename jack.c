@@ -37,11 +37,13 @@ static jack_default_audio_sample_t volume = 1.0;
 static int volume_integer = 100;
 /* indicates if we should be playing or not */
 static int play;
-/* current sample rate */
+/* current sample rate, changed by jack at any time */
 static int rate;
+/* sample rate when the device was opened */
+static int open_rate;
 /* flag set if xrun occurred that was our fault (the ringbuffer doesn't
  * contain enough data in the process callback) */
-static volatile int our_xrun = 0;
+static int our_xrun = 0;
 /* set to 1 if jack client thread exits */
 static volatile int jack_shutdown = 0;
 
@@ -83,7 +85,7 @@ static int process_cb(jack_nframes_t nframes, void *unused ATTR_UNUSED)
 		/* we must provide nframes data, so fill with silence
 		 * the remaining space. */
 		if (avail_frames < nframes) {
-			our_xrun = 1;
+			ATOMIC_STORE (&our_xrun, 1);
 
 			for (i = avail_frames; i < nframes; i++)
 				out[0][i] = out[1][i] = 0.0;
@@ -107,11 +109,12 @@ static int process_cb(jack_nframes_t nframes, void *unused ATTR_UNUSED)
 	return 0;
 }
 
-/* this is called if jack changes its sample rate */
+/* this is called if jack changes its sample rate; sound is converted to
+ * the new rate from the next open, the client stays as it is */
 static int update_sample_rate_cb(jack_nframes_t new_rate,
 		void *unused ATTR_UNUSED)
 {
-	rate = new_rate;
+	ATOMIC_STORE (&rate, (int)new_rate);
 	return 0;
 }
 
@@ -222,6 +225,7 @@ static int moc_jack_open (struct sound_params *sound_params)
 	}
 
 	logit ("jack open");
+	open_rate = ATOMIC_LOAD (&rate);
 	play = 1;
 
 	return 1;
@@ -233,10 +237,44 @@ static void moc_jack_close ()
 	play = 0;
 }
 
+/* De-interleave frames of stereo float sound straight into the ring
+ * buffers, applying the volume.  There must be room for them. */
+static void write_frames (const jack_default_audio_sample_t *frames,
+		const size_t count)
+{
+	int ch;
+
+	for (ch = 0; ch < 2; ch++) {
+		jack_ringbuffer_data_t vec[2];
+		size_t done = 0;
+		int part;
+
+		jack_ringbuffer_get_write_vector (ringbuffer[ch], vec);
+
+		for (part = 0; part < 2 && done < count; part++) {
+			jack_default_audio_sample_t *out
+				= (jack_default_audio_sample_t *)vec[part].buf;
+			size_t i, n;
+
+			n = MIN(count - done, vec[part].len
+					/ sizeof(jack_default_audio_sample_t));
+			for (i = 0; i < n; i++)
+				out[i] = frames[2 * (done + i) + ch] * volume;
+			done += n;
+		}
+
+		assert (done == count);
+		jack_ringbuffer_write_advance (ringbuffer[ch],
+				count * sizeof(jack_default_audio_sample_t));
+	}
+}
+
 static int moc_jack_play (const char *buff, const size_t size)
 {
-	size_t remain = size;
-	size_t pos = 0;
+	const size_t frame_size = 2 * sizeof(jack_default_audio_sample_t);
+	size_t remain = size / frame_size;
+	const jack_default_audio_sample_t *frames
+		= (const jack_default_audio_sample_t *)buff;
 
 	if (jack_shutdown) {
 		logit ("Refusing to play, because there is no client thread.");
@@ -245,44 +283,32 @@ static int moc_jack_play (const char *buff, const size_t size)
 
 	debug ("Playing %zu bytes", size);
 
-	if (our_xrun) {
+	if (ATOMIC_XCHG (&our_xrun, 0))
 		logit ("xrun");
-		our_xrun = 0;
+
+	if (ATOMIC_LOAD (&rate) != open_rate) {
+		logit ("JACK sample rate has changed to %d Hz",
+				ATOMIC_LOAD (&rate));
+		open_rate = ATOMIC_LOAD (&rate);
 	}
 
 	while (remain && !jack_shutdown) {
 		size_t space;
 
-		/* check if some space is available only in the second
-		 * ringbuffer, because it is read later than the first. */
-		if ((space = jack_ringbuffer_write_space(ringbuffer[1]))
-				> sizeof(jack_default_audio_sample_t)) {
-			size_t to_write;
-
-			space *= 2; /* we have 2 channels */
-			debug ("Space in the ringbuffer: %zu bytes", space);
-
-			to_write = MIN (space, remain);
-
-			to_write /= sizeof(jack_default_audio_sample_t) * 2;
-			remain -= to_write * sizeof(float) * 2;
-			while (to_write--) {
-				jack_default_audio_sample_t sample;
-
-				sample = *(jack_default_audio_sample_t *)
-					(buff + pos) * volume;
-				pos += sizeof (jack_default_audio_sample_t);
-				jack_ringbuffer_write (ringbuffer[0],
-						(char *)&sample,
-						sizeof(sample));
-
-				sample = *(jack_default_audio_sample_t *)
-					(buff + pos) * volume;
-				pos += sizeof (jack_default_audio_sample_t);
-				jack_ringbuffer_write (ringbuffer[1],
-						(char *)&sample,
-						sizeof(sample));
-			}
+		/* ringbuffer[1] is written after ringbuffer[0], but check
+		 * both to be sure. */
+		space = MIN(jack_ringbuffer_write_space (ringbuffer[0]),
+		            jack_ringbuffer_write_space (ringbuffer[1]))
+			/ sizeof(jack_default_audio_sample_t);
+
+		if (space) {
+			size_t to_write = MIN(space, remain);
+
+			debug ("Space in the ringbuffer: %zu frames", space);
+
+			write_frames (frames, to_write);
+			frames += 2 * to_write;
+			remain -= to_write;
 		}
 		else {
 			debug ("Sleeping for %uus", (unsigned int)(RINGBUF_SZ
@@ -335,7 +361,7 @@ static void moc_jack_shutdown(){
 
 static int moc_jack_get_rate ()
 {
-	return rate;
+	return ATOMIC_LOAD (&rate);
 }
 
 static char *moc_jack_get_mixer_channel_name ()
@@ -239,6 +239,14 @@ static struct command commands[] = {
 		{ 'Y', -1 },
 		1
 	},
+	{
+		KEY_CMD_PLIST_SORT_TAGS,
+		"plist_sort_tags",
+		"Sort the playlist by artist, album, track and title",
+		CON_MENU,
+		{ -1 },
+		0
+	},
 	{
 		KEY_CMD_MIXER_DEC_1,
 		"volume_down_1",
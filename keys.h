@@ -30,6 +30,7 @@ enum key_cmd
 	KEY_CMD_PLIST_CLEAR,
 	KEY_CMD_PLIST_ADD_DIR,
 	KEY_CMD_PLIST_REMOVE_DEAD_ENTRIES,
+	KEY_CMD_PLIST_SORT_TAGS,
 	KEY_CMD_MIXER_DEC_1,
 	KEY_CMD_MIXER_INC_1,
 	KEY_CMD_MIXER_DEC_5,
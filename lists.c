@@ -21,11 +21,25 @@
 
 #include "common.h"
 #include "lists.h"
+#include "sort_keys.h"
+
+/* Strings of an arena list are copied into blocks owned by the list
+ * instead of being malloc()ed one by one. */
+#define ARENA_BLOCK_MIN 4096
+
+struct arena_block {
+	struct arena_block *next;    /* Older block */
+	size_t size;
+	size_t used;
+	char data[];
+};
 
 struct lists_strs {
 	int size;          /* Number of strings on the list */
 	int capacity;      /* Number of allocated strings */
 	char **strs;
+	bool arena;        /* Strings are in the blocks below */
+	struct arena_block *blocks;  /* Newest first */
 };
 
 /* Allocate a new list of strings and return its address. */
@@ -39,10 +53,64 @@ lists_t_strs *lists_strs_new (int reserve)
 	result->size = 0;
 	result->capacity = (reserve ? reserve : 64);
 	result->strs = (char **) xcalloc (sizeof (char *), result->capacity);
+	result->arena = false;
+	result->blocks = NULL;
+
+	return result;
+}
+
+/* Allocate a new list which keeps its strings in an arena: they are not
+ * freed one by one, but all together when the list is cleared or freed.
+ * It suits lists which are filled and dropped as a whole.  Strings
+ * pushed onto it are copied in and freed, and those popped or swapped
+ * out are copies the caller must free, as with other lists. */
+lists_t_strs *lists_strs_new_arena (int reserve)
+{
+	lists_t_strs *result;
+
+	result = lists_strs_new (reserve);
+	result->arena = true;
 
 	return result;
 }
 
+/* Return a copy of the string in the list's arena. */
+static char *arena_strdup (lists_t_strs *list, const char *s)
+{
+	size_t len = strlen (s) + 1;
+	struct arena_block *block = list->blocks;
+	char *result;
+
+	if (!block || block->size - block->used < len) {
+		size_t size = block ? block->size * 2 : ARENA_BLOCK_MIN;
+
+		while (size < len)
+			size *= 2;
+		block = (struct arena_block *) xmalloc (sizeof (struct arena_block) + size);
+		block->next = list->blocks;
+		block->size = size;
+		block->used = 0;
+		list->blocks = block;
+	}
+
+	result = block->data + block->used;
+	memcpy (result, s, len);
+	block->used += len;
+
+	return result;
+}
+
+/* Free the arena block and all older ones. */
+static void arena_free_blocks (struct arena_block *block)
+{
+	while (block) {
+		struct arena_block *next = block->next;
+
+		free (block);
+		block = next;
+	}
+}
+
 /* Clear a list to an empty state. */
 void lists_strs_clear (lists_t_strs *list)
 {
@@ -50,8 +118,19 @@ void lists_strs_clear (lists_t_strs *list)
 
 	assert (list);
 
-	for (ix = 0; ix < list->size; ix += 1)
-		free ((void *) list->strs[ix]);
+	if (list->arena) {
+
+		/* Keep the largest block for the strings added next. */
+		if (list->blocks) {
+			arena_free_blocks (list->blocks->next);
+			list->blocks->next = NULL;
+			list->blocks->used = 0;
+		}
+	}
+	else {
+		for (ix = 0; ix < list->size; ix += 1)
+			free ((void *) list->strs[ix]);
+	}
 	list->size = 0;
 }
 
@@ -61,6 +140,7 @@ void lists_strs_free (lists_t_strs *list)
 	assert (list);
 
 	lists_strs_clear (list);
+	arena_free_blocks (list->blocks);
 	free (list->strs);
 	free (list);
 }
@@ -107,6 +187,32 @@ void lists_strs_sort (lists_t_strs *list, lists_t_compare *compare)
 	qsort (list->strs, list->size, sizeof (char *), compare);
 }
 
+/* Sort string list into the collation order of the locale.  If natural
+ * is set, numbers in the strings are compared by value. */
+void lists_strs_collate (lists_t_strs *list, bool natural)
+{
+	int ix;
+	char **strs;
+	struct sort_keys *keys;
+
+	assert (list);
+
+	keys = sort_keys_new (list->size, natural);
+	for (ix = 0; ix < list->size; ix += 1) {
+		sort_keys_add_text (keys, list->strs[ix]);
+		sort_keys_next (keys, ix);
+	}
+	sort_keys_sort (keys);
+
+	strs = (char **) xcalloc (sizeof (char *), list->capacity);
+	for (ix = 0; ix < list->size; ix += 1)
+		strs[ix] = list->strs[sort_keys_index (keys, ix)];
+
+	free (list->strs);
+	list->strs = strs;
+	sort_keys_free (keys);
+}
+
 /* Reverse the order of entries in a list. */
 void lists_strs_reverse (lists_t_strs *list)
 {
@@ -130,6 +236,13 @@ void lists_strs_push (lists_t_strs *list, char *s)
 	assert (list);
 	assert (s);
 
+	if (list->arena) {
+		char *copy = arena_strdup (list, s);
+
+		free (s);
+		s = copy;
+	}
+
 	if (list->size == list->capacity) {
 		list->capacity *= 2;
 		list->strs = (char **) xrealloc (list->strs, list->capacity * sizeof (char *));
@@ -151,6 +264,8 @@ char *lists_strs_pop (lists_t_strs *list)
 	if (list->size > 0) {
 		list->size -= 1;
 		result = list->strs[list->size];
+		if (list->arena)
+			result = xstrdup (result);
 	}
 
 	return result;
@@ -166,7 +281,13 @@ char *lists_strs_swap (lists_t_strs *list, int index, char *s)
 	assert (s);
 
 	result = list->strs[index];
-	list->strs[index] = s;
+	if (list->arena) {
+		result = xstrdup (result);
+		list->strs[index] = arena_strdup (list, s);
+		free (s);
+	}
+	else
+		list->strs[index] = s;
 
 	return result;
 }
@@ -179,6 +300,16 @@ void lists_strs_append (lists_t_strs *list, const char *s)
 	assert (list);
 	assert (s);
 
+	if (list->arena) {
+		if (list->size == list->capacity) {
+			list->capacity *= 2;
+			list->strs = (char **) xrealloc (list->strs, list->capacity * sizeof (char *));
+		}
+		list->strs[list->size] = arena_strdup (list, s);
+		list->size += 1;
+		return;
+	}
+
 	str = xstrdup (s);
 	lists_strs_push (list, str);
 }
@@ -190,6 +321,12 @@ void lists_strs_remove (lists_t_strs *list)
 
 	assert (list);
 
+	if (list->arena) {
+		if (list->size > 0)
+			list->size -= 1;
+		return;
+	}
+
 	str = lists_strs_pop (list);
 	if (str)
 		free (str);
@@ -204,6 +341,11 @@ void lists_strs_replace (lists_t_strs *list, int index, char *s)
 	assert (list);
 	assert (LIMIT(index, list->size));
 
+	if (list->arena) {
+		list->strs[index] = arena_strdup (list, s);
+		return;
+	}
+
 	str = xstrdup (s);
 	str = lists_strs_swap (list, index, str);
 	free (str);
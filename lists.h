@@ -12,6 +12,7 @@ typedef int lists_t_compare (const void *, const void *);
 
 /* List administration functions. */
 lists_t_strs *lists_strs_new (int reserve);
+lists_t_strs *lists_strs_new_arena (int reserve);
 void lists_strs_clear (lists_t_strs *list);
 void lists_strs_free (lists_t_strs *list);
 int lists_strs_size (const lists_t_strs *list);
@@ -23,6 +24,7 @@ char *lists_strs_at (const lists_t_strs *list, int index);
 
 /* List mutating functions. */
 void lists_strs_sort (lists_t_strs *list, lists_t_compare *compare);
+void lists_strs_collate (lists_t_strs *list, bool natural);
 void lists_strs_reverse (lists_t_strs *list);
 
 /* Ownership transferring functions. */
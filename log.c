@@ -13,9 +13,20 @@
 # include "config.h"
 #endif
 
+/* Once the log file is open, logit() only formats the message into a
+ * queue (a bounded lock-free ring shared by all threads) and a writer
+ * thread writes it out, so the threads logging never wait for the file
+ * or for each other.  The time is taken when logit() is called.  If the
+ * queue is full the message is dropped and counted.  Before the file is
+ * opened, in a forked child and after log_close() messages are written
+ * directly under logging_mtx as they always were. */
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include <pthread.h>
 #include <time.h>
@@ -44,6 +55,39 @@ static int circular_ptr = 0;
 
 static pthread_mutex_t logging_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+/* Size of the queue and the longest message kept (longer ones are cut). */
+#define LOG_QUEUE_SIZE	4096
+#define LOG_MSG_MAX	512
+
+/* How long the writer sleeps if nobody wakes it up. */
+#define LOG_WRITER_POLL_MS	100
+
+struct log_record
+{
+	uint64_t seq;		/* position it can be written at, plus one
+				   when written */
+	struct timespec time;
+	const char *file;
+	const char *function;
+	int line;
+	char msg[LOG_MSG_MAX];
+};
+
+static struct log_record *log_queue = NULL;
+static uint64_t queue_head = 0;	/* next position to write to */
+static uint64_t queue_tail = 0;	/* next to read, under logging_mtx */
+static uint64_t records_dropped = 0;
+static uint64_t drops_logged = 0;	/* under logging_mtx */
+
+/* Is the writer thread taking the messages? */
+static int log_async = 0;
+
+static pthread_t writer_tid;
+static pthread_mutex_t writer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int writer_waiting = 0;
+static int writer_exit = 0;
+
 static struct {
 	int sig;
 	const char *name;
@@ -88,12 +132,12 @@ static inline void flush_log (void)
 #endif
 
 #ifndef NDEBUG
-static void locked_logit (const char *file, const int line,
+static void locked_logit (const struct timespec *utc_time,
+                          const char *file, const int line,
                           const char *function, const char *msg)
 {
 	int len;
 	char *str, time_str[20];
-	struct timespec utc_time;
 	time_t tv_sec;
 	struct tm tm_time;
 	const char fmt[] = "%s.%06ld: %s:%d %s(): %s\n";
@@ -106,21 +150,20 @@ static void locked_logit (const char *file, const int line,
 	if (logging_state == LOGGING && !logfp)
 		return;
 
-	get_realtime (&utc_time);
-	tv_sec = utc_time.tv_sec;
+	tv_sec = utc_time->tv_sec;
 	localtime_r (&tv_sec, &tm_time);
 	strftime (time_str, sizeof (time_str), "%b %e %T", &tm_time);
 
 	if (logfp && !circular_log) {
-		fprintf (logfp, fmt, time_str, utc_time.tv_nsec / 1000L,
+		fprintf (logfp, fmt, time_str, utc_time->tv_nsec / 1000L,
 		                     file, line, function, msg);
 		return;
 	}
 
-	len = snprintf (NULL, 0, fmt, time_str, utc_time.tv_nsec / 1000L,
+	len = snprintf (NULL, 0, fmt, time_str, utc_time->tv_nsec / 1000L,
 	                              file, line, function, msg);
 	str = xmalloc (len + 1);
-	snprintf (str, len + 1, fmt, time_str, utc_time.tv_nsec / 1000L,
+	snprintf (str, len + 1, fmt, time_str, utc_time->tv_nsec / 1000L,
 	                             file, line, function, msg);
 
 	if (logging_state == BUFFERING) {
@@ -140,6 +183,17 @@ static void locked_logit (const char *file, const int line,
 }
 #endif
 
+#ifndef NDEBUG
+static void locked_logit_now (const char *file, const int line,
+                              const char *function, const char *msg)
+{
+	struct timespec utc_time;
+
+	get_realtime (&utc_time);
+	locked_logit (&utc_time, file, line, function, msg);
+}
+#endif
+
 #ifndef NDEBUG
 static void log_signals_raised (void)
 {
@@ -147,13 +201,230 @@ static void log_signals_raised (void)
 
     for (ix = 0; ix < ARRAY_SIZE(sig_info); ix += 1) {
 		while (sig_info[ix].raised > sig_info[ix].logged) {
-			locked_logit (__FILE__, __LINE__, __func__, sig_info[ix].name);
+			locked_logit_now (__FILE__, __LINE__, __func__, sig_info[ix].name);
 			sig_info[ix].logged += 1;
 		}
 	}
 }
 #endif
 
+#ifndef NDEBUG
+/* Wake up the writer thread if it sleeps.  Don't wait for it: if the mutex
+ * is taken, the writer is awake or will wake up on the timeout. */
+static void wake_writer ()
+{
+	ATOMIC_FENCE ();
+	if (ATOMIC_LOAD (&writer_waiting)
+			&& pthread_mutex_trylock (&writer_mtx) == 0) {
+		pthread_cond_signal (&writer_cond);
+		UNLOCK (writer_mtx);
+	}
+}
+#endif
+
+#ifndef NDEBUG
+/* Put the message into the queue.  Return false if it's full. */
+static bool queue_record (const char *file, const int line,
+                          const char *function, const char *format,
+                          va_list va)
+{
+	struct log_record *rec;
+	uint64_t pos = __atomic_load_n (&queue_head, __ATOMIC_RELAXED);
+
+	while (1) {
+		int64_t diff;
+
+		rec = &log_queue[pos % LOG_QUEUE_SIZE];
+		diff = (int64_t)(ATOMIC_LOAD (&rec->seq) - pos);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n (&queue_head, &pos,
+						pos + 1, false,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n (&queue_head, __ATOMIC_RELAXED);
+	}
+
+	get_realtime (&rec->time);
+	rec->file = file;
+	rec->function = function;
+	rec->line = line;
+	if (vsnprintf (rec->msg, sizeof(rec->msg), format, va)
+			>= (int)sizeof(rec->msg))
+		strcpy (rec->msg + sizeof(rec->msg) - 4, "...");
+
+	ATOMIC_STORE (&rec->seq, pos + 1);
+
+	return true;
+}
+#endif
+
+#ifndef NDEBUG
+/* Write out the messages waiting in the queue. */
+static void locked_drain_queue ()
+{
+	bool written = false;
+
+	if (!log_queue)
+		return;
+
+	log_signals_raised ();
+
+	while (1) {
+		struct log_record *rec = &log_queue[queue_tail % LOG_QUEUE_SIZE];
+
+		if (ATOMIC_LOAD (&rec->seq) != queue_tail + 1)
+			break;
+
+		locked_logit (&rec->time, rec->file, rec->line, rec->function,
+				rec->msg);
+		ATOMIC_STORE (&rec->seq, queue_tail + LOG_QUEUE_SIZE);
+		ATOMIC_STORE (&queue_tail, queue_tail + 1);
+		written = true;
+	}
+
+	if (ATOMIC_LOAD (&records_dropped) > drops_logged) {
+		uint64_t dropped = ATOMIC_LOAD (&records_dropped);
+		char *msg;
+
+		msg = format_msg ("%"PRIu64" log records dropped, the queue "
+		                  "was full", dropped - drops_logged);
+		locked_logit_now (__FILE__, __LINE__, __func__, msg);
+		free (msg);
+		drops_logged = dropped;
+		written = true;
+	}
+
+	if (written)
+		flush_log ();
+}
+#endif
+
+#ifndef NDEBUG
+static void *writer_thread (void *unused ATTR_UNUSED)
+{
+	bool exiting;
+
+	do {
+		struct timespec wake_up;
+
+		LOCK (logging_mtx);
+		locked_drain_queue ();
+		UNLOCK (logging_mtx);
+
+		get_realtime (&wake_up);
+		wake_up.tv_nsec += LOG_WRITER_POLL_MS * 1000000L;
+		if (wake_up.tv_nsec >= 1000000000L) {
+			wake_up.tv_sec += 1;
+			wake_up.tv_nsec -= 1000000000L;
+		}
+
+		LOCK (writer_mtx);
+		ATOMIC_STORE (&writer_waiting, 1);
+		ATOMIC_FENCE ();
+		exiting = writer_exit;
+		if (!exiting) {
+			uint64_t tail = ATOMIC_LOAD (&queue_tail);
+			struct log_record *rec;
+
+			/* Sleep only if there is nothing to write. */
+			rec = &log_queue[tail % LOG_QUEUE_SIZE];
+			if (ATOMIC_LOAD (&rec->seq) != tail + 1)
+				pthread_cond_timedwait (&writer_cond, &writer_mtx,
+				                        &wake_up);
+		}
+		ATOMIC_STORE (&writer_waiting, 0);
+		UNLOCK (writer_mtx);
+	} while (!exiting);
+
+	return NULL;
+}
+#endif
+
+#ifndef NDEBUG
+/* Don't let a forked child get what the writer has buffered but not
+ * written yet, it would write it again. */
+static void atfork_prepare ()
+{
+	LOCK (logging_mtx);
+	flush_log ();
+}
+
+static void atfork_parent ()
+{
+	UNLOCK (logging_mtx);
+}
+
+/* The writer thread doesn't exist in a forked child, so it logs directly
+ * (and writer_mtx might have been held by another thread).  The messages
+ * in the queue are the parent's to write. */
+static void atfork_child ()
+{
+	log_async = 0;
+	log_queue = NULL;
+	pthread_mutex_init (&logging_mtx, NULL);
+	pthread_mutex_init (&writer_mtx, NULL);
+}
+#endif
+
+#ifndef NDEBUG
+/* Start writing the log in the background, logging_mtx must be held. */
+static void locked_start_writer ()
+{
+	static bool atfork_set = false;
+	int rc, ix;
+
+	if (!log_queue) {
+		log_queue = (struct log_record *)xmalloc (LOG_QUEUE_SIZE
+				* sizeof(struct log_record));
+		for (ix = 0; ix < LOG_QUEUE_SIZE; ix += 1)
+			log_queue[ix].seq = ix;
+		queue_head = queue_tail = 0;
+	}
+
+	if (!atfork_set) {
+		pthread_atfork (atfork_prepare, atfork_parent, atfork_child);
+		atfork_set = true;
+	}
+
+	writer_exit = 0;
+	rc = pthread_create (&writer_tid, NULL, writer_thread, NULL);
+	if (rc != 0) {
+		char *msg = format_msg ("Can't start the log writer thread, "
+		                        "logging directly: %s", xstrerror (rc));
+
+		locked_logit_now (__FILE__, __LINE__, __func__, msg);
+		free (msg);
+		return;
+	}
+
+	ATOMIC_STORE (&log_async, 1);
+}
+#endif
+
+#ifndef NDEBUG
+/* Stop the writer thread, the messages left in the queue are not written
+ * yet. */
+static void stop_writer ()
+{
+	if (!ATOMIC_XCHG (&log_async, 0))
+		return;
+
+	LOCK (writer_mtx);
+	writer_exit = 1;
+	pthread_cond_signal (&writer_cond);
+	UNLOCK (writer_mtx);
+
+	if (!pthread_equal (pthread_self (), writer_tid))
+		pthread_join (writer_tid, NULL);
+}
+#endif
+
 /* Put something into the log.  If built with logging disabled,
  * this function is provided as a stub so independant plug-ins
  * configured with logging enabled can still resolve it. */
@@ -167,6 +438,22 @@ void internal_logit (const char *file LOGIT_ONLY,
 	char *msg;
 	va_list va;
 
+	if (ATOMIC_LOAD (&log_async)) {
+		bool queued;
+
+		va_start (va, format);
+		queued = queue_record (file, line, function, format, va);
+		va_end (va);
+
+		if (queued)
+			wake_writer ();
+		else
+			ATOMIC_ADD (&records_dropped, 1);
+
+		errno = saved_errno;
+		return;
+	}
+
 	LOCK(logging_mtx);
 
 	if (!logfp) {
@@ -190,7 +477,7 @@ void internal_logit (const char *file LOGIT_ONLY,
 	va_start (va, format);
 	msg = format_msg_va (format, va);
 	va_end (va);
-	locked_logit (file, line, function, msg);
+	locked_logit_now (file, line, function, msg);
 	free (msg);
 
 	flush_log ();
@@ -230,17 +517,19 @@ void log_init_stream (FILE *f LOGIT_ONLY, const char *fn LOGIT_ONLY)
 		goto end;
 
 	msg = format_msg ("Writing log to: %s", fn);
-	locked_logit (__FILE__, __LINE__, __func__, msg);
+	locked_logit_now (__FILE__, __LINE__, __func__, msg);
 	free (msg);
 
 	if (log_records_spilt > 0) {
 		msg = format_msg ("%d log records spilt", log_records_spilt);
-		locked_logit (__FILE__, __LINE__, __func__, msg);
+		locked_logit_now (__FILE__, __LINE__, __func__, msg);
 		free (msg);
 	}
 
 	flush_log ();
 
+	locked_start_writer ();
+
 end:
 	UNLOCK(logging_mtx);
 #endif
@@ -262,6 +551,7 @@ void log_circular_start ()
 	if (circular_size > 0) {
 		LOCK(logging_mtx);
 
+		locked_drain_queue ();
 		circular_log = lists_strs_new (circular_size);
 		circular_ptr = 0;
 
@@ -290,6 +580,7 @@ void log_circular_reset ()
 
 	LOCK(logging_mtx);
 
+	locked_drain_queue ();
 	locked_circular_reset ();
 
 	UNLOCK(logging_mtx);
@@ -309,6 +600,8 @@ void log_circular_log ()
 
 	LOCK(logging_mtx);
 
+	locked_drain_queue ();
+
 	fprintf (logfp, "\n* Circular Log Starts *\n\n");
 
 	for (ix = circular_ptr; ix < lists_strs_size (circular_log); ix += 1)
@@ -340,6 +633,7 @@ void log_circular_stop ()
 
 	LOCK(logging_mtx);
 
+	locked_drain_queue ();
 	lists_strs_free (circular_log);
 	circular_log = NULL;
 	circular_ptr = 0;
@@ -351,8 +645,12 @@ void log_circular_stop ()
 void log_close ()
 {
 #ifndef NDEBUG
+	stop_writer ();
+
 	LOCK(logging_mtx);
 
+	locked_drain_queue ();
+
 	if (!(logfp == stdout || logfp == stderr || logfp == NULL)) {
 		fclose (logfp);
 		logfp = NULL;
@@ -0,0 +1,342 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Loudness normalization.  The loudness of a file is measured once, by
+ * decoding it in the background (see the analyzer in tags_cache.c), as
+ * EBU R128 (ITU-R BS.1770) integrated loudness: the K-weighted mean square
+ * of 400ms blocks overlapping by 75%, gated at -70 LUFS and then at 10 LU
+ * under the mean of the blocks left.  It is kept in the tags cache, and
+ * playing the file only turns it into the gain the softmixer applies. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "files.h"
+#include "decoder.h"
+#include "audio.h"
+#include "audio_conversion.h"
+#include "tags_cache.h"
+#include "loudness.h"
+
+/* Size of the buffer for the decoded sound. */
+#define DECODE_BUF_SIZE	(64 * 1024)
+
+/* The K-weighting filter of one channel: a high shelf and a high pass
+ * biquad, in the transposed direct form II. */
+struct k_filter
+{
+	double z[2][2];
+};
+
+struct meter
+{
+	struct sound_params params;
+	double b[2][3], a[2][3];	/* coefficients of the biquads */
+	struct k_filter *filters;	/* one per channel */
+	double *weights;		/* of the channels */
+	long step_frames;		/* frames in 100ms */
+	long step_fill;			/* frames of the current step */
+	double step_sum;		/* their weighted sum of squares */
+	double steps[4];		/* mean squares of the last steps */
+	int steps_num;
+	double *blocks;			/* mean squares of the blocks */
+	size_t blocks_num, blocks_size;
+	double frames;			/* frames measured */
+	float peak;
+};
+
+/* Set the meter up for the sound format, keeping the blocks measured. */
+static void meter_setup (struct meter *m, const struct sound_params *params)
+{
+	double k, vh, vb, a0;
+	int ch;
+
+	m->params = *params;
+
+	/* The coefficients of BS.1770 worked out for any rate. */
+	k = tan (M_PI * 1681.974450955533 / params->rate);
+	vh = pow (10.0, 3.999843853973347 / 20.0);
+	vb = pow (vh, 0.4996667741545416);
+	a0 = 1.0 + k / 0.7071752369554196 + k * k;
+	m->b[0][0] = (vh + vb * k / 0.7071752369554196 + k * k) / a0;
+	m->b[0][1] = 2.0 * (k * k - vh) / a0;
+	m->b[0][2] = (vh - vb * k / 0.7071752369554196 + k * k) / a0;
+	m->a[0][1] = 2.0 * (k * k - 1.0) / a0;
+	m->a[0][2] = (1.0 - k / 0.7071752369554196 + k * k) / a0;
+
+	k = tan (M_PI * 38.13547087602444 / params->rate);
+	a0 = 1.0 + k / 0.5003270373238773 + k * k;
+	m->b[1][0] = 1.0;
+	m->b[1][1] = -2.0;
+	m->b[1][2] = 1.0;
+	m->a[1][1] = 2.0 * (k * k - 1.0) / a0;
+	m->a[1][2] = (1.0 - k / 0.5003270373238773 + k * k) / a0;
+
+	free (m->filters);
+	free (m->weights);
+	m->filters = (struct k_filter *)xcalloc (params->channels,
+	                                         sizeof(struct k_filter));
+	m->weights = (double *)xmalloc (params->channels * sizeof(double));
+
+	/* In the 5.1 order the LFE channel doesn't count and the surround
+	 * ones count more. */
+	for (ch = 0; ch < params->channels; ch++) {
+		if (params->channels >= 5 && ch == 3)
+			m->weights[ch] = 0.0;
+		else if (params->channels >= 5 && (ch == 4 || ch == 5))
+			m->weights[ch] = 1.41;
+		else
+			m->weights[ch] = 1.0;
+	}
+
+	m->step_frames = MAX(params->rate / 10, 1);
+	m->step_fill = 0;
+	m->step_sum = 0.0;
+	m->steps_num = 0;
+}
+
+static void meter_add_block (struct meter *m, const double mean_square)
+{
+	if (m->blocks_num == m->blocks_size) {
+		m->blocks_size = m->blocks_size ? 2 * m->blocks_size : 1024;
+		m->blocks = (double *)xrealloc (m->blocks,
+		                                m->blocks_size * sizeof(double));
+	}
+	m->blocks[m->blocks_num++] = mean_square;
+}
+
+/* Measure float samples in the meter's format. */
+static void meter_process (struct meter *m, const float *buf,
+		const size_t samples)
+{
+	const int channels = m->params.channels;
+	size_t i;
+
+	for (i = 0; i < samples; i += channels) {
+		double sum = 0.0;
+		int ch;
+
+		for (ch = 0; ch < channels; ch++) {
+			struct k_filter *f = &m->filters[ch];
+			double x = buf[i + ch], y;
+			int s;
+
+			if (fabsf (buf[i + ch]) > m->peak)
+				m->peak = fabsf (buf[i + ch]);
+
+			for (s = 0; s < 2; s++) {
+				y = m->b[s][0] * x + f->z[s][0];
+				f->z[s][0] = m->b[s][1] * x - m->a[s][1] * y
+				             + f->z[s][1];
+				f->z[s][1] = m->b[s][2] * x - m->a[s][2] * y;
+				x = y;
+			}
+
+			sum += m->weights[ch] * x * x;
+		}
+
+		m->step_sum += sum;
+		if (++m->step_fill < m->step_frames)
+			continue;
+
+		/* A block is 4 steps, the next one starts a step later. */
+		memmove (m->steps, m->steps + 1, 3 * sizeof(double));
+		m->steps[3] = m->step_sum / m->step_frames;
+		if (m->steps_num < 4)
+			m->steps_num++;
+		if (m->steps_num == 4)
+			meter_add_block (m, (m->steps[0] + m->steps[1]
+			                     + m->steps[2] + m->steps[3]) / 4.0);
+
+		m->step_sum = 0.0;
+		m->step_fill = 0;
+	}
+
+	m->frames += samples / channels;
+}
+
+static double block_loudness (const double mean_square)
+{
+	return -0.691 + 10.0 * log10 (mean_square);
+}
+
+/* The gated mean of the blocks in LUFS. */
+static float meter_integrated (const struct meter *m)
+{
+	double sum = 0.0, threshold;
+	size_t ix, count = 0;
+
+	for (ix = 0; ix < m->blocks_num; ix++) {
+		if (m->blocks[ix] > 0.0
+				&& block_loudness (m->blocks[ix]) > LOUDNESS_SILENCE) {
+			sum += m->blocks[ix];
+			count++;
+		}
+	}
+	if (!count)
+		return LOUDNESS_SILENCE;
+
+	threshold = block_loudness (sum / count) - 10.0;
+
+	sum = 0.0;
+	count = 0;
+	for (ix = 0; ix < m->blocks_num; ix++) {
+		if (m->blocks[ix] > 0.0
+				&& block_loudness (m->blocks[ix]) > LOUDNESS_SILENCE
+				&& block_loudness (m->blocks[ix]) > threshold) {
+			sum += m->blocks[ix];
+			count++;
+		}
+	}
+
+	return count ? block_loudness (sum / count) : LOUDNESS_SILENCE;
+}
+
+/* Decode the file and measure its loudness.  Give up when *stop becomes
+ * non-zero.  Return false if the file can't be decoded. */
+bool loudness_analyze (const char *file, struct loudness *res,
+		const int *stop)
+{
+	const struct decoder *f;
+	struct decoder_error err;
+	struct meter m;
+	void *data;
+	char *buf;
+	float *samples;
+	bool ok = true;
+
+	f = get_decoder (file);
+	if (!f)
+		return false;
+
+	data = f->open (file);
+	f->get_error (data, &err);
+	if (err.type != ERROR_OK) {
+		logit ("Can't open %s to measure its loudness: %s", file,
+		       err.err);
+		decoder_error_clear (&err);
+		f->close (data);
+		return false;
+	}
+
+	memset (&m, 0, sizeof(m));
+	buf = (char *)xmalloc (DECODE_BUF_SIZE);
+	samples = (float *)xmalloc (DECODE_BUF_SIZE * sizeof(float));
+
+	while (!ATOMIC_LOAD (stop)) {
+		struct sound_params params = { 0, 0, 0 };
+		size_t count;
+
+		if (f->decode_float) {
+			count = f->decode_float (data, samples,
+			                         DECODE_BUF_SIZE, &params);
+		}
+		else {
+			int decoded = f->decode (data, buf, DECODE_BUF_SIZE,
+			                         &params);
+
+			count = decoded > 0 ? decoded / sfmt_Bps (params.fmt)
+			                    : 0;
+			if (count) {
+				long fmt = params.fmt;
+
+				if (!(fmt & (SFMT_S8 | SFMT_U8 | SFMT_FLOAT))
+						&& (fmt & SFMT_MASK_ENDIANNESS)
+						   != SFMT_NE)
+					audio_conv_swap_endian (buf, decoded,
+					                        fmt);
+				audio_conv_to_float (buf, decoded, fmt,
+				                     samples);
+			}
+		}
+
+		f->get_error (data, &err);
+		if (err.type == ERROR_FATAL) {
+			logit ("Error measuring the loudness of %s: %s", file,
+			       err.err);
+			decoder_error_clear (&err);
+			ok = false;
+			break;
+		}
+		decoder_error_clear (&err);
+
+		if (!count)
+			break;
+
+		if (params.rate <= 0 || params.channels <= 0) {
+			ok = false;
+			break;
+		}
+		if (!sound_params_eq (params, m.params))
+			meter_setup (&m, &params);
+
+		meter_process (&m, samples, count - count % params.channels);
+	}
+
+	f->close (data);
+
+	if (ATOMIC_LOAD (stop))
+		ok = false;
+
+	if (ok) {
+		res->integrated = meter_integrated (&m);
+		res->peak = m.peak;
+		res->duration = m.params.rate ? m.frames / m.params.rate : 0.0;
+		logit ("Loudness of %s: %.1f LUFS, peak %.3f", file,
+		       res->integrated, res->peak);
+	}
+
+	free (m.filters);
+	free (m.weights);
+	free (m.blocks);
+	free (samples);
+	free (buf);
+
+	return ok;
+}
+
+/* Return the gain bringing the file to the NormalizeTarget loudness, or
+ * 1.0 if it is not normalized or its loudness is not known yet. */
+float loudness_gain (const char *file)
+{
+	const char *mode = options_get_symb ("Normalize");
+	struct loudness l;
+	float gain;
+
+	if (!strcasecmp (mode, "Off") || is_url (file))
+		return 1.0f;
+
+	if (!(!strcasecmp (mode, "Album")
+	      && tags_cache_get_album_loudness (file, &l))
+			&& !tags_cache_get_loudness (file, &l))
+		return 1.0f;
+
+	if (l.integrated <= LOUDNESS_SILENCE)
+		return 1.0f;
+
+	gain = powf (10.0f, (options_get_int ("NormalizeTarget")
+	                     - l.integrated) / 20.0f);
+	if (options_get_bool ("NormalizePreventClipping") && l.peak > 0.0f)
+		gain = MIN(gain, 1.0f / l.peak);
+
+	logit ("Normalizing %s: %.1f LUFS, gain %.2fdB", file, l.integrated,
+	       20.0 * log10 (gain));
+
+	return gain;
+}
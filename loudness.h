@@ -0,0 +1,26 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Loudness of a track below which (or of silence) it is not amplified. */
+#define LOUDNESS_SILENCE	-70.0f
+
+struct loudness
+{
+	float integrated;	/* EBU R128 integrated loudness in LUFS */
+	float peak;		/* the largest sample, 1.0 is full scale */
+	float duration;		/* seconds of sound measured */
+};
+
+bool loudness_analyze (const char *file, struct loudness *res,
+		const int *stop);
+float loudness_gain (const char *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,6 +16,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "files.h"
@@ -27,6 +28,36 @@
 static lists_t_strs *raw_lyrics = NULL;
 static const char *lyrics_message = NULL;
 
+/* The lyrics formatted for the last screen size asked for, or NULL. */
+static lists_t_strs *formatted = NULL;
+static int formatted_height = -1;
+static int formatted_width = -1;
+
+/* Lyrics files are loaded by a thread so the interface doesn't wait for
+ * the disk when the played file changes.  The result is picked up by
+ * lyrics_poll(); a load started for an earlier file is discarded. */
+static pthread_mutex_t load_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int load_generation = 0;
+static bool load_running = false;
+static bool load_done = false;
+static lists_t_strs *loaded_lyrics = NULL;
+static const char *loaded_message = NULL;
+
+struct lyrics_load
+{
+	int generation;
+	char *filename;
+};
+
+/* Forget the formatted lyrics, they must be made again. */
+static void drop_formatted (void)
+{
+	if (formatted) {
+		lists_strs_free (formatted);
+		formatted = NULL;
+	}
+}
+
 /* Return the list of lyrics lines, or NULL if none are loaded. */
 lists_t_strs *lyrics_lines_get (void)
 {
@@ -41,10 +72,12 @@ void lyrics_lines_set (lists_t_strs *lines)
 
 	raw_lyrics = lines;
 	lyrics_message = NULL;
+	drop_formatted ();
 }
 
-/* Return a list of lyrics lines loaded from a file, or NULL on error. */
-lists_t_strs *lyrics_load_file (const char *filename)
+/* Load the lyrics lines from a file.  Return NULL and set the message
+ * on error.  It's thread safe. */
+static lists_t_strs *load_file (const char *filename, const char **message)
 {
 	int text_plain;
 	FILE *lyrics_file = NULL;
@@ -53,7 +86,7 @@ lists_t_strs *lyrics_load_file (const char *filename)
 
 	assert (filename);
 
-	lyrics_message = "[No lyrics file!]";
+	*message = "[No lyrics file!]";
 	if (!file_exists (filename))
 		return NULL;
 	mime = file_mime_type (filename);
@@ -67,7 +100,7 @@ lists_t_strs *lyrics_load_file (const char *filename)
 		char *err = xstrerror (errno);
 		logit ("Error reading '%s': %s", filename, err);
 		free (err);
-		lyrics_message = "[Lyrics file cannot be read!]";
+		*message = "[Lyrics file cannot be read!]";
 		return NULL;
 	}
 
@@ -76,7 +109,109 @@ lists_t_strs *lyrics_load_file (const char *filename)
 		lists_strs_push (result, line);
 	fclose (lyrics_file);
 
-	lyrics_message = NULL;
+	*message = NULL;
+	return result;
+}
+
+/* Return a list of lyrics lines loaded from a file, or NULL on error. */
+lists_t_strs *lyrics_load_file (const char *filename)
+{
+	lists_t_strs *result;
+
+	result = load_file (filename, &lyrics_message);
+	drop_formatted ();
+
+	return result;
+}
+
+static void *load_thread (void *arg)
+{
+	struct lyrics_load *load = (struct lyrics_load *)arg;
+	lists_t_strs *lyrics;
+	const char *message;
+
+	lyrics = load_file (load->filename, &message);
+
+	LOCK (load_mtx);
+	if (load->generation == load_generation) {
+		loaded_lyrics = lyrics;
+		loaded_message = message;
+		load_done = true;
+		load_running = false;
+		lyrics = NULL;
+	}
+	UNLOCK (load_mtx);
+
+	if (lyrics)
+		lists_strs_free (lyrics);
+	free (load->filename);
+	free (load);
+
+	return NULL;
+}
+
+/* Start loading the lyrics file in the background. */
+static void start_load (char *filename)
+{
+	struct lyrics_load *load;
+	pthread_t thread;
+	pthread_attr_t attr;
+	int rc;
+
+	load = (struct lyrics_load *)xmalloc (sizeof (struct lyrics_load));
+	load->filename = filename;
+
+	LOCK (load_mtx);
+	load->generation = load_generation;
+	load_running = true;
+	UNLOCK (load_mtx);
+
+	lyrics_message = "[Loading lyrics...]";
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create (&thread, &attr, load_thread, load);
+	pthread_attr_destroy (&attr);
+
+	/* Load it now if there is no thread. */
+	if (rc != 0) {
+		log_errno ("Can't create the lyrics loading thread", rc);
+		load_thread (load);
+		lyrics_poll ();
+	}
+}
+
+/* Take the lyrics loaded in the background if they are ready.  Return
+ * true if they have been taken, so they should be shown. */
+bool lyrics_poll (void)
+{
+	bool result = false;
+
+	LOCK (load_mtx);
+	if (load_done) {
+		assert (!raw_lyrics);
+
+		raw_lyrics = loaded_lyrics;
+		lyrics_message = loaded_message;
+		loaded_lyrics = NULL;
+		load_done = false;
+		drop_formatted ();
+		result = true;
+	}
+	UNLOCK (load_mtx);
+
+	return result;
+}
+
+/* Return true if the lyrics are being loaded in the background. */
+bool lyrics_loading (void)
+{
+	bool result;
+
+	LOCK (load_mtx);
+	result = load_running || load_done;
+	UNLOCK (load_mtx);
+
 	return result;
 }
 
@@ -88,6 +223,8 @@ void lyrics_autoload (const char *filename)
 	assert (!raw_lyrics);
 	assert (lyrics_message);
 
+	drop_formatted ();
+
 	if (filename == NULL) {
 		lyrics_message = "[No file playing!]";
 		return;
@@ -109,12 +246,12 @@ void lyrics_autoload (const char *filename)
 	extn = ext_pos (lyrics_filename);
 	if (extn) {
 		*--extn = '\0';
-		raw_lyrics = lyrics_load_file (lyrics_filename);
+		start_load (lyrics_filename);
 	}
-	else
+	else {
 		lyrics_message = "[No lyrics file!]";
-
-	free (lyrics_filename);
+		free (lyrics_filename);
+	}
 }
 
 /* Given a line, return a centred copy of it. */
@@ -175,6 +312,7 @@ void lyrics_use_formatter (lyrics_t_formatter formatter,
 {
 	if (formatter_reaper)
 		formatter_reaper (formatter_data);
+	drop_formatted ();
 
 	if (formatter) {
 		lyrics_formatter = formatter;
@@ -189,7 +327,8 @@ void lyrics_use_formatter (lyrics_t_formatter formatter,
 }
 
 /* Return a list of either the formatted lyrics if any are loaded or
- * a centred message. */
+ * a centred message.  The list is kept for the next call with the same
+ * size and must not be changed or freed. */
 lists_t_strs *lyrics_format (int height, int width)
 {
 	int ix;
@@ -197,6 +336,10 @@ lists_t_strs *lyrics_format (int height, int width)
 
 	assert (raw_lyrics || lyrics_message);
 
+	if (formatted && formatted_height == height && formatted_width == width)
+		return formatted;
+
+	drop_formatted ();
 	result = NULL;
 
 	if (raw_lyrics) {
@@ -222,7 +365,7 @@ lists_t_strs *lyrics_format (int height, int width)
 		len = strlen (this_line);
 		if (len > width - 1)
 			strcpy (&this_line[width - 1], "\n");
-		else if (this_line[len - 1] != '\n') {
+		else if (len == 0 || this_line[len - 1] != '\n') {
 			char *new_line;
 
 			new_line = xmalloc (len + 2);
@@ -233,16 +376,31 @@ lists_t_strs *lyrics_format (int height, int width)
 		}
 	}
 
+	formatted = result;
+	formatted_height = height;
+	formatted_width = width;
+
 	return result;
 }
 
 /* Dispose of raw lyrics lines. */
 void lyrics_cleanup (void)
 {
+	LOCK (load_mtx);
+	load_generation += 1;
+	load_running = false;
+	if (loaded_lyrics) {
+		lists_strs_free (loaded_lyrics);
+		loaded_lyrics = NULL;
+	}
+	load_done = false;
+	UNLOCK (load_mtx);
+
 	if (raw_lyrics) {
 		lists_strs_free (raw_lyrics);
 		raw_lyrics = NULL;
 	}
+	drop_formatted ();
 
 	lyrics_message = "[No lyrics loaded!]";
 }
@@ -12,6 +12,8 @@ lists_t_strs *lyrics_lines_get (void);
 void lyrics_lines_set (lists_t_strs *lines);
 lists_t_strs *lyrics_load_file (const char *filename);
 void lyrics_autoload (const char *filename);
+bool lyrics_poll (void);
+bool lyrics_loading (void);
 void lyrics_use_formatter (lyrics_t_formatter, lyrics_t_reaper, void *data);
 lists_t_strs *lyrics_format (int height, int width);
 void lyrics_cleanup (void);
@@ -42,6 +42,9 @@
 #include "lists.h"
 #include "files.h"
 #include "rcc.h"
+#include "status_page.h"
+#include "bench.h"
+#include "startup.h"
 
 static int mocp_argc;
 static const char **mocp_argv;
@@ -77,6 +80,11 @@ struct parameters
 	int previous;
 	int rate;
 	int get_file_info;
+	int get_io_stats;
+	int get_stats;
+	int output_trace;
+	char *scan;
+	int get_status;
 	int toggle_pause;
 	int playit;
 	int seek_by;
@@ -89,6 +97,10 @@ struct parameters
 	char *toggle;
 	char *on;
 	char *off;
+	int bench;
+	int bench_kernels;
+	int verify_md5;
+	char *md5_sums;
 };
 
 /* Connect to the server, return fd of the socket or -1 on error. */
@@ -201,6 +213,7 @@ static void start_moc (const struct parameters *params, lists_t_strs *args)
 		case -1:
 			fatal ("fork() failed: %s", xstrerror (errno));
 		default:
+			startup_begin ("server_start");
 			close (notify_pipe[1]);
 			if (read(notify_pipe[0], &i, sizeof(i)) != sizeof(i))
 				fatal ("Server exited!");
@@ -210,6 +223,7 @@ static void start_moc (const struct parameters *params, lists_t_strs *args)
 				perror ("server_connect()");
 				fatal ("Can't connect to the server!");
 			}
+			startup_end ();
 		}
 	}
 
@@ -228,11 +242,64 @@ static void start_moc (const struct parameters *params, lists_t_strs *args)
 	close (server_sock);
 }
 
+/* Return true if only the information about the current file was asked
+ * for, which can be read from the status page. */
+static bool status_query_only (const struct parameters *params)
+{
+	return (params->get_file_info || params->get_formatted_info
+			|| params->get_status)
+		&& !params->playit && !params->clear && !params->append
+		&& !params->enqueue && !params->play && !params->get_io_stats
+		&& !params->get_stats && !params->output_trace && !params->scan
+		&& !params->seek_by && !params->rate && !params->jump_type
+		&& !params->adj_volume && !params->toggle && !params->on
+		&& !params->off && !params->exit && !params->stop
+		&& !params->pause && !params->next && !params->previous
+		&& !params->unpause && !params->toggle_pause;
+}
+
+/* Return true if the file type detection, the decoders and the I/O layer
+ * are needed: the server and the interface need them, and so do the
+ * commands which add files or read playlist files.  Other commands only
+ * talk to the server and start without loading the plugins. */
+static bool needs_full_init (const struct parameters *params)
+{
+	return params->allow_iface || params->playit || params->append
+		|| params->enqueue || params->play || params->bench
+		|| params->verify_md5;
+}
+
+/* Answer the status queries from the status page without talking to the
+ * server.  Return false if the page is not available. */
+static bool status_command (const struct parameters *params)
+{
+	struct status_info status;
+
+	if (!status_page_read (&status))
+		return false;
+
+	if (params->get_file_info)
+		interface_cmdline_file_info (-1, &status);
+	if (params->get_formatted_info)
+		interface_cmdline_formatted_info (-1,
+				params->formatted_info_param, &status);
+	if (params->get_status)
+		interface_cmdline_status (&status);
+
+	return true;
+}
+
 /* Send commands requested in params to the server. */
 static void server_command (struct parameters *params, lists_t_strs *args)
 {
 	int sock;
 
+	if (status_query_only (params) && status_command (params))
+		return;
+
+	if (params->get_status)
+		fatal ("The server is not running or doesn't publish its status!");
+
 	if ((sock = server_connect()) == -1)
 		fatal ("The server is not running!");
 
@@ -251,7 +318,15 @@ static void server_command (struct parameters *params, lists_t_strs *args)
 	if (params->play)
 		interface_cmdline_play_first (sock);
 	if (params->get_file_info)
-		interface_cmdline_file_info (sock);
+		interface_cmdline_file_info (sock, NULL);
+	if (params->get_io_stats)
+		interface_cmdline_io_stats (sock);
+	if (params->get_stats)
+		interface_cmdline_stats (sock);
+	if (params->output_trace)
+		interface_cmdline_output_trace (sock);
+	if (params->scan)
+		interface_cmdline_scan (sock, params->scan);
 	if (params->seek_by)
 		interface_cmdline_seek_by (sock, params->seek_by);
 	if (params->rate)
@@ -261,7 +336,8 @@ static void server_command (struct parameters *params, lists_t_strs *args)
 	if (params->jump_type=='s')
 		interface_cmdline_jump_to (sock,params->jump_to);
 	if (params->get_formatted_info)
-		interface_cmdline_formatted_info (sock, params->formatted_info_param);
+		interface_cmdline_formatted_info (sock, params->formatted_info_param,
+				NULL);
 	if (params->adj_volume)
 		interface_cmdline_adj_volume (sock, params->adj_volume);
 	if (params->toggle)
@@ -513,6 +589,18 @@ static struct poptOption general_opts[] = {
 			"Synchronize the playlist with other clients", NULL},
 	{"nosync", 'n', POPT_ARG_NONE, NULL, CL_NOSYNC,
 			"Don't synchronize the playlist with other clients", NULL},
+	{"bench", 0, POPT_ARG_NONE, &params.bench, CL_NOIFACE,
+			"Decode the files given on the command line as fast as possible"
+			" and print how long it took", NULL},
+	{"bench-kernels", 0, POPT_ARG_NONE, &params.bench_kernels, CL_NOIFACE,
+			"Measure the speed of the sound conversions and DSP stages",
+			NULL},
+	{"verify-md5", 0, POPT_ARG_NONE, &params.verify_md5, CL_NOIFACE,
+			"Print the MD5 sums of the sound of the files given on the"
+			" command line", NULL},
+	{"md5-sums", 0, POPT_ARG_STRING, &params.md5_sums, CL_HANDLED,
+			"Check the sums printed by --verify-md5 against this file",
+			"FILE"},
 	POPT_TABLEEND
 };
 
@@ -562,6 +650,19 @@ static struct poptOption server_opts[] = {
 			"Print information about the file currently playing", NULL},
 	{"format", 'Q', POPT_ARG_STRING, &params.formatted_info_param, CL_GETINFO,
 			"Print formatted information about the file currently playing", "FORMAT"},
+	{"io-stats", 0, POPT_ARG_NONE, &params.get_io_stats, CL_NOIFACE,
+			"Print the I/O counters of the streams being read", NULL},
+	{"stats", 0, POPT_ARG_NONE, &params.get_stats, CL_NOIFACE,
+			"Print the counters of the sound pipeline and the tags cache", NULL},
+	{"output-trace", 0, POPT_ARG_NONE, &params.output_trace, CL_NOIFACE,
+			"Write the trace of the last writes to the sound device"
+			" to a file", NULL},
+	{"scan", 0, POPT_ARG_STRING, &params.scan, CL_NOIFACE,
+			"Read the tags of the files in DIR into the tags cache"
+			" in the background", "DIR"},
+	{"status", 0, POPT_ARG_NONE, &params.get_status, CL_NOIFACE,
+			"Print the playback state published by the server"
+			" without connecting to it", NULL},
 	POPT_TABLEEND
 };
 
@@ -1194,11 +1295,15 @@ static void log_popt_command_line ()
 int main (int argc, const char *argv[])
 {
 	lists_t_strs *deferred_overrides, *args;
+	bool full_init;
+	int result = EXIT_SUCCESS;
 
 	assert (argc >= 0);
 	assert (argv != NULL);
 	assert (argv[argc] == NULL);
 
+	startup_init ();
+
 	mocp_argc = argc;
 	mocp_argv = argv;
 
@@ -1223,8 +1328,6 @@ int main (int argc, const char *argv[])
 	}
 #endif
 
-	files_init ();
-
 	if (get_home () == NULL)
 		fatal ("Could not determine user's home directory!");
 
@@ -1253,7 +1356,9 @@ int main (int argc, const char *argv[])
 		}
 		else
 			params.config_file = create_file_name ("config");
+		startup_begin ("options_parse");
 		options_parse (params.config_file);
+		startup_end ();
 	}
 
 	process_deferred_overrides (deferred_overrides);
@@ -1262,23 +1367,41 @@ int main (int argc, const char *argv[])
 
 	check_moc_dir ();
 
-	io_init ();
-	rcc_init ();
-	decoder_init (params.debug);
+	full_init = needs_full_init (&params);
+	if (full_init) {
+		startup_begin ("io_init");
+		files_init ();
+		io_init ();
+		rcc_init ();
+		startup_end ();
+		startup_begin ("decoder_init");
+		decoder_init (params.debug);
+		startup_end ();
+	}
 	srand (time(NULL));
 
-	if (params.allow_iface)
+	if (params.bench) {
+		if (!bench_files (args))
+			result = EXIT_FAILURE;
+	}
+	else if (params.bench_kernels)
+		bench_kernels ();
+	else if (params.verify_md5)
+		result = verify_md5 (args, params.md5_sums);
+	else if (params.allow_iface)
 		start_moc (&params, args);
 	else
 		server_command (&params, args);
 
 	lists_strs_free (args);
 	options_free ();
-	decoder_cleanup ();
-	io_cleanup ();
-	rcc_cleanup ();
-	files_cleanup ();
+	if (full_init) {
+		decoder_cleanup ();
+		io_cleanup ();
+		rcc_cleanup ();
+		files_cleanup ();
+	}
 	common_cleanup ();
 
-	return EXIT_SUCCESS;
+	return result;
 }
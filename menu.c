@@ -16,6 +16,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 
 #include "common.h"
@@ -25,12 +26,51 @@
 #include "rbtree.h"
 #include "utf8.h"
 
+/* Count of titles changed in all menus, a filtered menu can't be refined
+ * after a title has changed. */
+static unsigned int titles_changes = 0;
+
+static void menu_item_forget_disp (struct menu_item *mi)
+{
+	free (mi->title_disp);
+	mi->title_disp = NULL;
+	mi->title_width = -1;
+}
+
+/* Return the title to draw in title_space columns, converted for the
+ * terminal.  The result is remembered until the title, its alignment or
+ * the space change. */
+static const char *menu_item_title_disp (struct menu_item *mi,
+		const int title_space)
+{
+	if (mi->title_disp && mi->title_disp_space == title_space)
+		return mi->title_disp;
+
+	free (mi->title_disp);
+
+	if (mi->title_width == -1)
+		mi->title_width = strwidth (mi->title);
+
+	if (mi->title_width <= title_space || mi->align == MENU_ALIGN_LEFT)
+		mi->title_disp = xstrhead_display (mi->title, title_space);
+	else {
+		char *tail;
+
+		tail = xstrtail (mi->title, title_space);
+		mi->title_disp = xstr_display (tail);
+		free (tail);
+	}
+	mi->title_disp_space = title_space;
+
+	return mi->title_disp;
+}
+
 /* Draw menu item on a given position from the top of the menu. */
-static void draw_item (const struct menu *menu, const struct menu_item *mi,
+static void draw_item (const struct menu *menu, struct menu_item *mi,
 		const int pos, const int item_info_pos, int title_space,
 		const int number_space, const int draw_selected)
 {
-	int title_width, queue_pos_len = 0;
+	int queue_pos_len = 0;
 	int ix, x;
 	int y ATTR_UNUSED;		/* OpenBSD flags this as unused. */
 	char buf[32];
@@ -46,11 +86,11 @@ static void draw_item (const struct menu *menu, const struct menu_item *mi,
 	wmove (menu->win, pos, menu->posx);
 
 	if (number_space) {
-		if (draw_selected && mi == menu->selected && mi == menu->marked)
+		if (draw_selected && mi->num == menu->selected && mi->num == menu->marked)
 			wattrset (menu->win, menu->info_attr_sel_marked);
-		else if (draw_selected && mi == menu->selected)
+		else if (draw_selected && mi->num == menu->selected)
 			wattrset (menu->win, menu->info_attr_sel);
-		else if (mi == menu->marked)
+		else if (mi->num == menu->marked)
 			wattrset (menu->win, menu->info_attr_marked);
 		else
 			wattrset (menu->win, menu->info_attr_normal);
@@ -58,11 +98,11 @@ static void draw_item (const struct menu *menu, const struct menu_item *mi,
 	}
 
 	/* Set attributes */
-	if (draw_selected && mi == menu->selected && mi == menu->marked)
+	if (draw_selected && mi->num == menu->selected && mi->num == menu->marked)
 		wattrset (menu->win, mi->attr_sel_marked);
-	else if (draw_selected && mi == menu->selected)
+	else if (draw_selected && mi->num == menu->selected)
 		wattrset (menu->win, mi->attr_sel);
-	else if (mi == menu->marked)
+	else if (mi->num == menu->marked)
 		wattrset (menu->win, mi->attr_marked);
 	else
 		wattrset (menu->win, mi->attr_normal);
@@ -74,21 +114,11 @@ static void draw_item (const struct menu *menu, const struct menu_item *mi,
 		title_space -= queue_pos_len;
 	}
 
-	title_width = strwidth (mi->title);
-
 	getyx (menu->win, y, x);
-	if (title_width <= title_space || mi->align == MENU_ALIGN_LEFT)
-		xwaddnstr (menu->win, mi->title, title_space);
-	else {
-		char *ptr;
-
-		ptr = xstrtail (mi->title, title_space);
-		xwaddstr (menu->win, ptr);
-		free (ptr);
-	}
+	waddstr (menu->win, menu_item_title_disp (mi, title_space));
 
 	/* Fill the remainder of the title field with spaces. */
-	if (mi == menu->selected) {
+	if (mi->num == menu->selected) {
 		getyx (menu->win, y, ix);
 		while (ix < x + title_space) {
 			waddch (menu->win, ' ');
@@ -100,7 +130,7 @@ static void draw_item (const struct menu *menu, const struct menu_item *mi,
 	   Some utf8 chars do not have bold versions. */
 	if (menu->show_rating) {
 		wmove (menu->win, pos, item_info_pos + 1);
-		if (mi == menu->marked)
+		if (mi->num == menu->marked)
 			wattrset (menu->win, mi->attr_marked);
 		else
 			wattrset (menu->win, mi->attr_normal);
@@ -111,11 +141,11 @@ static void draw_item (const struct menu *menu, const struct menu_item *mi,
 	}
 
 	/* Description. */
-	if (draw_selected && mi == menu->selected && mi == menu->marked)
+	if (draw_selected && mi->num == menu->selected && mi->num == menu->marked)
 		wattrset (menu->win, menu->info_attr_sel_marked);
-	else if (draw_selected && mi == menu->selected)
+	else if (draw_selected && mi->num == menu->selected)
 		wattrset (menu->win, menu->info_attr_sel);
-	else if (mi == menu->marked)
+	else if (mi->num == menu->marked)
 		wattrset (menu->win, menu->info_attr_marked);
 	else
 		wattrset (menu->win, menu->info_attr_normal);
@@ -155,7 +185,7 @@ static void draw_item (const struct menu *menu, const struct menu_item *mi,
 
 void menu_draw (const struct menu *menu, const int active)
 {
-	struct menu_item *mi;
+	int i;
 	int title_width;
 	int info_pos;
 	int number_space = 0;
@@ -198,9 +228,9 @@ void menu_draw (const struct menu *menu, const int active)
 
 	title_width -= number_space;
 
-	for (mi = menu->top; mi && mi->num - menu->top->num < menu->height;
-			mi = mi->next)
-		draw_item (menu, mi, mi->num - menu->top->num + menu->posy,
+	for (i = menu->top; i < menu->nitems && i - menu->top < menu->height;
+			i++)
+		draw_item (menu, menu->items[i], i - menu->top + menu->posy,
 				menu->posx + info_pos, title_width,
 				number_space, active);
 }
@@ -210,26 +240,14 @@ void menu_set_cursor (const struct menu *m)
 {
 	assert (m != NULL);
 
-	if (m->selected)
-		wmove (m->win, m->selected->num - m->top->num + m->posy, m->posx);
-}
-
-static int rb_compare (const void *a, const void *b,
-                       const void *unused ATTR_UNUSED)
-{
-	struct menu_item *mia = (struct menu_item *)a;
-	struct menu_item *mib = (struct menu_item *)b;
-
-	return strcmp (mia->file, mib->file);
+	if (m->selected != -1)
+		wmove (m->win, m->selected - m->top + m->posy, m->posx);
 }
 
-static int rb_fname_compare (const void *key, const void *data,
-                             const void *unused ATTR_UNUSED)
+static const char *menu_item_file (const void *data,
+                                   const void *unused ATTR_UNUSED)
 {
-	const char *fname = (const char *)key;
-	const struct menu_item *mi = (const struct menu_item *)data;
-
-	return strcmp (fname, mi->file);
+	return ((const struct menu_item *)data)->file;
 }
 
 /* menu_items must be malloc()ed memory! */
@@ -249,14 +267,14 @@ struct menu *menu_new (WINDOW *win, const int posx, const int posy,
 	menu->win = win;
 	menu->items = NULL;
 	menu->nitems = 0;
-	menu->top = NULL;
-	menu->last = NULL;
-	menu->selected = NULL;
+	menu->items_alloc = 0;
+	menu->top = 0;
+	menu->selected = -1;
 	menu->posx = posx;
 	menu->posy = posy;
 	menu->width = width;
 	menu->height = height;
-	menu->marked = NULL;
+	menu->marked = -1;
 	menu->show_time = 0;
 	menu->show_rating = 0;
 	menu->show_format = false;
@@ -266,7 +284,14 @@ struct menu *menu_new (WINDOW *win, const int posx, const int posy,
 	menu->info_attr_sel_marked = A_NORMAL;
 	menu->number_items = 0;
 
-	menu->search_tree = rb_tree_new (rb_compare, rb_fname_compare, NULL);
+	menu->search_index = hash_index_new (menu_item_file, NULL);
+	menu->changes = 0;
+	menu->filter = NULL;
+	menu->filter_source = NULL;
+	menu->filter_changes = 0;
+	menu->filter_titles = 0;
+	menu->filter_own_changes = 0;
+	menu->filter_idx = NULL;
 
 	return menu;
 }
@@ -282,6 +307,10 @@ struct menu_item *menu_add (struct menu *menu, const char *title,
 	mi = (struct menu_item *)xmalloc (sizeof(struct menu_item));
 
 	mi->title = xstrdup (title);
+	mi->title_fold = NULL;
+	mi->title_width = -1;
+	mi->title_disp = NULL;
+	mi->title_disp_space = 0;
 	mi->type = type;
 	mi->file = xstrdup (file);
 	mi->num = menu->nitems;
@@ -297,23 +326,22 @@ struct menu_item *menu_add (struct menu *menu, const char *title,
 	mi->format[0] = 0;
 	mi->queue_pos = 0;
 
-	mi->next = NULL;
-	mi->prev = menu->last;
-	if (menu->last)
-		menu->last->next = mi;
+	if (menu->nitems == menu->items_alloc) {
+		menu->items_alloc = menu->items_alloc ? menu->items_alloc * 2 : 64;
+		menu->items = (struct menu_item **)xrealloc (menu->items,
+				menu->items_alloc * sizeof(struct menu_item *));
+	}
+	menu->items[menu->nitems] = mi;
 
-	if (!menu->items)
-		menu->items = mi;
-	if (!menu->top)
-		menu->top = menu->items;
-	if (!menu->selected)
-		menu->selected = menu->items;
+	if (menu->selected == -1)
+		menu->selected = 0;
 
-	if (file)
-		rb_insert (menu->search_tree, (void *)mi);
+	/* With more items for the file, the first one is found. */
+	if (file && !hash_index_find (menu->search_index, file))
+		hash_index_set (menu->search_index, mi);
 
-	menu->last = mi;
 	menu->nitems++;
+	menu->changes++;
 
 	return mi;
 }
@@ -327,6 +355,8 @@ static struct menu_item *menu_add_from_item (struct menu *menu,
 	assert (mi != NULL);
 
 	new = menu_add (menu, mi->title, mi->type, mi->file);
+	if (mi->title_fold)
+		new->title_fold = xstrdup (mi->title_fold);
 
 	new->attr_normal = mi->attr_normal;
 	new->attr_sel = mi->attr_sel;
@@ -340,30 +370,21 @@ static struct menu_item *menu_add_from_item (struct menu *menu,
 	return new;
 }
 
-static struct menu_item *get_item_relative (struct menu_item *mi,
-		int to_move)
+/* Return the index of the item to_move items after (or before if negative)
+ * the num item, stopping at the first and the last item. */
+static int get_item_relative (const struct menu *menu, const int num,
+		const int to_move)
 {
-	assert (mi != NULL);
+	int res = num + to_move;
 
-	while (to_move) {
-		struct menu_item *prev = mi;
+	assert (LIMIT(num, menu->nitems));
 
-		if (to_move > 0) {
-			mi = mi->next;
-			to_move--;
-		}
-		else {
-			mi = mi->prev;
-			to_move++;
-		}
+	if (res < 0)
+		return 0;
+	if (res >= menu->nitems)
+		return menu->nitems - 1;
 
-		if (!mi) {
-			mi = prev;
-			break;
-		}
-	}
-
-	return mi;
+	return res;
 }
 
 void menu_update_size (struct menu *menu, const int posx, const int posy,
@@ -380,9 +401,9 @@ void menu_update_size (struct menu *menu, const int posx, const int posy,
 	menu->width = width;
 	menu->height = height;
 
-	if (menu->selected && menu->top
-			&& menu->selected->num >= menu->top->num + menu->height)
-		menu->selected = get_item_relative (menu->top,
+	if (menu->selected != -1
+			&& menu->selected >= menu->top + menu->height)
+		menu->selected = get_item_relative (menu, menu->top,
 				menu->height - 1);
 }
 
@@ -392,6 +413,8 @@ static void menu_item_free (struct menu_item *mi)
 	assert (mi->title != NULL);
 
 	free (mi->title);
+	free (mi->title_fold);
+	free (mi->title_disp);
 	if (mi->file)
 		free (mi->file);
 
@@ -400,81 +423,83 @@ static void menu_item_free (struct menu_item *mi)
 
 void menu_free (struct menu *menu)
 {
-	struct menu_item *mi;
+	int i;
 
 	assert (menu != NULL);
 
-	mi = menu->items;
-	while (mi) {
-		struct menu_item *next = mi->next;
-
-		menu_item_free (mi);
-		mi = next;
-	}
+	for (i = 0; i < menu->nitems; i++)
+		menu_item_free (menu->items[i]);
+	free (menu->items);
 
-	rb_tree_free (menu->search_tree);
+	hash_index_free (menu->search_index);
+	free (menu->filter);
+	free (menu->filter_idx);
 
 	free (menu);
 }
 
 void menu_driver (struct menu *menu, const enum menu_request req)
 {
+	int last;
+
 	assert (menu != NULL);
 
 	if (menu->nitems == 0)
 		return;
 
-	if (req == REQ_DOWN && menu->selected->next) {
-		menu->selected = menu->selected->next;
-		if (menu->selected->num >= menu->top->num + menu->height) {
-			menu->top = get_item_relative (menu->selected,
+	last = menu->nitems - 1;
+
+	if (req == REQ_DOWN && menu->selected < last) {
+		menu->selected++;
+		if (menu->selected >= menu->top + menu->height) {
+			menu->top = get_item_relative (menu, menu->selected,
 					-menu->height / 2);
-			if (menu->top->num > menu->nitems - menu->height)
-				menu->top = get_item_relative (menu->last,
+			if (menu->top > menu->nitems - menu->height)
+				menu->top = get_item_relative (menu, last,
 						-menu->height + 1);
 		}
 	}
-	else if (req == REQ_UP && menu->selected->prev) {
-		menu->selected = menu->selected->prev;
-		if (menu->top->num > menu->selected->num)
-			menu->top = get_item_relative (menu->selected,
+	else if (req == REQ_UP && menu->selected > 0) {
+		menu->selected--;
+		if (menu->top > menu->selected)
+			menu->top = get_item_relative (menu, menu->selected,
 					-menu->height / 2);
 	}
-	else if (req == REQ_PGDOWN && menu->selected->num < menu->nitems - 1) {
-		if (menu->selected->num + menu->height - 1 < menu->nitems - 1) {
-			menu->selected = get_item_relative (menu->selected,
+	else if (req == REQ_PGDOWN && menu->selected < last) {
+		if (menu->selected + menu->height - 1 < last) {
+			menu->selected = get_item_relative (menu, menu->selected,
 					menu->height - 1);
-			menu->top = get_item_relative (menu->top,
+			menu->top = get_item_relative (menu, menu->top,
 					menu->height - 1);
-			if (menu->top->num > menu->nitems - menu->height)
-				menu->top = get_item_relative (menu->last,
+			if (menu->top > menu->nitems - menu->height)
+				menu->top = get_item_relative (menu, last,
 						-menu->height + 1);
 		}
 		else {
-			menu->selected = menu->last;
-			menu->top = get_item_relative (menu->last,
+			menu->selected = last;
+			menu->top = get_item_relative (menu, last,
 					-menu->height + 1);
 		}
 	}
-	else if (req == REQ_PGUP && menu->selected->prev) {
-		if (menu->selected->num - menu->height + 1 > 0) {
-			menu->selected = get_item_relative (menu->selected,
+	else if (req == REQ_PGUP && menu->selected > 0) {
+		if (menu->selected - menu->height + 1 > 0) {
+			menu->selected = get_item_relative (menu, menu->selected,
 					-menu->height + 1);
-			menu->top = get_item_relative (menu->top,
+			menu->top = get_item_relative (menu, menu->top,
 					-menu->height + 1);
 		}
 		else {
-			menu->selected = menu->items;
-			menu->top = menu->items;
+			menu->selected = 0;
+			menu->top = 0;
 		}
 	}
 	else if (req == REQ_TOP) {
-		menu->selected = menu->items;
-		menu->top = menu->items;
+		menu->selected = 0;
+		menu->top = 0;
 	}
 	else if (req == REQ_BOTTOM) {
-		menu->selected = menu->last;
-		menu->top = get_item_relative (menu->selected,
+		menu->selected = last;
+		menu->top = get_item_relative (menu, menu->selected,
 				-menu->height + 1);
 	}
 }
@@ -484,76 +509,71 @@ struct menu_item *menu_curritem (struct menu *menu)
 {
 	assert (menu != NULL);
 
-	return menu->selected;
+	return menu->selected != -1 ? menu->items[menu->selected] : NULL;
 }
 
-static void make_item_visible (struct menu *menu, struct menu_item *mi)
+static void make_item_visible (struct menu *menu, const int num)
 {
 	assert (menu != NULL);
-	assert (mi != NULL);
+	assert (LIMIT(num, menu->nitems));
 
-	if (mi->num < menu->top->num || mi->num >= menu->top->num + menu->height) {
-		menu->top = get_item_relative(mi, -menu->height/2);
+	if (num < menu->top || num >= menu->top + menu->height) {
+		menu->top = get_item_relative (menu, num, -menu->height/2);
 
-		if (menu->top->num > menu->nitems - menu->height)
-			menu->top = get_item_relative (menu->last,
+		if (menu->top > menu->nitems - menu->height)
+			menu->top = get_item_relative (menu, menu->nitems - 1,
 					-menu->height + 1);
 	}
 
-	if (menu->selected) {
-		if (menu->selected->num < menu->top->num ||
-				menu->selected->num >= menu->top->num + menu->height)
-			menu->selected = mi;
+	if (menu->selected != -1) {
+		if (menu->selected < menu->top ||
+				menu->selected >= menu->top + menu->height)
+			menu->selected = num;
 	}
 }
 
 /* Make this item selected */
-static void menu_setcurritem (struct menu *menu, struct menu_item *mi)
+static void menu_setcurritem (struct menu *menu, const int num)
 {
 	assert (menu != NULL);
-	assert (mi != NULL);
+	assert (LIMIT(num, menu->nitems));
 
-	menu->selected = mi;
-	make_item_visible (menu, mi);
+	menu->selected = num;
+	make_item_visible (menu, num);
 }
 
 /* Make the item with this title selected. */
 void menu_setcurritem_title (struct menu *menu, const char *title)
 {
-	struct menu_item *mi;
+	int i;
 
 	/* Find it */
-	for (mi = menu->top; mi; mi = mi->next)
-		if (!strcmp(mi->title, title))
+	for (i = menu->top; i < menu->nitems; i++)
+		if (!strcmp(menu->items[i]->title, title)) {
+			menu_setcurritem (menu, i);
 			break;
-
-	if (mi)
-		menu_setcurritem (menu, mi);
-}
-
-static struct menu_item *menu_find_by_position (struct menu *menu,
-		const int num)
-{
-	struct menu_item *mi;
-
-	assert (menu != NULL);
-
-	mi = menu->top;
-	while (mi && mi->num != num)
-		mi = mi->next;
-
-	return mi;
+		}
 }
 
 void menu_set_state (struct menu *menu, const struct menu_state *st)
 {
 	assert (menu != NULL);
 
-	if (!(menu->selected = menu_find_by_position(menu, st->selected_item)))
-		menu->selected = menu->last;
+	if (menu->nitems == 0) {
+		menu->selected = -1;
+		menu->top = 0;
+		return;
+	}
 
-	if (!(menu->top = menu_find_by_position(menu, st->top_item)))
-		menu->top = get_item_relative (menu->last, menu->height + 1);
+	if (LIMIT(st->selected_item, menu->nitems))
+		menu->selected = st->selected_item;
+	else
+		menu->selected = menu->nitems - 1;
+
+	if (LIMIT(st->top_item, menu->nitems))
+		menu->top = st->top_item;
+	else
+		menu->top = menu->nitems - 1;
 }
 
 void menu_set_items_numbering (struct menu *menu, const int number)
@@ -567,21 +587,56 @@ void menu_get_state (const struct menu *menu, struct menu_state *st)
 {
 	assert (menu != NULL);
 
-	st->top_item = menu->top ? menu->top->num : -1;
-	st->selected_item = menu->selected ? menu->selected->num : -1;
+	st->top_item = menu->nitems ? menu->top : -1;
+	st->selected_item = menu->selected;
 }
 
 void menu_unmark_item (struct menu *menu)
 {
 	assert (menu != NULL);
-	menu->marked = NULL;
+	menu->marked = -1;
+}
+
+static char *fold_case (const char *str)
+{
+	char *res = xstrdup (str);
+	char *p;
+
+	for (p = res; *p; p++)
+		*p = tolower ((unsigned char)*p);
+
+	return res;
+}
+
+static const char *menu_item_title_fold (struct menu_item *mi)
+{
+	if (!mi->title_fold)
+		mi->title_fold = fold_case (mi->title);
+
+	return mi->title_fold;
+}
+
+/* Can the menu filtered before be refined for the pattern (in lower case)
+ * instead of filtering the whole source menu? */
+static bool can_refine (const struct menu *prev, const struct menu *source,
+		const char *pattern)
+{
+	return prev && prev->filter && prev->filter_source == source
+		&& prev->filter_changes == source->changes
+		&& prev->filter_titles == titles_changes
+		&& prev->filter_own_changes == prev->changes
+		&& strstr (pattern, prev->filter);
 }
 
-/* Make a new menu from elements matching pattern. */
-struct menu *menu_filter_pattern (const struct menu *menu, const char *pattern)
+/* Make a new menu from elements matching pattern (case-insensitively).
+ * If prev is a menu made by filtering the same menu with a part of this
+ * pattern, only its items are matched. */
+struct menu *menu_filter_pattern (const struct menu *menu, const char *pattern,
+		const struct menu *prev)
 {
 	struct menu *new;
-	const struct menu_item *mi;
+	char *fold;
+	int i, n;
 
 	assert (menu != NULL);
 	assert (pattern != NULL);
@@ -596,12 +651,31 @@ struct menu *menu_filter_pattern (const struct menu *menu, const char *pattern)
 	menu_set_info_attr_marked (new, menu->info_attr_marked);
 	menu_set_info_attr_sel_marked (new, menu->info_attr_sel_marked);
 
-	for (mi = menu->items; mi; mi = mi->next)
-		if (strcasestr(mi->title, pattern))
+	fold = fold_case (pattern);
+	if (!can_refine (prev, menu, fold))
+		prev = NULL;
+
+	n = prev ? prev->nitems : menu->nitems;
+	new->filter_idx = (int *)xmalloc (MAX(n, 1) * sizeof(int));
+
+	for (i = 0; i < n; i++) {
+		int ix = prev ? prev->filter_idx[i] : i;
+		struct menu_item *mi = menu->items[ix];
+
+		if (strstr (menu_item_title_fold (mi), fold)) {
+			new->filter_idx[new->nitems] = ix;
 			menu_add_from_item (new, mi);
+		}
+	}
+
+	new->filter = fold;
+	new->filter_source = menu;
+	new->filter_changes = menu->changes;
+	new->filter_titles = titles_changes;
+	new->filter_own_changes = new->changes;
 
-	if (menu->marked)
-		menu_mark_item (new, menu->marked->file);
+	if (menu->marked != -1)
+		menu_mark_item (new, menu->items[menu->marked]->file);
 
 	return new;
 }
@@ -741,6 +815,11 @@ void menu_item_set_title (struct menu_item *mi, const char *title)
 	if (mi->title)
 		free (mi->title);
 	mi->title = xstrdup (title);
+
+	free (mi->title_fold);
+	mi->title_fold = NULL;
+	menu_item_forget_disp (mi);
+	titles_changes++;
 }
 
 int menu_nitems (const struct menu *menu)
@@ -752,16 +831,10 @@ int menu_nitems (const struct menu *menu)
 
 struct menu_item *menu_find (struct menu *menu, const char *fname)
 {
-	struct rb_node *x;
-
 	assert (menu != NULL);
 	assert (fname != NULL);
 
-	x = rb_search (menu->search_tree, fname);
-	if (rb_is_null(x))
-		return NULL;
-
-	return (struct menu_item *)rb_get_data (x);
+	return (struct menu_item *)hash_index_find (menu->search_index, fname);
 }
 
 void menu_mark_item (struct menu *menu, const char *file)
@@ -773,50 +846,48 @@ void menu_mark_item (struct menu *menu, const char *file)
 
 	item = menu_find (menu, file);
 	if (item)
-		menu->marked = item;
+		menu->marked = item->num;
 }
 
-static void menu_renumber_items (struct menu *menu)
+/* Return the index an item at idx has after the item at pos is deleted,
+ * the next item takes the place of the deleted one. */
+static int index_after_delete (const struct menu *menu, const int idx,
+		const int pos)
 {
-	int i = 0;
-	struct menu_item *mi;
-
-	assert (menu != NULL);
-
-	for (mi = menu->items; mi; mi = mi->next)
-		mi->num = i++;
-
-	assert (i == menu->nitems);
+	if (idx > pos)
+		return idx - 1;
+	if (idx == pos && idx == menu->nitems)
+		return idx - 1;
+	return idx;
 }
 
 static void menu_delete (struct menu *menu, struct menu_item *mi)
 {
+	int i, pos;
+
 	assert (menu != NULL);
 	assert (mi != NULL);
 
-	if (mi->prev)
-		mi->prev->next = mi->next;
-	if (mi->next)
-		mi->next->prev = mi->prev;
-
-	if (menu->items == mi)
-		menu->items = mi->next;
-	if (menu->last == mi)
-		menu->last = mi->prev;
+	pos = mi->num;
+	assert (menu->items[pos] == mi);
 
-	if (menu->marked == mi)
-		menu->marked = NULL;
-	if (menu->selected == mi)
-		menu->selected = mi->next ? mi->next : mi->prev;
-	if (menu->top == mi)
-		menu->top = mi->next ? mi->next : mi->prev;
-
-	if (mi->file)
-		rb_delete (menu->search_tree, mi->file);
+	if (mi->file && menu_find (menu, mi->file) == mi)
+		hash_index_delete (menu->search_index, mi->file);
 
 	menu->nitems--;
-	menu_renumber_items (menu);
+	memmove (menu->items + pos, menu->items + pos + 1,
+			(menu->nitems - pos) * sizeof(struct menu_item *));
+	for (i = pos; i < menu->nitems; i++)
+		menu->items[i]->num = i;
 
+	if (menu->marked == pos)
+		menu->marked = -1;
+	else
+		menu->marked = index_after_delete (menu, menu->marked, pos);
+	menu->selected = index_after_delete (menu, menu->selected, pos);
+	menu->top = MAX(index_after_delete (menu, menu->top, pos), 0);
+
+	menu->changes++;
 	menu_item_free (mi);
 }
 
@@ -837,6 +908,8 @@ void menu_item_set_align (struct menu_item *mi, const enum menu_align align)
 {
 	assert (mi != NULL);
 
+	if (mi->align != align)
+		menu_item_forget_disp (mi);
 	mi->align = align;
 }
 
@@ -849,7 +922,7 @@ void menu_setcurritem_file (struct menu *menu, const char *file)
 
 	mi = menu_find (menu, file);
 	if (mi)
-		menu_setcurritem (menu, mi);
+		menu_setcurritem (menu, mi->num);
 }
 /* Return non-zero value if the item in in the visible part of the menu. */
 int menu_is_visible (const struct menu *menu, const struct menu_item *mi)
@@ -857,13 +930,54 @@ int menu_is_visible (const struct menu *menu, const struct menu_item *mi)
 	assert (menu != NULL);
 	assert (mi != NULL);
 
-	if (mi->num >= menu->top->num
-			&& mi->num < menu->top->num + menu->height)
+	if (mi->num >= menu->top
+			&& mi->num < menu->top + menu->height)
 		return 1;
 
 	return 0;
 }
 
+/* Append the sound files shown in the menu to the list. */
+void menu_get_visible_files (const struct menu *menu, lists_t_strs *files)
+{
+	int i;
+
+	assert (menu != NULL);
+	assert (files != NULL);
+
+	for (i = menu->top; i < menu->nitems && i < menu->top + menu->height;
+			i++)
+		if (menu->items[i]->type == F_SOUND)
+			lists_strs_append (files, menu->items[i]->file);
+}
+
+/* Append the sound files up to rows items below and above the visible
+ * part of the menu to the list, the nearest first and the ones below
+ * before the ones above at the same distance. */
+void menu_get_nearby_files (const struct menu *menu, lists_t_strs *files,
+		const int rows)
+{
+	int i;
+
+	assert (menu != NULL);
+	assert (files != NULL);
+	assert (rows >= 0);
+
+	for (i = 0; i < rows; i++) {
+		int below = menu->top + menu->height + i;
+		int above = menu->top - 1 - i;
+
+		if (below >= menu->nitems && above < 0)
+			break;
+		if (below < menu->nitems && menu->items[below]->type == F_SOUND)
+			lists_strs_append (files, menu->items[below]->file);
+		if (above >= 0 && menu->items[above]->type == F_SOUND)
+			lists_strs_append (files, menu->items[above]->file);
+	}
+}
+
+/* Swap the places of the items.  The selection and the mark follow the
+ * items, the view stays where it is. */
 static void menu_items_swap (struct menu *menu, struct menu_item *mi1,
 		struct menu_item *mi2)
 {
@@ -874,60 +988,24 @@ static void menu_items_swap (struct menu *menu, struct menu_item *mi1,
 	assert (mi2 != NULL);
 	assert (mi1 != mi2);
 
-	/* if they are next to each other, change the pointers so that mi2
-	 * is the second one */
-	if (mi2->next == mi1) {
-		struct menu_item *i = mi1;
+	menu->items[mi1->num] = mi2;
+	menu->items[mi2->num] = mi1;
 
-		mi1 = mi2;
-		mi2 = i;
-	}
+	if (menu->selected == mi1->num)
+		menu->selected = mi2->num;
+	else if (menu->selected == mi2->num)
+		menu->selected = mi1->num;
 
-	if (mi1->next == mi2) {
-		if (mi2->next)
-			mi2->next->prev = mi1;
-		if (mi1->prev)
-			mi1->prev->next = mi2;
-
-		mi1->next = mi2->next;
-		mi2->prev = mi1->prev;
-		mi1->prev = mi2;
-		mi2->next = mi1;
-	}
-	else {
-		if (mi2->next)
-			mi2->next->prev = mi1;
-		if (mi2->prev)
-			mi2->prev->next = mi1;
-		mi2->next = mi1->next;
-		mi2->prev = mi1->prev;
-
-		if (mi1->next)
-			mi1->next->prev = mi2;
-		if (mi1->prev)
-			mi1->prev->next = mi2;
-		mi1->next = mi2->next;
-		mi1->prev = mi2->prev;
-	}
+	if (menu->marked == mi1->num)
+		menu->marked = mi2->num;
+	else if (menu->marked == mi2->num)
+		menu->marked = mi1->num;
 
 	t = mi1->num;
 	mi1->num = mi2->num;
 	mi2->num = t;
 
-	if (menu->top == mi1)
-		menu->top = mi2;
-	else if (menu->top == mi2)
-		menu->top = mi1;
-
-	if (menu->last == mi1)
-		menu->last = mi2;
-	else if (menu->last == mi2)
-		menu->last = mi1;
-
-	if (menu->items == mi1)
-		menu->items = mi2;
-	else if (menu->items == mi2)
-		menu->items = mi1;
+	menu->changes++;
 }
 
 void menu_swap_items (struct menu *menu, const char *file1, const char *file2)
@@ -956,5 +1034,5 @@ void menu_make_visible (struct menu *menu, const char *file)
 	assert (file != NULL);
 
 	if ((mi = menu_find(menu, file)))
-		make_item_visible (menu, mi);
+		make_item_visible (menu, mi->num);
 }
@@ -14,7 +14,8 @@
 #endif
 
 #include "files.h"
-#include "rbtree.h"
+#include "hash_index.h"
+#include "lists.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -43,6 +44,15 @@ enum menu_align
 struct menu_item
 {
 	char *title;		/* Title of the item */
+	char *title_fold;	/* Title in lower case for filtering, NULL
+				   until needed */
+
+	/* The title as last drawn, cut to fit title_disp_space columns and
+	 * converted for the terminal.  Redrawing an unchanged item costs no
+	 * conversion. */
+	int title_width;	/* columns of the title, -1 if unknown */
+	char *title_disp;
+	int title_disp_space;
 	enum menu_align align;	/* Align of the title */
 	int num;		/* Position of the item starting from 0. */
 
@@ -61,18 +71,16 @@ struct menu_item
 	char rating[FILE_RATING_STR_SZ];	/* File rating string */
 	char format[FILE_FORMAT_SZ];		/* File format */
 	int queue_pos;				/* Position in the queue */
-
-	struct menu_item *next;
-	struct menu_item *prev;
 };
 
 struct menu
 {
 	WINDOW *win;
-	struct menu_item *items;
+	struct menu_item **items; /* items in the menu order, items[i]->num
+				     is i */
 	int nitems;		/* number of present items */
-	struct menu_item *top;	/* first visible item */
-	struct menu_item *last;	/* last item in the menu */
+	int items_alloc;	/* allocated size of the items array */
+	int top;		/* index of the first visible item */
 
 	/* position and size */
 	int posx;
@@ -80,8 +88,8 @@ struct menu
 	int width;
 	int height;
 
-	struct menu_item *selected;	/* selected item */
-	struct menu_item *marked;	/* index of the marked item or -1 */
+	int selected;		/* index of the selected item or -1 */
+	int marked;		/* index of the marked item or -1 */
 
 	/* Flags for displaying information about the file. */
 	int show_time;
@@ -94,7 +102,18 @@ struct menu
 	int info_attr_sel_marked;
 	int number_items; /* display item number (position) */
 
-	struct rb_tree *search_tree; /* RB tree for searching by file name */
+	struct hash_index *search_index; /* for searching by file name */
+	unsigned int changes;	/* count of items added, deleted or moved */
+
+	/* In a menu made by menu_filter_pattern(), what it was made from,
+	 * so that a longer pattern can be matched only against these
+	 * items. */
+	char *filter;		/* the pattern in lower case */
+	const struct menu *filter_source;
+	unsigned int filter_changes;	/* filter_source->changes then */
+	unsigned int filter_titles;	/* count of titles changed then */
+	unsigned int filter_own_changes; /* own changes after filtering */
+	int *filter_idx;	/* index in filter_source of each item */
 };
 
 /* Menu state: relative (to the first item) positions of the top and selected
@@ -131,7 +150,8 @@ void menu_get_state (const struct menu *menu, struct menu_state *st);
 void menu_update_size (struct menu *menu, const int posx, const int posy,
 		const int width, const int height);
 void menu_unmark_item (struct menu *menu);
-struct menu *menu_filter_pattern (const struct menu *menu, const char *pattern);
+struct menu *menu_filter_pattern (const struct menu *menu, const char *pattern,
+		const struct menu *prev);
 void menu_set_show_time (struct menu *menu, const int t);
 void menu_set_show_rating (struct menu *menu, const bool t);
 void menu_set_show_format (struct menu *menu, const bool t);
@@ -149,6 +169,9 @@ struct menu_item *menu_find (struct menu *menu, const char *fname);
 void menu_del_item (struct menu *menu, const char *fname);
 void menu_item_set_align (struct menu_item *mi, const enum menu_align align);
 int menu_is_visible (const struct menu *menu, const struct menu_item *mi);
+void menu_get_visible_files (const struct menu *menu, lists_t_strs *files);
+void menu_get_nearby_files (const struct menu *menu, lists_t_strs *files,
+		const int rows);
 void menu_swap_items (struct menu *menu, const char *file1, const char *file2);
 void menu_make_visible (struct menu *menu, const char *file);
 void menu_set_cursor (const struct menu *m);
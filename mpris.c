@@ -24,6 +24,10 @@
 
 #include <libgen.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #include <dbus/dbus.h>
 
 #include "audio.h"
@@ -38,6 +42,7 @@
 #include "protocol.h"
 #include "server.h"
 #include "tags_cache.h"
+#include "thread_sched.h"
 
 static DBusConnection *dbus_conn; /* Connection handle. */
 static DBusError dbus_err;        /* Error flag. */
@@ -73,9 +78,27 @@ static bool mpris_track_changed = 0;
 static bool mpris_status_changed = 0;
 // static bool mpris_tracklist_changed = 0;
 static bool mpris_seeked = 0;
+static bool mpris_stopping = 0;
+static struct timespec mpris_first_change; /* of those not signalled yet */
 pthread_mutex_t mpris_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static const int MPRIS_TIMEOUT =			50;
+/* Written to wake up the thread from poll(). */
+static int wake_pipe[2] = {-1, -1};
+
+/* The metadata of the current track, so that the frequent Get and GetAll
+ * calls don't read the tags and look for the cover each time.  Only the
+ * MPRIS thread uses it, other threads just mark it invalid. */
+static struct
+{
+	char *file;		/* NULL if not valid */
+	struct file_tags *tags;
+	char cover_uri[PATH_MAX + 7];
+} metadata;
+static bool metadata_invalid = 0;	/* protected by mpris_mutex */
+
+/* Changes are signalled together after this many milliseconds from the
+ * first of them. */
+static const int MPRIS_SIGNAL_DELAY =		100;
 static const char* MPRIS_BUS_NAME =			"org.mpris.MediaPlayer2.moc";
 static const char* MPRIS_OBJECT =			"/org/mpris/MediaPlayer2";
 static const char* MPRIS_IFACE_ROOT =		"org.mpris.MediaPlayer2";
@@ -118,6 +141,15 @@ void mpris_init()
 		return;
 	}
 
+	if (pipe(wake_pipe) == -1) {
+		log_errno("MPRIS: can't create a pipe", errno);
+		wake_pipe[0] = wake_pipe[1] = -1;
+		return;
+	}
+	if (fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) == -1
+			|| fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) == -1)
+		log_errno("MPRIS: can't make the pipe non-blocking", errno);
+
 	logit("Successfully connected to D-Bus.");
 }
 
@@ -215,6 +247,42 @@ static void msg_add_dict_playback_status(DBusMessageIter *array)
 	msg_add_dict(array, DBUS_TYPE_STRING, &key, &val_s);
 }
 
+/* Make sure the metadata cache is for this file and up to date. */
+static void metadata_update(const char *file)
+{
+	bool invalid;
+
+	LOCK(mpris_mutex);
+	invalid = metadata_invalid;
+	metadata_invalid = 0;
+	UNLOCK(mpris_mutex);
+
+	if (!invalid && metadata.file && !strcmp(metadata.file, file))
+		return;
+
+	free(metadata.file);
+	if (metadata.tags)
+		tags_free(metadata.tags);
+	metadata.file = xstrdup(file);
+	metadata.cover_uri[0] = 0;
+
+	if (!file[0]) {
+		metadata.tags = tags_new();
+		return;
+	}
+
+	metadata.tags = tags_cache_get_immediate(tags_cache, file, TAGS_COMMENTS | TAGS_TIME);
+	debug("MPRIS metadata read for %s", file);
+
+	char* dir_buf = xstrdup(file);
+	char* dir = dirname(dir_buf);
+	char cover[PATH_MAX];
+	int rc = snprintf(cover, sizeof(cover), "%s/cover.jpg", dir);
+	if (rc < ssizeof(cover) && file_exists(cover))
+		snprintf(metadata.cover_uri, sizeof(metadata.cover_uri), "file://%s", cover);
+	free(dir_buf);
+}
+
 /* TODO: If tags are missing, at least a title made from file name should be returned! */
 static void msg_add_variant_metadata(DBusMessageIter *array) {
 	DBusMessageIter array_meta;
@@ -224,7 +292,6 @@ static void msg_add_variant_metadata(DBusMessageIter *array) {
 	char *file;
 	struct file_tags *tags;
 	int curr;
-	char cover_uri[PATH_MAX+7];
 
 	LOCK(curr_playing_mtx);
 	curr = curr_playing;
@@ -241,19 +308,9 @@ static void msg_add_variant_metadata(DBusMessageIter *array) {
 	file = plist_get_file(curr_plist, curr);
 	UNLOCK(plist_mtx);
 
-	if (file == NULL) {
-		file = xstrdup("");
-		tags = tags_new();
-	} else {
-		tags = tags_cache_get_immediate(tags_cache, file, TAGS_COMMENTS | TAGS_TIME);
-// 		logit("MPRIS file: %s", file);
-		char* dir = dirname(file);
-		char cover[PATH_MAX];
-		int rc = snprintf(cover, sizeof(cover), "%s/cover.jpg", dir);
-		if (rc < ssizeof(cover) && file_exists(cover)) {
-			snprintf(cover_uri, sizeof(cover_uri), "file://%s", cover);
-		} else cover_uri[0] = 0;
-	}
+	metadata_update(file ? file : "");
+	free(file);
+	tags = metadata.tags;
 
 	dbus_message_iter_open_container(array, DBUS_TYPE_VARIANT, "a{sv}", &variant);
 		dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "{sv}", &array_meta);
@@ -281,18 +338,15 @@ static void msg_add_variant_metadata(DBusMessageIter *array) {
 			else
 				val_s = "[unknown album]";
 			msg_add_dict(&array_meta, DBUS_TYPE_STRING, &key, &val_s);
-			if (cover_uri[0]) {
-// 				logit("MPRIS url: %s", cover_uri);
+			if (metadata.cover_uri[0]) {
+// 				logit("MPRIS url: %s", metadata.cover_uri);
 				key = "mpris:artUrl";
-				val_s = cover_uri;
+				val_s = metadata.cover_uri;
 				msg_add_dict(&array_meta, DBUS_TYPE_STRING, &key, &val_s);
 			}
 
 		dbus_message_iter_close_container(&variant, &array_meta);
 	dbus_message_iter_close_container(array, &variant);
-
-	free(file);
-	tags_free(tags);
 }
 
 static void msg_add_dict_metadata(DBusMessageIter *array)
@@ -509,7 +563,7 @@ static void mpris_properties_getall_root() {
 	dbus_message_iter_open_container(&args_out, DBUS_TYPE_ARRAY, "{sv}", &array);
 
 	key = "Identity";
-	val_s = xstrdup(PACKAGE_NAME);
+	val_s = PACKAGE_NAME;
 	msg_add_dict(&array, DBUS_TYPE_STRING, &key, &val_s);
 	key = "CanQuit";
 	msg_add_dict(&array, DBUS_TYPE_BOOLEAN, &key, &T);
@@ -532,7 +586,7 @@ static void mpris_properties_getall_root() {
 
 static void mpris_properties_get_root(char* key) {
 	if (!strcmp("Identity", key)) {
-		val_s = xstrdup(PACKAGE_NAME);
+		val_s = PACKAGE_NAME;
 		msg_add_variant(&args_out, DBUS_TYPE_STRING, &val_s);
 	} else if (!strcmp("CanQuit", key)) {
 		msg_add_variant(&args_out, DBUS_TYPE_BOOLEAN, &T);
@@ -780,77 +834,160 @@ static void mpris_properties() {
 	}
 }
 
-/* A server thread where all D-Bus messages are received and signals are sent. */
-void *mpris_thread(void *unused ATTR_UNUSED)
+/* Milliseconds left until the pending changes should be signalled, 0 if
+ * it's time, -1 if there are none.  Must be called with mpris_mutex. */
+static int signal_timeout()
+{
+	struct timespec now;
+	long elapsed;
+
+	if (!mpris_track_changed && !mpris_status_changed && !mpris_seeked)
+		return -1;
+
+	get_realtime(&now);
+	elapsed = (now.tv_sec - mpris_first_change.tv_sec) * 1000
+		+ (now.tv_nsec - mpris_first_change.tv_nsec) / 1000000;
+	if (elapsed < 0 || elapsed >= MPRIS_SIGNAL_DELAY)
+		return 0;
+	return MPRIS_SIGNAL_DELAY - elapsed;
+}
+
+/* Send one signal for all changes made since the last call. */
+static void send_signals()
+{
+	bool track, status, seeked;
+
+	LOCK(mpris_mutex);
+	track = mpris_track_changed;
+	status = mpris_status_changed;
+	seeked = mpris_seeked;
+	mpris_track_changed = 0;
+	mpris_status_changed = 0;
+	mpris_seeked = 0;
+	UNLOCK(mpris_mutex);
+
+	// TODO: Probably more signals needed
+// 	if (mpris_tracklist_changed) {
+// 		mpris_tracklist_change_signal();
+// 		mpris_tracklist_changed = 0;
+// 	}
+
+	/* The track change signal carries the status too. */
+	if (track)
+		mpris_track_change_signal();
+	else if (status)
+		mpris_status_change_signal();
+	if (seeked)
+		mpris_seeked_signal();
+}
+
+static void handle_message()
 {
 	DBusMessage *reply;
 	const char *iface;
 
+	dbus_message_iter_init(msg, &args_in);
+
+	/* Respond to all messages. They say in the specification some messages
+	 * are sometimes no-ops, so this is the place to start moving code. */
+
+	reply = dbus_message_new_method_return(msg);
+	dbus_message_iter_init_append(reply, &args_out);
+
+	/* Process the incoming message and prepare a response. */
+	if ((iface = dbus_message_get_interface(msg)) != NULL) {
+		if (!strcmp(MPRIS_IFACE_ROOT, iface))
+			mpris_root_methods();
+		else if (!strcmp(MPRIS_IFACE_PLAYER, iface))
+			mpris_player_methods();
+// 		else if (!strcmp(MPRIS_IFACE_TRACKLIST, iface))
+// 			mpris_tracklist_methods();
+		else if (!strcmp(PROPERTIES_IFACE, iface))
+			mpris_properties();
+		else if (!strcmp(INTROSPECTION_IFACE, iface) && dbus_message_is_method_call(msg, INTROSPECTION_IFACE, "Introspect")) {
+			msg_add_string(&mpris_introspection); // TODO: check introspection data if it reflects what is really possible
+		}
+		else logit("MPRIS unknown interface: %s", iface);  // TODO: add Playlists and TrackList interfaces
+	}
+
+	/* Send the response and clean up. */
+	dbus_connection_send(dbus_conn, reply, NULL);
+	dbus_message_unref(reply);
+	dbus_message_unref(msg);
+	dbus_connection_flush(dbus_conn);
+}
+
+/* Wake up the thread sleeping in poll(). */
+static void wake_thread()
+{
+	char c = 0;
+
+	if (wake_pipe[1] != -1 && write(wake_pipe[1], &c, 1) == -1
+			&& errno != EAGAIN)
+		log_errno("MPRIS: can't wake up the thread", errno);
+}
+
+/* A server thread where all D-Bus messages are received and signals are sent.
+ * It sleeps until there is something to read from D-Bus or a change to be
+ * signalled; changes made within MPRIS_SIGNAL_DELAY go in one signal. */
+void *mpris_thread(void *unused ATTR_UNUSED)
+{
+	struct pollfd fds[2];
+	int timeout;
+	int fd;
+
 	/* If no D-Bus connection has been established we have nothing to do. */
 	if (dbus_conn == NULL) return NULL;
 
+	if (!dbus_connection_get_unix_fd(dbus_conn, &fd)) {
+		logit("MPRIS: can't get the D-Bus connection descriptor.");
+		return NULL;
+	}
+
+	if (wake_pipe[0] == -1) return NULL;
+
 	logit("Starting the MPRIS thread.");
+	thread_sched_apply(THREAD_MPRIS);
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = wake_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (dbus_connection_read_write(dbus_conn, 0)) {
+		char buf[64];
 
-	/* Wait for an incoming message for a max. of MPRIS_TIMEOUT (50 ms). */
-	while (dbus_connection_read_write(dbus_conn, MPRIS_TIMEOUT)) {
-		if (server_quit) {
+		/* Answer all messages already read. */
+		while ((msg = dbus_connection_pop_message(dbus_conn)))
+			handle_message();
+
+		LOCK(mpris_mutex);
+		if (mpris_stopping) {
+			UNLOCK(mpris_mutex);
 			logit("Stopping the MPRIS thread due to server exit.");
 			return NULL;
 		}
+		timeout = signal_timeout();
+		UNLOCK(mpris_mutex);
 
-		/* Send signals if necessary. */
-		// TODO: Probably more signals needed
-		LOCK(mpris_mutex);
-// 		if (mpris_tracklist_changed) {
-// 			mpris_tracklist_change_signal();
-// 			mpris_tracklist_changed = 0;
-// 		}
-		if (mpris_track_changed) {
-			mpris_track_change_signal();
-			mpris_track_changed = 0;
-		}
-		if (mpris_status_changed) {
-			mpris_status_change_signal();
-			mpris_status_changed = 0;
-		}
-		if (mpris_seeked) {
-			mpris_seeked_signal();
-			mpris_seeked = 0;
+		if (timeout == 0) {
+			send_signals();
+			continue;
 		}
-		UNLOCK(mpris_mutex);
 
-		/* Fetch an incoming message. */
-		msg = dbus_connection_pop_message(dbus_conn);
-		if (msg == NULL) continue;
-
-		dbus_message_iter_init(msg, &args_in);
-
-		/* Respond to all messages. They say in the specification some messages
-		 * are sometimes no-ops, so this is the place to start moving code. */
-
-		reply = dbus_message_new_method_return(msg);
-		dbus_message_iter_init_append(reply, &args_out);
-
-		/* Process the incoming message and prepare a response. */
-		if ((iface = dbus_message_get_interface(msg)) != NULL) {
-			if (!strcmp(MPRIS_IFACE_ROOT, iface))
-				mpris_root_methods();
-			else if (!strcmp(MPRIS_IFACE_PLAYER, iface))
-				mpris_player_methods();
-// 			else if (!strcmp(MPRIS_IFACE_TRACKLIST, iface))
-// 				mpris_tracklist_methods();
-			else if (!strcmp(PROPERTIES_IFACE, iface))
-				mpris_properties();
-			else if (!strcmp(INTROSPECTION_IFACE, iface) && dbus_message_is_method_call(msg, INTROSPECTION_IFACE, "Introspect")) {
-				msg_add_string(&mpris_introspection); // TODO: check introspection data if it reflects what is really possible
-			}
-			else logit("MPRIS unknown interface: %s", iface);  // TODO: add Playlists and TrackList interfaces
+		/* libdbus may have buffered more input than one message. */
+		if (dbus_connection_get_dispatch_status(dbus_conn)
+				== DBUS_DISPATCH_DATA_REMAINS)
+			continue;
+
+		if (poll(fds, 2, timeout) == -1 && errno != EINTR) {
+			log_errno("MPRIS: poll() failed", errno);
+			break;
 		}
 
-		/* Send the response and clean up. */
-		dbus_connection_send(dbus_conn, reply, NULL);
-		dbus_message_unref(msg);
-		dbus_connection_flush(dbus_conn);
+		if (fds[1].revents & POLLIN)
+			while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+				;
 	}
 
 	if (dbus_error_is_set(&dbus_err)) {
@@ -871,28 +1008,61 @@ void *mpris_thread(void *unused ATTR_UNUSED)
 // 	UNLOCK(mpris_mutex);
 // }
 
+/* Set a change flag, starting the signal delay if it's the first one.
+ * Must be called with mpris_mutex. */
+static void note_change(bool *flag)
+{
+	if (!mpris_track_changed && !mpris_status_changed && !mpris_seeked)
+		get_realtime(&mpris_first_change);
+	*flag = 1;
+}
+
 void mpris_track_change()
 {
 	LOCK(mpris_mutex);
-	mpris_track_changed = 1;
+	note_change(&mpris_track_changed);
+	metadata_invalid = 1;
 	UNLOCK(mpris_mutex);
+	wake_thread();
 }
 
 void mpris_status_change()
 {
 	LOCK(mpris_mutex);
-	mpris_status_changed = 1;
+	note_change(&mpris_status_changed);
 	UNLOCK(mpris_mutex);
+	wake_thread();
 }
 
 void mpris_position_change()
 {
 	LOCK(mpris_mutex);
-	mpris_seeked = 1;
+	note_change(&mpris_seeked);
 	UNLOCK(mpris_mutex);
+	wake_thread();
+}
+
+/* Make the thread exit, it must be joined after that. */
+void mpris_stop()
+{
+	LOCK(mpris_mutex);
+	mpris_stopping = 1;
+	UNLOCK(mpris_mutex);
+	wake_thread();
 }
 
 void mpris_exit()
 {
+	if (wake_pipe[0] != -1) {
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		wake_pipe[0] = wake_pipe[1] = -1;
+	}
+	free(metadata.file);
+	metadata.file = NULL;
+	if (metadata.tags) {
+		tags_free(metadata.tags);
+		metadata.tags = NULL;
+	}
 	pthread_mutex_destroy(&mpris_mutex);
 }
@@ -3,6 +3,7 @@
 
 void mpris_init();
 void *mpris_thread(void *unused ATTR_UNUSED);
+void mpris_stop();
 void mpris_exit();
 void mpris_track_change();
 void mpris_status_change();
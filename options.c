@@ -436,7 +436,7 @@ static void add_list (const char *name, const char *value, options_t_check *chec
 	va_list va;
 
 	pos = init_option (name, OPTION_LIST);
-	options[pos].value.list = lists_strs_new (8);
+	options[pos].value.list = lists_strs_new_arena (8);
 	if (value)
 		lists_strs_split (options[pos].value.list, value, ":");
 	options[pos].check = check;
@@ -667,7 +667,7 @@ void options_init ()
 	add_path ("MusicDir", NULL, CHECK_NONE);
 	add_bool ("StartInMusicDir", false);
 	add_int  ("CircularLogSize", 0, CHECK_RANGE(1), 0, INT_MAX);
-	add_symb ("Sort", "FileName", CHECK_SYMBOL(1), "FileName");
+	add_symb ("Sort", "FileName", CHECK_SYMBOL(2), "FileName", "Natural");
 	add_bool ("ShowStreamErrors", false);
 	add_bool ("MP3IgnoreCRCErrors", true);
 	add_bool ("Repeat", false);
@@ -678,8 +678,17 @@ void options_init ()
 	          "%(n:%n :)%(a:%a - :)%(t:%t:)%(A: \\(%A\\):)", CHECK_NONE);
 	add_int  ("InputBuffer", 512, CHECK_RANGE(1), 32, INT_MAX);
 	add_int  ("OutputBuffer", 512, CHECK_RANGE(1), 128, INT_MAX);
+	add_bool ("LowLatency", false);
+	add_int  ("LowLatencyBuffer", 64, CHECK_RANGE(1), 64, INT_MAX);
+	add_bool ("OutputStats", false);
+	add_symb ("PauseMode", "Close", CHECK_SYMBOL(2), "Close", "Keep");
+	add_int  ("PauseCloseDelay", 60, CHECK_RANGE(1), 0, INT_MAX);
 	add_int  ("Prebuffering", 64, CHECK_RANGE(1), 0, INT_MAX);
+	add_bool ("AdaptivePrebuffering", true);
+	add_int  ("FileReadAhead", 1024, CHECK_RANGE(1), 0, INT_MAX);
+	add_bool ("FileDropBehind", false);
 	add_str  ("HTTPProxy", NULL, CHECK_NONE);
+	add_int  ("HTTPCacheSize", 256, CHECK_RANGE(1), 0, INT_MAX);
 
 #ifdef OPENBSD
 	add_list ("SoundDriver", "SNDIO:JACK:OSS",
@@ -704,9 +713,16 @@ void options_init ()
 	add_str  ("ALSADevice", "default", CHECK_NONE);
 	add_str  ("ALSAMixer1", "PCM", CHECK_NONE);
 	add_str  ("ALSAMixer2", "Master", CHECK_NONE);
+	add_bool ("ALSAMmap", false);
+
+	add_int  ("PulseTargetLength", 0, CHECK_RANGE(1), 0, 10000);
+	add_int  ("PulseMinRequest", 0, CHECK_RANGE(1), 0, 10000);
 
 	add_bool ("Softmixer_SaveState", true);
 	add_bool ("Equalizer_SaveState", true);
+	add_symb ("Normalize", "Off", CHECK_SYMBOL(3), "Off", "Track", "Album");
+	add_int  ("NormalizeTarget", -18, CHECK_RANGE(1), -40, 0);
+	add_bool ("NormalizePreventClipping", true);
 
 	add_bool ("ShowHiddenFiles", false);
 	add_bool ("HideFileExtension", false);
@@ -730,6 +746,7 @@ void options_init ()
 	add_bool ("AutoLoadLyrics", false);
 	add_path ("MOCDir", "~/.moc", CHECK_NONE);
 	add_bool ("UseMMap", false);
+	add_int  ("MMapWindow", 64, CHECK_RANGE(1), 0, 2048);
 	add_bool ("UseMimeMagic", false);
 	add_str  ("ID3v1TagsEncoding", "WINDOWS-1250", CHECK_NONE);
 	add_bool ("UseRCC", true);
@@ -738,6 +755,9 @@ void options_init ()
 	add_bool ("FileNamesIconv", false);
 	add_bool ("NonUTFXterm", false);
 	add_bool ("Precache", true);
+	add_int  ("PrecacheDepth", 1, CHECK_RANGE(1), 1, 8);
+	add_int  ("PrecacheSize", 36, CHECK_RANGE(1), 4, INT_MAX);
+	add_int  ("Crossfade", 0, CHECK_RANGE(1), 0, 30);
 	add_bool ("SavePlaylist", true);
 	add_bool ("SyncPlaylist", true);
 	add_bool ("SavePlaylistTags", false);
@@ -780,13 +800,32 @@ void options_init ()
 	add_symb ("ResampleMethod", "Linear",
 	                 CHECK_SYMBOL(5), "SincBestQuality", "SincMediumQuality",
 	                                  "SincFastest", "ZeroOrderHold", "Linear");
+	add_list ("ResampleMethodByRate", NULL, CHECK_FUNCTION);
 	add_int  ("EnableResample", 1, CHECK_RANGE(1), 0, 2);
 	add_int  ("MaxSamplerate", 0, CHECK_RANGE(1), 0, 500000);
 	add_int  ("MaxChannels", 0, CHECK_RANGE(1), 0, 500000);
 	add_list ("MaskOutputFormats","",CHECK_NONE);
+	add_bool ("PreferFloatOutput", true);
+	add_bool ("LockOutputFormat", false);
+	add_list ("ExtraOutputs", NULL, CHECK_NONE);
+	add_int  ("ExtraOutputBuffer", 512, CHECK_RANGE(1), 16, INT_MAX / 1024);
 	add_int  ("MixerBarWidth",  30, CHECK_RANGE(1), 10, INT_MAX);
 	add_bool ("UseRealtimePriority", false);
+	add_list ("ThreadCPUs", NULL, CHECK_FUNCTION);
+	add_list ("ThreadScheduling", NULL, CHECK_FUNCTION);
 	add_int  ("TagsCacheSize", 256, CHECK_RANGE(1), 0, INT_MAX);
+	add_int  ("TagsMemCacheSize", 1024, CHECK_RANGE(1), 0, INT_MAX);
+#ifdef HAVE_DB_H
+	add_symb ("TagsCacheBackend", "BerkeleyDB",
+	                 CHECK_SYMBOL(2), "BerkeleyDB", "File");
+#else
+	add_symb ("TagsCacheBackend", "File",
+	                 CHECK_SYMBOL(2), "BerkeleyDB", "File");
+#endif
+	add_int  ("TagsCacheSyncCount", 256, CHECK_RANGE(1), 0, INT_MAX);
+	add_int  ("TagsCacheSyncInterval", 30, CHECK_RANGE(1), 0, INT_MAX);
+	add_int  ("TagsReaderThreads", 0, CHECK_RANGE(1), 0, 32);
+	add_bool ("WatchTags", true);
 	add_bool ("PlaylistNumbering", true);
 
 	add_list ("Layout1", "directory(0,0,50%,100%):playlist(50%,0,FILL,100%)",
@@ -862,6 +901,7 @@ void options_init ()
 	add_path ("OnServerStart", NULL, CHECK_NONE);
 	add_path ("OnServerStop", NULL, CHECK_NONE);
 	add_path ("OnStop", NULL, CHECK_NONE);
+	add_path ("HookHelper", NULL, CHECK_NONE);
 
 	add_bool ("QueueNextSongReturn", false);
 
@@ -932,7 +972,7 @@ int options_check_list (const char *name, const char *val)
 	if (opt == -1)
 		return 0;
 
-	list = lists_strs_new (8);
+	list = lists_strs_new_arena (8);
 	size = lists_strs_split (list, val, ":");
 	result = 1;
 	for (ix = 0; ix < size; ix += 1) {
@@ -1360,6 +1400,44 @@ lists_t_strs *options_get_list (const char *name)
 	return options[i].value.list;
 }
 
+/* Return the index of the handle's option, looking it up the first time.
+ * Threads racing on the first lookup store the same index. */
+static int handle_option (options_t_handle *h, enum option_type type)
+{
+	int i = ATOMIC_LOAD (&h->ix);
+
+	if (i == -1) {
+		i = find_option (h->name, type);
+		if (i == -1)
+			fatal ("Tried to get wrong option '%s'!", h->name);
+		ATOMIC_STORE (&h->ix, i);
+	}
+
+	assert (options[i].type & type);
+
+	return i;
+}
+
+int options_handle_int (options_t_handle *h)
+{
+	return options[handle_option (h, OPTION_INT)].value.num;
+}
+
+bool options_handle_bool (options_t_handle *h)
+{
+	return options[handle_option (h, OPTION_BOOL)].value.boolean;
+}
+
+char *options_handle_str (options_t_handle *h)
+{
+	return options[handle_option (h, OPTION_STR | OPTION_PATH)].value.str;
+}
+
+char *options_handle_symb (options_t_handle *h)
+{
+	return options[handle_option (h, OPTION_SYMB)].value.str;
+}
+
 enum option_type options_get_type (const char *name)
 {
 	int i = find_option (name, OPTION_ANY);
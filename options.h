@@ -19,11 +19,25 @@ enum option_type
 	OPTION_ANY  = 255
 };
 
+/* An option looked up by name once and then read by its index, for the
+ * options read often.  Define it with OPTIONS_HANDLE("Name"). */
+typedef struct
+{
+	const char *name;
+	int ix;		/* index in the options table, -1 until looked up */
+} options_t_handle;
+
+#define OPTIONS_HANDLE(name)	{ (name), -1 }
+
 int options_get_int (const char *name);
 bool options_get_bool (const char *name);
 char *options_get_str (const char *name);
 char *options_get_symb (const char *name);
 lists_t_strs *options_get_list (const char *name);
+int options_handle_int (options_t_handle *h);
+bool options_handle_bool (options_t_handle *h);
+char *options_handle_str (options_t_handle *h);
+char *options_handle_symb (options_t_handle *h);
 void options_set_int (const char *name, const int value);
 void options_set_bool (const char *name, const bool value);
 void options_set_str (const char *name, const char *value);
@@ -18,8 +18,10 @@
 #endif
 
 #include <assert.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 
 #ifdef OUT_TEST
@@ -37,10 +39,17 @@
 #include "fifo_buf.h"
 #include "out_buf.h"
 #include "options.h"
+#include "stats.h"
+#include "thread_sched.h"
 
 struct out_buf
 {
+	/* The PCM data path: the decoder puts and the read thread gets
+	 * without taking any lock. */
 	struct fifo_buf *buf;
+
+	/* The control channel: the mutex is taken only to change the state
+	 * flags below and to sleep or wake up, never while moving PCM data. */
 	pthread_mutex_t	mutex;
 	pthread_t tid;	/* Thread id of the reading thread. */
 
@@ -52,46 +61,173 @@ struct out_buf
 	 * the buffer. */
 	out_buf_free_callback *free_callback;
 
-	/* State flags of the buffer. */
+	/* State flags of the buffer.  They are changed with the mutex held
+	 * and read by the reading thread with ATOMIC_LOAD(). */
 	int pause;
 	int exit;	/* Exit when the buffer is empty. */
 	int stop;	/* Don't play anything. */
 
 	int reset_dev;	/* Request to the reading thread to reset the audio
 			   device. */
+	int stop_ack;	/* The reading thread has seen the stop request. */
 
-	float time;	/* Time of played sound. */
-	int hardware_buf_fill;	/* How the sound card buffer is filled. */
+	/* The playback clock counts whole frames, so it doesn't drift
+	 * however long the stream plays. */
+	pthread_mutex_t time_mtx;	/* Mutex for the clock fields. */
+	double time_base;	/* Time of the first frame counted. */
+	uint64_t frames;	/* Frames played since time_base. */
+	int rate;		/* Rate the frames were played at. */
+	int delay_frames;	/* Frames the device has not played yet. */
 
 	int read_thread_waiting; /* Is the read thread waiting for data? */
+	int writer_waiting;	/* Is out_buf_put() waiting for space? */
+
+	/* In the low latency mode the writes follow the driver's period and
+	 * out_buf_put() keeps the fill under fill_target, which is doubled
+	 * on each underrun until it reaches the buffer size. */
+	int low_latency;
+	size_t fill_target;
+
+	int starved;	/* The reading thread ran dry while playing.
+			   Protected by the mutex. */
+	unsigned int underruns;	/* Number of underruns so far. */
+
+	int output_stats;	/* Time the writes (OutputStats). */
+
+	/* PauseMode is Keep: pause the device instead of closing it, and
+	 * close it only after it was paused for pause_close_delay seconds
+	 * (never if 0). */
+	int soft_pause;
+	int pause_close_delay;
 };
 
-/* Don't play more than this value (in seconds) in one audio_play().
- * This prevents locking. */
-#define AUDIO_MAX_PLAY		0.01
-#define AUDIO_MAX_PLAY_BYTES	32768
+/* How long the sound fades out when pausing the device and in when
+ * resuming. */
+#define PAUSE_FADE_MSEC	20
 
 #ifdef OUT_TEST
 static int fd;
 #endif
 
-static void set_realtime_prio ()
+/* Wake up the thread sleeping in out_buf_put() if there is one.  The fence
+ * pairs with the one in out_buf_put() so that either we see the flag or
+ * the writer sees the space we have just made. */
+static void wake_writer (struct out_buf *buf)
 {
-#ifdef HAVE_SCHED_GET_PRIORITY_MAX
-	int rc;
+	ATOMIC_FENCE ();
+	if (ATOMIC_LOAD (&buf->writer_waiting)) {
+		LOCK (buf->mutex);
+		pthread_cond_broadcast (&buf->ready_cond);
+		UNLOCK (buf->mutex);
+	}
+}
+
+/* Wake up the reading thread if it is waiting for data. */
+static void wake_reader (struct out_buf *buf)
+{
+	ATOMIC_FENCE ();
+	if (ATOMIC_LOAD (&buf->read_thread_waiting)) {
+		LOCK (buf->mutex);
+		pthread_cond_signal (&buf->play_cond);
+		UNLOCK (buf->mutex);
+	}
+}
 
-	if (options_get_bool("UseRealtimePriority")) {
-		struct sched_param param;
+/* Count an underrun and give the buffer more room if it is being kept
+ * short. */
+static void note_underrun (struct out_buf *buf)
+{
+	size_t target = ATOMIC_LOAD (&buf->fill_target);
+	unsigned int count = ATOMIC_ADD (&buf->underruns, 1);
+
+	stats_add (STAT_UNDERRUNS, 1);
+	if (buf->output_stats)
+		stats_output_xrun ();
+
+	if (target < fifo_buf_get_size (buf->buf)) {
+		target = MIN(2 * target, fifo_buf_get_size (buf->buf));
+		ATOMIC_STORE (&buf->fill_target, target);
+		logit ("Buffer underrun (%u so far), raising the fill target "
+		       "to %zuKB", count, target / 1024);
+	}
+	else
+		logit ("Buffer underrun (%u so far)", count);
+}
+
+/* How much can be put into the buffer now? */
+static size_t free_space (struct out_buf *buf)
+{
+	size_t fill = fifo_buf_get_fill (buf->buf);
+	size_t target = ATOMIC_LOAD (&buf->fill_target);
 
-		param.sched_priority = sched_get_priority_max(SCHED_RR);
-		rc = pthread_setschedparam (pthread_self (), SCHED_RR, &param);
-		if (rc != 0)
-			log_errno ("Can't set realtime priority", rc);
+	return fill < target ? MIN(target - fill,
+	                           fifo_buf_get_space (buf->buf)) : 0;
+}
+
+/* Is there nothing the reading thread could play now? */
+static inline int nothing_to_play (struct out_buf *buf)
+{
+	return (fifo_buf_get_fill (buf->buf) == 0
+	        || ATOMIC_LOAD (&buf->pause) || ATOMIC_LOAD (&buf->stop))
+	       && !ATOMIC_LOAD (&buf->exit);
+}
+
+/* Advance the playback clock by frames played at rate, delay is how many
+ * frames the device still holds. */
+static void count_frames (struct out_buf *buf, const int frames,
+		const int rate, const int delay)
+{
+	LOCK (buf->time_mtx);
+
+	/* Start counting anew if the rate has changed. */
+	if (rate != buf->rate) {
+		if (buf->rate)
+			buf->time_base += buf->frames / (double)buf->rate;
+		buf->frames = 0;
+		buf->rate = rate;
 	}
-#else
-	logit ("No sched_get_priority_max() function: "
-	                  "realtime priority not used.");
-#endif
+
+	buf->frames += frames;
+	buf->delay_frames = delay;
+
+	UNLOCK (buf->time_mtx);
+}
+
+/* Bytes of the sound in the device's format to fade on pause or resume. */
+static size_t fade_bytes (const int bpf)
+{
+	size_t len = audio_get_bps () / 1000 * PAUSE_FADE_MSEC;
+
+	return MIN(len, AUDIO_MAX_PLAY_BYTES) / bpf * bpf;
+}
+
+/* Play the sound coming next in the buffer faded out and pause the device
+ * after it.  Return 0 if the device can't be paused. */
+static int pause_device (struct out_buf *buf)
+{
+	char fade_buf[AUDIO_MAX_PLAY_BYTES];
+	int bpf = audio_get_bpf ();
+	size_t len = 0, pos = 0;
+
+	if (bpf && !ATOMIC_LOAD (&buf->stop))
+		len = fifo_buf_get (buf->buf, fade_buf, fade_bytes (bpf));
+
+	if (len) {
+		audio_fade (fade_buf, len, 0);
+		while (pos < len)
+			pos += audio_send_pcm (fade_buf + pos, len - pos);
+		count_frames (buf, len / bpf, audio_get_bps () / bpf, 0);
+	}
+
+	return audio_pause_device ();
+}
+
+/* Take the paused device out of the pause, dropping the silence it
+ * holds. */
+static void drop_paused_device ()
+{
+	audio_resume_device ();
+	audio_reset ();
 }
 
 /* Reading thread of the buffer. */
@@ -99,120 +235,223 @@ static void *read_thread (void *arg)
 {
 	struct out_buf *buf = (struct out_buf *)arg;
 	int audio_dev_closed = 0;
+	int dev_paused = 0;	/* paused but not closed (PauseMode) */
+	struct timespec paused_at;
+	int fade_in = 0;
+	int playing = 0;
+	int device_xruns = 0; /* the driver counts its underruns */
 
 	logit ("entering output buffer thread");
 
-	set_realtime_prio ();
-
-	LOCK (buf->mutex);
+	thread_sched_apply (THREAD_OUTPUT);
 
 	while (1) {
 		int played = 0;
 		char play_buf[AUDIO_MAX_PLAY_BYTES];
 		int play_buf_fill;
 		int play_buf_pos = 0;
-
-		if (buf->reset_dev && !audio_dev_closed) {
-			audio_reset ();
-			buf->reset_dev = 0;
+		int audio_bpf;
+		size_t play_buf_frames, fill;
+		int delay, avail, xruns;
+		struct timespec write_start;
+		out_buf_free_callback *free_callback;
+
+		if (!audio_dev_closed && ATOMIC_XCHG (&buf->reset_dev, 0)) {
+			if (dev_paused) {
+				drop_paused_device ();
+				dev_paused = 0;
+			}
+			else
+				audio_reset ();
 		}
 
-		if (buf->stop)
+		if (ATOMIC_LOAD (&buf->stop)) {
 			fifo_buf_clear (buf->buf);
-
-		if (buf->free_callback) {
-			/* unlock the mutex to make calls to out_buf functions
-			 * possible in the callback */
-			UNLOCK (buf->mutex);
-			buf->free_callback ();
-			LOCK (buf->mutex);
+			if (dev_paused) {
+				logit ("Stopped while paused");
+				drop_paused_device ();
+				dev_paused = 0;
+			}
 		}
 
-		debug ("sending the signal");
-		pthread_cond_broadcast (&buf->ready_cond);
+		free_callback = ATOMIC_LOAD (&buf->free_callback);
+		if (free_callback)
+			free_callback ();
 
-		if ((fifo_buf_get_fill(buf->buf) == 0 || buf->pause || buf->stop)
-				&& !buf->exit) {
-			if (buf->pause && !audio_dev_closed) {
-				logit ("Closing the device due to pause");
-				audio_close ();
-				audio_dev_closed = 1;
-			}
+		if (nothing_to_play (buf)) {
+			LOCK (buf->mutex);
 
-			debug ("waiting for something in the buffer");
-			buf->read_thread_waiting = 1;
-			pthread_cond_wait (&buf->play_cond, &buf->mutex);
-			debug ("something appeared in the buffer");
-		}
+			/* Fading out and pausing takes a while, so it is
+			 * done with the mutex unlocked; the state is checked
+			 * again below. */
+			if (buf->pause && !audio_dev_closed && !dev_paused) {
+				int soft_pause = buf->soft_pause;
+
+				UNLOCK (buf->mutex);
+				if (soft_pause && pause_device (buf)) {
+					logit ("Device paused");
+					dev_paused = 1;
+					get_realtime (&paused_at);
+				}
+				else {
+					logit ("Closing the device due to pause");
+					audio_close ();
+					audio_dev_closed = 1;
+				}
+				LOCK (buf->mutex);
+			}
 
-		buf->read_thread_waiting = 0;
+			if (buf->stop)
+				buf->stop_ack = 1;
 
-		if (audio_dev_closed && !buf->pause) {
-			logit ("Opening the device again after pause");
-			if (!audio_open(NULL)) {
-				logit ("Can't reopen the device! sleeping...");
-				xsleep (1, 1); /* there is no way to exit :( */
+			if (buf->pause || buf->stop) {
+				playing = 0;
+				buf->starved = 0;
+				if (buf->output_stats)
+					stats_output_idle ();
+			}
+			else if (playing)
+				buf->starved = 1;
+
+			ATOMIC_STORE (&buf->read_thread_waiting, 1);
+			ATOMIC_FENCE ();
+			pthread_cond_broadcast (&buf->ready_cond);
+
+			/* Check again: the writer might have put something
+			 * before it could see that we are waiting. */
+			if (nothing_to_play (buf)) {
+				debug ("waiting for something in the buffer");
+				if (dev_paused && buf->pause
+				               && buf->pause_close_delay) {
+					struct timespec until = paused_at;
+
+					until.tv_sec += buf->pause_close_delay;
+					if (pthread_cond_timedwait (&buf->play_cond,
+					                            &buf->mutex,
+					                            &until) == ETIMEDOUT
+					              && buf->pause) {
+						logit ("Closing the device paused "
+						       "for too long");
+						audio_close ();
+						audio_dev_closed = 1;
+						dev_paused = 0;
+					}
+				}
+				else
+					pthread_cond_wait (&buf->play_cond,
+					                   &buf->mutex);
+				debug ("something appeared in the buffer");
 			}
-			else
-				audio_dev_closed = 0;
-		}
 
-		if (fifo_buf_get_fill(buf->buf) == 0) {
-			if (buf->exit) {
-				logit ("exit");
-				break;
+			/* If the driver counts underruns, running dry here
+			 * is one only when the device runs dry too. */
+			if (buf->starved && !nothing_to_play (buf)
+			                 && !ATOMIC_LOAD (&buf->exit)) {
+				buf->starved = 0;
+				if (!device_xruns)
+					note_underrun (buf);
 			}
 
-			logit ("buffer empty");
+			ATOMIC_STORE (&buf->read_thread_waiting, 0);
+			UNLOCK (buf->mutex);
+
 			continue;
 		}
 
-		if (buf->pause) {
-			logit ("paused");
-			continue;
+		if (fifo_buf_get_fill(buf->buf) == 0) {
+			assert (ATOMIC_LOAD (&buf->exit));
+			logit ("exit");
+			break;
 		}
 
-		if (buf->stop) {
-			logit ("stopped");
+		if (ATOMIC_LOAD (&buf->pause) || ATOMIC_LOAD (&buf->stop)) {
+
+			/* Only exit is pending: drop what we can't play. */
+			fifo_buf_clear (buf->buf);
 			continue;
 		}
 
-		if (!audio_dev_closed) {
-			int audio_bpf;
-			size_t play_buf_frames;
+		if (audio_dev_closed) {
+			logit ("Opening the device again after pause");
+			if (!audio_open(NULL)) {
+				logit ("Can't reopen the device! sleeping...");
+				xsleep (1, 1); /* there is no way to exit :( */
+				continue;
+			}
+			audio_dev_closed = 0;
+		}
 
-			audio_bpf = audio_get_bpf();
+		if (dev_paused) {
+			logit ("Resuming the paused device");
+			audio_resume_device ();
+			dev_paused = 0;
+			fade_in = 1;
+		}
+
+		audio_bpf = audio_get_bpf();
+		if (buf->low_latency && audio_get_period () > 0)
+			play_buf_frames = MIN(audio_get_period (),
+			                      AUDIO_MAX_PLAY_BYTES / audio_bpf);
+		else
 			play_buf_frames = MIN(audio_get_bps() * AUDIO_MAX_PLAY,
 			                      AUDIO_MAX_PLAY_BYTES) / audio_bpf;
-			play_buf_fill = fifo_buf_get(buf->buf, play_buf,
-			                             play_buf_frames * audio_bpf);
-			UNLOCK (buf->mutex);
+		fill = fifo_buf_get_fill (buf->buf);
+		stats_fill_sample (fill, fifo_buf_get_size (buf->buf));
+		play_buf_fill = fifo_buf_get(buf->buf, play_buf,
+		                             play_buf_frames * audio_bpf);
+		wake_writer (buf);
+
+		if (fade_in) {
+			audio_fade (play_buf, MIN((size_t)play_buf_fill,
+			                          fade_bytes (audio_bpf)), 1);
+			fade_in = 0;
+		}
 
-			debug ("playing %d bytes", play_buf_fill);
+		debug ("playing %d bytes", play_buf_fill);
 
-			while (play_buf_pos < play_buf_fill) {
-				played = audio_send_pcm (
-						play_buf + play_buf_pos,
-						play_buf_fill - play_buf_pos);
+		if (buf->output_stats)
+			get_realtime (&write_start);
+
+		while (play_buf_pos < play_buf_fill) {
+			played = audio_send_pcm (
+					play_buf + play_buf_pos,
+					play_buf_fill - play_buf_pos);
 
 #ifdef OUT_TEST
-				write (fd, play_buf + play_buf_pos, played);
+			write (fd, play_buf + play_buf_pos, played);
 #endif
 
-				play_buf_pos += played;
-			}
+			play_buf_pos += played;
+		}
 
-			/*logit ("done sending PCM");*/
+		playing = 1;
 
-			LOCK (buf->mutex);
+		/*logit ("done sending PCM");*/
 
-			/* Update time */
-			if (play_buf_fill && audio_get_bps())
-				buf->time += play_buf_fill / (float)audio_get_bps();
-			buf->hardware_buf_fill = audio_get_buf_fill();
+		xruns = audio_get_delay (&delay, &avail);
+		device_xruns = xruns >= 0;
+
+		if (buf->output_stats) {
+			int rate = audio_get_bps () / audio_bpf;
+
+			stats_output_write (&write_start,
+			                    stats_usec_since (&write_start),
+			                    rate ? delay * INT64_C(1000000) / rate
+			                         : -1,
+			                    fill, fifo_buf_get_size (buf->buf));
 		}
+
+		while (xruns-- > 0)
+			note_underrun (buf);
+
+		count_frames (buf, play_buf_fill / audio_bpf,
+		              audio_get_bps () / audio_bpf, delay);
 	}
 
+	/* Nobody must be left waiting for us. */
+	LOCK (buf->mutex);
+	buf->stop_ack = 1;
+	pthread_cond_broadcast (&buf->ready_cond);
 	UNLOCK (buf->mutex);
 
 	logit ("exiting");
@@ -230,17 +469,37 @@ struct out_buf *out_buf_new (int size)
 
 	buf = xmalloc (sizeof (struct out_buf));
 
-	buf->buf = fifo_buf_new (size);
+	buf->buf = fifo_buf_new (size, MEM_AUDIO);
 	buf->exit = 0;
 	buf->pause = 0;
 	buf->stop = 0;
-	buf->time = 0.0;
+	buf->stop_ack = 0;
+	buf->time_base = 0.0;
+	buf->frames = 0;
+	buf->rate = 0;
+	buf->delay_frames = 0;
 	buf->reset_dev = 0;
-	buf->hardware_buf_fill = 0;
 	buf->read_thread_waiting = 0;
+	buf->writer_waiting = 0;
 	buf->free_callback = NULL;
+	buf->starved = 0;
+	buf->underruns = 0;
+	buf->output_stats = options_get_bool ("OutputStats");
+	buf->soft_pause = !strcasecmp (options_get_symb ("PauseMode"), "Keep");
+	buf->pause_close_delay = options_get_int ("PauseCloseDelay");
+
+	buf->low_latency = options_get_bool ("LowLatency");
+	if (buf->low_latency) {
+		buf->fill_target = MIN(options_get_int ("LowLatencyBuffer")
+		                       * 1024, size);
+		logit ("Low latency mode, filling the buffer up to %zuKB",
+		       buf->fill_target / 1024);
+	}
+	else
+		buf->fill_target = size;
 
 	pthread_mutex_init (&buf->mutex, NULL);
+	pthread_mutex_init (&buf->time_mtx, NULL);
 	pthread_cond_init (&buf->play_cond, NULL);
 	pthread_cond_init (&buf->ready_cond, NULL);
 
@@ -264,7 +523,7 @@ void out_buf_free (struct out_buf *buf)
 	assert (buf != NULL);
 
 	LOCK (buf->mutex);
-	buf->exit = 1;
+	ATOMIC_STORE (&buf->exit, 1);
 	pthread_cond_signal (&buf->play_cond);
 	UNLOCK (buf->mutex);
 
@@ -282,6 +541,9 @@ void out_buf_free (struct out_buf *buf)
 	rc = pthread_mutex_destroy (&buf->mutex);
 	if (rc != 0)
 		log_errno ("Destroying buffer mutex failed", rc);
+	rc = pthread_mutex_destroy (&buf->time_mtx);
+	if (rc != 0)
+		log_errno ("Destroying buffer time mutex failed", rc);
 	rc = pthread_cond_destroy (&buf->play_cond);
 	if (rc != 0)
 		log_errno ("Destroying buffer play condition failed", rc);
@@ -308,28 +570,30 @@ int out_buf_put (struct out_buf *buf, const char *data, int size)
 	while (size) {
 		int written;
 
-		LOCK (buf->mutex);
-
-		if (fifo_buf_get_space(buf->buf) == 0 && !buf->stop) {
-			/*logit ("buffer full, waiting for the signal");*/
-			pthread_cond_wait (&buf->ready_cond, &buf->mutex);
-			/*logit ("buffer ready");*/
-		}
-
-		if (buf->stop) {
+		if (ATOMIC_LOAD (&buf->stop)) {
 			logit ("the buffer is stopped, refusing to write to the buffer");
-			UNLOCK (buf->mutex);
 			return 0;
 		}
 
-		written = fifo_buf_put (buf->buf, data + pos, size);
+		written = fifo_buf_put (buf->buf, data + pos,
+		                        MIN((size_t) size, free_space (buf)));
 
 		if (written) {
-			pthread_cond_signal (&buf->play_cond);
+			wake_reader (buf);
 			size -= written;
 			pos += written;
+			continue;
 		}
 
+		LOCK (buf->mutex);
+		ATOMIC_STORE (&buf->writer_waiting, 1);
+		ATOMIC_FENCE ();
+		if (free_space (buf) == 0 && !buf->stop) {
+			/*logit ("buffer full, waiting for the signal");*/
+			pthread_cond_wait (&buf->ready_cond, &buf->mutex);
+			/*logit ("buffer ready");*/
+		}
+		ATOMIC_STORE (&buf->writer_waiting, 0);
 		UNLOCK (buf->mutex);
 	}
 
@@ -339,15 +603,16 @@ int out_buf_put (struct out_buf *buf, const char *data, int size)
 void out_buf_pause (struct out_buf *buf)
 {
 	LOCK (buf->mutex);
-	buf->pause = 1;
-	buf->reset_dev = 1;
+	ATOMIC_STORE (&buf->pause, 1);
+	ATOMIC_STORE (&buf->reset_dev, 1);
+	pthread_cond_signal (&buf->play_cond);
 	UNLOCK (buf->mutex);
 }
 
 void out_buf_unpause (struct out_buf *buf)
 {
 	LOCK (buf->mutex);
-	buf->pause = 0;
+	ATOMIC_STORE (&buf->pause, 0);
 	pthread_cond_signal (&buf->play_cond);
 	UNLOCK (buf->mutex);
 }
@@ -358,13 +623,15 @@ void out_buf_stop (struct out_buf *buf)
 {
 	logit ("stopping the buffer");
 	LOCK (buf->mutex);
-	buf->stop = 1;
-	buf->pause = 0;
-	buf->reset_dev = 1;
+	buf->stop_ack = 0;
+	ATOMIC_STORE (&buf->stop, 1);
+	ATOMIC_STORE (&buf->pause, 0);
+	ATOMIC_STORE (&buf->reset_dev, 1);
 	logit ("sending signal");
 	pthread_cond_signal (&buf->play_cond);
 	logit ("waiting for signal");
-	pthread_cond_wait (&buf->ready_cond, &buf->mutex);
+	while (!buf->stop_ack)
+		pthread_cond_wait (&buf->ready_cond, &buf->mutex);
 	logit ("done");
 	UNLOCK (buf->mutex);
 }
@@ -377,18 +644,22 @@ void out_buf_reset (struct out_buf *buf)
 
 	LOCK (buf->mutex);
 	fifo_buf_clear (buf->buf);
-	buf->stop = 0;
-	buf->pause = 0;
-	buf->reset_dev = 0;
-	buf->hardware_buf_fill = 0;
+	ATOMIC_STORE (&buf->stop, 0);
+	ATOMIC_STORE (&buf->pause, 0);
+	ATOMIC_STORE (&buf->reset_dev, 0);
 	UNLOCK (buf->mutex);
+
+	LOCK (buf->time_mtx);
+	buf->delay_frames = 0;
+	UNLOCK (buf->time_mtx);
 }
 
 void out_buf_time_set (struct out_buf *buf, const float time)
 {
-	LOCK (buf->mutex);
-	buf->time = time;
-	UNLOCK (buf->mutex);
+	LOCK (buf->time_mtx);
+	buf->time_base = time;
+	buf->frames = 0;
+	UNLOCK (buf->time_mtx);
 }
 
 /* Return the time in the audio which the user is currently hearing.
@@ -398,12 +669,14 @@ void out_buf_time_set (struct out_buf *buf, const float time)
  * its own processing. */
 float out_buf_time_get (struct out_buf *buf)
 {
-	float time;
-	int bps = audio_get_bps ();
+	double time;
 
-	LOCK (buf->mutex);
-	time = buf->time - (bps ? buf->hardware_buf_fill / (float)bps : 0);
-	UNLOCK (buf->mutex);
+	LOCK (buf->time_mtx);
+	time = buf->time_base;
+	if (buf->rate)
+		time += ((int64_t)buf->frames - buf->delay_frames)
+		        / (double)buf->rate;
+	UNLOCK (buf->time_mtx);
 
 	return time;
 }
@@ -413,35 +686,21 @@ void out_buf_set_free_callback (struct out_buf *buf,
 {
 	assert (buf != NULL);
 
-	LOCK (buf->mutex);
-	buf->free_callback = callback;
-	UNLOCK (buf->mutex);
+	ATOMIC_STORE (&buf->free_callback, callback);
 }
 
 int out_buf_get_free (struct out_buf *buf)
 {
-	int space;
-
 	assert (buf != NULL);
 
-	LOCK (buf->mutex);
-	space = fifo_buf_get_space (buf->buf);
-	UNLOCK (buf->mutex);
-
-	return space;
+	return free_space (buf);
 }
 
 int out_buf_get_fill (struct out_buf *buf)
 {
-	int fill;
-
 	assert (buf != NULL);
 
-	LOCK (buf->mutex);
-	fill = fifo_buf_get_fill (buf->buf);
-	UNLOCK (buf->mutex);
-
-	return fill;
+	return fifo_buf_get_fill (buf->buf);
 }
 
 /* Wait until the read thread will stop and wait for data to come.
@@ -458,7 +717,19 @@ void out_buf_wait (struct out_buf *buf)
 		debug ("waiting....");
 		pthread_cond_wait (&buf->ready_cond, &buf->mutex);
 	}
+
+	/* The buffer was drained on purpose. */
+	buf->starved = 0;
 	UNLOCK (buf->mutex);
 
 	logit ("done");
 }
+
+/* Return the number of times the reading thread ran out of data while
+ * playing. */
+unsigned int out_buf_get_underruns (struct out_buf *buf)
+{
+	assert (buf != NULL);
+
+	return ATOMIC_LOAD (&buf->underruns);
+}
@@ -7,6 +7,11 @@
 extern "C" {
 #endif
 
+/* Don't play more than this value (in seconds) in one audio_play().
+ * This prevents locking. */
+#define AUDIO_MAX_PLAY		0.01
+#define AUDIO_MAX_PLAY_BYTES	32768
+
 typedef void out_buf_free_callback ();
 
 struct out_buf;
@@ -25,6 +30,7 @@ void out_buf_set_free_callback (struct out_buf *buf,
 int out_buf_get_free (struct out_buf *buf);
 int out_buf_get_fill (struct out_buf *buf);
 void out_buf_wait (struct out_buf *buf);
+unsigned int out_buf_get_underruns (struct out_buf *buf);
 
 #ifdef __cplusplus
 }
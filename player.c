@@ -26,6 +26,7 @@
 #include "log.h"
 #include "decoder.h"
 #include "audio.h"
+#include "audio_conversion.h"
 #include "out_buf.h"
 #include "server.h"
 #include "options.h"
@@ -33,6 +34,11 @@
 #include "files.h"
 #include "playlist.h"
 #include "md5.h"
+#include "stats.h"
+#include "thread_sched.h"
+#include "softmixer.h"
+#include "loudness.h"
+#include "cue.h"
 
 #define PCM_BUF_SIZE		(36 * 1024)
 #define PREBUFFER_THRESHOLD	(18 * 1024)
@@ -46,45 +52,145 @@ enum request
 	REQ_UNPAUSE
 };
 
-struct bitrate_list_node
+struct bitrate_point
 {
-	struct bitrate_list_node *next;
 	int time;
 	int bitrate;
 };
 
 /* List of points where bitrate has changed. We use it to show bitrate at the
  * right time when playing, because the output buffer may be big and decoding
- * may be many seconds ahead of what the user can hear. */
+ * may be many seconds ahead of what the user can hear.
+ *
+ * It is a ring with one writer (the decoder) and one reader (the time
+ * update), neither of them locks.  A point is added at most once a second,
+ * so the ring is sized to cover what fits in the output buffer and
+ * a precache at a really low bitrate.  The indices run freely and are
+ * masked, so size is a power of two. */
 struct bitrate_list
 {
-	struct bitrate_list_node *head;
-	struct bitrate_list_node *tail;
-	pthread_mutex_t mtx;
+	struct bitrate_point *points;
+	unsigned int size;
+	unsigned int head; /* the oldest point, moved by the reader */
+	unsigned int tail; /* after the newest point, moved by the writer */
 };
 
+/* The lowest bitrate (in bytes per second) bitrate_list is sized for. */
+#define BITRATE_LIST_MIN_BPS	8000
+
 struct md5_data {
 	bool okay;
 	long len;
 	struct md5_ctx ctx;
 };
 
+/* Number of PCM chunks the decoder thread can fill ahead of the player. */
+#define PIPE_CHUNKS		4
+
+/* Chunks decoded from the new position before the output stops playing the
+ * sound from before a seek and switches to them. */
+#define SEEK_PREFILL		2
+
+/* The encoder delay and padding still to be dropped from what a decoder
+ * gives, in frames.  It goes with the decoder from the precache to the
+ * decoder thread. */
+struct trim
+{
+	long skip; /* frames to drop before the sound */
+	long end; /* frames of sound or -1 if the padding is not dropped */
+	long done; /* frames of sound given so far */
+	int rate; /* of the sound given so far */
+};
+
+/* Sound decoded by the decoder thread, waiting to be put into the output
+ * buffer. */
+struct pcm_chunk
+{
+	struct pcm_chunk *next;
+	char buf[PCM_BUF_SIZE];
+	int start; /* where the sound starts in buf (after the delay) */
+	int len; /* 0 means EOF */
+	struct sound_params sound_params;
+	float time; /* the position of the decoder after this chunk */
+	int bitrate;
+	bool error; /* the decoder reported an error decoding it */
+};
+
+/* Decoding runs in its own thread and gives its chunks in order to the
+ * player thread, which converts them, puts them into the output buffer and
+ * gives them back to be filled again.  Once the thread is started, the
+ * decoder is used only by it, seeking included: the output keeps playing
+ * the buffered sound while the decoder seeks and decodes the first chunks
+ * from the new position. */
+struct decoder_pipe
+{
+	const struct decoder *f;
+	void *decoder_data;
+	struct out_buf *out_buf;
+	pthread_t tid;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	struct pcm_chunk *chunks; /* all PIPE_CHUNKS of them */
+	struct pcm_chunk *free; /* chunks to be filled */
+	struct pcm_chunk *ready_head; /* decoded chunks, oldest first */
+	struct pcm_chunk *ready_tail;
+	float time; /* the position of the decoder (in seconds) */
+	struct trim trim;
+	bool busy; /* the decoder thread is decoding now */
+	bool eof; /* the decoder has returned EOF */
+	bool quit;
+	int seek_to; /* position to seek to (in seconds) or -1 */
+	unsigned int seek_req; /* number of seeks requested... */
+	unsigned int seek_done; /* ...and done by the decoder thread */
+	int seek_pos; /* the position the ready chunks start from */
+	bool seeked; /* the ready chunks are from a new position the player
+	                has not switched to yet */
+};
+
+/* What the player should do with the seek requested from the pipe. */
+enum seek_state
+{
+	SEEK_WAIT,	/* keep playing the old sound */
+	SEEK_FAILED,	/* forget the seek, continue with the old sound */
+	SEEK_SWITCH	/* drop the old sound, play from seek_pos */
+};
+
+/* Maximum value of the PrecacheDepth option. */
+#define PRECACHE_MAX		8
+
+/* How many seconds before the crossfade the next file starts to be
+ * precached, so that it is ready in time even on slow storage. */
+#define CROSSFADE_LEAD		10
+
 struct precache
 {
 	char *file; /* the file to precache */
-	char buf[2 * PCM_BUF_SIZE]; /* PCM buffer with precached data */
+	char *buf; /* PCM buffer with precached data */
+	int buf_size; /* PrecacheSize and room for one more chunk */
 	int buf_fill;
+	int buf_pos; /* where the sound not crossfaded yet starts */
+	int tail_fill; /* sound after buf_fill with different parameters */
+	struct sound_params tail_params; /* of the tail */
 	int ok; /* 1 if precache succeed */
 	struct sound_params sound_params; /* of the sound in the buffer */
 	struct decoder *f; /* decoder functions for precached file */
 	void *decoder_data;
+	struct trim trim;
 	int running; /* if the precache thread is running */
+	int done; /* if the precache thread has finished */
 	pthread_t tid; /* tid of the precache thread */
 	struct bitrate_list bitrate_list;
-	int decoded_time; /* how much sound we decoded in seconds */
+	float decoded_time; /* how much sound we decoded in seconds */
+	float faded_time; /* how much of it was mixed into the previous file */
 };
 
-struct precache precache;
+/* Files to be played next, each precached by its own thread.  Only the
+ * player thread uses the array. */
+static struct precache precache[PRECACHE_MAX];
+
+/* Float samples of the two files being crossfaded, PCM_BUF_SIZE samples
+ * for each. */
+static float *mix_buf = NULL;
 
 /* Request conditional and mutex. */
 static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
@@ -112,111 +218,147 @@ static pthread_mutex_t decoder_stream_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static int prebuffering = 0; /* are we prebuffering now? */
 
+/* Options read for every file played. */
+static options_t_handle opt_prebuffering = OPTIONS_HANDLE("Prebuffering");
+static options_t_handle opt_show_stream_errors
+	= OPTIONS_HANDLE("ShowStreamErrors");
+static options_t_handle opt_precache = OPTIONS_HANDLE("Precache");
+static options_t_handle opt_precache_depth = OPTIONS_HANDLE("PrecacheDepth");
+static options_t_handle opt_autonext = OPTIONS_HANDLE("AutoNext");
+static options_t_handle opt_crossfade = OPTIONS_HANDLE("Crossfade");
+
 static struct bitrate_list bitrate_list;
 
+static unsigned int bitrate_list_size ()
+{
+	unsigned int size = 16, points;
+
+	points = (options_get_int ("OutputBuffer")
+	          + options_get_int ("PrecacheSize")) * 1024
+	         / BITRATE_LIST_MIN_BPS + 2;
+	while (size < points)
+		size *= 2;
+
+	return size;
+}
+
+/* Make the list empty and big enough for the current options.  Must not be
+ * used when the list could be read. */
 static void bitrate_list_init (struct bitrate_list *b)
 {
+	unsigned int size;
+
 	assert (b != NULL);
 
-	b->head = NULL;
-	b->tail = NULL;
-	pthread_mutex_init (&b->mtx, NULL);
+	size = bitrate_list_size ();
+	if (b->size != size) {
+		free (b->points);
+		b->points = (struct bitrate_point *)xmalloc (
+				size * sizeof(struct bitrate_point));
+		b->size = size;
+	}
+
+	b->head = 0;
+	b->tail = 0;
 }
 
+/* Drop all points.  The writer must not be running. */
 static void bitrate_list_empty (struct bitrate_list *b)
 {
 	assert (b != NULL);
 
-	LOCK (b->mtx);
-	if (b->head) {
-		while (b->head) {
-			struct bitrate_list_node *t = b->head->next;
-
-			free (b->head);
-			b->head = t;
-		}
-
-		b->tail = NULL;
-	}
+	ATOMIC_STORE (&b->head, ATOMIC_LOAD (&b->tail));
 
 	debug ("Bitrate list elements removed.");
-
-	UNLOCK (b->mtx);
 }
 
 static void bitrate_list_destroy (struct bitrate_list *b)
 {
-	int rc;
-
 	assert (b != NULL);
 
-	bitrate_list_empty (b);
-
-	rc = pthread_mutex_destroy (&b->mtx);
-	if (rc != 0)
-		log_errno ("Can't destroy bitrate list mutex", rc);
+	free (b->points);
+	b->points = NULL;
+	b->size = 0;
 }
 
 static void bitrate_list_add (struct bitrate_list *b, const int time,
 		const int bitrate)
 {
+	unsigned int head, tail;
+	struct bitrate_point *last;
+
 	assert (b != NULL);
+	assert (b->points != NULL);
 
-	LOCK (b->mtx);
-	if (!b->tail) {
-		b->head = b->tail = (struct bitrate_list_node *)xmalloc (
-				sizeof(struct bitrate_list_node));
-		b->tail->next = NULL;
-		b->tail->time = time;
-		b->tail->bitrate = bitrate;
+	head = ATOMIC_LOAD (&b->head);
+	tail = b->tail;
+	last = &b->points[(tail - 1) & (b->size - 1)];
+
+	if (tail != head && last->bitrate == bitrate)
+		debug ("Not adding bitrate %d at time %d because the bitrate"
+				" hasn't changed", bitrate, time);
+	else if (tail != head && last->time == time)
+		debug ("Not adding bitrate %d at time %d because it is for"
+				" the same time as the last bitrate", bitrate, time);
+	else if (tail - head == b->size)
+		debug ("Not adding bitrate %d at time %d because the list"
+				" is full", bitrate, time);
+	else {
+		struct bitrate_point *point = &b->points[tail & (b->size - 1)];
+
+		assert (tail == head || last->time < time);
+
+		point->time = time;
+		point->bitrate = bitrate;
+		ATOMIC_STORE (&b->tail, tail + 1);
 
 		debug ("Adding bitrate %d at time %d", bitrate, time);
 	}
-	else if (b->tail->bitrate != bitrate && b->tail->time != time) {
-		assert (b->tail->time < time);
+}
 
-		b->tail->next = (struct bitrate_list_node *)xmalloc (
-				sizeof(struct bitrate_list_node));
-		b->tail = b->tail->next;
-		b->tail->next = NULL;
-		b->tail->time = time;
-		b->tail->bitrate = bitrate;
+/* Move the points of the precached file to the list of the played one. */
+static void bitrate_list_move (struct bitrate_list *dst,
+		struct bitrate_list *src)
+{
+	unsigned int ix;
+
+	bitrate_list_empty (dst);
+	for (ix = src->head; ix != src->tail; ix += 1) {
+		const struct bitrate_point *point
+			= &src->points[ix & (src->size - 1)];
 
-		debug ("Appending bitrate %d at time %d", bitrate, time);
+		bitrate_list_add (dst, point->time, point->bitrate);
 	}
-	else if (b->tail->bitrate == bitrate)
-		debug ("Not adding bitrate %d at time %d because the bitrate"
-				" hasn't changed", bitrate, time);
-	else
-		debug ("Not adding bitrate %d at time %d because it is for"
-				" the same time as the last bitrate", bitrate, time);
-	UNLOCK (b->mtx);
+	src->head = src->tail;
 }
 
 static int bitrate_list_get (struct bitrate_list *b, const int time)
 {
 	int bitrate = -1;
+	unsigned int head, tail;
 
 	assert (b != NULL);
 
-	LOCK (b->mtx);
-	if (b->head) {
-		while (b->head->next && b->head->next->time <= time) {
-			struct bitrate_list_node *o = b->head;
-
-			b->head = o->next;
-			debug ("Removing old bitrate %d for time %d", o->bitrate, o->time);
-			free (o);
+	if (!b->points)
+		return -1;
+
+	head = b->head;
+	tail = ATOMIC_LOAD (&b->tail);
+	if (head != tail) {
+		while (tail - head > 1
+		        && b->points[(head + 1) & (b->size - 1)].time <= time) {
+			debug ("Removing old bitrate %d for time %d",
+			        b->points[head & (b->size - 1)].bitrate,
+			        b->points[head & (b->size - 1)].time);
+			head += 1;
 		}
+		ATOMIC_STORE (&b->head, head);
 
-		bitrate = b->head->bitrate /*b->head->time + 1000*/;
+		bitrate = b->points[head & (b->size - 1)].bitrate;
 		debug ("Getting bitrate for time %d (%d)", time, bitrate);
 	}
-	else {
+	else
 		debug ("Getting bitrate for time %d (no bitrate information)", time);
-		bitrate = -1;
-	}
-	UNLOCK (b->mtx);
 
 	return bitrate;
 }
@@ -233,14 +375,131 @@ static void update_time ()
 	}
 }
 
-static void *precache_thread (void *data)
+/* Decode a piece of the file into buf like decoder->decode(), but get
+ * float samples from decoders which can give them if the device takes
+ * float, so they are not converted to fixed point and back. */
+static int decode_buf (const struct decoder *f, void *decoder_data,
+		char *buf, const int buf_len, struct sound_params *sound_params)
 {
-	struct precache *precache = (struct precache *)data;
+	struct timespec start;
 	int decoded;
+	long bps;
+
+	get_realtime (&start);
+
+	if (!f->decode_float || !audio_float_output ())
+		decoded = f->decode (decoder_data, buf, buf_len, sound_params);
+	else {
+		decoded = f->decode_float (decoder_data, (float *)buf,
+		                           buf_len / sizeof(float),
+		                           sound_params) * sizeof(float);
+		sound_params->fmt = SFMT_FLOAT;
+	}
+
+	stats_add (STAT_DECODE_USEC, stats_usec_since (&start));
+
+	bps = sound_params->fmt ? (long)sfmt_Bps (sound_params->fmt)
+		* sound_params->channels * sound_params->rate : 0;
+	if (decoded > 0 && bps > 0)
+		stats_add (STAT_DECODED_USEC, decoded * INT64_C(1000000) / bps);
+
+	return decoded;
+}
+
+/* Get the encoder delay and padding of the just opened file. */
+static void trim_init (struct trim *trim, const struct decoder *f,
+		void *decoder_data)
+{
+	long delay, padding, frames;
+
+	trim->skip = 0;
+	trim->end = -1;
+	trim->done = 0;
+	trim->rate = 0;
+
+	if (!f->get_gapless
+	    || !f->get_gapless (decoder_data, &delay, &padding, &frames))
+		return;
+
+	debug ("Gapless: delay %ld, padding %ld, frames %ld", delay, padding,
+			frames);
+
+	if (delay < 0 || padding < 0)
+		return;
+
+	trim->skip = delay;
+	if (frames >= 0 && frames - delay - padding > 0)
+		trim->end = frames - delay - padding;
+}
+
+/* The decoder has seeked to pos seconds: the delay is behind and the
+ * padding is where it was. */
+static void trim_seek (struct trim *trim, const int pos)
+{
+	trim->skip = 0;
+	if (trim->rate)
+		trim->done = (long)pos * trim->rate;
+	else
+		trim->end = -1;
+}
+
+/* Decode like decode_buf(), but without the encoder delay and padding.
+ * The sound starts at *start bytes in buf, so the delay is not copied
+ * out of the way; it is nonzero only for the first piece of sound. */
+static int decode_trimmed (const struct decoder *f, void *decoder_data,
+		struct trim *trim, char *buf, const int buf_len,
+		struct sound_params *sound_params, int *start)
+{
+	int decoded, frame_size;
+	long frames;
+
+	*start = 0;
+	if (trim->end >= 0 && trim->done >= trim->end)
+		return 0;
+
+	do {
+		decoded = decode_buf (f, decoder_data, buf, buf_len,
+				sound_params);
+		if (!decoded)
+			return 0;
+		if (!trim->skip && trim->end < 0)
+			return decoded;
+
+		frame_size = sfmt_Bps (sound_params->fmt)
+			* sound_params->channels;
+		frames = decoded / frame_size;
+		trim->rate = sound_params->rate;
+
+		if (trim->skip) {
+			long skip = MIN(trim->skip, frames);
+
+			trim->skip -= skip;
+			frames -= skip;
+			decoded -= skip * frame_size;
+			if (decoded)
+				*start = skip * frame_size;
+		}
+	} while (!decoded);
+
+	if (trim->end >= 0 && trim->done + frames > trim->end) {
+		frames = trim->end - trim->done;
+		decoded = frames * frame_size;
+	}
+	trim->done += frames;
+
+	return decoded;
+}
+
+static void precache_decode (struct precache *precache)
+{
+	int decoded, start;
 	struct sound_params new_sound_params;
 	struct decoder_error err;
 
 	precache->buf_fill = 0;
+	precache->buf_pos = 0;
+	precache->tail_fill = 0;
+	precache->faded_time = 0.0;
 	precache->sound_params.channels = 0; /* mark that sound_params were not
 						yet filled. */
 	precache->decoded_time = 0.0;
@@ -253,26 +512,32 @@ static void *precache_thread (void *data)
 		logit ("Failed to open the file for precache: %s", err.err);
 		decoder_error_clear (&err);
 		precache->f->close (precache->decoder_data);
-		return NULL;
+		return;
 	}
 
+	trim_init (&precache->trim, precache->f, precache->decoder_data);
 	audio_plist_set_time (precache->file,
 			precache->f->get_duration(precache->decoder_data));
 
-	/* Stop at PCM_BUF_SIZE, because when we decode too much, there is no
-	 * place where we can put the data that doesn't fit into the buffer. */
-	while (precache->buf_fill < PCM_BUF_SIZE) {
-		decoded = precache->f->decode (precache->decoder_data,
+	/* The buffer has room for one chunk more than we fill it to, because
+	 * when we decode too much, there is no place where we can put the
+	 * data that doesn't fit into the buffer. */
+	while (precache->buf_fill < precache->buf_size - PCM_BUF_SIZE) {
+		decoded = decode_trimmed (precache->f, precache->decoder_data,
+				&precache->trim,
 				precache->buf + precache->buf_fill,
-				PCM_BUF_SIZE, &new_sound_params);
+				PCM_BUF_SIZE, &new_sound_params, &start);
 
 		if (!decoded) {
 
-			/* EOF so fast? We can't pass this information
-			 * in precache, so give up. */
+			/* A short file: the decoder will tell the EOF
+			 * again when playing. */
+			if (precache->buf_fill)
+				break;
+
 			logit ("EOF when precaching.");
 			precache->f->close (precache->decoder_data);
-			return NULL;
+			return;
 		}
 
 		precache->f->get_error (precache->decoder_data, &err);
@@ -281,7 +546,14 @@ static void *precache_thread (void *data)
 			logit ("Error reading file for precache: %s", err.err);
 			decoder_error_clear (&err);
 			precache->f->close (precache->decoder_data);
-			return NULL;
+			return;
+		}
+
+		/* The delay is before the first sound, so it stays in the
+		 * buffer before buf_pos and the sound is not moved. */
+		if (start) {
+			precache->buf_fill += start;
+			precache->buf_pos = precache->buf_fill;
 		}
 
 		if (!precache->sound_params.channels)
@@ -290,12 +562,13 @@ static void *precache_thread (void *data)
 					new_sound_params)) {
 
 			/* There is no way to store sound with two different
-			 * parameters in the buffer, give up with
-			 * precaching. (this should never happen). */
+			 * parameters in the buffer, so stop here and leave
+			 * the chunk for the decoder loop. */
 			logit ("Sound parameters have changed when precaching.");
 			decoder_error_clear (&err);
-			precache->f->close (precache->decoder_data);
-			return NULL;
+			precache->tail_fill = decoded;
+			precache->tail_params = new_sound_params;
+			break;
 		}
 
 		bitrate_list_add (&precache->bitrate_list,
@@ -317,20 +590,38 @@ static void *precache_thread (void *data)
 
 	precache->ok = 1;
 	logit ("Successfully precached file (%d bytes)", precache->buf_fill);
+}
+
+static void *precache_thread (void *data)
+{
+	struct precache *precache = (struct precache *)data;
+
+	thread_sched_apply (THREAD_PRECACHE);
+	precache_decode (precache);
+	ATOMIC_STORE (&precache->done, 1);
+
 	return NULL;
 }
 
 static void start_precache (struct precache *precache, const char *file)
 {
-	int rc;
+	int rc, size;
 
 	assert (!precache->running);
 	assert (file != NULL);
 
+	size = options_get_int ("PrecacheSize") * 1024 + PCM_BUF_SIZE;
+	if (precache->buf_size != size) {
+		xfree_tag (precache->buf, MEM_DECODER);
+		precache->buf = (char *)xmalloc_tag (size, MEM_DECODER);
+		precache->buf_size = size;
+	}
+
 	precache->file = xstrdup (file);
 	bitrate_list_init (&precache->bitrate_list);
 	logit ("Precaching file %s", file);
 	precache->ok = 0;
+	precache->done = 0;
 	rc = pthread_create (&precache->tid, NULL, precache_thread, precache);
 	if (rc != 0)
 		log_errno ("Could not run precache thread", rc);
@@ -362,15 +653,248 @@ static void precache_reset (struct precache *precache)
 	if (precache->file) {
 		free (precache->file);
 		precache->file = NULL;
-		bitrate_list_destroy (&precache->bitrate_list);
 	}
 }
 
+/* Wait for the precache and throw it away. */
+static void precache_drop (struct precache *precache)
+{
+	precache_wait (precache);
+	if (precache->ok)
+		precache->f->close (precache->decoder_data);
+	precache_reset (precache);
+}
+
+/* Return the precache of the file or NULL if the file isn't precached. */
+static struct precache *precache_find (const char *file)
+{
+	int ix;
+
+	for (ix = 0; ix < PRECACHE_MAX; ix += 1) {
+		if (precache[ix].file && !strcmp (precache[ix].file, file))
+			return &precache[ix];
+	}
+
+	return NULL;
+}
+
+/* Is the file one of the first PrecacheDepth files of the list? */
+static bool precache_wanted (const lists_t_strs *files, const char *file)
+{
+	int ix, depth;
+
+	if (!files)
+		return false;
+
+	depth = MIN(options_handle_int (&opt_precache_depth), lists_strs_size (files));
+	for (ix = 0; ix < depth; ix += 1) {
+		if (!strcmp (lists_strs_at (files, ix), file))
+			return true;
+	}
+
+	return false;
+}
+
+/* Drop the precaches of files which are not going to be played soon. */
+static void precache_prune (const lists_t_strs *files)
+{
+	int ix;
+
+	for (ix = 0; ix < PRECACHE_MAX; ix += 1) {
+		if (precache[ix].file
+		       && !precache_wanted (files, precache[ix].file)) {
+			logit ("Dropping precache of %s", precache[ix].file);
+			precache_drop (&precache[ix]);
+		}
+	}
+}
+
+/* Start precaching the first PrecacheDepth files of the list which are
+ * not precached yet. */
+static void precache_files (const lists_t_strs *files)
+{
+	int ix, slot = 0, depth;
+
+	depth = MIN(options_handle_int (&opt_precache_depth), lists_strs_size (files));
+	for (ix = 0; ix < depth; ix += 1) {
+		const char *file = lists_strs_at (files, ix);
+
+		if (file_type (file) == F_URL) {
+			io_preconnect (file);
+			continue;
+		}
+
+		if (file_type (file) != F_SOUND || precache_find (file))
+			continue;
+
+		while (slot < PRECACHE_MAX && precache[slot].file)
+			slot += 1;
+		if (slot == PRECACHE_MAX)
+			break;
+
+		start_precache (&precache[slot], file);
+	}
+}
+
+/* Can sound in this format be mixed? */
+static bool crossfade_format_ok (const long fmt)
+{
+	if (fmt & (SFMT_S8 | SFMT_U8 | SFMT_FLOAT))
+		return true;
+
+	return (fmt & SFMT_MASK_ENDIANNESS) == SFMT_NE;
+}
+
+/* Return the precache of the next file if it can be crossfaded with sound
+ * in this format.  Never waits for the precache thread. */
+static struct precache *crossfade_source (const lists_t_strs *next_files,
+		const struct sound_params *params)
+{
+	struct precache *pc;
+
+	if (!next_files || lists_strs_empty (next_files))
+		return NULL;
+
+	pc = precache_find (lists_strs_at (next_files, 0));
+	if (!pc || !ATOMIC_LOAD (&pc->done))
+		return NULL;
+
+	precache_wait (pc);
+
+	if (!pc->ok || pc->tail_fill
+	            || !sound_params_eq(pc->sound_params, *params)
+	            || !crossfade_format_ok (params->fmt))
+		return NULL;
+
+	return pc;
+}
+
+/* Make sure the precache holds at least len bytes not faded yet, decoding
+ * more if needed.  Returns how many bytes there are. */
+static int crossfade_fill (struct precache *pc, const int len)
+{
+	while (pc->buf_fill - pc->buf_pos < len && !pc->tail_fill) {
+		int decoded, start;
+		struct sound_params new_sound_params;
+
+		if (pc->buf_pos) {
+			memmove (pc->buf, pc->buf + pc->buf_pos,
+			         pc->buf_fill - pc->buf_pos);
+			pc->buf_fill -= pc->buf_pos;
+			pc->buf_pos = 0;
+		}
+
+		if (pc->buf_fill + PCM_BUF_SIZE > pc->buf_size)
+			break;
+
+		decoded = decode_trimmed (pc->f, pc->decoder_data, &pc->trim,
+				pc->buf + pc->buf_fill, PCM_BUF_SIZE,
+				&new_sound_params, &start);
+		if (!decoded)
+			break;
+
+		/* precache_decode() has already dropped the delay. */
+		assert (!start);
+
+		/* Leave it for the decoder loop as precache_decode() does. */
+		if (!sound_params_eq(new_sound_params, pc->sound_params)) {
+			pc->tail_fill = decoded;
+			pc->tail_params = new_sound_params;
+			break;
+		}
+
+		pc->buf_fill += decoded;
+		pc->decoded_time += decoded / (float)(sfmt_Bps(
+					new_sound_params.fmt) *
+				new_sound_params.rate *
+				new_sound_params.channels);
+		bitrate_list_add (&pc->bitrate_list, pc->decoded_time,
+				pc->f->get_bitrate(pc->decoder_data));
+	}
+
+	return MIN(len, pc->buf_fill - pc->buf_pos);
+}
+
+/* Mix the beginning of the precached next file into the len bytes of
+ * sound in buf, which start remaining seconds before the end of the
+ * current file.  The current file fades out and the next one fades in
+ * over window seconds.  Returns true if anything was mixed. */
+static bool crossfade (char *buf, const int len,
+		const struct sound_params *params, const lists_t_strs *next_files,
+		const float remaining, const int window)
+{
+	struct precache *pc;
+	int ix, ch, frames, next_len, samples;
+	float *curr, *next;
+	const long fmt = params->fmt;
+
+	pc = crossfade_source (next_files, params);
+	if (!pc)
+		return false;
+
+	samples = len / sfmt_Bps (fmt);
+	frames = samples / params->channels;
+	next_len = crossfade_fill (pc, len);
+
+	curr = mix_buf;
+	next = mix_buf + PCM_BUF_SIZE;
+
+	if ((fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT) {
+		memcpy (curr, buf, len);
+		memcpy (next, pc->buf + pc->buf_pos, next_len);
+	}
+	else {
+		audio_conv_to_float (buf, len, fmt, curr);
+		audio_conv_to_float (pc->buf + pc->buf_pos, next_len, fmt, next);
+	}
+	memset (next + next_len / sfmt_Bps (fmt), 0,
+	        (samples - next_len / sfmt_Bps (fmt)) * sizeof (float));
+
+	for (ix = 0; ix < frames; ix += 1) {
+		float out = (remaining - ix / (float)params->rate) / window;
+
+		out = CLAMP(0.0f, out, 1.0f);
+		for (ch = 0; ch < params->channels; ch += 1) {
+			int s = ix * params->channels + ch;
+
+			curr[s] = curr[s] * out + next[s] * (1.0f - out);
+		}
+	}
+
+	if ((fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT) {
+		for (ix = 0; ix < samples; ix += 1)
+			curr[ix] = CLAMP(-1.0f, curr[ix], 1.0f);
+		memcpy (buf, curr, len);
+	}
+	else
+		audio_conv_from_float (curr, samples, fmt, buf);
+
+	pc->buf_pos += next_len;
+	pc->faded_time += next_len / (float)(sfmt_Bps(fmt) * params->rate
+			* params->channels);
+
+	return next_len > 0;
+}
+
 void player_init ()
 {
-	precache.file = NULL;
-	precache.running = 0;
-	precache.ok = 0;
+	int ix;
+
+	mix_buf = (float *)xmalloc (2 * PCM_BUF_SIZE * sizeof (float));
+
+	bitrate_list.points = NULL;
+	bitrate_list.size = 0;
+	bitrate_list_init (&bitrate_list);
+
+	for (ix = 0; ix < PRECACHE_MAX; ix += 1) {
+		precache[ix].file = NULL;
+		precache[ix].bitrate_list.points = NULL;
+		precache[ix].bitrate_list.size = 0;
+		precache[ix].buf = NULL;
+		precache[ix].buf_size = 0;
+		precache[ix].running = 0;
+		precache[ix].ok = 0;
+	}
 }
 
 static void show_tags (const struct file_tags *tags DEBUG_ONLY)
@@ -436,21 +960,374 @@ static void buf_free_cb ()
 	update_time ();
 }
 
+/* Decode the next chunk.  Its bitrate goes to the bitrate list unless it
+ * is from a position the output has not switched to yet. */
+static void decode_chunk (struct decoder_pipe *p, struct pcm_chunk *chunk,
+		const bool seeked)
+{
+	struct decoder_error err;
+
+	if (decoder_stream && out_buf_get_fill(p->out_buf)
+			< PREBUFFER_THRESHOLD) {
+		prebuffering = 1;
+		io_prebuffer (decoder_stream,
+				options_handle_int (&opt_prebuffering) * 1024,
+				p->f->get_bitrate(p->decoder_data));
+		prebuffering = 0;
+		status_msg ("Playing...");
+	}
+
+	chunk->len = decode_trimmed (p->f, p->decoder_data, &p->trim,
+			chunk->buf, sizeof(chunk->buf), &chunk->sound_params,
+			&chunk->start);
+
+	if (chunk->len)
+		p->time += chunk->len / (float)(sfmt_Bps(
+					chunk->sound_params.fmt) *
+				chunk->sound_params.rate *
+				chunk->sound_params.channels);
+	chunk->time = p->time;
+
+	chunk->error = false;
+	p->f->get_error (p->decoder_data, &err);
+	if (err.type != ERROR_OK) {
+		chunk->error = true;
+		if (err.type != ERROR_STREAM ||
+		    options_handle_bool (&opt_show_stream_errors))
+			error ("%s", err.err);
+		decoder_error_clear (&err);
+	}
+
+	chunk->bitrate = p->f->get_bitrate (p->decoder_data);
+	if (chunk->len) {
+		debug ("decoded %d bytes", chunk->len);
+		if (!seeked)
+			bitrate_list_add (&bitrate_list, p->time,
+					chunk->bitrate);
+		update_tags (p->f, p->decoder_data, decoder_stream);
+	}
+	else
+		logit ("EOF from decoder");
+}
+
+/* Seek the decoder as requested by the player and drop the chunks decoded
+ * before.  Called from the decoder thread with the pipe locked. */
+static void pipe_do_seek (struct decoder_pipe *p)
+{
+	int sec = p->seek_to;
+	unsigned int req = p->seek_req;
+	int pos;
+
+	p->seek_to = -1;
+	p->busy = true;
+	UNLOCK (p->mtx);
+
+	pos = p->f->seek (p->decoder_data, sec);
+
+	LOCK (p->mtx);
+	p->busy = false;
+	pthread_cond_broadcast (&p->cond);
+	if (pos == -1)
+		logit ("error when seeking");
+	else {
+		while (p->ready_head) {
+			struct pcm_chunk *chunk = p->ready_head;
+
+			p->ready_head = chunk->next;
+			chunk->next = p->free;
+			p->free = chunk;
+		}
+		p->ready_tail = NULL;
+		p->time = pos;
+		trim_seek (&p->trim, pos);
+		p->eof = false;
+		p->seek_pos = pos;
+		p->seeked = true;
+	}
+	p->seek_done = req;
+	UNLOCK (p->mtx);
+
+	LOCK (request_cond_mtx);
+	pthread_cond_broadcast (&request_cond);
+	UNLOCK (request_cond_mtx);
+
+	LOCK (p->mtx);
+}
+
+static void *decoder_thread (void *data)
+{
+	struct decoder_pipe *p = (struct decoder_pipe *)data;
+
+	thread_sched_apply (THREAD_DECODER);
+
+	LOCK (p->mtx);
+	while (!p->quit) {
+		struct pcm_chunk *chunk;
+		bool seeked;
+
+		if (p->seek_to != -1) {
+			pipe_do_seek (p);
+			continue;
+		}
+
+		if (p->eof || !p->free) {
+			pthread_cond_wait (&p->cond, &p->mtx);
+			continue;
+		}
+
+		chunk = p->free;
+		p->free = chunk->next;
+		p->busy = true;
+		seeked = p->seeked;
+		UNLOCK (p->mtx);
+
+		decode_chunk (p, chunk, seeked);
+
+		LOCK (p->mtx);
+		p->busy = false;
+		chunk->next = NULL;
+		if (p->ready_tail)
+			p->ready_tail->next = chunk;
+		else
+			p->ready_head = chunk;
+		p->ready_tail = chunk;
+		if (!chunk->len)
+			p->eof = true;
+		pthread_cond_broadcast (&p->cond);
+		UNLOCK (p->mtx);
+
+		/* The player checks the ready chunks with request_cond_mtx
+		 * locked, so it can't miss this. */
+		LOCK (request_cond_mtx);
+		pthread_cond_broadcast (&request_cond);
+		UNLOCK (request_cond_mtx);
+
+		LOCK (p->mtx);
+	}
+	UNLOCK (p->mtx);
+
+	return NULL;
+}
+
+static void pipe_init (struct decoder_pipe *p, const struct decoder *f,
+		void *decoder_data, const struct trim *trim,
+		struct out_buf *out_buf, const float time)
+{
+	int i;
+
+	p->f = f;
+	p->decoder_data = decoder_data;
+	p->out_buf = out_buf;
+	p->chunks = (struct pcm_chunk *)xmalloc_tag (PIPE_CHUNKS
+			* sizeof(struct pcm_chunk), MEM_DECODER);
+	p->free = NULL;
+	for (i = 0; i < PIPE_CHUNKS; i++) {
+		p->chunks[i].next = p->free;
+		p->free = &p->chunks[i];
+	}
+	p->ready_head = NULL;
+	p->ready_tail = NULL;
+	p->time = time;
+	p->trim = *trim;
+	p->busy = false;
+	p->eof = false;
+	p->quit = false;
+	p->seek_to = -1;
+	p->seek_req = 0;
+	p->seek_done = 0;
+	p->seek_pos = -1;
+	p->seeked = false;
+	pthread_mutex_init (&p->mtx, NULL);
+	pthread_cond_init (&p->cond, NULL);
+}
+
+static void pipe_start (struct decoder_pipe *p)
+{
+	if (pthread_create(&p->tid, NULL, decoder_thread, p))
+		fatal ("Can't create the decoder thread!");
+}
+
+static void pipe_destroy (struct decoder_pipe *p)
+{
+	LOCK (p->mtx);
+	p->quit = true;
+	pthread_cond_broadcast (&p->cond);
+	UNLOCK (p->mtx);
+
+	if (pthread_join(p->tid, NULL))
+		logit ("pthread_join() for the decoder thread failed");
+
+	pthread_mutex_destroy (&p->mtx);
+	pthread_cond_destroy (&p->cond);
+	xfree_tag (p->chunks, MEM_DECODER);
+}
+
+/* Take a chunk to be filled by the player itself (before the decoder thread
+ * starts). */
+static struct pcm_chunk *pipe_take_free (struct decoder_pipe *p)
+{
+	struct pcm_chunk *chunk;
+
+	LOCK (p->mtx);
+	chunk = p->free;
+	assert (chunk != NULL);
+	p->free = chunk->next;
+	UNLOCK (p->mtx);
+
+	return chunk;
+}
+
+/* Return the oldest decoded chunk or NULL if there is none yet. */
+static struct pcm_chunk *pipe_get (struct decoder_pipe *p)
+{
+	struct pcm_chunk *chunk;
+
+	LOCK (p->mtx);
+	chunk = p->ready_head;
+	if (chunk) {
+		p->ready_head = chunk->next;
+		if (!p->ready_head)
+			p->ready_tail = NULL;
+	}
+	UNLOCK (p->mtx);
+
+	return chunk;
+}
+
+/* Give the chunk back to be filled again. */
+static void pipe_recycle (struct decoder_pipe *p, struct pcm_chunk *chunk)
+{
+	LOCK (p->mtx);
+	chunk->next = p->free;
+	p->free = chunk;
+	pthread_cond_broadcast (&p->cond);
+	UNLOCK (p->mtx);
+}
+
+/* Ask the decoder thread to seek to sec.  It replaces the seek requested
+ * before if the thread has not started it yet. */
+static void pipe_seek (struct decoder_pipe *p, const int sec)
+{
+	LOCK (p->mtx);
+	p->seek_to = sec;
+	p->seek_req++;
+	pthread_cond_broadcast (&p->cond);
+	UNLOCK (p->mtx);
+}
+
+/* Check the seek requested with pipe_seek().  The switch to the new position
+ * waits for SEEK_PREFILL chunks, unless the output has nothing more to play
+ * or the decoder can't give them. */
+static enum seek_state pipe_seek_state (struct decoder_pipe *p)
+{
+	enum seek_state state;
+
+	LOCK (p->mtx);
+	if (p->seek_done != p->seek_req)
+		state = SEEK_WAIT;
+	else if (!p->seeked)
+		state = SEEK_FAILED;
+	else if (p->eof || !p->free
+			|| out_buf_get_fill(p->out_buf) == 0)
+		state = SEEK_SWITCH;
+	else {
+		struct pcm_chunk *chunk;
+		int ready = 0;
+
+		for (chunk = p->ready_head; chunk; chunk = chunk->next)
+			ready++;
+		state = ready >= SEEK_PREFILL ? SEEK_SWITCH : SEEK_WAIT;
+	}
+	UNLOCK (p->mtx);
+
+	return state;
+}
+
+/* The player has switched to the position of the last seek, return it.
+ * The bitrate list is emptied and gets the bitrates of the chunks decoded
+ * from there.  The decoder thread, the list's writer, is not decoding
+ * while this is done: it is waited for and can't start again without the
+ * pipe's mutex. */
+static int pipe_switch (struct decoder_pipe *p)
+{
+	struct pcm_chunk *chunk;
+	int pos;
+
+	LOCK (p->mtx);
+	assert (p->seeked);
+	while (p->busy)
+		pthread_cond_wait (&p->cond, &p->mtx);
+	p->seeked = false;
+	pos = p->seek_pos;
+	bitrate_list_empty (&bitrate_list);
+	for (chunk = p->ready_head; chunk; chunk = chunk->next) {
+		if (chunk->len)
+			bitrate_list_add (&bitrate_list, chunk->time,
+					chunk->bitrate);
+	}
+	UNLOCK (p->mtx);
+
+	return pos;
+}
+
 /* Decoder loop for already opened and probably running for some time decoder.
- * next_file will be precached at eof. */
-static void decode_loop (const struct decoder *f, void *decoder_data,
-		const char *next_file, struct out_buf *out_buf,
+ * file is the played file (NULL for a stream), next_files will be
+ * precached at eof.  If the decoder has already given sound which was not
+ * played, it is in pending.  trim is what is left of the encoder delay and
+ * padding to drop. */
+static void decode_loop (const char *file, const struct decoder *f,
+		void *decoder_data, const struct trim *trim,
+		const lists_t_strs *next_files, struct out_buf *out_buf,
 		struct sound_params *sound_params, struct md5_data *md5,
-		const float already_decoded_sec)
+		const float already_decoded_sec, const char *pending,
+		const int pending_len, const struct sound_params *pending_params)
 {
 	bool eof = false;
 	bool stopped = false;
-	char buf[PCM_BUF_SIZE];
+	struct decoder_pipe pipe;
+	struct pcm_chunk *chunk = NULL; /* decoded, not yet in out_buf */
 	int decoded = 0;
-	struct sound_params new_sound_params;
 	bool sound_params_change = false;
 	float decode_time = already_decoded_sec; /* the position of the decoder
 	                                            (in seconds) */
+	bool precache_started = false;
+	bool seeking = false; /* waiting for the decoder thread to seek */
+	enum seek_state seek_state = SEEK_WAIT;
+	int duration = f->get_duration (decoder_data);
+	int fade = 0;
+
+	if (next_files && options_handle_bool (&opt_precache)
+	               && options_handle_bool (&opt_autonext))
+		fade = options_handle_int (&opt_crossfade);
+	if (duration <= 2 * fade)
+		fade = 0;
+
+	/* The next track of a CUE sheet continuing this one takes its
+	 * decoder at the end, so it is precached only then. */
+	if (fade && file && !lists_strs_empty (next_files)
+	         && cue_continues (file, lists_strs_at (next_files, 0)))
+		fade = 0;
+
+	pipe_init (&pipe, f, decoder_data, trim, out_buf, already_decoded_sec);
+
+	if (pending_len) {
+		assert (pending_len <= PCM_BUF_SIZE);
+
+		chunk = pipe_take_free (&pipe);
+		memcpy (chunk->buf, pending, pending_len);
+		chunk->start = 0;
+		decoded = chunk->len = pending_len;
+		chunk->sound_params = *pending_params;
+		sound_params_change = !sound_params_eq(chunk->sound_params,
+		                                       *sound_params);
+		decode_time += decoded / (float)(sfmt_Bps(
+					chunk->sound_params.fmt)
+				* chunk->sound_params.rate
+				* chunk->sound_params.channels);
+		chunk->time = decode_time;
+		chunk->error = false;
+		pipe.time = decode_time;
+	}
 
 	out_buf_set_free_callback (out_buf, buf_free_cb);
 
@@ -468,55 +1345,66 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 
 	status_msg ("Playing...");
 
+	pipe_start (&pipe);
+
 	while (1) {
 		debug ("loop...");
 
 		LOCK (request_cond_mtx);
-		if (!eof && !decoded) {
-			struct decoder_error err;
-
+		if (seeking) {
+			seek_state = pipe_seek_state (&pipe);
+			if (seek_state == SEEK_WAIT
+					&& request == REQ_NOTHING) {
+				debug ("waiting for the seek...");
+				pthread_cond_wait (&request_cond,
+						&request_cond_mtx);
+			}
 			UNLOCK (request_cond_mtx);
-
-			if (decoder_stream && out_buf_get_fill(out_buf)
-					< PREBUFFER_THRESHOLD) {
-				prebuffering = 1;
-				io_prebuffer (decoder_stream,
-						options_get_int("Prebuffering")
-						* 1024);
-				prebuffering = 0;
-				status_msg ("Playing...");
+		}
+		else if (!eof && !chunk) {
+			chunk = pipe_get (&pipe);
+			if (!chunk && request == REQ_NOTHING) {
+				debug ("waiting for the decoder...");
+				pthread_cond_wait (&request_cond, &request_cond_mtx);
 			}
+			UNLOCK (request_cond_mtx);
 
-			decoded = f->decode (decoder_data, buf, sizeof(buf),
-					&new_sound_params);
-
-			if (decoded)
-				decode_time += decoded / (float)(sfmt_Bps(
-							new_sound_params.fmt) *
-						new_sound_params.rate *
-						new_sound_params.channels);
-
-			f->get_error (decoder_data, &err);
-			if (err.type != ERROR_OK) {
+			if (chunk && chunk->error)
 				md5->okay = false;
-				if (err.type != ERROR_STREAM ||
-				    options_get_bool ("ShowStreamErrors"))
-					error ("%s", err.err);
-				decoder_error_clear (&err);
-			}
 
-			if (!decoded) {
+			if (chunk && !chunk->len) {
 				eof = true;
-				logit ("EOF from decoder");
+				pipe_recycle (&pipe, chunk);
+				chunk = NULL;
 			}
-			else {
-				debug ("decoded %d bytes", decoded);
-				if (!sound_params_eq(new_sound_params, *sound_params))
+			else if (chunk) {
+				decoded = chunk->len;
+				decode_time = chunk->time;
+				if (!sound_params_eq(chunk->sound_params,
+				                     *sound_params))
 					sound_params_change = true;
 
-				bitrate_list_add (&bitrate_list, decode_time,
-						f->get_bitrate(decoder_data));
-				update_tags (f, decoder_data, decoder_stream);
+				if (fade && !precache_started && decode_time
+				               >= duration - fade - CROSSFADE_LEAD) {
+					precache_files (next_files);
+					precache_started = true;
+				}
+
+				if (fade && !sound_params_change
+				         && decode_time >= duration - fade) {
+					float chunk_time = decoded / (float)(
+						sfmt_Bps(chunk->sound_params.fmt)
+						* chunk->sound_params.rate
+						* chunk->sound_params.channels);
+
+					if (crossfade (chunk->buf + chunk->start,
+					               decoded,
+					               sound_params,
+					               next_files, duration
+					               - decode_time + chunk_time,
+					               fade))
+						md5->okay = false;
+				}
 			}
 		}
 
@@ -525,11 +1413,12 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 		else if (decoded > out_buf_get_free(out_buf)
 					|| (eof && out_buf_get_fill(out_buf))) {
 			debug ("waiting...");
-			if (eof && !precache.file && next_file
-					&& file_type(next_file) == F_SOUND
-					&& options_get_bool("Precache")
-					&& options_get_bool("AutoNext"))
-				start_precache (&precache, next_file);
+			if (eof && !precache_started && next_files
+					&& options_handle_bool (&opt_precache)
+					&& options_handle_bool (&opt_autonext)) {
+				precache_files (next_files);
+				precache_started = true;
+			}
 			pthread_cond_wait (&request_cond, &request_cond_mtx);
 			UNLOCK (request_cond_mtx);
 		}
@@ -553,49 +1442,64 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 			break;
 		}
 		else if (request == REQ_SEEK) {
-			int decoder_seek;
-
 			logit ("seeking");
 			md5->okay = false;
-			req_seek = MAX(0, req_seek);
-			if ((decoder_seek = f->seek(decoder_data, req_seek)) == -1)
-				logit ("error when seeking");
-			else {
-				out_buf_stop (out_buf);
-				out_buf_reset (out_buf);
-				out_buf_time_set (out_buf, decoder_seek);
-				bitrate_list_empty (&bitrate_list);
-				decode_time = decoder_seek;
-				eof = false;
-				decoded = 0;
-			}
+			pipe_seek (&pipe, MAX(0, req_seek));
+			seeking = true;
 
 			LOCK (request_cond_mtx);
 			if (request == REQ_SEEK)
 				request = REQ_NOTHING;
 			UNLOCK (request_cond_mtx);
-
+		}
+		else if (seeking) {
+			if (seek_state == SEEK_FAILED)
+				seeking = false;
+			else if (seek_state == SEEK_SWITCH) {
+				debug ("switching to the new position");
+				out_buf_stop (out_buf);
+				out_buf_reset (out_buf);
+				decode_time = pipe_switch (&pipe);
+				out_buf_time_set (out_buf, decode_time);
+				eof = false;
+				if (chunk) {
+					pipe_recycle (&pipe, chunk);
+					chunk = NULL;
+				}
+				decoded = 0;
+				sound_params_change = false;
+				seeking = false;
+			}
 		}
 		else if (!eof && decoded <= out_buf_get_free(out_buf)
 				&& !sound_params_change) {
 			debug ("putting into the buffer %d bytes", decoded);
+			if (chunk) {
 #if !defined(NDEBUG) && defined(DEBUG)
-			if (md5->okay) {
-				md5->len += decoded;
-				md5_process_bytes (buf, decoded, &md5->ctx);
-			}
+				if (md5->okay) {
+					md5->len += decoded;
+					md5_process_bytes (chunk->buf
+					                   + chunk->start, decoded,
+					                   &md5->ctx);
+				}
 #endif
-			audio_send_buf (buf, decoded);
+				audio_send_buf (chunk->buf + chunk->start,
+				                decoded);
+				pipe_recycle (&pipe, chunk);
+				chunk = NULL;
+			}
 			decoded = 0;
 		}
 		else if (!eof && sound_params_change
-				&& out_buf_get_fill(out_buf) == 0) {
+				&& (out_buf_get_fill(out_buf) == 0
+				    || audio_keeps_device (&chunk->sound_params))) {
 			logit ("Sound parameters have changed.");
-			*sound_params = new_sound_params;
+			*sound_params = chunk->sound_params;
 			sound_params_change = false;
 			set_info_channels (sound_params->channels);
 			set_info_rate (sound_params->rate / 1000);
-			out_buf_wait (out_buf);
+			if (!audio_keeps_device (sound_params))
+				out_buf_wait (out_buf);
 			if (!audio_open(sound_params)) {
 				md5->okay = false;
 				break;
@@ -609,12 +1513,14 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 
 	status_msg ("");
 
+	pipe_destroy (&pipe);
+
 	LOCK (decoder_stream_mtx);
 	decoder_stream = NULL;
 	f->close (decoder_data);
 	UNLOCK (decoder_stream_mtx);
 
-	bitrate_list_destroy (&bitrate_list);
+	bitrate_list_empty (&bitrate_list);
 
 	LOCK (curr_tags_mtx);
 	if (curr_tags) {
@@ -625,26 +1531,26 @@ static void decode_loop (const struct decoder *f, void *decoder_data,
 
 	out_buf_wait (out_buf);
 
-	if (precache.ok && (stopped || !options_get_bool ("AutoNext"))) {
-		precache_wait (&precache);
-		precache.f->close (precache.decoder_data);
-		precache_reset (&precache);
-	}
+	if (stopped || !options_handle_bool (&opt_autonext))
+		precache_prune (NULL);
 }
 
-#if !defined(NDEBUG) && defined(DEBUG)
-static void log_md5_sum (const char *file, struct sound_params sound_params,
-                         const struct decoder *f, uint8_t *md5, long md5_len)
+/* Return the line describing the decoded sound of a file the way it's
+ * logged for tools/md5check.sh: "MD5(name) = sum length decoder format
+ * channels rate".  Return NULL if the format is not known.  The result
+ * must be freed. */
+char *md5_sum_line (const char *name, const struct sound_params *sound_params,
+                    const char *decoder, const uint8_t *md5, const long len)
 {
 	unsigned int ix, bps;
 	char md5sum[MD5_DIGEST_SIZE * 2 + 1], format;
-	const char *fn, *endian;
+	const char *endian;
 
 	for (ix = 0; ix < MD5_DIGEST_SIZE; ix += 1)
 		sprintf (&md5sum[ix * 2], "%02x", md5[ix]);
 	md5sum[MD5_DIGEST_SIZE * 2] = 0x00;
 
-	switch (sound_params.fmt & SFMT_MASK_FORMAT) {
+	switch (sound_params->fmt & SFMT_MASK_FORMAT) {
 	case SFMT_S8:
 	case SFMT_S16:
 	case SFMT_S24:
@@ -661,37 +1567,59 @@ static void log_md5_sum (const char *file, struct sound_params sound_params,
 		format = 'f';
 		break;
 	default:
-		debug ("Unknown sound format: 0x%04lx", sound_params.fmt);
-		return;
+		return NULL;
 	}
 
-	bps = sfmt_Bps (sound_params.fmt) * 8;
+	bps = sfmt_Bps (sound_params->fmt) * 8;
 
 	endian = "";
 	if (format != 'f' && bps != 8) {
-		if (sound_params.fmt & SFMT_LE)
+		if (sound_params->fmt & SFMT_LE)
 			endian = "le";
-		else if (sound_params.fmt & SFMT_BE)
+		else if (sound_params->fmt & SFMT_BE)
 			endian = "be";
 	}
 
+	return format_msg ("MD5(%s) = %s %ld %s %c%u%s %d %d",
+	                   name, md5sum, len, decoder, format, bps, endian,
+	                   sound_params->channels, sound_params->rate);
+}
+
+#if !defined(NDEBUG) && defined(DEBUG)
+static void log_md5_sum (const char *file, struct sound_params sound_params,
+                         const struct decoder *f, uint8_t *md5, long md5_len)
+{
+	const char *fn;
+	char *line;
+
 	fn = strrchr (file, '/');
 	fn = fn ? fn + 1 : file;
-	debug ("MD5(%s) = %s %ld %s %c%u%s %d %d",
-	        fn, md5sum, md5_len, get_decoder_name (f),
-	        format, bps, endian,
-	        sound_params.channels, sound_params.rate);
+	line = md5_sum_line (fn, &sound_params, get_decoder_name (f),
+	                     md5, md5_len);
+	if (!line) {
+		debug ("Unknown sound format: 0x%04lx", sound_params.fmt);
+		return;
+	}
+
+	debug ("%s", line);
+	free (line);
 }
 #endif
 
-/* Play a file (disk file) using the given decoder. next_file is precached. */
+/* Play a file (disk file) using the given decoder. next_files are
+ * precached. */
 static void play_file (const char *file, const struct decoder *f,
-		const char *next_file, struct out_buf *out_buf)
+		const lists_t_strs *next_files, struct out_buf *out_buf)
 {
 	void *decoder_data;
 	struct sound_params sound_params = { 0, 0, 0 };
 	float already_decoded_time;
 	struct md5_data md5;
+	struct precache *pc;
+	struct trim trim;
+	const char *pending = NULL;
+	int pending_len = 0;
+	struct sound_params pending_params = { 0, 0, 0 };
 
 #if !defined(NDEBUG) && defined(DEBUG)
 	md5.okay = true;
@@ -701,63 +1629,81 @@ static void play_file (const char *file, const struct decoder *f,
 
 	out_buf_reset (out_buf);
 
-	precache_wait (&precache);
-
-	if (precache.ok && strcmp(precache.file, file)) {
-		logit ("The precached file is not the file we want.");
-		precache.f->close (precache.decoder_data);
-		precache_reset (&precache);
+	/* The softmixer runs after out_buf, but out_buf is empty here: the
+	 * previous file's decode_loop() waited for it to drain.  So the gain
+	 * applies from the file's first sample, except for the head faded in
+	 * by a crossfade, which was played with the previous file's gain. */
+	softmixer_set_norm_gain (loudness_gain (file));
+
+	pc = precache_find (file);
+	if (pc) {
+		precache_wait (pc);
+		if (!pc->ok) {
+			precache_reset (pc);
+			pc = NULL;
+		}
 	}
 
-	if (precache.ok && !strcmp(precache.file, file)) {
+	if (pc) {
 		struct decoder_error err;
 
 		logit ("Using precached file");
 
-		assert (f == precache.f);
+		assert (f == pc->f);
 
-		sound_params = precache.sound_params;
-		decoder_data = precache.decoder_data;
+		sound_params = pc->sound_params;
+		decoder_data = pc->decoder_data;
 		set_info_channels (sound_params.channels);
 		set_info_rate (sound_params.rate / 1000);
 
 		if (!audio_open(&sound_params)) {
 			md5.okay = false;
-			precache.f->close (precache.decoder_data);
-			precache_reset (&precache);
+			pc->f->close (pc->decoder_data);
+			precache_reset (pc);
 			return;
 		}
 
 #if !defined(NDEBUG) && defined(DEBUG)
-		md5.len += precache.buf_fill;
-		md5_process_bytes (precache.buf, precache.buf_fill, &md5.ctx);
+		md5.len += pc->buf_fill - pc->buf_pos;
+		md5_process_bytes (pc->buf + pc->buf_pos,
+		                   pc->buf_fill - pc->buf_pos, &md5.ctx);
 #endif
 
-		audio_send_buf (precache.buf, precache.buf_fill);
+		/* Before buf_pos is the sound mixed into the previous file
+		 * or the encoder delay. */
+		if (pc->faded_time > 0.0) {
+			md5.okay = false;
+			out_buf_time_set (out_buf, pc->faded_time);
+		}
+
+		if (pc->buf_fill > pc->buf_pos)
+			audio_send_buf (pc->buf + pc->buf_pos,
+			                pc->buf_fill - pc->buf_pos);
 
-		precache.f->get_error (precache.decoder_data, &err);
+		pc->f->get_error (pc->decoder_data, &err);
 		if (err.type != ERROR_OK) {
 			md5.okay = false;
 			if (err.type != ERROR_STREAM ||
-			    options_get_bool ("ShowStreamErrors"))
+			    options_handle_bool (&opt_show_stream_errors))
 				error ("%s", err.err);
 			decoder_error_clear (&err);
 		}
 
-		already_decoded_time = precache.decoded_time;
+		already_decoded_time = pc->decoded_time;
+		trim = pc->trim;
+
+		/* The buffer stays with the precache, but it is not used
+		 * again before decode_loop() has copied the tail. */
+		pending = pc->buf + pc->buf_fill;
+		pending_len = pc->tail_fill;
+		pending_params = pc->tail_params;
 
 		if(f->get_avg_bitrate)
 			set_info_avg_bitrate (f->get_avg_bitrate(decoder_data));
 		else
 			set_info_avg_bitrate (0);
 
-		bitrate_list_init (&bitrate_list);
-		bitrate_list.head = precache.bitrate_list.head;
-		bitrate_list.tail = precache.bitrate_list.tail;
-
-		/* don't free list elements when resetting precache */
-		precache.bitrate_list.head = NULL;
-		precache.bitrate_list.tail = NULL;
+		bitrate_list_move (&bitrate_list, &pc->bitrate_list);
 	}
 	else {
 		struct decoder_error err;
@@ -775,17 +1721,21 @@ static void play_file (const char *file, const struct decoder *f,
 		}
 
 		already_decoded_time = 0.0;
+		trim_init (&trim, f, decoder_data);
 		if (f->get_avg_bitrate)
 			set_info_avg_bitrate (f->get_avg_bitrate(decoder_data));
-		bitrate_list_init (&bitrate_list);
+		bitrate_list_empty (&bitrate_list);
 	}
 
 	audio_plist_set_time (file, f->get_duration(decoder_data));
 	audio_state_started_playing ();
-	precache_reset (&precache);
+	if (pc)
+		precache_reset (pc);
+	precache_prune (next_files);
 
-	decode_loop (f, decoder_data, next_file, out_buf, &sound_params,
-			&md5, already_decoded_time);
+	decode_loop (file, f, decoder_data, &trim, next_files, out_buf,
+			&sound_params, &md5, already_decoded_time, pending,
+			pending_len, &pending_params);
 
 #if !defined(NDEBUG) && defined(DEBUG)
 	if (md5.okay) {
@@ -804,9 +1754,11 @@ static void play_stream (const struct decoder *f, struct out_buf *out_buf)
 	struct sound_params sound_params = { 0, 0, 0 };
 	struct decoder_error err;
 	struct md5_data null_md5;
+	struct trim trim;
 
 	null_md5.okay = false;
 	out_buf_reset (out_buf);
+	softmixer_set_norm_gain (1.0f);
 
 	assert (f->open_stream != NULL);
 
@@ -825,28 +1777,30 @@ static void play_stream (const struct decoder *f, struct out_buf *out_buf)
 	}
 	else {
 		audio_state_started_playing ();
-		bitrate_list_init (&bitrate_list);
-		decode_loop (f, decoder_data, NULL, out_buf, &sound_params,
-				&null_md5, 0.0);
+		bitrate_list_empty (&bitrate_list);
+		trim_init (&trim, f, decoder_data);
+		decode_loop (NULL, f, decoder_data, &trim, NULL, out_buf,
+				&sound_params, &null_md5, 0.0, NULL, 0, NULL);
 	}
 }
 
 /* Callback for io buffer fill - show the prebuffering state. */
-static void fill_cb (struct io_stream *unused1 ATTR_UNUSED, size_t fill,
-		size_t unused2 ATTR_UNUSED, void *unused3 ATTR_UNUSED)
+static void fill_cb (struct io_stream *s, size_t fill,
+		size_t unused1 ATTR_UNUSED, void *unused2 ATTR_UNUSED)
 {
 	if (prebuffering) {
 		char msg[64];
 
-		sprintf (msg, "Prebuffering %zu/%d KB", fill / 1024U,
-		              options_get_int("Prebuffering"));
+		sprintf (msg, "Prebuffering %zu/%zu KB", fill / 1024U,
+		              io_prebuffer_target (s) / 1024U);
 		status_msg (msg);
 	}
 }
 
 /* Open a file, decode it and put output into the buffer. At the end, start
- * precaching next_file. */
-void player (const char *file, const char *next_file, struct out_buf *out_buf)
+ * precaching next_files, the files which will be played next in order. */
+void player (const char *file, const lists_t_strs *next_files,
+		struct out_buf *out_buf)
 {
 	struct decoder *f;
 
@@ -879,7 +1833,7 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 		prebuffering = 1;
 		io_set_buf_fill_callback (decoder_stream, fill_cb, NULL);
 		io_prebuffer (decoder_stream,
-				options_get_int("Prebuffering") * 1024);
+				options_handle_int (&opt_prebuffering) * 1024, -1);
 		prebuffering = 0;
 
 		status_msg ("Playing...");
@@ -899,7 +1853,7 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 		}
 
 		ev_audio_start ();
-		play_file (file, f, next_file, out_buf);
+		play_file (file, f, next_files, out_buf);
 		ev_audio_stop ();
 	}
 
@@ -908,7 +1862,7 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 
 void player_cleanup ()
 {
-	int rc;
+	int rc, ix;
 
 	rc = pthread_mutex_destroy (&request_cond_mtx);
 	if (rc != 0)
@@ -923,8 +1877,18 @@ void player_cleanup ()
 	if (rc != 0)
 		log_errno ("Can't destroy request condition", rc);
 
-	precache_wait (&precache);
-	precache_reset (&precache);
+	precache_prune (NULL);
+	for (ix = 0; ix < PRECACHE_MAX; ix += 1) {
+		xfree_tag (precache[ix].buf, MEM_DECODER);
+		precache[ix].buf = NULL;
+		precache[ix].buf_size = 0;
+		bitrate_list_destroy (&precache[ix].bitrate_list);
+	}
+
+	bitrate_list_destroy (&bitrate_list);
+
+	free (mix_buf);
+	mix_buf = NULL;
 }
 
 void player_reset ()
@@ -1,16 +1,21 @@
 #ifndef PLAYER_H
 #define PLAYER_H
 
+#include <stdint.h>
+
 #include "out_buf.h"
 #include "io.h"
+#include "audio.h"
 #include "playlist.h"
+#include "lists.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void player_cleanup ();
-void player (const char *file, const char *next_file, struct out_buf *out_buf);
+void player (const char *file, const lists_t_strs *next_files,
+		struct out_buf *out_buf);
 void player_stop ();
 void player_seek (const int n);
 void player_jump_to (const int n);
@@ -19,6 +24,8 @@ void player_init ();
 struct file_tags *player_get_curr_tags ();
 void player_pause ();
 void player_unpause ();
+char *md5_sum_line (const char *name, const struct sound_params *sound_params,
+                    const char *decoder, const uint8_t *md5, const long len);
 
 #ifdef __cplusplus
 }
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <assert.h>
 
@@ -31,25 +32,62 @@
 #include "log.h"
 #include "options.h"
 #include "files.h"
-#include "rbtree.h"
+#include "hash_index.h"
+#include "str_pool.h"
+#include "sort_keys.h"
 #include "utf8.h"
 #include "rcc.h"
 
 /* Initial size of the table */
 #define	INIT_SIZE	64
 
+/* Compact the list when it has at least that many deleted items and they
+ * are more than the non-deleted ones. */
+#define COMPACT_MIN	256
+
+/* Return a copy of the artist or album name for the tags. */
+static char *tags_str_dup (const struct file_tags *tags, const char *str)
+{
+	return tags->pooled ? str_pool_get (str) : xstrdup (str);
+}
+
+/* Free the artist or album name of the tags. */
+static void tags_str_free (const struct file_tags *tags, char *str)
+{
+	if (tags->pooled)
+		str_pool_put (str);
+	else
+		free (str);
+}
+
+/* Replace the artist and album names with the copies from the string pool,
+ * for tags kept on a playlist. */
+static void tags_pool (struct file_tags *tags)
+{
+	char *artist = tags->artist;
+	char *album = tags->album;
+
+	if (tags->pooled)
+		return;
+
+	tags->pooled = 1;
+	tags->artist = str_pool_get (artist);
+	tags->album = str_pool_get (album);
+
+	free (artist);
+	free (album);
+}
+
 void tags_free (struct file_tags *tags)
 {
 	assert (tags != NULL);
 
 	if (tags->title)
 		free (tags->title);
-	if (tags->artist)
-		free (tags->artist);
-	if (tags->album)
-		free (tags->album);
+	tags_str_free (tags, tags->artist);
+	tags_str_free (tags, tags->album);
 
-	free (tags);
+	xfree_tag (tags, MEM_TAGS);
 }
 
 void tags_clear (struct file_tags *tags)
@@ -58,10 +96,8 @@ void tags_clear (struct file_tags *tags)
 
 	if (tags->title)
 		free (tags->title);
-	if (tags->artist)
-		free (tags->artist);
-	if (tags->album)
-		free (tags->album);
+	tags_str_free (tags, tags->artist);
+	tags_str_free (tags, tags->album);
 
 	tags->title = NULL;
 	tags->artist = NULL;
@@ -79,13 +115,11 @@ void tags_copy (struct file_tags *dst, const struct file_tags *src)
 		free (dst->title);
 	dst->title = xstrdup (src->title);
 
-	if (dst->artist)
-		free (dst->artist);
-	dst->artist = xstrdup (src->artist);
+	tags_str_free (dst, dst->artist);
+	dst->artist = tags_str_dup (dst, src->artist);
 
-	if (dst->album)
-		free (dst->album);
-	dst->album = xstrdup (src->album);
+	tags_str_free (dst, dst->album);
+	dst->album = tags_str_dup (dst, src->album);
 
 	dst->track = src->track;
 	dst->time = src->time;
@@ -104,7 +138,7 @@ void tags_update (struct file_tags *dst, struct file_tags *src, int move)
 
 		dst->track = src->track;
 		
-		if (move)
+		if (move && dst->pooled == src->pooled)
 		{
 			dst->title  = src->title;  src->title  = NULL;
 			dst->artist = src->artist; src->artist = NULL;
@@ -114,8 +148,8 @@ void tags_update (struct file_tags *dst, struct file_tags *src, int move)
 		else
 		{
 			dst->title  = xstrdup (src->title);
-			dst->artist = xstrdup (src->artist);
-			dst->album  = xstrdup (src->album);
+			dst->artist = tags_str_dup (dst, src->artist);
+			dst->album  = tags_str_dup (dst, src->album);
 		}
 		dst->filled |= TAGS_COMMENTS;
 	}
@@ -135,7 +169,8 @@ struct file_tags *tags_new ()
 {
 	struct file_tags *tags;
 
-	tags = (struct file_tags *)xmalloc (sizeof(struct file_tags));
+	tags = (struct file_tags *)xmalloc_tag (sizeof(struct file_tags),
+			MEM_TAGS);
 	tags->title = NULL;
 	tags->artist = NULL;
 	tags->album = NULL;
@@ -143,6 +178,7 @@ struct file_tags *tags_new ()
 	tags->time = -1;
 	tags->rating = -1;
 	tags->filled = 0;
+	tags->pooled = 0;
 
 	return tags;
 }
@@ -159,23 +195,51 @@ struct file_tags *tags_dup (const struct file_tags *tags)
 	return dtags;
 }
 
-static int rb_compare (const void *a, const void *b, const void *adata)
+/* The search index maps file names to item indexes stored as index + 1,
+ * because NULL means no data. */
+#define INDEX_DATA(num)	((const void *)(intptr_t)((num) + 1))
+
+static const char *index_item_file (const void *data, const void *adata)
+{
+	const struct plist *plist = (const struct plist *)adata;
+
+	return plist->items[(intptr_t)data - 1].file;
+}
+
+/* Return the index of the item found in the search index for the file or
+ * -1. */
+static int index_find (const struct plist *plist, const char *file)
 {
-	struct plist *plist = (struct plist *)adata;
-	int pos_a = (intptr_t)a;
-	int pos_b = (intptr_t)b;
+	const void *data = hash_index_find (plist->search_index, file);
 
-	return strcoll (plist->items[pos_a].file, plist->items[pos_b].file);
+	return data ? (intptr_t)data - 1 : -1;
 }
 
-static int rb_fname_compare (const void *key, const void *data,
-                             const void *adata)
+/* Put the item in the search index as in plist_add(): the latest item for
+ * the file is found, but not a deleted one if there is a non-deleted one. */
+static void index_add (struct plist *plist, const int num)
 {
-	struct plist *plist = (struct plist *)adata;
-	const char *fname = (const char *)key;
-	const int pos = (intptr_t)data;
+	int found;
+
+	if (!plist->items[num].file)
+		return;
+
+	found = index_find (plist, plist->items[num].file);
+	if (found == -1 || !plist->items[num].deleted
+			|| plist->items[found].deleted)
+		hash_index_set (plist->search_index, INDEX_DATA(num));
+}
+
+/* Build the search index from scratch. */
+static void index_rebuild (struct plist *plist)
+{
+	int i;
 
-	return strcoll (fname, plist->items[pos].file);
+	hash_index_clear (plist->search_index);
+	hash_index_reserve (plist->search_index, plist->num);
+
+	for (i = 0; i < plist->num; i++)
+		index_add (plist, i);
 }
 
 /* Return 1 if an item has 'deleted' flag. */
@@ -186,18 +250,87 @@ inline int plist_deleted (const struct plist *plist, const int num)
 	return plist->items[num].deleted;
 }
 
+/* The live index is a Fenwick tree over the items (1-based) counting the
+ * non-deleted ones, so positions and next/prev items are found in
+ * O(log n) however many deleted items the list has. */
+
+/* Add delta to the count for the item num. */
+static void live_update (struct plist *plist, const int num, const int delta)
+{
+	int i;
+
+	for (i = num + 1; i <= plist->allocated; i += i & -i)
+		plist->live[i] += delta;
+}
+
+/* Return the number of non-deleted items before the item num. */
+static int live_count_before (const struct plist *plist, const int num)
+{
+	int i, count = 0;
+
+	for (i = num; i > 0; i -= i & -i)
+		count += plist->live[i];
+
+	return count;
+}
+
+/* Return the index of the nth (counting from 1) non-deleted item or -1 if
+ * there is no such item. */
+static int live_find (const struct plist *plist, int nth)
+{
+	int pos = 0, step = 1;
+
+	if (nth < 1 || nth > plist->not_deleted)
+		return -1;
+
+	while (step * 2 <= plist->allocated)
+		step *= 2;
+
+	for (; step > 0; step /= 2) {
+		if (pos + step <= plist->allocated
+				&& plist->live[pos + step] < nth) {
+			pos += step;
+			nth -= plist->live[pos];
+		}
+	}
+
+	return pos;
+}
+
+/* Build the live index from scratch for the current size of the table. */
+static void live_rebuild (struct plist *plist)
+{
+	int i;
+
+	plist->live = (int *)xrealloc_tag (plist->live,
+			sizeof(int) * (plist->allocated + 1), MEM_PLIST);
+	memset (plist->live, 0, sizeof(int) * (plist->allocated + 1));
+
+	for (i = 1; i <= plist->allocated; i++) {
+		int parent = i + (i & -i);
+
+		if (i <= plist->num && !plist->items[i - 1].deleted)
+			plist->live[i] += 1;
+		if (parent <= plist->allocated)
+			plist->live[parent] += plist->live[i];
+	}
+}
+
 /* Initialize the playlist. */
 void plist_init (struct plist *plist)
 {
 	plist->num = 0;
 	plist->allocated = INIT_SIZE;
 	plist->not_deleted = 0;
-	plist->items = (struct plist_item *)xmalloc (sizeof(struct plist_item)
-			* INIT_SIZE);
+	plist->items = (struct plist_item *)xmalloc_tag (
+			sizeof(struct plist_item) * INIT_SIZE, MEM_PLIST);
 	plist->serial = -1;
-	plist->search_tree = rb_tree_new (rb_compare, rb_fname_compare, plist);
+	plist->search_index = hash_index_new (index_item_file, plist);
 	plist->total_time = 0;
 	plist->items_with_time = 0;
+	memset (plist->type_count, 0, sizeof(plist->type_count));
+	plist->live = NULL;
+	live_rebuild (plist);
 }
 
 /* Create a new playlist item with empty fields. */
@@ -218,16 +351,42 @@ struct plist_item *plist_new_item ()
 	return item;
 }
 
-/* Add a file to the list. Return the index of the item. */
-int plist_add (struct plist *plist, const char *file_name)
+/* Make room for count more items so that adding them doesn't reallocate
+ * the list or its indexes on the way. */
+void plist_reserve (struct plist *plist, const int count)
+{
+	int needed;
+
+	assert (plist != NULL);
+	assert (count >= 0);
+
+	needed = plist->num + count;
+	if (needed <= plist->allocated)
+		return;
+
+	while (plist->allocated < needed)
+		plist->allocated *= 2;
+	plist->items = (struct plist_item *)xrealloc_tag (plist->items,
+			sizeof(struct plist_item) * plist->allocated,
+			MEM_PLIST);
+	live_rebuild (plist);
+	hash_index_reserve (plist->search_index, needed);
+}
+
+/* Add a file with the given modification time to the list.  Return the
+ * index of the item. */
+static int add_file (struct plist *plist, const char *file_name,
+		const time_t mtime)
 {
 	assert (plist != NULL);
 	assert (plist->items != NULL);
 
 	if (plist->allocated == plist->num) {
 		plist->allocated *= 2;
-		plist->items = (struct plist_item *)xrealloc (plist->items,
-				sizeof(struct plist_item) * plist->allocated);
+		plist->items = (struct plist_item *)xrealloc_tag (plist->items,
+				sizeof(struct plist_item) * plist->allocated,
+				MEM_PLIST);
+		live_rebuild (plist);
 	}
 
 	plist->items[plist->num].file = xstrdup (file_name);
@@ -237,21 +396,27 @@ int plist_add (struct plist *plist, const char *file_name)
 	plist->items[plist->num].title_file = NULL;
 	plist->items[plist->num].title_tags = NULL;
 	plist->items[plist->num].tags = NULL;
-	plist->items[plist->num].mtime = (file_name ? get_mtime(file_name)
-			: (time_t)-1);
+	plist->items[plist->num].mtime = mtime;
 	plist->items[plist->num].queue_pos = 0;
 
-	if (file_name) {
-		rb_delete (plist->search_tree, file_name);
-		rb_insert (plist->search_tree, (void *)(intptr_t)plist->num);
-	}
+	if (file_name)
+		hash_index_set (plist->search_index, INDEX_DATA(plist->num));
 
+	live_update (plist, plist->num, 1);
+	plist->type_count[plist->items[plist->num].type]++;
 	plist->num++;
 	plist->not_deleted++;
 
 	return plist->num - 1;
 }
 
+/* Add a file to the list. Return the index of the item. */
+int plist_add (struct plist *plist, const char *file_name)
+{
+	return add_file (plist, file_name, file_name ? get_mtime (file_name)
+			: (time_t)-1);
+}
+
 /* Copy all fields of item src to dst. */
 void plist_item_copy (struct plist_item *dst, const struct plist_item *src)
 {
@@ -264,8 +429,10 @@ void plist_item_copy (struct plist_item *dst, const struct plist_item *src)
 	dst->mtime = src->mtime;
 	dst->queue_pos = src->queue_pos;
 
-	if (src->tags)
+	if (src->tags) {
 		dst->tags = tags_dup (src->tags);
+		tags_pool (dst->tags);
+	}
 	else
 		dst->tags = NULL;
 
@@ -295,15 +462,13 @@ char *plist_get_file (const struct plist *plist, int i)
  */
 int plist_next (struct plist *plist, int num)
 {
-	int i = num + 1;
-
 	assert (plist != NULL);
 	assert (num >= -1);
 
-	while (i < plist->num && plist->items[i].deleted)
-		i++;
+	if (num + 1 >= plist->num)
+		return -1;
 
-	return i < plist->num ? i : -1;
+	return live_find (plist, live_count_before (plist, num + 1) + 1);
 }
 
 /* Get the number of the previous item on the list (skipping deleted items).
@@ -312,15 +477,13 @@ int plist_next (struct plist *plist, int num)
  */
 int plist_prev (struct plist *plist, int num)
 {
-	int i = num - 1;
-
 	assert (plist != NULL);
 	assert (num >= -1);
 
-	while (i >= 0 && plist->items[i].deleted)
-		i--;
+	if (num <= 0)
+		return -1;
 
-	return i >= 0 ? i : -1;
+	return live_find (plist, live_count_before (plist, MIN(num, plist->num)));
 }
 
 void plist_free_item_fields (struct plist_item *item)
@@ -353,14 +516,16 @@ void plist_clear (struct plist *plist)
 	for (i = 0; i < plist->num; i++)
 		plist_free_item_fields (&plist->items[i]);
 
-	plist->items = (struct plist_item *)xrealloc (plist->items,
-			sizeof(struct plist_item) * INIT_SIZE);
+	plist->items = (struct plist_item *)xrealloc_tag (plist->items,
+			sizeof(struct plist_item) * INIT_SIZE, MEM_PLIST);
 	plist->allocated = INIT_SIZE;
 	plist->num = 0;
 	plist->not_deleted = 0;
-	rb_tree_clear (plist->search_tree);
+	hash_index_clear (plist->search_index);
 	plist->total_time = 0;
 	plist->items_with_time = 0;
+	memset (plist->type_count, 0, sizeof(plist->type_count));
+	live_rebuild (plist);
 }
 
 /* Destroy the list freeing memory; the list can't be used after that. */
@@ -369,64 +534,89 @@ void plist_free (struct plist *plist)
 	assert (plist != NULL);
 
 	plist_clear (plist);
-	free (plist->items);
+	xfree_tag (plist->items, MEM_PLIST);
 	plist->allocated = 0;
 	plist->items = NULL;
-	rb_tree_free (plist->search_tree);
+	hash_index_free (plist->search_index);
+	xfree_tag (plist->live, MEM_PLIST);
+	plist->live = NULL;
 }
 
-/* Sort the playlist by file names. */
-void plist_sort_fname (struct plist *plist)
+/* Sort the playlist, deleted items are removed.  A sort key is built once
+ * for each item and the items are moved into the sorted order in one
+ * pass. */
+void plist_sort (struct plist *plist, const enum plist_sort_by by)
 {
-	struct plist_item *sorted;
-	struct rb_node *x;
-	int n;
+	struct sort_keys *keys;
+	struct plist_item *items;
+	bool natural;
+	int i;
+
+	assert (plist != NULL);
 
 	if (plist_count(plist) == 0)
 		return;
 
-	sorted = (struct plist_item *)xmalloc (plist_count(plist) *
-			sizeof(struct plist_item));
+	natural = !strcasecmp (options_get_symb ("Sort"), "Natural");
+	keys = sort_keys_new (plist->not_deleted, natural);
 
-	x = rb_min (plist->search_tree);
-	assert (!rb_is_null(x));
+	for (i = 0; i < plist->num; i++) {
+		const struct plist_item *item = &plist->items[i];
 
-	while (plist_deleted(plist, (intptr_t)rb_get_data (x)))
-		x = rb_next (x);
+		if (item->deleted)
+			continue;
 
-	sorted[0] = plist->items[(intptr_t)rb_get_data (x)];
-	rb_set_data (x, NULL);
+		if (by == PLIST_SORT_TAGS) {
+			const struct file_tags *tags = item->tags;
 
-	n = 1;
-	while (!rb_is_null(x = rb_next(x))) {
-		if (!plist_deleted(plist, (intptr_t)rb_get_data (x))) {
-			sorted[n] = plist->items[(intptr_t)rb_get_data (x)];
-			rb_set_data (x, (void *)(intptr_t)n++);
+			sort_keys_add_text (keys, tags ? tags->artist : NULL);
+			sort_keys_add_text (keys, tags ? tags->album : NULL);
+			sort_keys_add_number (keys, tags && tags->track > 0
+					? tags->track : -1);
+			sort_keys_add_text (keys, tags ? tags->title : NULL);
 		}
+		sort_keys_add_text (keys, item->file);
+		sort_keys_next (keys, i);
 	}
 
-	plist->num = n;
-	plist->not_deleted = n;
+	sort_keys_sort (keys);
+
+	items = (struct plist_item *)xmalloc_tag (sizeof(struct plist_item)
+			* plist->allocated, MEM_PLIST);
+	for (i = 0; i < sort_keys_count (keys); i++)
+		items[i] = plist->items[sort_keys_index (keys, i)];
+
+	for (i = 0; i < plist->num; i++)
+		if (plist->items[i].deleted)
+			plist_free_item_fields (&plist->items[i]);
+
+	xfree_tag (plist->items, MEM_PLIST);
+	plist->items = items;
+	plist->num = sort_keys_count (keys);
+	plist->not_deleted = plist->num;
+	sort_keys_free (keys);
 
-	memcpy (plist->items, sorted, sizeof(struct plist_item) * n);
-	free (sorted);
+	index_rebuild (plist);
+	live_rebuild (plist);
+}
+
+/* Sort the playlist by file names, deleted items are removed. */
+void plist_sort_fname (struct plist *plist)
+{
+	plist_sort (plist, PLIST_SORT_FNAME);
 }
 
 /* Find an item in the list.  Return the index or -1 if not found. */
 int plist_find_fname (struct plist *plist, const char *file)
 {
-	struct rb_node *x;
+	int num;
 
 	assert (plist != NULL);
 	assert (file != NULL);
 
-	x = rb_search (plist->search_tree, file);
+	num = index_find (plist, file);
 
-	if (rb_is_null(x))
-		return -1;
-
-	return !plist_deleted(plist, (intptr_t)rb_get_data (x)) ?
-                                 (intptr_t)rb_get_data (x) : -1;
+	return num != -1 && !plist_deleted(plist, num) ? num : -1;
 }
 
 /* Find an item in the list; also find deleted items.  If there is more than
@@ -434,20 +624,10 @@ int plist_find_fname (struct plist *plist, const char *file)
  * return the last of them.  Return the index or -1 if not found. */
 int plist_find_del_fname (const struct plist *plist, const char *file)
 {
-	int i;
-	int item = -1;
-
 	assert (plist != NULL);
+	assert (file != NULL);
 
-	for (i = 0; i < plist->num; i++) {
-		if (plist->items[i].file
-				&& !strcmp(plist->items[i].file, file)) {
-			if (item == -1 || plist_deleted(plist, item))
-				item = i;
-		}
-	}
-
-	return item;
+	return index_find (plist, file);
 }
 
 /* Returns the next filename that is a dead entry, or NULL if there are none
@@ -477,6 +657,38 @@ const char *plist_get_next_dead_entry (const struct plist *plist,
 
 #define if_not_empty(str)	(tags && (str) && *(str) ? (str) : NULL)
 
+/* Format strings are compiled into a list of operations, which is run
+ * for each title. */
+enum title_op_type
+{
+	TITLE_TEXT,	/* literal text */
+	TITLE_TAG,	/* %x: a tag value */
+	TITLE_COND	/* %(x:then:else) */
+};
+
+struct title_format;
+
+struct title_op
+{
+	enum title_op_type type;
+	char tag;		/* for TITLE_TAG and TITLE_COND */
+	char *text;		/* for TITLE_TEXT */
+	int text_len;
+	struct title_format *then;	/* for TITLE_COND */
+	struct title_format *otherwise;
+};
+
+struct title_format
+{
+	struct title_op *ops;
+	int num;
+	int allocated;
+};
+
+/* The last compiled format string. */
+static char *cached_fmt = NULL;
+static struct title_format *cached_format = NULL;
+
 static const char *title_expn_subs(char fmt, const struct file_tags *tags)
 {
 	static char track[16];
@@ -506,112 +718,189 @@ static inline void check_zero (const char *x)
 		fatal ("Unexpected end of title expression!");
 }
 
-/* Generate a title from fmt. */
-static void do_title_expn (char *dest, int size, const char *fmt,
-		const struct file_tags *tags)
+static void check_tag (const char tag)
 {
-	const char *h;
-	int free = --size;
+	if (!strchr ("naAt", tag))
+		fatal ("Error parsing format string!");
+}
+
+static struct title_op *title_add_op (struct title_format *f,
+		const enum title_op_type type)
+{
+	struct title_op *op;
+
+	if (f->num == f->allocated) {
+		f->allocated = f->allocated ? f->allocated * 2 : 4;
+		f->ops = (struct title_op *)xrealloc (f->ops,
+				f->allocated * sizeof(struct title_op));
+	}
+
+	op = &f->ops[f->num++];
+	op->type = type;
+	op->tag = 0;
+	op->text = NULL;
+	op->text_len = 0;
+	op->then = NULL;
+	op->otherwise = NULL;
+
+	return op;
+}
+
+/* Append a literal character, joining it with the previous text. */
+static void title_add_char (struct title_format *f, const char c)
+{
+	struct title_op *op;
+
+	if (f->num && f->ops[f->num - 1].type == TITLE_TEXT)
+		op = &f->ops[f->num - 1];
+	else
+		op = title_add_op (f, TITLE_TEXT);
+
+	op->text = (char *)xrealloc (op->text, op->text_len + 2);
+	op->text[op->text_len++] = c;
+	op->text[op->text_len] = '\0';
+}
+
+/* Copy the ternary expression at *fmt up to the unescaped end character
+ * into expr and leave *fmt at the end character. */
+static void title_copy_expr (char *expr, const int size, const char **fmt,
+		const char end, const char *too_long)
+{
+	int expr_pos = 0;
 	short escape = 0;
 
-	dest[0] = 0;
+	while (escape || **fmt != end) {
+		if (expr_pos == size - 2)
+			fatal ("%s", too_long);
+		expr[expr_pos++] = **fmt;
+		if (**fmt == '\\')
+			escape = 1;
+		else
+			escape = 0;
+		check_zero(++*fmt);
+	}
+	expr[expr_pos] = '\0';
+}
 
-	while (free > 0 && *fmt) {
+static void title_format_free (struct title_format *f)
+{
+	int i;
+
+	for (i = 0; i < f->num; i++) {
+		if (f->ops[i].text)
+			free (f->ops[i].text);
+		if (f->ops[i].then)
+			title_format_free (f->ops[i].then);
+		if (f->ops[i].otherwise)
+			title_format_free (f->ops[i].otherwise);
+	}
+
+	free (f->ops);
+	free (f);
+}
+
+/* Compile the format string. */
+static struct title_format *title_compile (const char *fmt)
+{
+	struct title_format *f;
+	short escape = 0;
+
+	f = (struct title_format *)xmalloc (sizeof(struct title_format));
+	f->ops = NULL;
+	f->num = 0;
+	f->allocated = 0;
+
+	while (*fmt) {
 		if (*fmt == '%' && !escape) {
 			check_zero(++fmt);
 
-			/* do ternary expansion
+			/* ternary expansion
 			 * format: %(x:true:false)
 			 */
 			if (*fmt == '(') {
 				char separator, expr[256];
-				int expr_pos = 0;
+				struct title_op *op;
 
 				check_zero(++fmt);
-				h = title_expn_subs(*fmt, tags);
+				check_tag (*fmt);
+				op = title_add_op (f, TITLE_COND);
+				op->tag = *fmt;
 
 				check_zero(++fmt);
 				separator = *fmt;
 
 				check_zero(++fmt);
+				title_copy_expr (expr, sizeof(expr), &fmt,
+						separator,
+						"Nested ternary expression too long!");
+				op->then = title_compile (expr);
 
-				if(h) { /* true */
-
-					/* copy the expression */
-					while (escape || *fmt != separator) {
-						if (expr_pos == sizeof(expr)-2)
-							fatal ("Nested ternary expression too long!");
-						expr[expr_pos++] = *fmt;
-						if (*fmt == '\\')
-							escape = 1;
-						else
-							escape = 0;
-						check_zero(++fmt);
-					}
-					expr[expr_pos] = '\0';
-
-					/* eat the rest */
-					while (escape || *fmt != ')') {
-						if (escape)
-							escape = 0;
-						else if (*fmt == '\\')
-							escape = 1;
-						check_zero(++fmt);
-					}
-				}
-				else { /* false */
-
-					/* eat the truth :-) */
-					while (escape || *fmt != separator) {
-						if (escape)
-							escape = 0;
-						else if (*fmt == '\\')
-							escape = 1;
-						check_zero(++fmt);
-					}
-
-					check_zero(++fmt);
-
-					/* copy the expression */
-					while (escape || *fmt != ')') {
-						if (expr_pos == sizeof(expr)-2)
-							fatal ("Ternary expression too long!");
-						expr[expr_pos++] = *fmt;
-						if (*fmt == '\\')
-							escape = 1;
-						else
-							escape = 0;
-						check_zero(++fmt);
-					}
-					expr[expr_pos] = '\0';
-				}
-
-				do_title_expn((dest + size - free),
-					      free, expr, tags);
-				free -= strlen(dest + size - free);
+				check_zero(++fmt);
+				title_copy_expr (expr, sizeof(expr), &fmt, ')',
+						"Ternary expression too long!");
+				op->otherwise = title_compile (expr);
 			}
 			else {
-				h = title_expn_subs(*fmt, tags);
-
-				if (h) {
-					strncat(dest, h, free-1);
-					free -= strlen (h);
-				}
+				check_tag (*fmt);
+				title_add_op (f, TITLE_TAG)->tag = *fmt;
 			}
 		}
 		else if (*fmt == '\\' && !escape)
 			escape = 1;
 		else {
-			dest[size - free] = *fmt;
-			dest[size - free + 1] = 0;
-			--free;
+			title_add_char (f, *fmt);
 			escape = 0;
 		}
 		fmt++;
 	}
 
-	free = MAX(free, 0); /* Possible integer overflow? */
-	dest[size - free] = '\0';
+	return f;
+}
+
+/* Generate a title into dest (of size bytes) from the compiled format.
+ * Return the length of the title. */
+static int title_run (const struct title_format *f, char *dest, int size,
+		const struct file_tags *tags)
+{
+	int i, len = 0;
+	int free = --size;
+
+	for (i = 0; i < f->num && free > 0; i++) {
+		const struct title_op *op = &f->ops[i];
+		const char *h;
+		int n;
+
+		switch (op->type) {
+			case TITLE_TEXT:
+				n = MIN(op->text_len, free);
+				memcpy (dest + len, op->text, n);
+				len += n;
+				free -= n;
+				break;
+			case TITLE_TAG:
+				h = title_expn_subs (op->tag, tags);
+				if (h) {
+					int h_len = strlen (h);
+
+					n = MIN(h_len, free - 1);
+					memcpy (dest + len, h, n);
+					len += n;
+					free -= h_len;
+				}
+				break;
+			case TITLE_COND:
+				h = title_expn_subs (op->tag, tags);
+				n = title_run (h ? op->then : op->otherwise,
+						dest + len, free, tags);
+				len += n;
+				free -= n;
+				break;
+		}
+	}
+
+	dest[len] = '\0';
+
+	return len;
 }
 
 /* Build file title from struct file_tags. Returned memory is malloc()ed. */
@@ -619,7 +908,15 @@ char *build_title_with_format (const struct file_tags *tags, const char *fmt)
 {
 	char title[512];
 
-	do_title_expn (title, sizeof(title), fmt, tags);
+	if (!cached_fmt || strcmp (cached_fmt, fmt)) {
+		if (cached_format)
+			title_format_free (cached_format);
+		free (cached_fmt);
+		cached_format = title_compile (fmt);
+		cached_fmt = xstrdup (fmt);
+	}
+
+	title_run (cached_format, title, sizeof(title), tags);
 	return xstrdup (title);
 }
 
@@ -632,10 +929,19 @@ char *build_title (const struct file_tags *tags)
 /* Copy the item to the playlist. Return the index of the added item. */
 int plist_add_from_item (struct plist *plist, const struct plist_item *item)
 {
-	int pos = plist_add (plist, item->file);
+	int pos = add_file (plist, item->file, item->mtime);
 
+	plist->type_count[plist->items[pos].type]--;
 	plist_item_copy (&plist->items[pos], item);
 
+	if (plist->items[pos].deleted) {
+		live_update (plist, pos, -1);
+		plist->not_deleted--;
+		return pos;
+	}
+
+	plist->type_count[plist->items[pos].type]++;
+
 	if (item->tags && item->tags->time != -1) {
 		plist->total_time += item->tags->time;
 		plist->items_with_time++;
@@ -668,6 +974,8 @@ void plist_delete (struct plist *plist, const int num)
 		plist->items[num].file = file;
 
 		plist->items[num].deleted = 1;
+		live_update (plist, num, -1);
+		plist->type_count[plist->items[num].type]--;
 
 		plist->not_deleted--;
 	}
@@ -719,14 +1027,22 @@ void plist_set_file (struct plist *plist, const int num, const char *file)
 	assert (file != NULL);
 
 	if (plist->items[num].file) {
-		rb_delete (plist->search_tree, file);
+		if (index_find (plist, plist->items[num].file) == num)
+			hash_index_delete (plist->search_index,
+			                   plist->items[num].file);
 		free (plist->items[num].file);
 	}
 
+	if (!plist->items[num].deleted)
+		plist->type_count[plist->items[num].type]--;
+
 	plist->items[num].file = xstrdup (file);
 	plist->items[num].type = file_type (file);
 	plist->items[num].mtime = get_mtime (file);
-	rb_insert (plist->search_tree, (void *)(intptr_t)num);
+	hash_index_set (plist->search_index, INDEX_DATA(num));
+
+	if (!plist->items[num].deleted)
+		plist->type_count[plist->items[num].type]++;
 }
 
 /* Add the content of playlist b to a by copying items. */
@@ -748,6 +1064,25 @@ void plist_cat (struct plist *a, struct plist *b)
 	}
 }
 
+/* Account the change of the item's time in the totals; deleted items are
+ * not counted. */
+static void update_total_time (struct plist *plist, const int num,
+		const int old_time, const int new_time)
+{
+	if (plist->items[num].deleted)
+		return;
+
+	if (old_time != -1) {
+		plist->total_time -= old_time;
+		plist->items_with_time--;
+	}
+
+	if (new_time != -1) {
+		plist->total_time += new_time;
+		plist->items_with_time++;
+	}
+}
+
 /* Set the time tags field for the item. */
 void plist_set_item_time (struct plist *plist, const int num, const int time)
 {
@@ -765,15 +1100,7 @@ void plist_set_item_time (struct plist *plist, const int num, const int time)
 	else
 		old_time = -1;
 
-	if (old_time != -1) {
-		plist->total_time -= old_time;
-		plist->items_with_time--;
-	}
-
-	if (time != -1) {
-		plist->total_time += time;
-		plist->items_with_time++;
-	}
+	update_total_time (plist, num, old_time, time);
 
 	plist->items[num].tags->time = time;
 	plist->items[num].tags->filled |= TAGS_TIME;
@@ -813,13 +1140,12 @@ int get_item_rating (const struct plist *plist, const int i)
 }
 
 /* Return the total time of all files on the playlist having the time tag.
- * If the time information is missing for any file, all_files is set to 0,
- * otherwise 1.
- * Returned value is that counted by plist_count_time(), so may be not
- * up-to-date. */
+ * If the time information is missing for any sound file, all_files is set
+ * to 0, otherwise 1 (internet streams have no time).  The totals are kept
+ * up to date as items and their tags change, so this is O(1). */
 int plist_total_time (const struct plist *plist, int *all_files)
 {
-	*all_files = plist->not_deleted == plist->items_with_time;
+	*all_files = plist->items_with_time >= plist->type_count[F_SOUND];
 
 	return plist->total_time;
 }
@@ -834,45 +1160,19 @@ static void plist_swap (struct plist *plist, const int a, const int b)
 	if (a != b) {
 		struct plist_item t;
 
+		if (plist->items[a].deleted != plist->items[b].deleted) {
+			int delta = plist->items[a].deleted ? 1 : -1;
+
+			live_update (plist, a, delta);
+			live_update (plist, b, -delta);
+		}
+
 		t = plist->items[a];
 		plist->items[a] = plist->items[b];
 		plist->items[b] = t;
 	}
 }
 
-/* Shuffle the playlist. */
-void plist_shuffle (struct plist *plist)
-{
-	int i;
-
-	for (i = 0; i < plist->num; i += 1)
-		plist_swap (plist, i, (rand () / (float)RAND_MAX) * (plist->num - 1));
-
-	rb_tree_clear (plist->search_tree);
-
-	for (i = 0; i < plist->num; i++)
-		rb_insert (plist->search_tree, (void *)(intptr_t)i);
-}
-
-/* Swap the first item on the playlist with the item with file fname. */
-void plist_swap_first_fname (struct plist *plist, const char *fname)
-{
-	int i;
-
-	assert (plist != NULL);
-	assert (fname != NULL);
-
-	i = plist_find_fname (plist, fname);
-
-	if (i != -1 && i != 0) {
-		rb_delete (plist->search_tree, fname);
-		rb_delete (plist->search_tree, plist->items[0].file);
-		plist_swap (plist, 0, i);
-		rb_insert (plist->search_tree, NULL);
-		rb_insert (plist->search_tree, (void *)(intptr_t)i);
-	}
-}
-
 void plist_set_serial (struct plist *plist, const int serial)
 {
 	plist->serial = serial;
@@ -887,14 +1187,10 @@ int plist_get_serial (const struct plist *plist)
  * Return -1 if there are no items. */
 int plist_last (const struct plist *plist)
 {
-	int i;
-
-	i = plist->num - 1;
-
-	while (i > 0 && plist_deleted(plist, i))
-		i--;
+	if (plist->not_deleted == 0)
+		return plist->num ? 0 : -1;
 
-	return i;
+	return live_find (plist, plist->not_deleted);
 }
 
 enum file_type plist_file_type (const struct plist *plist, const int num)
@@ -906,22 +1202,95 @@ enum file_type plist_file_type (const struct plist *plist, const int num)
 }
 
 /* Remove items from playlist 'a' that are also present on playlist 'b'. */
+/* Return the index of the non-deleted item for the file or -1. */
+static int find_live (const struct plist *plist, const char *file)
+{
+	int num = index_find (plist, file);
+
+	return num != -1 && !plist->items[num].deleted ? num : -1;
+}
+
+/* Compute what changed from one playlist to the other: the items of from
+ * missing in to (removed), the items of to missing in from (added) and the
+ * items of to that are in from, but at a different place in the order of
+ * the common items (moved).  Deleted items are not taken into account.  Each list
+ * is passed once with a lookup in the other's search index. */
+void plist_diff (const struct plist *from, const struct plist *to,
+		struct plist_diff *diff)
+{
+	int *rank;
+	int i, common = 0;
+
+	assert (from != NULL);
+	assert (to != NULL);
+	assert (diff != NULL);
+
+	diff->removed = (int *)xmalloc (sizeof(int) * MAX(from->num, 1));
+	diff->added = (int *)xmalloc (sizeof(int) * MAX(to->num, 1));
+	diff->moved = (int *)xmalloc (sizeof(int) * MAX(to->num, 1));
+	diff->removed_num = diff->added_num = diff->moved_num = 0;
+
+	/* The place of each item of from among the common items. */
+	rank = (int *)xmalloc (sizeof(int) * MAX(from->num, 1));
+	for (i = 0; i < from->num; i++) {
+		if (from->items[i].deleted || !from->items[i].file)
+			continue;
+
+		if (find_live (to, from->items[i].file) == -1)
+			diff->removed[diff->removed_num++] = i;
+		else
+			rank[i] = common++;
+	}
+
+	common = 0;
+	for (i = 0; i < to->num; i++) {
+		int n;
+
+		if (to->items[i].deleted || !to->items[i].file)
+			continue;
+
+		n = find_live (from, to->items[i].file);
+		if (n == -1)
+			diff->added[diff->added_num++] = i;
+		else if (rank[n] != common++)
+			diff->moved[diff->moved_num++] = i;
+	}
+
+	free (rank);
+}
+
+void plist_diff_free (struct plist_diff *diff)
+{
+	assert (diff != NULL);
+
+	free (diff->removed);
+	free (diff->added);
+	free (diff->moved);
+}
+
+/* Delete the items from a that are also in b. */
 void plist_remove_common_items (struct plist *a, struct plist *b)
 {
+	struct plist_diff diff;
+	char *added;
 	int i;
 
 	assert (a != NULL);
 	assert (b != NULL);
 
-	for (i = 0; i < a->num; i += 1) {
-		if (plist_deleted (a, i))
-			continue;
+	plist_diff (b, a, &diff);
 
-		assert (a->items[i].file != NULL);
+	added = (char *)xcalloc (MAX(a->num, 1), sizeof(char));
+	for (i = 0; i < diff.added_num; i++)
+		added[diff.added[i]] = 1;
 
-		if (plist_find_fname (b, a->items[i].file) != -1)
+	for (i = 0; i < a->num; i += 1) {
+		if (!plist_deleted (a, i) && a->items[i].file && !added[i])
 			plist_delete (a, i);
 	}
+
+	free (added);
+	plist_diff_free (&diff);
 }
 
 void plist_discard_tags (struct plist *plist)
@@ -957,16 +1326,9 @@ void plist_set_tags (struct plist *plist, const int num,
 	if (plist->items[num].tags)
 		tags_free (plist->items[num].tags);
 	plist->items[num].tags = tags_dup (tags);
+	tags_pool (plist->items[num].tags);
 
-	if (old_time != -1) {
-		plist->total_time -= old_time;
-		plist->items_with_time--;
-	}
-
-	if (tags->time != -1) {
-		plist->total_time += tags->time;
-		plist->items_with_time++;
-	}
+	update_total_time (plist, num, old_time, tags->time);
 }
 
 struct file_tags *plist_get_tags (const struct plist *plist, const int num)
@@ -984,38 +1346,74 @@ struct file_tags *plist_get_tags (const struct plist *plist, const int num)
 void plist_swap_files (struct plist *plist, const char *file1,
 		const char *file2)
 {
-	struct rb_node *x1, *x2;
+	int i1, i2;
 
 	assert (plist != NULL);
 	assert (file1 != NULL);
 	assert (file2 != NULL);
 
-	x1 = rb_search (plist->search_tree, file1);
-	x2 = rb_search (plist->search_tree, file2);
+	i1 = index_find (plist, file1);
+	i2 = index_find (plist, file2);
 
-	if (!rb_is_null(x1) && !rb_is_null(x2)) {
-		const void *t;
-
-		plist_swap (plist, (intptr_t)rb_get_data (x1),
-		                   (intptr_t)rb_get_data (x2));
-
-		t = rb_get_data (x1);
-		rb_set_data (x1, rb_get_data (x2));
-		rb_set_data (x2, t);
+	if (i1 != -1 && i2 != -1) {
+		plist_swap (plist, i1, i2);
+		hash_index_set (plist->search_index, INDEX_DATA(i1));
+		hash_index_set (plist->search_index, INDEX_DATA(i2));
 	}
 }
 
 /* Return the position of a file in the list, starting with 1. */
 int plist_get_position (const struct plist *plist, int num)
 {
-	int i, pos = 1;
-
 	assert (LIMIT(num, plist->num));
 
-	for (i = 0; i < num; i++) {
-		if(!plist->items[i].deleted)
-			pos++;
+	return live_count_before (plist, num) + 1;
+}
+
+/* Return 1 if the list has so many deleted items that it should be
+ * compacted. */
+int plist_needs_compact (const struct plist *plist)
+{
+	int deleted;
+
+	assert (plist != NULL);
+
+	deleted = plist->num - plist->not_deleted;
+
+	return deleted >= COMPACT_MIN && deleted > plist->not_deleted;
+}
+
+/* Remove deleted items from the list, except the item keep (if not -1),
+ * which is kept even if it's deleted.  Indexes of the items change, return
+ * the new index of the item keep or -1. */
+int plist_compact (struct plist *plist, const int keep)
+{
+	int i, n = 0, new_keep = -1;
+
+	assert (plist != NULL);
+	assert (keep == -1 || LIMIT(keep, plist->num));
+
+	for (i = 0; i < plist->num; i++) {
+		struct plist_item *item = &plist->items[i];
+
+		if (item->deleted && i != keep) {
+			plist_free_item_fields (item);
+			continue;
+		}
+
+		if (i == keep)
+			new_keep = n;
+		if (n != i)
+			plist->items[n] = *item;
+
+		n++;
 	}
 
-	return pos;
+	debug ("Compacted the list from %d to %d items", plist->num, n);
+
+	plist->num = n;
+	index_rebuild (plist);
+	live_rebuild (plist);
+
+	return new_keep;
 }
@@ -2,8 +2,7 @@
 #define PLAYLIST_H
 
 #include <sys/types.h>
-
-#include "rbtree.h"
+#include "hash_index.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -26,6 +25,7 @@ struct file_tags
 	int time;
 	int rating;
 	int filled; /* Which tags are filled: TAGS_COMMENTS, TAGS_TIME. */
+	int pooled; /* artist and album are from the string pool */
 };
 
 enum file_type
@@ -38,6 +38,13 @@ enum file_type
 	F_OTHER
 };
 
+/* How to sort a playlist. */
+enum plist_sort_by
+{
+	PLIST_SORT_FNAME,	/* by the file name */
+	PLIST_SORT_TAGS		/* by artist, album, track, title */
+};
+
 struct plist_item
 {
 	char *file;
@@ -50,6 +57,25 @@ struct plist_item
 	int queue_pos;		/* position in the queue */
 };
 
+/* Differences between two playlists as indexes of items. */
+struct plist_diff
+{
+	int *removed;		/* items of from missing in to */
+	int removed_num;
+	int *added;		/* items of to missing in from */
+	int added_num;
+	int *moved;		/* items of to in another order than in from */
+	int moved_num;
+};
+
+/* Point in the history of the server's playlist a copy of it is at: the
+ * server's playlist serial number and the number of changes made to it. */
+struct plist_sync
+{
+	int serial;
+	int version;		/* -1 if the copy is not in sync */
+};
+
 struct plist
 {
 	int num;			/* Number of elements on the list */
@@ -59,11 +85,14 @@ struct plist
 	int serial;		/* Optional serial number of this playlist */
 	int total_time;		/* Total time for files on the playlist */
 	int items_with_time;	/* Number of items for which the time is set. */
+	int type_count[F_OTHER + 1];	/* Non-deleted items of each type */
 
-	struct rb_tree *search_tree;
+	struct hash_index *search_index;	/* file name -> item */
+	int *live;		/* Fenwick tree counting non-deleted items */
 };
 
 void plist_init (struct plist *plist);
+void plist_reserve (struct plist *plist, const int count);
 int plist_add (struct plist *plist, const char *file_name);
 int plist_add_from_item (struct plist *plist, const struct plist_item *item);
 char *plist_get_file (const struct plist *plist, int i);
@@ -72,6 +101,7 @@ int plist_prev (struct plist *plist, int num);
 void plist_clear (struct plist *plist);
 void plist_delete (struct plist *plist, const int num);
 void plist_free (struct plist *plist);
+void plist_sort (struct plist *plist, const enum plist_sort_by by);
 void plist_sort_fname (struct plist *plist);
 int plist_find_fname (struct plist *plist, const char *file);
 struct file_tags *tags_new ();
@@ -96,8 +126,6 @@ void plist_set_item_rating (struct plist *plist, const int num, const int rating
 int get_item_time (const struct plist *plist, const int i);
 int get_item_rating (const struct plist *plist, const int i);
 int plist_total_time (const struct plist *plisti, int *all_files);
-void plist_shuffle (struct plist *plist);
-void plist_swap_first_fname (struct plist *plist, const char *fname);
 struct plist_item *plist_new_item ();
 void plist_free_item_fields (struct plist_item *item);
 void plist_set_serial (struct plist *plist, const int serial);
@@ -108,6 +136,9 @@ const char *plist_get_next_dead_entry (const struct plist *plist,
                                        int *last_index);
 void plist_item_copy (struct plist_item *dst, const struct plist_item *src);
 enum file_type plist_file_type (const struct plist *plist, const int num);
+void plist_diff (const struct plist *from, const struct plist *to,
+		struct plist_diff *diff);
+void plist_diff_free (struct plist_diff *diff);
 void plist_remove_common_items (struct plist *a, struct plist *b);
 void plist_discard_tags (struct plist *plist);
 void plist_set_tags (struct plist *plist, const int num,
@@ -116,6 +147,8 @@ struct file_tags *plist_get_tags (const struct plist *plist, const int num);
 void plist_swap_files (struct plist *plist, const char *file1,
 		const char *file2);
 int plist_get_position (const struct plist *plist, int num);
+int plist_needs_compact (const struct plist *plist);
+int plist_compact (struct plist *plist, const int keep);
 
 #ifdef __cplusplus
 }
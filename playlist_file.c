@@ -16,6 +16,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
@@ -23,6 +26,8 @@
 #include <errno.h>
 #include <assert.h>
 #include <libgen.h>
+#include <stdarg.h>
+#include <pthread.h>
 
 #define DEBUG
 
@@ -34,18 +39,181 @@
 #include "options.h"
 #include "interface.h"
 #include "decoder.h"
+#include "cue.h"
 
 int is_plist_file (const char *name)
 {
 	const char *ext = ext_pos (name);
 
-	if (ext && (!strcasecmp(ext, "m3u") || !strcasecmp(ext, "pls")))
+	if (ext && (!strcasecmp(ext, "m3u") || !strcasecmp(ext, "pls")
+	            || !strcasecmp(ext, "cue")))
 		return 1;
 
 	return 0;
 }
 
-static void make_path (char *buf, size_t buf_size, const char *cwd, char *path)
+/* The content of a playlist file in memory.  Lines are terminated in place
+ * while parsing, so the mapping is private and writable. */
+struct plist_text
+{
+	char *data;
+	size_t size;
+	bool mapped;	/* mmap()ed, otherwise malloc()ed */
+};
+
+/* Directory the relative paths of a playlist are resolved against. */
+struct plist_base
+{
+	char dir[2 * PATH_MAX];	/* resolved cwd */
+	size_t len;
+};
+
+/* Read the whole file into memory.  Return false on error. */
+static bool read_plist_text (struct plist_text *text, const char *fname)
+{
+	int fd;
+	struct stat st;
+	struct flock read_lock = {.l_type = F_RDLCK, .l_whence = SEEK_SET};
+
+	text->data = NULL;
+	text->size = 0;
+	text->mapped = false;
+
+	fd = open (fname, O_RDONLY);
+	if (fd == -1) {
+		error_errno ("Can't open playlist file", errno);
+		return false;
+	}
+
+	/* Lock gets released by close(). */
+	if (fcntl (fd, F_SETLKW, &read_lock) == -1)
+		log_errno ("Can't lock the playlist file", errno);
+
+	if (fstat (fd, &st) == -1) {
+		error_errno ("Can't stat playlist file", errno);
+		close (fd);
+		return false;
+	}
+	text->size = st.st_size;
+
+	/* The rest of the last page of a mapping reads as zeros, so the last
+	 * line is terminated unless the file fills the page exactly. */
+	if (text->size > 0 && text->size % sysconf (_SC_PAGESIZE)) {
+		text->data = mmap (NULL, text->size, PROT_READ | PROT_WRITE,
+		                   MAP_PRIVATE, fd, 0);
+		if (text->data != MAP_FAILED)
+			text->mapped = true;
+		else {
+			log_errno ("Can't mmap() the playlist file", errno);
+			text->data = NULL;
+		}
+	}
+
+	if (!text->mapped) {
+		size_t got = 0;
+
+		text->data = (char *)xmalloc (text->size + 1);
+		while (got < text->size) {
+			ssize_t res = read (fd, text->data + got, text->size - got);
+
+			if (res == -1 && errno == EINTR)
+				continue;
+			if (res <= 0) {
+				if (res == -1)
+					error_errno ("Can't read playlist file", errno);
+				break;
+			}
+			got += res;
+		}
+		text->size = got;
+		text->data[got] = 0;
+	}
+
+	close (fd);
+	return true;
+}
+
+static void free_plist_text (struct plist_text *text)
+{
+	if (text->mapped)
+		munmap (text->data, text->size);
+	else
+		free (text->data);
+}
+
+/* Return the next line of the text starting at *pos and move *pos past it.
+ * The line is terminated in place with end of line chars stripped.  Return
+ * NULL at the end of the text. */
+static char *next_line (struct plist_text *text, size_t *pos)
+{
+	char *line, *end;
+
+	if (*pos >= text->size)
+		return NULL;
+
+	line = text->data + *pos;
+	end = memchr (line, '\n', text->size - *pos);
+	if (end)
+		*pos = end - text->data + 1;
+	else {
+		end = text->data + text->size;
+		*pos = text->size;
+	}
+
+	*end = 0;
+	if (end > line && end[-1] == '\r')
+		end[-1] = 0;
+
+	return line;
+}
+
+/* Return the number of lines of the text not starting with c. */
+static int count_lines_without (const struct plist_text *text, const char c)
+{
+	const char *line = text->data;
+	const char *end = text->data + text->size;
+	int count = 0;
+
+	while (line < end) {
+		const char *eol = memchr (line, '\n', end - line);
+
+		if (*line != c)
+			count += 1;
+		line = eol ? eol + 1 : end;
+	}
+
+	return count;
+}
+
+static void make_base (struct plist_base *base, const char *cwd)
+{
+	strcpy (base->dir, "/");
+	resolve_path (base->dir, sizeof(base->dir), cwd);
+	base->len = strlen (base->dir);
+}
+
+/* Return true if the path has no empty, '.' or '..' elements, so resolving
+ * it changes nothing. */
+static bool is_plain_path (const char *path)
+{
+	const char *c = path[0] == '/' ? path + 1 : path;
+
+	do {
+		const char *slash = strchr (c, '/');
+		size_t len = slash ? (size_t)(slash - c) : strlen (c);
+
+		if (len == 0 || (c[0] == '.'
+		                 && (len == 1 || (len == 2 && c[1] == '.'))))
+			return false;
+
+		c = slash ? slash + 1 : NULL;
+	} while (c);
+
+	return true;
+}
+
+static void make_path (char *buf, size_t buf_size,
+		const struct plist_base *base, char *path)
 {
 	if (file_type(path) == F_URL) {
 		strncpy (buf, path, buf_size);
@@ -53,8 +221,27 @@ static void make_path (char *buf, size_t buf_size, const char *cwd, char *path)
 		return;
 	}
 
+	/* Most entries just need the base prepended. */
+	if (is_plain_path (path)) {
+		size_t len = strlen (path);
+
+		if (path[0] == '/' && len < buf_size) {
+			memcpy (buf, path, len + 1);
+			return;
+		}
+
+		if (path[0] != '/' && base->len + len + 1 < buf_size) {
+			size_t dir_len = base->len > 1 ? base->len : 0;
+
+			memcpy (buf, base->dir, dir_len);
+			buf[dir_len] = '/';
+			memcpy (buf + dir_len + 1, path, len + 1);
+			return;
+		}
+	}
+
 	if (path[0] != '/')
-		strcpy (buf, cwd);
+		strcpy (buf, base->dir);
 	else
 		strcpy (buf, "/");
 
@@ -81,26 +268,25 @@ static void strip_string (char *str)
 static int plist_load_m3u (struct plist *plist, const char *fname,
 		const char *cwd, const int load_serial)
 {
-	FILE *file;
-	char *line = NULL;
+	struct plist_text text;
+	struct plist_base base;
+	size_t pos = 0;
+	char *line;
 	int last_added = -1;
 	int after_extinf = 0;
 	int added = 0;
-	struct flock read_lock = {.l_type = F_RDLCK, .l_whence = SEEK_SET};
+	bool save_tags;
 
-	file = fopen (fname, "r");
-	if (!file) {
-		error_errno ("Can't open playlist file", errno);
+	if (!read_plist_text (&text, fname))
 		return 0;
-	}
 
-	/* Lock gets released by fclose(). */
-	if (fcntl (fileno (file), F_SETLKW, &read_lock) == -1)
-		log_errno ("Can't lock the playlist file", errno);
+	make_base (&base, cwd);
+	save_tags = options_get_bool ("SavePlaylistTags");
+	plist_reserve (plist, count_lines_without (&text, '#'));
 
-	while ((line = read_line (file))) {
+	while ((line = next_line (&text, &pos))) {
 		if (!strncmp (line, "#EXTINF:", sizeof("#EXTINF:") - 1)) {
-			if (!options_get_bool ("SavePlaylistTags")) continue;
+			if (!save_tags) continue;
 
 			char *comma, *num_err;
 			char time_text[10] = "";
@@ -148,7 +334,7 @@ static int plist_load_m3u (struct plist *plist, const char *fname,
 
 			strip_string (line);
 			if (strlen (line) <= PATH_MAX) {
-				make_path (path, sizeof(path), cwd, line);
+				make_path (path, sizeof(path), &base, line);
 
 				if (plist_find_fname (plist, path) == -1) {
 					if (after_extinf)
@@ -180,12 +366,10 @@ static int plist_load_m3u (struct plist *plist, const char *fname,
 				}
 			}
 		}
-		free (line);
 	}
 
 err:
-	free (line);
-	fclose (file);
+	free_plist_text (&text);
 	return added;
 }
 
@@ -200,53 +384,73 @@ static int is_blank_line (const char *l)
 	return 1;
 }
 
-/* Read a value from the given section from .INI file.  File should be opened
- * and seeking will be performed on it.  Return the malloc()ed value or NULL
- * if not present or error occurred. */
-static char *read_ini_value (FILE *file, const char *section, const char *key)
+/* Entry of a PLS file, the values point into the text of the file. */
+struct pls_entry
 {
-	char *line = NULL;
-	int in_section = 0;
-	char *value = NULL;
-	int key_len;
+	char *file;
+	char *title;
+	char *length;
+};
+
+/* If the name is prefix followed by a number from 1 to max, return the
+ * number, otherwise return 0. */
+static long pls_key_number (const char *name, const size_t name_len,
+		const char *prefix, const long max)
+{
+	size_t prefix_len = strlen (prefix);
+	long num = 0;
+	size_t i;
 
-	if (fseek(file, 0, SEEK_SET)) {
-		error_errno ("File fseek() error", errno);
-		return NULL;
+	if (name_len <= prefix_len || strncasecmp (name, prefix, prefix_len))
+		return 0;
+
+	for (i = prefix_len; i < name_len; i++) {
+		if (!isdigit (name[i]) || num > max)
+			return 0;
+		num = num * 10 + name[i] - '0';
 	}
 
-	key_len = strlen (key);
+	return num <= max ? num : 0;
+}
+
+/* Read the [playlist] section of the PLS text in one pass.  Fill entries
+ * (there is room for max of them) with the first value of each FileN,
+ * TitleN and LengthN key and return the value of NumberOfEntries or NULL
+ * if it's not present. */
+static char *read_pls_section (struct plist_text *text,
+		struct pls_entry *entries, const long max)
+{
+	size_t pos = 0;
+	char *line;
+	int in_section = 0;
+	char *nitems = NULL;
 
-	while ((line = read_line(file))) {
+	while ((line = next_line (text, &pos))) {
 		if (line[0] == '[') {
-			if (in_section) {
+			char *close;
 
-				/* we are outside of the interesting section */
-				free (line);
+			/* we are outside of the interesting section */
+			if (in_section)
 				break;
-			}
-			else {
-				char *close = strchr (line, ']');
-
-				if (!close) {
-					error ("Parse error in the INI file");
-					free (line);
-					break;
-				}
 
-				if (!strncasecmp(line + 1, section,
-							close - line - 1))
-					in_section = 1;
+			close = strchr (line, ']');
+			if (!close) {
+				error ("Parse error in the INI file");
+				break;
 			}
+
+			if (!strncasecmp(line + 1, "playlist", close - line - 1))
+				in_section = 1;
 		}
 		else if (in_section && line[0] != '#' && !is_blank_line(line)) {
-			char *t, *t2;
+			char *t, *t2, *value, **slot = NULL;
+			size_t name_len;
+			long num;
 
 			t2 = t = strchr (line, '=');
 
 			if (!t) {
 				error ("Parse error in the INI file");
-				free (line);
 				break;
 			}
 
@@ -256,61 +460,69 @@ static char *read_ini_value (FILE *file, const char *section, const char *key)
 
 			if (t2 == t) {
 				error ("Parse error in the INI file");
-				free (line);
 				break;
 			}
 
-			if (!strncasecmp(line, key,
-						MAX(t2 - line + 1, key_len))) {
-				value = t + 1;
+			value = t + 1;
+			while (isblank(value[0]))
+				value++;
 
-				while (isblank(value[0]))
-					value++;
+			if (value[0] == '"') {
+				char *q = strchr (value + 1, '"');
 
-				if (value[0] == '"') {
-					char *q = strchr (value + 1, '"');
-
-					if (!q) {
-						error ("Parse error in the INI file");
-						free (line);
-						break;
-					}
-
-					*q = 0;
+				if (!q) {
+					error ("Parse error in the INI file");
+					break;
 				}
 
-				value = xstrdup (value);
-				free (line);
-				break;
+				*q = 0;
 			}
-		}
 
-		free (line);
+			name_len = t2 - line + 1;
+			if (name_len == sizeof("NumberOfEntries") - 1
+			    && !strncasecmp (line, "NumberOfEntries", name_len))
+				slot = &nitems;
+			else if ((num = pls_key_number (line, name_len, "File", max)))
+				slot = &entries[num - 1].file;
+			else if ((num = pls_key_number (line, name_len, "Title", max)))
+				slot = &entries[num - 1].title;
+			else if ((num = pls_key_number (line, name_len, "Length", max)))
+				slot = &entries[num - 1].length;
+
+			if (slot && !*slot)
+				*slot = value;
+		}
 	}
 
-	return value;
+	return nitems;
 }
 
 /* Load PLS file into plist. Return the number of items read. */
 static int plist_load_pls (struct plist *plist, const char *fname,
 		const char *cwd)
 {
-	FILE *file;
-	char *e, *line = NULL;
-	long i, nitems, added = 0;
+	struct plist_text text;
+	struct plist_base base;
+	struct pls_entry *entries;
+	char *e, *line;
+	long i, max, nitems, added = 0;
 
-	file = fopen (fname, "r");
-	if (!file) {
-		error_errno ("Can't open playlist file", errno);
+	if (!read_plist_text (&text, fname))
 		return 0;
-	}
 
-	line = read_ini_value (file, "playlist", "NumberOfEntries");
+	/* Each entry needs its own FileN line, so there can't be more
+	 * entries than lines. */
+	max = count_lines_without (&text, '\n');
+	entries = (struct pls_entry *)xcalloc (MAX(max, 1),
+			sizeof(struct pls_entry));
+
+	line = read_pls_section (&text, entries, max);
 	if (!line) {
 
 		/* Assume that it is a pls file version 1 - plist_load_m3u()
 		 * should handle it like an m3u file without the m3u extensions. */
-		fclose (file);
+		free (entries);
+		free_plist_text (&text);
 		return plist_load_m3u (plist, fname, cwd, 0);
 	}
 
@@ -320,23 +532,22 @@ static int plist_load_pls (struct plist *plist, const char *fname,
 		goto err;
 	}
 
+	make_base (&base, cwd);
+	plist_reserve (plist, MIN(nitems, max));
+
 	for (i = 1; i <= nitems; i++) {
 		int time, last_added;
 		char *pls_file, *pls_title, *pls_length;
-		char key[32], path[2 * PATH_MAX];
+		char path[2 * PATH_MAX];
 
-		sprintf (key, "File%ld", i);
-		pls_file = read_ini_value (file, "playlist", key);
+		pls_file = i <= max ? entries[i - 1].file : NULL;
 		if (!pls_file) {
 			error ("Broken PLS file");
 			goto err;
 		}
 
-		sprintf (key, "Title%ld", i);
-		pls_title = read_ini_value (file, "playlist", key);
-
-		sprintf (key, "Length%ld", i);
-		pls_length = read_ini_value (file, "playlist", key);
+		pls_title = entries[i - 1].title;
+		pls_length = entries[i - 1].length;
 
 		if (pls_length) {
 			time = strtol (pls_length, &e, 10);
@@ -347,35 +558,72 @@ static int plist_load_pls (struct plist *plist, const char *fname,
 			time = -1;
 
 		if (strlen (pls_file) <= PATH_MAX) {
-			make_path (path, sizeof(path), cwd, pls_file);
+			make_path (path, sizeof(path), &base, pls_file);
 			if (plist_find_fname (plist, path) == -1) {
 				last_added = plist_add (plist, path);
 
 				if (pls_title && pls_title[0])
 					plist_set_title_tags (plist, last_added, pls_title);
 
-				if (time > 0) {
-					plist->items[last_added].tags = tags_new ();
-					plist->items[last_added].tags->time = time;
-					plist->items[last_added].tags->filled |= TAGS_TIME;
-				}
+				if (time > 0)
+					plist_set_item_time (plist, last_added, time);
 			}
 		}
 
-		free (pls_file);
-		if (pls_title)
-			free (pls_title);
-		if (pls_length)
-			free (pls_length);
 		added += 1;
 	}
 
 err:
-	free (line);
-	fclose (file);
+	free (entries);
+	free_plist_text (&text);
 	return added;
 }
 
+/* Load the tracks of a CUE sheet as the virtual files of its tracks.
+ * Return the number of items read. */
+static int plist_load_cue (struct plist *plist, const char *fname,
+		const char *cwd)
+{
+	struct plist_base base;
+	struct cue_sheet *sheet;
+	char path[2 * PATH_MAX];
+	char *name;
+	int ix;
+
+	make_base (&base, cwd);
+	name = xstrdup (fname);
+	make_path (path, sizeof(path), &base, name);
+	free (name);
+
+	sheet = cue_read (path);
+	if (!sheet) {
+		error ("Can't read the CUE sheet %s", fname);
+		return 0;
+	}
+
+	plist_reserve (plist, sheet->num);
+	for (ix = 0; ix < sheet->num; ix++) {
+		const struct cue_track *track = &sheet->tracks[ix];
+		char *name = cue_track_name (path, track->number);
+
+		if (plist_find_fname (plist, name) == -1) {
+			int num = plist_add (plist, name);
+
+			if (track->title)
+				plist_set_title_tags (plist, num, track->title);
+			if (track->end != -1)
+				plist_set_item_time (plist, num,
+				        (track->end - track->start) / CUE_FRAMES);
+		}
+		free (name);
+	}
+
+	ix = sheet->num;
+	cue_free (sheet);
+
+	return ix;
+}
+
 /* Load a playlist into plist. Return the number of items on the list. */
 /* The playlist may have deleted items. */
 int plist_load (struct plist *plist, const char *fname, const char *cwd,
@@ -389,6 +637,8 @@ int plist_load (struct plist *plist, const char *fname, const char *cwd,
 
 	if (ext && !strcasecmp(ext, "pls"))
 		num = plist_load_pls (plist, fname, cwd);
+	else if (ext && !strcasecmp(ext, "cue"))
+		num = plist_load_cue (plist, fname, cwd);
 	else
 		num = plist_load_m3u (plist, fname, cwd, load_serial);
 
@@ -400,93 +650,370 @@ int plist_load (struct plist *plist, const char *fname, const char *cwd,
 	return num;
 }
 
-/* Save plist in m3u format. Strip paths by strip_path bytes.
- * If save_serial is not 0, the playlist serial is saved in a
- * comment. */
-static int plist_save_m3u (struct plist *plist, const char *fname,
-		const int strip_path, const int save_serial, const bool save_tags)
+/* The snapshot is a binary dump of a playlist saved next to the playlist
+ * file it was made from.  It is only used while that file is unchanged, and
+ * it keeps the tags and modification times of the items so the playlist
+ * comes back without asking the server for the tags again.  It also records
+ * which version of the server's playlist it was in sync with, so a client
+ * can ask only for the changes made since.  The format is private to this
+ * machine: fields are stored in the host byte order. */
+
+#define SNAPSHOT_MAGIC		"MOCPLSN"
+#define SNAPSHOT_VERSION	2
+
+struct snapshot_header
+{
+	char magic[8];
+	int32_t version;
+	int32_t serial;
+	int64_t source_mtime;	/* of the playlist file */
+	int64_t source_size;
+	int32_t count;		/* number of items */
+	int32_t sync_serial;	/* see struct plist_sync */
+	int32_t sync_version;
+};
+
+/* Item record, followed by the strings: file, title_tags and if has_tags
+ * is set title, artist and album. */
+struct snapshot_item
+{
+	int64_t mtime;
+	int32_t type;
+	int32_t has_tags;
+	int32_t filled;
+	int32_t time;
+	int32_t track;
+	int32_t rating;
+};
+
+struct snapshot_reader
 {
-	FILE *file = NULL;
-	int i, ret, result = 0;
-	struct flock write_lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+	char *pos;
+	char *end;
+};
 
-	debug ("Saving playlist to '%s'", fname);
+static bool snapshot_get (struct snapshot_reader *r, void *buf,
+		const size_t size)
+{
+	if ((size_t)(r->end - r->pos) < size)
+		return false;
 
-	file = fopen (fname, "w");
-	if (!file) {
-		error_errno ("Can't save playlist", errno);
-		return 0;
+	memcpy (buf, r->pos, size);
+	r->pos += size;
+
+	return true;
+}
+
+/* Get the string pointing into the snapshot data. */
+static bool snapshot_get_str (struct snapshot_reader *r, char **str)
+{
+	uint32_t size;
+
+	if (!snapshot_get (r, &size, sizeof(size)))
+		return false;
+
+	if (size == 0) {
+		*str = NULL;
+		return true;
 	}
 
-	/* Lock gets released by fclose(). */
-	if (fcntl (fileno (file), F_SETLKW, &write_lock) == -1)
-		log_errno ("Can't lock the playlist file", errno);
+	if ((size_t)(r->end - r->pos) < size || r->pos[size - 1])
+		return false;
 
-	if (options_get_bool ("SavePlaylistTags"))
-		if (fprintf (file, "#EXTM3U\r\n") < 0) {
-			error_errno ("Error writing playlist", errno);
-			goto err;
-		}
+	*str = r->pos;
+	r->pos += size;
 
-	if (save_serial && fprintf (file, "#MOCSERIAL: %d\r\n",
-	                                  plist_get_serial (plist)) < 0) {
-		error_errno ("Error writing playlist", errno);
-		goto err;
+	return true;
+}
+
+/* A buffer the playlist is formatted into before it is written. */
+struct save_buf
+{
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/* Saving of a playlist: the files are formatted in memory and written by
+ * save_job_run(), on the saving thread or not. */
+struct save_job
+{
+	char *fname;
+	struct save_buf text;		/* the m3u file */
+	char *snapshot;			/* snapshot file name or NULL */
+	struct save_buf snap;		/* the snapshot, the source fields of
+					   its header are filled in when the
+					   m3u file is written */
+	int error;			/* errno of the failure to write the
+					   playlist, 0 if none */
+};
+
+/* The save running on the saving thread, NULL if none. */
+static struct save_job *running_save = NULL;
+static pthread_t save_thread;
+
+static void save_buf_add (struct save_buf *b, const void *data,
+		const size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = MAX(2 * b->size, b->len + len + 64 * 1024);
+		b->data = (char *)xrealloc (b->data, b->size);
+	}
+
+	memcpy (b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void save_buf_printf (struct save_buf *b, const char *format, ...)
+	ATTR_PRINTF(2, 3);
+
+static void save_buf_printf (struct save_buf *b, const char *format, ...)
+{
+	va_list va;
+	int len;
+
+	va_start (va, format);
+	len = vsnprintf (b->data + b->len, b->size - b->len, format, va);
+	va_end (va);
+
+	if ((size_t)len >= b->size - b->len) {
+		b->size = MAX(2 * b->size, b->len + len + 64 * 1024);
+		b->data = (char *)xrealloc (b->data, b->size);
+
+		va_start (va, format);
+		vsnprintf (b->data + b->len, b->size - b->len, format, va);
+		va_end (va);
+	}
+
+	b->len += len;
+}
+
+/* Add the string as its size including the terminating zero followed by
+ * the characters, NULL is added as size 0. */
+static void snapshot_put_str (struct save_buf *b, const char *str)
+{
+	uint32_t size = str ? strlen (str) + 1 : 0;
+
+	save_buf_add (b, &size, sizeof(size));
+	if (size)
+		save_buf_add (b, str, size);
+}
+
+/* Format the playlist in m3u format, stripping strip_path bytes of the
+ * paths.  If save_serial is not 0, the playlist serial is saved in a
+ * comment.  If snap is not NULL, format the snapshot of the playlist in the
+ * same pass, with sync (may be NULL) as the version of the server's
+ * playlist it is in sync with. */
+static void format_plist (const struct plist *plist, struct save_buf *text,
+		const int strip_path, const int save_serial, const bool save_tags,
+		struct save_buf *snap, const struct plist_sync *sync)
+{
+	int i;
+
+	if (options_get_bool ("SavePlaylistTags"))
+		save_buf_printf (text, "#EXTM3U\r\n");
+	if (save_serial)
+		save_buf_printf (text, "#MOCSERIAL: %d\r\n",
+		                 plist_get_serial (plist));
+
+	if (snap) {
+		struct snapshot_header header;
+
+		memset (&header, 0, sizeof(header));
+		strcpy (header.magic, SNAPSHOT_MAGIC);
+		header.version = SNAPSHOT_VERSION;
+		header.serial = plist_get_serial (plist);
+		header.count = plist_count (plist);
+		header.sync_serial = sync ? sync->serial : -1;
+		header.sync_version = sync ? sync->version : -1;
+		save_buf_add (snap, &header, sizeof(header));
 	}
 
 	for (i = 0; i < plist->num; i++) {
-		if (!plist_deleted (plist, i)) {
-
-			/* EXTM3U */
-			if (save_tags) {
-				if (plist->items[i].tags)
-					ret = fprintf (file, "#EXTINF:%d,%s\r\n",
-							plist->items[i].tags->time,
-							plist->items[i].title_tags ?
-							plist->items[i].title_tags
-							: plist->items[i].title_file);
-				else
-					ret = fprintf (file, "#EXTINF:%d,%s\r\n", 0,
-							plist->items[i].title_file);
+		const struct plist_item *item = &plist->items[i];
+
+		if (item->deleted)
+			continue;
+
+		/* EXTM3U */
+		if (save_tags)
+			save_buf_printf (text, "#EXTINF:%d,%s\r\n",
+			                 item->tags ? item->tags->time : 0,
+			                 item->tags && item->title_tags
+			                 ? item->title_tags : item->title_file);
+
+		save_buf_printf (text, "%s\r\n", item->file + strip_path);
+
+		if (snap) {
+			struct snapshot_item rec;
+
+			memset (&rec, 0, sizeof(rec));
+			rec.mtime = item->mtime;
+			rec.type = item->type;
+			rec.has_tags = item->tags != NULL;
+			if (item->tags) {
+				rec.filled = item->tags->filled;
+				rec.time = item->tags->time;
+				rec.track = item->tags->track;
+				rec.rating = item->tags->rating;
 			}
-			else
-				ret = 17;
-
-			/* file */
-			if (ret >= 0)
-				ret = fprintf (file, "%s\r\n",
-				                     plist->items[i].file + strip_path);
 
-			if (ret < 0) {
-				error_errno ("Error writing playlist", errno);
-				goto err;
+			save_buf_add (snap, &rec, sizeof(rec));
+			snapshot_put_str (snap, item->file);
+			snapshot_put_str (snap, item->title_tags);
+			if (item->tags) {
+				snapshot_put_str (snap, item->tags->title);
+				snapshot_put_str (snap, item->tags->artist);
+				snapshot_put_str (snap, item->tags->album);
 			}
 		}
 	}
+}
+
+/* Write the data to a new file next to fname and rename it to fname, so
+ * that fname is never seen half written.  If fname is a symlink, the file
+ * it points to is replaced.  An existing file keeps its permissions, a new
+ * one gets those open() gives.  Return false on error with errno set. */
+static bool write_atomically (const char *fname, const struct save_buf *b)
+{
+	char *target, *tmp;
+	struct stat st;
+	bool existed;
+	size_t pos = 0;
+	int fd, err, n = 0;
+
+	target = realpath (fname, NULL);
+	if (!target)
+		target = xstrdup (fname);
+	existed = stat (target, &st) == 0;
+
+	do {
+		tmp = format_msg ("%s.%d.%d", target, (int)getpid (), n++);
+		fd = open (tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd == -1)
+			free (tmp);
+	} while (fd == -1 && errno == EEXIST);
+
+	if (fd == -1) {
+		err = errno;
+		free (target);
+		errno = err;
+		return false;
+	}
 
-	ret = fclose (file);
-	file = NULL;
-	if (ret)
-		error_errno ("Error writing playlist", errno);
-	else
-		result = 1;
+	while (pos < b->len) {
+		ssize_t res = write (fd, b->data + pos, b->len - pos);
+
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res == -1)
+			goto err;
+		pos += res;
+	}
+
+	if ((existed && fchmod (fd, st.st_mode & 07777) == -1)
+			|| fsync (fd) == -1)
+		goto err;
+	if (close (fd) == -1) {
+		fd = -1;
+		goto err;
+	}
+	fd = -1;
+
+	if (rename (tmp, target) == -1)
+		goto err;
+
+	free (tmp);
+	free (target);
+	return true;
 
 err:
-	if (file)
-		fclose (file);
+	err = errno;
+	if (fd != -1)
+		close (fd);
+	unlink (tmp);
+	free (tmp);
+	free (target);
+	errno = err;
+	return false;
+}
+
+/* Write the files of the save. */
+static void save_job_run (struct save_job *job)
+{
+	struct snapshot_header *header;
+	struct stat st;
+
+	debug ("Saving playlist to '%s'", job->fname);
+
+	if (!write_atomically (job->fname, &job->text)) {
+		job->error = errno;
+		if (job->snapshot)
+			unlink (job->snapshot);
+		return;
+	}
+
+	if (!job->snapshot)
+		return;
+
+	/* The snapshot is valid only for this version of the file. */
+	if (stat (job->fname, &st) == -1) {
+		log_errno ("Can't stat the playlist file", errno);
+		unlink (job->snapshot);
+		return;
+	}
+
+	header = (struct snapshot_header *)job->snap.data;
+	header->source_mtime = st.st_mtime;
+	header->source_size = st.st_size;
+
+	if (!write_atomically (job->snapshot, &job->snap))
+		log_errno ("Can't save the playlist snapshot", errno);
+}
+
+static void *save_thread_fn (void *arg)
+{
+	save_job_run ((struct save_job *)arg);
+
+	return NULL;
+}
+
+/* Free the save and return its result, reporting the error if report is
+ * set. */
+static int save_job_finish (struct save_job *job, const bool report)
+{
+	int result = job->error == 0;
+
+	if (!result) {
+		if (report)
+			error_errno ("Can't save playlist", job->error);
+		else
+			log_errno ("Can't save playlist", job->error);
+	}
+
+	free (job->fname);
+	free (job->snapshot);
+	free (job->text.data);
+	free (job->snap.data);
+	free (job);
+
 	return result;
 }
 
-/* Save the playlist into the file. Return 0 on error. If cwd is NULL, use
- * absolute paths. */
-int plist_save (struct plist *plist, const char *file, const int save_serial, const bool save_tags)
+/* Prepare the save of the playlist into the file, and of its snapshot if
+ * snapshot is not NULL.  Use paths relative to the file's directory if
+ * SaveRelativePlaylists is set and all items are under it. */
+static struct save_job *save_job_new (const struct plist *plist,
+		const char *file, const int save_serial, const bool save_tags,
+		const char *snapshot, const struct plist_sync *sync)
 {
+	struct save_job *job;
 	int offset = 0;
-	char *dir,*file_copy;
 
 	debug("TG: saving playlist %s", file);
 
 	if (options_get_bool("SaveRelativePlaylists")) {
+		char *dir, *file_copy;
 		int i;
 
 		file_copy = xstrdup(file);
@@ -508,5 +1035,164 @@ int plist_save (struct plist *plist, const char *file, const int save_serial, co
 		free(file_copy);
 	}
 
-	return plist_save_m3u (plist, file, offset, save_serial, save_tags);
+	job = (struct save_job *)xcalloc (1, sizeof(struct save_job));
+	job->fname = xstrdup (file);
+	job->snapshot = xstrdup (snapshot);
+
+	format_plist (plist, &job->text, offset, save_serial, save_tags,
+	              snapshot ? &job->snap : NULL, sync);
+
+	return job;
+}
+
+/* Save the playlist into the file. Return 0 on error. */
+int plist_save (struct plist *plist, const char *file, const int save_serial, const bool save_tags)
+{
+	struct save_job *job;
+
+	plist_save_wait ();
+
+	job = save_job_new (plist, file, save_serial, save_tags, NULL, NULL);
+	save_job_run (job);
+
+	return save_job_finish (job, true);
+}
+
+/* Start saving the playlist into the file, and its snapshot into snapshot
+ * (sync, which may be NULL, is the version of the server's playlist it is
+ * in sync with).  The files are written by a thread, from a copy made now,
+ * while the caller goes on; plist_save_wait() waits for them. */
+void plist_save_start (const struct plist *plist, const char *file,
+		const int save_serial, const bool save_tags, const char *snapshot,
+		const struct plist_sync *sync)
+{
+	struct save_job *job;
+	int rc;
+
+	plist_save_wait ();
+
+	job = save_job_new (plist, file, save_serial, save_tags, snapshot,
+	                    sync);
+
+	rc = pthread_create (&save_thread, NULL, save_thread_fn, job);
+	if (rc != 0) {
+		log_errno ("Can't create the playlist saving thread", rc);
+		save_job_run (job);
+		save_job_finish (job, false);
+		return;
+	}
+
+	running_save = job;
+}
+
+/* Wait for the save started by plist_save_start() to finish.  Return 0 if
+ * it failed (the error is logged). */
+int plist_save_wait ()
+{
+	struct save_job *job = running_save;
+
+	if (!job)
+		return 1;
+
+	pthread_join (save_thread, NULL);
+	running_save = NULL;
+
+	return save_job_finish (job, false);
+}
+
+/* Load the snapshot from fname into the empty plist if it was made from
+ * the current content of the source playlist file.  The items keep their
+ * saved modification times, checking them is left to the caller.  If sync
+ * is not NULL, it gets the version of the server's playlist the snapshot
+ * was in sync with.  Return the number of items or -1 if there is no valid
+ * snapshot. */
+int plist_load_snapshot (struct plist *plist, const char *fname,
+		const char *source, struct plist_sync *sync)
+{
+	struct plist_text text;
+	struct snapshot_reader r;
+	struct snapshot_header header;
+	struct stat st;
+	int i;
+
+	assert (plist_count (plist) == 0);
+
+	if (stat (source, &st) == -1 || !file_exists (fname))
+		return -1;
+
+	if (!read_plist_text (&text, fname))
+		return -1;
+
+	r.pos = text.data;
+	r.end = text.data + text.size;
+
+	if (!snapshot_get (&r, &header, sizeof(header))
+			|| memcmp (header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))
+			|| header.version != SNAPSHOT_VERSION
+			|| header.source_mtime != st.st_mtime
+			|| header.source_size != st.st_size
+			|| header.count < 0) {
+		logit ("Playlist snapshot is out of date");
+		free_plist_text (&text);
+		return -1;
+	}
+
+	plist_reserve (plist, header.count);
+
+	for (i = 0; i < header.count; i++) {
+		struct snapshot_item rec;
+		struct plist_item item;
+		struct file_tags tags;
+
+		if (!snapshot_get (&r, &rec, sizeof(rec))
+				|| !snapshot_get_str (&r, &item.file)
+				|| !snapshot_get_str (&r, &item.title_tags)
+				|| !item.file || !LIMIT(rec.type, F_OTHER + 1))
+			break;
+
+		item.type = rec.type;
+		item.deleted = 0;
+		item.title_file = NULL;
+		item.mtime = rec.mtime;
+		item.queue_pos = 0;
+		item.tags = NULL;
+
+		if (rec.has_tags) {
+			if (!snapshot_get_str (&r, &tags.title)
+					|| !snapshot_get_str (&r, &tags.artist)
+					|| !snapshot_get_str (&r, &tags.album))
+				break;
+
+			tags.track = rec.track;
+			tags.time = rec.time;
+			tags.rating = rec.rating;
+			tags.filled = rec.filled;
+			tags.pooled = 0;
+			item.tags = &tags;
+		}
+
+		if (plist_find_fname (plist, item.file) == -1)
+			plist_add_from_item (plist, &item);
+	}
+
+	free_plist_text (&text);
+
+	if (i < header.count) {
+		logit ("Broken playlist snapshot");
+		plist_clear (plist);
+		return -1;
+	}
+
+	plist_set_serial (plist, header.serial);
+	if (sync) {
+		sync->serial = header.sync_serial;
+		sync->version = header.sync_version;
+	}
+
+	if (options_get_bool ("ReadTags"))
+		switch_titles_tags (plist);
+	else
+		switch_titles_file (plist);
+
+	return plist_count (plist);
 }
@@ -9,6 +9,12 @@ int plist_load (struct plist *plist, const char *fname, const char *cwd,
 		const int load_serial);
 int plist_save (struct plist *plist, const char *file, const int save_serial, const bool save_tags);
 int is_plist_file (const char *name);
+void plist_save_start (const struct plist *plist, const char *file,
+		const int save_serial, const bool save_tags, const char *snapshot,
+		const struct plist_sync *sync);
+int plist_save_wait ();
+int plist_load_snapshot (struct plist *plist, const char *fname,
+		const char *source, struct plist_sync *sync);
 
 #ifdef __cplusplus
 }
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <assert.h>
 #include <unistd.h>
@@ -50,6 +51,24 @@
 			        xstrerror (errno)); \
 	} while (0)
 
+/* Playlists are sent in chunks of at least this size (except the last
+ * one).  A chunk is the length of the data and the number of items in it
+ * followed by the items; a chunk with no data ends the playlist. */
+#define PLIST_CHUNK_SIZE	(64 * 1024)
+
+/* Events are sent in packets of about this size at most. */
+#define EVENT_SEND_MAX		(64 * 1024)
+
+/* The largest chunk accepted: one item with strings of the maximal length
+ * can be added to an almost full chunk. */
+#define PLIST_CHUNK_MAX		(PLIST_CHUNK_SIZE + 8 * (MAX_SEND_STRING + 8))
+
+/* Size of the receive buffer of a socket. */
+#define RECV_BUF_SIZE		(8 * 1024)
+
+/* Size of a block of the arena for the received strings. */
+#define ARENA_BLOCK_SIZE	(2 * (MAX_SEND_STRING + 1))
+
 /* Buffer used to send data in one bigger chunk instead of sending sigle
  * integer, string etc. values. */
 struct packet_buf
@@ -59,6 +78,30 @@ struct packet_buf
 	size_t len;
 };
 
+/* Data received from a socket and not used yet.  Each recv() reads as much
+ * as there is, so a message usually takes one system call to get.  Strings
+ * of the message being handled can be put in the arena, which is reset
+ * when the message is done. */
+struct recv_buf
+{
+	char buf[RECV_BUF_SIZE];
+	size_t pos;		/* the first byte not used yet */
+	size_t len;		/* the end of the received data */
+	struct arena_block *arena; /* the current block first */
+};
+
+/* Every string of the protocol fits in a block. */
+struct arena_block
+{
+	struct arena_block *next;
+	size_t used;
+	char data[ARENA_BLOCK_SIZE];
+};
+
+/* Receive buffers indexed by the socket descriptor. */
+static struct recv_buf **recv_bufs = NULL;
+static int recv_bufs_num = 0;
+
 /* Create a socket name, return NULL if the name could not be created. */
 char *socket_name ()
 {
@@ -70,28 +113,208 @@ char *socket_name ()
 	return socket_name;
 }
 
-/* Get an integer value from the socket, return == 0 on error. */
-int get_int (int sock, int *i)
+/* Return the receive buffer of the socket, create it if needed.  The
+ * buffers are not locked: a socket is read only by one thread. */
+static struct recv_buf *recv_buf_get (const int sock)
 {
-	ssize_t res;
+	assert (sock >= 0);
 
-	res = recv (sock, i, sizeof(int), 0);
-	if (res == -1)
-		log_errno ("recv() failed when getting int", errno);
+	if (sock >= recv_bufs_num) {
+		int num = MAX(sock + 1, MAX(recv_bufs_num * 2, 16));
 
-	return res == ssizeof(int) ? 1 : 0;
+		recv_bufs = (struct recv_buf **)xrealloc_tag (recv_bufs,
+				sizeof(struct recv_buf *) * num, MEM_PROTOCOL);
+		memset (recv_bufs + recv_bufs_num, 0,
+				sizeof(struct recv_buf *) * (num - recv_bufs_num));
+		recv_bufs_num = num;
+	}
+
+	if (!recv_bufs[sock])
+		recv_bufs[sock] = (struct recv_buf *)xcalloc_tag (1,
+				sizeof(struct recv_buf), MEM_PROTOCOL);
+
+	return recv_bufs[sock];
+}
+
+/* Move the data not used yet to the beginning of the buffer. */
+static void recv_buf_compact (struct recv_buf *rb)
+{
+	if (rb->pos) {
+		memmove (rb->buf, rb->buf + rb->pos, rb->len - rb->pos);
+		rb->len -= rb->pos;
+		rb->pos = 0;
+	}
+}
+
+/* Make at least size bytes available in the buffer reading as much as
+ * there is in the socket.  Return 0 on error or EOF. */
+static int recv_buf_fill (int sock, struct recv_buf *rb, const size_t size)
+{
+	assert (size <= RECV_BUF_SIZE);
+
+	if (rb->pos + size > RECV_BUF_SIZE)
+		recv_buf_compact (rb);
+
+	while (rb->len - rb->pos < size) {
+		ssize_t res;
+
+		res = recv (sock, rb->buf + rb->len, RECV_BUF_SIZE - rb->len, 0);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			log_errno ("recv() failed when getting data", errno);
+			return 0;
+		}
+		if (res == 0) {
+			if (rb->len > rb->pos)
+				logit ("Unexpected EOF when getting data");
+			return 0;
+		}
+		rb->len += res;
+	}
+
+	return 1;
+}
+
+/* Receive exactly size bytes from the socket.  Small values are taken
+ * from the receive buffer, the rest of a bigger one is read directly.
+ * Return 0 on error. */
+static int recv_all (int sock, char *buf, const size_t size)
+{
+	struct recv_buf *rb = recv_buf_get (sock);
+	size_t nread;
+
+	if (size <= RECV_BUF_SIZE) {
+		if (!recv_buf_fill(sock, rb, size))
+			return 0;
+		memcpy (buf, rb->buf + rb->pos, size);
+		rb->pos += size;
+		if (rb->pos == rb->len)
+			rb->pos = rb->len = 0;
+		return 1;
+	}
+
+	nread = rb->len - rb->pos;
+	memcpy (buf, rb->buf + rb->pos, nread);
+	rb->pos = rb->len = 0;
+
+	while (nread < size) {
+		ssize_t res;
+
+		res = recv (sock, buf + nread, size - nread, 0);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			log_errno ("recv() failed when getting data", errno);
+			return 0;
+		}
+		if (res == 0) {
+			logit ("Unexpected EOF when getting data");
+			return 0;
+		}
+		nread += res;
+	}
+
+	return 1;
+}
+
+/* Return true if there are received data not used yet.  The socket is not
+ * seen as readable when waiting for them. */
+bool recv_buf_pending (int sock)
+{
+	return sock >= 0 && sock < recv_bufs_num && recv_bufs[sock]
+		&& recv_bufs[sock]->len > recv_bufs[sock]->pos;
+}
+
+/* Free the receive buffer and the arena of the socket; must be done when
+ * the socket is closed, before its descriptor can be reused. */
+void recv_buf_free (int sock)
+{
+	struct recv_buf *rb;
+
+	if (sock < 0 || sock >= recv_bufs_num || !recv_bufs[sock])
+		return;
+
+	rb = recv_bufs[sock];
+	while (rb->arena) {
+		struct arena_block *b = rb->arena;
+
+		rb->arena = b->next;
+		xfree_tag (b, MEM_PROTOCOL);
+	}
+
+	xfree_tag (rb, MEM_PROTOCOL);
+	recv_bufs[sock] = NULL;
+}
+
+/* Allocate memory in the arena of the buffer. */
+static char *arena_alloc (struct recv_buf *rb, const size_t size)
+{
+	struct arena_block *b = rb->arena;
+	char *mem;
+
+	assert (size <= ARENA_BLOCK_SIZE);
+
+	if (!b || ARENA_BLOCK_SIZE - b->used < size) {
+		b = (struct arena_block *)xmalloc_tag (
+				sizeof(struct arena_block), MEM_PROTOCOL);
+		b->next = rb->arena;
+		b->used = 0;
+		rb->arena = b;
+	}
+
+	mem = b->data + b->used;
+	b->used += size;
+
+	return mem;
+}
+
+/* Release the memory of everything received with the *_arena() functions
+ * from the socket.  One block is kept for the next message. */
+void recv_arena_reset (int sock)
+{
+	struct recv_buf *rb;
+
+	if (sock < 0 || sock >= recv_bufs_num || !recv_bufs[sock]
+			|| !recv_bufs[sock]->arena)
+		return;
+
+	rb = recv_bufs[sock];
+	while (rb->arena->next) {
+		struct arena_block *b = rb->arena->next;
+
+		rb->arena->next = b->next;
+		xfree_tag (b, MEM_PROTOCOL);
+	}
+	rb->arena->used = 0;
+}
+
+/* Get an integer value from the socket, return == 0 on error. */
+int get_int (int sock, int *i)
+{
+	return recv_all (sock, (char *)i, sizeof(int));
 }
 
 /* Get an integer value from the socket without blocking. */
 enum noblock_io_status get_int_noblock (int sock, int *i)
 {
+	struct recv_buf *rb = recv_buf_get (sock);
 	ssize_t res;
 	char *err;
 
-	nonblocking (recv, res, sock, i, sizeof (int));
+	if (rb->len - rb->pos >= sizeof(int))
+		return get_int (sock, i) ? NB_IO_OK : NB_IO_ERR;
 
-	if (res == ssizeof (int))
-		return NB_IO_OK;
+	recv_buf_compact (rb);
+	nonblocking (recv, res, sock, rb->buf + rb->len,
+			RECV_BUF_SIZE - rb->len);
+
+	if (res > 0) {
+		rb->len += res;
+		if (rb->len - rb->pos < sizeof(int))
+			return NB_IO_BLOCK;
+		return get_int (sock, i) ? NB_IO_OK : NB_IO_ERR;
+	}
 	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
 		return NB_IO_BLOCK;
 
@@ -142,36 +365,54 @@ static int send_long (int sock, long i)
 }
 #endif
 
+/* Get the length of a string from the socket, return 0 on error. */
+static int get_str_len (int sock, int *len)
+{
+	if (!get_int(sock, len))
+		return 0;
+
+	if (!RANGE(0, *len, MAX_SEND_STRING)) {
+		logit ("Bad string length.");
+		return 0;
+	}
+
+	return 1;
+}
+
 /* Get the string from socket, return NULL on error. The memory is malloced. */
 char *get_str (int sock)
 {
-	int len, nread = 0;
+	int len;
 	char *str;
 
-	if (!get_int(sock, &len))
+	if (!get_str_len(sock, &len))
 		return NULL;
 
-	if (!RANGE(0, len, MAX_SEND_STRING)) {
-		logit ("Bad string length.");
+	str = (char *)xmalloc (sizeof(char) * (len + 1));
+	if (!recv_all(sock, str, len)) {
+		logit ("Error while getting string");
+		free (str);
 		return NULL;
 	}
+	str[len] = 0;
 
-	str = (char *)xmalloc (sizeof(char) * (len + 1));
-	while (nread < len) {
-		ssize_t res;
+	return str;
+}
 
-		res = recv (sock, str + nread, len - nread, 0);
-		if (res == -1) {
-			log_errno ("recv() failed when getting string", errno);
-			free (str);
-			return NULL;
-		}
-		if (res == 0) {
-			logit ("Unexpected EOF when getting string");
-			free (str);
-			return NULL;
-		}
-		nread += res;
+/* Get the string from socket into the socket's arena, it's valid until
+ * recv_arena_reset().  Return NULL on error. */
+char *get_str_arena (int sock)
+{
+	int len;
+	char *str;
+
+	if (!get_str_len(sock, &len))
+		return NULL;
+
+	str = arena_alloc (recv_buf_get (sock), len + 1);
+	if (!recv_all(sock, str, len)) {
+		logit ("Error while getting string");
+		return NULL;
 	}
 	str[len] = 0;
 
@@ -195,13 +436,7 @@ int send_str (int sock, const char *str)
 /* Get a time_t value from the socket, return == 0 on error. */
 int get_time (int sock, time_t *i)
 {
-	ssize_t res;
-
-	res = recv (sock, i, sizeof(time_t), 0);
-	if (res == -1)
-		log_errno ("recv() failed when getting time_t", errno);
-
-	return res == ssizeof(time_t) ? 1 : 0;
+	return recv_all (sock, (char *)i, sizeof(time_t));
 }
 
 /* Send a time_t value to the socket, return == 0 on error */
@@ -220,8 +455,9 @@ static struct packet_buf *packet_buf_new ()
 {
 	struct packet_buf *b;
 
-	b = (struct packet_buf *)xmalloc (sizeof(struct packet_buf));
-	b->buf = (char *)xmalloc (1024);
+	b = (struct packet_buf *)xmalloc_tag (sizeof(struct packet_buf),
+			MEM_PROTOCOL);
+	b->buf = (char *)xmalloc_tag (1024, MEM_PROTOCOL);
 	b->allocated = 1024;
 	b->len = 0;
 
@@ -232,8 +468,8 @@ static void packet_buf_free (struct packet_buf *b)
 {
 	assert (b != NULL);
 
-	free (b->buf);
-	free (b);
+	xfree_tag (b->buf, MEM_PROTOCOL);
+	xfree_tag (b, MEM_PROTOCOL);
 }
 
 /* Make sure that there is at least len bytes free. */
@@ -243,7 +479,8 @@ static void packet_buf_add_space (struct packet_buf *b, const size_t len)
 
 	if (b->allocated < b->len + len) {
 		b->allocated += len + 256; /* put some more space */
-		b->buf = (char *)xrealloc (b->buf, b->allocated);
+		b->buf = (char *)xrealloc_tag (b->buf, b->allocated,
+				MEM_PROTOCOL);
 	}
 }
 
@@ -363,6 +600,281 @@ int send_item (int sock, const struct plist_item *item)
 	return res;
 }
 
+/* Send the vector of buffers to the socket. Return 0 on error. */
+static int writev_all (int sock, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t sent;
+
+		sent = writev (sock, iov, iovcnt);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			log_errno ("Error while sending data", errno);
+			return 0;
+		}
+
+		while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+
+	return 1;
+}
+
+/* Add a string to the buffer as its length followed by the characters and
+ * the terminating zero, so it can be used where it is received. */
+static void packet_buf_add_cstr (struct packet_buf *b, const char *str)
+{
+	int str_len;
+
+	assert (b != NULL);
+
+	str_len = str ? strlen (str) : 0;
+
+	packet_buf_add_int (b, str_len);
+	packet_buf_add_space (b, str_len + 1);
+	if (str_len)
+		memcpy (b->buf + b->len, str, str_len);
+	b->buf[b->len + str_len] = 0;
+	b->len += str_len + 1;
+}
+
+/* Add an item to the playlist chunk. */
+static void packet_buf_add_chunk_item (struct packet_buf *b,
+		const struct plist_item *item)
+{
+	const struct file_tags *tags = item->tags;
+
+	packet_buf_add_cstr (b, item->file);
+	packet_buf_add_cstr (b, item->title_tags);
+	packet_buf_add_cstr (b, tags ? tags->title : NULL);
+	packet_buf_add_cstr (b, tags ? tags->artist : NULL);
+	packet_buf_add_cstr (b, tags ? tags->album : NULL);
+	packet_buf_add_int (b, tags ? tags->track : -1);
+	packet_buf_add_int (b, tags && tags->filled & TAGS_TIME
+			? tags->time : -1);
+	packet_buf_add_int (b, tags && tags->filled & TAGS_RATING
+			? tags->rating : -1);
+	packet_buf_add_int (b, tags ? tags->filled : 0);
+	packet_buf_add_time (b, item->mtime);
+}
+
+/* Send a chunk of a playlist in one system call if possible.  Data of
+ * zero length is the end of the playlist mark.  Return 0 on error. */
+int send_plist_chunk (int sock, const char *buf, const size_t len,
+		const int items)
+{
+	int header[2];
+	struct iovec iov[2];
+
+	if (len > PLIST_CHUNK_MAX) {
+		logit ("Playlist chunk too big: %zu bytes", len);
+		return 0;
+	}
+
+	header[0] = (int)len;
+	header[1] = items;
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (char *)buf;
+	iov[1].iov_len = len;
+
+	return writev_all (sock, iov, len ? 2 : 1);
+}
+
+/* Receive a chunk of a playlist.  The data is malloc()ed and put in *buf,
+ * its length in *len and the number of items in *items.  At the end of the
+ * playlist *buf is NULL and *len is 0.  Return 0 on error. */
+int recv_plist_chunk (int sock, char **buf, size_t *len, int *items)
+{
+	int header[2];
+
+	*buf = NULL;
+	*len = 0;
+	*items = 0;
+
+	if (!recv_all(sock, (char *)header, sizeof(header)))
+		return 0;
+
+	if (!RANGE(0, header[0], PLIST_CHUNK_MAX) || header[1] < 0
+			|| (header[0] == 0) != (header[1] == 0)) {
+		logit ("Bad playlist chunk header: %d bytes, %d items",
+				header[0], header[1]);
+		return 0;
+	}
+
+	if (header[0] == 0)
+		return 1;
+
+	*buf = (char *)xmalloc (header[0]);
+	if (!recv_all(sock, *buf, header[0])) {
+		free (*buf);
+		*buf = NULL;
+		return 0;
+	}
+
+	*len = header[0];
+	*items = header[1];
+
+	return 1;
+}
+
+/* Send not deleted items from the playlist in chunks followed by the end
+ * of the playlist mark.  Return 0 on error. */
+int send_plist_items (int sock, const struct plist *plist)
+{
+	int i, items = 0, res = 1;
+	struct packet_buf *b;
+
+	b = packet_buf_new ();
+	packet_buf_add_space (b, PLIST_CHUNK_SIZE + 1024);
+
+	for (i = 0; i < plist->num && res; i++) {
+		if (plist_deleted(plist, i))
+			continue;
+
+		packet_buf_add_chunk_item (b, &plist->items[i]);
+		items++;
+
+		if (b->len >= PLIST_CHUNK_SIZE) {
+			res = send_plist_chunk (sock, b->buf, b->len, items);
+			b->len = 0;
+			items = 0;
+		}
+	}
+
+	if (res && items)
+		res = send_plist_chunk (sock, b->buf, b->len, items);
+	if (res)
+		res = send_plist_chunk (sock, NULL, 0, 0);
+
+	if (!res)
+		logit ("Error when sending playlist");
+
+	packet_buf_free (b);
+	return res;
+}
+
+/* Cursor over the received playlist chunk. */
+struct chunk_reader
+{
+	char *pos;
+	char *end;
+};
+
+static int chunk_get_int (struct chunk_reader *r, int *n)
+{
+	if (r->end - r->pos < ssizeof(int))
+		return 0;
+
+	memcpy (n, r->pos, sizeof(int));
+	r->pos += sizeof(int);
+
+	return 1;
+}
+
+static int chunk_get_time (struct chunk_reader *r, time_t *t)
+{
+	if (r->end - r->pos < ssizeof(time_t))
+		return 0;
+
+	memcpy (t, r->pos, sizeof(time_t));
+	r->pos += sizeof(time_t);
+
+	return 1;
+}
+
+/* Get a string pointing into the chunk, NULL for an empty string. */
+static int chunk_get_str (struct chunk_reader *r, char **str)
+{
+	int len;
+
+	if (!chunk_get_int(r, &len) || !RANGE(0, len, MAX_SEND_STRING)
+			|| r->end - r->pos <= len || r->pos[len])
+		return 0;
+
+	*str = len ? r->pos : NULL;
+	r->pos += len + 1;
+
+	return 1;
+}
+
+/* Decode the next item from the chunk.  The strings in the item and tags
+ * point into the chunk.  Return 0 if the data is malformed. */
+static int chunk_get_item (struct chunk_reader *r, struct plist_item *item,
+		struct file_tags *tags)
+{
+	memset (item, 0, sizeof(struct plist_item));
+	memset (tags, 0, sizeof(struct file_tags));
+
+	if (!chunk_get_str(r, &item->file) || !item->file
+			|| !chunk_get_str(r, &item->title_tags)
+			|| !chunk_get_str(r, &tags->title)
+			|| !chunk_get_str(r, &tags->artist)
+			|| !chunk_get_str(r, &tags->album)
+			|| !chunk_get_int(r, &tags->track)
+			|| !chunk_get_int(r, &tags->time)
+			|| !chunk_get_int(r, &tags->rating)
+			|| !chunk_get_int(r, &tags->filled)
+			|| !chunk_get_time(r, &item->mtime))
+		return 0;
+
+	item->type = file_type (item->file);
+	item->tags = tags;
+
+	return 1;
+}
+
+/* Receive a playlist sent by send_plist_items() and add its items to the
+ * playlist.  Return 0 on error. */
+int recv_plist_items (int sock, struct plist *plist)
+{
+	char *buf;
+	size_t len;
+	int items;
+
+	while (recv_plist_chunk(sock, &buf, &len, &items)) {
+		struct chunk_reader r;
+		struct plist_item item;
+		struct file_tags tags;
+		int i;
+
+		if (!buf)
+			return 1;
+
+		plist_reserve (plist, items);
+
+		r.pos = buf;
+		r.end = buf + len;
+		for (i = 0; i < items; i++) {
+			if (!chunk_get_item(&r, &item, &tags)) {
+				logit ("Malformed playlist chunk");
+				free (buf);
+				return 0;
+			}
+			plist_add_from_item (plist, &item);
+		}
+
+		free (buf);
+
+		if (r.pos != r.end) {
+			logit ("Garbage at the end of playlist chunk");
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
 struct file_tags *recv_tags (int sock)
 {
 	struct file_tags *tags = tags_new ();
@@ -494,6 +1006,51 @@ struct plist_item *recv_item (int sock)
 	return item;
 }
 
+/* Get a playlist item from the client into item and tags with the strings
+ * in the socket's arena (valid until recv_arena_reset()), NULL instead of
+ * empty strings except the file name.  Return 0 on error. */
+int recv_item_arena (int sock, struct plist_item *item,
+		struct file_tags *tags)
+{
+	memset (item, 0, sizeof(struct plist_item));
+	memset (tags, 0, sizeof(struct file_tags));
+
+	if (!(item->file = get_str_arena(sock))) {
+		logit ("Error while receiving file name");
+		return 0;
+	}
+
+	if (!item->file[0])
+		return 1;
+
+	if (!(item->title_tags = get_str_arena(sock))
+			|| !(tags->title = get_str_arena(sock))
+			|| !(tags->artist = get_str_arena(sock))
+			|| !(tags->album = get_str_arena(sock))
+			|| !get_int(sock, &tags->track)
+			|| !get_int(sock, &tags->time)
+			|| !get_int(sock, &tags->rating)
+			|| !get_int(sock, &tags->filled)
+			|| !get_time(sock, &item->mtime)) {
+		logit ("Error while receiving item");
+		return 0;
+	}
+
+	if (!item->title_tags[0])
+		item->title_tags = NULL;
+	if (!tags->title[0])
+		tags->title = NULL;
+	if (!tags->artist[0])
+		tags->artist = NULL;
+	if (!tags->album[0])
+		tags->album = NULL;
+
+	item->type = file_type (item->file);
+	item->tags = tags;
+
+	return 1;
+}
+
 struct move_ev_data *recv_move_ev_data (int sock)
 {
 	struct move_ev_data *d;
@@ -516,47 +1073,127 @@ struct move_ev_data *recv_move_ev_data (int sock)
 	return d;
 }
 
-/* Push an event on the queue if it's not already there. */
+/* Return the index of the coalesced events slot for the event type or -1
+ * if events of this type are not coalesced.  These events only tell the
+ * client to look at the current state again (or show the latest status
+ * message), so one queued event of each type is enough. */
+static int coalesced_slot (const int type)
+{
+	switch (type) {
+		case EV_STATE:		return 0;
+		case EV_CTIME:		return 1;
+		case EV_BITRATE:	return 2;
+		case EV_RATE:		return 3;
+		case EV_CHANNELS:	return 4;
+		case EV_OPTIONS:	return 5;
+		case EV_TAGS:		return 6;
+		case EV_STATUS_MSG:	return 7;
+		case EV_MIXER_CHANGE:	return 8;
+		case EV_AVG_BITRATE:	return 9;
+	}
+
+	return -1;
+}
+
+/* Return the k-th event of the queue. */
+static struct event *event_at (const struct event_queue *q, const int k)
+{
+	return &q->ring[(q->head + k) & (q->size - 1)];
+}
+
+/* Push an event on the queue if it's not already there.  If an event of
+ * the same coalesced type is waiting, it just gets the new data. */
 void event_push (struct event_queue *q, const int event, void *data)
 {
+	struct event *e;
+	int slot;
+
 	assert (q != NULL);
 
-	if (!q->head) {
-		q->head = (struct event *)xmalloc (sizeof(struct event));
-		q->head->next = NULL;
-		q->head->type = event;
-		q->head->data = data;
-		q->tail = q->head;
+	slot = coalesced_slot (event);
+	if (slot != -1) {
+		int k = (int)(q->coalesced[slot] - q->popped);
+
+		if (LIMIT(k, q->num) && event_at(q, k)->type == event) {
+			e = event_at (q, k);
+			free_event_data (e->type, e->data);
+			e->data = data;
+			return;
+		}
 	}
-	else {
-		assert (q->head != NULL);
-		assert (q->tail != NULL);
-		assert (q->tail->next == NULL);
 
-		q->tail->next = (struct event *)xmalloc (
-				sizeof(struct event));
-		q->tail = q->tail->next;
-		q->tail->next = NULL;
-		q->tail->type = event;
-		q->tail->data = data;
+	if (q->num == q->size) {
+		int new_size = q->size ? q->size * 2 : EVENT_QUEUE_INIT;
+		struct event *ring;
+		int k;
+
+		ring = (struct event *)xmalloc_tag (sizeof(struct event)
+				* new_size, MEM_PROTOCOL);
+		for (k = 0; k < q->num; k++)
+			ring[k] = *event_at (q, k);
+		xfree_tag (q->ring, MEM_PROTOCOL);
+		q->ring = ring;
+		q->size = new_size;
+		q->head = 0;
 	}
+
+	e = event_at (q, q->num);
+	e->type = event;
+	e->data = data;
+
+	if (slot != -1)
+		q->coalesced[slot] = q->popped + q->num;
+	q->num++;
 }
 
 /* Remove the first event from the queue (don't free the data field). */
 void event_pop (struct event_queue *q)
 {
-	struct event *e;
+	assert (q != NULL);
+	assert (q->num > 0);
+
+	q->head = (q->head + 1) & (q->size - 1);
+	q->num--;
+	q->popped++;
+}
+
+/* Return true iff 'event' is a playlist event. */
+bool is_plist_event (const int event)
+{
+	bool result = false;
+
+	switch (event) {
+	case EV_PLIST_ADD:
+	case EV_PLIST_DEL:
+	case EV_PLIST_MOVE:
+	case EV_PLIST_CLEAR:
+		result = true;
+	}
+
+	return result;
+}
+
+/* Remove the events of the types for which match() returns true from the
+ * queue, freeing their data. */
+void event_queue_drop (struct event_queue *q, bool (*match)(const int type))
+{
+	int k, kept = 0;
 
 	assert (q != NULL);
-	assert (q->head != NULL);
-	assert (q->tail != NULL);
+	assert (match != NULL);
 
-	e = q->head;
-	q->head = e->next;
-	free (e);
+	for (k = 0; k < q->num; k++) {
+		struct event *e = event_at (q, k);
+
+		if (match (e->type))
+			free_event_data (e->type, e->data);
+		else
+			*event_at (q, kept++) = *e;
+	}
 
-	if (q->tail == e)
-		q->tail = NULL; /* the queue is empty */
+	/* Coalesced events have moved, they are found again only by chance,
+	 * which is harmless. */
+	q->num = kept;
 }
 
 /* Get the pointer to the first item in the queue or NULL if the queue is
@@ -565,7 +1202,7 @@ struct event *event_get_first (struct event_queue *q)
 {
 	assert (q != NULL);
 
-	return q->head;
+	return q->num ? event_at (q, 0) : NULL;
 }
 
 void free_tag_ev_data (struct tag_ev_response *d)
@@ -639,7 +1276,8 @@ void free_event_data (const int type, void *data)
 		abort (); /* BUG */
 }
 
-/* Free event queue content without the queue structure. */
+/* Free event queue content without the queue structure.  The queue is
+ * left empty and can still be used. */
 void event_queue_free (struct event_queue *q)
 {
 	struct event *e;
@@ -650,52 +1288,51 @@ void event_queue_free (struct event_queue *q)
 		free_event_data (e->type, e->data);
 		event_pop (q);
 	}
-}
 
-void event_queue_init (struct event_queue *q)
-{
-	assert (q != NULL);
+	xfree_tag (q->ring, MEM_PROTOCOL);
+	q->ring = NULL;
+	q->size = 0;
+	q->head = 0;
 
-	q->head = NULL;
-	q->tail = NULL;
+	if (q->out) {
+		packet_buf_free (q->out);
+		q->out = NULL;
+	}
+	q->out_pos = 0;
 }
 
-#if 0
-/* Search for an event of this type and return pointer to it or NULL if there
- * was no such event. */
-struct event *event_search (struct event_queue *q, const int event)
+void event_queue_init (struct event_queue *q)
 {
-	struct event *e;
+	int i;
 
 	assert (q != NULL);
 
-	while ((e = q->head)) {
-		if (e->type == event)
-			return e;
-		e = e->next;
-	}
-
-	return NULL;
+	q->ring = (struct event *)xmalloc_tag (sizeof(struct event)
+			* EVENT_QUEUE_INIT, MEM_PROTOCOL);
+	q->size = EVENT_QUEUE_INIT;
+	q->head = 0;
+	q->num = 0;
+	q->popped = 0;
+	for (i = 0; i < EVENT_COALESCED; i++)
+		q->coalesced[i] = 0;
+	q->out = NULL;
+	q->out_pos = 0;
 }
-#endif
 
-/* Return != 0 if the queue is empty. */
+/* Return != 0 if the queue is empty: there are no events to send and no
+ * events partially sent. */
 int event_queue_empty (const struct event_queue *q)
 {
 	assert (q != NULL);
 
-	return q->head == NULL ? 1 : 0;
+	return q->num == 0 && !q->out ? 1 : 0;
 }
 
-/* Make a packet buffer filled with the event (with data). */
-static struct packet_buf *make_event_packet (const struct event *e)
+/* Add the event (with data) to the packet buffer. */
+static void packet_buf_add_event (struct packet_buf *b, const struct event *e)
 {
-	struct packet_buf *b;
-
 	assert (e != NULL);
 
-	b = packet_buf_new ();
-
 	packet_buf_add_int (b, e->type);
 
 	if (e->type == EV_PLIST_DEL
@@ -729,51 +1366,123 @@ static struct packet_buf *make_event_packet (const struct event *e)
 	}
 	else if (e->data)
 		abort (); /* BUG */
+}
+
+/* Add EV_FILES_TAGS carrying the EV_FILE_TAGS events at the head of the
+ * queue (at most FILES_TAGS_BATCH) to the packet buffer.  Return the number
+ * of the events used. */
+static int packet_buf_add_files_tags (struct packet_buf *b,
+		const struct event_queue *q)
+{
+	int k, n = 0;
+
+	while (n < q->num && n < FILES_TAGS_BATCH
+			&& event_at(q, n)->type == EV_FILE_TAGS)
+		n++;
+
+	packet_buf_add_int (b, EV_FILES_TAGS);
+	packet_buf_add_int (b, n);
+
+	for (k = 0; k < n; k++) {
+		const struct tag_ev_response *r = event_at(q, k)->data;
+
+		packet_buf_add_str (b, r->file);
+		packet_buf_add_tags (b, r->tags);
+	}
+
+	return n;
+}
+
+/* Take events from the head of the queue and put them into one packet of
+ * about EVENT_SEND_MAX bytes at most.  A run of EV_FILE_TAGS events goes as
+ * one EV_FILES_TAGS event. */
+static struct packet_buf *make_events_packet (struct event_queue *q)
+{
+	struct packet_buf *b = packet_buf_new ();
+
+	while (q->num && b->len < EVENT_SEND_MAX) {
+		struct event *e = event_get_first (q);
+		int count;
+
+		if (e->type == EV_FILE_TAGS && q->num > 1
+				&& event_at(q, 1)->type == EV_FILE_TAGS)
+			count = packet_buf_add_files_tags (b, q);
+		else {
+			packet_buf_add_event (b, e);
+			count = 1;
+		}
+
+		while (count-- > 0) {
+			e = event_get_first (q);
+			free_event_data (e->type, e->data);
+			event_pop (q);
+		}
+	}
 
 	return b;
 }
 
-/* Send the first event from the queue and remove it on success.  If the
- * operation would block return NB_IO_BLOCK.  Return NB_IO_ERR on error
- * or NB_IO_OK on success. */
+/* Send the rest of the packet event_send_noblock() has sent only partly,
+ * waiting if needed, so that other data written to the socket doesn't
+ * land in the middle of it.  Return 0 on error. */
+int event_send_pending (int sock, struct event_queue *q)
+{
+	int res;
+
+	assert (q != NULL);
+
+	if (!q->out)
+		return 1;
+
+	res = send_all (sock, q->out->buf + q->out_pos,
+			q->out->len - q->out_pos);
+
+	packet_buf_free (q->out);
+	q->out = NULL;
+	q->out_pos = 0;
+
+	return res;
+}
+
+/* Send the events waiting in the queue, as many as fit in one packet, in
+ * one send() call.  What could not be sent is kept and sent first the next
+ * time.  If the operation would block, or not all was sent, return
+ * NB_IO_BLOCK.  Return NB_IO_ERR on error or NB_IO_OK on success. */
 enum noblock_io_status event_send_noblock (int sock, struct event_queue *q)
 {
 	ssize_t res;
 	char *err;
-	struct packet_buf *b;
-	enum noblock_io_status result;
 
 	assert (q != NULL);
 	assert (!event_queue_empty(q));
 
-	b = make_event_packet (event_get_first(q));
-
-	/* We must do it in one send() call to be able to handle blocking. */
-	nonblocking (send, res, sock, b->buf, b->len);
+	if (!q->out) {
+		q->out = make_events_packet (q);
+		q->out_pos = 0;
+	}
 
-	if (res == (ssize_t)b->len) {
-		struct event *e;
+	nonblocking (send, res, sock, q->out->buf + q->out_pos,
+			q->out->len - q->out_pos);
 
-		e = event_get_first (q);
-		free_event_data (e->type, e->data);
-		event_pop (q);
+	if (res > 0) {
+		q->out_pos += res;
+		if (q->out_pos < q->out->len)
+			return NB_IO_BLOCK;
 
-		result = NB_IO_OK;
-		goto exit;
+		packet_buf_free (q->out);
+		q->out = NULL;
+		q->out_pos = 0;
+		return NB_IO_OK;
 	}
 
 	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
 		logit ("Sending event would block");
-		result = NB_IO_BLOCK;
-		goto exit;
+		return NB_IO_BLOCK;
 	}
 
 	err = xstrerror (errno);
 	logit ("send()ing event failed (%zd): %s", res, err);
 	free (err);
-	result = NB_IO_ERR;
 
-exit:
-	packet_buf_free (b);
-	return result;
+	return NB_IO_ERR;
 }
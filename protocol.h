@@ -11,15 +11,36 @@ struct event
 {
 	int type;	/* type of the event (one of EV_*) */
 	void *data;	/* optional data associated with the event */
-	struct event *next;
 };
 
+/* Initial size of the event queue's ring; it doubles when full. */
+#define EVENT_QUEUE_INIT	16
+
+/* Number of event types of which only one event is kept in the queue. */
+#define EVENT_COALESCED		10
+
+struct packet_buf;
+
 struct event_queue
 {
-	struct event *head;
-	struct event *tail;
+	struct event *ring;	/* the events, the first one at ring[head] */
+	int size;		/* size of the ring, a power of 2 */
+	int head;
+	int num;		/* number of events in the queue */
+	unsigned int popped;	/* number of events taken from the queue */
+	unsigned int coalesced[EVENT_COALESCED]; /* popped + index of the
+						    last event of each
+						    coalesced type */
+	struct packet_buf *out;	/* events being sent */
+	size_t out_pos;		/* how much of out is sent */
 };
 
+/* Maximum number of EV_FILE_TAGS events sent as one EV_FILES_TAGS. */
+#define FILES_TAGS_BATCH	64
+
+/* Maximum number of files in one CMD_GET_FILES_TAGS. */
+#define FILES_TAGS_REQUEST_MAX	1024
+
 /* Used as data field in the event queue for EV_FILE_TAGS. */
 struct tag_ev_response
 {
@@ -63,6 +84,9 @@ enum noblock_io_status
 #define EV_AVG_BITRATE  0x12 /* average bitrate has changed (new song) */
 #define EV_AUDIO_START	0x13 /* playing of audio has started */
 #define EV_AUDIO_STOP	0x14 /* playing of audio has stopped */
+#define EV_FILES_TAGS	0x15 /* several EV_FILE_TAGS responses in one event:
+				number of files followed by file name and
+				tags pairs */
 
 /* Events caused by a client that wants to modify the playlist (see
  * CMD_CLI_PLIST* commands). */
@@ -147,19 +171,42 @@ enum noblock_io_status
 #define CMD_QUEUE_CLEAR	0x3e /* clear the queue */
 #define CMD_GET_QUEUE	0x3f /* request the queue from the server */
 #define CMD_SET_RATING	0x40 /* change rating for a file */
+#define CMD_GET_IO_STATS	0x41 /* get the counters of the open streams */
+#define CMD_BOOST_TAGS_REQUESTS	0x42 /* serve tags requests for these files
+					first */
+#define CMD_GET_FILES_TAGS	0x43 /* request for tags of a list of files */
+#define CMD_GET_PLIST_CHANGES	0x44 /* get changes of the clients' playlist
+					since the given version */
+#define CMD_GET_STATS	0x45 /* get the counters of the sound pipeline */
+#define CMD_DUMP_OUTPUT_TRACE	0x46 /* write the output trace to a file */
+#define CMD_SCAN	0x47 /* read the tags of a directory tree into the
+				cache */
+#define CMD_CLI_PLIST_SERIAL	0x48 /* set the serial number of the
+					clients' playlist */
 
 char *socket_name ();
 int get_int (int sock, int *i);
 enum noblock_io_status get_int_noblock (int sock, int *i);
 int send_int (int sock, int i);
 char *get_str (int sock);
+char *get_str_arena (int sock);
 int send_str (int sock, const char *str);
 int get_time (int sock, time_t *i);
 int send_time (int sock, time_t i);
 int send_item (int sock, const struct plist_item *item);
 struct plist_item *recv_item (int sock);
+int recv_item_arena (int sock, struct plist_item *item,
+		struct file_tags *tags);
 struct file_tags *recv_tags (int sock);
 int send_tags (int sock, const struct file_tags *tags);
+int send_plist_chunk (int sock, const char *buf, const size_t len,
+		const int items);
+int recv_plist_chunk (int sock, char **buf, size_t *len, int *items);
+int send_plist_items (int sock, const struct plist *plist);
+int recv_plist_items (int sock, struct plist *plist);
+bool recv_buf_pending (int sock);
+void recv_buf_free (int sock);
+void recv_arena_reset (int sock);
 
 void event_queue_init (struct event_queue *q);
 void event_queue_free (struct event_queue *q);
@@ -168,7 +215,10 @@ struct event *event_get_first (struct event_queue *q);
 void event_pop (struct event_queue *q);
 void event_push (struct event_queue *q, const int event, void *data);
 int event_queue_empty (const struct event_queue *q);
+void event_queue_drop (struct event_queue *q, bool (*match)(const int type));
+bool is_plist_event (const int event);
 enum noblock_io_status event_send_noblock (int sock, struct event_queue *q);
+int event_send_pending (int sock, struct event_queue *q);
 struct tag_ev_response *tag_ev_data_dup (const struct tag_ev_response *d);
 void free_tag_ev_data (struct tag_ev_response *d);
 void free_move_ev_data (struct move_ev_data *m);
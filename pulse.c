@@ -82,10 +82,12 @@
 #define DEBUG
 
 #include <math.h>
+#include <string.h>
 #include <pulse/pulseaudio.h>
 #include "common.h"
 #include "log.h"
 #include "audio.h"
+#include "options.h"
 
 
 /* The pulse mainloop and context are initialized in pulse_init and
@@ -292,6 +294,18 @@ static int pulse_open (struct sound_params *sound_params)
 		fatal ("pulse: got unrequested format");
 	}
 
+	/* A deep target buffer with a large minimal request lets the server
+	 * wake us up rarely, PA_STREAM_ADJUST_LATENCY makes it size its own
+	 * buffers to match. */
+	if (options_get_int ("PulseTargetLength"))
+		ba.tlength = pa_usec_to_bytes (
+			options_get_int ("PulseTargetLength") * PA_USEC_PER_MSEC,
+			&ss);
+	if (options_get_int ("PulseMinRequest"))
+		ba.minreq = pa_usec_to_bytes (
+			options_get_int ("PulseMinRequest") * PA_USEC_PER_MSEC,
+			&ss);
+
 	debug ("opening stream");
 
 	pa_threaded_mainloop_lock (mainloop);
@@ -378,15 +392,29 @@ static int pulse_play (const char *buff, const size_t size)
 	 * our stream underneath us.
 	 */
 	while (stream) {
+		void *data;
 		size_t towrite = MIN(pa_stream_writable_size (stream),
 				     size - offset);
 		debug ("writing %d bytes", (int)towrite);
 
-		/* We have no working way of dealing with errors
+		/* Copy straight into the memory shared with the server,
+		 * so that pa_stream_write() doesn't have to copy again.
+		 * It may give us less than we asked for.
+		 *
+		 * We have no working way of dealing with errors
 		 * (see below). */
-		if (pa_stream_write(stream, buff + offset, towrite,
-				    NULL, 0, PA_SEEK_RELATIVE))
-			error ("pa_stream_write failed");
+		if (towrite > 0) {
+			if (pa_stream_begin_write (stream, &data, &towrite)) {
+				error ("pa_stream_begin_write failed");
+				towrite = size - offset;
+			}
+			else {
+				memcpy (data, buff + offset, towrite);
+				if (pa_stream_write(stream, data, towrite,
+						    NULL, 0, PA_SEEK_RELATIVE))
+					error ("pa_stream_write failed");
+			}
+		}
 
 		offset += towrite;
 
@@ -612,6 +640,38 @@ static int pulse_reset (void)
 	return result;
 }
 
+/* Wait for the operation started with flush_callback() to finish. */
+static void wait_operation (pa_operation *op)
+{
+	while (pa_operation_get_state (op) == PA_OPERATION_RUNNING)
+		pa_threaded_mainloop_wait (mainloop);
+
+	pa_operation_unref (op);
+}
+
+/* Let the server play out what it has and cork the stream, or uncork
+ * it. */
+static int pulse_pause (int pause)
+{
+	int result = 0;
+
+	pa_threaded_mainloop_lock (mainloop);
+
+	if (stream) {
+		if (pause)
+			wait_operation (pa_stream_drain (stream, flush_callback,
+			                                 &result));
+		wait_operation (pa_stream_cork (stream, pause, flush_callback,
+		                                &result));
+	}
+	else
+		logit ("pulse_pause() called without a stream");
+
+	pa_threaded_mainloop_unlock (mainloop);
+
+	return result;
+}
+
 static int pulse_get_rate (void)
 {
 	/* This is called once right after open. Do not bother making
@@ -694,4 +754,5 @@ void pulse_funcs (struct hw_funcs *funcs)
 	funcs->get_rate = pulse_get_rate;
 	funcs->toggle_mixer_channel = pulse_toggle_mixer_channel;
 	funcs->get_mixer_channel_name = pulse_get_mixer_channel_name;
+	funcs->pause = pulse_pause;
 }
@@ -14,11 +14,18 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
+#include "common.h"
 #include "playlist.h"
 #include "options.h"
+#include "hash_index.h"
+#include "ratings.h"
 #include "interface.h" /* for user_wants_interrupt() */
 #include "server.h" /* for server_error */
 
@@ -34,155 +41,211 @@
  * Newlines in file names are not handled in all cases (things
  * like "<something>\n3 <some other filename>", but whatever). */
 
-/* We read files in chunks of BUF_SIZE bytes */
-#define BUF_SIZE (8*1024)
+/* Number of ratings files kept in memory. */
+#define RATINGS_CACHE_SIZE 8
 
+/* one line of a ratings file */
+struct rating_entry
+{
+	const char *name; /* points into the file's content */
+	int rating;
+	long pos;         /* position of the rating character */
+};
 
-/* find rating for a file and returns that rating or
- * -1 if not found. If found, filepos is the position
- * of the rating character in rf.
- * rf is assumed to be freshly opened (i.e. ftell()==0). */
-static int find_rating (const char *fn, FILE *rf, long *filepos)
+/* content of a ratings file, indexed by file name */
+struct ratings_dir
+{
+	char *path;        /* of the ratings file, NULL if the slot is free */
+	dev_t dev;         /* what the file was when it was read, to see */
+	ino_t ino;         /* if it has changed since */
+	off_t size;
+	time_t mtime;
+	char *content;
+	bool unterminated; /* the last line has no newline */
+	struct rating_entry *entries;
+	struct hash_index *index;
+	unsigned long used; /* for dropping the least recently used one */
+};
+
+static struct ratings_dir cache[RATINGS_CACHE_SIZE];
+static unsigned long cache_clock = 0;
+
+/* Ratings are read by the tags reading threads and written by the
+ * server's main thread. */
+static pthread_mutex_t cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* path of the ratings file in the same folder as fn (malloc()ed) */
+static char *ratings_file_name (const char *fn)
 {
-	assert(fn && rf && ftell(rf) == 0);
-
-	char buf[BUF_SIZE]; /* storage for one chunk */
-	char   *s = NULL;   /* current position in chunk */
-	int     n = 0;      /* characters left in chunk */
-	long fpos = 0;      /* ftell() of end of chunk */
-	const int fnlen = strlen(fn);
-
-	/* get next char, refill buffer if needed */
-	#define GETC(c) do{ \
-	if (!n) { \
-		n = fread(buf, 1, BUF_SIZE, rf); \
-		s = buf; \
-		fpos += n; \
-		if (!n) (c) = -1; else { (c) = *(const unsigned char*)s++; --n; } \
-	} \
-	else { (c) = *(const unsigned char*)s++; --n; } \
-	} while (0)
-	
-	/* loop over all lines in the file */
-	while (true)
+	assert(fn);
+
+	const char *rfn = options_get_str ("RatingFile");
+	const char *sep = strrchr (fn, '/');
+	if (!sep)
 	{
-		int c0; GETC(c0);
+		/* current directory */
+		return xstrdup (rfn);
+	}
 
-		if (c0 < 0) return -1; /* EOF */
+	size_t dirlen = (sep-fn) + 1;
+	char *buf = xmalloc (dirlen + strlen (rfn) + 1);
+	memcpy (buf, fn, dirlen);
+	strcpy (buf + dirlen, rfn);
+	return buf;
+}
 
-		if (c0 == '\n') continue; /* empty line */
+static const char *entry_key (const void *data, const void *unused ATTR_UNUSED)
+{
+	return ((const struct rating_entry *)data)->name;
+}
 
-		if (c0 >= '0' && c0 <= '5') /* possible rating line */
-		{
-			char c; GETC(c);
-
-			if (c < 0) return -1; /* EOF again */
-			
-			/* go straight to next line if we already read the newline */
-			if (c == '\n') continue; 
-			
-			if (c == ' ') /* still good */
-			{
-				/* find fn */
-				const char *t = fn; /* remaining string to match */
-				int nleft = fnlen; /* invariant: nleft == strlen(t) */
-				while (true)
-				{
-					/* compare as much as possible in this chunk */
-					int ncmp = (nleft < n ? nleft : n);
-					if (memcmp(t, s, ncmp))
-					{
-						/* not our file. skip rest of line */
-						break;
-					}
-
-					/* Note: next line is where things get weird
-					 * if fn contains newlines */
-					s += ncmp;
-					t += ncmp;
-					n -= ncmp;
-					nleft -= ncmp;
-
-					if (!nleft)
-					{
-						/* remember position of rating */
-						if (filepos)
-							*filepos = fpos-n - fnlen - 2;
-						
-						/* check for trailing garbage */
-						GETC(c);
-						if (c >= 0 && c != '\n')
-							break; /* skip rest of line */
-
-						/* success */
-						return c0 - '0';
-					}
-
-					if (!n) /* read next chunk */
-					{
-						n = fread(buf, 1, BUF_SIZE, rf);
-						if (!n) return -1;
-						s = buf;
-					}
-				}
-			}
-		}
+static void dir_free (struct ratings_dir *d)
+{
+	free (d->path);
+	free (d->content);
+	free (d->entries);
+	if (d->index) hash_index_free (d->index);
+	memset (d, 0, sizeof (*d));
+}
 
-		/* skip to next line */
-		while (true)
+static bool dir_is_current (const struct ratings_dir *d, const struct stat *st)
+{
+	return d->dev == st->st_dev && d->ino == st->st_ino
+		&& d->size == st->st_size && d->mtime == st->st_mtime;
+}
+
+static void dir_set_stat (struct ratings_dir *d, const struct stat *st)
+{
+	d->dev = st->st_dev;
+	d->ino = st->st_ino;
+	d->size = st->st_size;
+	d->mtime = st->st_mtime;
+}
+
+/* Read the whole ratings file into d and index its lines.  Lines which
+ * are not ratings are ignored, so is a repeated file name: the first line
+ * counts. */
+static bool dir_load (struct ratings_dir *d, const char *path)
+{
+	FILE *rf = fopen (path, "rb");
+	if (!rf) return false;
+
+	struct stat st;
+	if (fstat (fileno (rf), &st) == -1)
+	{
+		fclose (rf);
+		return false;
+	}
+
+	size_t size = st.st_size;
+	char *content = xmalloc (size + 1);
+	size = fread (content, 1, size, rf);
+	fclose (rf);
+	content[size] = 0;
+
+	/* every entry takes a line */
+	int lines = 1;
+	for (const char *s = content; (s = memchr (s, '\n', content + size - s)); s++)
+		lines++;
+
+	d->path = xstrdup (path);
+	dir_set_stat (d, &st);
+	d->content = content;
+	d->unterminated = size > 0 && content[size - 1] != '\n';
+	d->entries = xcalloc (lines, sizeof (struct rating_entry));
+	d->index = hash_index_new (entry_key, NULL);
+	hash_index_reserve (d->index, lines);
+
+	int n = 0;
+	char *s = content;
+	while (s < content + size)
+	{
+		char *e = memchr (s, '\n', content + size - s);
+		if (!e) e = content + size;
+		*e = 0;
+
+		/* There must only be a single space after the rating. */
+		if (e - s > 2 && s[0] >= '0' && s[0] <= '5' && s[1] == ' '
+				&& !hash_index_find (d->index, s + 2))
 		{
-			char *e = memchr (s, '\n', n);
-			if (e)
-			{
-				/* found a newline, update position in buffer */
-				n -= e-s + 1;
-				s = e+1;
-				break;
-			}
-			/* look for newline in next chunk */
-			n = fread(buf, 1, BUF_SIZE, rf);
-			if (!n) return -1;
-			s = buf;
+			struct rating_entry *re = &d->entries[n++];
+			re->name = s + 2;
+			re->rating = s[0] - '0';
+			re->pos = s - content;
+			hash_index_set (d->index, re);
 		}
+
+		s = e + 1;
 	}
-	#undef GETC
+
+	return true;
 }
 
-/* open ratings file in the same folder as fn */
-static FILE *open_ratings_file (const char *fn, const char *mode)
+/* Return the ratings file in the cache, reading it again if it has
+ * changed, or NULL if there is no such file.  The cache must be locked. */
+static struct ratings_dir *get_dir (const char *path)
 {
-	assert(fn && mode && *mode);
+	struct stat st;
+	struct ratings_dir *d = NULL;
+	int i;
 
-	char buf[512]; /* buffer for file path */
-	size_t  N = sizeof(buf);
-	const char *rfn = options_get_str ("RatingFile");
+	for (i = 0; i < RATINGS_CACHE_SIZE; i++)
+	{
+		if (cache[i].path && !strcmp (cache[i].path, path))
+		{
+			d = &cache[i];
+			break;
+		}
+	}
 
-	char *sep = strrchr (fn, '/');
-	if (!sep)
+	if (stat (path, &st) == -1)
 	{
-		/* current directory */
-		return fopen (rfn, mode);
+		if (d) dir_free (d);
+		return NULL;
 	}
-	else if ((sep-fn) + 1 + strlen (rfn) + 1 <= N)
+
+	if (d && !dir_is_current (d, &st))
+		dir_free (d);
+	else if (d)
 	{
-		/* buf can hold the file name */
-		memcpy (buf, fn, (sep-fn) + 1);
-		strcpy (buf + (sep-fn) + 1, rfn);
-		return fopen (buf, mode);
+		d->used = ++cache_clock;
+		return d;
 	}
-	else
+
+	/* use a free slot or the least recently used one */
+	d = &cache[0];
+	for (i = 0; i < RATINGS_CACHE_SIZE; i++)
+	{
+		if (!cache[i].path)
+		{
+			d = &cache[i];
+			break;
+		}
+		if (cache[i].used < d->used)
+			d = &cache[i];
+	}
+	if (d->path) dir_free (d);
+
+	if (!dir_load (d, path))
 	{
-		/* path is too long, allocate buffer on heap */
-		int N = (sep-fn) + 1 + strlen (rfn) + 1;
-		char *gbuf = xmalloc (N);
-		if (!gbuf) return NULL;
-
-		memcpy (gbuf, fn, (sep-fn) + 1);
-		strcpy (gbuf + (sep-fn) + 1, rfn);
-		FILE *rf = fopen (gbuf, "rb");
-		free (gbuf);
-		return rf;
+		dir_free (d);
+		return NULL;
 	}
+
+	d->used = ++cache_clock;
+	return d;
+}
+
+/* Remember the file's state after we've written to it ourselves, so
+ * it's not read again. */
+static void dir_written (struct ratings_dir *d)
+{
+	struct stat st;
+
+	if (stat (d->path, &st) == -1)
+		dir_free (d);
+	else
+		dir_set_stat (d, &st);
 }
 
 /* read rating for a file into file_tags */
@@ -191,22 +254,24 @@ void ratings_read_file (const char *fn, struct file_tags *tags)
 	assert(fn && tags);
 
 	int rating = 0;
+	char *path = ratings_file_name (fn);
 
-	FILE *rf = open_ratings_file (fn, "rb");
-	if (rf)
-	{
-		/* get filename */
-		const char *sep = strrchr (fn, '/');
-		if (sep) fn = sep + 1;
+	/* get filename */
+	const char *sep = strrchr (fn, '/');
+	if (sep) fn = sep + 1;
 
-		/* read rating from ratings file */
-		rating = find_rating (fn, rf, NULL);
+	LOCK (cache_mtx);
+	struct ratings_dir *d = get_dir (path);
+	if (d)
+	{
+		const struct rating_entry *re = hash_index_find (d->index, fn);
 
 		/* if fn has no rating, treat as 0-rating */
-		if (rating < 0) rating = 0;
-
-		fclose (rf);
+		if (re) rating = re->rating;
 	}
+	UNLOCK (cache_mtx);
+
+	free (path);
 
 	/* store the rating */
 	tags->rating = rating;
@@ -219,62 +284,77 @@ bool ratings_write_file (const char *fn, int rating)
 	assert(fn && rating >= 0 && rating <= 5);
 
 	const char *failmsg = "Rating could not be written (check permissions).";
-	#define FAIL do { \
-		server_error (__FILE__, __LINE__, "ratings_write_file", failmsg); \
-		return 0; } while (0)
-
-
-	/* keep full path for open_ratings_file */
-	const char *path = fn;
+	char *path = ratings_file_name (fn);
+	int ok = 1;
 
 	/* get filename */
 	const char *sep = strrchr (fn, '/');
 	if (sep) fn = sep + 1;
 
-	FILE *rf = open_ratings_file (path, "rb+");
-	if (!rf)
-	{
-		if (rating <= 0) return 1; /* 0 rating needs no writing */
-
-		/* ratings file did not exist or could not be opened
-		 * for reading. Try creating it */
-		FILE *rf = open_ratings_file (path, "ab");
-		if (!rf) FAIL; /* can't create it either */
+	LOCK (cache_mtx);
 
-		/* append new rating */
-		int ok = fprintf (rf, "%d %s\n", rating, fn);
-		fclose (rf);
-		if (!ok) FAIL;
-		return 1;
-	}
+	struct ratings_dir *d = get_dir (path);
+	struct rating_entry *re = d ? (struct rating_entry *)hash_index_find (d->index, fn) : NULL;
 
-	/* ratings file exists, locate our file */
-	long filepos;
-	int  ok = 1;
-	int r0 = find_rating (fn, rf, &filepos);
-	if (r0 < 0)
+	if (!re)
 	{
-		/* not found - append */
-		if (rating > 0 && 0 == fseek (rf, 0, SEEK_END))
+		/* not found - append, 0 rating needs no writing */
+		if (rating > 0)
 		{
-			ok = fprintf (rf, "%d %s\n", rating, fn);
+			FILE *rf = fopen (path, "ab");
+			if (rf)
+			{
+				ok = fprintf (rf, "%s%d %s\n",
+						d && d->unterminated ? "\n" : "",
+						rating, fn) > 0;
+				ok = (fclose (rf) == 0) && ok;
+			}
+			else
+				ok = 0;
+
+			/* the new line will be indexed when it's read again */
+			if (d) dir_free (d);
 		}
 	}
-	else if (r0 != rating)
+	else if (re->rating != rating)
 	{
 		/* update existing entry */
-		assert (rating >= 0 && rating <= 5);
-		if (0 == fseek (rf, filepos, SEEK_SET))
+		FILE *rf = fopen (path, "rb+");
+		if (rf && fseek (rf, re->pos, SEEK_SET) == 0)
+			ok = (fputc ('0' + rating, rf) != EOF);
+		else
+			ok = 0;
+		if (rf) ok = (fclose (rf) == 0) && ok;
+
+		if (ok)
 		{
-			ok = (fputc ('0' + rating, rf) > 0);
+			re->rating = rating;
+			dir_written (d);
 		}
+		else
+			dir_free (d);
 	}
-	fclose (rf);
 
-	if (!ok) FAIL;
+	UNLOCK (cache_mtx);
+
+	free (path);
 
-	#undef FAIL
+	if (!ok)
+	{
+		server_error (__FILE__, __LINE__, "ratings_write_file", failmsg);
+		return 0;
+	}
 
 	return 1;
 }
 
+/* drop the cached ratings files */
+void ratings_cleanup ()
+{
+	int i;
+
+	LOCK (cache_mtx);
+	for (i = 0; i < RATINGS_CACHE_SIZE; i++)
+		if (cache[i].path) dir_free (&cache[i]);
+	UNLOCK (cache_mtx);
+}
@@ -13,6 +13,9 @@ bool ratings_write_file (const char *fn, int rating);
 /* read ratings for a file */
 void ratings_read_file (const char *fn, struct file_tags *tags);
 
+/* free the ratings kept in memory */
+void ratings_cleanup ();
+
 #ifdef __cplusplus
 }
 #endif
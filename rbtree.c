@@ -33,10 +33,27 @@ struct rb_node
 	const void *data;
 };
 
+/* The nodes are allocated from slabs owned by the tree, each twice the
+ * size of the previous one.  Deleted nodes go on a free list; clearing the
+ * tree keeps only the largest slab and doesn't visit the nodes. */
+#define RB_SLAB_MIN	64
+#define RB_SLAB_MAX	16384
+
+struct rb_slab
+{
+	struct rb_slab *next;	/* smaller, older slab */
+	int size;		/* nodes in the slab */
+	int used;		/* of them, handed out so far */
+	struct rb_node nodes[];
+};
+
 struct rb_tree
 {
 	struct rb_node *root;
 
+	struct rb_slab *slabs;	/* the newest (largest) first */
+	struct rb_node *free_nodes;	/* deleted, linked by 'right' */
+
 	/* compare function for two data elements */
 	rb_t_compare *cmp_fn;
 
@@ -50,6 +67,38 @@ struct rb_tree
 /* item used as a null value */
 static struct rb_node rb_null = { NULL, NULL, NULL, RB_BLACK, NULL };
 
+static struct rb_node *rb_node_alloc (struct rb_tree *t)
+{
+	struct rb_node *n;
+
+	if (t->free_nodes) {
+		n = t->free_nodes;
+		t->free_nodes = n->right;
+		return n;
+	}
+
+	if (!t->slabs || t->slabs->used == t->slabs->size) {
+		struct rb_slab *slab;
+		int size = t->slabs ? MIN(t->slabs->size * 2, RB_SLAB_MAX)
+		                    : RB_SLAB_MIN;
+
+		slab = (struct rb_slab *)xmalloc (sizeof (struct rb_slab)
+				+ size * sizeof (struct rb_node));
+		slab->next = t->slabs;
+		slab->size = size;
+		slab->used = 0;
+		t->slabs = slab;
+	}
+
+	return &t->slabs->nodes[t->slabs->used++];
+}
+
+static void rb_node_free (struct rb_tree *t, struct rb_node *n)
+{
+	n->right = t->free_nodes;
+	t->free_nodes = n;
+}
+
 static void rb_left_rotate (struct rb_node **root, struct rb_node *x)
 {
 	struct rb_node *y = x->right;
@@ -228,7 +277,7 @@ void rb_insert (struct rb_tree *t, void *data)
 
 	x = t->root;
 	y = &rb_null;
-	z = (struct rb_node *)xmalloc (sizeof(struct rb_node));
+	z = rb_node_alloc (t);
 
 	z->data = data;
 
@@ -377,7 +426,7 @@ void rb_delete (struct rb_tree *t, const void *key)
 		if (y->color == RB_BLACK)
 			rb_delete_fixup (&t->root, x, parent);
 
-		free (y);
+		rb_node_free (t, y);
 	}
 }
 
@@ -393,6 +442,8 @@ struct rb_tree *rb_tree_new (rb_t_compare *cmp_fn,
 	t = xmalloc (sizeof (*t));
 
 	t->root = &rb_null;
+	t->slabs = NULL;
+	t->free_nodes = NULL;
 	t->cmp_fn = cmp_fn;
 	t->cmp_key_fn = cmp_key_fn;
 	t->adata = adata;
@@ -400,25 +451,30 @@ struct rb_tree *rb_tree_new (rb_t_compare *cmp_fn,
 	return t;
 }
 
-static void rb_destroy (struct rb_node *n)
+/* Free the slab and all older ones. */
+static void rb_free_slabs (struct rb_slab *slab)
 {
-	if (n != &rb_null) {
-		rb_destroy (n->right);
-		rb_destroy (n->left);
-		free (n);
+	while (slab) {
+		struct rb_slab *next = slab->next;
+
+		free (slab);
+		slab = next;
 	}
 }
 
+/* Remove all nodes.  The largest slab is kept for the nodes inserted
+ * next. */
 void rb_tree_clear (struct rb_tree *t)
 {
 	assert (t != NULL);
 	assert (t->root != NULL);
 
-	if (t->root != &rb_null) {
-		rb_destroy (t->root->left);
-		rb_destroy (t->root->right);
-		free (t->root);
-		t->root = &rb_null;
+	t->root = &rb_null;
+	t->free_nodes = NULL;
+	if (t->slabs) {
+		rb_free_slabs (t->slabs->next);
+		t->slabs->next = NULL;
+		t->slabs->used = 0;
 	}
 }
 
@@ -427,6 +483,6 @@ void rb_tree_free (struct rb_tree *t)
 	assert (t != NULL);
 	assert (t->root != NULL);
 
-	rb_tree_clear (t);
+	rb_free_slabs (t->slabs);
 	free (t);
 }
@@ -21,31 +21,42 @@
 
 #include <assert.h>
 
+#include "common.h"
+#include "conv_memo.h"
 #include "rcc.h"
 
-char *rcc_reencode (char *str)
-{
-	char *result = str;
-
-	assert (str != NULL);
-
 #ifdef HAVE_RCC
+/* The strings detected and converted last, the same artist and album come
+ * with every file of an album. */
+#define RCC_MEMO_SIZE	256
+static struct conv_memo *rcc_memo = NULL;
+
+static char *rcc_convert (const char *str,
+		const void *unused ATTR_UNUSED)
+{
+	char *result = NULL;
 	rcc_string rccstring;
 
 	rccstring = rccFrom (NULL, 0, str);
 	if (rccstring) {
-		if (*rccstring) {
-			char *reencoded;
-
-			reencoded = rccToCharset (NULL, "UTF-8", rccstring);
-			if (reencoded) {
-		    	free (result);
-		    	result = reencoded;
-			}
-		}
-
+		if (*rccstring)
+			result = rccToCharset (NULL, "UTF-8", rccstring);
 		free (rccstring);
 	}
+
+	return result ? result : xstrdup (str);
+}
+#endif /* HAVE_RCC */
+
+char *rcc_reencode (char *str)
+{
+	char *result = str;
+
+	assert (str != NULL);
+
+#ifdef HAVE_RCC
+	result = conv_memo_convert (rcc_memo, str, rcc_convert, NULL);
+	free (str);
 #endif /* HAVE_RCC */
 
 	return result;
@@ -54,6 +65,8 @@ char *rcc_reencode (char *str)
 void rcc_init ()
 {
 #ifdef HAVE_RCC
+	rcc_memo = conv_memo_new (RCC_MEMO_SIZE);
+
 	rcc_class classes[] = {
 		{"input", RCC_CLASS_STANDARD, NULL, NULL, "Input Encoding", 0},
 		{"output", RCC_CLASS_KNOWN, NULL, NULL, "Output Encoding", 0},
@@ -72,6 +85,8 @@ void rcc_init ()
 void rcc_cleanup ()
 {
 #ifdef HAVE_RCC
+	conv_memo_free (rcc_memo);
+	rcc_memo = NULL;
 	rccFree ();
 #endif /* HAVE_RCC */
 }
@@ -0,0 +1,262 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Seek index: time -> file position samples collected by decoders for
+ * formats that have no seek table of their own.  It is stored next to
+ * the file's record in the tags cache, so seeking in a file played
+ * before doesn't need to estimate or scan. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "seek_index.h"
+#include "tags_cache.h"
+
+/* The index has at most SEEK_INDEX_MAX slots of SEEK_INDEX_STEP seconds.
+ * When a point beyond the last slot is added, pairs of slots are merged
+ * and the step doubled. */
+#define SEEK_INDEX_MAX	1024
+#define SEEK_INDEX_STEP	1.0
+
+/* Identifies the seek index among what decoders store in the cache. */
+#define SEEK_INDEX_MAGIC	(('S' << 24) | ('I' << 16) | ('D' << 8) | '1')
+
+/* The stored index: this header followed by slots points. */
+struct seek_index_hdr
+{
+	uint32_t magic;
+	uint32_t slots;
+	double step;
+	double duration;
+};
+
+struct stored_point
+{
+	double time;
+	int64_t offset;
+};
+
+/* Return the slot of the time.  A point exactly at the slot's start
+ * shouldn't land in the previous slot because of rounding. */
+static unsigned int slot_of (const struct seek_index *idx, double time)
+{
+	double slot = time / idx->step + 1e-6;
+
+	return slot < (double)SEEK_INDEX_MAX ? (unsigned int)slot
+	                                     : SEEK_INDEX_MAX;
+}
+
+static void clear_points (struct seek_index *idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < SEEK_INDEX_MAX; i++)
+		idx->points[i].time = -1.0;
+	idx->slots = 0;
+}
+
+/* Merge pairs of slots, keeping the earlier point of each pair. */
+static void thin_out (struct seek_index *idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < SEEK_INDEX_MAX / 2; i++) {
+		if (idx->points[2 * i].time >= 0.0)
+			idx->points[i] = idx->points[2 * i];
+		else
+			idx->points[i] = idx->points[2 * i + 1];
+	}
+	for (; i < SEEK_INDEX_MAX; i++)
+		idx->points[i].time = -1.0;
+
+	idx->slots = (idx->slots + 1) / 2;
+	idx->step *= 2;
+}
+
+/* Read the index from the cache, return 0 if there is no usable one. */
+static int load (struct seek_index *idx)
+{
+	struct seek_index_hdr hdr;
+	unsigned int i;
+	size_t len;
+	char *buf;
+
+	buf = (char *)tags_cache_get_seek_table (idx->file, &len);
+	if (!buf)
+		return 0;
+
+	if (len >= sizeof(hdr))
+		memcpy (&hdr, buf, sizeof(hdr));
+	if (len < sizeof(hdr) || hdr.magic != SEEK_INDEX_MAGIC
+			|| hdr.slots > SEEK_INDEX_MAX || !(hdr.step > 0.0)
+			|| len != sizeof(hdr)
+			          + hdr.slots * sizeof(struct stored_point)) {
+		logit ("Bad seek index in the cache for %s", idx->file);
+		free (buf);
+		return 0;
+	}
+
+	for (i = 0; i < hdr.slots; i++) {
+		struct stored_point point;
+
+		memcpy (&point, buf + sizeof(hdr) + i * sizeof(point),
+		        sizeof(point));
+		idx->points[i].time = point.time;
+		idx->points[i].offset = point.offset;
+	}
+
+	idx->slots = hdr.slots;
+	idx->step = hdr.step;
+	idx->duration = hdr.duration;
+
+	free (buf);
+
+	debug ("Seek index for %s: %u slots of %.1fs", idx->file,
+	       idx->slots, idx->step);
+
+	return 1;
+}
+
+static void store (const struct seek_index *idx)
+{
+	struct seek_index_hdr hdr;
+	unsigned int i;
+	size_t len;
+	char *buf;
+
+	hdr.magic = SEEK_INDEX_MAGIC;
+	hdr.slots = idx->slots;
+	hdr.step = idx->step;
+	hdr.duration = idx->duration;
+
+	len = sizeof(hdr) + idx->slots * sizeof(struct stored_point);
+	buf = (char *)xmalloc (len);
+	memcpy (buf, &hdr, sizeof(hdr));
+
+	for (i = 0; i < idx->slots; i++) {
+		struct stored_point point;
+
+		point.time = idx->points[i].time;
+		point.offset = idx->points[i].offset;
+		memcpy (buf + sizeof(hdr) + i * sizeof(point), &point,
+		        sizeof(point));
+	}
+
+	tags_cache_put_seek_table (idx->file, buf, len);
+	free (buf);
+}
+
+/* Get the seek index for the file, empty if it isn't in the cache. */
+struct seek_index *seek_index_open (const char *file)
+{
+	struct seek_index *idx;
+
+	assert (file != NULL);
+
+	idx = (struct seek_index *)xmalloc (sizeof (struct seek_index));
+	idx->file = xstrdup (file);
+	idx->step = SEEK_INDEX_STEP;
+	idx->duration = 0.0;
+	idx->modified = 0;
+	idx->points = (struct seek_point *)xmalloc (SEEK_INDEX_MAX
+	                                     * sizeof (struct seek_point));
+	clear_points (idx);
+
+	load (idx);
+
+	return idx;
+}
+
+/* Store the index in the cache if it has changed and free it. */
+void seek_index_close (struct seek_index *idx)
+{
+	assert (idx != NULL);
+
+	if (idx->modified && idx->slots)
+		store (idx);
+
+	free (idx->points);
+	free (idx->file);
+	free (idx);
+}
+
+/* Drop all points and use slots of step seconds (0.0 for the default). */
+void seek_index_reset (struct seek_index *idx, double step)
+{
+	assert (idx != NULL);
+	assert (step >= 0.0);
+
+	clear_points (idx);
+	idx->step = step > 0.0 ? step : SEEK_INDEX_STEP;
+	idx->duration = 0.0;
+	idx->modified = 1;
+}
+
+/* Note that decoding can start at offset for the time. */
+void seek_index_add (struct seek_index *idx, double time, off_t offset)
+{
+	unsigned int slot;
+
+	assert (idx != NULL);
+
+	if (time < 0.0 || offset < 0)
+		return;
+
+	while ((slot = slot_of (idx, time)) >= SEEK_INDEX_MAX)
+		thin_out (idx);
+
+	if (idx->points[slot].time >= 0.0 && idx->points[slot].time <= time)
+		return;
+
+	idx->points[slot].time = time;
+	idx->points[slot].offset = offset;
+	idx->slots = MAX(idx->slots, slot + 1);
+	idx->modified = 1;
+}
+
+/* Mark the index as covering the whole file. */
+void seek_index_set_duration (struct seek_index *idx, double duration)
+{
+	assert (idx != NULL);
+
+	idx->duration = duration;
+	idx->modified = 1;
+}
+
+/* Return the last point at or before the time, NULL if there is none. */
+const struct seek_point *seek_index_find (const struct seek_index *idx,
+                                          double time)
+{
+	unsigned int slot;
+
+	assert (idx != NULL);
+
+	if (!idx->slots || time < 0.0)
+		return NULL;
+
+	slot = MIN(slot_of (idx, time), idx->slots - 1);
+	while (idx->points[slot].time < 0.0 || idx->points[slot].time > time) {
+		if (slot == 0)
+			return NULL;
+		slot--;
+	}
+
+	return &idx->points[slot];
+}
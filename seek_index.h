@@ -0,0 +1,43 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A position in the file from which decoding can start. */
+struct seek_point
+{
+	double time;		/* Time in seconds, negative for an empty slot */
+	off_t offset;		/* Position of the frame/page starting there */
+};
+
+/* Seek points for a file in slots of step seconds, at most one point
+ * (the earliest known) per slot.  Decoders add points as they decode;
+ * the index is kept in the tags cache between plays. */
+struct seek_index
+{
+	char *file;
+	double step;		/* Time covered by each slot */
+	double duration;	/* Total time if the whole file was indexed,
+				   otherwise 0.0 */
+	unsigned int slots;	/* Number of used slots */
+	struct seek_point *points;
+	int modified;		/* Not yet stored in the cache? */
+};
+
+struct seek_index *seek_index_open (const char *file);
+void seek_index_close (struct seek_index *idx);
+void seek_index_reset (struct seek_index *idx, double step);
+void seek_index_add (struct seek_index *idx, double time, off_t offset);
+void seek_index_set_duration (struct seek_index *idx, double duration);
+const struct seek_point *seek_index_find (const struct seek_index *idx,
+                                          double time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
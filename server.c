@@ -17,7 +17,11 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
 #ifdef HAVE_GETRLIMIT
 # include <sys/resource.h>
 #endif
@@ -48,6 +52,11 @@
 #include "softmixer.h"
 #include "equalizer.h"
 #include "ratings.h"
+#include "io.h"
+#include "status_page.h"
+#include "stats.h"
+#include "startup.h"
+#include "hooks.h"
 #ifdef HAVE_MPRIS
 # include "mpris.h"
 #endif
@@ -65,9 +74,76 @@ struct client
 	int can_send_plist;	/* can this client send a playlist? */
 	int lock;		/* is this client locking us? */
 	int serial;		/* used for generating unique serial numbers */
+	int id;			/* index in the clients table */
+	int watched;		/* WATCH_* events the loop waits for */
 };
 
-static struct client clients[CLIENTS_MAX];
+/* Clients are kept in chunks allocated when more clients connect.  Chunks
+ * are never moved or freed while the server runs, so other threads can
+ * use a client while the table grows. */
+#define CLIENTS_CHUNK	16
+#define CLIENT(i)	(&client_chunks[(i) / CLIENTS_CHUNK][(i) % CLIENTS_CHUNK])
+
+static struct client *client_chunks[CLIENTS_MAX / CLIENTS_CHUNK];
+
+/* Number of client slots in the chunks. */
+static int clients_num = 0;
+
+/* Guards growing the table for threads other than the server thread. */
+static pthread_mutex_t clients_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* The clients' playlist.  The server keeps it up to date from the
+ * CMD_CLI_PLIST_* commands and the tags read for the clients, sends it to
+ * clients asking for the playlist and remembers the last changes, so a
+ * client with an older version of it gets only the changes made since. */
+static struct plist clients_plist;
+
+/* Is the content of clients_plist known?  It is once a client has loaded
+ * a playlist or said it has one. */
+static bool clients_plist_valid = false;
+
+/* Number of changes made to clients_plist, counted from a base that
+ * differs between the server's runs, so copies of the playlist saved by
+ * clients of another server don't match. */
+static int clients_plist_version = 0;
+
+/* How many of the last changes are kept. */
+#define PLIST_CHANGES_MAX	1024
+
+/* Playlist events for the last changes, the change making version v is
+ * at v % PLIST_CHANGES_MAX. */
+static struct event plist_changes[PLIST_CHANGES_MAX];
+static int plist_changes_num = 0;
+
+/* Guards clients_plist against the threads reading tags. */
+static pthread_mutex_t clients_plist_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Events the server loop waits for on a descriptor. */
+#define WATCH_READ	0x01
+#define WATCH_WRITE	0x02
+
+/* Tokens for the descriptors which are not clients' sockets. */
+#define WATCH_SERVER	-1
+#define WATCH_WAKE_UP	-2
+
+/* A descriptor ready for the events. */
+struct watch_event
+{
+	int token;	/* client index or WATCH_SERVER or WATCH_WAKE_UP */
+	int fd;
+	int events;
+};
+
+/* Maximum number of ready descriptors handled in one loop pass. */
+#define WATCH_EVENTS_MAX	64
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+#else
+static struct pollfd *poll_fds = NULL;
+static int *poll_tokens = NULL;
+static int poll_allocated = 0;
+#endif
 
 /* Thread ID of the server thread. */
 static pthread_t server_tid;
@@ -77,7 +153,7 @@ static pthread_t server_tid;
 static pthread_t mpris_tid;
 #endif
 
-/* Pipe used to wake up the server from select() from another thread. */
+/* Pipe used to wake up the server from waiting for events from another thread. */
 static int wake_up_pipe[2];
 
 /* Socket used to accept incoming client connections. */
@@ -101,8 +177,6 @@ static struct {
 
 struct tags_cache *tags_cache;
 
-extern char **environ;
-
 static void write_pid_file ()
 {
 	char *fname = create_file_name (PID_FILE);
@@ -160,24 +234,66 @@ static void sig_exit (int sig)
 
 static void clients_init ()
 {
-	int i;
-
-	for (i = 0; i < CLIENTS_MAX; i++) {
-		clients[i].socket = -1;
-		pthread_mutex_init (&clients[i].events_mtx, NULL);
-	}
+	clients_num = 0;
 }
 
 static void clients_cleanup ()
 {
 	int i, rc;
 
-	for (i = 0; i < CLIENTS_MAX; i++) {
-		clients[i].socket = -1;
-		rc = pthread_mutex_destroy (&clients[i].events_mtx);
+	for (i = 0; i < clients_num; i++) {
+		CLIENT(i)->socket = -1;
+		rc = pthread_mutex_destroy (&CLIENT(i)->events_mtx);
 		if (rc != 0)
 			log_errno ("Can't destroy events mutex", rc);
 	}
+
+	for (i = 0; i < clients_num / CLIENTS_CHUNK; i++) {
+		free (client_chunks[i]);
+		client_chunks[i] = NULL;
+	}
+
+	clients_num = 0;
+}
+
+static void clients_plist_init ()
+{
+	unsigned int seed;
+
+	/* The serial number is the clients' one, told by
+	 * CMD_CLI_PLIST_SERIAL. */
+	plist_init (&clients_plist);
+
+	seed = (unsigned int)time (NULL) ^ ((unsigned int)getpid () << 8);
+	clients_plist_version = (int)(seed % 0x3fff + 1) << 16;
+}
+
+/* Add a chunk of free client slots to the table.  Return 0 if the table
+ * is full. */
+static int grow_clients ()
+{
+	struct client *chunk;
+	int i;
+
+	if (clients_num == CLIENTS_MAX)
+		return 0;
+
+	chunk = (struct client *)xcalloc (CLIENTS_CHUNK, sizeof(struct client));
+	for (i = 0; i < CLIENTS_CHUNK; i++) {
+		chunk[i].socket = -1;
+		chunk[i].id = clients_num + i;
+		pthread_mutex_init (&chunk[i].events_mtx, NULL);
+		event_queue_init (&chunk[i].events);
+	}
+
+	LOCK (clients_mtx);
+	client_chunks[clients_num / CLIENTS_CHUNK] = chunk;
+	clients_num += CLIENTS_CHUNK;
+	UNLOCK (clients_mtx);
+
+	logit ("Client table grown to %d slots", clients_num);
+
+	return 1;
 }
 
 /* Add a client to the list, return 1 if ok, 0 on error (max clients exceeded) */
@@ -185,22 +301,26 @@ static int add_client (int sock)
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket == -1) {
-			clients[i].wants_plist_events = 0;
-			LOCK (clients[i].events_mtx);
-			event_queue_free (&clients[i].events);
-			event_queue_init (&clients[i].events);
-			UNLOCK (clients[i].events_mtx);
-			clients[i].socket = sock;
-			clients[i].requests_plist = 0;
-			clients[i].can_send_plist = 0;
-			clients[i].lock = 0;
-			tags_cache_clear_queue (tags_cache, i);
-			return 1;
-		}
+	for (i = 0; i < clients_num; i++)
+		if (CLIENT(i)->socket == -1)
+			break;
+
+	if (i == clients_num && !grow_clients ())
+		return 0;
 
-	return 0;
+	CLIENT(i)->wants_plist_events = 0;
+	LOCK (CLIENT(i)->events_mtx);
+	event_queue_free (&CLIENT(i)->events);
+	event_queue_init (&CLIENT(i)->events);
+	UNLOCK (CLIENT(i)->events_mtx);
+	CLIENT(i)->socket = sock;
+	CLIENT(i)->requests_plist = 0;
+	CLIENT(i)->can_send_plist = 0;
+	CLIENT(i)->lock = 0;
+	CLIENT(i)->watched = 0;
+	tags_cache_clear_queue (tags_cache, i);
+
+	return 1;
 }
 
 /* Return index of a client that has a lock acquired. Return -1 if there is no
@@ -209,8 +329,8 @@ static int locking_client ()
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1 && clients[i].lock)
+	for (i = 0; i < clients_num; i++)
+		if (CLIENT(i)->socket != -1 && CLIENT(i)->lock)
 			return i;
 	return -1;
 }
@@ -249,23 +369,26 @@ static int client_unlock (struct client *cli)
 	return 1;
 }
 
-/* Return the client index from the clients table. */
-static int client_index (const struct client *cli)
-{
-	int i;
+/* Set when the status page must be updated by the server's thread. */
+static int status_page_dirty = 0;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket == cli->socket)
-			return i;
-	return -1;
-}
+static void watch_init ();
+static void watch_set (const int fd, const int token, const int old_events,
+		const int events);
 
 static void del_client (struct client *cli)
 {
+	/* The socket is usually closed already, which removes it from epoll
+	 * by itself. */
+	if (cli->watched)
+		watch_set (cli->socket, cli->id, cli->watched, 0);
+	cli->watched = 0;
+
+	recv_buf_free (cli->socket);
 	cli->socket = -1;
 	LOCK (cli->events_mtx);
 	event_queue_free (&cli->events);
-	tags_cache_clear_queue (tags_cache, client_index(cli));
+	tags_cache_clear_queue (tags_cache, cli->id);
 	UNLOCK (cli->events_mtx);
 }
 
@@ -285,6 +408,13 @@ static void wake_up_server ()
 		log_errno ("Can't wake up the server: (write() failed)", errno);
 }
 
+/* Make the server's thread update the status page. */
+static void status_page_changed ()
+{
+	ATOMIC_STORE (&status_page_dirty, 1);
+	wake_up_server ();
+}
+
 static void redirect_output (FILE *stream)
 {
 	FILE *rc;
@@ -334,29 +464,15 @@ static void run_extern_cmd (const char *event)
 {
 	char *command;
 
-	command = xstrdup (options_get_str (event));
+	command = options_get_str (event);
 
 	if (command) {
-		char *args[2], *err;
+		char *args[2];
 
-		args[0] = xstrdup (command);
+		args[0] = command;
 		args[1] = NULL;
 
-		switch (fork ()) {
-		case 0:
-			execve (command, args, environ);
-			fatal ("Error when running %s command '%s': %s",
-			        event, command, xstrerror (errno));
-		case -1:
-			err = xstrerror (errno);
-			logit ("Error when running %s command '%s': %s",
-			        event, command, err);
-			free (err);
-			break;
-		}
-
-		free (command);
-		free (args[0]);
+		hooks_run (event, args);
 	}
 }
 
@@ -366,6 +482,7 @@ void server_init (int debugging, int foreground)
 	struct sockaddr_un sock_name;
 	pid_t pid;
 
+	startup_begin ("server_init");
 	logit ("Starting MOC Server");
 
 	assert (server_sock == -1);
@@ -420,13 +537,25 @@ void server_init (int debugging, int foreground)
 	log_pthread_stack_size ();
 
 	clients_init ();
+	clients_plist_init ();
+	watch_init ();
+	status_page_init ();
+	startup_begin ("audio_initialize");
 	audio_initialize ();
-	tags_cache = tags_cache_new (options_get_int("TagsCacheSize"));
+	startup_end ();
+	startup_begin ("tags_cache_load");
+	tags_cache = tags_cache_new (options_get_int("TagsCacheSize"),
+	                             options_get_int("TagsMemCacheSize"),
+	                             options_get_int("TagsReaderThreads"));
 	tags_cache_load (tags_cache, create_file_name("cache"));
+	startup_end ();
+	status_page_dirty = 1;
 
 #ifdef HAVE_MPRIS
+	startup_begin ("mpris_init");
 	mpris_init ();
 	pthread_create (&mpris_tid, NULL, mpris_thread, NULL);
+	startup_end ();
 #endif
 
 	server_tid = pthread_self ();
@@ -446,10 +575,13 @@ void server_init (int debugging, int foreground)
 		redirect_output (stderr);
 	}
 
+	hooks_init ();
+
 	logit ("Running OnServerStart");
 	run_extern_cmd ("OnServerStart");
 
-	return;
+	startup_end ();
+	startup_profile ("startup_server");
 }
 
 /* Send EV_DATA and the integer value. Return 0 on error. */
@@ -603,35 +735,38 @@ static void on_song_change ()
 	}
 #endif
 
-	switch (fork ()) {
-	case 0:
-		args = lists_strs_save (arg_list);
-		execve (args[0], args, environ);
-		fatal ("Error when running OnSongChange command '%s': %s",
-		        args[0], xstrerror (errno));
-	case -1:
-		log_errno ("Failed to fork()", errno);
-	}
+	args = lists_strs_save (arg_list);
+	hooks_run ("OnSongChange", args);
+	free (args);
 
 	lists_strs_free (arg_list);
 	free (last_file);
 	last_file = curr_file;
 }
 
-/* Return true iff 'event' is a playlist event. */
-static inline bool is_plist_event (const int event)
+/* Return a copy of the event's data. */
+static void *event_data_dup (const int event, const void *data)
 {
-	bool result = false;
+	void *data_copy = NULL;
 
-	switch (event) {
-	case EV_PLIST_ADD:
-	case EV_PLIST_DEL:
-	case EV_PLIST_MOVE:
-	case EV_PLIST_CLEAR:
-		result = true;
+	if (event == EV_PLIST_ADD || event == EV_QUEUE_ADD) {
+		data_copy = plist_new_item ();
+		plist_item_copy (data_copy, data);
+	}
+	else if (event == EV_PLIST_DEL
+	      || event == EV_QUEUE_DEL
+	      || event == EV_STATUS_MSG
+	      || event == EV_SRV_ERROR) {
+		data_copy = xstrdup (data);
 	}
+	else if (event == EV_PLIST_MOVE || event == EV_QUEUE_MOVE)
+		data_copy = move_ev_data_dup ((struct move_ev_data *)data);
+	else if (event == EV_FILE_TAGS)
+		data_copy = tag_ev_data_dup ((struct tag_ev_response *)data);
+	else
+		logit ("Unhandled data!");
 
-	return result;
+	return data_copy;
 }
 
 void add_event_all (const int event, const void *data)
@@ -650,43 +785,23 @@ void add_event_all (const int event, const void *data)
 		}
 	}
 
-	for (i = 0; i < CLIENTS_MAX; i++) {
+	LOCK (clients_mtx);
+	for (i = 0; i < clients_num; i++) {
 		void *data_copy = NULL;
 
-		if (clients[i].socket == -1)
+		if (CLIENT(i)->socket == -1)
 			continue;
 
-		if (!clients[i].wants_plist_events && is_plist_event (event))
+		if (!CLIENT(i)->wants_plist_events && is_plist_event (event))
 			continue;
 
-		if (data) {
-			if (event == EV_PLIST_ADD
-			 || event == EV_QUEUE_ADD) {
-				data_copy = plist_new_item ();
-				plist_item_copy (data_copy, data);
-			}
-			else if (event == EV_PLIST_DEL
-			      || event == EV_QUEUE_DEL
-			      || event == EV_STATUS_MSG
-			      || event == EV_SRV_ERROR) {
-				data_copy = xstrdup (data);
-			}
-			else if (event == EV_PLIST_MOVE
-			      || event == EV_QUEUE_MOVE)
-				data_copy = move_ev_data_dup (
-						(struct move_ev_data *)
-						data);
-			else if (event == EV_FILE_TAGS)
-				data_copy = tag_ev_data_dup (
-						(struct tag_ev_response *)
-						data);
-			else
-				logit ("Unhandled data!");
-		}
+		if (data)
+			data_copy = event_data_dup (event, data);
 
-		add_event (&clients[i], event, data_copy);
+		add_event (CLIENT(i), event, data_copy);
 		added++;
 	}
+	UNLOCK (clients_mtx);
 
 	if (added)
 		wake_up_server ();
@@ -694,6 +809,133 @@ void add_event_all (const int event, const void *data)
 		debug ("No events have been added because there are no clients");
 }
 
+static void clients_plist_free ()
+{
+	int i;
+
+	for (i = 0; i < PLIST_CHANGES_MAX; i++) {
+		if (plist_changes[i].data)
+			free_event_data (plist_changes[i].type,
+					plist_changes[i].data);
+		plist_changes[i].data = NULL;
+	}
+	plist_changes_num = 0;
+
+	plist_free (&clients_plist);
+}
+
+/* Make the change to clients_plist the clients make when they get the
+ * playlist event and remember it as the next version. */
+static void clients_plist_change (const int event, const void *data)
+{
+	struct event *change;
+	int num;
+
+	LOCK (clients_plist_mtx);
+
+	switch (event) {
+		case EV_PLIST_ADD:
+			if (plist_find_fname (&clients_plist,
+						((struct plist_item *)data)->file) == -1)
+				plist_add_from_item (&clients_plist, data);
+			break;
+		case EV_PLIST_DEL:
+			num = plist_find_fname (&clients_plist, data);
+			if (num != -1)
+				plist_delete (&clients_plist, num);
+			break;
+		case EV_PLIST_MOVE:
+			plist_swap_files (&clients_plist,
+					((struct move_ev_data *)data)->from,
+					((struct move_ev_data *)data)->to);
+			break;
+		case EV_PLIST_CLEAR:
+			plist_clear (&clients_plist);
+			break;
+	}
+
+	clients_plist_valid = true;
+	clients_plist_version++;
+
+	change = &plist_changes[clients_plist_version % PLIST_CHANGES_MAX];
+	if (change->data)
+		free_event_data (change->type, change->data);
+	change->type = event;
+	change->data = data ? event_data_dup (event, data) : NULL;
+	if (plist_changes_num < PLIST_CHANGES_MAX)
+		plist_changes_num++;
+
+	UNLOCK (clients_plist_mtx);
+}
+
+/* Update the tags of the file on clients_plist with the tags read for
+ * a client. */
+static void clients_plist_update_tags (const char *file,
+		const struct file_tags *tags)
+{
+	int num;
+
+	LOCK (clients_plist_mtx);
+
+	num = plist_find_fname (&clients_plist, file);
+	if (num != -1) {
+		struct file_tags *new_tags = tags_dup (tags);
+		struct file_tags *old_tags = plist_get_tags (&clients_plist, num);
+
+		if (old_tags) {
+			tags_update (new_tags, old_tags, 1);
+			tags_free (old_tags);
+		}
+
+		plist_set_tags (&clients_plist, num, new_tags);
+		tags_free (new_tags);
+
+		if (clients_plist.items[num].title_tags) {
+			free (clients_plist.items[num].title_tags);
+			clients_plist.items[num].title_tags = NULL;
+		}
+		make_tags_title (&clients_plist, num);
+	}
+
+	UNLOCK (clients_plist_mtx);
+}
+
+/* Drop the playlist events queued for the client: they are for changes
+ * already made to the playlist the client is about to get. */
+static void drop_plist_events (struct client *cli)
+{
+	LOCK (cli->events_mtx);
+	event_queue_drop (&cli->events, is_plist_event);
+	UNLOCK (cli->events_mtx);
+}
+
+/* Send clients_plist to the client as EV_DATA followed by the serial
+ * number, the version and the items.  From now on the client gets the
+ * playlist events for the next changes.  Return 0 on error. */
+static int send_clients_plist (struct client *cli)
+{
+	int res;
+
+	LOCK (clients_plist_mtx);
+
+	drop_plist_events (cli);
+	cli->wants_plist_events = 1;
+
+	res = send_int (cli->socket, EV_DATA)
+		&& send_int (cli->socket, plist_get_serial (&clients_plist))
+		&& send_int (cli->socket, clients_plist_version)
+		&& send_plist_items (cli->socket, &clients_plist);
+
+	UNLOCK (clients_plist_mtx);
+
+	if (res)
+		logit ("Playlist sent");
+	else
+		logit ("Error while sending the playlist");
+
+	return res;
+}
+
 /* Send events from the queue. Return 0 on error. */
 static int flush_events (struct client *cli)
 {
@@ -709,20 +951,18 @@ static int flush_events (struct client *cli)
 	return st != NB_IO_ERR ? 1 : 0;
 }
 
-/* Send events to clients whose sockets are ready to write. */
-static void send_events (fd_set *fds)
+/* Finish sending the events packet flush_events() has sent only partly,
+ * before anything is written directly to the client's socket.  Return 0
+ * on error. */
+static int flush_pending_events (struct client *cli)
 {
-	int i;
+	int res;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1
-				&& FD_ISSET(clients[i].socket, fds)) {
-			debug ("Flushing events for client %d", i);
-			if (!flush_events (&clients[i])) {
-				close (clients[i].socket);
-				del_client (&clients[i]);
-			}
-		}
+	LOCK (cli->events_mtx);
+	res = event_send_pending (cli->socket, &cli->events);
+	UNLOCK (cli->events_mtx);
+
+	return res;
 }
 
 /* End playing and cleanup. */
@@ -730,13 +970,17 @@ static void server_shutdown ()
 {
 	logit ("Server exiting...");
 	audio_exit ();
+	status_page_cleanup ();
 #ifdef HAVE_MPRIS
 	mpris_exit ();
 #endif
 	tags_cache_free (tags_cache);
 	tags_cache = NULL;
+	ratings_cleanup ();
+	clients_plist_free ();
 	logit ("Running OnServerStop");
 	run_extern_cmd ("OnServerStop");
+	hooks_cleanup ();
 	unlink (socket_name());
 	unlink (create_file_name(PID_FILE));
 	close (wake_up_pipe[0]);
@@ -758,14 +1002,13 @@ static int req_list_add (struct client *cli)
 {
 	char *file;
 
-	file = get_str (cli->socket);
+	file = get_str_arena (cli->socket);
 	if (!file)
 		return 0;
 
 	logit ("Adding '%s' to the list", file);
 
 	audio_plist_add (file);
-	free (file);
 
 	return 1;
 }
@@ -776,7 +1019,7 @@ static int req_queue_add (const struct client *cli)
 	char *file;
 	struct plist_item *item;
 
-	file = get_str (cli->socket);
+	file = get_str_arena (cli->socket);
 	if (!file)
 		return 0;
 
@@ -800,7 +1043,6 @@ static int req_queue_add (const struct client *cli)
 
 	plist_free_item_fields (item);
 	free (item);
-	free (file);
 
 	return 1;
 }
@@ -810,12 +1052,11 @@ static int req_play (struct client *cli)
 {
 	char *file;
 
-	if (!(file = get_str(cli->socket)))
+	if (!(file = get_str_arena(cli->socket)))
 		return 0;
 
 	logit ("Playing %s", *file ? file : "first element on the list");
 	audio_play (file);
-	free (file);
 
 	return 1;
 }
@@ -935,6 +1176,89 @@ void server_error (const char *file, int line, const char *function,
 	add_event_all (EV_SRV_ERROR, msg);
 }
 
+/* Send the I/O counters of the open streams to the client.  Return 0 on
+ * error. */
+static int send_io_stats (struct client *cli)
+{
+	int status = 1;
+	char *report = io_stats_report ();
+
+	if (!send_data_str(cli, report))
+		status = 0;
+	free (report);
+
+	return status;
+}
+
+/* Send the pipeline counters and the state of the clients' event queues
+ * to the client.  Return 0 on error. */
+static int send_stats (struct client *cli)
+{
+	int status = 1;
+	int i, clients = 0, events = 0, max_events = 0;
+	char *report, *msg;
+
+	for (i = 0; i < clients_num; i++) {
+		if (CLIENT(i)->socket == -1)
+			continue;
+
+		clients += 1;
+		LOCK (CLIENT(i)->events_mtx);
+		events += CLIENT(i)->events.num;
+		max_events = MAX(max_events, CLIENT(i)->events.num);
+		UNLOCK (CLIENT(i)->events_mtx);
+	}
+
+	report = stats_report ();
+	msg = format_msg ("%sClients: %d\n"
+	                  "EventsQueued: %d (%d at most for a client)\n",
+	                  report, clients, events, max_events);
+
+	if (!send_data_str(cli, msg))
+		status = 0;
+	free (msg);
+	free (report);
+
+	return status;
+}
+
+/* Write the output trace to a file and send its name to the client, or an
+ * empty string if there is nothing to write or it failed.  Return 0 on
+ * error. */
+static int send_output_trace (struct client *cli)
+{
+	int status = 1;
+	char *fname = stats_output_trace_dump ();
+
+	if (!send_data_str(cli, fname ? fname : ""))
+		status = 0;
+	free (fname);
+
+	return status;
+}
+
+/* Handle CMD_SCAN: start scanning the directory and send the client an
+ * empty string or why it couldn't be started.  Return 0 on error. */
+static int req_scan (struct client *cli)
+{
+	char *dir;
+	const char *err;
+	int status = 1;
+
+	if (!(dir = get_str(cli->socket)))
+		return 0;
+
+	logit ("Scan of %s requested", dir);
+	err = tags_cache_scan (tags_cache, dir);
+	if (err)
+		logit ("Can't scan %s: %s", dir, err);
+	if (!send_data_str(cli, err ? err : ""))
+		status = 0;
+	free (dir);
+
+	return status;
+}
+
 /* Send the song name to the client. Return 0 on error. */
 static int send_sname (struct client *cli)
 {
@@ -962,24 +1286,17 @@ static int send_option (struct client *cli)
 {
 	char *name;
 
-	if (!(name = get_str(cli->socket)))
+	if (!(name = get_str_arena(cli->socket)))
 		return 0;
 
 	/* We can send only a few options, others make no sense here. */
 	if (!valid_sync_option(name)) {
 		logit ("Client wanted to get invalid option '%s'", name);
-		free (name);
 		return 0;
 	}
 
 	/* All supported options are boolean type. */
-	if (!send_data_bool(cli, options_get_bool(name))) {
-		free (name);
-		return 0;
-	}
-
-	free (name);
-	return 1;
+	return send_data_bool (cli, options_get_bool(name));
 }
 
 /* Get and set an option from the client. Return 1 on error. */
@@ -988,19 +1305,16 @@ static int get_set_option (struct client *cli)
 	char *name;
 	int val;
 
-	if (!(name = get_str (cli->socket)))
+	if (!(name = get_str_arena (cli->socket)))
 		return 0;
 	if (!valid_sync_option (name)) {
 		logit ("Client requested setting invalid option '%s'", name);
 		return 0;
 	}
-	if (!get_int (cli->socket, &val)) {
-		free (name);
+	if (!get_int (cli->socket, &val))
 		return 0;
-	}
 
 	options_set_bool (name, val ? true : false);
-	free (name);
 
 #ifdef HAVE_MPRIS
 	mpris_status_change ();
@@ -1020,6 +1334,7 @@ static int set_mixer (struct client *cli)
 		return 0;
 
 	audio_set_mixer (val);
+	status_page_changed ();
 	return 1;
 }
 
@@ -1028,13 +1343,12 @@ static int delete_item (struct client *cli)
 {
 	char *file;
 
-	if (!(file = get_str(cli->socket)))
+	if (!(file = get_str_arena(cli->socket)))
 		return 0;
 
 	debug ("Request for deleting %s", file);
 
 	audio_plist_delete (file);
-	free (file);
 	return 1;
 }
 
@@ -1042,14 +1356,13 @@ static int req_queue_del (const struct client *cli)
 {
 	char *file;
 
-	if (!(file = get_str(cli->socket)))
+	if (!(file = get_str_arena(cli->socket)))
 		return 0;
 
 	debug ("Deleting '%s' from queue", file);
 
 	audio_queue_delete (file);
 	add_event_all (EV_QUEUE_DEL, file);
-	free (file);
 
 	return 1;
 }
@@ -1060,8 +1373,8 @@ static int find_sending_plist ()
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1 && clients[i].can_send_plist)
+	for (i = 0; i < clients_num; i++)
+		if (CLIENT(i)->socket != -1 && CLIENT(i)->can_send_plist)
 			return i;
 	return -1;
 }
@@ -1073,10 +1386,14 @@ static int get_client_plist (struct client *cli)
 
 	debug ("Client with fd %d requests the playlist", cli->socket);
 
-	/* Find the first connected client, and ask it to send the playlist.
+	/* Send our copy of the playlist if we have it.  Otherwise find the
+	 * first connected client, and ask it to send the playlist.
 	 * Here, send 1 if there is a client with the playlist, or 0 if there
 	 * isn't. */
 
+	if (clients_plist_valid)
+		return send_data_int (cli, 1) && send_clients_plist (cli);
+
 	cli->requests_plist = 1;
 
 	first = find_sending_plist ();
@@ -1091,7 +1408,8 @@ static int get_client_plist (struct client *cli)
 	if (!send_data_int(cli, 1))
 		return 0;
 
-	if (!send_int(clients[first].socket, EV_SEND_PLIST))
+	if (!flush_pending_events(CLIENT(first))
+			|| !send_int(CLIENT(first)->socket, EV_SEND_PLIST))
 		return 0;
 
 	return 1;
@@ -1102,8 +1420,8 @@ static int find_cli_requesting_plist ()
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].requests_plist)
+	for (i = 0; i < clients_num; i++)
+		if (CLIENT(i)->requests_plist)
 			return i;
 	return -1;
 }
@@ -1114,8 +1432,10 @@ static int req_send_plist (struct client *cli)
 {
 	int requesting = find_cli_requesting_plist ();
 	int send_fd;
-	struct plist_item *item;
 	int serial;
+	char *buf;
+	size_t len;
+	int items, res;
 
 	debug ("Client with fd %d wants to send its playlists", cli->socket);
 
@@ -1124,11 +1444,12 @@ static int req_send_plist (struct client *cli)
 		send_fd = -1;
 	}
 	else {
-		send_fd = clients[requesting].socket;
-		if (!send_int(send_fd, EV_DATA)) {
+		send_fd = CLIENT(requesting)->socket;
+		if (!flush_pending_events(CLIENT(requesting))
+				|| !send_int(send_fd, EV_DATA)) {
 			logit ("Error while sending response; disconnecting the client");
 			close (send_fd);
-			del_client (&clients[requesting]);
+			del_client (CLIENT(requesting));
 			send_fd = -1;
 		}
 	}
@@ -1138,54 +1459,54 @@ static int req_send_plist (struct client *cli)
 		return 0;
 	}
 
-	if (send_fd != -1 && !send_int(send_fd, serial)) {
+	/* The version is unknown, the client's copy won't be in sync. */
+	if (send_fd != -1 && (!send_int(send_fd, serial)
+				|| !send_int(send_fd, -1))) {
 		error ("Error while sending serial; disconnecting the client");
 		close (send_fd);
-		del_client (&clients[requesting]);
+		del_client (CLIENT(requesting));
 		send_fd = -1;
 	}
 
 	/* Even if no clients are requesting the playlist, we must read it,
-	 * because there is no way to say that we don't need it. */
-	while ((item = recv_item(cli->socket)) && item->file[0]) {
-		if (send_fd != -1 && !send_item(send_fd, item)) {
-			logit ("Error while sending item; disconnecting the client");
+	 * because there is no way to say that we don't need it.  The chunks
+	 * are passed on as they are, without decoding the items. */
+	while ((res = recv_plist_chunk(cli->socket, &buf, &len, &items))
+			&& buf) {
+		if (send_fd != -1 && !send_plist_chunk(send_fd, buf, len, items)) {
+			logit ("Error while sending items; disconnecting the client");
 			close (send_fd);
-			del_client (&clients[requesting]);
+			del_client (CLIENT(requesting));
 			send_fd = -1;
 		}
-		plist_free_item_fields (item);
-		free (item);
+		free (buf);
 	}
 
-	if (item) {
-		plist_free_item_fields (item);
-		free (item);
+	if (res)
 		logit ("Playlist sent");
-	}
 	else
-		logit ("Error while receiving item");
+		logit ("Error while receiving the playlist");
 
-	if (send_fd != -1 && !send_item (send_fd, NULL)) {
+	if (send_fd != -1 && !send_plist_chunk (send_fd, NULL, 0, 0)) {
 		logit ("Error while sending end of playlist mark; "
 		       "disconnecting the client");
 		close (send_fd);
-		del_client (&clients[requesting]);
+		del_client (CLIENT(requesting));
 		return 0;
 	}
 
 	if (requesting != -1)
-		clients[requesting].requests_plist = 0;
+		CLIENT(requesting)->requests_plist = 0;
 
-	return item ? 1 : 0;
+	return res;
 }
 
 /* Client requested we send the queue so we get it from audio.c and
  * send it to the client. */
 static int req_send_queue (struct client *cli)
 {
-	int i;
-	struct plist *queue;
+	int res;
+	const struct plist *queue;
 
 	logit ("Client with fd %d wants queue... sending it", cli->socket);
 
@@ -1197,24 +1518,11 @@ static int req_send_queue (struct client *cli)
 	}
 
 	queue = audio_queue_get_contents ();
+	res = send_plist_items (cli->socket, queue);
+	audio_queue_release (queue);
 
-	for (i = 0; i < queue->num; i++)
-		if (!plist_deleted(queue, i)) {
-			if(!send_item(cli->socket, &queue->items[i])){
-				logit ("Error sending queue; disconnecting the client");
-				close (cli->socket);
-				del_client (cli);
-				free (queue);
-				return 0;
-			}
-		}
-
-	plist_free (queue);
-	free (queue);
-
-	if (!send_item (cli->socket, NULL)) {
-		logit ("Error while sending end of playlist mark; "
-		       "disconnecting the client");
+	if (!res) {
+		logit ("Error sending queue; disconnecting the client");
 		close (cli->socket);
 		del_client (cli);
 		return 0;
@@ -1229,54 +1537,96 @@ static int req_send_queue (struct client *cli)
 static int plist_sync_cmd (struct client *cli, const int cmd)
 {
 	if (cmd == CMD_CLI_PLIST_ADD) {
-		struct plist_item *item;
+		struct plist_item item;
+		struct file_tags tags;
 
 		debug ("Sending EV_PLIST_ADD");
 
-		if (!(item = recv_item(cli->socket))) {
+		if (!recv_item_arena(cli->socket, &item, &tags)) {
 			logit ("Error while receiving item");
 			return 0;
 		}
 
-		add_event_all (EV_PLIST_ADD, item);
-		plist_free_item_fields (item);
-		free (item);
+		clients_plist_change (EV_PLIST_ADD, &item);
+		add_event_all (EV_PLIST_ADD, &item);
 	}
 	else if (cmd == CMD_CLI_PLIST_DEL) {
 		char *file;
 
 		debug ("Sending EV_PLIST_DEL");
 
-		if (!(file = get_str(cli->socket))) {
+		if (!(file = get_str_arena(cli->socket))) {
 			logit ("Error while receiving file");
 			return 0;
 		}
 
+		clients_plist_change (EV_PLIST_DEL, file);
 		add_event_all (EV_PLIST_DEL, file);
-		free (file);
 	}
 	else if (cmd == CMD_CLI_PLIST_MOVE) {
 		struct move_ev_data m;
 
-		if (!(m.from = get_str(cli->socket))
-				|| !(m.to = get_str(cli->socket))) {
+		if (!(m.from = get_str_arena(cli->socket))
+				|| !(m.to = get_str_arena(cli->socket))) {
 			logit ("Error while receiving file");
 			return 0;
 		}
 
+		clients_plist_change (EV_PLIST_MOVE, &m);
 		add_event_all (EV_PLIST_MOVE, &m);
-
-		free (m.from);
-		free (m.to);
 	}
 	else { /* it can be only CMD_CLI_PLIST_CLEAR */
 		debug ("Sending EV_PLIST_CLEAR");
+		clients_plist_change (EV_PLIST_CLEAR, NULL);
 		add_event_all (EV_PLIST_CLEAR, NULL);
 	}
 
 	return 1;
 }
 
+/* Handle CMD_GET_PLIST_CHANGES.  If the client has a copy of the playlist
+ * at one of the last versions, send 1 and queue the playlist events for
+ * the changes made since, else send 0.  Return 0 on error. */
+static int req_plist_changes (struct client *cli)
+{
+	int serial, version, v;
+	bool in_sync;
+
+	if (!get_int(cli->socket, &serial) || !get_int(cli->socket, &version)) {
+		logit ("Error while receiving the playlist version");
+		return 0;
+	}
+
+	LOCK (clients_plist_mtx);
+
+	/* The serial number may have changed since, the version tells the
+	 * copy. */
+	in_sync = clients_plist_valid
+		&& version <= clients_plist_version
+		&& version >= clients_plist_version - plist_changes_num;
+
+	if (in_sync) {
+		drop_plist_events (cli);
+		cli->wants_plist_events = 1;
+
+		for (v = version + 1; v <= clients_plist_version; v++) {
+			struct event *change
+				= &plist_changes[v % PLIST_CHANGES_MAX];
+
+			add_event (cli, change->type, change->data
+					? event_data_dup (change->type, change->data)
+					: NULL);
+		}
+
+		debug ("Sending %d playlist changes to client with fd %d",
+				clients_plist_version - version, cli->socket);
+	}
+
+	UNLOCK (clients_plist_mtx);
+
+	return send_data_int (cli, in_sync ? 1 : 0);
+}
+
 /* Handle CMD_PLIST_GET_SERIAL. Return 0 on error. */
 static int req_plist_get_serial (struct client *cli)
 {
@@ -1304,6 +1654,23 @@ static int req_plist_set_serial (struct client *cli)
 	return 1;
 }
 
+/* Handle CMD_CLI_PLIST_SERIAL. Return 0 on error. */
+static int req_cli_plist_serial (struct client *cli)
+{
+	int serial;
+
+	if (!get_int(cli->socket, &serial))
+		return 0;
+
+	debug ("Setting the clients' playlist serial number to %d", serial);
+
+	LOCK (clients_plist_mtx);
+	plist_set_serial (&clients_plist, serial);
+	UNLOCK (clients_plist_mtx);
+
+	return 1;
+}
+
 /* Generate a unique playlist serial number. */
 static int gen_serial (const struct client *cli)
 {
@@ -1317,7 +1684,7 @@ static int gen_serial (const struct client *cli)
 	 * enough since clients use only two playlists. */
 
 	do {
-		serial = (seed << 8) | client_index(cli);
+		serial = (seed << 8) | cli->id;
 		seed = (seed + 1) & 0xFF;
 	} while (serial == audio_plist_get_serial());
 
@@ -1378,6 +1745,7 @@ int req_get_mixer_channel_name (struct client *cli)
 void req_toggle_mixer_channel ()
 {
 	audio_toggle_mixer_channel ();
+	status_page_changed ();
 	add_event_all (EV_MIXER_CHANGE, NULL);
 }
 
@@ -1385,6 +1753,7 @@ void req_toggle_mixer_channel ()
 void req_toggle_softmixer ()
 {
 	softmixer_set_active(!softmixer_is_active());
+	status_page_changed ();
 	add_event_all (EV_MIXER_CHANGE, NULL);
 }
 
@@ -1464,15 +1833,44 @@ static int get_file_tags (const int cli_id)
 	char *file;
 	int tags_sel;
 
-	if (!(file = get_str(clients[cli_id].socket)))
+	if (!(file = get_str_arena(CLIENT(cli_id)->socket)))
 		return 0;
-	if (!get_int(clients[cli_id].socket, &tags_sel)) {
-		free (file);
+	if (!get_int(CLIENT(cli_id)->socket, &tags_sel))
 		return 0;
-	}
 
 	tags_cache_add_request (tags_cache, file, tags_sel, cli_id);
-	free (file);
+
+	return 1;
+}
+
+/* Handle CMD_GET_FILES_TAGS. Return 0 on error. */
+static int get_files_tags (const int cli_id)
+{
+	lists_t_strs *files;
+	int tags_sel, count, i;
+
+	if (!get_int(CLIENT(cli_id)->socket, &tags_sel))
+		return 0;
+	if (!get_int(CLIENT(cli_id)->socket, &count))
+		return 0;
+	if (count < 1 || count > FILES_TAGS_REQUEST_MAX) {
+		logit ("Bad number of files to get tags for: %d", count);
+		return 0;
+	}
+
+	files = lists_strs_new (count);
+	for (i = 0; i < count; i++) {
+		char *file;
+
+		if (!(file = get_str(CLIENT(cli_id)->socket))) {
+			lists_strs_free (files);
+			return 0;
+		}
+		lists_strs_push (files, file);
+	}
+
+	tags_cache_add_requests (tags_cache, files, tags_sel, cli_id);
+	lists_strs_free (files);
 
 	return 1;
 }
@@ -1481,11 +1879,40 @@ static int abort_tags_requests (const int cli_id)
 {
 	char *file;
 
-	if (!(file = get_str(clients[cli_id].socket)))
+	if (!(file = get_str_arena(CLIENT(cli_id)->socket)))
 		return 0;
 
 	tags_cache_clear_up_to (tags_cache, file, cli_id);
-	free (file);
+
+	return 1;
+}
+
+/* Handle CMD_BOOST_TAGS_REQUESTS. Return 0 on error. */
+static int boost_tags_requests (const int cli_id)
+{
+	lists_t_strs *files;
+	int count, i;
+
+	if (!get_int(CLIENT(cli_id)->socket, &count))
+		return 0;
+	if (!LIMIT(count, 1024)) {
+		logit ("Bad number of files to boost: %d", count);
+		return 0;
+	}
+
+	files = lists_strs_new (MAX(count, 1));
+	for (i = 0; i < count; i++) {
+		char *file;
+
+		if (!(file = get_str(CLIENT(cli_id)->socket))) {
+			lists_strs_free (files);
+			return 0;
+		}
+		lists_strs_push (files, file);
+	}
+
+	tags_cache_boost_requests (tags_cache, files, cli_id);
+	lists_strs_free (files);
 
 	return 1;
 }
@@ -1496,18 +1923,12 @@ static int req_list_move (struct client *cli)
 	char *from;
 	char *to;
 
-	if (!(from = get_str(cli->socket)))
+	if (!(from = get_str_arena(cli->socket))
+			|| !(to = get_str_arena(cli->socket)))
 		return 0;
-	if (!(to = get_str(cli->socket))) {
-		free (from);
-		return 0;
-	}
 
 	audio_plist_move (from, to);
 
-	free (from);
-	free (to);
-
 	return 1;
 }
 
@@ -1516,12 +1937,9 @@ static int req_queue_move (const struct client *cli)
 {
 	struct move_ev_data m;
 
-	if (!(m.from = get_str(cli->socket)))
+	if (!(m.from = get_str_arena(cli->socket))
+			|| !(m.to = get_str_arena(cli->socket)))
 		return 0;
-	if (!(m.to = get_str(cli->socket))) {
-		free (m.from);
-		return 0;
-	}
 
 	audio_queue_move (m.from, m.to);
 
@@ -1530,9 +1948,6 @@ static int req_queue_move (const struct client *cli)
 	/* Broadcast the event to clients */
 	add_event_all (EV_QUEUE_MOVE, &m);
 
-	free (m.from);
-	free (m.to);
-
 	return 1;
 }
 
@@ -1541,7 +1956,7 @@ static void handle_command (const int client_id)
 {
 	int cmd;
 	int err = 0;
-	struct client *cli = &clients[client_id];
+	struct client *cli = CLIENT(client_id);
 
 	if (!get_int(cli->socket, &cmd)) {
 		logit ("Failed to get command from the client");
@@ -1550,6 +1965,14 @@ static void handle_command (const int client_id)
 		return;
 	}
 
+	/* The replies are written directly to the socket. */
+	if (!flush_pending_events(cli)) {
+		logit ("Failed to send events to the client");
+		close (cli->socket);
+		del_client (cli);
+		return;
+	}
+
 	switch (cmd) {
 		case CMD_QUIT:
 			logit ("Exit request from the client");
@@ -1663,6 +2086,13 @@ static void handle_command (const int client_id)
 			break;
 		case CMD_CAN_SEND_PLIST:
 			cli->can_send_plist = 1;
+			LOCK (clients_plist_mtx);
+			clients_plist_valid = true;
+			UNLOCK (clients_plist_mtx);
+			break;
+		case CMD_GET_PLIST_CHANGES:
+			if (!req_plist_changes(cli))
+				err = 1;
 			break;
 		case CMD_CLI_PLIST_ADD:
 		case CMD_CLI_PLIST_DEL:
@@ -1691,6 +2121,10 @@ static void handle_command (const int client_id)
 			if (!req_plist_set_serial(cli))
 				err = 1;
 			break;
+		case CMD_CLI_PLIST_SERIAL:
+			if (!req_cli_plist_serial(cli))
+				err = 1;
+			break;
 		case CMD_GET_TAGS:
 			if (!req_get_tags(cli))
 				err = 1;
@@ -1713,6 +2147,14 @@ static void handle_command (const int client_id)
 			if (!abort_tags_requests(client_id))
 				err = 1;
 			break;
+		case CMD_GET_FILES_TAGS:
+			if (!get_files_tags(client_id))
+				err = 1;
+			break;
+		case CMD_BOOST_TAGS_REQUESTS:
+			if (!boost_tags_requests(client_id))
+				err = 1;
+			break;
 		case CMD_LIST_MOVE:
 			if (!req_list_move(cli))
 				err = 1;
@@ -1757,6 +2199,22 @@ static void handle_command (const int client_id)
 			if (!req_set_rating(cli))
 				err = 1;
 			break;
+		case CMD_GET_STATS:
+			if (!send_stats(cli))
+				err = 1;
+			break;
+		case CMD_DUMP_OUTPUT_TRACE:
+			if (!send_output_trace(cli))
+				err = 1;
+			break;
+		case CMD_SCAN:
+			if (!req_scan(cli))
+				err = 1;
+			break;
+		case CMD_GET_IO_STATS:
+			if (!send_io_stats(cli))
+				err = 1;
+			break;
 		default:
 			logit ("Bad command (0x%x) from the client", cmd);
 			err = 1;
@@ -1767,55 +2225,252 @@ static void handle_command (const int client_id)
 		close (cli->socket);
 		del_client (cli);
 	}
+	else if (cli->socket != -1)
+		recv_arena_reset (cli->socket);
 }
 
-/* Add clients file descriptors to fds. */
-static void add_clients_fds (fd_set *read, fd_set *write)
+#ifdef HAVE_SYS_EPOLL_H
+
+static void watch_init ()
 {
-	int i;
+	epoll_fd = epoll_create (16);
+	if (epoll_fd == -1)
+		fatal ("epoll_create() failed: %s", xstrerror (errno));
+
+	watch_set (server_sock, WATCH_SERVER, 0, WATCH_READ);
+	watch_set (wake_up_pipe[0], WATCH_WAKE_UP, 0, WATCH_READ);
+}
+
+static void watch_cleanup ()
+{
+	close (epoll_fd);
+	epoll_fd = -1;
+}
+
+/* Change the events waited for on the descriptor from old_events to
+ * events, 0 means not waiting for it at all. */
+static void watch_set (const int fd, const int token, const int old_events,
+		const int events)
+{
+	struct epoll_event ev;
+	int op;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1) {
-			if (locking_client() == -1 || is_locking(&clients[i]))
-				FD_SET (clients[i].socket, read);
+	memset (&ev, 0, sizeof(ev));
+	ev.events = (events & WATCH_READ ? EPOLLIN : 0)
+		| (events & WATCH_WRITE ? EPOLLOUT : 0);
+	ev.data.u64 = ((uint64_t)(uint32_t)fd << 32) | (uint32_t)token;
 
-			LOCK (clients[i].events_mtx);
-			if (!event_queue_empty(&clients[i].events))
-				FD_SET (clients[i].socket, write);
-			UNLOCK (clients[i].events_mtx);
+	if (!events)
+		op = EPOLL_CTL_DEL;
+	else if (!old_events)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	if (epoll_ctl (epoll_fd, op, fd, &ev) == -1 && op != EPOLL_CTL_DEL)
+		log_errno ("epoll_ctl() failed", errno);
+}
+
+/* Wait for the events at most timeout milliseconds (-1 means no limit),
+ * fill ready with at most max of them and return their number or -1 on
+ * error. */
+static int watch_wait (struct watch_event *ready, const int max,
+		const int timeout)
+{
+	struct epoll_event evs[WATCH_EVENTS_MAX];
+	int i, n;
+
+	n = epoll_wait (epoll_fd, evs, MIN(max, WATCH_EVENTS_MAX), timeout);
+
+	for (i = 0; i < n; i++) {
+		ready[i].token = (int)(uint32_t)evs[i].data.u64;
+		ready[i].fd = (int)(evs[i].data.u64 >> 32);
+		ready[i].events = (evs[i].events & EPOLLIN ? WATCH_READ : 0)
+			| (evs[i].events & EPOLLOUT ? WATCH_WRITE : 0);
+
+		/* Errors show up on the next read or write. */
+		if (evs[i].events & (EPOLLERR | EPOLLHUP))
+			ready[i].events |= WATCH_READ | WATCH_WRITE;
+	}
+
+	return n;
+}
+
+#else
+
+static void watch_init ()
+{
+}
+
+static void watch_cleanup ()
+{
+	free (poll_fds);
+	free (poll_tokens);
+	poll_fds = NULL;
+	poll_tokens = NULL;
+	poll_allocated = 0;
+}
+
+/* With poll() the descriptors are collected in watch_wait() from the
+ * clients' watched events. */
+static void watch_set (const int fd ATTR_UNUSED, const int token ATTR_UNUSED,
+		const int old_events ATTR_UNUSED, const int events ATTR_UNUSED)
+{
+}
+
+static void poll_add (int *num, const int fd, const int token,
+		const int events)
+{
+	if (*num == poll_allocated) {
+		poll_allocated = poll_allocated ? poll_allocated * 2 : 16;
+		poll_fds = (struct pollfd *)xrealloc (poll_fds,
+				sizeof(struct pollfd) * poll_allocated);
+		poll_tokens = (int *)xrealloc (poll_tokens,
+				sizeof(int) * poll_allocated);
+	}
+
+	poll_fds[*num].fd = fd;
+	poll_fds[*num].events = (events & WATCH_READ ? POLLIN : 0)
+		| (events & WATCH_WRITE ? POLLOUT : 0);
+	poll_fds[*num].revents = 0;
+	poll_tokens[*num] = token;
+	*num += 1;
+}
+
+/* Wait for the events at most timeout milliseconds (-1 means no limit),
+ * fill ready with at most max of them and return their number or -1 on
+ * error. */
+static int watch_wait (struct watch_event *ready, const int max,
+		const int timeout)
+{
+	int i, num = 0, n = 0;
+
+	poll_add (&num, server_sock, WATCH_SERVER, WATCH_READ);
+	poll_add (&num, wake_up_pipe[0], WATCH_WAKE_UP, WATCH_READ);
+	for (i = 0; i < clients_num; i++)
+		if (CLIENT(i)->watched)
+			poll_add (&num, CLIENT(i)->socket, i, CLIENT(i)->watched);
+
+	if (poll (poll_fds, num, timeout) == -1)
+		return -1;
+
+	for (i = 0; i < num && n < max; i++) {
+		short revents = poll_fds[i].revents;
+
+		if (!revents)
+			continue;
+
+		ready[n].token = poll_tokens[i];
+		ready[n].fd = poll_fds[i].fd;
+		ready[n].events = (revents & POLLIN ? WATCH_READ : 0)
+			| (revents & POLLOUT ? WATCH_WRITE : 0);
+
+		/* Errors show up on the next read or write. */
+		if (revents & (POLLERR | POLLHUP | POLLNVAL))
+			ready[n].events |= WATCH_READ | WATCH_WRITE;
+		n++;
+	}
+
+	return n;
+}
+
+#endif
+
+/* Make the loop wait for reading from clients unless another client holds
+ * the lock, and for writing only to clients with queued events.  Return
+ * true if a client that can be read from has received data not handled
+ * yet, the loop must not wait then. */
+static bool update_watches ()
+{
+	int i, locker = locking_client ();
+	bool pending = false;
+
+	for (i = 0; i < clients_num; i++) {
+		struct client *cli = CLIENT(i);
+		int events = 0;
+
+		if (cli->socket == -1)
+			continue;
+
+		if (locker == -1 || locker == i)
+			events |= WATCH_READ;
+
+		LOCK (cli->events_mtx);
+		if (!event_queue_empty(&cli->events))
+			events |= WATCH_WRITE;
+		UNLOCK (cli->events_mtx);
+
+		if (events != cli->watched) {
+			watch_set (cli->socket, i, cli->watched, events);
+			cli->watched = events;
 		}
+
+		if ((events & WATCH_READ) && recv_buf_pending(cli->socket))
+			pending = true;
+	}
+
+	return pending;
+}
+
+/* Return the client the ready event is for or NULL if it's not a client's
+ * one or the client has gone since. */
+static struct client *ready_client (const struct watch_event *ev)
+{
+	if (ev->token < 0 || ev->token >= clients_num
+			|| CLIENT(ev->token)->socket != ev->fd)
+		return NULL;
+
+	return CLIENT(ev->token);
 }
 
-/* Return the maximum fd from clients and the argument. */
-static int max_fd (int max)
+/* Send events to the clients whose sockets are ready to write. */
+static void send_events (const struct watch_event *ready, const int num)
 {
 	int i;
 
-	if (wake_up_pipe[0] > max)
-		max = wake_up_pipe[0];
+	for (i = 0; i < num; i++) {
+		struct client *cli = ready_client (&ready[i]);
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket > max)
-			max = clients[i].socket;
-	return max;
+		if (cli && (ready[i].events & WATCH_WRITE)
+				&& (cli->watched & WATCH_WRITE)) {
+			debug ("Flushing events for client %d", cli->id);
+			if (!flush_events (cli)) {
+				close (cli->socket);
+				del_client (cli);
+			}
+		}
+	}
 }
 
-/* Handle clients whose fds are ready to read. */
-static void handle_clients (fd_set *fds)
+/* Handle clients whose sockets are ready to read and then the ones with
+ * commands already received but not handled. */
+static void handle_clients (const struct watch_event *ready, const int num)
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1
-				&& FD_ISSET(clients[i].socket, fds)) {
-			if (locking_client() == -1
-					|| is_locking(&clients[i]))
-				handle_command (i);
-			else
-				debug ("Not getting a command from client with"
-						" fd %d because of lock",
-						clients[i].socket);
-		}
+	for (i = 0; i < num; i++) {
+		struct client *cli = ready_client (&ready[i]);
+
+		if (!cli || !(ready[i].events & WATCH_READ)
+				|| !(cli->watched & WATCH_READ))
+			continue;
+
+		if (locking_client() == -1 || is_locking(cli))
+			handle_command (cli->id);
+		else
+			debug ("Not getting a command from client with"
+					" fd %d because of lock", cli->socket);
+	}
+
+	for (i = 0; i < clients_num; i++) {
+		struct client *cli = CLIENT(i);
+
+		if (recv_buf_pending(cli->socket)
+				&& (locking_client() == -1 || is_locking(cli)))
+			handle_command (i);
+	}
+	/* Put the files added by the commands on the playlist at once. */
+	audio_plist_flush ();
 }
 
 /* Close all client connections sending EV_EXIT. */
@@ -1823,14 +2478,54 @@ static void close_clients ()
 {
 	int i;
 
-	for (i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket != -1) {
-			send_int (clients[i].socket, EV_EXIT);
-			close (clients[i].socket);
-			del_client (&clients[i]);
+	for (i = 0; i < clients_num; i++)
+		if (CLIENT(i)->socket != -1) {
+			if (flush_pending_events (CLIENT(i)))
+				send_int (CLIENT(i)->socket, EV_EXIT);
+			close (CLIENT(i)->socket);
+			del_client (CLIENT(i));
 		}
 }
 
+/* Copy the state of the player to the status page.  The tags and the file
+ * name can't be got in the threads that change them, so it's done here. */
+static void update_status_page ()
+{
+	struct status_info *info;
+	struct file_tags *tags = NULL;
+	char *file;
+	int volume;
+
+	file = audio_get_sname ();
+	if (file && file_type (file) == F_URL)
+		tags = audio_get_curr_tags ();
+	else if (file && file[0])
+		tags = tags_cache_get_immediate (tags_cache, file,
+		                                 TAGS_COMMENTS | TAGS_TIME);
+	volume = audio_get_mixer ();
+
+	if ((info = status_page_begin ())) {
+		info->state = audio_get_state ();
+		info->curr_time = audio_get_time ();
+		info->volume = volume;
+		info->total_time = tags && (tags->filled & TAGS_TIME)
+			? tags->time : -1;
+		info->track = tags ? tags->track : -1;
+		strncpy (info->file, file ? file : "", sizeof(info->file) - 1);
+		strncpy (info->title, tags && tags->title ? tags->title : "",
+				sizeof(info->title) - 1);
+		strncpy (info->artist, tags && tags->artist ? tags->artist : "",
+				sizeof(info->artist) - 1);
+		strncpy (info->album, tags && tags->album ? tags->album : "",
+				sizeof(info->album) - 1);
+	}
+	status_page_end ();
+
+	if (tags)
+		tags_free (tags);
+	free (file);
+}
+
 /* Handle incoming connections */
 void server_loop ()
 {
@@ -1844,25 +2539,30 @@ void server_loop ()
 	log_circular_start ();
 
 	do {
-		int res;
-		fd_set fds_write, fds_read;
+		int i, res;
+		bool pending;
+		struct watch_event ready[WATCH_EVENTS_MAX];
+
+		if (ATOMIC_XCHG (&status_page_dirty, 0))
+			update_status_page ();
 
-		FD_ZERO (&fds_read);
-		FD_ZERO (&fds_write);
-		FD_SET (server_sock, &fds_read);
-		FD_SET (wake_up_pipe[0], &fds_read);
-		add_clients_fds (&fds_read, &fds_write);
+		pending = update_watches ();
 
 		res = 0;
 		if (!server_quit)
-			res = select (max_fd(server_sock)+1, &fds_read,
-					&fds_write, NULL, NULL);
+			res = watch_wait (ready, WATCH_EVENTS_MAX,
+					pending ? 0 : -1);
 
 		if (res == -1 && errno != EINTR && !server_quit)
-			fatal ("select() failed: %s", xstrerror (errno));
+			fatal ("Waiting for events failed: %s", xstrerror (errno));
 
 		if (!server_quit && res >= 0) {
-			if (FD_ISSET(server_sock, &fds_read)) {
+			send_events (ready, res);
+			handle_clients (ready, res);
+		}
+
+		for (i = 0; !server_quit && i < res; i++) {
+			if (ready[i].token == WATCH_SERVER) {
 				int client_sock;
 
 				debug ("accept()ing connection...");
@@ -1877,7 +2577,7 @@ void server_loop ()
 					busy (client_sock);
 			}
 
-			if (FD_ISSET(wake_up_pipe[0], &fds_read)) {
+			else if (ready[i].token == WATCH_WAKE_UP) {
 				int w;
 
 				logit ("Got 'wake up'");
@@ -1885,9 +2585,6 @@ void server_loop ()
 				if (read(wake_up_pipe[0], &w, sizeof(w)) < 0)
 					fatal ("Can't read wake up signal: %s", xstrerror (errno));
 			}
-
-			send_events (&fds_write);
-			handle_clients (&fds_read);
 		}
 
 		if (server_quit)
@@ -1900,7 +2597,9 @@ void server_loop ()
 
 	close_clients ();
 	clients_cleanup ();
+	watch_cleanup ();
 #ifdef HAVE_MPRIS
+	mpris_stop ();
 	pthread_join (mpris_tid, NULL);
 #endif
 	close (server_sock);
@@ -1908,27 +2607,45 @@ void server_loop ()
 	server_shutdown ();
 }
 
+/* Copy sound_info to the status page. */
+static void publish_sound_info ()
+{
+	struct status_info *info;
+
+	if ((info = status_page_begin ())) {
+		info->bitrate = sound_info.bitrate;
+		info->avg_bitrate = sound_info.avg_bitrate;
+		info->rate = sound_info.rate;
+		info->channels = sound_info.channels;
+	}
+	status_page_end ();
+}
+
 void set_info_bitrate (const int bitrate)
 {
 	sound_info.bitrate = bitrate;
+	publish_sound_info ();
 	add_event_all (EV_BITRATE, NULL);
 }
 
 void set_info_channels (const int channels)
 {
 	sound_info.channels = channels;
+	publish_sound_info ();
 	add_event_all (EV_CHANNELS, NULL);
 }
 
 void set_info_rate (const int rate)
 {
 	sound_info.rate = rate;
+	publish_sound_info ();
 	add_event_all (EV_RATE, NULL);
 }
 
 void set_info_avg_bitrate (const int avg_bitrate)
 {
 	sound_info.avg_bitrate = avg_bitrate;
+	publish_sound_info ();
 	add_event_all (EV_AVG_BITRATE, NULL);
 }
 
@@ -1938,11 +2655,18 @@ void state_change ()
 #ifdef HAVE_MPRIS
 	mpris_status_change ();
 #endif
+	status_page_changed ();
 	add_event_all (EV_STATE, NULL);
 }
 
 void ctime_change ()
 {
+	struct status_info *info;
+
+	if ((info = status_page_begin ()))
+		info->curr_time = audio_get_time ();
+	status_page_end ();
+
 	add_event_all (EV_CTIME, NULL);
 }
 
@@ -1951,6 +2675,7 @@ void tags_change ()
 #ifdef HAVE_MPRIS
 	mpris_track_change();
 #endif
+	status_page_changed ();
 	add_event_all (EV_TAGS, NULL);
 }
 
@@ -1964,9 +2689,11 @@ void tags_response (const int client_id, const char *file,
 {
 	assert (file != NULL);
 	assert (tags != NULL);
-	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (LIMIT(client_id, clients_num));
 
-	if (clients[client_id].socket != -1) {
+	clients_plist_update_tags (file, tags);
+
+	if (CLIENT(client_id)->socket != -1) {
 		struct tag_ev_response *data
 			= (struct tag_ev_response *)xmalloc (
 					sizeof(struct tag_ev_response));
@@ -1974,11 +2701,26 @@ void tags_response (const int client_id, const char *file,
 		data->file = xstrdup (file);
 		data->tags = tags_dup (tags);
 
-		add_event (&clients[client_id], EV_FILE_TAGS, data);
+		add_event (CLIENT(client_id), EV_FILE_TAGS, data);
 		wake_up_server ();
 	}
 }
 
+/* Send the tags of a file changed by another program to all clients. */
+void file_tags_changed (const char *file, const struct file_tags *tags)
+{
+	struct tag_ev_response data;
+
+	assert (file != NULL);
+	assert (tags != NULL);
+
+	clients_plist_update_tags (file, tags);
+
+	data.file = (char *)file;
+	data.tags = (struct file_tags *)tags;
+	add_event_all (EV_FILE_TAGS, &data);
+}
+
 void ev_audio_start ()
 {
 	add_event_all (EV_AUDIO_START, NULL);
@@ -7,7 +7,10 @@ extern "C" {
 
 #include "playlist.h"
 
-#define CLIENTS_MAX	10
+#define CLIENTS_MAX	256
+
+/* The server's tags cache (NULL outside the server). */
+extern struct tags_cache *tags_cache;
 
 void server_init (int debug, int foreground);
 void server_loop ();
@@ -23,6 +26,7 @@ void ctime_change ();
 void status_msg (const char *msg);
 void tags_response (const int client_id, const char *file,
 		const struct file_tags *tags);
+void file_tags_changed (const char *file, const struct file_tags *tags);
 void ev_audio_start ();
 void ev_audio_stop ();
 void server_queue_pop (const char *filename);
@@ -40,6 +40,10 @@ static int mix_mono;
 static int mixer_val, mixer_amp, mixer_real;
 static float mixer_realf;
 
+/* Gain normalizing the loudness of the file being played, set by the
+ * player when the output buffer is empty. */
+static float norm_gain = 1.0f;
+
 static void softmixer_read_config();
 static void softmixer_write_config();
 
@@ -113,25 +117,6 @@ int softmixer_is_mono()
 
 /* private code */
 
-static void process_buffer_u8(uint8_t *buf, size_t samples);
-static void process_buffer_s8(int8_t *buf, size_t samples);
-static void process_buffer_u16(uint16_t *buf, size_t samples);
-static void process_buffer_s16(int16_t *buf, size_t samples);
-static void process_buffer_u24(uint32_t *buf, size_t samples);
-static void process_buffer_s24(int32_t *buf, size_t samples);
-static void process_buffer_u32(uint32_t *buf, size_t samples);
-static void process_buffer_s32(int32_t *buf, size_t samples);
-static void process_buffer_float(float *buf, size_t samples);
-static void mix_mono_u8(uint8_t *buf, int channels, size_t samples);
-static void mix_mono_s8(int8_t *buf, int channels, size_t samples);
-static void mix_mono_u16(uint16_t *buf, int channels, size_t samples);
-static void mix_mono_s16(int16_t *buf, int channels, size_t samples);
-static void mix_mono_u24(uint32_t *buf, int channels, size_t samples);
-static void mix_mono_s24(int32_t *buf, int channels, size_t samples);
-static void mix_mono_u32(uint32_t *buf, int channels, size_t samples);
-static void mix_mono_s32(int32_t *buf, int channels, size_t samples);
-static void mix_mono_float(float *buf, int channels, size_t samples);
-
 static void softmixer_read_config()
 {
   char *cfname = create_file_name(SOFTMIXER_SAVE_FILE);
@@ -264,487 +249,68 @@ static void softmixer_write_config()
   logit ("Softmixer configuration written");
 }
 
-void softmixer_process_buffer(char *buf, size_t size, const struct sound_params *sound_params)
-{
-  int do_softmix, do_monomix;
-
-  debug ("Processing %zu bytes...", size);
-
-  do_softmix = active && (mixer_real != 100);
-  do_monomix = mix_mono && (sound_params->channels > 1);
-
-  if(!do_softmix && !do_monomix)
-    return;
-
-  long sound_format = sound_params->fmt & SFMT_MASK_FORMAT;
-  int samplewidth = sfmt_Bps(sound_format);
-
-  assert (size % (samplewidth * sound_params->channels) == 0);
-
-  switch(sound_format)
-  {
-    case SFMT_U8:
-      if(do_softmix)
-        process_buffer_u8((uint8_t *)buf, size);
-      if(do_monomix)
-        mix_mono_u8((uint8_t *)buf, sound_params->channels, size);
-      break;
-    case SFMT_S8:
-      if(do_softmix)
-        process_buffer_s8((int8_t *)buf, size);
-      if(do_monomix)
-        mix_mono_s8((int8_t *)buf, sound_params->channels, size);
-      break;
-    case SFMT_U16:
-      if(do_softmix)
-        process_buffer_u16((uint16_t *)buf, size / sizeof(uint16_t));
-      if(do_monomix)
-        mix_mono_u16((uint16_t *)buf, sound_params->channels, size / sizeof(uint16_t));
-      break;
-    case SFMT_S16:
-      if(do_softmix)
-        process_buffer_s16((int16_t *)buf, size / sizeof(int16_t));
-      if(do_monomix)
-        mix_mono_s16((int16_t *)buf, sound_params->channels, size / sizeof(int16_t));
-      break;
-    case SFMT_U24:
-      if(do_softmix)
-        process_buffer_u24((uint32_t *)buf, size / sizeof(uint32_t));
-      if(mix_mono)
-        mix_mono_u24((uint32_t *)buf, sound_params->channels, size / sizeof(uint32_t));
-      break;
-    case SFMT_S24:
-      if(do_softmix)
-        process_buffer_s24((int32_t *)buf, size / sizeof(int32_t));
-      if(mix_mono)
-        mix_mono_s24((int32_t *)buf, sound_params->channels, size / sizeof(int32_t));
-      break;
-    case SFMT_U32:
-      if(do_softmix)
-        process_buffer_u32((uint32_t *)buf, size / sizeof(uint32_t));
-      if(do_monomix)
-        mix_mono_u32((uint32_t *)buf, sound_params->channels, size / sizeof(uint32_t));
-      break;
-    case SFMT_S32:
-      if(do_softmix)
-        process_buffer_s32((int32_t *)buf, size / sizeof(int32_t));
-      if(do_monomix)
-        mix_mono_s32((int32_t *)buf, sound_params->channels, size / sizeof(int32_t));
-      break;
-    case SFMT_FLOAT:
-      if(do_softmix)
-        process_buffer_float((float *)buf, size / sizeof(float));
-      if(do_monomix)
-        mix_mono_float((float *)buf, sound_params->channels, size / sizeof(float));
-      break;
-    default:
-      debug ("No softmixer/monomixer for chosen format.");
-
-  }
-}
-
-static void process_buffer_u8(uint8_t *buf, size_t samples)
-{
-  size_t i;
-
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    int16_t tmp = buf[i];
-    tmp -= (UINT8_MAX>>1);
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp += (UINT8_MAX>>1);
-    tmp = CLAMP(0, tmp, UINT8_MAX);
-    buf[i] = (uint8_t)tmp;
-  }
-}
-
-static void process_buffer_s8(int8_t *buf, size_t samples)
-{
-  size_t i;
-
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    int16_t tmp = buf[i];
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp = CLAMP(INT8_MIN, tmp, INT8_MAX);
-    buf[i] = (int8_t)tmp;
-  }
-}
-
-static void process_buffer_u16(uint16_t *buf, size_t samples)
-{
-  size_t i;
-
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    int32_t tmp = buf[i];
-    tmp -= (UINT16_MAX>>1);
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp += (UINT16_MAX>>1);
-    tmp = CLAMP(0, tmp, UINT16_MAX);
-    buf[i] = (uint16_t)tmp;
-  }
-}
-
-static void process_buffer_s16(int16_t *buf, size_t samples)
-{
-  size_t i;
-
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    int32_t tmp = buf[i];
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp = CLAMP(INT16_MIN, tmp, INT16_MAX);
-    buf[i] = (int16_t)tmp;
-  }
-}
-
-static void process_buffer_u24(uint32_t *buf, size_t samples)
-{
-  size_t i;
-
-  debug ("mixing");
-  
-  for(i=0; i<samples; i++)
-  {
-    int64_t tmp = buf[i];
-    tmp -= S24_MIN;
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp += S24_MIN;
-    tmp = CLAMP(0, tmp, U24_MAX);
-    buf[i] = (uint32_t)tmp;
-  }
-}
+/* Gain of the mixer value that leaves the samples untouched. */
+#define UNITY_GAIN 1000
 
-static void process_buffer_s24(int32_t *buf, size_t samples)
+/* Tell if the softmixer has anything to do with sound in this format. */
+int softmixer_is_needed(const struct sound_params *sound_params)
 {
-  size_t i;
-
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    int64_t tmp = buf[i];
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp = CLAMP(S24_MIN, tmp, S24_MAX);
-    buf[i] = (int32_t)tmp;
-  }
+  return (active && mixer_real != UNITY_GAIN)
+    || norm_gain != 1.0f
+    || (mix_mono && sound_params->channels > 1);
 }
 
-static void process_buffer_u32(uint32_t *buf, size_t samples)
+/* Set the loudness normalization gain for the sound processed from now
+ * on. */
+void softmixer_set_norm_gain(const float gain)
 {
-  size_t i;
-
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    int64_t tmp = buf[i];
-    tmp -= (UINT32_MAX>>1);
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp += (UINT32_MAX>>1);
-    tmp = CLAMP(0, tmp, UINT32_MAX);
-    buf[i] = (uint32_t)tmp;
-  }
+  norm_gain = gain;
 }
 
-static void process_buffer_s32(int32_t *buf, size_t samples)
+/* Return the gain applied now: the mixer value with the loudness
+ * normalization. */
+float softmixer_get_gain()
 {
-  size_t i;
-
-  debug ("mixing");
+  float gain = (active && mixer_real != UNITY_GAIN) ? mixer_realf : 1.0f;
 
-  for(i=0; i<samples; i++)
-  {
-    int64_t tmp = buf[i];
-    tmp *= mixer_real;
-    tmp /= 1000;
-    tmp = CLAMP(INT32_MIN, tmp, INT32_MAX);
-    buf[i] = (int32_t)tmp;
-  }
+  return gain * norm_gain;
 }
 
-static void process_buffer_float(float *buf, size_t samples)
+/* Apply the gain (with the normalization) and the mono mix to float samples in place, in a single
+ * pass.  The result is not clipped, that is left to the final conversion
+ * to the device format. */
+void softmixer_process_float(float *buf, size_t samples, const struct sound_params *sound_params)
 {
+  int c, channels = sound_params->channels;
+  float gain;
   size_t i;
 
-  debug ("mixing");
-
-  for(i=0; i<samples; i++)
-  {
-    float tmp = buf[i];
-    tmp *= mixer_realf;
-    tmp = CLAMP(-1.0f, tmp, 1.0f);
-    buf[i] = tmp;
-  }
-}
-
-// Mono-Mixing
-static void mix_mono_u8(uint8_t *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
-
-  debug ("making mono");
-
-  assert (channels > 1);
-
-  while(i < samples)
-  {
-    int16_t mono = 0;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
-
-    mono /= channels;
-    mono = MIN(mono, UINT8_MAX);  // can't be negative
-
-    for(c=0; c<channels; c++)
-      *buf++ = (uint8_t)mono;
-
-    i+=channels;
-  }
-}
-
-static void mix_mono_s8(int8_t *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
-
-  debug ("making mono");
-
-  assert (channels > 1);
-
-  while(i < samples)
-  {
-    int16_t mono = 0;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
-
-    mono /= channels;
-    mono = CLAMP(INT8_MIN, mono, INT8_MAX);
-
-    for(c=0; c<channels; c++)
-      *buf++ = (int8_t)mono;
-
-    i+=channels;
-  }
-}
-
-static void mix_mono_u16(uint16_t *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
-
-  debug ("making mono");
-
-  assert (channels > 1);
-
-  while(i < samples)
-  {
-    int32_t mono = 0;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
-
-    mono /= channels;
-    mono = MIN(mono, UINT16_MAX);  // can't be negative
-
-    for(c=0; c<channels; c++)
-      *buf++ = (uint16_t)mono;
-
-    i+=channels;
-  }
-}
-
-static void mix_mono_s16(int16_t *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
-
-  debug ("making mono");
-
-  assert (channels > 1);
-
-  while(i < samples)
-  {
-    int32_t mono = 0;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
-
-    mono /= channels;
-    mono = CLAMP(INT16_MIN, mono, INT16_MAX);
-
-    for(c=0; c<channels; c++)
-      *buf++ = (int16_t)mono;
-
-    i+=channels;
-  }
-}
-
-static void mix_mono_u24(uint32_t *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
-
-  debug ("making mono");
-
-  if(channels < 2)
-    return;
-
-  while(i < samples)
-  {
-    int64_t mono = 0;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
-
-    mono /= channels;
-    mono = MIN(mono, U24_MAX);  // can't be negative
-
-    for(c=0; c<channels; c++)
-      *buf++ = (uint32_t)mono;
-
-    i+=channels;
-  }
-}
-
-static void mix_mono_s24(int32_t *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
+  debug ("Processing %zu samples...", samples);
 
-  debug ("making mono");
+  assert (samples % channels == 0);
 
-  if(channels < 2)
-    return;
+  gain = softmixer_get_gain();
 
-  while(i < samples)
+  if(mix_mono && channels > 1)
   {
-    int64_t mono = 0;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
-
-    mono /= channels;
-    mono = CLAMP(S24_MIN, mono, S24_MAX);
-
-    for(c=0; c<channels; c++)
-      *buf++ = (int32_t)mono;
-
-    i+=channels;
-  }
-}
+    gain /= channels;
 
-static void mix_mono_u32(uint32_t *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
-
-  debug ("making mono");
-
-  assert (channels > 1);
-
-  while(i < samples)
-  {
-    int64_t mono = 0;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
-
-    mono /= channels;
-    mono = MIN(mono, UINT32_MAX);  // can't be negative
-
-    for(c=0; c<channels; c++)
-      *buf++ = (uint32_t)mono;
-
-    i+=channels;
-  }
-}
-
-static void mix_mono_s32(int32_t *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
-
-  debug ("making mono");
-
-  assert (channels > 1);
-
-  while(i < samples)
-  {
-    int64_t mono = 0;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
+    for(i=0; i<samples; i+=channels)
+    {
+      float mono = 0.0f;
 
-    mono /= channels;
-    mono = CLAMP(INT32_MIN, mono, INT32_MAX);
+      for(c=0; c<channels; c++)
+        mono += buf[i + c];
 
-    for(c=0; c<channels; c++)
-      *buf++ = (int32_t)mono;
+      mono *= gain;
 
-    i+=channels;
+      for(c=0; c<channels; c++)
+        buf[i + c] = mono;
+    }
   }
-}
-
-static void mix_mono_float(float *buf, int channels, size_t samples)
-{
-  int c;
-  size_t i = 0;
-
-  debug ("making mono");
-
-  assert (channels > 1);
-
-  while(i < samples)
+  else if(gain != 1.0f)
   {
-    float mono = 0.0f;
-
-    for(c=0; c<channels; c++)
-      mono += *buf++;
-
-    buf-=channels;
-
-    mono /= channels;
-    mono = CLAMP(-1.0f, mono, 1.0f);
-
-    for(c=0; c<channels; c++)
-      *buf++ = mono;
-
-    i+=channels;
+    for(i=0; i<samples; i++)
+      buf[i] *= gain;
   }
 }
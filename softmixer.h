@@ -34,7 +34,10 @@ void softmixer_set_active(int act);
 int softmixer_is_mono();
 void softmixer_set_mono(int mono);
 
-void softmixer_process_buffer(char *buf, const size_t size, const struct sound_params *sound_params);
+int softmixer_is_needed(const struct sound_params *sound_params);
+void softmixer_set_norm_gain(const float gain);
+float softmixer_get_gain();
+void softmixer_process_float(float *buf, size_t samples, const struct sound_params *sound_params);
 
 #ifdef __cplusplus
 }
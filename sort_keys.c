@@ -0,0 +1,384 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Sort keys: instead of collating strings on every comparison, a key is
+ * built once for each item and the keys are compared with memcmp().  A key
+ * is a sequence of fields, each one a sequence of segments:
+ *
+ *   text:   0x02, strxfrm() of the text, 0x00
+ *   number: 0x01, the number of digits, the digits without leading zeros
+ *
+ * and the field ends with 0x00, so a shorter field sorts first.  In the
+ * natural order the digits in a text make number segments, so "track 2"
+ * sorts before "track 10".  Items with equal keys keep their order. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "common.h"
+#include "sort_keys.h"
+
+#define SEG_NUMBER	0x01
+#define SEG_TEXT	0x02
+#define FIELD_END	0x00
+
+/* Sort at least this many keys in parallel. */
+#define PARALLEL_MIN	16384
+#define MAX_THREADS	4
+
+struct sort_entry
+{
+	size_t offset;		/* of the key in the keys' data */
+	size_t len;
+	int index;		/* of the item */
+};
+
+struct sort_keys
+{
+	struct sort_entry *entries;
+	int count;
+	int allocated;
+
+	unsigned char *data;	/* all keys one after another */
+	size_t len;
+	size_t size;
+	size_t key_start;	/* offset of the key being built */
+
+	char *seg;		/* copy of a text segment for strxfrm() */
+	size_t seg_size;
+
+	bool natural;
+};
+
+struct sort_chunk
+{
+	const struct sort_keys *k;
+	struct sort_entry *entries;
+	int count;
+};
+
+struct sort_keys *sort_keys_new (const int count, const bool natural)
+{
+	struct sort_keys *k;
+
+	k = (struct sort_keys *)xmalloc (sizeof(struct sort_keys));
+	k->allocated = MAX(count, 1);
+	k->entries = (struct sort_entry *)xmalloc (sizeof(struct sort_entry)
+			* k->allocated);
+	k->count = 0;
+	k->size = 64 * k->allocated;
+	k->data = (unsigned char *)xmalloc (k->size);
+	k->len = 0;
+	k->key_start = 0;
+	k->seg_size = 256;
+	k->seg = (char *)xmalloc (k->seg_size);
+	k->natural = natural;
+
+	return k;
+}
+
+static void reserve (struct sort_keys *k, const size_t len)
+{
+	if (k->len + len > k->size) {
+		while (k->len + len > k->size)
+			k->size *= 2;
+		k->data = (unsigned char *)xrealloc (k->data, k->size);
+	}
+}
+
+static void put_byte (struct sort_keys *k, const unsigned char c)
+{
+	reserve (k, 1);
+	k->data[k->len++] = c;
+}
+
+/* Add the text segment of len chars. */
+static void add_text_segment (struct sort_keys *k, const char *text,
+		const size_t len)
+{
+	size_t xlen;
+
+	if (len + 1 > k->seg_size) {
+		k->seg_size = len + 1;
+		k->seg = (char *)xrealloc (k->seg, k->seg_size);
+	}
+	memcpy (k->seg, text, len);
+	k->seg[len] = 0;
+
+	put_byte (k, SEG_TEXT);
+
+	xlen = strxfrm ((char *)k->data + k->len, k->seg, k->size - k->len);
+	if (xlen >= k->size - k->len) {
+		reserve (k, xlen + 1);
+		strxfrm ((char *)k->data + k->len, k->seg, k->size - k->len);
+	}
+	k->len += xlen;
+
+	put_byte (k, 0x00);
+}
+
+/* Add the number segment of len digits. */
+static void add_number_segment (struct sort_keys *k, const char *digits,
+		size_t len)
+{
+	while (len > 1 && *digits == '0') {
+		digits++;
+		len--;
+	}
+
+	len = MIN(len, 255);
+	put_byte (k, SEG_NUMBER);
+	put_byte (k, len);
+	reserve (k, len);
+	memcpy (k->data + k->len, digits, len);
+	k->len += len;
+}
+
+/* Add the text as the next field of the current key. */
+void sort_keys_add_text (struct sort_keys *k, const char *text)
+{
+	assert (k != NULL);
+
+	if (text && *text) {
+		if (!k->natural)
+			add_text_segment (k, text, strlen (text));
+		else {
+			while (*text) {
+				size_t len = 0;
+
+				if (isdigit ((unsigned char)*text)) {
+					while (isdigit ((unsigned char)text[len]))
+						len++;
+					add_number_segment (k, text, len);
+				}
+				else {
+					while (text[len] && !isdigit ((unsigned char)text[len]))
+						len++;
+					add_text_segment (k, text, len);
+				}
+
+				text += len;
+			}
+		}
+	}
+
+	put_byte (k, FIELD_END);
+}
+
+/* Add the number as the next field of the current key, negative numbers
+ * make an empty field. */
+void sort_keys_add_number (struct sort_keys *k, const int num)
+{
+	assert (k != NULL);
+
+	if (num >= 0) {
+		char digits[16];
+
+		snprintf (digits, sizeof(digits), "%d", num);
+		add_number_segment (k, digits, strlen (digits));
+	}
+
+	put_byte (k, FIELD_END);
+}
+
+/* Finish the current key as the key of the item with the index. */
+void sort_keys_next (struct sort_keys *k, const int index)
+{
+	assert (k != NULL);
+
+	if (k->count == k->allocated) {
+		k->allocated *= 2;
+		k->entries = (struct sort_entry *)xrealloc (k->entries,
+				sizeof(struct sort_entry) * k->allocated);
+	}
+
+	k->entries[k->count].offset = k->key_start;
+	k->entries[k->count].len = k->len - k->key_start;
+	k->entries[k->count].index = index;
+	k->count++;
+	k->key_start = k->len;
+}
+
+static int entry_cmp (const struct sort_keys *k, const struct sort_entry *a,
+		const struct sort_entry *b)
+{
+	int res;
+
+	res = memcmp (k->data + a->offset, k->data + b->offset,
+			MIN(a->len, b->len));
+	if (res)
+		return res;
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+
+	return a->index - b->index;
+}
+
+/* Sort the entries with insertion into runs of 16 and merging the runs
+ * using tmp of the same size.  (qsort() can't pass the keys to the
+ * comparison function without a global.) */
+static void merge_sort (const struct sort_keys *k, struct sort_entry *entries,
+		struct sort_entry *tmp, const int count)
+{
+	struct sort_entry *src = entries, *dst = tmp;
+	int run, i;
+
+	for (i = 0; i < count; i += 16) {
+		int j, end = MIN(i + 16, count);
+
+		for (j = i + 1; j < end; j++) {
+			struct sort_entry e = entries[j];
+			int l = j;
+
+			while (l > i && entry_cmp (k, &entries[l - 1], &e) > 0) {
+				entries[l] = entries[l - 1];
+				l--;
+			}
+			entries[l] = e;
+		}
+	}
+
+	for (run = 16; run < count; run *= 2) {
+		struct sort_entry *swap;
+
+		for (i = 0; i < count; i += 2 * run) {
+			int a = i, b = MIN(i + run, count);
+			int a_end = b, b_end = MIN(i + 2 * run, count);
+			int o = i;
+
+			while (a < a_end && b < b_end)
+				dst[o++] = entry_cmp (k, &src[a], &src[b]) <= 0
+					? src[a++] : src[b++];
+			while (a < a_end)
+				dst[o++] = src[a++];
+			while (b < b_end)
+				dst[o++] = src[b++];
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != entries)
+		memcpy (entries, src, sizeof(struct sort_entry) * count);
+}
+
+static void *sort_chunk_thread (void *arg)
+{
+	struct sort_chunk *c = (struct sort_chunk *)arg;
+	struct sort_entry *tmp;
+
+	tmp = (struct sort_entry *)xmalloc (sizeof(struct sort_entry)
+			* MAX(c->count, 1));
+	merge_sort (c->k, c->entries, tmp, c->count);
+	free (tmp);
+
+	return NULL;
+}
+
+/* Sort the keys.  Large lists are split into chunks sorted by separate
+ * threads, then the chunks are merged. */
+void sort_keys_sort (struct sort_keys *k)
+{
+	struct sort_chunk chunks[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	bool started[MAX_THREADS];
+	struct sort_entry *tmp;
+	int i, nthreads = 1;
+
+	assert (k != NULL);
+
+	if (k->count >= PARALLEL_MIN) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+		nthreads = (int)MAX(MIN(cpus, MAX_THREADS), 1);
+	}
+
+	tmp = (struct sort_entry *)xmalloc (sizeof(struct sort_entry)
+			* MAX(k->count, 1));
+
+	if (nthreads == 1) {
+		merge_sort (k, k->entries, tmp, k->count);
+		free (tmp);
+		return;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		int start = (int)((long)k->count * i / nthreads);
+		int end = (int)((long)k->count * (i + 1) / nthreads);
+
+		chunks[i].k = k;
+		chunks[i].entries = k->entries + start;
+		chunks[i].count = end - start;
+		started[i] = pthread_create (&threads[i], NULL, sort_chunk_thread,
+				&chunks[i]) == 0;
+		if (!started[i])
+			sort_chunk_thread (&chunks[i]);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		if (started[i])
+			pthread_join (threads[i], NULL);
+
+	/* Merge the sorted chunks one by one into the first. */
+	for (i = 1; i < nthreads; i++) {
+		struct sort_entry *a = k->entries;
+		struct sort_entry *b = chunks[i].entries;
+		struct sort_entry *a_end = b, *b_end = b + chunks[i].count;
+		int o = 0;
+
+		while (a < a_end && b < b_end)
+			tmp[o++] = entry_cmp (k, a, b) <= 0 ? *a++ : *b++;
+		while (a < a_end)
+			tmp[o++] = *a++;
+		while (b < b_end)
+			tmp[o++] = *b++;
+
+		memcpy (k->entries, tmp, sizeof(struct sort_entry) * o);
+	}
+
+	free (tmp);
+}
+
+int sort_keys_count (const struct sort_keys *k)
+{
+	assert (k != NULL);
+
+	return k->count;
+}
+
+/* Return the index of the item on the position pos in the sorted order. */
+int sort_keys_index (const struct sort_keys *k, const int pos)
+{
+	assert (k != NULL);
+	assert (LIMIT(pos, k->count));
+
+	return k->entries[pos].index;
+}
+
+void sort_keys_free (struct sort_keys *k)
+{
+	assert (k != NULL);
+
+	free (k->entries);
+	free (k->data);
+	free (k->seg);
+	free (k);
+}
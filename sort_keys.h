@@ -0,0 +1,23 @@
+#ifndef SORT_KEYS_H
+#define SORT_KEYS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sort_keys;
+
+struct sort_keys *sort_keys_new (const int count, const bool natural);
+void sort_keys_add_text (struct sort_keys *k, const char *text);
+void sort_keys_add_number (struct sort_keys *k, const int num);
+void sort_keys_next (struct sort_keys *k, const int index);
+void sort_keys_sort (struct sort_keys *k);
+int sort_keys_count (const struct sort_keys *k);
+int sort_keys_index (const struct sort_keys *k, const int pos);
+void sort_keys_free (struct sort_keys *k);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
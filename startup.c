@@ -0,0 +1,134 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Timing of the startup phases.  The phases are nested with
+ * startup_begin()/startup_end() and timed with the monotonic clock from
+ * startup_init(); the server inherits the phases timed before it was
+ * forked, so its profile and the client's both have them.  Startup runs in
+ * one thread, so there is no locking. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include "common.h"
+#include "log.h"
+#include "startup.h"
+
+#define MAX_PHASES	32
+#define MAX_DEPTH	8
+
+struct phase
+{
+	const char *name;	/* a string constant */
+	int depth;
+	uint64_t start;		/* microseconds since startup_init() */
+	uint64_t usec;
+};
+
+static struct timespec start_time;
+static struct phase phases[MAX_PHASES];
+static int phases_num = 0;
+static int open_phases[MAX_DEPTH];
+static int depth = 0;
+
+/* Return the microseconds since startup_init(). */
+static uint64_t usec_now ()
+{
+	struct timespec now;
+
+	get_monotonic (&now);
+
+	return (uint64_t)(now.tv_sec - start_time.tv_sec) * 1000000
+		+ now.tv_nsec / 1000 - start_time.tv_nsec / 1000;
+}
+
+/* Start timing the startup, as early as possible. */
+void startup_init ()
+{
+	get_monotonic (&start_time);
+	phases_num = 0;
+	depth = 0;
+}
+
+/* Start timing the phase, inside the phases begun and not ended yet.
+ * Phases over the limits are not timed. */
+void startup_begin (const char *phase)
+{
+	assert (phase != NULL);
+
+	if (depth < MAX_DEPTH) {
+		open_phases[depth] = -1;
+		if (phases_num < MAX_PHASES) {
+			struct phase *p = &phases[phases_num];
+
+			p->name = phase;
+			p->depth = depth;
+			p->start = usec_now ();
+			p->usec = 0;
+			open_phases[depth] = phases_num++;
+		}
+	}
+	depth += 1;
+}
+
+/* End the phase begun last. */
+void startup_end ()
+{
+	assert (depth > 0);
+
+	depth -= 1;
+	if (depth < MAX_DEPTH && open_phases[depth] != -1) {
+		struct phase *p = &phases[open_phases[depth]];
+
+		p->usec = usec_now () - p->start;
+	}
+}
+
+/* Log the phases and write them to the file of that name in the MOC
+ * directory, one line each: the name, the nesting depth, the start and
+ * the duration in microseconds, separated by tabs. */
+void startup_profile (const char *name)
+{
+	const char *fname;
+	FILE *file;
+	int i;
+
+	assert (name != NULL);
+
+	logit ("Startup profile (%"PRIu64" us so far):", usec_now ());
+	for (i = 0; i < phases_num; i++)
+		logit ("%*s%s: %.1f ms", phases[i].depth * 2, "",
+				phases[i].name, phases[i].usec / 1000.0);
+
+	fname = create_file_name (name);
+	file = fopen (fname, "w");
+	if (!file) {
+		log_errno ("Can't write the startup profile", errno);
+		return;
+	}
+
+	fprintf (file, "# phase\tdepth\tstart_usec\tusec\n");
+	for (i = 0; i < phases_num; i++)
+		fprintf (file, "%s\t%d\t%"PRIu64"\t%"PRIu64"\n",
+				phases[i].name, phases[i].depth,
+				phases[i].start, phases[i].usec);
+
+	if (fclose (file))
+		log_errno ("Can't write the startup profile", errno);
+}
@@ -0,0 +1,17 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void startup_init ();
+void startup_begin (const char *phase);
+void startup_end ();
+void startup_profile (const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,402 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Counters of the server's sound pipeline.  They are changed by many
+ * threads at the places they count, so they are plain atomic additions;
+ * the report made for CMD_GET_STATS is not a consistent snapshot of all
+ * of them, it doesn't need to be.
+ *
+ * With OutputStats set the output thread also times its writes to the
+ * device and keeps a trace of the last of them; without it none of that
+ * code runs. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include "common.h"
+#include "log.h"
+#include "stats.h"
+#include "thread_sched.h"
+
+/* The output trace keeps the last TRACE_SIZE writes to the device and the
+ * underruns among them.  Only the output thread adds to it; trace_next
+ * counts all the entries ever added. */
+#define TRACE_SIZE	8192
+#define TRACE_FILE	"output_trace"
+
+struct trace_entry
+{
+	struct timespec time;	/* start of the write or the underrun */
+	uint32_t write_usec;
+	uint32_t interval_usec;	/* since the previous write, 0 if none */
+	int32_t device_usec;	/* sound in the device, -1 if not known */
+	uint16_t fill;		/* output buffer fill in per mille */
+	uint16_t xrun;		/* an underrun, not a write */
+};
+
+static int64_t counters[STATS_NUM];
+static int64_t fill_hist[STATS_FILL_BUCKETS];
+static int64_t hists[STATS_HISTS_NUM][STATS_HIST_BUCKETS];
+
+static struct trace_entry output_trace[TRACE_SIZE];
+static uint64_t trace_next;
+
+/* Start of the last write, used only by the output thread. */
+static struct timespec last_write;
+static bool last_write_valid = false;
+
+void stats_add (const enum stats_counter c, const int64_t n)
+{
+	assert (c < STATS_NUM);
+
+	ATOMIC_ADD (&counters[c], n);
+}
+
+/* Count the output buffer fill seen when taking the sound out of it. */
+void stats_fill_sample (const size_t fill, const size_t size)
+{
+	int bucket;
+
+	if (!size)
+		return;
+
+	bucket = (int)((uint64_t)fill * STATS_FILL_BUCKETS / size);
+	ATOMIC_ADD (&fill_hist[MIN(bucket, STATS_FILL_BUCKETS - 1)], 1);
+}
+
+/* Return the microseconds from start to end, 0 if end is earlier. */
+static uint64_t usec_between (const struct timespec *start,
+		const struct timespec *end)
+{
+	int64_t usec = (end->tv_sec - start->tv_sec) * INT64_C(1000000)
+	               + (end->tv_nsec - start->tv_nsec) / 1000;
+
+	return usec > 0 ? usec : 0;
+}
+
+static void hist_add (const enum stats_hist h, const uint64_t usec)
+{
+	uint64_t v = usec >> 7;
+	int bucket = 0;
+
+	while (v && bucket < STATS_HIST_BUCKETS - 1) {
+		v >>= 1;
+		bucket += 1;
+	}
+
+	ATOMIC_ADD (&hists[h][bucket], 1);
+}
+
+/* Return the next trace entry to fill; trace_add() makes it visible. */
+static struct trace_entry *trace_entry ()
+{
+	struct trace_entry *e = &output_trace[trace_next % TRACE_SIZE];
+
+	memset (e, 0, sizeof(struct trace_entry));
+
+	return e;
+}
+
+static void trace_add ()
+{
+	ATOMIC_STORE (&trace_next, trace_next + 1);
+}
+
+/* Count a write to the device made by the output thread, which started at
+ * start and took write_usec.  device_usec is the sound left in the device
+ * after it (-1 if not known), fill is how much was in the output buffer of
+ * size bytes before it. */
+void stats_output_write (const struct timespec *start,
+		const uint64_t write_usec, const int64_t device_usec,
+		const size_t fill, const size_t size)
+{
+	struct trace_entry *e = trace_entry ();
+
+	e->time = *start;
+	e->write_usec = MIN(write_usec, UINT32_MAX);
+	e->device_usec = device_usec >= 0 ? MIN(device_usec, INT32_MAX) : -1;
+	e->fill = size ? (uint16_t)((uint64_t)fill * 1000 / size) : 0;
+
+	hist_add (STAT_HIST_WRITE, write_usec);
+	if (device_usec >= 0)
+		hist_add (STAT_HIST_DEVICE_FILL, device_usec);
+
+	if (last_write_valid) {
+		uint64_t interval = usec_between (&last_write, start);
+
+		e->interval_usec = MIN(interval, UINT32_MAX);
+		hist_add (STAT_HIST_INTERVAL, interval);
+	}
+
+	last_write = *start;
+	last_write_valid = true;
+
+	trace_add ();
+}
+
+/* Put an underrun into the output trace. */
+void stats_output_xrun ()
+{
+	struct trace_entry *e = trace_entry ();
+
+	get_realtime (&e->time);
+	e->device_usec = -1;
+	e->xrun = 1;
+
+	trace_add ();
+}
+
+/* The output thread has stopped playing (pause or stop), so the time until
+ * the next write is not an interval between writes. */
+void stats_output_idle ()
+{
+	last_write_valid = false;
+}
+
+/* Return the microseconds since start. */
+uint64_t stats_usec_since (const struct timespec *start)
+{
+	struct timespec now;
+
+	get_realtime (&now);
+
+	return usec_between (start, &now);
+}
+
+/* Return the time spent per second of sound as text. */
+static void format_cost (char *buf, const size_t size, const int64_t usec,
+		const int64_t sound_usec)
+{
+	if (sound_usec > 0)
+		snprintf (buf, size, "%.2f ms/s", usec * 1000.0 / sound_usec);
+	else
+		strcpy (buf, "-");
+}
+
+/* Return the percentage of hits as text. */
+static void format_ratio (char *buf, const size_t size, const int64_t hits,
+		const int64_t all)
+{
+	if (all > 0)
+		snprintf (buf, size, "%.1f%%", hits * 100.0 / all);
+	else
+		strcpy (buf, "-");
+}
+
+/* Put the histogram h as text into buf: the count for each bucket marked
+ * with its upper bound.  Return the number of samples in it. */
+static int64_t format_hist (char *buf, const size_t size,
+		const enum stats_hist h)
+{
+	int64_t all = 0;
+	size_t pos = 0;
+	int i;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		int64_t n = ATOMIC_LOAD (&hists[h][i]);
+		long bound = 128L << MIN(i, STATS_HIST_BUCKETS - 2);
+		char label[16];
+
+		if (bound < 1000)
+			snprintf (label, sizeof(label), "%ldus", bound);
+		else
+			snprintf (label, sizeof(label), "%ldms", bound / 1000);
+
+		pos += snprintf (buf + pos, size - pos, "%s%s%s:%"PRId64,
+				i ? " " : "",
+				i == STATS_HIST_BUCKETS - 1 ? ">" : "<",
+				label, n);
+		all += n;
+	}
+
+	return all;
+}
+
+/* Put the live memory of the subsystems as text into buf, or an empty
+ * string if it is not counted. */
+static void format_memory (char *buf, const size_t size)
+{
+	size_t pos = 0;
+	int i;
+
+	buf[0] = 0;
+	for (i = 0; i < MEM_SUBSYSTEMS; i++) {
+		long bytes, blocks;
+
+		if (!mem_stats_get (i, &bytes, &blocks))
+			return;
+
+		pos += snprintf (buf + pos, size - pos, "%s%s %ld kB in %ld "
+				"blocks", i ? ", " : "Memory: ",
+				mem_tag_name (i), bytes / 1024, blocks);
+	}
+	snprintf (buf + pos, size - pos, "\n");
+}
+
+/* Return the report of the counters, one line each.  The result must be
+ * freed. */
+char *stats_report ()
+{
+	int64_t c[STATS_NUM], hist[STATS_FILL_BUCKETS], samples = 0;
+	int64_t tags_hits, tags_all;
+	char decode[32], conv[32], dsp[32], hit_ratio[32];
+	char hist_str[STATS_FILL_BUCKETS * 8];
+	char write_hist[512], interval_hist[512], device_hist[512];
+	char memory[512];
+	char *output = NULL, *threads, *report;
+	size_t pos = 0;
+	int i;
+
+	for (i = 0; i < STATS_NUM; i++)
+		c[i] = ATOMIC_LOAD (&counters[i]);
+	for (i = 0; i < STATS_FILL_BUCKETS; i++) {
+		hist[i] = ATOMIC_LOAD (&fill_hist[i]);
+		samples += hist[i];
+	}
+
+	/* The fill histogram in percents of the samples. */
+	for (i = 0; i < STATS_FILL_BUCKETS; i++)
+		pos += snprintf (hist_str + pos, sizeof(hist_str) - pos, "%s%d",
+				i ? " " : "", samples
+				? (int)(hist[i] * 100 / samples) : 0);
+
+	format_cost (decode, sizeof(decode), c[STAT_DECODE_USEC],
+			c[STAT_DECODED_USEC]);
+	format_cost (conv, sizeof(conv), c[STAT_CONV_USEC],
+			c[STAT_DECODED_USEC]);
+	format_cost (dsp, sizeof(dsp), c[STAT_DSP_USEC],
+			c[STAT_DECODED_USEC]);
+
+	tags_hits = c[STAT_TAGS_MEM_HITS] + c[STAT_TAGS_STORE_HITS];
+	tags_all = tags_hits + c[STAT_TAGS_MISSES];
+	format_ratio (hit_ratio, sizeof(hit_ratio), tags_hits, tags_all);
+
+	/* The output histograms are only there with OutputStats set. */
+	if (format_hist (write_hist, sizeof(write_hist), STAT_HIST_WRITE) > 0) {
+		format_hist (interval_hist, sizeof(interval_hist),
+				STAT_HIST_INTERVAL);
+		format_hist (device_hist, sizeof(device_hist),
+				STAT_HIST_DEVICE_FILL);
+		output = format_msg ("WriteTime: %s\n"
+		                     "WriteInterval: %s\n"
+		                     "DeviceFill: %s\n",
+		                     write_hist, interval_hist, device_hist);
+	}
+
+	format_memory (memory, sizeof(memory));
+	threads = thread_sched_report ();
+
+	report = format_msg ("Underruns: %"PRId64"\n"
+	                   "BufferFill: %s (%% of %"PRId64" samples in "
+	                   "tenths of the buffer)\n"
+	                   "Decoded: %"PRId64" s\n"
+	                   "DecodeTime: %s\n"
+	                   "ConversionTime: %s\n"
+	                   "DSPTime: %s\n"
+	                   "TagsHits: %"PRId64" memory, %"PRId64" disk, "
+	                   "%"PRId64" read (%s)\n"
+	                   "TagsQueued: %"PRId64"\n"
+	                   "Scanned: %"PRId64" files, %"PRId64" read\n"
+	                   "%s%s%s",
+	                   c[STAT_UNDERRUNS],
+	                   hist_str, samples,
+	                   c[STAT_DECODED_USEC] / 1000000,
+	                   decode, conv, dsp,
+	                   c[STAT_TAGS_MEM_HITS], c[STAT_TAGS_STORE_HITS],
+	                   c[STAT_TAGS_MISSES], hit_ratio,
+	                   c[STAT_TAGS_QUEUED],
+	                   c[STAT_SCAN_FILES], c[STAT_SCAN_READ],
+	                   memory, threads, output ? output : "");
+	free (threads);
+	free (output);
+
+	return report;
+}
+
+/* Write the output trace to a file in the MOC directory, oldest entries
+ * first, with the time in the format of the log so it can be matched with
+ * what the log says happened then.  Return the file name (to be freed) or
+ * NULL if the trace is empty or can't be written. */
+char *stats_output_trace_dump ()
+{
+	struct trace_entry *entries;
+	uint64_t first, end, now, i;
+	char *fname;
+	FILE *file;
+
+	end = ATOMIC_LOAD (&trace_next);
+	if (end == 0)
+		return NULL;
+
+	first = end > TRACE_SIZE ? end - TRACE_SIZE : 0;
+	entries = (struct trace_entry *)xmalloc ((end - first)
+			* sizeof(struct trace_entry));
+	for (i = first; i < end; i++)
+		entries[i - first] = output_trace[i % TRACE_SIZE];
+
+	/* Drop the entries the output thread could overwrite while we were
+	 * copying them. */
+	ATOMIC_FENCE ();
+	now = ATOMIC_LOAD (&trace_next);
+	i = now >= TRACE_SIZE ? now - TRACE_SIZE + 1 : 0;
+	i = MAX(i, first);
+
+	fname = xstrdup (create_file_name (TRACE_FILE));
+	file = fopen (fname, "w");
+	if (!file) {
+		log_errno ("Can't create the output trace file", errno);
+		free (entries);
+		free (fname);
+		return NULL;
+	}
+
+	fprintf (file, "# time event write_us interval_us device_us "
+	               "fill_permille\n");
+	for (; i < end; i++) {
+		const struct trace_entry *e = &entries[i - first];
+		char time_str[20];
+		time_t sec = e->time.tv_sec;
+		struct tm tm_time;
+
+		localtime_r (&sec, &tm_time);
+		strftime (time_str, sizeof (time_str), "%b %e %T", &tm_time);
+
+		if (e->xrun)
+			fprintf (file, "%s.%06ld underrun\n", time_str,
+					e->time.tv_nsec / 1000L);
+		else
+			fprintf (file, "%s.%06ld write %"PRIu32" %"PRIu32
+					" %"PRId32" %u\n", time_str,
+					e->time.tv_nsec / 1000L, e->write_usec,
+					e->interval_usec, e->device_usec,
+					(unsigned int)e->fill);
+	}
+
+	free (entries);
+
+	if (fclose (file) != 0) {
+		log_errno ("Can't write the output trace file", errno);
+		free (fname);
+		return NULL;
+	}
+
+	logit ("Output trace written to %s", fname);
+
+	return fname;
+}
@@ -0,0 +1,60 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counters of the server's sound pipeline, since the server started. */
+enum stats_counter
+{
+	STAT_UNDERRUNS,		/* output buffer underruns */
+	STAT_DECODE_USEC,	/* time spent in the decoders */
+	STAT_DECODED_USEC,	/* sound decoded, in microseconds of it */
+	STAT_CONV_USEC,		/* time spent converting the sound format */
+	STAT_DSP_USEC,		/* time spent in the DSP effects */
+	STAT_TAGS_MEM_HITS,	/* tags found in the memory cache */
+	STAT_TAGS_STORE_HITS,	/* tags found in the on-disk cache */
+	STAT_TAGS_MISSES,	/* tags read from the files */
+	STAT_TAGS_QUEUED,	/* tags requests waiting (not a counter) */
+	STAT_SCAN_FILES,	/* files visited by tags_cache_scan() */
+	STAT_SCAN_READ,		/* of them, files whose tags were read */
+	STATS_NUM
+};
+
+/* The output buffer fill is counted in so many equal parts. */
+#define STATS_FILL_BUCKETS	10
+
+/* Histograms of the output thread, kept only with OutputStats set.  The
+ * buckets are powers of two microseconds: under 128us, under 256us... and
+ * the last is for everything longer. */
+enum stats_hist
+{
+	STAT_HIST_WRITE,	/* time taken to write a chunk to the device */
+	STAT_HIST_INTERVAL,	/* time between the starts of the writes */
+	STAT_HIST_DEVICE_FILL,	/* sound left in the device after a write */
+	STATS_HISTS_NUM
+};
+
+#define STATS_HIST_BUCKETS	12
+
+void stats_add (const enum stats_counter c, const int64_t n);
+void stats_fill_sample (const size_t fill, const size_t size);
+uint64_t stats_usec_since (const struct timespec *start);
+char *stats_report ();
+
+void stats_output_write (const struct timespec *start,
+		const uint64_t write_usec, const int64_t device_usec,
+		const size_t fill, const size_t size);
+void stats_output_xrun ();
+void stats_output_idle ();
+char *stats_output_trace_dump ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* The status page is a small file in the MOC directory mapped into the
+ * memory of the server, which keeps the playback state in it up to date.
+ * Status queries map it and copy the state without asking the server.
+ * The writer makes the sequence number odd while changing the state, and
+ * a reader retries when it's odd or changed under it (a seqlock). */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "log.h"
+#include "protocol.h"
+#include "status_page.h"
+
+#define STATUS_PAGE_FILE	"status"
+#define STATUS_PAGE_VERSION	1
+
+/* Give up reading after so many retries, the server must be stuck in the
+ * middle of an update. */
+#define READ_TRIES		1000
+
+struct status_page
+{
+	int version;
+	int size;		/* sizeof(struct status_page) */
+	pid_t pid;		/* the server's, 0 after it has exited */
+	unsigned int seq;
+	struct status_info info;
+};
+
+static struct status_page *page = NULL;
+static int page_fd = -1;
+
+/* Serialises the writers: the server's threads update different fields. */
+static pthread_mutex_t page_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create the status page.  The server runs without it if it can't be
+ * created. */
+void status_page_init ()
+{
+	char *fname = create_file_name (STATUS_PAGE_FILE);
+	void *mem;
+
+	assert (page == NULL);
+
+	page_fd = open (fname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (page_fd == -1) {
+		log_errno ("Can't create the status page", errno);
+		return;
+	}
+
+	if (ftruncate (page_fd, sizeof(struct status_page)) == -1) {
+		log_errno ("Can't set the size of the status page", errno);
+		close (page_fd);
+		page_fd = -1;
+		unlink (fname);
+		return;
+	}
+
+	mem = mmap (NULL, sizeof(struct status_page), PROT_READ | PROT_WRITE,
+			MAP_SHARED, page_fd, 0);
+	if (mem == MAP_FAILED) {
+		log_errno ("Can't map the status page", errno);
+		close (page_fd);
+		page_fd = -1;
+		unlink (fname);
+		return;
+	}
+
+	page = (struct status_page *)mem;
+	page->version = STATUS_PAGE_VERSION;
+	page->size = sizeof(struct status_page);
+	page->info.state = STATE_STOP;
+	page->info.curr_time = -1;
+	page->info.total_time = -1;
+	page->info.rate = -1;
+	page->info.bitrate = -1;
+	page->info.avg_bitrate = -1;
+	page->info.channels = -1;
+	page->info.volume = -1;
+	page->info.track = -1;
+
+	/* The readers don't look at the page until the pid is there. */
+	ATOMIC_STORE (&page->pid, getpid ());
+}
+
+/* Mark the page as not valid and remove it. */
+void status_page_cleanup ()
+{
+	if (!page)
+		return;
+
+	ATOMIC_STORE (&page->pid, 0);
+	unlink (create_file_name (STATUS_PAGE_FILE));
+
+	munmap (page, sizeof(struct status_page));
+	close (page_fd);
+	page = NULL;
+	page_fd = -1;
+}
+
+/* Start changing the page and return its state to be changed or NULL if
+ * there is no page.  status_page_end() must be called in both cases. */
+struct status_info *status_page_begin ()
+{
+	LOCK (page_mtx);
+
+	if (!page)
+		return NULL;
+
+	ATOMIC_STORE (&page->seq, page->seq + 1);
+	ATOMIC_FENCE ();
+
+	return &page->info;
+}
+
+/* Publish the changes made since status_page_begin(). */
+void status_page_end ()
+{
+	if (page)
+		ATOMIC_STORE (&page->seq, page->seq + 1);
+
+	UNLOCK (page_mtx);
+}
+
+/* Copy a consistent state from the page into info.  Return false if there
+ * is no page or the server that wrote it doesn't run. */
+static bool copy_page (const struct status_page *p, struct status_info *info)
+{
+	int tries;
+	pid_t pid;
+
+	if (p->version != STATUS_PAGE_VERSION
+			|| p->size != sizeof(struct status_page))
+		return false;
+
+	pid = ATOMIC_LOAD (&p->pid);
+	if (pid <= 0 || (kill (pid, 0) == -1 && errno == ESRCH))
+		return false;
+
+	for (tries = 0; tries < READ_TRIES; tries++) {
+		unsigned int seq = ATOMIC_LOAD (&p->seq);
+
+		if (seq & 1) {
+			sched_yield ();
+			continue;
+		}
+
+		memcpy (info, &p->info, sizeof(struct status_info));
+		ATOMIC_FENCE ();
+
+		if (ATOMIC_LOAD (&p->seq) == seq)
+			return true;
+	}
+
+	return false;
+}
+
+/* Read the state published by the running server.  Return false if it's
+ * not available (old server, no server or no page). */
+bool status_page_read (struct status_info *info)
+{
+	char *fname = create_file_name (STATUS_PAGE_FILE);
+	struct stat st;
+	void *mem;
+	bool res;
+	int fd;
+
+	fd = open (fname, O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	if (fstat (fd, &st) == -1 || st.st_size != sizeof(struct status_page)) {
+		close (fd);
+		return false;
+	}
+
+	mem = mmap (NULL, sizeof(struct status_page), PROT_READ, MAP_SHARED,
+			fd, 0);
+	close (fd);
+	if (mem == MAP_FAILED)
+		return false;
+
+	res = copy_page ((const struct status_page *)mem, info);
+	munmap (mem, sizeof(struct status_page));
+
+	if (res) {
+		info->file[sizeof(info->file) - 1] = 0;
+		info->title[sizeof(info->title) - 1] = 0;
+		info->artist[sizeof(info->artist) - 1] = 0;
+		info->album[sizeof(info->album) - 1] = 0;
+	}
+
+	return res;
+}
@@ -0,0 +1,48 @@
+#ifndef STATUS_PAGE_H
+#define STATUS_PAGE_H
+
+#include <stdbool.h>
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximal length of the tag strings (with the terminating zero) in the
+ * status page, longer ones are cut. */
+#define STATUS_TAG_MAX	256
+
+/* Playback state published by the server.  The strings are empty if not
+ * known, the numbers -1. */
+struct status_info
+{
+	int state;
+	int curr_time;
+	int total_time;
+	int rate;		/* kHz */
+	int bitrate;		/* kbps */
+	int avg_bitrate;	/* kbps */
+	int channels;
+	int volume;		/* 0..100 */
+	int track;
+	char file[MAX_SEND_STRING + 1];
+	char title[STATUS_TAG_MAX];	/* the title tag */
+	char artist[STATUS_TAG_MAX];
+	char album[STATUS_TAG_MAX];
+};
+
+/* Server side. */
+void status_page_init ();
+void status_page_cleanup ();
+struct status_info *status_page_begin ();
+void status_page_end ();
+
+/* Client side. */
+bool status_page_read (struct status_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* String pool: one reference counted copy of each string.  Tags stored
+ * on playlists take artist and album names from here, so a name shared
+ * by thousands of files is kept in memory once. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "common.h"
+#include "hash_index.h"
+#include "str_pool.h"
+
+struct pool_str
+{
+	int refs;
+	char str[];
+};
+
+static struct hash_index *pool = NULL;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *pool_str_key (const void *data,
+                                 const void *unused ATTR_UNUSED)
+{
+	return ((const struct pool_str *)data)->str;
+}
+
+static struct pool_str *pool_str_of (char *str)
+{
+	return (struct pool_str *)(str - offsetof(struct pool_str, str));
+}
+
+/* Return the pooled copy of the string (NULL for NULL).  It must not be
+ * modified and must be released with str_pool_put(). */
+char *str_pool_get (const char *str)
+{
+	struct pool_str *s;
+
+	if (!str)
+		return NULL;
+
+	LOCK (pool_mtx);
+
+	if (!pool)
+		pool = hash_index_new (pool_str_key, NULL);
+
+	s = (struct pool_str *)hash_index_find (pool, str);
+	if (!s) {
+		size_t len = strlen (str) + 1;
+
+		s = (struct pool_str *)xmalloc_tag (sizeof(struct pool_str)
+				+ len, MEM_TAGS);
+		s->refs = 0;
+		memcpy (s->str, str, len);
+		hash_index_set (pool, s);
+	}
+
+	s->refs += 1;
+
+	UNLOCK (pool_mtx);
+
+	return s->str;
+}
+
+/* Release the string got from str_pool_get(). */
+void str_pool_put (char *str)
+{
+	struct pool_str *s;
+
+	if (!str)
+		return;
+
+	s = pool_str_of (str);
+
+	LOCK (pool_mtx);
+
+	assert (s->refs > 0);
+	assert (hash_index_find (pool, str) == s);
+
+	s->refs -= 1;
+	if (s->refs == 0) {
+		hash_index_delete (pool, str);
+		xfree_tag (s, MEM_TAGS);
+	}
+
+	UNLOCK (pool_mtx);
+}
+
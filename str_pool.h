@@ -0,0 +1,15 @@
+#ifndef STR_POOL_H
+#define STR_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+char *str_pool_get (const char *str);
+void str_pool_put (char *str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,6 +17,8 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -24,6 +26,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <math.h>
 
 #ifdef HAVE_DB_H
 # ifndef HAVE_U_INT
@@ -46,16 +49,28 @@ typedef unsigned long int u_long;
 #include "tags_cache.h"
 #include "log.h"
 #include "audio.h"
-
-#ifdef HAVE_DB_H
-# define DB_ONLY
-#else
-# define DB_ONLY ATTR_UNUSED
-#endif
+#include "options.h"
+#include "tags_store.h"
+#include "stats.h"
+#include "hash_index.h"
+#include "decoder.h"
+#include "dir_watch.h"
+#include "thread_sched.h"
+#include "loudness.h"
 
 /* The name of the tags database in the cache directory. */
 #define TAGS_DB "tags.db"
 
+/* The name of the tags store (used instead of the database) in the cache
+ * directory. */
+#define TAGS_STORE "tags.store"
+
+/* Number of locks for the records in the store, chosen by file name. */
+#define RECORD_LOCKS 64
+
+/* Index of the records by access time. */
+#define ATIME_DB "atime.db"
+
 /* The name of the version tag file in the cache directory. */
 #define MOC_VERSION_TAG "moc_version_tag"
 
@@ -69,11 +84,24 @@ typedef unsigned long int u_long;
  * temporarily set it to zero to disable cache activity during structural
  * changes which require multiple commits.
  */
-#define CACHE_DB_FORMAT_VERSION	2
+#define CACHE_DB_FORMAT_VERSION	4
+
+/* How many records over the cache size one tags_cache_gc() call removes
+ * at most, so that it can be done between requests. */
+#define GC_SLICE 16
 
-/* How frequently to flush the tags database to disk.  A value of zero
- * disables flushing. */
-#define DB_SYNC_COUNT 5
+/* Size of the keys of the access time index. */
+#define ATIME_KEY_SIZE 8
+
+/* The most tags reader threads. */
+#define TAGS_READERS_MAX 32
+
+/* The name of the file in the cache directory holding the directory being
+ * scanned, so that the scan is resumed when the server starts again. */
+#define SCAN_STATE "scan_dir"
+
+/* The tags read by the scan. */
+#define SCAN_TAGS (TAGS_COMMENTS | TAGS_TIME)
 
 /* Element of a requests queue. */
 struct request_queue_node
@@ -87,6 +115,22 @@ struct request_queue
 {
 	struct request_queue_node *head;
 	struct request_queue_node *tail;
+	int boosted; /* number of requests at the head for files the client
+	                shows, which are served before any others */
+};
+
+/* A record of the in-memory cache of recently used tags. */
+struct mem_entry
+{
+	char *file;
+	time_t mtime;			/* modification time of the file when
+					   the tags were read */
+	bool watched;			/* its directory was watched since
+					   before the tags were read, so they
+					   are valid without checking mtime */
+	struct file_tags *tags;
+	struct mem_entry *prev;		/* more recently used */
+	struct mem_entry *next;		/* less recently used */
 };
 
 struct tags_cache
@@ -95,9 +139,29 @@ struct tags_cache
 #ifdef HAVE_DB_H
 	DB_ENV *db_env;
 	DB *db;
+	DB *atime_db;		/* index of db by access time */
+	int nrecords;		/* number of records in db */
 	u_int32_t locker;
 #endif
 
+	/* The store used instead of the DB. */
+	struct tags_store *store;
+	pthread_mutex_t record_mtx[RECORD_LOCKS];
+
+	int unsynced; /* records added since the last tags_cache_flush() */
+	pthread_mutex_t flush_mtx; /* held while flushing */
+
+	/* The flusher thread writes the added records to disk in batches:
+	 * after sync_count records or every sync_interval seconds (none of
+	 * them if zero) and when the cache is freed. */
+	int sync_count;
+	int sync_interval;
+	bool flusher_running;
+	int stop_flusher;
+	pthread_t flusher;
+	pthread_cond_t flusher_cond;
+	pthread_mutex_t flusher_mtx;	/* for stop_flusher */
+
 	int max_items;		/* maximum number of items in the cache. */
 	struct request_queue queues[CLIENTS_MAX]; /* requests queues for each
 						     client */
@@ -106,8 +170,84 @@ struct tags_cache
 	pthread_cond_t request_cond; /* condition for signalizing new
 					requests */
 	pthread_mutex_t mutex; /* mutex for all above data (except db because
-				  it's thread-safe) */
-	pthread_t reader_thread; /* tid of the reading thread */
+				  it's thread-safe) and curr_queue */
+	int curr_queue; /* index of the queue from where the next request
+			   is taken */
+	int readers; /* number of reader threads */
+	pthread_t *reader_threads; /* tids of the reader threads */
+
+	/* Recently used tags kept in memory in front of the DB. */
+	struct rb_tree *mem_index;	/* mem_entry by file name */
+	struct mem_entry *mem_head;	/* the most recently used */
+	struct mem_entry *mem_tail;	/* the least recently used */
+	int mem_items;
+	int mem_max_items;		/* zero if disabled */
+	pthread_mutex_t mem_mutex;	/* for all of the mem_* fields */
+
+	/* Watch of the directories of the files requested by the clients:
+	 * changes remove the tags from memory, and tags of the files in the
+	 * caches are read again and sent to all clients. */
+	struct dir_watch *watch;	/* NULL if not watching */
+	int watch_gen;			/* incremented on each change
+					   (atomic) */
+
+	/* The scan of a directory tree (tags_cache_scan()). */
+	struct scan *scan;		/* the last scan started or NULL */
+	char *scan_state;		/* SCAN_STATE file, NULL if the cache
+					   isn't loaded */
+	pthread_mutex_t scan_mtx;	/* for scan */
+
+	/* The analyzer measuring the loudness of the files in the background
+	 * (if Normalize is not Off). */
+	bool analyzer_running;
+	int stop_analyzer;		/* set to stop it (atomic) */
+	pthread_t analyzer;
+	lists_t_strs *analyze;		/* files to measure, the last added
+					   first */
+	struct rb_tree *analyze_set;	/* the strings in analyze */
+	lists_t_strs *analyze_albums;	/* directories whose album loudness
+					   to compute after the files */
+	struct rb_tree *albums;		/* album_loudness by directory */
+	pthread_cond_t analyze_cond;	/* a file or album was added */
+	pthread_mutex_t analyze_mtx;	/* for analyze, analyze_set,
+					   analyze_albums and albums */
+};
+
+/* The loudness of the sound files in a directory taken as an album,
+ * computed by the analyzer. */
+struct album_loudness
+{
+	char *dir;
+	time_t mtime;			/* of the directory when computed */
+	struct loudness loudness;
+};
+
+/* A scan reading the tags of all sound files in a directory tree into the
+ * cache.  Its threads take the directories from a shared stack and push
+ * the subdirectories they find onto it. */
+struct scan
+{
+	struct tags_cache *cache;
+	char *root;
+	bool show_hidden;		/* ShowHiddenFiles */
+	int threads;			/* number of scanning threads */
+	pthread_t thread;		/* the first of them, which starts the
+					   others and waits for them */
+	struct timespec start;
+	int stop;			/* set to stop the scan (atomic) */
+
+	pthread_mutex_t mtx;		/* for the fields below */
+	pthread_cond_t cond;		/* signalled when a directory is pushed
+					   or a thread is done with one */
+	lists_t_strs *dirs;		/* directories still to be read */
+	int busy;			/* threads reading a directory */
+	lists_t_strs *seen;		/* "device:inode" of the directories
+					   pushed, so symlink loops are read
+					   once */
+	struct hash_index *seen_index;	/* of seen */
+	int files;			/* sound files found */
+	int read;			/* files whose tags were read */
+	bool done;			/* the threads have finished */
 };
 
 struct cache_record
@@ -115,6 +255,11 @@ struct cache_record
 	time_t mod_time;		/* last modification time of the file */
 	time_t atime;			/* Time of last access. */
 	struct file_tags *tags;
+	void *seek_table;		/* Decoder's seek table (opaque, may be
+					   NULL) */
+	size_t seek_table_len;
+	struct loudness loudness;	/* duration is negative if it was not
+					   measured */
 };
 
 /* BerkleyDB-provided error code to description function wrapper. */
@@ -138,6 +283,7 @@ static void request_queue_init (struct request_queue *q)
 
 	q->head = NULL;
 	q->tail = NULL;
+	q->boosted = 0;
 }
 
 static void request_queue_clear (struct request_queue *q)
@@ -151,9 +297,11 @@ static void request_queue_clear (struct request_queue *q)
 
 		free (o->file);
 		free (o);
+		stats_add (STAT_TAGS_QUEUED, -1);
 	}
 
 	q->tail = NULL;
+	q->boosted = 0;
 }
 
 /* Remove items from the queue from the beginning to the specified file. */
@@ -174,6 +322,10 @@ static void request_queue_clear_up_to (struct request_queue *q,
 
 		free (o->file);
 		free (o);
+		stats_add (STAT_TAGS_QUEUED, -1);
+
+		if (q->boosted)
+			q->boosted -= 1;
 	}
 
 	if (!q->head)
@@ -202,6 +354,7 @@ static void request_queue_add (struct request_queue *q, const char *file,
 	q->tail->file = xstrdup (file);
 	q->tail->tags_sel = tags_sel;
 	q->tail->next = NULL;
+	stats_add (STAT_TAGS_QUEUED, 1);
 }
 
 static int request_queue_empty (const struct request_queue *q)
@@ -228,21 +381,65 @@ static char *request_queue_pop (struct request_queue *q, int *tags_sel)
 	file = n->file;
 	*tags_sel = n->tags_sel;
 	free (n);
+	stats_add (STAT_TAGS_QUEUED, -1);
 
 	if (q->tail == n)
 		q->tail = NULL; /* the queue is empty */
+	if (q->boosted)
+		q->boosted -= 1;
 
 	return file;
 }
 
-#ifdef HAVE_DB_H
+/* Move the requests for these files to the head of the queue, keeping
+ * their order, and the rest (including the ones boosted before) behind
+ * them. */
+static void request_queue_boost (struct request_queue *q,
+                                 lists_t_strs *files)
+{
+	struct request_queue_node *high = NULL, *high_tail = NULL;
+	struct request_queue_node *low = NULL, *low_tail = NULL;
+	struct request_queue_node *n, *next;
+
+	assert (q != NULL);
+
+	q->boosted = 0;
+
+	for (n = q->head; n; n = next) {
+		next = n->next;
+		n->next = NULL;
+
+		if (lists_strs_exists (files, n->file)) {
+			if (high_tail)
+				high_tail->next = n;
+			else
+				high = n;
+			high_tail = n;
+			q->boosted += 1;
+		}
+		else {
+			if (low_tail)
+				low_tail->next = n;
+			else
+				low = n;
+			low_tail = n;
+		}
+	}
+
+	if (high) {
+		high_tail->next = low;
+		q->head = high;
+	}
+	else
+		q->head = low;
+	q->tail = low ? low_tail : high_tail;
+}
+
 static size_t strlen_null (const char *s)
 {
 	return s ? strlen (s) : 0;
 }
-#endif
 
-#ifdef HAVE_DB_H
 static char *cache_record_serialize (const struct cache_record *rec, int *len)
 {
 	char *buf;
@@ -263,7 +460,10 @@ static char *cache_record_serialize (const struct cache_record *rec, int *len)
 		+ title_len
 		+ sizeof(rec->tags->track)
 		+ 1 /* tags->rating */
-		+ sizeof(rec->tags->time);
+		+ sizeof(rec->tags->time)
+		+ sizeof(rec->seek_table_len)
+		+ rec->seek_table_len
+		+ sizeof(rec->loudness);
 
 	buf = p = (char *)xmalloc (*len);
 
@@ -302,11 +502,19 @@ static char *cache_record_serialize (const struct cache_record *rec, int *len)
 
 	*p++ = (char)rec->tags->rating;
 
+	memcpy (p, &rec->seek_table_len, sizeof(rec->seek_table_len));
+	p += sizeof(rec->seek_table_len);
+	if (rec->seek_table_len) {
+		memcpy (p, rec->seek_table, rec->seek_table_len);
+		p += rec->seek_table_len;
+	}
+
+	memcpy (p, &rec->loudness, sizeof(rec->loudness));
+	p += sizeof(rec->loudness);
+
 	return buf;
 }
-#endif
 
-#ifdef HAVE_DB_H
 static int cache_record_deserialize (struct cache_record *rec,
            const char *serialized, size_t size, int skip_tags)
 {
@@ -321,6 +529,9 @@ static int cache_record_deserialize (struct cache_record *rec,
 		rec->tags = tags_new ();
 	else
 		rec->tags = NULL;
+	rec->seek_table = NULL;
+	rec->seek_table_len = 0;
+	rec->loudness.duration = -1.0f;
 
 #define extract_num(var) \
 	do { \
@@ -336,12 +547,14 @@ static int cache_record_deserialize (struct cache_record *rec,
 		if (bytes_left < sizeof(str_len)) \
 			goto err; \
 		memcpy (&str_len, p, sizeof(str_len)); \
+		bytes_left -= sizeof(str_len); \
 		p += sizeof(str_len); \
 		if (bytes_left < str_len) \
 			goto err; \
 		var = xmalloc (str_len + 1); \
 		memcpy (var, p, str_len); \
 		var[str_len] = '\0'; \
+		bytes_left -= str_len; \
 		p += str_len; \
 	} while (0)
 
@@ -373,6 +586,18 @@ static int cache_record_deserialize (struct cache_record *rec,
 
 		if (rec->tags->time >= 0)
 			rec->tags->filled |= TAGS_TIME;
+
+		extract_num (rec->seek_table_len);
+		if (rec->seek_table_len) {
+			if (bytes_left < rec->seek_table_len)
+				goto err;
+			rec->seek_table = xmalloc (rec->seek_table_len);
+			memcpy (rec->seek_table, p, rec->seek_table_len);
+			bytes_left -= rec->seek_table_len;
+			p += rec->seek_table_len;
+		}
+
+		extract_num (rec->loudness);
 	}
 
 	return 1;
@@ -381,177 +606,419 @@ err:
 	logit ("Cache record deserialization error at %tdB", p - serialized);
 	tags_free (rec->tags);
 	rec->tags = NULL;
+	free (rec->seek_table);
+	rec->seek_table = NULL;
+	rec->seek_table_len = 0;
 	return 0;
 }
-#endif
 
-/* Locked DB function prototype.
- * The function must not acquire or release DB locks. */
+/* Locked record function prototype.
+ * The function must not acquire or release record locks. */
+typedef void *t_locked_fn (struct tags_cache *, const char *, int, int);
+
+/* A lock on the record of a file. */
+struct record_lock
+{
 #ifdef HAVE_DB_H
-typedef void *t_locked_fn (struct tags_cache *, const char *,
-                                      int, int, DBT *, DBT *);
+	DB_LOCK db_lock;
 #endif
+	pthread_mutex_t *mutex;		/* NULL if the lock is a DB lock */
+};
 
-/* This function ensures that a DB function takes place while holding a
- * database record lock.  It also provides an initialised database thang
- * for the key and record. */
-#ifdef HAVE_DB_H
-static void *with_db_lock (t_locked_fn fn, struct tags_cache *c,
-                           const char *file, int tags_sel, int client_id)
+/* Acquire and release the lock on the file's record. */
+static void lock_record (struct tags_cache *c, const char *file,
+                         struct record_lock *lock)
 {
-	int rc;
-	void *result;
-	DB_LOCK lock;
-	DBT key, record;
+	if (c->store) {
+		unsigned int h = 0;
+		const char *p;
+
+		for (p = file; *p; p++)
+			h = h * 31 + (unsigned char)*p;
+
+		lock->mutex = &c->record_mtx[h % RECORD_LOCKS];
+		LOCK (*lock->mutex);
+		return;
+	}
+
+	lock->mutex = NULL;
 
-	assert (c->db_env != NULL);
+#ifdef HAVE_DB_H
+	{
+		DBT key;
+		int rc;
+
+		assert (c->db_env != NULL);
 
-	memset (&key, 0, sizeof (key));
-	key.data = (void *) file;
-	key.size = strlen (file);
+		memset (&key, 0, sizeof (key));
+		key.data = (void *) file;
+		key.size = strlen (file);
+
+		rc = c->db_env->lock_get (c->db_env, c->locker, 0,
+				&key, DB_LOCK_WRITE, &lock->db_lock);
+		if (rc)
+			fatal ("Can't get DB lock: %s", db_strerror (rc));
+	}
+#endif
+}
 
-	memset (&record, 0, sizeof (record));
-	record.flags = DB_DBT_MALLOC;
+static void unlock_record (struct tags_cache *c, struct record_lock *lock)
+{
+	if (lock->mutex) {
+		UNLOCK (*lock->mutex);
+		return;
+	}
 
-	rc = c->db_env->lock_get (c->db_env, c->locker, 0,
-			&key, DB_LOCK_WRITE, &lock);
-	if (rc)
-		fatal ("Can't get DB lock: %s", db_strerror (rc));
+#ifdef HAVE_DB_H
+	{
+		int rc;
 
-	result = fn (c, file, tags_sel, client_id, &key, &record);
+		rc = c->db_env->lock_put (c->db_env, &lock->db_lock);
+		if (rc)
+			fatal ("Can't release DB lock: %s", db_strerror (rc));
+	}
+#else
+	(void) c;
+#endif
+}
 
-	rc = c->db_env->lock_put (c->db_env, &lock);
-	if (rc)
-		fatal ("Can't release DB lock: %s", db_strerror (rc));
+/* This function ensures that a record function takes place while holding
+ * the record lock. */
+static void *with_record_lock (t_locked_fn fn, struct tags_cache *c,
+                               const char *file, int tags_sel,
+                               int client_id)
+{
+	void *result;
+	struct record_lock lock;
 
-	if (record.data)
-		free (record.data);
+	lock_record (c, file, &lock);
+	result = fn (c, file, tags_sel, client_id);
+	unlock_record (c, &lock);
 
 	return result;
 }
-#endif
+
+/* Return the serialised record of the file (malloc()ed) or NULL if there
+ * is none. */
+static char *get_record (struct tags_cache *c, const char *file,
+                         size_t *len)
+{
+	if (c->store)
+		return tags_store_get (c->store, file, len);
 
 #ifdef HAVE_DB_H
-static void tags_cache_remove_rec (struct tags_cache *c, const char *fname)
+	{
+		DBT key, data;
+		int ret;
+
+		memset (&key, 0, sizeof (key));
+		key.data = (void *) file;
+		key.size = strlen (file);
+
+		memset (&data, 0, sizeof (data));
+		data.flags = DB_DBT_MALLOC;
+
+		ret = c->db->get (c->db, NULL, &key, &data, 0);
+		if (ret) {
+			if (ret != DB_NOTFOUND)
+				log_errno ("Cache DB get error", ret);
+			return NULL;
+		}
+
+		*len = data.size;
+		return (char *)data.data;
+	}
+#else
+	return NULL;
+#endif
+}
+
+/* Store the serialised record of the file. */
+static bool put_record (struct tags_cache *c, const char *file,
+                        const char *data, size_t len, time_t atime)
 {
-	DBT key;
-	int ret;
+	if (c->store)
+		return tags_store_put (c->store, file, data, len, atime);
 
-	assert (fname != NULL);
+#ifdef HAVE_DB_H
+	{
+		DBT key, db_data;
+		int ret;
+
+		memset (&key, 0, sizeof (key));
+		key.data = (void *) file;
+		key.size = strlen (file);
+
+		memset (&db_data, 0, sizeof (db_data));
+		db_data.data = (void *) data;
+		db_data.size = len;
+
+		/* Try to add a new record first to count it. */
+		ret = c->db->put (c->db, NULL, &key, &db_data, DB_NOOVERWRITE);
+		if (ret == DB_KEYEXIST)
+			ret = c->db->put (c->db, NULL, &key, &db_data, 0);
+		else if (ret == 0)
+			ATOMIC_ADD (&c->nrecords, 1);
+		if (ret)
+			error_errno ("DB put error", ret);
+
+		return ret == 0;
+	}
+#else
+	return false;
+#endif
+}
 
-	debug ("Removing %s from the cache...", fname);
+/* Make the key of the access time index for a record: the atime,
+ * big-endian so that the B-tree orders the keys by time. */
+#ifdef HAVE_DB_H
+static int atime_index_key (DB *secondary ATTR_UNUSED,
+                            const DBT *key ATTR_UNUSED,
+                            const DBT *data, DBT *result)
+{
+	struct cache_record rec;
+	unsigned char *index_key;
+	uint64_t atime;
+	int i;
+
+	if (!cache_record_deserialize (&rec, data->data, data->size, 1))
+		return DB_DONOTINDEX;
+
+	index_key = (unsigned char *)xmalloc (ATIME_KEY_SIZE);
+	atime = (uint64_t)rec.atime;
+	for (i = ATIME_KEY_SIZE - 1; i >= 0; i--) {
+		index_key[i] = atime & 0xff;
+		atime >>= 8;
+	}
 
-	memset (&key, 0, sizeof(key));
-	key.data = (void *)fname;
-	key.size = strlen (fname);
+	memset (result, 0, sizeof (*result));
+	result->data = index_key;
+	result->size = ATIME_KEY_SIZE;
+	result->flags = DB_DBT_APPMALLOC;
 
-	ret = c->db->del (c->db, NULL, &key, 0);
-	if (ret)
-		logit ("Can't remove item for %s from the cache: %s",
-				fname, db_strerror (ret));
+	return 0;
 }
 #endif
 
-/* Remove the one element of the cache based on it's access time. */
+/* Remove at most GC_SLICE least recently used records over the cache
+ * size, taking them from the front of the access time index.  Return true
+ * if there are more to remove. */
 #ifdef HAVE_DB_H
-static void tags_cache_gc (struct tags_cache *c)
+static bool tags_cache_gc (struct tags_cache *c)
 {
 	DBC *cur;
-	DBT key;
-	DBT serialized_cache_rec;
-	int ret;
-	char *last_referenced = NULL;
-	time_t last_referenced_atime = time (NULL) + 1;
-	int nitems = 0;
+	DBT key, data;
+	int ret, removed = 0;
 
-	c->db->cursor (c->db, NULL, &cur, 0);
+	if (ATOMIC_LOAD (&c->nrecords) <= c->max_items)
+		return false;
 
-	memset (&key, 0, sizeof(key));
-	memset (&serialized_cache_rec, 0, sizeof(serialized_cache_rec));
+	ret = c->atime_db->cursor (c->atime_db, NULL, &cur, 0);
+	if (ret) {
+		log_errno ("Can't open cursor on the access time index", ret);
+		return false;
+	}
 
+	memset (&key, 0, sizeof(key));
+	memset (&data, 0, sizeof(data));
 	key.flags = DB_DBT_MALLOC;
-	serialized_cache_rec.flags = DB_DBT_MALLOC;
-
-	while (true) {
-		struct cache_record rec;
+	data.flags = DB_DBT_MALLOC | DB_DBT_PARTIAL; /* we don't need it */
 
+	while (removed < GC_SLICE
+	       && ATOMIC_LOAD (&c->nrecords) > c->max_items) {
 #if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
-		ret = cur->c_get (cur, &key, &serialized_cache_rec, DB_NEXT);
+		ret = cur->c_get (cur, &key, &data, DB_NEXT);
 #else
-		ret = cur->get (cur, &key, &serialized_cache_rec, DB_NEXT);
+		ret = cur->get (cur, &key, &data, DB_NEXT);
 #endif
-
-		if (ret != 0)
+		if (ret) {
+			if (ret != DB_NOTFOUND)
+				log_errno ("Searching for element to remove failed "
+				           "(cursor)", ret);
 			break;
-
-		if (cache_record_deserialize (&rec, serialized_cache_rec.data,
-					serialized_cache_rec.size, 1)
-				&& rec.atime < last_referenced_atime) {
-			last_referenced_atime = rec.atime;
-
-			if (last_referenced)
-				free (last_referenced);
-			last_referenced = (char *)xmalloc (key.size + 1);
-			memcpy (last_referenced, key.data, key.size);
-			last_referenced[key.size] = '\0';
 		}
 
-		// TODO: remove objects with serialization error.
+		free (key.data);
+		free (data.data);
 
-		nitems++;
+		/* Deleting through the index removes the record too. */
+#if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
+		ret = cur->c_del (cur, 0);
+#else
+		ret = cur->del (cur, 0);
+#endif
+		if (ret) {
+			log_errno ("Can't remove item from the cache", ret);
+			break;
+		}
 
-		free (key.data);
-		free (serialized_cache_rec.data);
+		ATOMIC_ADD (&c->nrecords, -1);
+		removed += 1;
 	}
 
-	if (ret != DB_NOTFOUND)
-		log_errno ("Searching for element to remove failed (cursor)", ret);
-
 #if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 6
 	cur->c_close (cur);
 #else
 	cur->close (cur);
 #endif
 
-	debug ("Elements in cache: %d (limit %d)", nitems, c->max_items);
+	if (removed)
+		debug ("Removed %d records from the cache, %d left (limit %d)",
+		        removed, ATOMIC_LOAD (&c->nrecords), c->max_items);
 
-	if (last_referenced) {
-		if (nitems >= c->max_items)
-			tags_cache_remove_rec (c, last_referenced);
-		free (last_referenced);
-	}
-	else
-		debug ("Cache empty");
+	return ret == 0 && ATOMIC_LOAD (&c->nrecords) > c->max_items;
 }
 #endif
 
-/* Synchronize cache every DB_SYNC_COUNT updates. */
+/* Remove the records over the cache size and flush the database to
+ * disk if records were added since the last time.  Doing it for a batch
+ * of records spares an fsync() for each one.  Returns false if another
+ * thread is doing it. */
+static bool tags_cache_flush (struct tags_cache *c)
+{
+	if (pthread_mutex_trylock (&c->flush_mtx))
+		return false;
+
+	if (ATOMIC_XCHG (&c->unsynced, 0)) {
+		debug ("Flushing the tags cache");
+		if (c->store) {
+			tags_store_compact (c->store, c->max_items);
+			tags_store_sync (c->store);
+		}
 #ifdef HAVE_DB_H
-static void tags_cache_sync (struct tags_cache *c)
+		else {
+			while (tags_cache_gc (c))
+				;
+			c->atime_db->sync (c->atime_db, 0);
+			c->db->sync (c->db, 0);
+		}
+#endif
+	}
+
+	UNLOCK (c->flush_mtx);
+
+	return true;
+}
+
+static void *flusher_thread (void *cache_ptr)
+{
+	struct tags_cache *c = (struct tags_cache *)cache_ptr;
+
+	LOCK (c->flusher_mtx);
+
+	while (!c->stop_flusher) {
+		if (c->sync_interval > 0) {
+			struct timespec wake_up;
+
+			get_realtime (&wake_up);
+			wake_up.tv_sec += c->sync_interval;
+			pthread_cond_timedwait (&c->flusher_cond, &c->flusher_mtx,
+			                        &wake_up);
+		}
+		else
+			pthread_cond_wait (&c->flusher_cond, &c->flusher_mtx);
+
+		if (c->stop_flusher)
+			break;
+
+		UNLOCK (c->flusher_mtx);
+		tags_cache_flush (c);
+		LOCK (c->flusher_mtx);
+	}
+
+	UNLOCK (c->flusher_mtx);
+
+	return NULL;
+}
+
+static void start_flusher (struct tags_cache *c)
+{
+	int rc;
+
+	c->sync_count = options_get_int ("TagsCacheSyncCount");
+	c->sync_interval = options_get_int ("TagsCacheSyncInterval");
+	c->stop_flusher = 0;
+
+	if (!c->sync_count && !c->sync_interval) {
+		logit ("Tags cache is written to disk only on exit");
+		return;
+	}
+
+	rc = pthread_create (&c->flusher, NULL, flusher_thread, c);
+	if (rc != 0)
+		fatal ("Can't create tags cache flusher thread: %s",
+		        xstrerror (rc));
+	c->flusher_running = true;
+}
+
+static void stop_flusher (struct tags_cache *c)
 {
-	static int sync_count = 0;
+	int rc;
 
-	if (DB_SYNC_COUNT == 0)
+	if (!c->flusher_running)
 		return;
 
-	sync_count += 1;
-	if (sync_count >= DB_SYNC_COUNT) {
-		sync_count = 0;
-		c->db->sync (c->db, 0);
+	LOCK (c->flusher_mtx);
+	c->stop_flusher = 1;
+	pthread_cond_signal (&c->flusher_cond);
+	UNLOCK (c->flusher_mtx);
+
+	rc = pthread_join (c->flusher, NULL);
+	if (rc != 0)
+		fatal ("pthread_join() on tags cache flusher thread failed: %s",
+		        xstrerror (rc));
+	c->flusher_running = false;
+}
+
+/* Get the seek table from the file's record if the record is up to date,
+ * return NULL if there is none.  Put the loudness stored in the record in
+ * *loudness if it is not NULL (its duration is negative if there is
+ * none). */
+static void *get_stored (struct tags_cache *c, const char *file,
+                         time_t mtime, size_t *len,
+                         struct loudness *loudness)
+{
+	char *serialized_cache_rec;
+	size_t serial_len;
+	struct cache_record rec;
+	void *table = NULL;
+
+	if (loudness)
+		loudness->duration = -1.0f;
+
+	serialized_cache_rec = get_record (c, file, &serial_len);
+	if (!serialized_cache_rec)
+		return NULL;
+
+	if (cache_record_deserialize (&rec, serialized_cache_rec,
+	                              serial_len, 0)) {
+		tags_free (rec.tags);
+		if (rec.mod_time == mtime && loudness)
+			*loudness = rec.loudness;
+		if (rec.mod_time == mtime && rec.seek_table) {
+			table = rec.seek_table;
+			*len = rec.seek_table_len;
+		}
+		else
+			free (rec.seek_table);
 	}
+
+	free (serialized_cache_rec);
+
+	return table;
 }
-#endif
 
-/* Add this tags object for the file to the cache. */
-#ifdef HAVE_DB_H
+/* Add this tags object for the file to the cache.  The seek table and the
+ * loudness already stored for the file are kept unless they are given. */
 static void tags_cache_add (struct tags_cache *c, const char *file,
-                                  DBT *key, struct file_tags *tags)
+                            struct file_tags *tags,
+                            const void *seek_table, size_t seek_table_len,
+                            const struct loudness *loudness)
 {
 	char *serialized_cache_rec;
 	int serial_len;
 	struct cache_record rec;
-	DBT data;
-	int ret;
+	void *stored_table = NULL;
 
 	assert (tags != NULL);
 
@@ -560,188 +1027,1227 @@ static void tags_cache_add (struct tags_cache *c, const char *file,
 	rec.mod_time = get_mtime (file);
 	rec.atime = time (NULL);
 	rec.tags = tags;
+	rec.seek_table = (void *)seek_table;
+	rec.seek_table_len = seek_table_len;
+
+	if (!seek_table || !loudness) {
+		struct loudness stored_loudness;
+		size_t stored_len = 0;
+
+		stored_table = get_stored (c, file, rec.mod_time, &stored_len,
+		                           &stored_loudness);
+		if (!seek_table) {
+			rec.seek_table = stored_table;
+			rec.seek_table_len = stored_len;
+		}
+		rec.loudness = loudness ? *loudness : stored_loudness;
+	}
+	else
+		rec.loudness = *loudness;
 
 	serialized_cache_rec = cache_record_serialize (&rec, &serial_len);
+	free (stored_table);
 	if (!serialized_cache_rec)
 		return;
 
-	memset (&data, 0, sizeof(data));
-	data.data = serialized_cache_rec;
-	data.size = serial_len;
+	if (put_record (c, file, serialized_cache_rec, serial_len, rec.atime)
+	    && ATOMIC_ADD (&c->unsynced, 1) >= c->sync_count
+	    && c->sync_count) {
+		LOCK (c->flusher_mtx);
+		pthread_cond_signal (&c->flusher_cond);
+		UNLOCK (c->flusher_mtx);
+	}
+
+	free (serialized_cache_rec);
+}
 
-	tags_cache_gc (c);
+static int mem_entry_cmp (const void *a, const void *b,
+                          const void *unused ATTR_UNUSED)
+{
+	const struct mem_entry *ea = (const struct mem_entry *)a;
+	const struct mem_entry *eb = (const struct mem_entry *)b;
 
-	ret = c->db->put (c->db, NULL, key, &data, 0);
-	if (ret)
-		error_errno ("DB put error", ret);
+	return strcmp (ea->file, eb->file);
+}
 
-	tags_cache_sync (c);
+static int mem_entry_cmp_key (const void *key, const void *data,
+                              const void *unused ATTR_UNUSED)
+{
+	const char *file = (const char *)key;
+	const struct mem_entry *e = (const struct mem_entry *)data;
 
-	free (serialized_cache_rec);
+	return strcmp (file, e->file);
 }
-#endif
 
-/* Read time tags for a file into tags structure (or create it if NULL). */
-struct file_tags *read_missing_tags (const char *file,
-                 struct file_tags *tags, int tags_sel)
+static void mem_unlink (struct tags_cache *c, struct mem_entry *e)
 {
-	if (tags == NULL)
-		tags = tags_new ();
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		c->mem_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		c->mem_tail = e->prev;
+	e->prev = e->next = NULL;
+}
 
-	if (tags_sel & TAGS_TIME) {
-		int time;
+static void mem_link_head (struct tags_cache *c, struct mem_entry *e)
+{
+	e->prev = NULL;
+	e->next = c->mem_head;
+	if (c->mem_head)
+		c->mem_head->prev = e;
+	else
+		c->mem_tail = e;
+	c->mem_head = e;
+}
 
-		/* Try to get it from the server's playlist first. */
-		time = audio_get_ftime (file);
+static void mem_remove (struct tags_cache *c, struct mem_entry *e)
+{
+	rb_delete (c->mem_index, e->file);
+	mem_unlink (c, e);
+	c->mem_items -= 1;
 
-		if (time != -1) {
-			tags->time = time;
-			tags->filled |= TAGS_TIME;
-			tags_sel &= ~TAGS_TIME;
+	tags_free (e->tags);
+	xfree_tag (e->file, MEM_TAGS);
+	xfree_tag (e, MEM_TAGS);
+}
+
+/* Return a copy of the in-memory tags for the file if they have all the
+ * tags_sel tags and they are known to be up to date without looking at the
+ * file: a change would have removed them. */
+static struct file_tags *mem_cache_get_watched (struct tags_cache *c,
+                                                const char *file,
+                                                int tags_sel)
+{
+	struct rb_node *x;
+	struct file_tags *tags = NULL;
+
+	if (!c->mem_max_items || !c->watch)
+		return NULL;
+
+	LOCK (c->mem_mutex);
+
+	x = rb_search (c->mem_index, file);
+	if (!rb_is_null (x)) {
+		struct mem_entry *e = (struct mem_entry *)rb_get_data (x);
+
+		if (e->watched && (e->tags->filled & tags_sel) == tags_sel) {
+			mem_unlink (c, e);
+			mem_link_head (c, e);
+			tags = tags_dup (e->tags);
+			stats_add (STAT_TAGS_MEM_HITS, 1);
 		}
 	}
 
-	tags = read_file_tags (file, tags, tags_sel);
+	UNLOCK (c->mem_mutex);
 
 	return tags;
 }
 
-/* Read the selected tags for this file and add it to the cache. */
-#ifdef HAVE_DB_H
-static void *locked_read_add (struct tags_cache *c, const char *file,
-                              const int tags_sel, const int client_id,
-                              DBT *key, DBT *serialized_cache_rec)
+/* Return a copy of the in-memory tags for the file if they are up to date
+ * with its mtime and have all the tags_sel tags, otherwise NULL. */
+static struct file_tags *mem_cache_get (struct tags_cache *c,
+                                        const char *file, time_t mtime,
+                                        int tags_sel)
 {
-	int ret;
+	struct rb_node *x;
+	struct mem_entry *e;
 	struct file_tags *tags = NULL;
 
-	assert (c->db != NULL);
+	if (!c->mem_max_items)
+		return NULL;
 
-	ret = c->db->get (c->db, NULL, key, serialized_cache_rec, 0);
-	if (ret && ret != DB_NOTFOUND)
-		log_errno ("Cache DB get error", ret);
+	LOCK (c->mem_mutex);
 
-	/* If this entry is already present in the cache, we have 3 options:
-	 * we must read different tags (TAGS_*) or the tags are outdated
-	 * or this is an immediate tags read (client_id == -1) */
-	if (ret == 0) {
-		struct cache_record rec;
+	x = rb_search (c->mem_index, file);
+	if (!rb_is_null (x)) {
+		e = (struct mem_entry *)rb_get_data (x);
 
-		if (cache_record_deserialize (&rec, serialized_cache_rec->data,
-		                              serialized_cache_rec->size, 0)) {
-			time_t curr_mtime = get_mtime (file);
+		if (e->mtime != mtime)
+			mem_remove (c, e);
+		else {
+			mem_unlink (c, e);
+			mem_link_head (c, e);
 
-			if (rec.mod_time != curr_mtime) {
-				debug ("Tags in the cache are outdated");
-				tags_free (rec.tags);  /* remove them and reread tags */
-			}
-			else if ((rec.tags->filled & tags_sel) == tags_sel
-					&& client_id == -1) {
-				debug ("Tags are in the cache.");
-				return rec.tags;
-			}
-			else {
-				debug ("Tags in the cache are not what we want");
-				tags = rec.tags;  /* read additional tags */
+			if ((e->tags->filled & tags_sel) == tags_sel) {
+				tags = tags_dup (e->tags);
+				stats_add (STAT_TAGS_MEM_HITS, 1);
 			}
 		}
 	}
 
-	tags = read_missing_tags (file, tags, tags_sel);
-	tags_cache_add (c, file, key, tags);
+	UNLOCK (c->mem_mutex);
 
 	return tags;
 }
-#endif
 
-/* Read the selected tags for this file and add it to the cache.
- * If client_id != -1, the server is notified using tags_response().
- * If client_id == -1, copy of file_tags is returned. */
-static struct file_tags *tags_cache_read_add (struct tags_cache *c DB_ONLY,
-                     const char *file, int tags_sel, int client_id)
+/* Keep a copy of the tags in memory, forgetting the least recently used
+ * ones if there are too many. */
+static void mem_cache_put (struct tags_cache *c, const char *file,
+                           time_t mtime, bool watched,
+                           const struct file_tags *tags)
 {
-	struct file_tags *tags = NULL;
+	struct rb_node *x;
+	struct mem_entry *e;
+
+	if (!c->mem_max_items)
+		return;
+
+	LOCK (c->mem_mutex);
+
+	x = rb_search (c->mem_index, file);
+	if (!rb_is_null (x)) {
+		e = (struct mem_entry *)rb_get_data (x);
+		tags_free (e->tags);
+		mem_unlink (c, e);
+	}
+	else {
+		e = (struct mem_entry *)xmalloc_tag (sizeof (struct mem_entry),
+				MEM_TAGS);
+		e->file = xstrdup_tag (file, MEM_TAGS);
+		rb_insert (c->mem_index, e);
+		c->mem_items += 1;
+	}
+
+	e->mtime = mtime;
+	e->watched = watched;
+	e->tags = tags_dup (tags);
+	mem_link_head (c, e);
+
+	while (c->mem_items > c->mem_max_items)
+		mem_remove (c, c->mem_tail);
+
+	UNLOCK (c->mem_mutex);
+}
+
+/* Forget the in-memory tags for the file.  Return which tags they had. */
+static int mem_cache_forget (struct tags_cache *c, const char *file)
+{
+	struct rb_node *x;
+	int filled = 0;
+
+	if (!c->mem_max_items)
+		return 0;
+
+	LOCK (c->mem_mutex);
+
+	x = rb_search (c->mem_index, file);
+	if (!rb_is_null (x)) {
+		struct mem_entry *e = (struct mem_entry *)rb_get_data (x);
+
+		filled = e->tags->filled;
+		mem_remove (c, e);
+	}
+
+	UNLOCK (c->mem_mutex);
+
+	return filled;
+}
+
+/* Check the mtime of the in-memory tags of the files in the directory (all
+ * of them if it's NULL) again, it's not watched anymore. */
+static void mem_cache_unwatch (struct tags_cache *c, const char *dir)
+{
+	struct mem_entry *e;
+	size_t len = dir ? strlen (dir) : 0;
+
+	LOCK (c->mem_mutex);
+
+	for (e = c->mem_head; e; e = e->next) {
+		if (!dir || (!strncmp (e->file, dir, len) && e->file[len] == '/'
+		             && !strchr (e->file + len + 1, '/')))
+			e->watched = false;
+	}
+
+	UNLOCK (c->mem_mutex);
+}
+
+/* Read time tags for a file into tags structure (or create it if NULL). */
+struct file_tags *read_missing_tags (const char *file,
+                 struct file_tags *tags, int tags_sel)
+{
+	if (tags == NULL)
+		tags = tags_new ();
+
+	stats_add (STAT_TAGS_MISSES, 1);
+
+	if (tags_sel & TAGS_TIME) {
+		int time;
+
+		/* Try to get it from the server's playlist first. */
+		time = audio_get_ftime (file);
+
+		if (time != -1) {
+			tags->time = time;
+			tags->filled |= TAGS_TIME;
+			tags_sel &= ~TAGS_TIME;
+		}
+	}
+
+	tags = read_file_tags (file, tags, tags_sel);
+
+	return tags;
+}
+
+/* Read the selected tags for this file and add it to the cache. */
+static void *locked_read_add (struct tags_cache *c, const char *file,
+                              const int tags_sel, const int client_id)
+{
+	char *serialized_cache_rec;
+	size_t serial_len;
+	struct file_tags *tags = NULL;
+
+	serialized_cache_rec = get_record (c, file, &serial_len);
+
+	/* If this entry is already present in the cache, we have 3 options:
+	 * we must read different tags (TAGS_*) or the tags are outdated
+	 * or this is an immediate tags read (client_id == -1) */
+	if (serialized_cache_rec) {
+		struct cache_record rec;
+
+		if (cache_record_deserialize (&rec, serialized_cache_rec,
+		                              serial_len, 0)) {
+			time_t curr_mtime = get_mtime (file);
+
+			free (rec.seek_table);  /* tags_cache_add() keeps it */
+
+			if (rec.mod_time != curr_mtime) {
+				debug ("Tags in the cache are outdated");
+				tags_free (rec.tags);  /* remove them and reread tags */
+			}
+			else if ((rec.tags->filled & tags_sel) == tags_sel
+					&& client_id == -1) {
+				debug ("Tags are in the cache.");
+				stats_add (STAT_TAGS_STORE_HITS, 1);
+				free (serialized_cache_rec);
+				return rec.tags;
+			}
+			else {
+				debug ("Tags in the cache are not what we want");
+				tags = rec.tags;  /* read additional tags */
+			}
+		}
+
+		free (serialized_cache_rec);
+	}
+
+	tags = read_missing_tags (file, tags, tags_sel);
+	tags_cache_add (c, file, tags, NULL, 0, NULL);
+
+	return tags;
+}
+
+/* Read the selected tags for this file and add it to the cache.
+ * If client_id != -1, the server is notified using tags_response().
+ * If client_id == -1, copy of file_tags is returned. */
+static struct file_tags *tags_cache_read_add (struct tags_cache *c,
+                     const char *file, int tags_sel, int client_id)
+{
+	struct file_tags *tags;
+	time_t mtime = 0;
+	int watch_gen;
+	bool watched;
 
 	assert (file != NULL);
 
 	debug ("Getting tags for %s", file);
 
-#ifdef HAVE_DB_H
+	/* The tags read can be kept as watched only if no change came
+	 * meanwhile. */
+	watch_gen = ATOMIC_LOAD (&c->watch_gen);
+	watched = dir_watch_covers (c->watch, file);
+
+	tags = mem_cache_get_watched (c, file, tags_sel);
+	if (!tags) {
+		mtime = get_mtime (file);
+		tags = mem_cache_get (c, file, mtime, tags_sel);
+	}
+	if (tags)
+		debug ("Tags are in memory");
+	else {
+		if (c->max_items)
+			tags = (struct file_tags *)with_record_lock (locked_read_add,
+			                             c, file, tags_sel, client_id);
+		else
+			tags = read_missing_tags (file, NULL, tags_sel);
+
+		mem_cache_put (c, file, mtime, watched
+		               && watch_gen == ATOMIC_LOAD(&c->watch_gen), tags);
+	}
+
+	if (client_id != -1) {
+		tags_response (client_id, file, tags);
+		tags_free (tags);
+		tags = NULL;
+	}
+
+	/* TODO: Remove the oldest items from the cache if we exceeded the maximum
+	 * cache size */
+
+	return tags;
+}
+
+/* Return the tags kept in the cache for the file, up to date or not. */
+static void *locked_get_tags (struct tags_cache *c, const char *file,
+                              const int tags_sel ATTR_UNUSED,
+                              const int client_id ATTR_UNUSED)
+{
+	char *serialized_cache_rec;
+	size_t serial_len;
+	struct cache_record rec;
+	struct file_tags *tags = NULL;
+
+	serialized_cache_rec = get_record (c, file, &serial_len);
+	if (!serialized_cache_rec)
+		return NULL;
+
+	if (cache_record_deserialize (&rec, serialized_cache_rec,
+	                              serial_len, 0)) {
+		free (rec.seek_table);
+		tags = rec.tags;
+	}
+
+	free (serialized_cache_rec);
+
+	return tags;
+}
+
+/* Read the tags again even if the file's mtime didn't change. */
+static void *locked_reread (struct tags_cache *c, const char *file,
+                            const int tags_sel,
+                            const int client_id ATTR_UNUSED)
+{
+	struct file_tags *tags;
+
+	tags = read_missing_tags (file, NULL, tags_sel);
+	tags_cache_add (c, file, tags, NULL, 0, NULL);
+
+	return tags;
+}
+
+/* The file was written by another program: if its tags are cached, read
+ * them again and send them to all clients. */
+static void refresh_tags (struct tags_cache *c, const char *file)
+{
+	struct file_tags *tags;
+	int tags_sel;
+	time_t mtime;
+
+	tags_sel = mem_cache_forget (c, file);
+	if (!tags_sel && c->max_items) {
+		tags = (struct file_tags *)with_record_lock (locked_get_tags,
+		                                             c, file, 0, -1);
+		if (tags) {
+			tags_sel = tags->filled;
+			tags_free (tags);
+		}
+	}
+
+	tags_sel &= TAGS_COMMENTS | TAGS_TIME;
+	if (!tags_sel)
+		return;
+
+	debug ("%s was changed, reading its tags again", file);
+
+	/* This is the only thread handling the changes, one coming while
+	 * reading will be handled after it. */
+	mtime = get_mtime (file);
 	if (c->max_items)
-		tags = (struct file_tags *)with_db_lock (locked_read_add, c, file,
-		                                         tags_sel, client_id);
+		tags = (struct file_tags *)with_record_lock (locked_reread,
+		                                             c, file, tags_sel, -1);
 	else
+		tags = read_missing_tags (file, NULL, tags_sel);
+	mem_cache_put (c, file, mtime, dir_watch_covers (c->watch, file), tags);
+
+	file_tags_changed (file, tags);
+	tags_free (tags);
+}
+
+static void watch_event (void *cache_ptr, const char *path,
+                         enum dir_watch_event event)
+{
+	struct tags_cache *c = (struct tags_cache *)cache_ptr;
+
+	ATOMIC_ADD (&c->watch_gen, 1);
+
+	switch (event) {
+		case DIR_WATCH_CHANGED:
+			refresh_tags (c, path);
+			break;
+		case DIR_WATCH_GONE:
+			mem_cache_forget (c, path);
+			break;
+		case DIR_WATCH_LOST:
+			mem_cache_unwatch (c, path);
+			break;
+	}
+}
+
+/* Return the index of the first queue from curr_queue on with a boosted
+ * request, or -1. */
+static int find_boosted_queue (const struct tags_cache *c)
+{
+	int i;
+
+	for (i = 0; i < CLIENTS_MAX; i++) {
+		int q = (c->curr_queue + i) % CLIENTS_MAX;
+
+		if (c->queues[q].boosted)
+			return q;
+	}
+
+	return -1;
+}
+
+/* The readers share curr_queue, so between them they still take one
+ * request from each client's queue in turn. */
+static void *reader_thread (void *cache_ptr)
+{
+	struct tags_cache *c;
+
+	logit ("Tags reader thread started");
+	thread_sched_apply (THREAD_TAGS);
+
+	assert (cache_ptr != NULL);
+
+	c = (struct tags_cache *)cache_ptr;
+
+	LOCK (c->mutex);
+
+	while (!c->stop_reader_thread) {
+		int i;
+		char *request_file;
+		int tags_sel = 0;
+
+		/* Find the queue with a request waiting.  Begin searching at
+		 * curr_queue: we want to get one request from each queue,
+		 * and then move to the next non-empty queue.  Requests for
+		 * the files the clients show go first. */
+		i = find_boosted_queue (c);
+		if (i == -1)
+			i = c->curr_queue;
+		while (i < CLIENTS_MAX && request_queue_empty (&c->queues[i]))
+			i++;
+		if (i == CLIENTS_MAX) {
+			i = 0;
+			while (i < c->curr_queue && request_queue_empty (&c->queues[i]))
+				i++;
+
+			if (i == c->curr_queue) {
+				debug ("All queues empty, waiting");
+				pthread_cond_wait (&c->request_cond, &c->mutex);
+				continue;
+			}
+		}
+
+		request_file = request_queue_pop (&c->queues[i], &tags_sel);
+		c->curr_queue = (i + 1) % CLIENTS_MAX;
+		UNLOCK (c->mutex);
+
+		tags_cache_read_add (c, request_file, tags_sel, i);
+		free (request_file);
+#ifdef HAVE_DB_H
+		if (c->db)
+			tags_cache_gc (c);
 #endif
-		tags = read_missing_tags (file, tags, tags_sel);
 
-	if (client_id != -1) {
-		tags_response (client_id, file, tags);
-		tags_free (tags);
-		tags = NULL;
-	}
+		LOCK (c->mutex);
+	}
+
+	UNLOCK (c->mutex);
+
+	logit ("Exiting tags reader thread");
+
+	return NULL;
+}
+
+/* Start the reader threads: readers of them or, if it's zero, one for
+ * each CPU. */
+static void start_readers (struct tags_cache *c, int readers)
+{
+	int i, rc;
+
+	if (readers <= 0) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+		readers = cpus > 0 ? (int)MIN(cpus, TAGS_READERS_MAX) : 1;
+	}
+	readers = MIN(readers, TAGS_READERS_MAX);
+
+	logit ("Starting %d tags reader thread(s)", readers);
+
+	c->reader_threads = (pthread_t *)xcalloc (readers, sizeof(pthread_t));
+	for (i = 0; i < readers; i++) {
+		rc = pthread_create (&c->reader_threads[i], NULL, reader_thread, c);
+		if (rc != 0)
+			fatal ("Can't create tags cache thread: %s", xstrerror (rc));
+	}
+	c->readers = readers;
+}
+
+static int analyze_cmp (const void *a, const void *b,
+                        const void *unused ATTR_UNUSED)
+{
+	return strcmp ((const char *)a, (const char *)b);
+}
+
+static int album_cmp (const void *a, const void *b,
+                      const void *unused ATTR_UNUSED)
+{
+	const struct album_loudness *aa = (const struct album_loudness *)a;
+	const struct album_loudness *ab = (const struct album_loudness *)b;
+
+	return strcmp (aa->dir, ab->dir);
+}
+
+static int album_cmp_key (const void *key, const void *data,
+                          const void *unused ATTR_UNUSED)
+{
+	const char *dir = (const char *)key;
+	const struct album_loudness *a = (const struct album_loudness *)data;
+
+	return strcmp (dir, a->dir);
+}
+
+/* Return the directory part of the file name (without the trailing
+ * slash, so "" for the root), or NULL if there is none. */
+static char *file_dir (const char *file)
+{
+	char *dir, *slash;
+
+	dir = xstrdup (file);
+	slash = strrchr (dir, '/');
+	if (!slash) {
+		free (dir);
+		return NULL;
+	}
+	*slash = 0;
+
+	return dir;
+}
+
+/* Queue the file for the analyzer if it is running and the file is not
+ * queued already. */
+static void analyze_request (struct tags_cache *c, const char *file)
+{
+	char *queued;
+
+	if (!c->analyzer_running)
+		return;
+
+	LOCK (c->analyze_mtx);
+	if (rb_is_null (rb_search (c->analyze_set, file))) {
+		queued = xstrdup (file);
+		rb_insert (c->analyze_set, queued);
+		lists_strs_push (c->analyze, queued);
+		pthread_cond_signal (&c->analyze_cond);
+	}
+	UNLOCK (c->analyze_mtx);
+}
+
+/* Forget the album loudness computed for the file's directory. */
+static void album_forget (struct tags_cache *c, const char *file)
+{
+	struct rb_node *x;
+	char *dir;
+
+	dir = file_dir (file);
+	if (!dir)
+		return;
+
+	LOCK (c->analyze_mtx);
+	x = rb_search (c->albums, dir);
+	if (!rb_is_null (x)) {
+		struct album_loudness *a;
+
+		a = (struct album_loudness *)rb_get_data (x);
+		rb_delete (c->albums, dir);
+		free (a->dir);
+		free (a);
+	}
+	UNLOCK (c->analyze_mtx);
+
+	free (dir);
+}
+
+/* Get the loudness stored for the current version of the file, return
+ * false if it was not measured. */
+static bool get_loudness (struct tags_cache *c, const char *file,
+                          struct loudness *loudness)
+{
+	struct record_lock lock;
+	size_t len;
+
+	lock_record (c, file, &lock);
+	free (get_stored (c, file, get_mtime (file), &len, loudness));
+	unlock_record (c, &lock);
+
+	return loudness->duration >= 0.0f;
+}
+
+/* Store the loudness measured along with the file's tags. */
+static void put_loudness (struct tags_cache *c, const char *file,
+                          const struct loudness *loudness)
+{
+	struct file_tags *tags = NULL;
+	struct record_lock lock;
+	char *serialized_cache_rec;
+	size_t serial_len;
+
+	lock_record (c, file, &lock);
+
+	serialized_cache_rec = get_record (c, file, &serial_len);
+	if (serialized_cache_rec) {
+		struct cache_record rec;
+
+		if (cache_record_deserialize (&rec, serialized_cache_rec,
+		                              serial_len, 0)) {
+			free (rec.seek_table);
+			if (rec.mod_time == get_mtime (file))
+				tags = rec.tags;
+			else
+				tags_free (rec.tags);
+		}
+
+		free (serialized_cache_rec);
+	}
+
+	if (!tags)
+		tags = tags_new ();
+
+	tags_cache_add (c, file, tags, NULL, 0, loudness);
+
+	unlock_record (c, &lock);
+
+	tags_free (tags);
+}
+
+/* Get the loudness of the file, measuring and storing it if it's not
+ * stored yet.  Return false if the analyzer was stopped first. */
+static bool analyze_file (struct tags_cache *c, const char *file,
+                          struct loudness *loudness)
+{
+	if (get_loudness (c, file, loudness))
+		return true;
+
+	if (!loudness_analyze (file, loudness, &c->stop_analyzer)) {
+		if (ATOMIC_LOAD(&c->stop_analyzer))
+			return false;
+
+		/* Don't try again until the file changes. */
+		loudness->integrated = LOUDNESS_SILENCE;
+		loudness->peak = 0.0f;
+		loudness->duration = 0.0f;
+	}
+
+	put_loudness (c, file, loudness);
+	album_forget (c, file);
+
+	return true;
+}
+
+/* Compute the loudness of the sound files in the directory taken as an
+ * album: their mean energy weighted by duration and their highest peak.
+ * The files not measured yet are measured first. */
+static void analyze_album (struct tags_cache *c, const char *dir)
+{
+	const char *path = *dir ? dir : "/";
+	struct album_loudness *a;
+	struct loudness album;
+	struct rb_node *x;
+	struct dirent *entry;
+	double energy = 0.0, duration = 0.0;
+	float peak = 0.0f;
+	time_t mtime;
+	DIR *d;
+
+	mtime = get_mtime (path);
+	d = opendir (path);
+	if (!d) {
+		log_errno ("Can't open the album directory", errno);
+		return;
+	}
+
+	while ((entry = readdir (d))) {
+		struct loudness track;
+		struct stat st;
+		char *file;
+		bool ok = true;
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		file = format_msg ("%s/%s", dir, entry->d_name);
+		if (stat (file, &st) == 0 && S_ISREG(st.st_mode)
+				&& is_sound_file (file)) {
+			ok = analyze_file (c, file, &track);
+			if (ok && track.integrated > LOUDNESS_SILENCE) {
+				energy += track.duration
+				          * pow (10.0, track.integrated / 10.0);
+				duration += track.duration;
+				peak = MAX(peak, track.peak);
+			}
+		}
+		free (file);
+
+		if (!ok) {
+			closedir (d);
+			return;
+		}
+	}
+
+	closedir (d);
+
+	album.integrated = duration > 0.0 ? 10.0 * log10 (energy / duration)
+	                                  : LOUDNESS_SILENCE;
+	album.peak = peak;
+	album.duration = duration;
+	logit ("Album loudness of %s: %.1f LUFS, peak %.3f", path,
+	       album.integrated, album.peak);
+
+	LOCK (c->analyze_mtx);
+	x = rb_search (c->albums, dir);
+	if (rb_is_null (x)) {
+		a = (struct album_loudness *)xmalloc (sizeof (*a));
+		a->dir = xstrdup (dir);
+		rb_insert (c->albums, a);
+	}
+	else
+		a = (struct album_loudness *)rb_get_data (x);
+	a->mtime = mtime;
+	a->loudness = album;
+	UNLOCK (c->analyze_mtx);
+}
+
+/* Measure the loudness of the queued files which don't have it yet and
+ * then of the queued albums, with the lowest priority: nobody waits for
+ * it. */
+static void *analyzer_thread (void *cache_ptr)
+{
+	struct tags_cache *c = (struct tags_cache *)cache_ptr;
+
+	thread_sched_lower ();
+
+	LOCK (c->analyze_mtx);
+	while (!ATOMIC_LOAD(&c->stop_analyzer)) {
+		struct loudness loudness;
+		char *file;
+
+		if (!lists_strs_empty (c->analyze)) {
+			file = lists_strs_pop (c->analyze);
+			rb_delete (c->analyze_set, file);
+			UNLOCK (c->analyze_mtx);
+
+			analyze_file (c, file, &loudness);
+		}
+		else if (!lists_strs_empty (c->analyze_albums)) {
+			file = lists_strs_pop (c->analyze_albums);
+			UNLOCK (c->analyze_mtx);
+
+			analyze_album (c, file);
+		}
+		else {
+			pthread_cond_wait (&c->analyze_cond, &c->analyze_mtx);
+			continue;
+		}
+
+		free (file);
+		LOCK (c->analyze_mtx);
+	}
+	UNLOCK (c->analyze_mtx);
+
+	return NULL;
+}
+
+static void start_analyzer (struct tags_cache *c)
+{
+	int rc;
+
+	if (!strcasecmp (options_get_symb ("Normalize"), "Off"))
+		return;
+
+	c->stop_analyzer = 0;
+	rc = pthread_create (&c->analyzer, NULL, analyzer_thread, c);
+	if (rc != 0) {
+		log_errno ("Can't create the loudness analyzer thread", rc);
+		return;
+	}
+	c->analyzer_running = true;
+}
+
+static void stop_analyzer (struct tags_cache *c)
+{
+	int rc;
+
+	if (!c->analyzer_running)
+		return;
+
+	LOCK (c->analyze_mtx);
+	ATOMIC_STORE (&c->stop_analyzer, 1);
+	pthread_cond_signal (&c->analyze_cond);
+	UNLOCK (c->analyze_mtx);
+
+	rc = pthread_join (c->analyzer, NULL);
+	if (rc != 0)
+		fatal ("pthread_join() on the loudness analyzer thread "
+		       "failed: %s", xstrerror (rc));
+	c->analyzer_running = false;
+	rb_tree_clear (c->analyze_set);
+	lists_strs_clear (c->analyze);
+	lists_strs_clear (c->analyze_albums);
+}
+
+/* Read the tags for the scan, unless the cache has them all for the
+ * current version of the file.  Return the tags if they were read. */
+static void *locked_scan_file (struct tags_cache *c, const char *file,
+                               const int tags_sel,
+                               const int client_id ATTR_UNUSED)
+{
+	char *serialized_cache_rec;
+	size_t serial_len;
+	time_t mtime = get_mtime (file);
+	bool fresh = false, measured = false;
+
+	serialized_cache_rec = get_record (c, file, &serial_len);
+	if (serialized_cache_rec) {
+		struct cache_record rec;
+
+		if (cache_record_deserialize (&rec, serialized_cache_rec,
+		                              serial_len, 0)) {
+			fresh = rec.mod_time == mtime
+			        && (rec.tags->filled & tags_sel) == tags_sel;
+			measured = rec.mod_time == mtime
+			           && rec.loudness.duration >= 0.0f;
+			free (rec.seek_table);
+			tags_free (rec.tags);
+		}
+
+		free (serialized_cache_rec);
+	}
+
+	if (!measured)
+		analyze_request (c, file);
+
+	if (fresh)
+		return NULL;
+
+	return locked_read_add (c, file, tags_sel, -1);
+}
+
+static void scan_file (struct scan *s, const char *file)
+{
+	struct file_tags *tags;
+
+	tags = (struct file_tags *)with_record_lock (locked_scan_file, s->cache,
+	                                             file, SCAN_TAGS, -1);
+	stats_add (STAT_SCAN_FILES, 1);
+	if (tags) {
+		stats_add (STAT_SCAN_READ, 1);
+		tags_free (tags);
+#ifdef HAVE_DB_H
+		if (s->cache->db)
+			tags_cache_gc (s->cache);
+#endif
+	}
+
+	LOCK (s->mtx);
+	s->files += 1;
+	if (tags)
+		s->read += 1;
+	UNLOCK (s->mtx);
+}
+
+static const char *seen_key (const void *data, const void *unused ATTR_UNUSED)
+{
+	return (const char *)data;
+}
+
+/* Push the directory onto the stack unless it was already there. */
+static void scan_push_dir (struct scan *s, const char *dir,
+                           const struct stat *st)
+{
+	char key[64];
+
+	snprintf (key, sizeof(key), "%jx:%jx", (uintmax_t)st->st_dev,
+	          (uintmax_t)st->st_ino);
+
+	LOCK (s->mtx);
+	if (!hash_index_find (s->seen_index, key)) {
+		lists_strs_append (s->seen, key);
+		hash_index_set (s->seen_index,
+		                lists_strs_at (s->seen, lists_strs_size (s->seen) - 1));
+		lists_strs_append (s->dirs, dir);
+		pthread_cond_signal (&s->cond);
+	}
+	UNLOCK (s->mtx);
+}
+
+static void scan_dir (struct scan *s, const char *dir)
+{
+	DIR *d;
+	struct dirent *entry;
+	bool dir_is_root = !strcmp (dir, "/");
+
+	if (!(d = opendir (dir))) {
+		char *err = xstrerror (errno);
+		logit ("Can't scan %s: %s", dir, err);
+		free (err);
+		return;
+	}
+
+	while ((entry = readdir (d)) && !ATOMIC_LOAD(&s->stop)) {
+		char file[PATH_MAX];
+		struct stat st;
+		int rc;
+
+		if (!strcmp (entry->d_name, ".") || !strcmp (entry->d_name, ".."))
+			continue;
+		if (!s->show_hidden && entry->d_name[0] == '.')
+			continue;
+
+		rc = snprintf (file, sizeof(file), "%s/%s",
+		               dir_is_root ? "" : dir, entry->d_name);
+		if (rc >= ssizeof(file)) {
+			logit ("Path too long in %s", dir);
+			continue;
+		}
+
+		if (stat (file, &st) == -1)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			scan_push_dir (s, file, &st);
+		else if (is_sound_file (file))
+			scan_file (s, file);
+	}
+
+	closedir (d);
+}
+
+/* Read the directories from the stack until it's empty and no other
+ * thread can push more onto it. */
+static void *scan_worker (void *scan_ptr)
+{
+	struct scan *s = (struct scan *)scan_ptr;
+
+	thread_sched_lower ();
+
+	LOCK (s->mtx);
+	while (!ATOMIC_LOAD(&s->stop)) {
+		char *dir;
+
+		if (lists_strs_empty (s->dirs)) {
+			if (!s->busy)
+				break;
+			pthread_cond_wait (&s->cond, &s->mtx);
+			continue;
+		}
+
+		dir = lists_strs_pop (s->dirs);
+		s->busy += 1;
+		UNLOCK (s->mtx);
+
+		scan_dir (s, dir);
+		free (dir);
+
+		LOCK (s->mtx);
+		s->busy -= 1;
+		pthread_cond_broadcast (&s->cond);
+	}
+	UNLOCK (s->mtx);
+
+	return NULL;
+}
+
+static void *scan_thread (void *scan_ptr)
+{
+	struct scan *s = (struct scan *)scan_ptr;
+	pthread_t *others;
+	int i, started = 0;
+
+	logit ("Scanning %s with %d thread(s)", s->root, s->threads);
+
+	others = (pthread_t *)xcalloc (s->threads, sizeof (pthread_t));
+	for (i = 1; i < s->threads; i++) {
+		int rc = pthread_create (&others[started], NULL, scan_worker, s);
+
+		if (rc != 0) {
+			log_errno ("Can't create a scanning thread", rc);
+			break;
+		}
+		started += 1;
+	}
+
+	scan_worker (s);
+
+	for (i = 0; i < started; i++)
+		pthread_join (others[i], NULL);
+	free (others);
+
+	if (ATOMIC_LOAD(&s->stop))
+		logit ("Scan of %s stopped after %d files, it will be resumed",
+		       s->root, s->files);
+	else {
+		if (unlink (s->cache->scan_state) == -1 && errno != ENOENT)
+			log_errno ("Can't remove the scan state file", errno);
+		logit ("Scan of %s finished: %d files, %d read, in %"PRIu64" s",
+		       s->root, s->files, s->read,
+		       stats_usec_since (&s->start) / 1000000);
+	}
+
+	LOCK (s->mtx);
+	s->done = true;
+	UNLOCK (s->mtx);
+
+	return NULL;
+}
+
+static void scan_free (struct scan *s)
+{
+	lists_strs_free (s->dirs);
+	hash_index_free (s->seen_index);
+	lists_strs_free (s->seen);
+	pthread_mutex_destroy (&s->mtx);
+	pthread_cond_destroy (&s->cond);
+	free (s->root);
+	free (s);
+}
+
+/* Stop the last scan if it's still running and free it. */
+static void stop_scan (struct tags_cache *c)
+{
+	struct scan *s = c->scan;
+
+	if (!s)
+		return;
+
+	LOCK (s->mtx);
+	ATOMIC_STORE (&s->stop, 1);
+	pthread_cond_broadcast (&s->cond);
+	UNLOCK (s->mtx);
+
+	pthread_join (s->thread, NULL);
+	scan_free (s);
+	c->scan = NULL;
+}
+
+/* Start scanning the directory (absolute path). */
+static bool start_scan (struct tags_cache *c, const char *dir)
+{
+	struct scan *s;
+	struct stat st;
+	int rc;
+
+	if (stat (dir, &st) == -1 || !S_ISDIR(st.st_mode))
+		return false;
+
+	s = (struct scan *)xmalloc (sizeof (struct scan));
+	s->cache = c;
+	s->root = xstrdup (dir);
+	s->show_hidden = options_get_bool ("ShowHiddenFiles");
+	s->threads = c->readers;
+	get_realtime (&s->start);
+	s->stop = 0;
+	pthread_mutex_init (&s->mtx, NULL);
+	pthread_cond_init (&s->cond, NULL);
+	s->dirs = lists_strs_new (64);
+	s->busy = 0;
+	s->seen = lists_strs_new (256);
+	s->seen_index = hash_index_new (seen_key, NULL);
+	s->files = 0;
+	s->read = 0;
+	s->done = false;
+
+	scan_push_dir (s, dir, &st);
+
+	rc = pthread_create (&s->thread, NULL, scan_thread, s);
+	if (rc != 0) {
+		log_errno ("Can't create the scanning thread", rc);
+		scan_free (s);
+		return false;
+	}
+
+	c->scan = s;
+
+	return true;
+}
+
+/* Resume the scan which the server's exit interrupted, if there was one. */
+static void resume_scan (struct tags_cache *c, const char *cache_dir)
+{
+	FILE *f;
+	char dir[PATH_MAX + 1];
+
+	c->scan_state = format_msg ("%s/%s", cache_dir, SCAN_STATE);
+
+	if (!(f = fopen (c->scan_state, "r")))
+		return;
 
-	/* TODO: Remove the oldest items from the cache if we exceeded the maximum
-	 * cache size */
+	if (fgets (dir, sizeof(dir), f)) {
+		dir[strcspn (dir, "\n")] = 0;
+		logit ("Resuming the scan of %s", dir);
+		LOCK (c->scan_mtx);
+		if (!start_scan (c, dir))
+			unlink (c->scan_state);
+		UNLOCK (c->scan_mtx);
+	}
 
-	return tags;
+	fclose (f);
 }
 
-static void *reader_thread (void *cache_ptr)
+/* Read the tags and the time of all sound files under the directory
+ * (absolute path) into the cache in the background, skipping those the
+ * cache has already.  If the server exits, the scan is resumed when it
+ * starts again.  Return NULL or the reason why the scan can't be started. */
+const char *tags_cache_scan (struct tags_cache *c, const char *dir)
 {
-	struct tags_cache *c;
-	int curr_queue = 0; /* index of the queue from where
-	                       we will get the next request */
-
-	logit ("Tags reader thread started");
+	const char *err = NULL;
+	FILE *f;
 
-	assert (cache_ptr != NULL);
+	assert (c != NULL);
+	assert (dir != NULL);
 
-	c = (struct tags_cache *)cache_ptr;
+	if (!c->max_items || !c->scan_state)
+		return "The tags cache is disabled";
 
-	LOCK (c->mutex);
+	LOCK (c->scan_mtx);
 
-	while (!c->stop_reader_thread) {
-		int i;
-		char *request_file;
-		int tags_sel = 0;
+	if (c->scan) {
+		bool done;
 
-		/* Find the queue with a request waiting.  Begin searching at
-		 * curr_queue: we want to get one request from each queue,
-		 * and then move to the next non-empty queue. */
-		i = curr_queue;
-		while (i < CLIENTS_MAX && request_queue_empty (&c->queues[i]))
-			i++;
-		if (i == CLIENTS_MAX) {
-			i = 0;
-			while (i < curr_queue && request_queue_empty (&c->queues[i]))
-				i++;
+		LOCK (c->scan->mtx);
+		done = c->scan->done;
+		UNLOCK (c->scan->mtx);
 
-			if (i == curr_queue) {
-				debug ("All queues empty, waiting");
-				pthread_cond_wait (&c->request_cond, &c->mutex);
-				continue;
-			}
+		if (!done) {
+			UNLOCK (c->scan_mtx);
+			return "A scan is already running";
 		}
-		curr_queue = i;
-
-		request_file = request_queue_pop (&c->queues[curr_queue], &tags_sel);
-		UNLOCK (c->mutex);
 
-		tags_cache_read_add (c, request_file, tags_sel, curr_queue);
-		free (request_file);
+		stop_scan (c);
+	}
 
-		LOCK (c->mutex);
-		curr_queue = (curr_queue + 1) % CLIENTS_MAX;
+	if ((f = fopen (c->scan_state, "w"))) {
+		fprintf (f, "%s\n", dir);
+		if (fclose (f))
+			log_errno ("Can't write the scan state file", errno);
 	}
+	else
+		log_errno ("Can't create the scan state file", errno);
 
-	UNLOCK (c->mutex);
+	if (!start_scan (c, dir)) {
+		unlink (c->scan_state);
+		err = "Can't scan the directory";
+	}
 
-	logit ("Exiting tags reader thread");
+	UNLOCK (c->scan_mtx);
 
-	return NULL;
+	return err;
 }
 
-struct tags_cache *tags_cache_new (size_t max_size)
+struct tags_cache *tags_cache_new (size_t max_size, int mem_size,
+                                   int readers)
 {
 	int i, rc;
 	struct tags_cache *result;
@@ -751,7 +2257,20 @@ struct tags_cache *tags_cache_new (size_t max_size)
 #ifdef HAVE_DB_H
 	result->db_env = NULL;
 	result->db = NULL;
+	result->atime_db = NULL;
+	result->nrecords = 0;
 #endif
+	result->store = NULL;
+	for (i = 0; i < RECORD_LOCKS; i++)
+		pthread_mutex_init (&result->record_mtx[i], NULL);
+	result->unsynced = 0;
+	pthread_mutex_init (&result->flush_mtx, NULL);
+	result->sync_count = 0;
+	result->sync_interval = 0;
+	result->flusher_running = false;
+	result->stop_flusher = 0;
+	pthread_mutex_init (&result->flusher_mtx, NULL);
+	pthread_cond_init (&result->flusher_cond, NULL);
 
 	for (i = 0; i < CLIENTS_MAX; i++)
 		request_queue_init (&result->queues[i]);
@@ -762,15 +2281,38 @@ struct tags_cache *tags_cache_new (size_t max_size)
 	result->max_items = 0;
 #endif
 	result->stop_reader_thread = 0;
+	result->curr_queue = 0;
 	pthread_mutex_init (&result->mutex, NULL);
 
+	result->mem_index = rb_tree_new (mem_entry_cmp, mem_entry_cmp_key, NULL);
+	result->mem_head = NULL;
+	result->mem_tail = NULL;
+	result->mem_items = 0;
+	result->mem_max_items = mem_size;
+	pthread_mutex_init (&result->mem_mutex, NULL);
+
+	result->scan = NULL;
+	result->scan_state = NULL;
+	pthread_mutex_init (&result->scan_mtx, NULL);
+
+	result->analyzer_running = false;
+	result->stop_analyzer = 0;
+	result->analyze = lists_strs_new (64);
+	result->analyze_set = rb_tree_new (analyze_cmp, analyze_cmp, NULL);
+	result->analyze_albums = lists_strs_new (8);
+	result->albums = rb_tree_new (album_cmp, album_cmp_key, NULL);
+	pthread_cond_init (&result->analyze_cond, NULL);
+	pthread_mutex_init (&result->analyze_mtx, NULL);
+
+	result->watch_gen = 0;
+	result->watch = options_get_bool ("WatchTags")
+	                ? dir_watch_new (watch_event, result) : NULL;
+
 	rc = pthread_cond_init (&result->request_cond, NULL);
 	if (rc != 0)
 		fatal ("Can't create request_cond: %s", xstrerror (rc));
 
-	rc = pthread_create (&result->reader_thread, NULL, reader_thread, result);
-	if (rc != 0)
-		fatal ("Can't create tags cache thread: %s", xstrerror (rc));
+	start_readers (result, readers);
 
 	return result;
 }
@@ -778,16 +2320,47 @@ struct tags_cache *tags_cache_new (size_t max_size)
 void tags_cache_free (struct tags_cache *c)
 {
 	int i, rc;
+	struct rb_node *x;
 
 	assert (c != NULL);
 
+	LOCK (c->scan_mtx);
+	stop_scan (c);
+	UNLOCK (c->scan_mtx);
+
+	dir_watch_free (c->watch);
+	c->watch = NULL;
+
 	LOCK (c->mutex);
 	c->stop_reader_thread = 1;
-	pthread_cond_signal (&c->request_cond);
+	pthread_cond_broadcast (&c->request_cond);
 	UNLOCK (c->mutex);
 
+	for (i = 0; i < c->readers; i++) {
+		rc = pthread_join (c->reader_threads[i], NULL);
+		if (rc != 0)
+			fatal ("pthread_join() on cache reader thread failed: %s",
+			        xstrerror (rc));
+	}
+	free (c->reader_threads);
+
+	stop_analyzer (c);
+	stop_flusher (c);
+
+	if (c->store) {
+		tags_cache_flush (c);
+		tags_store_close (c->store);
+		c->store = NULL;
+	}
+
 #ifdef HAVE_DB_H
 	if (c->db) {
+		if (c->max_items)
+			tags_cache_flush (c);
+		if (c->atime_db) {
+			c->atime_db->close (c->atime_db, 0);
+			c->atime_db = NULL;
+		}
 #ifndef NDEBUG
 		c->db->set_errcall (c->db, NULL);
 		c->db->set_msgcall (c->db, NULL);
@@ -811,79 +2384,129 @@ void tags_cache_free (struct tags_cache *c)
 	}
 #endif
 
-	rc = pthread_join (c->reader_thread, NULL);
-	if (rc != 0)
-		fatal ("pthread_join() on cache reader thread failed: %s",
-		        xstrerror (rc));
-
 	for (i = 0; i < CLIENTS_MAX; i++)
 		request_queue_clear (&c->queues[i]);
 
+	while (c->mem_head)
+		mem_remove (c, c->mem_head);
+	rb_tree_free (c->mem_index);
+	rc = pthread_mutex_destroy (&c->mem_mutex);
+	if (rc != 0)
+		log_errno ("Can't destroy mem_mutex", rc);
+
 	rc = pthread_mutex_destroy (&c->mutex);
 	if (rc != 0)
 		log_errno ("Can't destroy mutex", rc);
 	rc = pthread_cond_destroy (&c->request_cond);
 	if (rc != 0)
 		log_errno ("Can't destroy request_cond", rc);
+	for (i = 0; i < RECORD_LOCKS; i++) {
+		rc = pthread_mutex_destroy (&c->record_mtx[i]);
+		if (rc != 0)
+			log_errno ("Can't destroy record_mtx", rc);
+	}
+	rc = pthread_mutex_destroy (&c->flush_mtx);
+	if (rc != 0)
+		log_errno ("Can't destroy flush_mtx", rc);
+	rc = pthread_mutex_destroy (&c->flusher_mtx);
+	if (rc != 0)
+		log_errno ("Can't destroy flusher_mtx", rc);
+	rc = pthread_cond_destroy (&c->flusher_cond);
+	if (rc != 0)
+		log_errno ("Can't destroy flusher_cond", rc);
+	rc = pthread_mutex_destroy (&c->scan_mtx);
+	if (rc != 0)
+		log_errno ("Can't destroy scan_mtx", rc);
+	free (c->scan_state);
+	rc = pthread_mutex_destroy (&c->analyze_mtx);
+	if (rc != 0)
+		log_errno ("Can't destroy analyze_mtx", rc);
+	rc = pthread_cond_destroy (&c->analyze_cond);
+	if (rc != 0)
+		log_errno ("Can't destroy analyze_cond", rc);
+	rb_tree_free (c->analyze_set);
+	lists_strs_free (c->analyze);
+	lists_strs_free (c->analyze_albums);
+	for (x = rb_min (c->albums); !rb_is_null (x); x = rb_next (x)) {
+		struct album_loudness *a;
+
+		a = (struct album_loudness *)rb_get_data (x);
+		free (a->dir);
+		free (a);
+	}
+	rb_tree_free (c->albums);
 
 	free (c);
 }
 
-#ifdef HAVE_DB_H
 static void *locked_add_request (struct tags_cache *c, const char *file,
-                                 int tags_sel, int client_id,
-                                 DBT *key, DBT *serialized_cache_rec)
+                                 int tags_sel, int client_id)
 {
-	int db_ret;
+	char *serialized_cache_rec;
+	size_t serial_len;
 	struct cache_record rec;
+	void *found = NULL;
 
-	assert (c->db);
-
-	db_ret = c->db->get (c->db, NULL, key, serialized_cache_rec, 0);
-
-	if (db_ret == DB_NOTFOUND)
-		return NULL;
-
-	if (db_ret) {
-		error_errno ("Cache DB search error", db_ret);
+	serialized_cache_rec = get_record (c, file, &serial_len);
+	if (!serialized_cache_rec)
 		return NULL;
-	}
 
-	if (cache_record_deserialize (&rec, serialized_cache_rec->data,
-				serialized_cache_rec->size, 0)) {
+	if (cache_record_deserialize (&rec, serialized_cache_rec,
+				serial_len, 0)) {
+		free (rec.seek_table);
 		if (rec.mod_time == get_mtime (file)
 				&& (rec.tags->filled & tags_sel) == tags_sel) {
 			tags_response (client_id, file, rec.tags);
-			tags_free (rec.tags);
 			debug ("Tags are present in the cache");
-			return (void *)1;
+			stats_add (STAT_TAGS_STORE_HITS, 1);
+			found = (void *)1;
 		}
+		else
+			debug ("Found outdated or incomplete tags in the cache");
 
 		tags_free (rec.tags);
-		debug ("Found outdated or incomplete tags in the cache");
 	}
 
-	return NULL;
+	free (serialized_cache_rec);
+
+	return found;
+}
+
+/* Send the tags to the client if they are in the memory or on-disk cache.
+ * Return true if they were sent. */
+static bool respond_from_cache (struct tags_cache *c, const char *file,
+                                int tags_sel, int client_id)
+{
+	struct file_tags *tags;
+
+	tags = mem_cache_get_watched (c, file, tags_sel);
+	if (!tags)
+		tags = mem_cache_get (c, file, get_mtime (file), tags_sel);
+	if (tags) {
+		tags_response (client_id, file, tags);
+		tags_free (tags);
+		debug ("Tags are present in memory");
+		return true;
+	}
+
+	if (c->max_items)
+		return with_record_lock (locked_add_request, c, file, tags_sel,
+		                         client_id) != NULL;
+
+	return false;
 }
-#endif
 
 void tags_cache_add_request (struct tags_cache *c, const char *file,
                                         int tags_sel, int client_id)
 {
-	void *rc = NULL;
-
 	assert (c != NULL);
 	assert (file != NULL);
 	assert (LIMIT(client_id, CLIENTS_MAX));
 
 	debug ("Request for tags for '%s' from client %d", file, client_id);
 
-#ifdef HAVE_DB_H
-	if (c->max_items)
-		rc = with_db_lock (locked_add_request, c, file, tags_sel, client_id);
-#endif
-
-	if (!rc) {
+	dir_watch_add (c->watch, file);
+	if (!respond_from_cache (c, file, tags_sel, client_id)) {
 		LOCK (c->mutex);
 		request_queue_add (&c->queues[client_id], file, tags_sel);
 		pthread_cond_signal (&c->request_cond);
@@ -891,6 +2514,78 @@ void tags_cache_add_request (struct tags_cache *c, const char *file,
 	}
 }
 
+static int file_name_cmp (const void *a, const void *b,
+                          const void *unused ATTR_UNUSED)
+{
+	return strcmp ((const char *)a, (const char *)b);
+}
+
+/* Request tags for a list of files.  Cached tags are sent at once, the
+ * rest is queued in one go skipping duplicates and files which are
+ * already queued for (at least) the same tags. */
+void tags_cache_add_requests (struct tags_cache *c, lists_t_strs *files,
+                              int tags_sel, int client_id)
+{
+	int ix, queued = 0;
+	struct rb_tree *seen;
+	struct request_queue *q;
+	struct request_queue_node *node;
+	lists_t_strs *missing;
+
+	assert (c != NULL);
+	assert (files != NULL);
+	assert (LIMIT(client_id, CLIENTS_MAX));
+
+	debug ("Request for tags for %d files from client %d",
+	        lists_strs_size (files), client_id);
+
+	missing = lists_strs_new (lists_strs_size (files));
+	for (ix = 0; ix < lists_strs_size (files); ix += 1) {
+		const char *file = lists_strs_at (files, ix);
+
+		dir_watch_add (c->watch, file);
+		if (!respond_from_cache (c, file, tags_sel, client_id))
+			lists_strs_append (missing, file);
+	}
+
+	if (lists_strs_empty (missing)) {
+		lists_strs_free (missing);
+		return;
+	}
+
+	seen = rb_tree_new (file_name_cmp, file_name_cmp, NULL);
+
+	LOCK (c->mutex);
+
+	q = &c->queues[client_id];
+	for (node = q->head; node; node = node->next) {
+		if ((node->tags_sel & tags_sel) == tags_sel
+				&& rb_is_null (rb_search (seen, node->file)))
+			rb_insert (seen, node->file);
+	}
+
+	for (ix = 0; ix < lists_strs_size (missing); ix += 1) {
+		const char *file = lists_strs_at (missing, ix);
+
+		if (rb_is_null (rb_search (seen, file))) {
+			request_queue_add (q, file, tags_sel);
+			rb_insert (seen, q->tail->file);
+			queued += 1;
+		}
+	}
+
+	if (queued)
+		pthread_cond_broadcast (&c->request_cond);
+
+	UNLOCK (c->mutex);
+
+	debug ("Queued %d of %d requested files", queued,
+	        lists_strs_size (files));
+
+	rb_tree_free (seen);
+	lists_strs_free (missing);
+}
+
 void tags_cache_clear_queue (struct tags_cache *c, int client_id)
 {
 	assert (c != NULL);
@@ -902,6 +2597,22 @@ void tags_cache_clear_queue (struct tags_cache *c, int client_id)
 	UNLOCK (c->mutex);
 }
 
+/* Serve the client's requests for these files (the ones it shows) before
+ * its other requests. */
+void tags_cache_boost_requests (struct tags_cache *c, lists_t_strs *files,
+                                int client_id)
+{
+	assert (c != NULL);
+	assert (files != NULL);
+	assert (LIMIT(client_id, CLIENTS_MAX));
+
+	LOCK (c->mutex);
+	request_queue_boost (&c->queues[client_id], files);
+	debug ("Boosted %d requests of client %d", c->queues[client_id].boosted,
+	        client_id);
+	UNLOCK (c->mutex);
+}
+
 /* Remove all pending requests from the queue for the given client up to
  * the request associated with the given file. */
 void tags_cache_clear_up_to (struct tags_cache *c, const char *file,
@@ -948,7 +2659,6 @@ static void db_panic_cb (DB_ENV *unused ATTR_UNUSED, int errval)
 #endif
 
 /* Purge content of a directory. */
-#ifdef HAVE_DB_H
 static int purge_directory (const char *dir_path)
 {
 	DIR *dir;
@@ -1021,19 +2731,19 @@ static int purge_directory (const char *dir_path)
 	closedir (dir);
 	return 1;
 }
-#endif
 
 /* Create a MOC/db version string.
  *
  * @param buf Output buffer (at least VERSION_TAG_MAX chars long)
  */
-#ifdef HAVE_DB_H
 static const char *create_version_tag (char *buf)
 {
-	int db_major;
-	int db_minor;
+	int db_major = 0;
+	int db_minor = 0;
 
+#ifdef HAVE_DB_H
 	db_version (&db_major, &db_minor, NULL);
+#endif
 
 #ifdef PACKAGE_REVISION
 	snprintf (buf, VERSION_TAG_MAX, "%d %d %d r%s",
@@ -1045,11 +2755,9 @@ static const char *create_version_tag (char *buf)
 
 	return buf;
 }
-#endif
 
 /* Check version of the cache directory.  If it was created
  * using format not handled by this version of MOC, return 0. */
-#ifdef HAVE_DB_H
 static int cache_version_matches (const char *cache_dir)
 {
 	char *fname = NULL;
@@ -1099,9 +2807,7 @@ static int cache_version_matches (const char *cache_dir)
 
 	return compare_result;
 }
-#endif
 
-#ifdef HAVE_DB_H
 static void write_cache_version (const char *cache_dir)
 {
 	char cur_version_tag[VERSION_TAG_MAX];
@@ -1127,10 +2833,8 @@ static void write_cache_version (const char *cache_dir)
 	free (fname);
 	fclose (f);
 }
-#endif
 
 /* Make sure that the cache directory exists and clear it if necessary. */
-#ifdef HAVE_DB_H
 static int prepare_cache_dir (const char *cache_dir)
 {
 	if (mkdir (cache_dir, 0700) == 0) {
@@ -1153,16 +2857,59 @@ static int prepare_cache_dir (const char *cache_dir)
 
 	return 1;
 }
+
+/* Set nrecords to the number of records in the cache. */
+#ifdef HAVE_DB_H
+static bool count_records (struct tags_cache *c)
+{
+	DB_BTREE_STAT *stat;
+	int ret;
+
+#if DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR < 3
+	ret = c->db->stat (c->db, &stat, 0);
+#else
+	ret = c->db->stat (c->db, NULL, &stat, 0);
+#endif
+	if (ret) {
+		error_errno ("Can't count records in the tags cache", ret);
+		return false;
+	}
+
+	c->nrecords = stat->bt_nkeys;
+	free (stat);
+
+	debug ("Elements in cache: %d (limit %d)", c->nrecords, c->max_items);
+
+	return true;
+}
 #endif
 
-void tags_cache_load (struct tags_cache *c DB_ONLY,
-                      const char *cache_dir DB_ONLY)
+/* Open the store in the cache directory instead of the database. */
+static bool open_store (struct tags_cache *c, const char *cache_dir)
 {
-	assert (c != NULL);
-	assert (cache_dir != NULL);
+	char *path;
+
+	path = format_msg ("%s/%s", cache_dir, TAGS_STORE);
+	c->store = tags_store_open (path);
+	free (path);
+
+	if (!c->store)
+		return false;
+
+	debug ("Elements in cache: %d (limit %d)",
+	       tags_store_count (c->store), c->max_items);
 
+	return true;
+}
+
+void tags_cache_load (struct tags_cache *c, const char *cache_dir)
+{
 #ifdef HAVE_DB_H
 	int ret;
+#endif
+
+	assert (c != NULL);
+	assert (cache_dir != NULL);
 
 	if (!c->max_items)
 		return;
@@ -1172,6 +2919,19 @@ void tags_cache_load (struct tags_cache *c DB_ONLY,
 		goto err;
 	}
 
+#ifdef HAVE_DB_H
+	if (!strcasecmp (options_get_symb ("TagsCacheBackend"), "File")) {
+#endif
+		if (!open_store (c, cache_dir))
+			goto err;
+
+		start_flusher (c);
+		start_analyzer (c);
+		resume_scan (c, cache_dir);
+		return;
+#ifdef HAVE_DB_H
+	}
+
 	ret = db_env_create (&c->db_env, 0);
 	if (ret) {
 		error_errno ("Can't create DB environment", ret);
@@ -1222,9 +2982,50 @@ void tags_cache_load (struct tags_cache *c DB_ONLY,
 		goto err;
 	}
 
+	ret = db_create (&c->atime_db, c->db_env, 0);
+	if (ret) {
+		error_errno ("Failed to create cache access time index", ret);
+		goto err;
+	}
+
+	ret = c->atime_db->set_flags (c->atime_db, DB_DUP | DB_DUPSORT);
+	if (ret) {
+		error_errno ("Failed to set cache access time index flags", ret);
+		goto err;
+	}
+
+	ret = c->atime_db->open (c->atime_db, NULL, ATIME_DB, NULL, DB_BTREE,
+	                         DB_CREATE | DB_THREAD, 0);
+	if (ret) {
+		error_errno ("Failed to open (or create) cache access time index",
+		             ret);
+		goto err;
+	}
+
+	/* This builds the index if it's empty (e.g. for an older cache). */
+	ret = c->db->associate (c->db, NULL, c->atime_db, atime_index_key,
+	                        DB_CREATE);
+	if (ret) {
+		error_errno ("Failed to associate cache access time index", ret);
+		goto err;
+	}
+
+	if (!count_records (c))
+		goto err;
+
+	start_flusher (c);
+	start_analyzer (c);
+	resume_scan (c, cache_dir);
+
 	return;
+#endif
 
 err:
+#ifdef HAVE_DB_H
+	if (c->atime_db) {
+		c->atime_db->close (c->atime_db, 0);
+		c->atime_db = NULL;
+	}
 	if (c->db) {
 #ifndef NDEBUG
 		c->db->set_errcall (c->db, NULL);
@@ -1243,9 +3044,9 @@ err:
 		c->db_env->close (c->db_env, 0);
 		c->db_env = NULL;
 	}
+#endif
 	c->max_items = 0;
 	error ("Failed to initialise tags cache: caching disabled");
-#endif
 }
 
 /* Immediately read tags for a file bypassing the request queue. */
@@ -1266,3 +3067,138 @@ struct file_tags *tags_cache_get_immediate (struct tags_cache *c,
 
 	return tags;
 }
+
+/* Return the decoder's seek table stored along with the file's tags
+ * (malloc()ed) or NULL if there is none or it is outdated.  There is
+ * no cache outside the server, so NULL is returned there too. */
+void *tags_cache_get_seek_table (const char *file, size_t *len)
+{
+	struct tags_cache *c = tags_cache;
+	struct record_lock lock;
+	void *table;
+
+	assert (file != NULL);
+	assert (len != NULL);
+
+	if (!c || !c->max_items || is_url (file))
+		return NULL;
+
+	lock_record (c, file, &lock);
+	table = get_stored (c, file, get_mtime (file), len, NULL);
+	unlock_record (c, &lock);
+
+	return table;
+}
+
+/* Store the decoder's seek table along with the file's tags. */
+void tags_cache_put_seek_table (const char *file, const void *table,
+                                size_t len)
+{
+	struct tags_cache *c = tags_cache;
+	struct file_tags *tags = NULL;
+	struct record_lock lock;
+	char *serialized_cache_rec;
+	size_t serial_len;
+
+	assert (file != NULL);
+	assert (table != NULL);
+
+	if (!c || !c->max_items || is_url (file))
+		return;
+
+	debug ("Storing %zu bytes seek table for %s", len, file);
+
+	lock_record (c, file, &lock);
+
+	/* Keep the tags we already have for the file. */
+	serialized_cache_rec = get_record (c, file, &serial_len);
+	if (serialized_cache_rec) {
+		struct cache_record rec;
+
+		if (cache_record_deserialize (&rec, serialized_cache_rec,
+		                              serial_len, 0)) {
+			free (rec.seek_table);
+			if (rec.mod_time == get_mtime (file))
+				tags = rec.tags;
+			else
+				tags_free (rec.tags);
+		}
+
+		free (serialized_cache_rec);
+	}
+
+	if (!tags)
+		tags = tags_new ();
+
+	tags_cache_add (c, file, tags, table, len, NULL);
+
+	unlock_record (c, &lock);
+
+	tags_free (tags);
+}
+
+/* Get the loudness measured for the file.  Return false if it was not
+ * measured yet; the file is queued for the analyzer then. */
+bool tags_cache_get_loudness (const char *file, struct loudness *loudness)
+{
+	struct tags_cache *c = tags_cache;
+
+	assert (file != NULL);
+	assert (loudness != NULL);
+
+	if (!c || !c->max_items || is_url (file))
+		return false;
+
+	if (get_loudness (c, file, loudness))
+		return true;
+
+	analyze_request (c, file);
+
+	return false;
+}
+
+/* Get the loudness of the album of the file: of the sound files in its
+ * directory.  Only the value already computed by the analyzer is used;
+ * return false if there is none for the directory as it is now, the
+ * album is queued for the analyzer then. */
+bool tags_cache_get_album_loudness (const char *file,
+                                    struct loudness *loudness)
+{
+	struct tags_cache *c = tags_cache;
+	struct rb_node *x;
+	bool found = false;
+	time_t mtime;
+	char *dir;
+
+	assert (file != NULL);
+	assert (loudness != NULL);
+
+	if (!c || !c->max_items || !c->analyzer_running || is_url (file))
+		return false;
+
+	dir = file_dir (file);
+	if (!dir)
+		return false;
+	mtime = get_mtime (*dir ? dir : "/");
+
+	LOCK (c->analyze_mtx);
+	x = rb_search (c->albums, dir);
+	if (!rb_is_null (x)) {
+		const struct album_loudness *a;
+
+		a = (const struct album_loudness *)rb_get_data (x);
+		if (a->mtime == mtime) {
+			*loudness = a->loudness;
+			found = true;
+		}
+	}
+	if (!found && !lists_strs_exists (c->analyze_albums, dir)) {
+		lists_strs_append (c->analyze_albums, dir);
+		pthread_cond_signal (&c->analyze_cond);
+	}
+	UNLOCK (c->analyze_mtx);
+
+	free (dir);
+
+	return found;
+}
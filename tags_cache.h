@@ -1,28 +1,47 @@
 #ifndef TAGS_CACHE_H
 #define TAGS_CACHE_H
 
+#include "lists.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct file_tags;
 struct tags_cache;
+struct loudness;
 
 /* Administrative functions: */
-struct tags_cache *tags_cache_new (size_t max_size);
+struct tags_cache *tags_cache_new (size_t max_size, int mem_size,
+                                   int readers);
 void tags_cache_free (struct tags_cache *c);
 
 /* Request queue manipulation functions: */
 void tags_cache_clear_queue (struct tags_cache *c, int client_id);
 void tags_cache_clear_up_to (struct tags_cache *c, const char *file,
                                                       int client_id);
+void tags_cache_boost_requests (struct tags_cache *c, lists_t_strs *files,
+                                int client_id);
 
 /* Cache DB manipulation functions: */
 void tags_cache_load (struct tags_cache *c, const char *cache_dir);
+void tags_cache_add_requests (struct tags_cache *c, lists_t_strs *files,
+                              int tags_sel, int client_id);
 void tags_cache_add_request (struct tags_cache *c, const char *file,
                                         int tags_sel, int client_id);
 struct file_tags *tags_cache_get_immediate (struct tags_cache *c,
                                   const char *file, int tags_sel);
+const char *tags_cache_scan (struct tags_cache *c, const char *dir);
+
+/* Decoders' seek tables kept in the server's cache: */
+void *tags_cache_get_seek_table (const char *file, size_t *len);
+void tags_cache_put_seek_table (const char *file, const void *table,
+                                size_t len);
+
+/* Loudness of the files measured in the background: */
+bool tags_cache_get_loudness (const char *file, struct loudness *loudness);
+bool tags_cache_get_album_loudness (const char *file,
+                                    struct loudness *loudness);
 
 #ifdef __cplusplus
 }
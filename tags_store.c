@@ -0,0 +1,675 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* A simple store for the tags cache used instead of Berkeley DB: records
+ * (opaque blobs under a file name key) are appended to a file which is
+ * memory-mapped for reading and indexed by a hash table built when the
+ * file is opened.  A record replaced by a newer one stays in the file
+ * until the store is compacted, which rewrites the live records and drops
+ * the least recently used ones over the limit.  There is no environment
+ * to recover: a record torn by a crash is cut off when opening. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define DEBUG
+
+#include "common.h"
+#include "log.h"
+#include "tags_store.h"
+
+#define STORE_MAGIC	"MOCTAGS"
+#define STORE_VERSION	2
+
+/* The file is mapped with this much room to grow at least. */
+#define STORE_MAP_MIN	(1024 * 1024)
+
+/* Don't bother compacting a store with less garbage. */
+#define STORE_GARBAGE_MIN	(256 * 1024)
+
+struct store_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t unused;
+};
+
+/* Each record is this header followed by the key and the data, padded
+ * to a multiple of 8 bytes. */
+struct store_entry
+{
+	uint32_t key_len;
+	uint32_t data_len;
+	int64_t atime;
+	uint32_t sum;		/* FNV-1a of the header (with sum 0), the
+				   key and the data */
+	uint32_t unused;
+};
+
+struct store_slot
+{
+	uint64_t offset;	/* of the entry, 0 if the slot is empty */
+	uint32_t hash;		/* of the key */
+};
+
+struct tags_store
+{
+	char *path;
+	int fd;
+
+	const char *map;
+	size_t map_size;
+	size_t file_size;	/* end of the last entry */
+
+	struct store_slot *index;
+	size_t index_size;	/* power of two */
+	int count;		/* records in the index */
+	size_t dead_bytes;	/* taken by replaced records */
+
+	/* The mapping, the index and the counters can be read under the
+	 * read lock; the appenders take it exclusively only to publish a
+	 * record.  write_mtx serialises the appenders and compaction. */
+	pthread_rwlock_t lock;
+	pthread_mutex_t write_mtx;
+};
+
+static uint32_t fnv1a (uint32_t h, const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)buf[i];
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+#define FNV_INIT 2166136261U
+
+/* Return the checksum of the entry whose header is e and whose key and
+ * data are at key. */
+static uint32_t entry_sum (const struct store_entry *e, const char *key)
+{
+	struct store_entry h = *e;
+
+	h.sum = 0;
+
+	return fnv1a (fnv1a (FNV_INIT, (const char *)&h, sizeof (h)), key,
+	              e->key_len + e->data_len);
+}
+
+static size_t entry_size (size_t key_len, size_t data_len)
+{
+	return (sizeof (struct store_entry) + key_len + data_len + 7) & ~7;
+}
+
+static const char *entry_key (const char *map, uint64_t offset)
+{
+	return map + offset + sizeof (struct store_entry);
+}
+
+static void entry_header (const char *map, uint64_t offset,
+                          struct store_entry *e)
+{
+	memcpy (e, map + offset, sizeof (*e));
+}
+
+/* Return the slot for the key: the one holding it or the empty one where
+ * it would go. */
+static struct store_slot *index_find (struct store_slot *index,
+                                      size_t index_size, const char *map,
+                                      const char *key, size_t key_len,
+                                      uint32_t hash)
+{
+	size_t i = hash & (index_size - 1);
+
+	while (index[i].offset) {
+		if (index[i].hash == hash) {
+			struct store_entry e;
+
+			entry_header (map, index[i].offset, &e);
+			if (e.key_len == key_len
+			    && !memcmp (entry_key (map, index[i].offset), key,
+			                key_len))
+				return &index[i];
+		}
+		i = (i + 1) & (index_size - 1);
+	}
+
+	return &index[i];
+}
+
+/* Keep the index at most half full. */
+static void index_grow (struct tags_store *s)
+{
+	struct store_slot *index;
+	size_t size, i;
+
+	if ((size_t)(s->count + 1) * 2 <= s->index_size)
+		return;
+
+	size = s->index_size ? s->index_size * 2 : 1024;
+	index = (struct store_slot *)xcalloc (size, sizeof (struct store_slot));
+
+	for (i = 0; i < s->index_size; i++) {
+		size_t j;
+
+		if (!s->index[i].offset)
+			continue;
+
+		j = s->index[i].hash & (size - 1);
+		while (index[j].offset)
+			j = (j + 1) & (size - 1);
+		index[j] = s->index[i];
+	}
+
+	free (s->index);
+	s->index = index;
+	s->index_size = size;
+}
+
+/* Add the entry at this offset to the index, replacing the older one for
+ * the same key. */
+static void index_add (struct tags_store *s, uint64_t offset)
+{
+	struct store_entry e;
+	struct store_slot *slot;
+	uint32_t hash;
+
+	entry_header (s->map, offset, &e);
+	hash = fnv1a (FNV_INIT, entry_key (s->map, offset), e.key_len);
+
+	index_grow (s);
+	slot = index_find (s->index, s->index_size, s->map,
+	                   entry_key (s->map, offset), e.key_len, hash);
+
+	if (slot->offset) {
+		struct store_entry old;
+
+		entry_header (s->map, slot->offset, &old);
+		s->dead_bytes += entry_size (old.key_len, old.data_len);
+	}
+	else
+		s->count += 1;
+
+	slot->offset = offset;
+	slot->hash = hash;
+}
+
+/* Map the file with room to grow to at least size bytes. */
+static bool store_map (struct tags_store *s, size_t size)
+{
+	size_t page = sysconf (_SC_PAGESIZE);
+	size_t map_size = MAX(size * 2, (size_t)STORE_MAP_MIN);
+	void *map;
+
+	map_size = (map_size + page - 1) / page * page;
+
+	map = mmap (NULL, map_size, PROT_READ, MAP_SHARED, s->fd, 0);
+	if (map == MAP_FAILED) {
+		log_errno ("Can't map the tags store", errno);
+		return false;
+	}
+
+	if (s->map)
+		munmap ((void *)s->map, s->map_size);
+	s->map = (const char *)map;
+	s->map_size = map_size;
+
+	return true;
+}
+
+static bool write_all (int fd, const char *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t res = pwrite (fd, buf, len, offset);
+
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		buf += res;
+		len -= res;
+		offset += res;
+	}
+
+	return true;
+}
+
+static bool write_header (int fd)
+{
+	struct store_header h;
+
+	memset (&h, 0, sizeof (h));
+	strcpy (h.magic, STORE_MAGIC);
+	h.version = STORE_VERSION;
+
+	return ftruncate (fd, 0) == 0
+	       && write_all (fd, (const char *)&h, sizeof (h), 0);
+}
+
+/* Sync the directory of the file, so that a rename() into it is on disk. */
+static bool sync_dir (const char *path)
+{
+	char *dir, *slash;
+	int fd, err;
+	bool ok;
+
+	dir = xstrdup (path);
+	slash = strrchr (dir, '/');
+	if (!slash)
+		strcpy (dir, ".");
+	else if (slash == dir)
+		slash[1] = 0;
+	else
+		*slash = 0;
+
+	fd = open (dir, O_RDONLY);
+	free (dir);
+	if (fd == -1)
+		return false;
+
+	ok = fsync (fd) == 0;
+	err = errno;
+	close (fd);
+	errno = err;
+
+	return ok;
+}
+
+/* Build the index from the entries in the file.  Cut off the file at the
+ * first damaged entry. */
+static void store_scan (struct tags_store *s)
+{
+	uint64_t offset = sizeof (struct store_header);
+
+	while (offset + sizeof (struct store_entry) <= s->file_size) {
+		struct store_entry e;
+		size_t size;
+		uint32_t sum;
+
+		entry_header (s->map, offset, &e);
+		if (e.key_len == 0 || (uint64_t)e.key_len + e.data_len
+		                      > s->file_size - offset)
+			break;
+
+		size = entry_size (e.key_len, e.data_len);
+		if (size > s->file_size - offset)
+			break;
+
+		sum = entry_sum (&e, entry_key (s->map, offset));
+		if (sum != e.sum)
+			break;
+
+		index_add (s, offset);
+		offset += size;
+	}
+
+	if (offset != s->file_size) {
+		logit ("Cutting off damaged end of the tags store at %"PRIu64,
+		       offset);
+		if (ftruncate (s->fd, offset))
+			log_errno ("Can't truncate the tags store", errno);
+		s->file_size = offset;
+	}
+}
+
+/* Open the store, creating it if it doesn't exist.  Return NULL on
+ * error. */
+struct tags_store *tags_store_open (const char *path)
+{
+	struct tags_store *s;
+	struct store_header h;
+	struct stat st;
+
+	assert (path != NULL);
+
+	s = (struct tags_store *)xcalloc (1, sizeof (struct tags_store));
+	s->path = xstrdup (path);
+
+	s->fd = open (path, O_RDWR | O_CREAT, 0600);
+	if (s->fd == -1) {
+		error_errno ("Can't open the tags store", errno);
+		goto err;
+	}
+
+	if (fstat (s->fd, &st)) {
+		error_errno ("Can't stat the tags store", errno);
+		goto err;
+	}
+
+	if (st.st_size < (off_t)sizeof (h)
+	    || pread (s->fd, &h, sizeof (h), 0) != sizeof (h)
+	    || memcmp (h.magic, STORE_MAGIC, sizeof (STORE_MAGIC))
+	    || h.version != STORE_VERSION) {
+		if (st.st_size)
+			logit ("Tags store %s has a wrong format, clearing it", path);
+		if (!write_header (s->fd)) {
+			error_errno ("Can't write the tags store", errno);
+			goto err;
+		}
+		st.st_size = sizeof (h);
+	}
+
+	s->file_size = st.st_size;
+	if (!store_map (s, s->file_size))
+		goto err;
+
+	store_scan (s);
+
+	pthread_rwlock_init (&s->lock, NULL);
+	pthread_mutex_init (&s->write_mtx, NULL);
+
+	debug ("Opened tags store with %d records (%zu bytes of garbage)",
+	       s->count, s->dead_bytes);
+
+	return s;
+
+err:
+	if (s->fd != -1)
+		close (s->fd);
+	free (s->path);
+	free (s);
+
+	return NULL;
+}
+
+void tags_store_close (struct tags_store *s)
+{
+	assert (s != NULL);
+
+	munmap ((void *)s->map, s->map_size);
+	if (close (s->fd))
+		log_errno ("Error closing the tags store", errno);
+
+	pthread_rwlock_destroy (&s->lock);
+	pthread_mutex_destroy (&s->write_mtx);
+
+	free (s->index);
+	free (s->path);
+	free (s);
+}
+
+/* Return a copy of the data stored under the key (malloc()ed) or NULL if
+ * there is none. */
+char *tags_store_get (struct tags_store *s, const char *key, size_t *len)
+{
+	struct store_slot *slot;
+	size_t key_len = strlen (key);
+	char *data = NULL;
+
+	assert (s != NULL);
+	assert (len != NULL);
+
+	pthread_rwlock_rdlock (&s->lock);
+
+	/* An empty store has no index until the first put. */
+	slot = s->index_size ? index_find (s->index, s->index_size, s->map,
+	                                   key, key_len,
+	                                   fnv1a (FNV_INIT, key, key_len))
+	                     : NULL;
+	if (slot && slot->offset) {
+		struct store_entry e;
+
+		entry_header (s->map, slot->offset, &e);
+		data = (char *)xmalloc (MAX(e.data_len, 1));
+		memcpy (data, entry_key (s->map, slot->offset) + e.key_len,
+		        e.data_len);
+		*len = e.data_len;
+	}
+
+	pthread_rwlock_unlock (&s->lock);
+
+	return data;
+}
+
+/* Store the data under the key, replacing what was there. */
+bool tags_store_put (struct tags_store *s, const char *key,
+                     const char *data, size_t len, time_t atime)
+{
+	struct store_entry *e;
+	size_t key_len = strlen (key);
+	size_t size = entry_size (key_len, len);
+	uint64_t offset;
+	bool ok = true;
+
+	assert (s != NULL);
+	assert (key_len > 0);
+	assert (data != NULL || len == 0);
+
+	e = (struct store_entry *)xcalloc (1, size);
+	e->key_len = key_len;
+	e->data_len = len;
+	e->atime = atime;
+	memcpy ((char *)(e + 1), key, key_len);
+	if (len)
+		memcpy ((char *)(e + 1) + key_len, data, len);
+	e->sum = entry_sum (e, (char *)(e + 1));
+
+	LOCK (s->write_mtx);
+
+	offset = s->file_size;
+	if (!write_all (s->fd, (const char *)e, size, offset)) {
+		error_errno ("Can't write to the tags store", errno);
+		ok = false;
+	}
+	else {
+		pthread_rwlock_wrlock (&s->lock);
+		if (offset + size > s->map_size)
+			ok = store_map (s, offset + size);
+		if (ok) {
+			s->file_size = offset + size;
+			index_add (s, offset);
+		}
+		pthread_rwlock_unlock (&s->lock);
+	}
+
+	UNLOCK (s->write_mtx);
+
+	free (e);
+
+	return ok;
+}
+
+int tags_store_count (struct tags_store *s)
+{
+	int count;
+
+	assert (s != NULL);
+
+	pthread_rwlock_rdlock (&s->lock);
+	count = s->count;
+	pthread_rwlock_unlock (&s->lock);
+
+	return count;
+}
+
+/* Write what was put to disk. */
+bool tags_store_sync (struct tags_store *s)
+{
+	assert (s != NULL);
+
+	if (fdatasync (s->fd)) {
+		log_errno ("Can't sync the tags store", errno);
+		return false;
+	}
+
+	return true;
+}
+
+/* A record considered by tags_store_compact(). */
+struct live_entry
+{
+	uint64_t offset;
+	int64_t atime;
+};
+
+static int live_entry_cmp (const void *a, const void *b)
+{
+	const struct live_entry *x = (const struct live_entry *)a;
+	const struct live_entry *y = (const struct live_entry *)b;
+
+	if (x->atime != y->atime)
+		return x->atime < y->atime ? -1 : 1;
+
+	/* Keep the records in the order of the file. */
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* Rewrite the store without the replaced records and the least recently
+ * used ones over max_records if there is enough to gain.  Readers are
+ * stopped only to switch to the new file. */
+bool tags_store_compact (struct tags_store *s, int max_records)
+{
+	struct live_entry *live;
+	struct tags_store n, old;
+	char *tmp_path;
+	int nlive = 0, skip = 0, i;
+	size_t j;
+	uint64_t offset;
+	bool ok = false;
+
+	assert (s != NULL);
+
+	LOCK (s->write_mtx);
+
+	/* Only the appenders, excluded by write_mtx, change the index. */
+	if (s->count <= max_records + max_records / 8
+	    && (s->dead_bytes < STORE_GARBAGE_MIN
+	        || s->dead_bytes < s->file_size / 2)) {
+		UNLOCK (s->write_mtx);
+		return true;
+	}
+
+	live = (struct live_entry *)xmalloc (MAX(s->count, 1)
+	                                     * sizeof (struct live_entry));
+	for (j = 0; j < s->index_size; j++) {
+		struct store_entry e;
+
+		if (!s->index[j].offset)
+			continue;
+
+		entry_header (s->map, s->index[j].offset, &e);
+		live[nlive].offset = s->index[j].offset;
+		live[nlive].atime = e.atime;
+		nlive++;
+	}
+
+	qsort (live, nlive, sizeof (struct live_entry), live_entry_cmp);
+	if (nlive > max_records)
+		skip = nlive - max_records;
+
+	memset (&n, 0, sizeof (n));
+	n.fd = -1;
+	tmp_path = format_msg ("%s.tmp", s->path);
+
+	n.fd = open (tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (n.fd == -1) {
+		error_errno ("Can't create new tags store", errno);
+		goto end;
+	}
+
+	if (!write_header (n.fd)) {
+		error_errno ("Can't write new tags store", errno);
+		goto end;
+	}
+
+	offset = sizeof (struct store_header);
+	for (i = skip; i < nlive; i++) {
+		struct store_entry e;
+		size_t size;
+
+		entry_header (s->map, live[i].offset, &e);
+		size = entry_size (e.key_len, e.data_len);
+		if (!write_all (n.fd, s->map + live[i].offset, size, offset)) {
+			error_errno ("Can't write new tags store", errno);
+			goto end;
+		}
+		offset += size;
+	}
+
+	n.file_size = offset;
+	if (fdatasync (n.fd) || !store_map (&n, n.file_size)) {
+		error_errno ("Can't write new tags store", errno);
+		goto end;
+	}
+
+	offset = sizeof (struct store_header);
+	while (offset < n.file_size) {
+		struct store_entry e;
+
+		entry_header (n.map, offset, &e);
+		index_add (&n, offset);
+		offset += entry_size (e.key_len, e.data_len);
+	}
+
+	if (rename (tmp_path, s->path)) {
+		error_errno ("Can't replace the tags store", errno);
+		goto end;
+	}
+	if (!sync_dir (s->path))
+		log_errno ("Can't sync the tags store directory", errno);
+
+	debug ("Compacted tags store: %d records (%d dropped), %zu -> %zu "
+	       "bytes", n.count, skip, s->file_size, n.file_size);
+
+	/* Switch to the new store and leave the old one in n to be freed. */
+	pthread_rwlock_wrlock (&s->lock);
+	old = *s;
+	s->fd = n.fd;
+	s->map = n.map;
+	s->map_size = n.map_size;
+	s->index = n.index;
+	s->index_size = n.index_size;
+	s->file_size = n.file_size;
+	s->count = n.count;
+	s->dead_bytes = 0;
+	pthread_rwlock_unlock (&s->lock);
+	n.fd = old.fd;
+	n.map = old.map;
+	n.map_size = old.map_size;
+	n.index = old.index;
+
+	ok = true;
+
+end:
+	if (n.map)
+		munmap ((void *)n.map, n.map_size);
+	if (n.fd != -1)
+		close (n.fd);
+	if (!ok)
+		unlink (tmp_path);
+	free (n.index);
+	free (tmp_path);
+	free (live);
+
+	UNLOCK (s->write_mtx);
+
+	return ok;
+}
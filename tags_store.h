@@ -0,0 +1,25 @@
+#ifndef TAGS_STORE_H
+#define TAGS_STORE_H
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tags_store;
+
+struct tags_store *tags_store_open (const char *path);
+void tags_store_close (struct tags_store *s);
+char *tags_store_get (struct tags_store *s, const char *key, size_t *len);
+bool tags_store_put (struct tags_store *s, const char *key,
+                     const char *data, size_t len, time_t atime);
+int tags_store_count (struct tags_store *s);
+bool tags_store_sync (struct tags_store *s);
+bool tags_store_compact (struct tags_store *s, int max_records);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
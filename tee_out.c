@@ -0,0 +1,399 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* Extra outputs: programs given by the ExtraOutputs option which get the
+ * sound played on their standard input, as raw samples exactly as they go
+ * to the sound device (after the DSP and the conversion).  Each program is
+ * started with the rate, the number of channels and the sample format as
+ * its arguments and started again when they change.
+ *
+ * The sound is copied once into a reference counted chunk shared by all
+ * the outputs.  Each output has a thread writing the chunks queued for it
+ * and a limit of how much may be queued; the sound which doesn't fit is
+ * dropped for that output, so a slow one never holds up the sound device
+ * or the other outputs. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
+
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "lists.h"
+#include "audio.h"
+#include "tee_out.h"
+
+extern char **environ;
+
+struct tee_chunk
+{
+	int refs;			/* outputs which haven't written it */
+	struct sound_params params;	/* format of the sound */
+	size_t len;
+	char data[];
+};
+
+/* Entry of an output's queue. */
+struct tee_ref
+{
+	struct tee_chunk *chunk;
+	struct tee_ref *next;
+};
+
+struct tee_sink
+{
+	char *path;			/* the program */
+	struct tee_ref *head, *tail;	/* chunks to write */
+	size_t queued;			/* bytes in the chunks */
+	bool dropping;			/* the last chunk was dropped */
+	pthread_cond_t cond;		/* a chunk was queued */
+	pthread_t thread;
+};
+
+static struct tee_sink *sinks = NULL;
+static int sinks_num = 0;
+
+/* Maximum number of bytes queued for an output. */
+static size_t max_queued;
+
+static bool exiting = false;
+
+/* Protects the queues and the reference counts. */
+static pthread_mutex_t tee_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void chunk_unref (struct tee_chunk *chunk)
+{
+	if (--chunk->refs == 0)
+		free (chunk);
+}
+
+/* Put the name of the sample format, as aplay takes it, in buf. */
+static void format_name (const long fmt, char *buf, const size_t size)
+{
+	static const struct
+	{
+		long fmt;
+		const char *name;
+	} names[] = {
+		{ SFMT_S8, "S8" },
+		{ SFMT_U8, "U8" },
+		{ SFMT_S16, "S16" },
+		{ SFMT_U16, "U16" },
+		{ SFMT_S24, "S24" },
+		{ SFMT_U24, "U24" },
+		{ SFMT_S24_3, "S24_3" },
+		{ SFMT_U24_3, "U24_3" },
+		{ SFMT_S32, "S32" },
+		{ SFMT_U32, "U32" },
+		{ SFMT_FLOAT, "FLOAT" }
+	};
+	size_t ix;
+
+	for (ix = 0; ix < ARRAY_SIZE(names); ix++) {
+		if (fmt & names[ix].fmt)
+			break;
+	}
+	if (ix == ARRAY_SIZE(names))
+		snprintf (buf, size, "unknown");
+	else if (fmt & (SFMT_S8 | SFMT_U8))
+		snprintf (buf, size, "%s", names[ix].name);
+	else
+		snprintf (buf, size, "%s_%s", names[ix].name,
+		          (fmt & SFMT_BE) ? "BE" : "LE");
+}
+
+/* Start the output's program for the sound format.  Return the write end
+ * of the pipe to its standard input or -1 on error. */
+static int sink_start (const struct tee_sink *sink,
+		const struct sound_params *params)
+{
+	char rate[16], channels[16], format[16];
+	char *args[5];
+	int fds[2];
+	pid_t pid;
+#ifdef HAVE_POSIX_SPAWN
+	posix_spawn_file_actions_t actions;
+	int rc;
+#endif
+
+	if (pipe (fds) == -1) {
+		log_errno ("Can't create the pipe to an extra output", errno);
+		return -1;
+	}
+
+	/* Other programs started later must not keep the pipe open, and a
+	 * program which stopped reading must not keep the server from
+	 * exiting. */
+	if (fcntl (fds[1], F_SETFD, FD_CLOEXEC) == -1
+			|| fcntl (fds[1], F_SETFL, O_NONBLOCK) == -1)
+		log_errno ("Can't set the pipe to an extra output", errno);
+
+	snprintf (rate, sizeof(rate), "%d", params->rate);
+	snprintf (channels, sizeof(channels), "%d", params->channels);
+	format_name (params->fmt, format, sizeof(format));
+
+	args[0] = sink->path;
+	args[1] = rate;
+	args[2] = channels;
+	args[3] = format;
+	args[4] = NULL;
+
+#ifdef HAVE_POSIX_SPAWN
+	posix_spawn_file_actions_init (&actions);
+	posix_spawn_file_actions_adddup2 (&actions, fds[0], STDIN_FILENO);
+	posix_spawn_file_actions_addclose (&actions, fds[0]);
+
+	rc = posix_spawn (&pid, args[0], &actions, NULL, args, environ);
+
+	posix_spawn_file_actions_destroy (&actions);
+
+	if (rc != 0) {
+		char *err = xstrerror (rc);
+
+		logit ("Error when running the extra output '%s': %s",
+		       args[0], err);
+		free (err);
+		pid = -1;
+	}
+#else
+	pid = fork ();
+	if (pid == 0) {
+		dup2 (fds[0], STDIN_FILENO);
+		close (fds[0]);
+		execve (args[0], args, environ);
+		fatal ("Error when running the extra output '%s': %s",
+		       args[0], xstrerror (errno));
+	}
+	if (pid == -1)
+		log_errno ("Failed to fork()", errno);
+#endif
+
+	close (fds[0]);
+
+	if (pid == -1) {
+		close (fds[1]);
+		return -1;
+	}
+
+	logit ("Started the extra output '%s' for %s, %s channels, %sHz",
+	       sink->path, format, channels, rate);
+
+	return fds[1];
+}
+
+/* Write all of the buffer, return false on error or when exiting. */
+static bool write_all (int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t res = write (fd, buf, len);
+
+		if (res == -1 && errno == EAGAIN) {
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+
+			if (ATOMIC_LOAD (&exiting)) {
+				errno = ECANCELED;
+				return false;
+			}
+			poll (&pfd, 1, 100);
+			continue;
+		}
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		buf += res;
+		len -= res;
+	}
+
+	return true;
+}
+
+static void *sink_thread (void *arg)
+{
+	struct tee_sink *sink = (struct tee_sink *)arg;
+	struct sound_params params = { 0, 0, 0 };
+	int fd = -1;
+
+	LOCK (tee_mtx);
+	while (!exiting) {
+		struct tee_ref *ref;
+		struct tee_chunk *chunk;
+
+		if (!sink->head) {
+			pthread_cond_wait (&sink->cond, &tee_mtx);
+			continue;
+		}
+
+		ref = sink->head;
+		sink->head = ref->next;
+		if (!sink->head)
+			sink->tail = NULL;
+		chunk = ref->chunk;
+		free (ref);
+		UNLOCK (tee_mtx);
+
+		/* A program is started for each format; if it can't be
+		 * started or exits, the sound is dropped until the format
+		 * changes. */
+		if (!sound_params_eq (params, chunk->params)) {
+			if (fd != -1)
+				close (fd);
+			params = chunk->params;
+			fd = sink_start (sink, &params);
+		}
+
+		if (fd != -1 && !write_all (fd, chunk->data, chunk->len)) {
+			if (errno != ECANCELED)
+				log_errno ("Can't write to the extra output", errno);
+			close (fd);
+			fd = -1;
+		}
+
+		LOCK (tee_mtx);
+		sink->queued -= chunk->len;
+		chunk_unref (chunk);
+	}
+	UNLOCK (tee_mtx);
+
+	if (fd != -1)
+		close (fd);
+
+	return NULL;
+}
+
+/* Start the threads of the outputs set in ExtraOutputs. */
+void tee_out_init ()
+{
+	lists_t_strs *paths = options_get_list ("ExtraOutputs");
+	int ix;
+
+	if (!lists_strs_size (paths))
+		return;
+
+	max_queued = options_get_int ("ExtraOutputBuffer") * 1024;
+
+	sinks = (struct tee_sink *)xcalloc (lists_strs_size (paths),
+	                                     sizeof(struct tee_sink));
+
+	for (ix = 0; ix < lists_strs_size (paths); ix++) {
+		struct tee_sink *sink = &sinks[sinks_num];
+		int rc;
+
+		sink->path = xstrdup (lists_strs_at (paths, ix));
+		pthread_cond_init (&sink->cond, NULL);
+
+		rc = pthread_create (&sink->thread, NULL, sink_thread, sink);
+		if (rc != 0) {
+			log_errno ("Can't create the extra output thread", rc);
+			pthread_cond_destroy (&sink->cond);
+			free (sink->path);
+			continue;
+		}
+
+		sinks_num++;
+	}
+}
+
+void tee_out_shutdown ()
+{
+	int ix;
+
+	LOCK (tee_mtx);
+	ATOMIC_STORE (&exiting, true);
+	for (ix = 0; ix < sinks_num; ix++)
+		pthread_cond_signal (&sinks[ix].cond);
+	UNLOCK (tee_mtx);
+
+	for (ix = 0; ix < sinks_num; ix++) {
+		struct tee_sink *sink = &sinks[ix];
+
+		pthread_join (sink->thread, NULL);
+
+		while (sink->head) {
+			struct tee_ref *ref = sink->head;
+
+			sink->head = ref->next;
+			chunk_unref (ref->chunk);
+			free (ref);
+		}
+
+		pthread_cond_destroy (&sink->cond);
+		free (sink->path);
+	}
+
+	free (sinks);
+	sinks = NULL;
+	sinks_num = 0;
+}
+
+/* Queue the sound going to the device, in the given format, for the extra
+ * outputs which have room for it. */
+void tee_out_play (const char *buf, const size_t size,
+		const struct sound_params *params)
+{
+	struct tee_chunk *chunk;
+	int ix;
+
+	if (!sinks_num || !size)
+		return;
+
+	chunk = (struct tee_chunk *)xmalloc (sizeof(struct tee_chunk) + size);
+	chunk->refs = 0;
+	chunk->params = *params;
+	chunk->len = size;
+	memcpy (chunk->data, buf, size);
+
+	LOCK (tee_mtx);
+	for (ix = 0; ix < sinks_num; ix++) {
+		struct tee_sink *sink = &sinks[ix];
+		struct tee_ref *ref;
+
+		if (sink->queued + size > max_queued) {
+			if (!sink->dropping)
+				logit ("Extra output '%s' doesn't keep up, "
+				       "dropping sound", sink->path);
+			sink->dropping = true;
+			continue;
+		}
+		sink->dropping = false;
+
+		ref = (struct tee_ref *)xmalloc (sizeof(struct tee_ref));
+		ref->chunk = chunk;
+		ref->next = NULL;
+		if (sink->tail)
+			sink->tail->next = ref;
+		else
+			sink->head = ref;
+		sink->tail = ref;
+		sink->queued += size;
+		chunk->refs++;
+
+		pthread_cond_signal (&sink->cond);
+	}
+
+	if (!chunk->refs)
+		free (chunk);
+	UNLOCK (tee_mtx);
+}
@@ -0,0 +1,19 @@
+#ifndef TEE_OUT_H
+#define TEE_OUT_H
+
+#include "audio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void tee_out_init ();
+void tee_out_shutdown ();
+void tee_out_play (const char *buf, const size_t size,
+		const struct sound_params *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * MOC - music on console
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+/* CPU affinity and scheduling policy of the server's threads.  Each thread
+ * calls thread_sched_apply() for its class when it starts; the entries for
+ * the class in ThreadCPUs and ThreadScheduling say what to do, and what
+ * was done is logged and kept for the statistics. */
+
+/* For CPU_SET() and the Linux-only policies. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1
+#endif
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "lists.h"
+#include "thread_sched.h"
+
+static const char *class_names[THREAD_CLASSES_NUM] = {
+	"output", "decoder", "precache", "tags", "io", "mpris"
+};
+
+/* What the last thread of each class got, empty if none has started. */
+static char results[THREAD_CLASSES_NUM][128];
+static pthread_mutex_t results_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return the arguments of the entry for the class in the list option
+ * (what follows the opening parenthesis) or NULL if there is none. */
+static const char *class_args (const char *option,
+		const enum thread_class cls)
+{
+	lists_t_strs *list = options_get_list (option);
+	size_t len = strlen (class_names[cls]);
+	int ix;
+
+	for (ix = 0; ix < lists_strs_size (list); ix++) {
+		const char *entry = lists_strs_at (list, ix);
+
+		if (!strncasecmp (entry, class_names[cls], len)
+				&& entry[len] == '(')
+			return entry + len + 1;
+	}
+
+	return NULL;
+}
+
+/* Bind the calling thread to the CPUs listed like "0-1,3)". */
+static void set_cpus (const char *args, char *desc, const size_t size)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	const char *p = args;
+	int rc;
+
+	CPU_ZERO (&set);
+	while (*p != ')') {
+		char *end;
+		long first, last;
+
+		first = last = strtol (p, &end, 10);
+		if (*end == '-')
+			last = strtol (end + 1, &end, 10);
+		if (end == p || (*end != ',' && *end != ')') || first < 0
+				|| last < first || last >= CPU_SETSIZE) {
+			snprintf (desc, size, "bad CPU list");
+			return;
+		}
+		for (; first <= last; first++)
+			CPU_SET (first, &set);
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	rc = pthread_setaffinity_np (pthread_self (), sizeof(set), &set);
+	if (rc != 0)
+		snprintf (desc, size, "CPUs %.*s failed: %s",
+		          (int)(p - args), args, xstrerror (rc));
+	else
+		snprintf (desc, size, "CPUs %.*s", (int)(p - args), args);
+#else
+	snprintf (desc, size, "CPU affinity not supported");
+#endif
+}
+
+/* Lower the niceness of the calling thread alone, which only Linux can. */
+static int set_nice (const int nice)
+{
+#ifdef __linux__
+	if (setpriority (PRIO_PROCESS, syscall (SYS_gettid), nice) == -1)
+		return errno;
+	return 0;
+#else
+	return nice ? ENOSYS : 0;
+#endif
+}
+
+/* Set the policy given like "fifo,50)": fifo and rr take the realtime
+ * priority (the highest if omitted), other and batch the nice level. */
+static void set_policy (const char *args, char *desc, const size_t size)
+{
+#ifdef HAVE_SCHED_GET_PRIORITY_MAX
+	static const struct
+	{
+		const char *name;
+		int policy;
+	} policies[] = {
+		{ "other", SCHED_OTHER },
+#ifdef SCHED_BATCH
+		{ "batch", SCHED_BATCH },
+#endif
+#ifdef SCHED_IDLE
+		{ "idle", SCHED_IDLE },
+#endif
+		{ "fifo", SCHED_FIFO },
+		{ "rr", SCHED_RR }
+	};
+	struct sched_param param;
+	const char *comma = strchr (args, ',');
+	size_t len = (comma ? comma : strchr (args, ')')) - args;
+	bool realtime;
+	long value = 0;
+	int ix, rc;
+
+	for (ix = 0; ix < (int)ARRAY_SIZE(policies); ix++) {
+		if (strlen (policies[ix].name) == len
+				&& !strncasecmp (args, policies[ix].name, len))
+			break;
+	}
+	if (ix == (int)ARRAY_SIZE(policies)) {
+		snprintf (desc, size, "unknown policy '%.*s'", (int)len, args);
+		return;
+	}
+
+	realtime = policies[ix].policy == SCHED_FIFO
+		|| policies[ix].policy == SCHED_RR;
+	if (comma) {
+		char *end;
+
+		value = strtol (comma + 1, &end, 10);
+		if (end == comma + 1 || *end != ')') {
+			snprintf (desc, size, "bad %s argument", policies[ix].name);
+			return;
+		}
+	}
+	else if (realtime)
+		value = sched_get_priority_max (policies[ix].policy);
+
+	if (realtime && (value < sched_get_priority_min (policies[ix].policy)
+			|| value > sched_get_priority_max (policies[ix].policy))) {
+		snprintf (desc, size, "%s priority %ld out of range",
+		          policies[ix].name, value);
+		return;
+	}
+
+	param.sched_priority = realtime ? value : 0;
+	rc = pthread_setschedparam (pthread_self (), policies[ix].policy,
+	                            &param);
+	if (rc == 0 && !realtime && value)
+		rc = set_nice (value);
+
+	if (rc != 0)
+		snprintf (desc, size, "%s %ld failed: %s", policies[ix].name,
+		          value, xstrerror (rc));
+	else if (realtime || value)
+		snprintf (desc, size, "%s %ld", policies[ix].name, value);
+	else
+		snprintf (desc, size, "%s", policies[ix].name);
+#else
+	snprintf (desc, size, "scheduling policies not supported");
+#endif
+}
+
+/* Let everything else go first: give the calling thread the lowest CPU
+ * priority and the idle I/O class, for work nobody is waiting for.  Only
+ * Linux has them per thread. */
+void thread_sched_lower ()
+{
+#ifdef __linux__
+	pid_t tid = syscall (SYS_gettid);
+
+	if (setpriority (PRIO_PROCESS, tid, 19) == -1)
+		log_errno ("Can't lower the thread's priority", errno);
+#ifdef SYS_ioprio_set
+	/* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE: their header is not always
+	 * installed. */
+	if (syscall (SYS_ioprio_set, 1, tid, 3 << 13) == -1)
+		log_errno ("Can't set the thread's I/O priority", errno);
+#endif
+#endif
+}
+
+/* Give the calling thread the CPUs and the scheduling configured for its
+ * class. */
+void thread_sched_apply (const enum thread_class cls)
+{
+	const char *cpus, *policy;
+	char cpus_desc[64] = "", policy_desc[64] = "";
+	char result[sizeof(results[0])];
+
+	assert (cls < THREAD_CLASSES_NUM);
+
+	cpus = class_args ("ThreadCPUs", cls);
+	policy = class_args ("ThreadScheduling", cls);
+
+	/* The old way to make the output thread realtime. */
+	if (!policy && cls == THREAD_OUTPUT
+			&& options_get_bool ("UseRealtimePriority"))
+		policy = "rr)";
+
+	if (cpus)
+		set_cpus (cpus, cpus_desc, sizeof(cpus_desc));
+	if (policy)
+		set_policy (policy, policy_desc, sizeof(policy_desc));
+
+	snprintf (result, sizeof(result), "%s%s%s",
+	          policy ? policy_desc : "default",
+	          cpus ? ", " : "", cpus_desc);
+	if (cpus || policy)
+		logit ("Scheduling of the %s thread: %s", class_names[cls],
+		       result);
+
+	LOCK (results_mtx);
+	strcpy (results[cls], result);
+	UNLOCK (results_mtx);
+}
+
+/* Return the "Threads:" line of the statistics, naming what each class of
+ * the started threads got. */
+char *thread_sched_report ()
+{
+	char line[THREAD_CLASSES_NUM * (sizeof(results[0]) + 16)];
+	size_t pos = 0;
+	int ix;
+
+	line[0] = 0;
+
+	LOCK (results_mtx);
+	for (ix = 0; ix < THREAD_CLASSES_NUM; ix++) {
+		if (results[ix][0])
+			pos += snprintf (line + pos, sizeof(line) - pos,
+			                 "%s%s %s", pos ? "; " : "",
+			                 class_names[ix], results[ix]);
+	}
+	UNLOCK (results_mtx);
+
+	return format_msg ("Threads: %s\n", pos ? line : "none started");
+}
@@ -0,0 +1,29 @@
+#ifndef THREAD_SCHED_H
+#define THREAD_SCHED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Kinds of the server's threads which can be given their own CPUs and
+ * scheduling (ThreadCPUs and ThreadScheduling options). */
+enum thread_class
+{
+	THREAD_OUTPUT,		/* output buffer */
+	THREAD_DECODER,		/* playing and decoder pipe threads */
+	THREAD_PRECACHE,	/* precaching the next file */
+	THREAD_TAGS,		/* tags cache readers */
+	THREAD_IO,		/* reading streams ahead */
+	THREAD_MPRIS,		/* D-Bus */
+	THREAD_CLASSES_NUM
+};
+
+void thread_sched_apply (const enum thread_class cls);
+void thread_sched_lower ();
+char *thread_sched_report ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -48,6 +48,7 @@
 #include "options.h"
 #include "utf8.h"
 #include "rcc.h"
+#include "conv_memo.h"
 
 static char *terminal_charset = NULL;
 static int using_utf8 = 0;
@@ -56,6 +57,12 @@ static iconv_t iconv_desc = (iconv_t)(-1);
 static iconv_t files_iconv_desc = (iconv_t)(-1);
 static iconv_t xterm_iconv_desc = (iconv_t)(-1);
 
+/* The file names and titles converted last: the same ones are converted
+ * each time a directory is shown. */
+#define ICONV_MEMO_SIZE	1024
+static struct conv_memo *files_memo = NULL;
+static struct conv_memo *xterm_memo = NULL;
+
 
 /* Return a malloc()ed string converted using iconv().
  * If for_file_name is not 0, use the conversion defined for file names.
@@ -117,14 +124,21 @@ char *iconv_str (const iconv_t desc, const char *str)
 	return converted;
 }
 
+static char *memo_iconv (const char *str, const void *desc)
+{
+	return iconv_str (*(const iconv_t *)desc, str);
+}
+
 char *files_iconv_str (const char *str)
 {
-    return iconv_str (files_iconv_desc, str);
+	return conv_memo_convert (files_memo, str, memo_iconv,
+	                          &files_iconv_desc);
 }
 
 char *xterm_iconv_str (const char *str)
 {
-    return iconv_str (xterm_iconv_desc, str);
+	return conv_memo_convert (xterm_memo, str, memo_iconv,
+	                          &xterm_iconv_desc);
 }
 
 int xwaddstr (WINDOW *win, const char *str)
@@ -203,9 +217,11 @@ static size_t xmbstowcs (wchar_t *dest, const char *src, size_t len,
 	return count;
 }
 
-int xwaddnstr (WINDOW *win, const char *str, const int n)
+/* Return a malloc()ed copy of the beginning of str up to n columns wide,
+ * converted to the terminal's character set as xwaddnstr() shows it. */
+char *xstrhead_display (const char *str, const int n)
 {
-	int res, width, inv_char;
+	int width, inv_char;
 	wchar_t *ucs;
 	char *mstr, *lstr;
 	size_t size, num_chars;
@@ -244,14 +260,35 @@ int xwaddnstr (WINDOW *win, const char *str, const int n)
 	else
 		snprintf (lstr, num_chars + 1, "%s", mstr);
 
-	res = waddstr (win, lstr);
-
 	free (ucs);
-	free (lstr);
 	free (mstr);
+	return lstr;
+}
+
+int xwaddnstr (WINDOW *win, const char *str, const int n)
+{
+	int res;
+	char *lstr;
+
+	lstr = xstrhead_display (str, n);
+	res = waddstr (win, lstr);
+	free (lstr);
+
 	return res;
 }
 
+/* Return a malloc()ed copy of str converted to the terminal's character
+ * set as xwaddstr() shows it. */
+char *xstr_display (const char *str)
+{
+	assert (str != NULL);
+
+	if (using_utf8)
+		return xstrdup (str);
+
+	return iconv_str (iconv_desc, str);
+}
+
 int xmvwaddstr (WINDOW *win, const int y, const int x, const char *str)
 {
 	int res;
@@ -348,9 +385,13 @@ void utf8_init ()
 
 	if (options_get_bool ("FileNamesIconv"))
 		files_iconv_desc = iconv_open ("UTF-8", "");
+	if (files_iconv_desc != (iconv_t)(-1))
+		files_memo = conv_memo_new (ICONV_MEMO_SIZE);
 
 	if (options_get_bool ("NonUTFXterm"))
 		xterm_iconv_desc = iconv_open ("", "UTF-8");
+	if (xterm_iconv_desc != (iconv_t)(-1))
+		xterm_memo = conv_memo_new (ICONV_MEMO_SIZE);
 }
 
 void utf8_cleanup ()
@@ -358,6 +399,10 @@ void utf8_cleanup ()
 	if (terminal_charset)
 		free (terminal_charset);
 	iconv_cleanup ();
+	conv_memo_free (files_memo);
+	files_memo = NULL;
+	conv_memo_free (xterm_memo);
+	xterm_memo = NULL;
 }
 
 /* Return the number of columns the string occupies when displayed. */